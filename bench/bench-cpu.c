@@ -0,0 +1,187 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Benchmarks code that doesn't need OpenGL: vecmat kernels
+ * and DGR serialization.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "kuhl-util.h"
+#include "vecmat.h"
+#include "dgr.h"
+#include "bench.h"
+
+#define MATRIX_COUNT 1024 /**< Number of matrices/vectors each vecmat kernel loops over */
+
+static float matA[MATRIX_COUNT][16], matB[MATRIX_COUNT][16], matC[MATRIX_COUNT][16];
+static float vecA[MATRIX_COUNT][4], vecB[MATRIX_COUNT][4], vecC[MATRIX_COUNT][4];
+
+/** Fills the input arrays with the same pseudo-random values every
+ * time the benchmark runs. */
+static void fill_inputs(void)
+{
+	srand48(1);
+	for(int i=0; i<MATRIX_COUNT; i++)
+	{
+		/* Random rotation + translation so that the matrices are invertible. */
+		float axis[3] = { drand48()+.1, drand48(), drand48() };
+		vec3f_normalize(axis);
+		mat4f_rotateAxisVec_new(matA[i], drand48()*360, axis);
+		matA[i][12] = drand48(); matA[i][13] = drand48(); matA[i][14] = drand48();
+		mat4f_rotateAxisVec_new(matB[i], drand48()*360, axis);
+		for(int j=0; j<4; j++)
+		{
+			vecA[i][j] = drand48()+.1;
+			vecB[i][j] = drand48()+.1;
+		}
+	}
+}
+
+static void bench_vecmat(void)
+{
+	fill_inputs();
+	long iterations = bench_iterations(2000);
+	double start;
+
+	start = bench_seconds();
+	for(long n=0; n<iterations; n++)
+		for(int i=0; i<MATRIX_COUNT; i++)
+			mat4f_mult_mat4f_new(matC[i], matA[i], matB[i]);
+	bench_report("vecmat/mat4f_mult_mat4f", iterations*MATRIX_COUNT,
+	             bench_seconds()-start, iterations*MATRIX_COUNT, "matrices");
+	bench_sink += matC[MATRIX_COUNT/2][5];
+
+	start = bench_seconds();
+	for(long n=0; n<iterations; n++)
+		for(int i=0; i<MATRIX_COUNT; i++)
+			mat4f_mult_vec4f_new(vecC[i], matA[i], vecA[i]);
+	bench_report("vecmat/mat4f_mult_vec4f", iterations*MATRIX_COUNT,
+	             bench_seconds()-start, iterations*MATRIX_COUNT, "vectors");
+	bench_sink += vecC[MATRIX_COUNT/2][1];
+
+	/* vecA holds MATRIX_COUNT*4/3 points with 3 components each */
+	start = bench_seconds();
+	for(long n=0; n<iterations; n++)
+		mat4f_mult_point3f_batch(vecC[0], matA[0], vecA[0], MATRIX_COUNT*4/3);
+	bench_report("vecmat/mat4f_mult_point3f_batch", iterations*(MATRIX_COUNT*4/3),
+	             bench_seconds()-start, iterations*(MATRIX_COUNT*4/3), "points");
+	bench_sink += vecC[MATRIX_COUNT/2][1];
+
+	start = bench_seconds();
+	for(long n=0; n<iterations/4; n++)
+		for(int i=0; i<MATRIX_COUNT; i++)
+			mat4f_invert_new(matC[i], matA[i]);
+	bench_report("vecmat/mat4f_invert", iterations/4*MATRIX_COUNT,
+	             bench_seconds()-start, iterations/4*MATRIX_COUNT, "matrices");
+	bench_sink += matC[MATRIX_COUNT/2][5];
+
+	start = bench_seconds();
+	for(long n=0; n<iterations; n++)
+		for(int i=0; i<MATRIX_COUNT; i++)
+			vec3f_cross_new(vecC[i], vecA[i], vecB[i]);
+	bench_report("vecmat/vec3f_cross", iterations*MATRIX_COUNT,
+	             bench_seconds()-start, iterations*MATRIX_COUNT, "vectors");
+	bench_sink += vecC[MATRIX_COUNT/2][1];
+
+	start = bench_seconds();
+	for(long n=0; n<iterations; n++)
+		for(int i=0; i<MATRIX_COUNT; i++)
+		{
+			vec3f_copy(vecC[i], vecA[i]);
+			vec3f_normalize(vecC[i]);
+		}
+	bench_report("vecmat/vec3f_normalize", iterations*MATRIX_COUNT,
+	             bench_seconds()-start, iterations*MATRIX_COUNT, "vectors");
+	bench_sink += vecC[MATRIX_COUNT/2][1];
+}
+
+/** Builds a serialized DGR packet containing recordCount records
+ * of recordSize bytes each.
+ *
+ * @param size Filled in with the size of the packet.
+ * @return The packet (to be free()'d by the caller).
+ */
+static char* make_dgr_packet(int recordCount, int recordSize, int *size)
+{
+	*size = 0;
+	char *packet = kuhl_malloc(recordCount*(32+sizeof(int)+recordSize));
+	char *ptr = packet;
+	for(int i=0; i<recordCount; i++)
+	{
+		ptr += sprintf(ptr, "bench-record-%d", i)+1;
+		memcpy(ptr, &recordSize, sizeof(int));
+		ptr += sizeof(int);
+		for(int j=0; j<recordSize; j++)
+			ptr[j] = (char) (i+j);
+		ptr += recordSize;
+	}
+	*size = ptr-packet;
+	return packet;
+}
+
+static void bench_dgr(void)
+{
+	/* Run DGR as a slave that listens on an arbitrary port. It never
+	 * receives anything---the benchmark feeds packets directly to
+	 * dgr_unserialize(). */
+	setenv("DGR_MODE", "slave", 1);
+	setenv("DGR_SLAVE_LISTEN_PORT", "0", 1);
+	dgr_init();
+	if(!dgr_is_enabled())
+	{
+		fprintf(stderr, "DGR could not be initialized, skipping DGR benchmarks.\n");
+		return;
+	}
+
+	int configs[][2] = { { 16, 16 },   // a typical frame: a few small variables
+	                     { 256, 64 } }; // many variables
+	for(unsigned int c=0; c<sizeof(configs)/sizeof(configs[0]); c++)
+	{
+		int recordCount = configs[c][0];
+		int recordSize = configs[c][1];
+		int packetSize = 0;
+		char *packet = make_dgr_packet(recordCount, recordSize, &packetSize);
+		dgr_unserialize(packetSize, packet); // add the records to DGR
+
+		long iterations = bench_iterations(200000 / recordCount);
+		char name[128];
+
+		double start = bench_seconds();
+		for(long n=0; n<iterations; n++)
+			dgr_unserialize(packetSize, packet);
+		snprintf(name, sizeof(name), "dgr/unserialize/%dx%d", recordCount, recordSize);
+		bench_report(name, iterations, bench_seconds()-start,
+		             (double)iterations*packetSize, "bytes");
+
+		/* The serialized data includes records from earlier
+		 * configurations too. */
+		double bytes = 0;
+		start = bench_seconds();
+		for(long n=0; n<iterations; n++)
+		{
+			int size = 0;
+			char *serialized = dgr_serialize(&size);
+			bench_sink += serialized[size-1];
+			bytes += size;
+		}
+		snprintf(name, sizeof(name), "dgr/serialize/%dx%d", recordCount, recordSize);
+		bench_report(name, iterations, bench_seconds()-start, bytes, "bytes");
+		free(packet);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	bench_init(argc, argv);
+	bench_vecmat();
+	bench_dgr();
+	bench_finish();
+	exit(EXIT_SUCCESS);
+}
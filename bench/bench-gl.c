@@ -0,0 +1,142 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Benchmarks kuhl_geometry draw call throughput and texture
+ * upload bandwidth. Everything is drawn into an offscreen
+ * framebuffer of a hidden window.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <GL/glew.h>
+
+#include "kuhl-util.h"
+#include "vecmat.h"
+#include "bench.h"
+
+#define FRAMEBUFFER_SIZE 512
+
+/** Creates a small triangle that will cover a few pixels of the framebuffer. */
+static void init_triangle(kuhl_geometry *geom, GLuint program, int i, int count)
+{
+	kuhl_geometry_new(geom, program, 3, GL_TRIANGLES);
+	float x = -1 + 2.0f * (i % 32) / 32;
+	float y = -1 + 2.0f * ((i / 32) % 32) / 32;
+	float z = -1 + 2.0f * i / count;
+	GLfloat vertexPositions[] = { x, y, z,
+	                              x+.05f, y, z,
+	                              x+.05f, y+.05f, z };
+	kuhl_geometry_attrib(geom, vertexPositions, 3, "in_Position", KG_WARN);
+}
+
+/** Draws geomCount geometry objects for a number of frames with
+ * kuhl_geometry_draw() and with a kuhl_render_queue. glFinish() is
+ * called at the end of each frame so that GPU time is included. */
+static void bench_draw(GLuint program, int geomCount)
+{
+	kuhl_geometry *geoms = kuhl_malloc(sizeof(kuhl_geometry)*geomCount);
+	for(int i=0; i<geomCount; i++)
+		init_triangle(&geoms[i], program, i, geomCount);
+
+	glUseProgram(program);
+	float identity[16];
+	mat4f_identity(identity);
+	glUniformMatrix4fv(kuhl_get_uniform("ModelView"), 1, 0, identity);
+	glUniformMatrix4fv(kuhl_get_uniform("Projection"), 1, 0, identity);
+	glUseProgram(0);
+
+	long frames = bench_iterations(100);
+	char name[128];
+
+	/* Warm up the driver before timing. */
+	for(int i=0; i<geomCount; i++)
+		kuhl_geometry_draw(&geoms[i]);
+	glFinish();
+
+	double start = bench_seconds();
+	for(long f=0; f<frames; f++)
+	{
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		for(int i=0; i<geomCount; i++)
+			kuhl_geometry_draw(&geoms[i]);
+		glFinish();
+	}
+	snprintf(name, sizeof(name), "draw/kuhl_geometry_draw/%d", geomCount);
+	bench_report(name, frames, bench_seconds()-start, (double)frames*geomCount, "draws");
+
+	kuhl_render_queue queue;
+	kuhl_render_queue_init(&queue);
+	for(int i=0; i<geomCount; i++)
+		kuhl_render_queue_add(&queue, &geoms[i]);
+	kuhl_render_queue_draw(&queue);
+	glFinish();
+
+	start = bench_seconds();
+	for(long f=0; f<frames; f++)
+	{
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		kuhl_render_queue_draw(&queue);
+		glFinish();
+	}
+	snprintf(name, sizeof(name), "draw/kuhl_render_queue/%d", geomCount);
+	bench_report(name, frames, bench_seconds()-start, (double)frames*geomCount, "draws");
+	kuhl_render_queue_free(&queue);
+
+	for(int i=0; i<geomCount; i++)
+		kuhl_geometry_delete(&geoms[i]);
+	free(geoms);
+	kuhl_errorcheck();
+}
+
+/** Measures how quickly RGBA images can be turned into textures with
+ * kuhl_read_texture_rgba_array() (including mipmap generation). */
+static void bench_texture_upload(int size)
+{
+	unsigned char *image = kuhl_malloc(size*size*4);
+	for(int i=0; i<size*size*4; i++)
+		image[i] = (unsigned char) (i*7);
+
+	long iterations = bench_iterations(2048*2048 / (size*size) * 4);
+	GLuint tex = kuhl_read_texture_rgba_array(image, size, size); // warm up
+	glDeleteTextures(1, &tex);
+	glFinish();
+
+	double start = bench_seconds();
+	for(long n=0; n<iterations; n++)
+	{
+		tex = kuhl_read_texture_rgba_array(image, size, size);
+		glDeleteTextures(1, &tex);
+	}
+	glFinish();
+	char name[128];
+	snprintf(name, sizeof(name), "texture/upload/%dx%d", size, size);
+	bench_report(name, iterations, bench_seconds()-start,
+	             (double)iterations*size*size*4, "bytes");
+	free(image);
+	kuhl_errorcheck();
+}
+
+int main(int argc, char** argv)
+{
+	bench_init(argc, argv);
+	bench_gl_init(argc, argv, FRAMEBUFFER_SIZE, FRAMEBUFFER_SIZE);
+
+	GLuint program = kuhl_create_program("triangle.vert", "triangle.frag");
+	glEnable(GL_DEPTH_TEST);
+
+	int geomCounts[] = { 100, 1000, 10000 };
+	for(unsigned int i=0; i<sizeof(geomCounts)/sizeof(geomCounts[0]); i++)
+		bench_draw(program, geomCounts[i]);
+
+	int textureSizes[] = { 256, 1024, 2048 };
+	for(unsigned int i=0; i<sizeof(textureSizes)/sizeof(textureSizes[0]); i++)
+		bench_texture_upload(textureSizes[i]);
+
+	bench_finish();
+	exit(EXIT_SUCCESS);
+}
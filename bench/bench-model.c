@@ -0,0 +1,76 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Benchmarks loading the models in the models directory and
+ * updating them with kuhl_update_model().
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <GL/glew.h>
+
+#include "kuhl-util.h"
+#include "bench.h"
+
+/* Models that are stored in this repository (relative to the bin directory). */
+static const char *models[] = { "../models/duck/duck.dae",
+                                "../models/sphere/sphere.dae",
+                                "../models/cube/cube.obj" };
+
+int main(int argc, char** argv)
+{
+	bench_init(argc, argv);
+	bench_gl_init(argc, argv, 64, 64);
+	GLuint program = kuhl_create_program("assimp.vert", "assimp.frag");
+
+	for(unsigned int m=0; m<sizeof(models)/sizeof(models[0]); m++)
+	{
+		char name[256];
+		const char *shortName = strrchr(models[m], '/')+1;
+
+		/* The first load imports the file with ASSIMP (or reads the
+		 * model cache if it exists). Later loads of the same file
+		 * reuse the scene that is already in memory and only create
+		 * the kuhl_geometry objects and OpenGL buffers. */
+		double start = bench_seconds();
+		kuhl_geometry *geom = kuhl_load_model(models[m], NULL, program, NULL);
+		glFinish();
+		if(geom == NULL)
+		{
+			fprintf(stderr, "Unable to load %s, skipping it.\n", models[m]);
+			continue;
+		}
+		snprintf(name, sizeof(name), "model/load-first/%s", shortName);
+		bench_report(name, 1, bench_seconds()-start, 1, "loads");
+
+		long iterations = bench_iterations(20);
+		start = bench_seconds();
+		for(long n=0; n<iterations; n++)
+		{
+			kuhl_geometry *again = kuhl_load_model(models[m], NULL, program, NULL);
+			glFinish();
+			kuhl_geometry_delete(again);
+		}
+		snprintf(name, sizeof(name), "model/load-again/%s", shortName);
+		bench_report(name, iterations, bench_seconds()-start, iterations, "loads");
+
+		unsigned int geomCount = kuhl_geometry_count(geom);
+		iterations = bench_iterations(10000);
+		start = bench_seconds();
+		for(long n=0; n<iterations; n++)
+			kuhl_update_model(geom, 0, (n % 1000) / 100.0f);
+		snprintf(name, sizeof(name), "model/update/%s", shortName);
+		bench_report(name, iterations, bench_seconds()-start,
+		             (double)iterations*geomCount, "meshes");
+
+		kuhl_geometry_delete(geom);
+	}
+
+	bench_finish();
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,160 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Benchmarks passing items between threads through an
+ * lfqueue (see lfqueue.h) and through a queue (see queue.h) that is
+ * protected by a mutex. Results depend heavily on the number of
+ * cores; every test is slow if there are fewer cores than threads.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "queue.h"
+#include "lfqueue.h"
+#include "bench.h"
+
+#define BENCH_CAPACITY 1024 /**< Items that each queue can hold */
+#define BENCH_THREADS 2 /**< Producers and consumers in the multiple-producer tests */
+
+/** A queue protected by a mutex. It has the same capacity as the
+ * lfqueue that it is compared to. */
+typedef struct
+{
+	queue *q;
+	pthread_mutex_t mutex;
+} locked_queue;
+
+static int locked_try_add(locked_queue *lq, long *item)
+{
+	int ok = 0;
+	pthread_mutex_lock(&(lq->mutex));
+	if(queue_length(lq->q) < BENCH_CAPACITY)
+		ok = queue_add(lq->q, item);
+	pthread_mutex_unlock(&(lq->mutex));
+	return ok;
+}
+
+static int locked_try_remove(locked_queue *lq, long *item)
+{
+	int ok = 0;
+	pthread_mutex_lock(&(lq->mutex));
+	if(queue_length(lq->q) > 0)
+		ok = queue_remove(lq->q, item);
+	pthread_mutex_unlock(&(lq->mutex));
+	return ok;
+}
+
+/** The state shared by the threads in one test. */
+typedef struct
+{
+	lfqueue *lf; /**< The queue being tested, or NULL to test locked */
+	locked_queue *locked;
+	long items; /**< Items sent by each producer */
+	long sum; /**< Sum of the items received by a consumer */
+	long received; /**< Items to receive, set per consumer */
+} bench_thread;
+
+static void* bench_producer(void *arg)
+{
+	bench_thread *t = (bench_thread*) arg;
+	for(long i=1; i<=t->items; i++)
+	{
+		while(t->lf ? !lfqueue_try_add(t->lf, &i) : !locked_try_add(t->locked, &i))
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void* bench_consumer(void *arg)
+{
+	bench_thread *t = (bench_thread*) arg;
+	long item;
+	for(long i=0; i<t->received; i++)
+	{
+		while(t->lf ? !lfqueue_try_remove(t->lf, &item) : !locked_try_remove(t->locked, &item))
+			sched_yield();
+		t->sum += item;
+	}
+	return NULL;
+}
+
+/** Runs one test with a number of producers and consumers and
+ * reports the number of items passed per second. */
+static void bench_run(const char *label, lfqueue *lf, locked_queue *locked, long items, int producers, int consumers)
+{
+	pthread_t threads[2*BENCH_THREADS];
+	bench_thread state[2*BENCH_THREADS];
+	long perProducer = items / producers;
+	long total = perProducer * producers;
+
+	for(int i=0; i<producers+consumers; i++)
+	{
+		state[i].lf = lf;
+		state[i].locked = locked;
+		state[i].items = perProducer;
+		state[i].sum = 0;
+		/* Split the items between the consumers. */
+		int c = i - producers;
+		state[i].received = total / consumers + (c < total % consumers ? 1 : 0);
+	}
+
+	double start = bench_seconds();
+	for(int i=0; i<producers+consumers; i++)
+		pthread_create(&threads[i], NULL, i < producers ? bench_producer : bench_consumer, &state[i]);
+	long sum = 0;
+	for(int i=0; i<producers+consumers; i++)
+	{
+		pthread_join(threads[i], NULL);
+		if(i >= producers)
+			sum += state[i].sum;
+	}
+	double elapsed = bench_seconds() - start;
+
+	char name[128];
+	snprintf(name, sizeof(name), "%s/%dx%d", label, producers, consumers);
+	long expected = producers * (perProducer * (perProducer+1) / 2);
+	if(sum != expected)
+	{
+		fprintf(stderr, "%s: The consumers received the wrong items.\n", name);
+		exit(EXIT_FAILURE);
+	}
+	bench_report(name, total, elapsed, total, "items");
+}
+
+int main(int argc, char** argv)
+{
+	bench_init(argc, argv);
+	char cores[32];
+	snprintf(cores, sizeof(cores), "%ld", sysconf(_SC_NPROCESSORS_ONLN));
+	bench_info("cores", cores);
+	long items = bench_iterations(2000000);
+
+	locked_queue locked;
+	locked.q = queue_new(BENCH_CAPACITY, sizeof(long));
+	pthread_mutex_init(&(locked.mutex), NULL);
+
+	lfqueue *spsc = lfqueue_new(BENCH_CAPACITY, sizeof(long), LFQUEUE_SPSC);
+	bench_run("lfqueue/spsc", spsc, NULL, items, 1, 1);
+	lfqueue_free(spsc);
+
+	lfqueue *mpmc = lfqueue_new(BENCH_CAPACITY, sizeof(long), LFQUEUE_MPMC);
+	bench_run("lfqueue/mpmc", mpmc, NULL, items, 1, 1);
+	bench_run("lfqueue/mpmc", mpmc, NULL, items, BENCH_THREADS, BENCH_THREADS);
+	lfqueue_free(mpmc);
+
+	bench_run("mutex", NULL, &locked, items, 1, 1);
+	bench_run("mutex", NULL, &locked, items, BENCH_THREADS, BENCH_THREADS);
+
+	pthread_mutex_destroy(&(locked.mutex));
+	queue_free(locked.q);
+	bench_finish();
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,287 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ *
+ * Timing and reporting functions for the benchmark programs. See
+ * bench.h for details.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+
+#include <GL/glew.h>
+#ifdef __APPLE__
+#include <GLUT/glut.h>
+#else
+#include <GL/freeglut.h>
+#endif
+
+#include "kuhl-util.h"
+#include "bench.h"
+
+#define BENCH_MAX_RESULTS 256
+
+/** One benchmark result. */
+typedef struct
+{
+	char name[128];
+	long iterations;
+	double seconds;
+	double amount; /**< Amount of work done (in units) */
+	char unit[32];
+} bench_result;
+
+/** A key/value pair describing the machine or the build. */
+typedef struct
+{
+	char key[64];
+	char value[256];
+} bench_keyvalue;
+
+volatile float bench_sink = 0;
+
+static const char *bench_program = "bench";
+static int bench_csv = 0;
+static const char *bench_output = NULL;
+static double bench_scale = 1;
+static bench_result bench_results[BENCH_MAX_RESULTS];
+static int bench_result_count = 0;
+static bench_keyvalue bench_infos[BENCH_MAX_RESULTS];
+static int bench_info_count = 0;
+
+
+/** Parses the command line options that all benchmark programs
+ * accept.
+ *
+ * @param argc The argc passed to main().
+ * @param argv The argv passed to main().
+ */
+void bench_init(int argc, char** argv)
+{
+	if(argc > 0)
+		bench_program = basename(argv[0]);
+	for(int i=1; i<argc; i++)
+	{
+		if(strcmp(argv[i], "--csv") == 0)
+			bench_csv = 1;
+		else if(strncmp(argv[i], "--output=", 9) == 0)
+			bench_output = argv[i]+9;
+		else if(strncmp(argv[i], "--scale=", 8) == 0)
+			bench_scale = atof(argv[i]+8);
+		else
+		{
+			fprintf(stderr, "Usage: %s [--csv] [--output=file] [--scale=factor]\n", bench_program);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(bench_scale <= 0)
+		bench_scale = 1;
+
+	char hostname[256];
+	if(gethostname(hostname, sizeof(hostname)) != 0)
+		snprintf(hostname, sizeof(hostname), "unknown");
+	hostname[sizeof(hostname)-1] = '\0';
+	bench_info("host", hostname);
+}
+
+/** Scales the number of iterations of a benchmark by the factor
+ * given with the --scale option.
+ *
+ * @param iterations The default number of iterations.
+ * @return The number of iterations that should be used (at least 1).
+ */
+long bench_iterations(long iterations)
+{
+	long scaled = (long) (iterations * bench_scale);
+	return scaled < 1 ? 1 : scaled;
+}
+
+/** Returns a monotonic time in seconds that is suitable for timing
+ * benchmarks. */
+double bench_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/** Records information about the machine or configuration that the
+ * benchmark was run with (for example, the OpenGL renderer).
+ *
+ * @param key The name of the information.
+ * @param value The value of the information.
+ */
+void bench_info(const char *key, const char *value)
+{
+	if(bench_info_count == BENCH_MAX_RESULTS)
+		return;
+	bench_keyvalue *kv = &bench_infos[bench_info_count++];
+	snprintf(kv->key, sizeof(kv->key), "%s", key);
+	snprintf(kv->value, sizeof(kv->value), "%s", value ? value : "");
+}
+
+/** Records the result of a benchmark.
+ *
+ * @param name The name of the benchmark.
+ * @param iterations The number of times the benchmarked operation was run.
+ * @param seconds The time that all of the iterations took.
+ * @param amount The amount of work that was done (for example, bytes
+ * uploaded). Use iterations if there are no better units.
+ * @param unit The unit of amount (for example, "bytes" or "draws").
+ */
+void bench_report(const char *name, long iterations, double seconds, double amount, const char *unit)
+{
+	if(bench_result_count == BENCH_MAX_RESULTS)
+	{
+		fprintf(stderr, "%s: Too many benchmark results.\n", bench_program);
+		return;
+	}
+	bench_result *r = &bench_results[bench_result_count++];
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->iterations = iterations;
+	r->seconds = seconds;
+	r->amount = amount;
+	snprintf(r->unit, sizeof(r->unit), "%s", unit);
+	fprintf(stderr, "%-40s %12.3f ns/iteration %14.1f %s/s\n", name,
+	        iterations > 0 ? seconds*1e9/iterations : 0,
+	        seconds > 0 ? amount/seconds : 0, unit);
+}
+
+/** Writes a string to a JSON file with quotes and escapes. */
+static void bench_json_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for(const char *c = str; *c != '\0'; c++)
+	{
+		if(*c == '"' || *c == '\\')
+			fputc('\\', f);
+		if((unsigned char) *c >= ' ')
+			fputc(*c, f);
+	}
+	fputc('"', f);
+}
+
+/** Writes all of the results in JSON or CSV format. Should be called
+ * once at the end of the benchmark program. */
+void bench_finish(void)
+{
+	char defaultOutput[1024];
+	if(bench_output == NULL)
+	{
+		snprintf(defaultOutput, sizeof(defaultOutput), "%s.%s", bench_program, bench_csv ? "csv" : "json");
+		bench_output = defaultOutput;
+	}
+
+	FILE *f = stdout;
+	if(strcmp(bench_output, "-") != 0)
+	{
+		f = fopen(bench_output, "w");
+		if(f == NULL)
+		{
+			fprintf(stderr, "%s: Unable to write to %s\n", bench_program, bench_output);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(bench_csv)
+	{
+		fprintf(f, "program,benchmark,iterations,seconds,ns_per_iteration,amount,unit,per_second\n");
+		for(int i=0; i<bench_result_count; i++)
+		{
+			bench_result *r = &bench_results[i];
+			fprintf(f, "%s,%s,%ld,%.9f,%.3f,%.1f,%s,%.3f\n",
+			        bench_program, r->name, r->iterations, r->seconds,
+			        r->iterations > 0 ? r->seconds*1e9/r->iterations : 0,
+			        r->amount, r->unit,
+			        r->seconds > 0 ? r->amount/r->seconds : 0);
+		}
+	}
+	else
+	{
+		fprintf(f, "{\n\"program\": ");
+		bench_json_string(f, bench_program);
+		fprintf(f, ",\n\"info\": {");
+		for(int i=0; i<bench_info_count; i++)
+		{
+			fprintf(f, "%s\n  ", i == 0 ? "" : ",");
+			bench_json_string(f, bench_infos[i].key);
+			fprintf(f, ": ");
+			bench_json_string(f, bench_infos[i].value);
+		}
+		fprintf(f, "\n},\n\"results\": [");
+		for(int i=0; i<bench_result_count; i++)
+		{
+			bench_result *r = &bench_results[i];
+			fprintf(f, "%s\n  {\"benchmark\": ", i == 0 ? "" : ",");
+			bench_json_string(f, r->name);
+			fprintf(f, ", \"iterations\": %ld, \"seconds\": %.9f, \"ns_per_iteration\": %.3f, \"amount\": %.1f, \"unit\": ",
+			        r->iterations, r->seconds,
+			        r->iterations > 0 ? r->seconds*1e9/r->iterations : 0,
+			        r->amount);
+			bench_json_string(f, r->unit);
+			fprintf(f, ", \"per_second\": %.3f}", r->seconds > 0 ? r->amount/r->seconds : 0);
+		}
+		fprintf(f, "\n]\n}\n");
+	}
+
+	if(f != stdout)
+	{
+		fclose(f);
+		fprintf(stderr, "%s: Wrote results to %s\n", bench_program, bench_output);
+	}
+}
+
+/** Creates a hidden GLUT window with an OpenGL 3.2 core context and
+ * an offscreen framebuffer that benchmarks can draw into. Drawing
+ * into a framebuffer object keeps the results independent of the
+ * window size, the display and vsync.
+ *
+ * @param argc The argc passed to main().
+ * @param argv The argv passed to main().
+ * @param width The width of the offscreen framebuffer.
+ * @param height The height of the offscreen framebuffer.
+ * @return The framebuffer object, which is bound when this function returns.
+ */
+int bench_gl_init(int argc, char** argv, int width, int height)
+{
+	glutInit(&argc, argv);
+	glutInitWindowSize(64, 64);
+#ifdef __APPLE__
+	glutInitDisplayMode(GLUT_3_2_CORE_PROFILE | GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
+#else
+	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
+	glutInitContextVersion(3,2);
+	glutInitContextProfile(GLUT_CORE_PROFILE);
+#endif
+	glutCreateWindow(bench_program);
+	glutHideWindow();
+
+	glewExperimental = GL_TRUE;
+	GLenum glewError = glewInit();
+	if(glewError != GLEW_OK)
+	{
+		fprintf(stderr, "Error initializing GLEW: %s\n", glewGetErrorString(glewError));
+		exit(EXIT_FAILURE);
+	}
+	glGetError(); // see comment in samples/triangle.c
+
+	bench_info("gl_vendor", (const char*) glGetString(GL_VENDOR));
+	bench_info("gl_renderer", (const char*) glGetString(GL_RENDERER));
+	bench_info("gl_version", (const char*) glGetString(GL_VERSION));
+
+	GLuint texture;
+	GLint framebuffer = kuhl_gen_framebuffer(width, height, &texture, NULL);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glViewport(0, 0, width, height);
+	kuhl_errorcheck();
+	return framebuffer;
+}
@@ -0,0 +1,47 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Helper functions shared by the benchmark programs in the bench
+    directory. Each benchmark program times a fixed amount of work
+    and reports the results with bench_report(). The results are
+    written as JSON (the default) or CSV to a file named after the
+    program (e.g., bench-cpu.json) so that they can be compared
+    between releases. A human-readable summary is printed to stderr.
+
+    The following command line options are accepted by every
+    benchmark program:
+
+    --csv - Write CSV instead of JSON.<br>
+    --output=file - Write results to a different file ("-" for stdout).<br>
+    --scale=2 - Multiply the number of iterations by a factor.
+
+    @author Scott Kuhl
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void bench_init(int argc, char** argv);
+long bench_iterations(long iterations);
+double bench_seconds(void);
+void bench_info(const char *key, const char *value);
+void bench_report(const char *name, long iterations, double seconds, double amount, const char *unit);
+void bench_finish(void);
+int bench_gl_init(int argc, char** argv, int width, int height);
+
+/** Prevents the compiler from removing calculations whose results
+ * are otherwise unused. */
+extern volatile float bench_sink;
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+#endif // __BENCH_H__
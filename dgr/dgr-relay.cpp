@@ -1,6 +1,15 @@
 // This program is used by DGR applications. This program simply reads
 // the UDP packets that DGR generates and then sends them on to a new
 // IP address.
+//
+// One thread receives packets with recvmmsg() whenever epoll reports
+// that the socket is readable. Each packet is placed in a shared pool
+// and a pointer to it is pushed onto a lock-free single-producer,
+// single-consumer ring for each destination. Each destination has its
+// own thread that sends batches of packets with sendmmsg(), so a slow
+// or unreachable slave only delays its own packets. If a ring is full,
+// the packet is dropped for that destination (DGR slaves only need the
+// newest frame anyway).
 
 // Authors:
 // James Walker   jwwalker at mtu dot edu
@@ -11,24 +20,32 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
 #include <math.h>
 #include <pthread.h>
+#include <atomic>
 #include <string>
 #include <vector>
 
 
-/* On most networks, the MTU is set to 1500 bytes. With header
- * overhead, this means that we could expect to have around 1472 bytes
- * of data in a UDP packet. Local loopback addresses will often have a
- * higher MTU. One way to send packets larger than the MTU is with
- * IPv4 fragmentation---which happens automatically. */
+/* DGR splits large frames into fragments that fit in a datagram
+ * (see DGR_MTU) and the relay forwards each fragment without looking
+ * inside of it. No UDP datagram is larger than 64 KiB. */
 #define BUFLEN 65536
+#define POOL_SIZE 512 // number of packets that can be waiting to be sent
+#define RING_SIZE 256 // number of packets that can be queued for each destination (power of 2)
+#define BATCH_SIZE 32 // number of packets per recvmmsg()/sendmmsg()
+#define STATS_INTERVAL 10 // seconds between printing statistics
 
 char *RELAY_IN_PORT = NULL; // the port we listen for UDP packets on
 char *RELAY_OUT_IP = NULL; // the address we send UDP packets to
@@ -41,45 +58,313 @@ socklen_t slen_R;
 
 struct sockaddr_in si_me_R;
 
-std::vector<int> s_S; // list of sockets to send data to
-std::vector<struct sockaddr_in> si_other_S; // list of sockaddr objects for our sockets.
+/* A packet that was received. A packet is reused once no destination
+ * refers to it anymore. */
+struct packet {
+	std::atomic<int> refs; // number of rings (and the receiver) using this packet
+	int len;
+	long receivedUsec; // when the packet was received
+	char buf[BUFLEN];
+};
+packet *pool = NULL;
+int poolNext = 0; // where the receiver looks for a free packet next
+
+/* A destination and the queue of packets that will be sent to it. */
+struct destination {
+	int s_S; // socket to send data to
+	struct sockaddr_in si_other_S;
+	pthread_t thread;
+	int wakeup; // eventfd that the receiver writes to after queuing packets
+
+	// Single-producer (receiver) single-consumer (sender) ring
+	packet *ring[RING_SIZE];
+	std::atomic<unsigned int> head; // next entry that the receiver writes
+	std::atomic<unsigned int> tail; // next entry that the sender reads
+
+	std::atomic<unsigned long> packetsOut;
+	std::atomic<unsigned long> drops;
+	std::atomic<unsigned long> latencyTotal; // microseconds from receive to send
+	std::atomic<long> latencyMax;
+};
+std::vector<destination*> destinations;
 socklen_t slen_S;
 
-bool receivedPacket = false;
-int framesPassed = 0;
+std::atomic<bool> receivedPacket(false);
+std::atomic<int> framesPassed(0);
+std::atomic<unsigned long> packetsIn(0);
+std::atomic<unsigned long> bytesIn(0);
+std::atomic<unsigned long> poolDrops(0); // packets dropped because every packet in the pool was in use
+
+/* Microseconds from an arbitrary starting point. */
+static long usec_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000L + ts.tv_nsec/1000;
+}
+
+/* Stops referring to a packet. */
+static void packet_release(packet *p)
+{
+	p->refs.fetch_sub(1, std::memory_order_release);
+}
+
+/* Finds a packet that isn't in use. Only the receiver calls this, so
+ * a packet without references can't be claimed by anybody else. */
+static packet* packet_get()
+{
+	for(int i=0; i<POOL_SIZE; i++)
+	{
+		packet *p = &pool[(poolNext+i) % POOL_SIZE];
+		if(p->refs.load(std::memory_order_acquire) == 0)
+		{
+			poolNext = (poolNext+i+1) % POOL_SIZE;
+			p->refs.store(1, std::memory_order_relaxed);
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/* Queues a packet for a destination. Called only by the receiver. */
+static void destination_push(destination *d, packet *p)
+{
+	unsigned int head = d->head.load(std::memory_order_relaxed);
+	unsigned int tail = d->tail.load(std::memory_order_acquire);
+	if(head - tail >= RING_SIZE)
+	{
+		d->drops++;
+		return;
+	}
+	p->refs.fetch_add(1, std::memory_order_relaxed);
+	d->ring[head % RING_SIZE] = p;
+	d->head.store(head+1, std::memory_order_release);
+}
+
+/* Sends the packets queued for one destination. */
+void * sender(void *arg) {
+	destination *d = (destination*) arg;
+	struct mmsghdr msgs[BATCH_SIZE];
+	struct iovec iovs[BATCH_SIZE];
+	packet *batch[BATCH_SIZE];
+
+	while (true) {
+		unsigned int tail = d->tail.load(std::memory_order_relaxed);
+		unsigned int head = d->head.load(std::memory_order_acquire);
+		if(head == tail)
+		{
+			// wait for the receiver to queue more packets
+			uint64_t count;
+			if(read(d->wakeup, &count, sizeof(count)) == -1 && errno != EINTR) {
+				perror("DGR Relay: ERROR read eventfd");
+				exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+
+		int n = 0;
+		while(tail != head && n < BATCH_SIZE)
+		{
+			packet *p = d->ring[tail % RING_SIZE];
+			batch[n] = p;
+			iovs[n].iov_base = p->buf;
+			iovs[n].iov_len = p->len;
+			memset(&msgs[n], 0, sizeof(msgs[n]));
+			msgs[n].msg_hdr.msg_name = &d->si_other_S;
+			msgs[n].msg_hdr.msg_namelen = slen_S;
+			msgs[n].msg_hdr.msg_iov = &iovs[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			n++;
+			tail++;
+		}
+
+		int sent = 0;
+		while(sent < n)
+		{
+			int ret = sendmmsg(d->s_S, msgs+sent, n-sent, 0);
+			if(ret == -1) {
+				if(errno == EINTR)
+					continue;
+				/* Treat errors like ECONNREFUSED (nobody is listening
+				 * yet) as a lost packet instead of giving up. */
+				if(errno != ECONNREFUSED && errno != EHOSTUNREACH && errno != ENETUNREACH) {
+					perror("DGR Relay: ERROR sendmmsg");
+					exit(EXIT_FAILURE);
+				}
+				d->drops++;
+				sent++;
+				continue;
+			}
+			sent += ret;
+			d->packetsOut += ret;
+		}
+
+		long now = usec_now();
+		for(int i=0; i<n; i++)
+		{
+			long latency = now - batch[i]->receivedUsec;
+			d->latencyTotal += latency;
+			long prevMax = d->latencyMax.load(std::memory_order_relaxed);
+			while(latency > prevMax && !d->latencyMax.compare_exchange_weak(prevMax, latency))
+				;
+			packet_release(batch[i]);
+		}
+		d->tail.store(tail, std::memory_order_release);
+	}
+	return NULL;
+}
+
+/* Waits (for a little while) for every destination to send the
+ * packets that are queued for it. */
+static void flush_destinations()
+{
+	for(int i=0; i<100; i++)
+	{
+		bool empty = true;
+		for(unsigned int j = 0; j < destinations.size(); j++)
+			if(destinations[j]->head.load() != destinations[j]->tail.load())
+				empty = false;
+		if(empty)
+			return;
+		usleep(10000);
+	}
+}
+
+/* Prints the counters and resets the latency statistics. */
+static void print_stats()
+{
+	printf("DGR Relay: in: %lu packets, %lu bytes, %lu dropped (no free buffers)\n",
+	       packetsIn.load(), bytesIn.load(), poolDrops.load());
+	for(unsigned int i = 0; i < destinations.size(); i++)
+	{
+		destination *d = destinations[i];
+		unsigned long out = d->packetsOut.exchange(0);
+		unsigned long total = d->latencyTotal.exchange(0);
+		long max = d->latencyMax.exchange(0);
+		printf("DGR Relay:   port %d: out: %lu packets, %lu dropped, latency avg %.1f us max %ld us\n",
+		       ntohs(d->si_other_S.sin_port), out, d->drops.load(),
+		       out > 0 ? (double) total / out : 0.0, max);
+	}
+	fflush(stdout);
+}
 
-// This function receives incoming packets, repackages them, and then forwards them
-// on the network for consumption by the slaves. It does this in an infinite loop.
+// This function receives incoming packets and hands them to the
+// sender threads. It does this in an infinite loop.
 void * receiver(void *) {
-	char buf[BUFLEN];
+	int epfd = epoll_create1(0);
+	if(epfd == -1) {
+		perror("DGR Relay: ERROR epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = s_R;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, s_R, &ev) == -1) {
+		perror("DGR Relay: ERROR epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+
+	struct mmsghdr msgs[BATCH_SIZE];
+	struct iovec iovs[BATCH_SIZE];
+	packet *batch[BATCH_SIZE];
+
 	while (true) {
-		// Receive any frames
-		int bytesReceived;
-		bytesReceived = recvfrom(s_R, buf, BUFLEN, 0, NULL, 0);
-		if (bytesReceived == -1) {
-			perror("DGR Relay: ERROR recvfrom");
+		struct epoll_event events[1];
+		int nfds = epoll_wait(epfd, events, 1, 100);
+		if(nfds == -1) {
+			if(errno == EINTR)
+				continue;
+			perror("DGR Relay: ERROR epoll_wait");
 			exit(EXIT_FAILURE);
 		}
+		if(nfds == 0)
+			continue;
 
-		receivedPacket = true;
-		framesPassed = 0;
+		// Receive any frames until there are none left
+		while(true)
+		{
+			int n = 0;
+			for(; n < BATCH_SIZE; n++)
+			{
+				batch[n] = packet_get();
+				if(batch[n] == NULL)
+					break;
+				iovs[n].iov_base = batch[n]->buf;
+				iovs[n].iov_len = BUFLEN;
+				memset(&msgs[n], 0, sizeof(msgs[n]));
+				msgs[n].msg_hdr.msg_iov = &iovs[n];
+				msgs[n].msg_hdr.msg_iovlen = 1;
+			}
+			if(n == 0)
+			{
+				/* Every packet is waiting to be sent. Throw away a
+				 * datagram so we don't spin on a readable socket. */
+				char discard[BUFLEN];
+				if(recv(s_R, discard, BUFLEN, MSG_DONTWAIT) == -1)
+					break;
+				poolDrops++;
+				continue;
+			}
 
-		// When we have received a frame, send it out!
-		for(unsigned int i = 0; i < s_S.size(); i++){
-			if (sendto(s_S[i], buf, bytesReceived, 0, (struct sockaddr*)&si_other_S[i],
-					   slen_S) == -1) {
-				perror("DGR Relay: ERROR sendto");
+			int received = recvmmsg(s_R, msgs, n, MSG_DONTWAIT, NULL);
+			if (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				perror("DGR Relay: ERROR recvmmsg");
 				exit(EXIT_FAILURE);
 			}
-		}
+			if(received < 0)
+				received = 0;
 
-		/* Check if the frame that we just forwarded was informing
-		 * processes to exit. */
-		if(bytesReceived > (int) strlen("!!!dgr_died!!!") &&
-		   strcmp(buf, "!!!dgr_died!!!") == 0)
-		{
-			printf("DGR Relay: Received message from master indicating that DGR communication is complete.\n");
-			exit(EXIT_SUCCESS);
+			long now = usec_now();
+			bool died = false;
+			for(int i = 0; i < received; i++)
+			{
+				packet *p = batch[i];
+				p->len = msgs[i].msg_len;
+				p->receivedUsec = now;
+				packetsIn++;
+				bytesIn += p->len;
+
+				// When we have received a frame, send it out!
+				for(unsigned int j = 0; j < destinations.size(); j++)
+					destination_push(destinations[j], p);
+
+				/* Check if the frame that we just forwarded was
+				 * informing processes to exit. The master only sends
+				 * that one record in its last frame, so the frame
+				 * will be small. The record name is after the frame
+				 * header (and after other headers when the master
+				 * sends delta-encoded packets). */
+				const char *diedName = "!!!dgr_died!!!";
+				if(p->len < 256 &&
+				   memmem(p->buf, p->len, diedName, strlen(diedName)+1) != NULL)
+					died = true;
+			}
+			// release the packets (including ones that weren't filled)
+			for(int i = 0; i < n; i++)
+				packet_release(batch[i]);
+
+			if(received > 0)
+			{
+				receivedPacket = true;
+				framesPassed = 0;
+				uint64_t one = 1;
+				for(unsigned int j = 0; j < destinations.size(); j++)
+					if(write(destinations[j]->wakeup, &one, sizeof(one)) == -1) {
+						perror("DGR Relay: ERROR write eventfd");
+						exit(EXIT_FAILURE);
+					}
+			}
+
+			if(died)
+			{
+				flush_destinations();
+				printf("DGR Relay: Received message from master indicating that DGR communication is complete.\n");
+				print_stats();
+				exit(EXIT_SUCCESS);
+			}
+			if(received < n)
+				break;
 		}
 	}
 }
@@ -91,37 +376,51 @@ int main(int argc, char **argv) {
 	if (argc < 4) {
 		printf("USAGE: %s port-in ipaddr-out port-out [ port2-out .. ]\n", argv[0]);
 		printf("This program will listen on a specific port for UDP packets. When one is received, it will be sent to the specified IP address. If more than one port is specified, it will send the packet to multiple ports at that IP address.\n");
+		printf("On networks that support multicast, setting DGR_MULTICAST_GROUP on the master and the slaves avoids the need for this relay.\n");
 		exit(EXIT_FAILURE);
 	}
 	RELAY_IN_PORT=argv[1];
 	RELAY_OUT_IP=argv[2];
 
+	pool = new packet[POOL_SIZE];
+	for(int i = 0; i < POOL_SIZE; i++)
+		pool[i].refs = 0;
+
 	// for each of the output ports, create a socket:
 	for(int i = 3; i < argc; i++){
 		printf("DGR Relay: Preparing to send data to %s on port %s\n", RELAY_OUT_IP, argv[i]);
-		
-		struct sockaddr_in _si_other_S;
-		int _s_S;
-		slen_S=sizeof(_si_other_S);
 
-		if ((_s_S=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+		destination *d = new destination();
+		slen_S=sizeof(d->si_other_S);
+
+		if ((d->s_S=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
 			perror("DGR Relay: ERROR socket");
 			exit(EXIT_FAILURE);
 		}
 		int so_broadcast = 1;
-		setsockopt(_s_S, SOL_SOCKET, SO_BROADCAST, &so_broadcast, sizeof(so_broadcast));
+		setsockopt(d->s_S, SOL_SOCKET, SO_BROADCAST, &so_broadcast, sizeof(so_broadcast));
 
-		memset((char *) &_si_other_S, 0, sizeof(_si_other_S));
-		_si_other_S.sin_family = AF_INET;
-		_si_other_S.sin_port = htons(atoi(argv[i]));
-		if (inet_aton(RELAY_OUT_IP, &_si_other_S.sin_addr) == 0) {
+		memset((char *) &d->si_other_S, 0, sizeof(d->si_other_S));
+		d->si_other_S.sin_family = AF_INET;
+		d->si_other_S.sin_port = htons(atoi(argv[i]));
+		if (inet_aton(RELAY_OUT_IP, &d->si_other_S.sin_addr) == 0) {
 			fprintf(stderr, "DGR Relay: inet_aton() failed\n");
 			exit(1);
 		}
 
-		// add this socket to a list
-		s_S.push_back(_s_S);
-		si_other_S.push_back(_si_other_S);
+		if((d->wakeup = eventfd(0, 0)) == -1) {
+			perror("DGR Relay: ERROR eventfd");
+			exit(EXIT_FAILURE);
+		}
+		d->head = 0;
+		d->tail = 0;
+		d->packetsOut = 0;
+		d->drops = 0;
+		d->latencyTotal = 0;
+		d->latencyMax = 0;
+
+		// add this destination to a list
+		destinations.push_back(d);
     }
 
 
@@ -140,6 +439,14 @@ int main(int argc, char **argv) {
 		perror("DGR Relay: ERROR bind");
 		exit(EXIT_FAILURE);
 	}
+	fcntl(s_R, F_SETFL, fcntl(s_R, F_GETFL, 0) | O_NONBLOCK);
+
+	// start a thread to send data to each destination
+	for(unsigned int i = 0; i < destinations.size(); i++)
+		if (pthread_create(&destinations[i]->thread, NULL, &sender, destinations[i]) != 0) {
+			perror("DGR Relay: Exiting because pthread_create() failed.");
+			exit(EXIT_FAILURE);
+		}
 
 	// listen for updates
 	if (pthread_create(&receiverThread, NULL, &receiver, NULL) != 0) {
@@ -149,6 +456,7 @@ int main(int argc, char **argv) {
 
 	printf("DGR Relay: Initialization complete, running...\n");
 
+	int ticks = 0;
 	while (true) {
 	        usleep(100000); // 1/10th a second
 
@@ -157,11 +465,15 @@ int main(int argc, char **argv) {
 		// >15 seconds if it hasn't received any packets yet).
 		framesPassed++;
 
+		if(++ticks % (STATS_INTERVAL*10) == 0 && receivedPacket)
+			print_stats();
+
 		int timeoutReceivedPacket = 50; // tenths of a second to timeout (if we HAVE received previous packet)
 		int timeoutFirstPacket = 150; // tenths of a second to timeout (if we have NOT received previous packet)
-		
+
 		if(receivedPacket && framesPassed > timeoutReceivedPacket) {
 		printf("DGR Relay: Exiting because we haven't received a packet within %f seconds (and we have received packets previously).\n", timeoutReceivedPacket/10.0);
+				print_stats();
 				exit(EXIT_SUCCESS);
 		}
 		if(receivedPacket == 0 && framesPassed > timeoutFirstPacket) {
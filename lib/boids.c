@@ -0,0 +1,383 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ *
+ * Simulates a flock of boids. See boids.h for details.
+ *
+ * Each update hashes every boid into a grid cell, sorts the boids by
+ * hash table entry with a counting sort (copying the positions and
+ * velocities into b->sorted) and then calculates the new positions
+ * and velocities from the sorted copy. Because the new values are
+ * written into the regular arrays, threads never write data that
+ * another thread reads and the boids stay in the sorted order.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "boids.h"
+#include "kuhl-util.h"
+#include "vecmat.h"
+#include "msg.h"
+#include "trace.h"
+
+#define BOIDS_MAX_THREADS 16 /**< Maximum number of threads that boids_update() uses */
+#define BOIDS_CHUNK 256 /**< Number of boids that a thread updates at a time */
+
+/** The flock that is being updated by boids_update(). */
+static struct
+{
+	boids *b;
+	float dt;
+	int chunks;         /**< Number of chunks of BOIDS_CHUNK boids */
+	int next;           /**< Next chunk to be updated (accessed atomically) */
+	int finished;       /**< Number of chunks that have been updated (accessed atomically) */
+	int active;         /**< Worker threads that are working on this job */
+	unsigned int generation; /**< Incremented each time a job is started */
+} boids_job;
+
+static pthread_mutex_t boids_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t boids_start = PTHREAD_COND_INITIALIZER; /**< Signaled when a job is started */
+static pthread_cond_t boids_done = PTHREAD_COND_INITIALIZER;  /**< Signaled when a worker finishes a job */
+static int boids_threads = -1; /**< Number of worker threads (-1 if they haven't been started) */
+
+/** Returns the grid cell that a coordinate is in. */
+static inline int boids_cell_coord(float v, float invRadius)
+{
+	return (int) floorf(v * invRadius);
+}
+
+/** Returns the hash table entry for a grid cell. */
+static inline unsigned int boids_hash(int cx, int cy, int cz, unsigned int mask)
+{
+	return ((unsigned int) cx * 73856093u ^
+	        (unsigned int) cy * 19349663u ^
+	        (unsigned int) cz * 83492791u) & mask;
+}
+
+/** Calculates the new velocity, position and matrix of boids [first,last) in sorted order. */
+static void boids_update_range(boids *b, float dt, int first, int last)
+{
+	const float *sx = b->sorted[0], *sy = b->sorted[1], *sz = b->sorted[2];
+	const float *svx = b->sorted[3], *svy = b->sorted[4], *svz = b->sorted[5];
+	const float r2 = b->radius * b->radius;
+	const float sep2 = b->separation * b->separation;
+	const float invRadius = 1.0f / b->radius;
+	const unsigned int mask = b->tableSize - 1;
+
+	for(int i=first; i<last; i++)
+	{
+		const float px = sx[i], py = sy[i], pz = sz[i];
+		const int cx = boids_cell_coord(px, invRadius);
+		const int cy = boids_cell_coord(py, invRadius);
+		const int cz = boids_cell_coord(pz, invRadius);
+
+		float n = 0, cenX = 0, cenY = 0, cenZ = 0, velX = 0, velY = 0, velZ = 0;
+		float sepX = 0, sepY = 0, sepZ = 0;
+
+		/* Neighboring cells may share a hash table entry; each entry
+		 * must only be visited once. */
+		unsigned int visited[27];
+		int visitedCount = 0;
+		for(int dz=-1; dz<=1; dz++)
+			for(int dy=-1; dy<=1; dy++)
+				for(int dx=-1; dx<=1; dx++)
+				{
+					unsigned int h = boids_hash(cx+dx, cy+dy, cz+dz, mask);
+					int seen = 0;
+					for(int k=0; k<visitedCount; k++)
+						if(visited[k] == h)
+							seen = 1;
+					if(seen)
+						continue;
+					visited[visitedCount++] = h;
+
+					/* The boids in an entry are contiguous, so this loop
+					 * reads each array sequentially. */
+					const unsigned int end = b->cellStart[h+1];
+					for(unsigned int j=b->cellStart[h]; j<end; j++)
+					{
+						float ox = sx[j]-px, oy = sy[j]-py, oz = sz[j]-pz;
+						float d2 = ox*ox + oy*oy + oz*oz;
+						if(d2 >= r2 || d2 == 0)
+							continue;
+						n += 1;
+						cenX += ox; cenY += oy; cenZ += oz;
+						velX += svx[j]; velY += svy[j]; velZ += svz[j];
+						if(d2 < sep2)
+						{
+							float push = 1.0f/d2;
+							sepX -= push*ox; sepY -= push*oy; sepZ -= push*oz;
+						}
+					}
+				}
+
+		float vx = svx[i], vy = svy[i], vz = svz[i];
+		float ax = 0, ay = 0, az = 0;
+		if(n > 0)
+		{
+			/* cen is the offset of the center of the neighbors from
+			 * this boid. */
+			float inv = 1.0f / n;
+			ax += b->cohesionWeight * cenX*inv + b->alignmentWeight * (velX*inv - vx);
+			ay += b->cohesionWeight * cenY*inv + b->alignmentWeight * (velY*inv - vy);
+			az += b->cohesionWeight * cenZ*inv + b->alignmentWeight * (velZ*inv - vz);
+		}
+		ax += b->separationWeight * sepX;
+		ay += b->separationWeight * sepY;
+		az += b->separationWeight * sepZ;
+
+		/* Steer back toward the bounds. */
+		if(px >  b->bounds[0]) ax -= b->boundsWeight;
+		if(px < -b->bounds[0]) ax += b->boundsWeight;
+		if(py >  b->bounds[1]) ay -= b->boundsWeight;
+		if(py < -b->bounds[1]) ay += b->boundsWeight;
+		if(pz >  b->bounds[2]) az -= b->boundsWeight;
+		if(pz < -b->bounds[2]) az += b->boundsWeight;
+
+		vx += dt*ax; vy += dt*ay; vz += dt*az;
+		float speed = sqrtf(vx*vx + vy*vy + vz*vz);
+		float scale = 1;
+		if(speed > b->maxSpeed)
+			scale = b->maxSpeed / speed;
+		else if(speed < b->minSpeed)
+			scale = speed > 0 ? b->minSpeed / speed : 0;
+		vx *= scale; vy *= scale; vz *= scale;
+		if(speed == 0)
+			vz = b->minSpeed;
+
+		b->vx[i] = vx; b->vy[i] = vy; b->vz[i] = vz;
+		b->x[i] = px + dt*vx;
+		b->y[i] = py + dt*vy;
+		b->z[i] = pz + dt*vz;
+
+		/* Point the model's +Z axis along the velocity. */
+		float forward[3] = { vx, vy, vz };
+		vec3f_normalize(forward);
+		float up[3] = { 0, 1, 0 };
+		float right[3];
+		vec3f_cross_new(right, up, forward);
+		if(vec3f_norm(right) < 1e-4f)
+			vec3f_set(right, 1, 0, 0);
+		vec3f_normalize(right);
+		vec3f_cross_new(up, forward, right);
+		float place[16] = { right[0],   right[1],   right[2],   0,
+		                    up[0],      up[1],      up[2],      0,
+		                    forward[0], forward[1], forward[2], 0,
+		                    b->x[i],    b->y[i],    b->z[i],    1 };
+		mat4f_mult_mat4f_new(b->matrices + 16*i, place, b->base);
+	}
+}
+
+/** Updates chunks from the current job until there are none left. */
+static void boids_work(void)
+{
+	int i;
+	while((i = __sync_fetch_and_add(&boids_job.next, 1)) < boids_job.chunks)
+	{
+		int first = i * BOIDS_CHUNK;
+		int last = first + BOIDS_CHUNK;
+		if(last > boids_job.b->count)
+			last = boids_job.b->count;
+		boids_update_range(boids_job.b, boids_job.dt, first, last);
+		__sync_fetch_and_add(&boids_job.finished, 1);
+	}
+}
+
+/** The main function of the worker threads used by boids_update(). */
+static void* boids_thread(void *arg)
+{
+	unsigned int generation = 0;
+	while(1)
+	{
+		pthread_mutex_lock(&boids_mutex);
+		while(boids_job.generation == generation)
+			pthread_cond_wait(&boids_start, &boids_mutex);
+		generation = boids_job.generation;
+		boids_job.active++;
+		pthread_mutex_unlock(&boids_mutex);
+
+		TRACE_BEGIN("boids_update worker");
+		boids_work();
+		TRACE_END();
+
+		pthread_mutex_lock(&boids_mutex);
+		boids_job.active--;
+		pthread_cond_signal(&boids_done);
+		pthread_mutex_unlock(&boids_mutex);
+	}
+	return NULL;
+}
+
+/** Starts the worker threads the first time boids_update() is
+ * called. */
+static void boids_threads_start(void)
+{
+	if(boids_threads >= 0)
+		return;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	const char *str = getenv("BOIDS_THREADS");
+	if(str != NULL && strlen(str) > 0)
+		threads = atoi(str);
+	if(threads < 0)
+		threads = 0;
+	if(threads > BOIDS_MAX_THREADS)
+		threads = BOIDS_MAX_THREADS;
+
+	boids_threads = 0;
+	for(long i=0; i<threads; i++)
+	{
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, boids_thread, NULL) != 0)
+		{
+			msg(WARNING, "Failed to create thread to update boids, using %d threads.\n", boids_threads);
+			break;
+		}
+		pthread_detach(thread);
+		boids_threads++;
+	}
+	msg(DEBUG, "Using %d worker threads to update boids.\n", boids_threads);
+}
+
+/** Sorts the boids into the hash table and copies their positions
+ * and velocities into b->sorted in that order. */
+static void boids_sort(boids *b)
+{
+	const float invRadius = 1.0f / b->radius;
+	const unsigned int mask = b->tableSize - 1;
+	unsigned int *start = b->cellStart;
+	memset(start, 0, sizeof(unsigned int)*(b->tableSize+1));
+	for(int i=0; i<b->count; i++)
+	{
+		b->cell[i] = boids_hash(boids_cell_coord(b->x[i], invRadius),
+		                        boids_cell_coord(b->y[i], invRadius),
+		                        boids_cell_coord(b->z[i], invRadius), mask);
+		start[b->cell[i]+1]++;
+	}
+	for(unsigned int h=0; h<b->tableSize; h++)
+		start[h+1] += start[h];
+
+	/* Use the start of each entry as the place to write the next boid
+	 * and shift the entries back afterwards. */
+	float *src[6] = { b->x, b->y, b->z, b->vx, b->vy, b->vz };
+	for(int i=0; i<b->count; i++)
+	{
+		unsigned int dest = start[b->cell[i]]++;
+		for(int k=0; k<6; k++)
+			b->sorted[k][dest] = src[k][i];
+	}
+	memmove(start+1, start, sizeof(unsigned int)*b->tableSize);
+	start[0] = 0;
+}
+
+/** Creates a flock with boids at random positions inside of the
+ * bounds moving in random directions.
+ *
+ * @param b The flock to initialize.
+ * @param count The number of boids.
+ */
+void boids_init(boids *b, int count)
+{
+	memset(b, 0, sizeof(boids));
+	b->radius = 2;
+	b->separation = .5;
+	b->cohesionWeight = 1;
+	b->alignmentWeight = 1;
+	b->separationWeight = 1.5;
+	b->boundsWeight = 2;
+	vec3f_set(b->bounds, 25, 25, 25);
+	b->minSpeed = 1;
+	b->maxSpeed = 4;
+	mat4f_identity(b->base);
+
+	if(count < 0)
+		count = 0;
+	b->count = count;
+	size_t size = sizeof(float)*(count > 0 ? count : 1);
+	b->x = kuhl_malloc(size);
+	b->y = kuhl_malloc(size);
+	b->z = kuhl_malloc(size);
+	b->vx = kuhl_malloc(size);
+	b->vy = kuhl_malloc(size);
+	b->vz = kuhl_malloc(size);
+	for(int k=0; k<6; k++)
+		b->sorted[k] = kuhl_malloc(size);
+	b->matrices = kuhl_malloc(size*16);
+	b->cell = kuhl_malloc(sizeof(unsigned int)*(count > 0 ? count : 1));
+
+	/* About half of the entries in the hash table are used. */
+	b->tableSize = 1;
+	while(b->tableSize < 2*(unsigned int)count)
+		b->tableSize *= 2;
+	b->cellStart = kuhl_malloc(sizeof(unsigned int)*(b->tableSize+1));
+
+	for(int i=0; i<count; i++)
+	{
+		b->x[i] = (drand48()*2-1) * b->bounds[0];
+		b->y[i] = (drand48()*2-1) * b->bounds[1];
+		b->z[i] = (drand48()*2-1) * b->bounds[2];
+		b->vx[i] = drand48()*2-1;
+		b->vy[i] = drand48()*2-1;
+		b->vz[i] = drand48()*2-1;
+	}
+	for(int i=0; i<count; i++)
+		mat4f_translate_new(b->matrices+16*i, b->x[i], b->y[i], b->z[i]);
+}
+
+/** Moves the boids forward in time and calculates their matrices.
+ *
+ * @param b The flock.
+ * @param dt The amount of time (in seconds) to move the boids forward.
+ */
+void boids_update(boids *b, float dt)
+{
+	if(b->count == 0 || b->radius <= 0)
+		return;
+	TRACE_SCOPE("boids_update");
+	boids_threads_start();
+	boids_sort(b);
+
+	pthread_mutex_lock(&boids_mutex);
+	boids_job.b = b;
+	boids_job.dt = dt;
+	boids_job.chunks = (b->count + BOIDS_CHUNK - 1) / BOIDS_CHUNK;
+	boids_job.next = 0;
+	boids_job.finished = 0;
+	if(boids_threads > 0 && boids_job.chunks > 1)
+	{
+		boids_job.generation++;
+		pthread_cond_broadcast(&boids_start);
+	}
+	pthread_mutex_unlock(&boids_mutex);
+
+	/* The calling thread helps and then waits until all chunks are
+	 * finished and no worker is still looking at this job. */
+	boids_work();
+	pthread_mutex_lock(&boids_mutex);
+	while(__sync_fetch_and_add(&boids_job.finished, 0) < boids_job.chunks ||
+	      boids_job.active > 0)
+		pthread_cond_wait(&boids_done, &boids_mutex);
+	pthread_mutex_unlock(&boids_mutex);
+}
+
+/** Frees the memory used by a flock. */
+void boids_free(boids *b)
+{
+	free(b->x); free(b->y); free(b->z);
+	free(b->vx); free(b->vy); free(b->vz);
+	for(int k=0; k<6; k++)
+		free(b->sorted[k]);
+	free(b->matrices);
+	free(b->cell);
+	free(b->cellStart);
+	memset(b, 0, sizeof(boids));
+}
@@ -0,0 +1,82 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    boids simulates a flock of birds (or a school of fish) with
+    Reynolds' rules: each boid steers toward the center of its
+    neighbors (cohesion), toward their average heading (alignment)
+    and away from neighbors that are too close (separation). For
+    example:
+
+    <pre>
+    boids flock;
+    boids_init(&flock, 10000);
+    for(int i=0; i<flock.count; i++)
+        place boid i at (flock.x[i], flock.y[i], flock.z[i])
+    ...
+    // every frame:
+    boids_update(&flock, dt);
+    kuhl_geometry_instance_attrib(modelgeom, flock.matrices, 16, flock.count,
+                                  "in_InstanceMat", KG_FULL_LIST);
+    kuhl_geometry_draw(modelgeom);
+    </pre>
+
+    Positions and velocities are stored as separate arrays of x, y
+    and z values. Neighbors are found with a uniform grid that has
+    cells the size of the neighborhood, so only boids in the 27 cells
+    around a boid are checked. The grid is stored in a hash table, so
+    the flock can spread out without using more memory. Each update
+    sorts the boids by cell so that the boids in a cell are next to
+    each other in the arrays; the index of a boid changes from one
+    update to the next.
+
+    The boids are updated by several threads. The number of threads
+    can be set with the BOIDS_THREADS environment variable (0 updates
+    all boids on the calling thread).
+
+    @author Scott Kuhl
+ */
+
+#ifndef __BOIDS_H__
+#define __BOIDS_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A flock of boids. Create with boids_init(). The fields up to
+ * count may be changed at any time. */
+typedef struct
+{
+	float radius; /**< Boids closer than this are neighbors (default is 2) */
+	float separation; /**< Neighbors closer than this are pushed away (default is .5) */
+	float cohesionWeight; /**< Steering toward the center of the neighbors (default is 1) */
+	float alignmentWeight; /**< Steering toward the heading of the neighbors (default is 1) */
+	float separationWeight; /**< Steering away from close neighbors (default is 1.5) */
+	float boundsWeight; /**< Steering back toward the bounds (default is 2) */
+	float bounds[3]; /**< Boids are steered back when they are farther than this from the origin on each axis (default is 25) */
+	float minSpeed, maxSpeed; /**< Range of speeds (default is 1 to 4) */
+	float base[16]; /**< Matrix applied to the model before it is placed at a boid (default is identity) */
+
+	int count; /**< Number of boids */
+	float *x, *y, *z; /**< Position of each boid */
+	float *vx, *vy, *vz; /**< Velocity of each boid */
+	float *matrices; /**< Model matrix of each boid (16 floats each; +Z of the model points along the velocity), set by boids_update() */
+
+	float *sorted[6]; /**< Positions and velocities sorted by cell */
+	unsigned int *cell; /**< Hash of the cell that each boid is in */
+	unsigned int *cellStart; /**< First sorted boid in each hash table entry (tableSize+1 entries) */
+	unsigned int tableSize; /**< Number of entries in the hash table (a power of 2) */
+} boids;
+
+void boids_init(boids *b, int count);
+void boids_update(boids *b, float dt);
+void boids_free(boids *b);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+#endif // __BOIDS_H__
@@ -0,0 +1,707 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ *
+ * Builds and queries bounding volume hierarchies over kuhl_geometry
+ * lists. See bvh.h for details.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include <GL/glew.h>
+
+#include "bvh.h"
+#include "kuhl-nodep.h"
+#include "vecmat.h"
+#include "msg.h"
+
+#define BVH_LEAF_SIZE 4 /**< Maximum number of items in a leaf */
+#define BVH_STACK 64 /**< Maximum depth of a tree (a tree with median splits never gets close) */
+
+
+/** Reads the "in_Position" attribute and the indices of a geometry
+ * back from the buffers that they are stored in.
+ *
+ * @param geom The geometry to read.
+ *
+ * @param positions Set to a newly allocated array of 3 floats per
+ * vertex.
+ *
+ * @param indices Set to a newly allocated array of indices or NULL if
+ * the geometry has no indices.
+ *
+ * @return The number of vertices, 0 if the geometry has no positions.
+ */
+static GLuint bvh_read_geometry(kuhl_geometry *geom, float **positions, GLuint **indices)
+{
+	*positions = NULL;
+	*indices = NULL;
+
+	kuhl_attrib *attrib = NULL;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+		if(geom->attribs[i].divisor == 0 && strcmp(geom->attribs[i].name, "in_Position") == 0)
+			attrib = &(geom->attribs[i]);
+	if(attrib == NULL || attrib->components < 2 || geom->vertex_count == 0)
+		return 0;
+
+	glBindVertexArray(0);
+	/* Buffers can't be read while kuhl_geometry_attrib_get() has
+	 * them mapped. */
+	kuhl_geometry_unmap(geom);
+	glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+
+	GLsizeiptr attribBytes = sizeof(GLfloat)*attrib->components;
+	GLsizeiptr stride = attrib->stride ? attrib->stride : attribBytes;
+	GLsizeiptr start = stride*geom->base_vertex + attrib->offset;
+	GLsizeiptr length = stride*(geom->vertex_count-1) + attribBytes;
+	char *raw = kuhl_malloc(length);
+	glGetBufferSubData(GL_ARRAY_BUFFER, start, length, raw);
+
+	float *pos = kuhl_malloc(sizeof(float)*3*geom->vertex_count);
+	for(GLuint v=0; v<geom->vertex_count; v++)
+	{
+		const GLfloat *src = (const GLfloat*) (raw + v*stride);
+		pos[v*3+0] = src[0];
+		pos[v*3+1] = src[1];
+		pos[v*3+2] = attrib->components > 2 ? src[2] : 0;
+	}
+	free(raw);
+
+	if(geom->indices_len > 0 && glIsBuffer(geom->indices_bufferobject))
+	{
+		*indices = kuhl_malloc(sizeof(GLuint)*geom->indices_len);
+		glBindBuffer(GL_ARRAY_BUFFER, geom->indices_bufferobject);
+		if(geom->indices_type == GL_UNSIGNED_SHORT)
+		{
+			/* Widen 16-bit indices (see kuhl_geometry_indices()). */
+			GLushort *shortIndices = kuhl_malloc(sizeof(GLushort)*geom->indices_len);
+			glGetBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLushort)*geom->indices_len, shortIndices);
+			for(GLuint i=0; i<geom->indices_len; i++)
+				(*indices)[i] = shortIndices[i];
+			free(shortIndices);
+		}
+		else
+			glGetBufferSubData(GL_ARRAY_BUFFER, sizeof(GLuint)*geom->first_index,
+			                   sizeof(GLuint)*geom->indices_len, *indices);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_errorcheck();
+
+	*positions = pos;
+	return geom->vertex_count;
+}
+
+/** Copies the triangles of a geometry into the tree.
+ *
+ * @return The number of triangles that were added.
+ */
+static int bvh_add_triangles(bvh_tree *tree, kuhl_geometry *geom, int *capacity)
+{
+	if(geom->primitive_type != GL_TRIANGLES)
+		return 0;
+#ifdef KUHL_UTIL_USE_ASSIMP
+	if(geom->bones != NULL)
+		return 0;
+#endif
+
+	float *pos;
+	GLuint *indices;
+	GLuint vertexCount = bvh_read_geometry(geom, &pos, &indices);
+	if(vertexCount == 0)
+		return 0;
+
+	GLuint indexCount = indices ? geom->indices_len : vertexCount;
+	int count = indexCount / 3;
+	if(tree->triangle_count + count > *capacity)
+	{
+		*capacity = (tree->triangle_count + count) * 2;
+		tree->triangles = realloc(tree->triangles, sizeof(float)*9*(*capacity));
+	}
+
+	float *dest = tree->triangles + 9*tree->triangle_count;
+	for(int t=0; t<count; t++)
+	{
+		for(int v=0; v<3; v++)
+		{
+			GLuint index = indices ? indices[t*3+v] : (GLuint) (t*3+v);
+			if(index >= vertexCount)
+				index = 0;
+			memcpy(dest + t*9 + v*3, pos + index*3, sizeof(float)*3);
+		}
+	}
+	free(pos);
+	free(indices);
+	tree->triangle_count += count;
+	return count;
+}
+
+/** Expands box a so that it contains box b. */
+static void bvh_box_union(float a[6], const float b[6])
+{
+	for(int i=0; i<3; i++)
+	{
+		if(b[i*2] < a[i*2])
+			a[i*2] = b[i*2];
+		if(b[i*2+1] > a[i*2+1])
+			a[i*2+1] = b[i*2+1];
+	}
+}
+
+/** Sets a box to be empty. */
+static void bvh_box_empty(float box[6])
+{
+	for(int i=0; i<3; i++)
+	{
+		box[i*2] = FLT_MAX;
+		box[i*2+1] = -FLT_MAX;
+	}
+}
+
+/** Twice the center of an item's box along an axis. */
+static float bvh_centroid(const bvh_item *item, int axis)
+{
+	return item->box[axis*2] + item->box[axis*2+1];
+}
+
+/** Reorders items so that the k'th item is the one that would be
+ * there if the items were sorted by centroid and no item before it
+ * has a larger centroid (i.e., std::nth_element()). */
+static void bvh_select(bvh_item *items, int count, int k, int axis)
+{
+	int left = 0, right = count-1;
+	while(left < right)
+	{
+		float pivot = bvh_centroid(&items[(left+right)/2], axis);
+		int i = left, j = right;
+		while(i <= j)
+		{
+			while(bvh_centroid(&items[i], axis) < pivot) i++;
+			while(bvh_centroid(&items[j], axis) > pivot) j--;
+			if(i <= j)
+			{
+				bvh_item tmp = items[i];
+				items[i] = items[j];
+				items[j] = tmp;
+				i++;
+				j--;
+			}
+		}
+		if(k <= j)
+			right = j;
+		else if(k >= i)
+			left = i;
+		else
+			break;
+	}
+}
+
+/** Creates the node for a range of items and, recursively, the nodes
+ * below it. The items are split in half along the longest axis of
+ * their centroids.
+ *
+ * @return The index of the new node.
+ */
+static int bvh_build_node(bvh_tree *tree, int first, int count)
+{
+	int index = tree->node_count++;
+	bvh_node *node = &(tree->nodes[index]);
+	bvh_box_empty(node->box);
+	float centroids[6];
+	bvh_box_empty(centroids);
+	for(int i=first; i<first+count; i++)
+	{
+		bvh_box_union(node->box, tree->items[i].box);
+		for(int a=0; a<3; a++)
+		{
+			float c = bvh_centroid(&tree->items[i], a);
+			float cbox[6] = { c, c, c, c, c, c };
+			bvh_box_union(centroids, cbox);
+		}
+	}
+
+	node->first = first;
+	node->count = count;
+	node->right = -1;
+	if(count <= BVH_LEAF_SIZE)
+		return index;
+
+	int axis = 0;
+	for(int a=1; a<3; a++)
+		if(centroids[a*2+1]-centroids[a*2] > centroids[axis*2+1]-centroids[axis*2])
+			axis = a;
+
+	int half = count / 2;
+	bvh_select(tree->items + first, count, half, axis);
+	node->count = 0;
+	bvh_build_node(tree, first, half);
+	int right = bvh_build_node(tree, first+half, count-half);
+	node->right = right;
+	return index;
+}
+
+/** Computes the world-space boxes of the items.
+ *
+ * @param force Process all geometry even if its matrix didn't change.
+ *
+ * @return 1 if any box changed.
+ */
+static int bvh_update_items(bvh_tree *tree, int force)
+{
+	char *changed = calloc(tree->geom_count, 1);
+	int anyChanged = 0;
+	for(int g=0; g<tree->geom_count; g++)
+	{
+		float world[16];
+		mat4f_mult_mat4f_new(world, tree->matrix, tree->geoms[g]->matrix);
+		if(!force && memcmp(world, tree->geom_matrix[g], sizeof(world)) == 0)
+			continue;
+		mat4f_copy(tree->geom_matrix[g], world);
+		changed[g] = 1;
+		anyChanged = 1;
+
+		int first = tree->geom_triangles[g];
+		int count = tree->geom_triangles[g+1] - first;
+		if(count > 0)
+			mat4f_mult_point3f_batch(tree->world + first*9, world, tree->triangles + first*9, count*3);
+	}
+
+	for(int i=0; anyChanged && i<tree->item_count; i++)
+	{
+		bvh_item *item = &(tree->items[i]);
+		if(!changed[item->geom])
+			continue;
+		if(item->triangle < 0)
+		{
+			memcpy(item->box, tree->geoms[item->geom]->aabbox, sizeof(float)*6);
+			kuhl_bbox_transform(item->box, tree->geom_matrix[item->geom]);
+			continue;
+		}
+		const float *v = tree->world + 9*(tree->geom_triangles[item->geom] + item->triangle);
+		for(int a=0; a<3; a++)
+		{
+			item->box[a*2]   = fminf(v[a], fminf(v[3+a], v[6+a]));
+			item->box[a*2+1] = fmaxf(v[a], fmaxf(v[3+a], v[6+a]));
+		}
+	}
+	free(changed);
+	return anyChanged;
+}
+
+/** Builds a bounding volume hierarchy over a kuhl_geometry list.
+ *
+ * @param tree The tree to create. Free it with bvh_free().
+ *
+ * @param geom The geometry list (for example, from kuhl_load_model()).
+ *
+ * @param matrix A matrix to apply to all of the geometry (for
+ * example, the model matrix) or NULL for the identity matrix.
+ *
+ * @param options BVH_MESHES or BVH_TRIANGLES.
+ *
+ * @return 1 if the tree contains at least one item, 0 otherwise.
+ */
+int bvh_build(bvh_tree *tree, kuhl_geometry *geom, const float matrix[16], int options)
+{
+	memset(tree, 0, sizeof(bvh_tree));
+	if(matrix != NULL)
+		mat4f_copy(tree->matrix, matrix);
+	else
+		mat4f_identity(tree->matrix);
+
+	tree->geom_count = kuhl_geometry_count(geom);
+	if(tree->geom_count == 0)
+		return 0;
+	tree->geoms = kuhl_malloc(sizeof(kuhl_geometry*)*tree->geom_count);
+	tree->geom_matrix = kuhl_malloc(sizeof(float)*16*tree->geom_count);
+	tree->geom_triangles = kuhl_malloc(sizeof(int)*(tree->geom_count+1));
+
+	int capacity = 0;
+	int itemCapacity = 0;
+	int g = 0;
+	for(kuhl_geometry *cur = geom; cur != NULL; cur = cur->next, g++)
+	{
+		tree->geoms[g] = cur;
+		tree->geom_triangles[g] = tree->triangle_count;
+		int count = 0;
+		if(options & BVH_TRIANGLES)
+			count = bvh_add_triangles(tree, cur, &capacity);
+		/* Geometry without triangles is stored as its box (if it has
+		 * one). */
+		if(count == 0 && cur->aabbox[0] > cur->aabbox[1])
+			continue;
+
+		int itemCount = count > 0 ? count : 1;
+		if(tree->item_count + itemCount > itemCapacity)
+		{
+			itemCapacity = (tree->item_count + itemCount) * 2;
+			tree->items = realloc(tree->items, sizeof(bvh_item)*itemCapacity);
+		}
+		for(int i=0; i<itemCount; i++)
+		{
+			bvh_item *item = &(tree->items[tree->item_count++]);
+			item->geom = g;
+			item->triangle = count > 0 ? i : -1;
+		}
+	}
+	tree->geom_triangles[tree->geom_count] = tree->triangle_count;
+	if(tree->triangle_count > 0)
+		tree->world = kuhl_malloc(sizeof(float)*9*tree->triangle_count);
+
+	if(tree->item_count == 0)
+	{
+		msg(WARNING, "None of the %d geometry objects have any triangles or bounding boxes.\n", tree->geom_count);
+		return 0;
+	}
+
+	bvh_update_items(tree, 1);
+	tree->nodes = kuhl_malloc(sizeof(bvh_node)*(2*tree->item_count));
+	bvh_build_node(tree, 0, tree->item_count);
+	msg(DEBUG, "Built BVH with %d nodes over %d items (%d triangles) from %d geometry objects.\n",
+	    tree->node_count, tree->item_count, tree->triangle_count, tree->geom_count);
+	return 1;
+}
+
+/** Updates the boxes in a tree after the geometry moved (i.e., after
+ * the matrices in the kuhl_geometry structs changed) without
+ * changing the structure of the tree. Only geometry whose matrix
+ * changed is transformed again. The tree should be rebuilt if the
+ * geometry moves so far that the boxes overlap a lot.
+ *
+ * @param tree The tree to refit.
+ *
+ * @param matrix A new matrix to apply to all of the geometry or NULL
+ * to keep using the previous matrix.
+ */
+void bvh_refit(bvh_tree *tree, const float matrix[16])
+{
+	if(tree->node_count == 0)
+		return;
+	if(matrix != NULL)
+		mat4f_copy(tree->matrix, matrix);
+	if(!bvh_update_items(tree, 0))
+		return;
+
+	/* Children always have larger indices than their parents. */
+	for(int n=tree->node_count-1; n>=0; n--)
+	{
+		bvh_node *node = &(tree->nodes[n]);
+		bvh_box_empty(node->box);
+		if(node->count > 0)
+		{
+			for(int i=node->first; i<node->first+node->count; i++)
+				bvh_box_union(node->box, tree->items[i].box);
+		}
+		else
+		{
+			bvh_box_union(node->box, tree->nodes[n+1].box);
+			bvh_box_union(node->box, tree->nodes[node->right].box);
+		}
+	}
+}
+
+/** Frees the memory used by a tree. The geometry is not changed. */
+void bvh_free(bvh_tree *tree)
+{
+	free(tree->nodes);
+	free(tree->items);
+	free(tree->geoms);
+	free(tree->geom_matrix);
+	free(tree->geom_triangles);
+	free(tree->triangles);
+	free(tree->world);
+	memset(tree, 0, sizeof(bvh_tree));
+}
+
+/** Checks if two boxes overlap. */
+static int bvh_box_overlap(const float a[6], const float b[6])
+{
+	for(int i=0; i<3; i++)
+		if(a[i*2] > b[i*2+1] || a[i*2+1] < b[i*2])
+			return 0;
+	return 1;
+}
+
+/** Finds the items whose boxes overlap a box. Triangles are only
+ * tested with their bounding boxes, so a triangle may be returned if
+ * it is near the box but doesn't intersect it.
+ *
+ * @param tree The tree to search.
+ *
+ * @param box A world-space box (xmin, xmax, ymin, ymax, zmin, zmax).
+ *
+ * @param hits An array to store the items that overlap the box in
+ * (only the geom and triangle fields are set). May be NULL.
+ *
+ * @param maxHits The length of the hits array.
+ *
+ * @return The number of items that overlap the box. This may be
+ * larger than maxHits.
+ */
+int bvh_overlap(const bvh_tree *tree, const float box[6], bvh_hit *hits, int maxHits)
+{
+	if(tree->node_count == 0)
+		return 0;
+
+	int found = 0;
+	int stack[BVH_STACK];
+	int depth = 0;
+	stack[depth++] = 0;
+	while(depth > 0)
+	{
+		const bvh_node *node = &(tree->nodes[stack[--depth]]);
+		if(!bvh_box_overlap(node->box, box))
+			continue;
+		if(node->count == 0)
+		{
+			stack[depth++] = node->right;
+			stack[depth++] = (int) (node - tree->nodes) + 1;
+			continue;
+		}
+		for(int i=node->first; i<node->first+node->count; i++)
+		{
+			const bvh_item *item = &(tree->items[i]);
+			if(!bvh_box_overlap(item->box, box))
+				continue;
+			if(hits != NULL && found < maxHits)
+			{
+				memset(&hits[found], 0, sizeof(bvh_hit));
+				hits[found].geom = tree->geoms[item->geom];
+				hits[found].triangle = item->triangle;
+			}
+			found++;
+		}
+	}
+	return found;
+}
+
+/** Intersects a ray with a box.
+ *
+ * @param tmin Set to the distance where the ray enters the box (0 if
+ * the ray starts inside of the box).
+ *
+ * @param axis Set to the axis of the face that the ray enters through
+ * (-1 if the ray starts inside of the box). May be NULL.
+ *
+ * @return 1 if the ray hits the box before maxDistance.
+ */
+static int bvh_ray_box(const float box[6], const float origin[3], const float invDir[3],
+                       float maxDistance, float *tmin, int *axis)
+{
+	float tnear = 0, tfar = maxDistance;
+	int nearAxis = -1;
+	for(int a=0; a<3; a++)
+	{
+		/* A ray parallel to the slab would produce 0*inf if the
+		 * origin is on the edge of the box. */
+		if(isinf(invDir[a]))
+		{
+			if(origin[a] < box[a*2] || origin[a] > box[a*2+1])
+				return 0;
+			continue;
+		}
+		float t1 = (box[a*2]   - origin[a]) * invDir[a];
+		float t2 = (box[a*2+1] - origin[a]) * invDir[a];
+		float lo = fminf(t1, t2), hi = fmaxf(t1, t2);
+		if(lo > tnear)
+		{
+			tnear = lo;
+			nearAxis = a;
+		}
+		if(hi < tfar)
+			tfar = hi;
+		if(tnear > tfar)
+			return 0;
+	}
+	*tmin = tnear;
+	if(axis != NULL)
+		*axis = nearAxis;
+	return 1;
+}
+
+/** Intersects a ray with a triangle (Moller-Trumbore). Both sides of
+ * the triangle can be hit.
+ *
+ * @return 1 if the ray hits the triangle before maxDistance.
+ */
+static int bvh_ray_triangle(const float v[9], const float origin[3], const float dir[3],
+                            float maxDistance, float *t)
+{
+	float e1[3], e2[3], p[3], s[3], q[3];
+	vec3f_sub_new(e1, v+3, v);
+	vec3f_sub_new(e2, v+6, v);
+	vec3f_cross_new(p, dir, e2);
+	float det = vec3f_dot(e1, p);
+	if(fabsf(det) < 1e-12f)
+		return 0;
+	float inv = 1.0f / det;
+	vec3f_sub_new(s, origin, v);
+	float u = vec3f_dot(s, p) * inv;
+	if(u < 0 || u > 1)
+		return 0;
+	vec3f_cross_new(q, s, e1);
+	float w = vec3f_dot(dir, q) * inv;
+	if(w < 0 || u + w > 1)
+		return 0;
+	float dist = vec3f_dot(e2, q) * inv;
+	if(dist < 0 || dist > maxDistance)
+		return 0;
+	*t = dist;
+	return 1;
+}
+
+/** Traverses the tree with a ray. See bvh_ray_nearest(). If hit is
+ * NULL, the search stops at the first hit. */
+static int bvh_ray(const bvh_tree *tree, const float origin[3], const float direction[3],
+                   float maxDistance, bvh_hit *hit)
+{
+	if(tree->node_count == 0)
+		return 0;
+
+	float dir[3];
+	vec3f_normalize_new(dir, direction);
+	if(!isfinite(dir[0]) || !isfinite(dir[1]) || !isfinite(dir[2]))
+		return 0;
+	float invDir[3];
+	for(int a=0; a<3; a++)
+		invDir[a] = 1.0f / dir[a];
+
+	float best = maxDistance;
+	int bestItem = -1, bestAxis = -1;
+	int stack[BVH_STACK];
+	int depth = 0;
+	stack[depth++] = 0;
+	while(depth > 0)
+	{
+		int index = stack[--depth];
+		const bvh_node *node = &(tree->nodes[index]);
+		float t;
+		if(!bvh_ray_box(node->box, origin, invDir, best, &t, NULL))
+			continue;
+
+		if(node->count == 0)
+		{
+			/* Visit the nearer child first so that best shrinks
+			 * quickly. */
+			int a = index+1, b = node->right;
+			float ta, tb;
+			int hitA = bvh_ray_box(tree->nodes[a].box, origin, invDir, best, &ta, NULL);
+			int hitB = bvh_ray_box(tree->nodes[b].box, origin, invDir, best, &tb, NULL);
+			if(hitA && hitB && tb < ta)
+			{
+				stack[depth++] = a;
+				stack[depth++] = b;
+			}
+			else
+			{
+				if(hitB) stack[depth++] = b;
+				if(hitA) stack[depth++] = a;
+			}
+			continue;
+		}
+
+		for(int i=node->first; i<node->first+node->count; i++)
+		{
+			const bvh_item *item = &(tree->items[i]);
+			int axis = -1;
+			if(item->triangle < 0)
+			{
+				if(!bvh_ray_box(item->box, origin, invDir, best, &t, &axis))
+					continue;
+			}
+			else
+			{
+				const float *v = tree->world + 9*(tree->geom_triangles[item->geom] + item->triangle);
+				if(!bvh_ray_triangle(v, origin, dir, best, &t))
+					continue;
+			}
+			if(hit == NULL)
+				return 1;
+			best = t;
+			bestItem = i;
+			bestAxis = axis;
+		}
+	}
+
+	if(bestItem < 0)
+		return 0;
+
+	const bvh_item *item = &(tree->items[bestItem]);
+	hit->geom = tree->geoms[item->geom];
+	hit->triangle = item->triangle;
+	hit->distance = best;
+	for(int a=0; a<3; a++)
+		hit->point[a] = origin[a] + dir[a]*best;
+	if(item->triangle >= 0)
+	{
+		const float *v = tree->world + 9*(tree->geom_triangles[item->geom] + item->triangle);
+		float e1[3], e2[3];
+		vec3f_sub_new(e1, v+3, v);
+		vec3f_sub_new(e2, v+6, v);
+		vec3f_cross_new(hit->normal, e1, e2);
+		vec3f_normalize(hit->normal);
+		/* Make the normal face the ray */
+		if(vec3f_dot(hit->normal, dir) > 0)
+			vec3f_scalarMult(hit->normal, -1);
+	}
+	else if(bestAxis >= 0)
+	{
+		vec3f_set(hit->normal, 0, 0, 0);
+		hit->normal[bestAxis] = dir[bestAxis] > 0 ? -1 : 1;
+	}
+	else // ray started inside of the box
+		vec3f_scalarMult_new(hit->normal, dir, -1);
+	return 1;
+}
+
+/** Checks if a ray hits anything in the tree. This is faster than
+ * bvh_ray_nearest() because the search stops at the first hit.
+ *
+ * @param tree The tree to search.
+ *
+ * @param origin The world-space start of the ray.
+ *
+ * @param direction The direction of the ray (does not need to be
+ * normalized).
+ *
+ * @param maxDistance Items further than this distance from the
+ * origin are ignored. Use FLT_MAX to search the entire ray.
+ *
+ * @return 1 if the ray hits an item, 0 otherwise.
+ */
+int bvh_ray_any(const bvh_tree *tree, const float origin[3], const float direction[3], float maxDistance)
+{
+	return bvh_ray(tree, origin, direction, maxDistance, NULL);
+}
+
+/** Finds the first item that a ray hits. Items stored as boxes are
+ * hit where the ray enters the box (or at the origin of the ray if
+ * it starts inside of the box).
+ *
+ * @param tree The tree to search.
+ *
+ * @param origin The world-space start of the ray.
+ *
+ * @param direction The direction of the ray (does not need to be
+ * normalized).
+ *
+ * @param maxDistance Items further than this distance from the
+ * origin are ignored. Use FLT_MAX to search the entire ray.
+ *
+ * @param hit Filled in with information about the closest hit.
+ *
+ * @return 1 if the ray hits an item, 0 otherwise (hit is not changed).
+ */
+int bvh_ray_nearest(const bvh_tree *tree, const float origin[3], const float direction[3], float maxDistance, bvh_hit *hit)
+{
+	if(hit == NULL)
+		return bvh_ray_any(tree, origin, direction, maxDistance);
+	return bvh_ray(tree, origin, direction, maxDistance, hit);
+}
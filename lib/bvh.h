@@ -0,0 +1,109 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    bvh builds a bounding volume hierarchy (a tree of axis-aligned
+    bounding boxes) over a kuhl_geometry list so that a whole model
+    can be tested against a box or a ray without testing every
+    mesh. For example:
+
+    <pre>
+    bvh_tree tree;
+    bvh_build(&tree, modelgeom, modelMatrix, BVH_TRIANGLES);
+    bvh_hit hit;
+    if(bvh_ray_nearest(&tree, origin, direction, 100, &hit))
+        printf("Hit triangle %d at distance %f\n", hit.triangle, hit.distance);
+    </pre>
+
+    A tree contains either one item for each kuhl_geometry (the
+    default) or, with BVH_TRIANGLES, one item for each triangle. The
+    triangles are read from the "in_Position" attribute of geometry
+    drawn with GL_TRIANGLES; other geometry is stored as a single
+    box. Geometry with bones is stored with the box of its bind pose
+    because kuhl_update_model() moves its vertices on the GPU.
+
+    All queries are performed in world coordinates: each geometry is
+    transformed by the matrix passed to bvh_build() or bvh_refit() and
+    then by the geometry's own matrix. When geometry moves (for
+    example, after kuhl_update_model()), call bvh_refit() to update
+    the boxes without rebuilding the tree. Only geometry whose matrix
+    changed is processed again.
+
+    @author Scott Kuhl
+ */
+
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include "kuhl-util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Options for bvh_build() */
+enum
+{
+	BVH_MESHES = 0, /**< Store one item for each kuhl_geometry */
+	BVH_TRIANGLES = 1 /**< Store one item for each triangle */
+};
+
+/** A node in a bvh_tree. Nodes are stored in depth-first order: the
+ * first child of a node immediately follows it. */
+typedef struct
+{
+	float box[6]; /**< World-space bounding box (xmin, xmax, ymin, ...) */
+	int right; /**< Index of the second child (interior nodes only) */
+	int first; /**< Index of the first item (leaves only) */
+	int count; /**< Number of items in a leaf, 0 for interior nodes */
+} bvh_node;
+
+/** A mesh or a triangle stored in a bvh_tree. */
+typedef struct
+{
+	float box[6]; /**< World-space bounding box */
+	int geom; /**< Index into the tree's geoms array */
+	int triangle; /**< Triangle index in the geometry, -1 if the item is the geometry's box */
+} bvh_item;
+
+/** A bounding volume hierarchy. Create with bvh_build(). */
+typedef struct
+{
+	bvh_node *nodes;
+	int node_count;
+	bvh_item *items;
+	int item_count;
+	kuhl_geometry **geoms; /**< The geometry in the tree */
+	float (*geom_matrix)[16]; /**< World matrix of each geometry when the tree was last refit */
+	int *geom_triangles; /**< Index of the first triangle of each geometry (geom_count+1 entries). Geometry without triangles is stored as a box. */
+	int geom_count;
+	float *triangles; /**< Object-space vertices, 9 floats per triangle */
+	float *world; /**< World-space vertices, 9 floats per triangle */
+	int triangle_count;
+	float matrix[16]; /**< Matrix applied before each geometry's own matrix */
+} bvh_tree;
+
+/** The result of a query. */
+typedef struct
+{
+	kuhl_geometry *geom; /**< The geometry that was hit */
+	int triangle; /**< The triangle that was hit, -1 if the geometry's box was hit */
+	float distance; /**< Distance along the ray (ray queries only) */
+	float point[3]; /**< World-space point that was hit (ray queries only) */
+	float normal[3]; /**< Normal of the triangle or box face that was hit (ray queries only) */
+} bvh_hit;
+
+int bvh_build(bvh_tree *tree, kuhl_geometry *geom, const float matrix[16], int options);
+void bvh_refit(bvh_tree *tree, const float matrix[16]);
+void bvh_free(bvh_tree *tree);
+int bvh_overlap(const bvh_tree *tree, const float box[6], bvh_hit *hits, int maxHits);
+int bvh_ray_any(const bvh_tree *tree, const float origin[3], const float direction[3], float maxDistance);
+int bvh_ray_nearest(const bvh_tree *tree, const float origin[3], const float direction[3], float maxDistance, bvh_hit *hit);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+#endif // __BVH_H__
@@ -0,0 +1,539 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ *
+ * Reads the window back through a ring of pixel buffer objects and
+ * encodes the images on background threads. See capture.h for
+ * details.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h> // sysconf()
+#include <pthread.h>
+
+#include <GL/glew.h>
+#ifdef __APPLE__
+#include <GLUT/glut.h>
+#else
+#include <GL/freeglut.h>
+#endif
+
+#include "capture.h"
+#include "kuhl-util.h"
+#include "kuhl-nodep.h"
+#include "msg.h"
+#include "trace.h"
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+#include "imageio.h"
+#else
+#include "stb_image_write.h"
+#endif
+
+#define CAPTURE_SLOTS 3 /**< Number of pixel buffer objects that frames are read into */
+#define CAPTURE_MAX_JOBS 16 /**< Number of frames that can wait to be encoded before capture_frame() blocks */
+#define CAPTURE_MAX_THREADS 4 /**< Default maximum number of encoding threads */
+
+/** A frame that has been read back and is waiting to be written. */
+typedef struct capture_job
+{
+	unsigned char *data; /**< RGB pixels, bottom row first (NULL if the readback failed) */
+	int width, height;
+	char *filename; /**< File to write, NULL to write to the pipe */
+	long seq; /**< Order of the frame in the pipe */
+	struct capture_job *next;
+} capture_job;
+
+/** A pixel buffer object that a frame is read into. */
+typedef struct
+{
+	GLuint pbo;
+	GLsizeiptr size; /**< Size of pbo in bytes */
+	GLsync fence; /**< Signaled when the frame has been copied into pbo */
+	int busy; /**< 1 if the slot contains a frame that hasn't been collected */
+	int width, height;
+	char *filename;
+	long seq;
+} capture_slot;
+
+static capture_slot capture_slots[CAPTURE_SLOTS];
+static int capture_next_slot = 0; /**< Slot to use next (also the oldest busy slot) */
+
+static capture_job *capture_head = NULL, *capture_tail = NULL;
+static int capture_queued = 0; /**< Number of jobs in the list */
+static int capture_active = 0; /**< Number of jobs being encoded */
+static int capture_threads = 0; /**< Number of threads started */
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER; /**< Protects the job list and the pipe sequence number */
+static pthread_cond_t capture_work_cond = PTHREAD_COND_INITIALIZER; /**< Signaled when a job is added */
+static pthread_cond_t capture_done_cond = PTHREAD_COND_INITIALIZER; /**< Signaled when a job is removed or finished */
+static pthread_cond_t capture_pipe_cond = PTHREAD_COND_INITIALIZER; /**< Signaled when a frame is written to the pipe */
+
+static FILE *capture_pipe = NULL;
+static int capture_pipe_width = 0, capture_pipe_height = 0;
+static long capture_pipe_seq = 0; /**< Sequence number of the next frame captured for the pipe */
+static long capture_pipe_next = 0; /**< Sequence number of the next frame to write to the pipe */
+static int capture_pipe_failed = 0;
+static int capture_atexit_registered = 0;
+
+
+/** Writes a frame to an image file. The type of the file is
+ * determined by the filename extension. */
+static void capture_write_image(capture_job *job)
+{
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	imageio_info info_out;
+	info_out.width    = job->width;
+	info_out.height   = job->height;
+	info_out.depth    = 8; // bits/color in output image
+	info_out.quality  = 85;
+	info_out.colorspace = sRGBColorspace;
+	info_out.filename = job->filename;
+	info_out.comment  = NULL;
+	info_out.type     = CharPixel;
+	info_out.map      = "RGB";
+	imageout(&info_out, job->data);
+#else
+	int comp = 3;
+	int stride_in_bytes = job->width*comp;
+	kuhl_flip_texture_rgba_array(job->data, job->width, job->height, comp);
+
+	int ok = 0;
+	const char *s = job->filename;
+	if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".png"))
+		ok = stbi_write_png(s, job->width, job->height, comp, job->data, stride_in_bytes);
+	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".tga"))
+		ok = stbi_write_tga(s, job->width, job->height, comp, job->data);
+	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".bmp"))
+		ok = stbi_write_bmp(s, job->width, job->height, comp, job->data);
+	if(!ok)
+		msg(ERROR, "Failed write screenshot to %s (note: STB can only write png, tga, and bmp files.)\n", s);
+#endif
+}
+
+/** Writes a frame to the pipe after all of the frames that were
+ * captured before it. */
+static void capture_write_pipe(capture_job *job)
+{
+	pthread_mutex_lock(&capture_mutex);
+	while(capture_pipe_next != job->seq)
+		pthread_cond_wait(&capture_pipe_cond, &capture_mutex);
+	pthread_mutex_unlock(&capture_mutex);
+
+	if(job->data != NULL && capture_pipe != NULL && !capture_pipe_failed)
+	{
+		size_t size = (size_t) job->width * job->height * 3;
+		if(fwrite(job->data, 1, size, capture_pipe) != size)
+		{
+			msg(ERROR, "Failed to write frame %ld to the capture pipe. No more frames will be sent.\n", job->seq);
+			capture_pipe_failed = 1;
+		}
+	}
+
+	pthread_mutex_lock(&capture_mutex);
+	capture_pipe_next++;
+	pthread_cond_broadcast(&capture_pipe_cond);
+	pthread_mutex_unlock(&capture_mutex);
+}
+
+/** Encodes jobs until the program exits. */
+static void* capture_worker(void *arg)
+{
+	pthread_mutex_lock(&capture_mutex);
+	for(;;)
+	{
+		while(capture_head == NULL)
+			pthread_cond_wait(&capture_work_cond, &capture_mutex);
+		capture_job *job = capture_head;
+		capture_head = job->next;
+		if(capture_head == NULL)
+			capture_tail = NULL;
+		capture_queued--;
+		capture_active++;
+		pthread_cond_broadcast(&capture_done_cond);
+		pthread_mutex_unlock(&capture_mutex);
+
+		TRACE_BEGIN("capture_encode");
+		if(job->filename == NULL)
+			capture_write_pipe(job);
+		else if(job->data != NULL)
+			capture_write_image(job);
+		TRACE_END();
+		free(job->data);
+		free(job->filename);
+		free(job);
+
+		pthread_mutex_lock(&capture_mutex);
+		capture_active--;
+		pthread_cond_broadcast(&capture_done_cond);
+	}
+	return NULL;
+}
+
+/** Starts the encoding threads the first time they are needed. Must
+ * be called with capture_mutex locked. */
+static void capture_start_threads(void)
+{
+	if(capture_threads > 0)
+		return;
+
+	int count = (int) sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if(count > CAPTURE_MAX_THREADS)
+		count = CAPTURE_MAX_THREADS;
+	const char *str = getenv("KUHL_CAPTURE_THREADS");
+	if(str != NULL && strlen(str) > 0)
+		count = atoi(str);
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	/* imageio isn't known to be safe to use from several threads. */
+	count = 1;
+#endif
+	if(count < 1)
+		count = 1;
+
+	for(int i=0; i<count; i++)
+	{
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, capture_worker, NULL) != 0)
+		{
+			msg(ERROR, "Failed to create capture thread.\n");
+			break;
+		}
+		pthread_detach(thread);
+		capture_threads++;
+	}
+	if(capture_threads == 0)
+	{
+		msg(FATAL, "Unable to create any capture threads.\n");
+		exit(EXIT_FAILURE);
+	}
+	msg(DEBUG, "Encoding captured frames with %d threads.\n", capture_threads);
+}
+
+/** Gives a frame to the encoding threads. Waits if too many frames
+ * are already waiting to be encoded. Takes ownership of data and
+ * filename. */
+static void capture_enqueue(unsigned char *data, int width, int height, char *filename, long seq)
+{
+	capture_job *job = kuhl_malloc(sizeof(capture_job));
+	job->data = data;
+	job->width = width;
+	job->height = height;
+	job->filename = filename;
+	job->seq = seq;
+	job->next = NULL;
+
+	pthread_mutex_lock(&capture_mutex);
+	capture_start_threads();
+	if(capture_queued >= CAPTURE_MAX_JOBS)
+	{
+		TRACE_SCOPE("capture_backpressure");
+		while(capture_queued >= CAPTURE_MAX_JOBS)
+			pthread_cond_wait(&capture_done_cond, &capture_mutex);
+	}
+	if(capture_tail == NULL)
+		capture_head = job;
+	else
+		capture_tail->next = job;
+	capture_tail = job;
+	capture_queued++;
+	pthread_cond_signal(&capture_work_cond);
+	pthread_mutex_unlock(&capture_mutex);
+}
+
+/** Checks if frames can be read back without blocking. */
+static int capture_async_supported(void)
+{
+	return GLEW_VERSION_3_2 || (GLEW_VERSION_3_0 && GLEW_ARB_sync && GLEW_ARB_pixel_buffer_object);
+}
+
+/** Copies a frame out of a slot and gives it to the encoding threads.
+ *
+ * @param slot The slot to collect.
+ *
+ * @param wait 1 to wait for the frame if the GPU hasn't finished
+ * copying it.
+ *
+ * @return 1 if the slot is now empty, 0 if the frame isn't ready.
+ */
+static int capture_collect(capture_slot *slot, int wait)
+{
+	if(!slot->busy)
+		return 1;
+
+	GLenum result = glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+	if(result == GL_TIMEOUT_EXPIRED)
+	{
+		if(!wait)
+			return 0;
+		TRACE_SCOPE("capture_wait");
+		while(result == GL_TIMEOUT_EXPIRED)
+			result = glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+	}
+	glDeleteSync(slot->fence);
+	slot->fence = 0;
+
+	GLsizeiptr size = (GLsizeiptr) slot->width * slot->height * 3;
+	unsigned char *data = kuhl_malloc(size);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	void *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+	if(mapped != NULL)
+	{
+		memcpy(data, mapped, size);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	else
+	{
+		msg(ERROR, "Failed to map pixel buffer for captured frame.\n");
+		free(data);
+		data = NULL;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	kuhl_errorcheck();
+
+	capture_enqueue(data, slot->width, slot->height, slot->filename, slot->seq);
+	slot->filename = NULL;
+	slot->busy = 0;
+	return 1;
+}
+
+/** Collects frames whose readback has finished. Frames are always
+ * collected in the order that they were captured. */
+static void capture_collect_all(int wait)
+{
+	for(int i=0; i<CAPTURE_SLOTS; i++)
+	{
+		capture_slot *slot = &capture_slots[(capture_next_slot+i) % CAPTURE_SLOTS];
+		if(!capture_collect(slot, wait))
+			return;
+	}
+}
+
+/** Waits until every frame that has been collected from the pixel
+ * buffers has been written. Doesn't use OpenGL. */
+static void capture_wait_jobs(void)
+{
+	pthread_mutex_lock(&capture_mutex);
+	while(capture_head != NULL || capture_active > 0)
+		pthread_cond_wait(&capture_done_cond, &capture_mutex);
+	pthread_mutex_unlock(&capture_mutex);
+	if(capture_pipe != NULL)
+		fflush(capture_pipe);
+}
+
+/** Writes out the frames that are already in memory when the program
+ * exits. The OpenGL context may already be gone, so frames that are
+ * still in the pixel buffers can't be collected here; call
+ * capture_shutdown() before exiting to keep them. */
+static void capture_atexit(void)
+{
+	int lost = 0;
+	for(int i=0; i<CAPTURE_SLOTS; i++)
+		if(capture_slots[i].busy)
+			lost++;
+	if(lost > 0)
+		msg(WARNING, "%d captured frames were not written because capture_shutdown() wasn't called before exiting.\n", lost);
+	capture_wait_jobs();
+	if(capture_pipe != NULL)
+	{
+		int status = pclose(capture_pipe);
+		capture_pipe = NULL;
+		if(status != 0)
+			msg(WARNING, "Capture command exited with status %d\n", status);
+	}
+}
+
+/** Starts reading the window into the next slot.
+ *
+ * @param filename The file to write (will be free()'d), or NULL to
+ * send the frame to the pipe.
+ */
+static void capture_start(char *filename, long seq)
+{
+	TRACE_SCOPE("capture_start");
+	if(!capture_atexit_registered)
+	{
+		atexit(capture_atexit);
+		capture_atexit_registered = 1;
+	}
+
+	int width  = glutGet(GLUT_WINDOW_WIDTH);
+	int height = glutGet(GLUT_WINDOW_HEIGHT);
+	GLsizeiptr size = (GLsizeiptr) width * height * 3;
+
+	GLint packAlignment = 4;
+	glGetIntegerv(GL_PACK_ALIGNMENT, &packAlignment);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+	if(!capture_async_supported())
+	{
+		/* Read the pixels immediately but still encode them on a
+		 * background thread. */
+		unsigned char *data = kuhl_malloc(size);
+		glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, data);
+		glPixelStorei(GL_PACK_ALIGNMENT, packAlignment);
+		kuhl_errorcheck();
+		capture_enqueue(data, width, height, filename, seq);
+		return;
+	}
+
+	capture_collect_all(0);
+	capture_slot *slot = &capture_slots[capture_next_slot];
+	capture_collect(slot, 1);
+
+	if(slot->pbo == 0)
+		glGenBuffers(1, &(slot->pbo));
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	if(size > slot->size)
+	{
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		slot->size = size;
+	}
+	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+	slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glPixelStorei(GL_PACK_ALIGNMENT, packAlignment);
+	kuhl_errorcheck();
+
+	slot->busy = 1;
+	slot->width = width;
+	slot->height = height;
+	slot->filename = filename;
+	slot->seq = seq;
+	capture_next_slot = (capture_next_slot+1) % CAPTURE_SLOTS;
+}
+
+/** Captures the current contents of the window and writes it to an
+ * image file in the background. Unlike kuhl_screenshot(), the file
+ * may not exist when this function returns; use capture_finish() to
+ * wait for it.
+ *
+ * @param filename The name of the image file to write. The type of
+ * image file is determined by the filename extension (see
+ * kuhl_screenshot()).
+ *
+ * @return 1 if the frame was captured, 0 otherwise.
+ */
+int capture_frame(const char *filename)
+{
+	if(filename == NULL || strlen(filename) == 0)
+	{
+		msg(ERROR, "No filename was provided for the captured frame.\n");
+		return 0;
+	}
+	capture_start(strdup(filename), 0);
+	return 1;
+}
+
+/** Starts a program that frames captured with capture_pipe_frame()
+ * are written to. Each frame is written to the program's standard
+ * input as width*height RGB pixels (3 bytes each) starting with the
+ * bottom row. For example:
+ *
+ * ffmpeg -y -f rawvideo -pixel_format rgb24 -video_size 640x480 -framerate 30 -i - -vf vflip out.mp4
+ *
+ * @param command The command to run with popen().
+ *
+ * @param width The width of the frames (i.e., of the window).
+ *
+ * @param height The height of the frames.
+ *
+ * @return 1 if the program was started, 0 otherwise.
+ */
+int capture_pipe_open(const char *command, int width, int height)
+{
+	capture_pipe_close();
+
+	/* Avoid being killed by SIGPIPE if the program exits early; the
+	 * failed write is reported instead. */
+	signal(SIGPIPE, SIG_IGN);
+	capture_pipe = popen(command, "w");
+	if(capture_pipe == NULL)
+	{
+		msg(ERROR, "Failed to run capture command: %s\n", command);
+		return 0;
+	}
+	msg(INFO, "Sending %dx%d frames to: %s\n", width, height, command);
+	capture_pipe_width = width;
+	capture_pipe_height = height;
+	capture_pipe_failed = 0;
+	pthread_mutex_lock(&capture_mutex);
+	capture_pipe_seq = 0;
+	capture_pipe_next = 0;
+	pthread_mutex_unlock(&capture_mutex);
+	return 1;
+}
+
+/** Captures the current contents of the window and sends it to the
+ * program started by capture_pipe_open().
+ *
+ * @return 1 if the frame was captured, 0 otherwise (no pipe is open
+ * or the window is no longer the size that the pipe was opened with).
+ */
+int capture_pipe_frame(void)
+{
+	if(capture_pipe == NULL || capture_pipe_failed)
+		return 0;
+	if(glutGet(GLUT_WINDOW_WIDTH) != capture_pipe_width ||
+	   glutGet(GLUT_WINDOW_HEIGHT) != capture_pipe_height)
+	{
+		msg(WARNING, "Window is no longer %dx%d, frame was not captured.\n", capture_pipe_width, capture_pipe_height);
+		return 0;
+	}
+	capture_start(NULL, capture_pipe_seq++);
+	return 1;
+}
+
+/** Waits for all frames that were sent to the pipe and then closes
+ * it. */
+void capture_pipe_close(void)
+{
+	if(capture_pipe == NULL)
+		return;
+	capture_finish();
+	int status = pclose(capture_pipe);
+	capture_pipe = NULL;
+	if(status != 0)
+		msg(WARNING, "Capture command exited with status %d\n", status);
+}
+
+/** Collects any frames whose readback has finished without
+ * waiting. capture_frame() does this automatically, but calling this
+ * once per frame lets the last few frames get encoded sooner. */
+void capture_poll(void)
+{
+	if(capture_async_supported())
+		capture_collect_all(0);
+}
+
+/** Waits until every frame that was captured has been written. */
+void capture_finish(void)
+{
+	TRACE_SCOPE("capture_finish");
+	if(capture_async_supported())
+		capture_collect_all(1);
+	capture_wait_jobs();
+}
+
+/** Writes every frame that was captured, closes the pipe and deletes
+ * the pixel buffers. Call this before the program exits (while the
+ * OpenGL context still exists) so that the last few frames aren't
+ * lost. Capturing can start again afterwards. */
+void capture_shutdown(void)
+{
+	capture_finish();
+	capture_pipe_close();
+	for(int i=0; i<CAPTURE_SLOTS; i++)
+	{
+		capture_slot *slot = &capture_slots[i];
+		if(slot->pbo != 0)
+			glDeleteBuffers(1, &(slot->pbo));
+		slot->pbo = 0;
+		slot->size = 0;
+	}
+}
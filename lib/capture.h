@@ -0,0 +1,59 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    capture copies the contents of the window into image files (or
+    into a video encoder) without making the program wait for the
+    pixels. kuhl_video_record() uses this module.
+
+    capture_frame() starts copying the window into one of a small ring
+    of pixel buffer objects and returns immediately. The pixels are
+    collected a frame or two later (during a later capture_frame() or
+    capture_poll() call) once a fence shows that the copy finished,
+    and a background thread flips and encodes the image. The files are
+    written out of order, but every filename is chosen when
+    capture_frame() is called.
+
+    capture_pipe_open() starts a program (typically ffmpeg) and
+    capture_pipe_frame() sends raw RGB frames to its standard input in
+    the order that they were captured. Frames are sent bottom row
+    first, so ffmpeg needs "-vf vflip".
+
+    Call capture_finish() to wait until all captured frames are
+    written. Call capture_shutdown() before the program exits; frames
+    that haven't been read back from OpenGL yet are lost otherwise
+    (frames that have been read back are still written when the
+    program exits). viewmat_end_frame() calls capture_poll() so that
+    at most a frame or two are waiting in OpenGL.
+
+    The following environment variable changes the behavior of the
+    module:
+
+    KUHL_CAPTURE_THREADS="2" - Number of threads that encode images
+    (default: one less than the number of processors, at most 4).
+
+    @author Scott Kuhl
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int capture_frame(const char *filename);
+int capture_pipe_open(const char *command, int width, int height);
+int capture_pipe_frame(void);
+void capture_pipe_close(void);
+void capture_poll(void);
+void capture_finish(void);
+void capture_shutdown(void);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+#endif // __CAPTURE_H__
@@ -8,6 +8,53 @@
 
     DGR provides a framework for a master process to share data with slave processes via UDP packets on a network.
 
+    By default, every packet contains the name and data of every
+    record. If the DGR_DELTA environment variable is set to 1 on the
+    master, the master instead assigns each record a numeric ID. The
+    name of a record is only sent with the ID in the first packet
+    that contains the record and in keyframes. Other packets only
+    contain the records whose bytes changed since the previous
+    packet. A keyframe containing every record is sent every
+    DGR_KEYFRAME_INTERVAL packets (default 60) so that slaves which
+    start late or which lose packets recover. Slaves detect which
+    kind of packet they received automatically.
+
+    Each packet is sent as a numbered frame that is split into
+    fragments which fit into a single UDP datagram. The DGR_MTU
+    environment variable on the master sets the largest datagram
+    (default 1400 bytes), which lets DGR share more data than fits in
+    one UDP packet. Slaves reassemble the fragments and use the newest
+    frame whose fragments have all arrived. If a fragment is lost, only
+    that frame is skipped. Delta-encoded packets are all applied in
+    order instead; after a lost packet, a slave ignores delta-encoded
+    packets until the next keyframe.
+
+    Instead of using dgr-relay to send a copy of each packet to each
+    slave, DGR_MULTICAST_GROUP can be set to a multicast address (for
+    example, 239.255.42.99 or ff15::4299) on the master and all
+    slaves. The master then sends each packet once (to
+    DGR_MASTER_DEST_PORT rather than DGR_MASTER_DEST_IP) and each slave
+    joins the group and listens on DGR_SLAVE_LISTEN_PORT. Packets
+    reach other subnets only if DGR_MULTICAST_TTL (default 1) is
+    larger than 1. DGR_MULTICAST_INTERFACE selects the network
+    interface: an IPv4 address of the interface for IPv4 groups or the
+    name of the interface (eth0, etc) for IPv6 groups.
+
+    Setting DGR_SWAP_BARRIER=1 on the master and all slaves makes all
+    of the computers swap buffers at the same time (if the program
+    calls dgr_swap_barrier() right before swapping, which
+    viewmat_end_frame() does). Each slave tells the master when it has
+    rendered a frame by sending a small packet to port DGR_SWAP_PORT
+    (default 5802) on the computer that sent the frame (or on
+    DGR_SWAP_MASTER_IP when packets arrive through dgr-relay). Once
+    every slave is ready, the master tells the slaves to swap. If a
+    computer doesn't respond within DGR_SWAP_TIMEOUT milliseconds
+    (default 50), everybody swaps anyway. The master also stops waiting
+    for a slave that misses several frames in a row until it catches
+    up again so that one stalled computer doesn't slow down all of the
+    others. DGR_SWAP_NODES on the master sets the number of slaves to
+    wait for before any slave has responded (default 0).
+
     @author Scott Kuhl
  */
 
@@ -25,32 +72,52 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <net/if.h> // if_nametoindex()
 #include <poll.h>
+#include <sys/uio.h> // struct iovec
+#else
+struct iovec { void *iov_base; size_t iov_len; };
 #endif // __MINGW32__
 
+#include <limits.h>
+#ifndef IOV_MAX
+#define IOV_MAX 1024 /**< Maximum number of iovecs that sendmsg() accepts (UIO_MAXIOV on Linux) */
+#endif
+
 #include <errno.h>
 #include <time.h>
 #include "msg.h"
+#include "trace.h"
+#include "kuhl-nodep.h"
 
 
 
 /** The dgr_record struct is used internally by DGR to hold a single
  * variable that DGR is keeping track of. */
 typedef struct {
-	char name[1024]; /**< The name of the variable */
+	char *name;      /**< The name of the variable */
+	unsigned int hash; /**< Hash of the name, see dgr_hash() */
 	int size;        /**< Number of bytes of data in this variable */
+	int capacity;    /**< Number of bytes allocated for buffer */
 	void *buffer;    /**< The bytes of data in this variable */
+	int has_data;    /**< 0 if the record was created by dgr_register() and hasn't been set yet */
+	int changed;     /**< Master: Have the bytes changed since the last delta packet was sent? */
+	int announced;   /**< Master: Has the name been sent with the record ID? */
 } dgr_record;
 
 
 
 
-/** Maximum number of records DGR can handle. */
-#define DGR_MAX_LIST_SIZE 1024
 /** A list of records DGR is tracking */
-static dgr_record dgr_list[DGR_MAX_LIST_SIZE]; 
+static dgr_record *dgr_list = NULL;
 /** Size of the DGR record list */
 static int dgr_list_size = 0;
+/** Number of records allocated in dgr_list */
+static int dgr_list_capacity = 0;
+/** Hash table of indices into dgr_list (-1 for empty slots). The
+ * size is a power of two and at least twice dgr_list_size. */
+static int *dgr_hash_table = NULL;
+static unsigned int dgr_hash_table_size = 0;
 
 /* The socket that we are sending/receiving from */
 static int dgr_socket;
@@ -61,22 +128,269 @@ static time_t dgr_time_lastreceive; /**< time we received last packet, 0 if have
 static int dgr_mode = 0;  /**< Set to 1 if we are master, 0 otherwise */
 static int dgr_disabled = 0; /**< Set to 1 if we are running in a DGR environment, 0 otherwise */
 
+/* Delta-encoded packets. A packet starts with a dgr_delta_header and
+ * is followed by records. Each record is an int record ID, an int
+ * size, a char that is 1 if a null terminated name follows and then
+ * the bytes of the record. The record ID is the index of the record
+ * in the master's dgr_list. */
+#define DGR_DELTA_MAGIC 0xD6D1D1D6 /**< First bytes of a delta packet. The first byte is 0xD6 in either byte order, which is not a character that a record name would start with. */
+
+/** The header at the start of a delta-encoded packet. */
+typedef struct {
+	unsigned int magic;    /**< DGR_DELTA_MAGIC */
+	unsigned int session;  /**< Changes whenever the master's record IDs change */
+	unsigned int sequence; /**< Packet number */
+	int keyframe;          /**< 1 if the packet contains all records */
+} dgr_delta_header;
+
+static int dgr_delta = 0; /**< Master: Send delta-encoded packets (DGR_DELTA environment variable) */
+static int dgr_keyframe_interval = 60; /**< Master: Send all records every this many packets */
+static unsigned int dgr_session = 0; /**< Master: Session number sent in packet headers */
+static unsigned int dgr_sequence = 0; /**< Master: Number of packets sent */
+static unsigned int dgr_slave_session = 0; /**< Slave: Session of the record IDs in dgr_slave_ids */
+static int *dgr_slave_ids = NULL; /**< Slave: Maps record IDs to indices in dgr_list (-1 if unknown) */
+static int dgr_slave_ids_size = 0;
+static unsigned int dgr_slave_sequence = 0; /**< Slave: Sequence number of the last delta-encoded packet that we applied */
+static int dgr_slave_synced = 0; /**< Slave: 1 if dgr_slave_sequence is valid and no packets have been lost since then */
+
+/* Packets are assembled without allocating memory once DGR has
+ * warmed up. Record headers (and the data of small records) are
+ * written into dgr_send_arena and dgr_send_iov describes the packet
+ * as a list of pieces of dgr_send_arena and of the record buffers
+ * themselves, which sendmsg() transmits without copying them into
+ * another buffer first. */
+#define DGR_COPY_BELOW 64 /**< Records smaller than this many bytes are copied into the arena instead of getting their own iovec */
+#define DGR_RECEIVE_SIZE 65536 /**< Larger than the largest possible UDP datagram */
+static struct iovec *dgr_send_iov = NULL;
+static int dgr_send_iov_capacity = 0;
+static int dgr_send_iovcnt = 0; /**< Number of iovecs used by the last packet */
+static char *dgr_send_arena = NULL;
+static int dgr_send_arena_capacity = 0;
+static char *dgr_send_flat = NULL; /**< The last packet copied into one buffer, see dgr_serialize() */
+static int dgr_send_flat_capacity = 0;
+static char *dgr_receive_buffer = NULL; /**< Slave: DGR_RECEIVE_SIZE bytes */
+
+/* Frames. Each packet (a "frame") is split into fragments that fit
+ * in one UDP datagram. Each fragment starts with a dgr_frame_header
+ * that is followed by some of the bytes of the frame. Slaves
+ * reassemble the fragments and only use a frame once all of its
+ * fragments have arrived. If a fragment is lost, the frame is
+ * skipped and the next complete frame is used instead. */
+#define DGR_FRAME_MAGIC 0xD6F7F7D6 /**< First bytes of a fragment, see DGR_DELTA_MAGIC. */
+#define DGR_FRAME_WINDOW 1024 /**< Slave: Frames that are up to this many frames older than the newest frame are ignored. Frames that are even older are assumed to come from a restarted master. */
+#define DGR_FRAME_MAX_SIZE (64*1024*1024) /**< Slave: Largest frame that we will reassemble */
+
+/** The header at the start of each fragment. */
+typedef struct {
+	unsigned int magic;     /**< DGR_FRAME_MAGIC */
+	unsigned int frame;     /**< Frame number */
+	unsigned int size;      /**< Number of bytes in the whole frame */
+	unsigned int offset;    /**< Location of this fragment's bytes in the frame */
+	unsigned short fragment;  /**< Index of fragment */
+	unsigned short fragments; /**< Number of fragments in the frame */
+} dgr_frame_header;
+
+static int dgr_mtu = 1400; /**< Master: Largest datagram to send (DGR_MTU environment variable) */
+static unsigned int dgr_frame = 0; /**< Master: Number of frames sent */
+static struct iovec *dgr_fragment_iov = NULL; /**< Master: Pieces of a fragment */
+static int dgr_fragment_iov_capacity = 0;
+
+static char *dgr_frame_buffer = NULL; /**< Slave: The frame being reassembled */
+static int dgr_frame_buffer_capacity = 0;
+static unsigned char *dgr_frame_have = NULL; /**< Slave: Which fragments have arrived */
+static int dgr_frame_have_capacity = 0;
+static int dgr_frame_started = 0; /**< Slave: Are we reassembling a frame? */
+static dgr_frame_header dgr_frame_current; /**< Slave: Header of the frame being reassembled */
+static int dgr_frame_received = 0; /**< Slave: Number of fragments of the frame that have arrived */
+static char *dgr_complete_buffer = NULL; /**< Slave: The newest complete frame */
+static int dgr_complete_buffer_capacity = 0;
+static int dgr_complete_size = 0;
+static int dgr_complete_ready = 0; /**< Slave: Is there a complete frame that hasn't been unserialized? */
+static int dgr_complete_any = 0; /**< Slave: Have we completed a numbered frame? */
+static unsigned int dgr_complete_frame = 0; /**< Slave: Number of the newest complete frame */
+static int dgr_complete_numbered = 0; /**< Slave: Did the newest complete frame have a frame number? */
+
+/* Swap barrier. */
+#define DGR_SWAP_RELEASE_MAGIC 0xD6A5A5D6 /**< First bytes of the packet that the master sends to release the slaves */
+#define DGR_SWAP_ACK_MAGIC 0xD6ACACD6 /**< First bytes of the packet that a slave sends when it is ready to swap */
+#define DGR_SWAP_DEFAULT_PORT "5802"
+#define DGR_SWAP_MAX_MISSES 3 /**< Master: Stop waiting for a slave after it misses this many barriers in a row */
+
+/** The packet sent by the master to release slaves and by slaves to
+ * tell the master that they are ready to swap. */
+typedef struct {
+	unsigned int magic; /**< DGR_SWAP_RELEASE_MAGIC or DGR_SWAP_ACK_MAGIC */
+	unsigned int frame; /**< The frame that was rendered */
+} dgr_swap_packet;
+
+/** Master: What we know about a slave that is using the swap barrier. */
+typedef struct {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	char name[80];     /**< Address and port of the slave */
+	int ready;         /**< Has the slave acknowledged the current frame? */
+	int misses;        /**< Number of barriers in a row that the slave missed */
+	int timeouts;      /**< Total number of barriers that the slave missed */
+	long skewTotal;    /**< Total microseconds that the master waited for the slave */
+	long skewMax;
+	int samples;
+} dgr_swap_node;
+
+static int dgr_swap = 0; /**< Is the swap barrier enabled? (DGR_SWAP_BARRIER environment variable) */
+static int dgr_swap_timeout = 50; /**< Milliseconds to wait at the barrier */
+static int dgr_swap_socket = -1; /**< Master: Socket that receives acknowledgments */
+static int dgr_swap_nodes_expected = 0; /**< Master: Number of slaves to wait for */
+static dgr_swap_node *dgr_swap_nodes = NULL; /**< Master: Slaves that have acknowledged a frame */
+static int dgr_swap_node_count = 0;
+static int dgr_swap_node_capacity = 0;
+static struct sockaddr_storage dgr_swap_master; /**< Slave: Where to send acknowledgments */
+static socklen_t dgr_swap_master_len = 0; /**< Slave: 0 if we don't know where to send acknowledgments */
+static int dgr_swap_master_fixed = 0; /**< Slave: Was dgr_swap_master set by DGR_SWAP_MASTER_IP? */
+static unsigned short dgr_swap_port = 0; /**< Slave: Port for acknowledgments in network byte order */
+static int dgr_swap_released = 0; /**< Slave: Have we received a release? */
+static unsigned int dgr_swap_release_frame = 0; /**< Slave: Newest frame that the master released */
+static unsigned int dgr_applied_frame = 0; /**< Slave: Frame that was unserialized last */
+static int dgr_applied_numbered = 0; /**< Slave: Did that frame have a frame number? */
+static long dgr_swap_waitTotal = 0; /**< Microseconds spent waiting at the barrier */
+static long dgr_swap_waitMax = 0;
+static int dgr_swap_waits = 0;
+static int dgr_swap_timeouts = 0; /**< Slave: Number of times that no release arrived in time */
+
+static void dgr_swap_init(void);
+
 
 /** Frees resources that DGR has used. */
 static void dgr_free(void)
 {
 	for(int i=0; i<dgr_list_size; i++)
+	{
+		free(dgr_list[i].name);
 		free(dgr_list[i].buffer);
+	}
+	/* The send and receive buffers are kept so they can be reused. */
 	dgr_list_size = 0;
+	for(unsigned int i=0; i<dgr_hash_table_size; i++)
+		dgr_hash_table[i] = -1;
+	/* Record IDs will be reused for different records. Slaves ignore
+	 * delta-encoded packets from a new session until they receive a
+	 * keyframe, so the next packet must be one. */
+	dgr_session++;
+	dgr_sequence = 0;
 }
 
 
+#ifndef __MINGW32__
+/** Gets the network interface from DGR_MULTICAST_INTERFACE.
+ *
+ * @param family AF_INET or AF_INET6
+ * @param addr Set to the IPv4 address of the interface (or INADDR_ANY).
+ * @return The index of the IPv6 interface (or 0).
+ */
+static unsigned int dgr_multicast_interface(int family, struct in_addr *addr)
+{
+	addr->s_addr = htonl(INADDR_ANY);
+	const char *iface = getenv("DGR_MULTICAST_INTERFACE");
+	if(iface == NULL || strlen(iface) == 0)
+		return 0;
+
+	if(family == AF_INET)
+	{
+		if(inet_pton(AF_INET, iface, addr) != 1)
+		{
+			msg(FATAL, "DGR: DGR_MULTICAST_INTERFACE must be the IPv4 address of an interface for IPv4 groups; '%s' is not.\n", iface);
+			exit(EXIT_FAILURE);
+		}
+		return 0;
+	}
+
+	unsigned int index = if_nametoindex(iface);
+	if(index == 0)
+	{
+		msg(FATAL, "DGR: DGR_MULTICAST_INTERFACE: Unknown interface '%s'.\n", iface);
+		exit(EXIT_FAILURE);
+	}
+	return index;
+}
+
+/** Sets the TTL and interface that the master uses to send multicast
+ * packets.
+ *
+ * @param family AF_INET or AF_INET6
+ */
+static void dgr_multicast_sender(int family)
+{
+	int ttl = 1;
+	const char *ttlStr = getenv("DGR_MULTICAST_TTL");
+	if(ttlStr != NULL && atoi(ttlStr) > 0)
+		ttl = atoi(ttlStr);
+
+	struct in_addr addr;
+	unsigned int index = dgr_multicast_interface(family, &addr);
+	int ok;
+	if(family == AF_INET)
+	{
+		unsigned char ttl4 = ttl > 255 ? 255 : ttl;
+		ok = setsockopt(dgr_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl4, sizeof(ttl4)) == 0 &&
+			setsockopt(dgr_socket, IPPROTO_IP, IP_MULTICAST_IF, &addr, sizeof(addr)) == 0;
+	}
+	else
+	{
+		ok = setsockopt(dgr_socket, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl)) == 0 &&
+			(index == 0 ||
+			 setsockopt(dgr_socket, IPPROTO_IPV6, IPV6_MULTICAST_IF, &index, sizeof(index)) == 0);
+	}
+	if(!ok)
+	{
+		msg(FATAL, "DGR Master: Unable to configure multicast: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	msg(INFO, "DGR Master: Sending multicast packets with TTL %d.\n", ttl);
+}
+
+/** Joins a multicast group so that a slave receives the packets that
+ * the master sends to the group.
+ *
+ * @param group The address of the group.
+ */
+static void dgr_multicast_join(const struct addrinfo *group)
+{
+	struct in_addr addr;
+	unsigned int index = dgr_multicast_interface(group->ai_family, &addr);
+	int ok;
+	if(group->ai_family == AF_INET)
+	{
+		struct ip_mreq mreq;
+		mreq.imr_multiaddr = ((struct sockaddr_in*) group->ai_addr)->sin_addr;
+		mreq.imr_interface = addr;
+		ok = setsockopt(dgr_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == 0;
+	}
+	else
+	{
+		struct ipv6_mreq mreq;
+		mreq.ipv6mr_multiaddr = ((struct sockaddr_in6*) group->ai_addr)->sin6_addr;
+		mreq.ipv6mr_interface = index;
+		ok = setsockopt(dgr_socket, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) == 0;
+	}
+	if(!ok)
+	{
+		msg(FATAL, "DGR Slave: Unable to join multicast group: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	msg(INFO, "DGR Slave: Joined multicast group.\n");
+}
+#endif // __MINGW32__
+
 /** Initializes a master DGR process that will send packets out on the network. */
 static void dgr_init_master()
 {
 #ifndef __MINGW32__
 	const char *ipAddr = getenv("DGR_MASTER_DEST_IP");
 	const char *port = getenv("DGR_MASTER_DEST_PORT");
+	const char *group = getenv("DGR_MULTICAST_GROUP");
+	if(group != NULL && strlen(group) > 0)
+		ipAddr = group;
+	else
+		group = NULL;
 	if(ipAddr == NULL || strcmp(ipAddr, "0.0.0.0") == 0)
 	{
 		dgr_disabled = 1;
@@ -92,6 +406,32 @@ static void dgr_init_master()
 	}
 
 	printf("DGR Master: Preparing to send packets to %s port %s.\n", ipAddr, port);
+
+	const char *mtu = getenv("DGR_MTU");
+	if(mtu != NULL && atoi(mtu) > 0)
+	{
+		dgr_mtu = atoi(mtu);
+		if(dgr_mtu < 64)
+			dgr_mtu = 64;
+		if(dgr_mtu > 65507) // largest UDP payload with IPv4
+			dgr_mtu = 65507;
+	}
+	/* Start at an arbitrary frame number so that slaves don't ignore
+	 * the frames of a master that restarted (see DGR_FRAME_WINDOW). */
+	dgr_frame = (unsigned int) time(NULL) ^ (unsigned int) getpid();
+
+	const char *delta = getenv("DGR_DELTA");
+	if(delta != NULL && strcmp(delta, "1") == 0)
+	{
+		dgr_delta = 1;
+		const char *interval = getenv("DGR_KEYFRAME_INTERVAL");
+		if(interval != NULL && atoi(interval) > 0)
+			dgr_keyframe_interval = atoi(interval);
+		/* Slaves that were listening to a previous master must not
+		 * reuse the record IDs that they learned from it. */
+		dgr_session = (unsigned int) time(NULL) ^ ((unsigned int) getpid() << 16);
+		msg(INFO, "DGR Master: Sending delta-encoded packets with a keyframe every %d packets.\n", dgr_keyframe_interval);
+	}
 	
 	struct addrinfo hints, *servinfo;
 	memset(&hints, 0, sizeof hints);
@@ -120,6 +460,9 @@ static void dgr_init_master()
 		exit(EXIT_FAILURE);
 	}
 
+	if(group != NULL)
+		dgr_multicast_sender(p->ai_family);
+
 	dgr_addrinfo = p;
 #endif // __MINGW32__
 }
@@ -138,13 +481,31 @@ static void dgr_init_slave()
 	
 	dgr_time_lastreceive = 0;
 	struct addrinfo hints, *servinfo, *p;
+	int rv;
+
+	/* If we are joining a multicast group, the socket must use the
+	 * same protocol (IPv4 or IPv6) as the group. */
+	struct addrinfo *groupinfo = NULL;
+	const char *group = getenv("DGR_MULTICAST_GROUP");
+	if(group != NULL && strlen(group) > 0)
+	{
+		memset(&hints, 0, sizeof hints);
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+		hints.ai_flags = AI_NUMERICHOST;
+		if ((rv = getaddrinfo(group, NULL, &hints, &groupinfo)) != 0) {
+			msg(FATAL, "DGR Slave: DGR_MULTICAST_GROUP '%s': %s\n", group, gai_strerror(rv));
+			exit(EXIT_FAILURE);
+		}
+	}
 
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC; // set to AF_INET forces IPv4; AF_INET6 forces IPv6; AF_UNSPEC allows any
+	if(groupinfo != NULL)
+		hints.ai_family = groupinfo->ai_family;
 	hints.ai_socktype = SOCK_DGRAM;
 	hints.ai_flags = AI_PASSIVE; // use my IP
 
-	int rv;
 	if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
 		msg(FATAL, "DGR Slave: getaddrinfo: %s\n", gai_strerror(rv));
 		exit(EXIT_FAILURE);
@@ -157,6 +518,13 @@ static void dgr_init_slave()
 			perror("DGR Slave: socket");
 			continue;
 		}
+		/* Let several slaves on the same computer listen to the same
+		 * multicast group and port. */
+		if(groupinfo != NULL)
+		{
+			int yes = 1;
+			setsockopt(dgr_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		}
 		if (bind(dgr_socket, p->ai_addr, p->ai_addrlen) == -1) {
 			close(dgr_socket);
 			msg(ERROR, "DGR Slave: bind: %s", strerror(errno));
@@ -172,6 +540,11 @@ static void dgr_init_slave()
 	}
 
 	freeaddrinfo(servinfo);
+	if(groupinfo != NULL)
+	{
+		dgr_multicast_join(groupinfo);
+		freeaddrinfo(groupinfo);
+	}
 #endif // __MINGW32__
 }
 
@@ -226,6 +599,8 @@ void dgr_init(void)
 	
 	if(dgr_disabled)
 		msg(INFO, "DGR is disabled; not a valid DGR environment.\n");
+	else
+		dgr_swap_init();
 
 	// if there already is a list, free it.
 	if(dgr_list_size > 0)
@@ -233,33 +608,110 @@ void dgr_init(void)
 }
 
 
+/** Hashes a record name (32-bit FNV-1a). */
+static unsigned int dgr_hash(const char *name)
+{
+	unsigned int hash = 2166136261u;
+	for(const unsigned char *c = (const unsigned char*) name; *c != '\0'; c++)
+	{
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/** Finds the hash table slot for a name. The slot either contains
+ * the index of the record with that name or is empty (-1). */
+static unsigned int dgr_hash_slot(const char *name, unsigned int hash)
+{
+	unsigned int mask = dgr_hash_table_size-1;
+	unsigned int slot = hash & mask;
+	while(dgr_hash_table[slot] != -1)
+	{
+		dgr_record *r = &(dgr_list[dgr_hash_table[slot]]);
+		if(r->hash == hash && strcmp(r->name, name) == 0)
+			break;
+		slot = (slot+1) & mask;
+	}
+	return slot;
+}
+
+/** Makes room for one more record in dgr_list and in the hash table. */
+static void dgr_grow(void)
+{
+	if(dgr_list_size == dgr_list_capacity)
+	{
+		dgr_list_capacity = dgr_list_capacity == 0 ? 64 : dgr_list_capacity*2;
+		dgr_list = realloc(dgr_list, sizeof(dgr_record)*dgr_list_capacity);
+		if(dgr_list == NULL)
+		{
+			msg(FATAL, "DGR: Unable to allocate space for %d records.\n", dgr_list_capacity);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if((unsigned int) (dgr_list_size+1)*2 > dgr_hash_table_size)
+	{
+		dgr_hash_table_size = dgr_hash_table_size == 0 ? 128 : dgr_hash_table_size*2;
+		free(dgr_hash_table);
+		dgr_hash_table = malloc(sizeof(int)*dgr_hash_table_size);
+		if(dgr_hash_table == NULL)
+		{
+			msg(FATAL, "DGR: Unable to allocate hash table.\n");
+			exit(EXIT_FAILURE);
+		}
+		for(unsigned int i=0; i<dgr_hash_table_size; i++)
+			dgr_hash_table[i] = -1;
+		for(int i=0; i<dgr_list_size; i++)
+			dgr_hash_table[dgr_hash_slot(dgr_list[i].name, dgr_list[i].hash)] = i;
+	}
+}
+
 /** Given a name, find the index of the name in our list. Returns -1 if
  * name is not found. */
 static int dgr_findIndex(const char *name)
 {
-	for(int i=0; i<dgr_list_size; i++)
-		if(strcmp(name, dgr_list[i].name) == 0)
-			return i;
-	return -1;
+	if(dgr_hash_table_size == 0)
+		return -1;
+	return dgr_hash_table[dgr_hash_slot(name, dgr_hash(name))];
 }
 
+/** Finds the index of a record or adds a record without any data if
+ * there isn't a record with the name. */
+static int dgr_findOrAdd(const char *name)
+{
+	unsigned int hash = dgr_hash(name);
+	dgr_grow();
+	unsigned int slot = dgr_hash_slot(name, hash);
+	if(dgr_hash_table[slot] != -1)
+		return dgr_hash_table[slot];
+
+	// printf("DGR Master: The name '%s' is new to dgr, storing it at location %d\n", name, dgr_list_size);
+	dgr_record *record = &(dgr_list[dgr_list_size]);
+	record->name = strdup(name);
+	record->hash = hash;
+	record->size = 0;
+	record->capacity = 0;
+	record->buffer = NULL;
+	record->has_data = 0;
+	record->changed = 0;
+	record->announced = 0;
+	dgr_hash_table[slot] = dgr_list_size;
+	return dgr_list_size++;
+}
 
-/** Given a label, a buffer to store data, and the size of that buffer,
- * get data from DGR, store it in buffer and return the actual size of
- * the data we copied into the buffer.
+
+/** Given the index of a record, a buffer to store data, and the size
+ * of that buffer, get data from DGR, store it in buffer and return
+ * the actual size of the data we copied into the buffer.
  *
  * @return Returns the size of the data if success, and a negative
- * number upon error. Returns -1 if DGR didn't know about the
- * name. Returns -2 the buffer you provided was too small. Returns -3
- * if DGR is not enabled.
+ * number upon error. Returns -1 if DGR didn't have data for the
+ * record. Returns -2 the buffer you provided was too small.
  */
-static int dgr_get(const char *name, void* buffer, int bufferSize)
+static int dgr_get_index(int index, void* buffer, int bufferSize)
 {
-	if(dgr_disabled)
-		return -3;
-	
-	int index = dgr_findIndex(name);
-	if(index == -1)
+	if(index < 0 || index >= dgr_list_size || !dgr_list[index].has_data)
 		return -1;
 
 	/* If we found the record... */
@@ -274,6 +726,50 @@ static int dgr_get(const char *name, void* buffer, int bufferSize)
 		return -2;
 }
 
+/** Given a label, a buffer to store data, and the size of that buffer,
+ * get data from DGR, store it in buffer and return the actual size of
+ * the data we copied into the buffer.
+ *
+ * @return Returns the size of the data if success, and a negative
+ * number upon error. Returns -1 if DGR didn't know about the
+ * name. Returns -2 the buffer you provided was too small. Returns -3
+ * if DGR is not enabled.
+ */
+static int dgr_get(const char *name, void* buffer, int bufferSize)
+{
+	if(dgr_disabled)
+		return -3;
+	return dgr_get_index(dgr_findIndex(name), buffer, bufferSize);
+}
+
+/** Stores data in a record in DGRs list of variables.
+ * @param index The index of the record in dgr_list.
+ * @param buffer A pointer to the variable.
+ * @param size The number of bytes used by the variable.
+ */
+static void dgr_set_index(int index, const void *buffer, int size)
+{
+	dgr_record *record = &(dgr_list[index]);
+	if(!record->has_data || record->size != size)
+	{
+//		printf("DGR Master: The name %s used to have size %d but now has size %d.", record->name, record->size, size);
+		/* Only reallocate if the record grows beyond any size that it
+		 * had before. */
+		if(size > record->capacity)
+		{
+			free(record->buffer);
+			record->buffer = malloc(size);
+			record->capacity = size;
+		}
+		record->size = size;
+		record->has_data = 1;
+		record->changed = 1;
+	}
+	else if(memcmp(record->buffer, buffer, size) != 0)
+		record->changed = 1;
+	memcpy(record->buffer, buffer, size);
+}
+
 /** Adds a variable to DGRs list of variables. These variables will be sent to slaves when dgr_update() is called.
  * @param name The name of the variable.
  * @param buffer A pointer to the variable.
@@ -285,39 +781,27 @@ static void dgr_set(const char *name, const void *buffer, int size)
 		return;
 	
 	// printf("dgr_set(%s, %p, %d)\n", name, buffer, size);
-	int index = dgr_findIndex(name);
-	if(index == -1)
-	{
-		// printf("DGR Master: The name '%s' is new to dgr, storing it at location %d\n", name, dgr_list_size);
-
-		if(dgr_list_size > DGR_MAX_LIST_SIZE)
-		{
-			msg(FATAL, "DGR Master: You have exceeded the maximum list size for DGR.");
-			exit(EXIT_FAILURE);
-		}
-
-		dgr_record *record = &(dgr_list[dgr_list_size]);
-		sprintf(record->name, "%s",  name);
-		record->size = size;
-		record->buffer = malloc(size);
-		memcpy(record->buffer, buffer, size);
-
-		dgr_list_size++;
-	}
-	else
-	{
-		dgr_record *record = &(dgr_list[index]);
-		// printf("DGR Master: The name '%s' is already known to dgr (at index %d)\n", name, index);
+	dgr_set_index(dgr_findOrAdd(name), buffer, size);
+}
 
-		if(record->size != size)
-		{
-//			printf("DGR Master: The name %s used to have size %d but now has size %d.", name, record->size, size);
-			free(record->buffer);
-			record->buffer = malloc(size);
-			record->size = size;
-		}
-		memcpy(record->buffer, buffer, size);
-	}
+/** Gets a variable on a DGR slave and prints a message if anything
+ * goes wrong.
+ *
+ * @param name The name of the variable (used in messages).
+ * @param index The index of the variable in dgr_list (or -1).
+ * @param buffer A pointer to the data (an int, float, array, struct, etc.)
+ * @param bufferSize The size of the data in the buffer in bytes.
+ */
+static void dgr_get_checked(const char *name, int index, void* buffer, int bufferSize)
+{
+	int ret = dgr_get_index(index, buffer, bufferSize);
+	if(ret == -1)
+		msg(ERROR, "DGR Slave: Tried to get '%s' from DGR, but DGR didn't have it!\n", name);
+	else if(ret == -2)
+		msg(ERROR, "DGR Slave: Tried to get '%s' from DGR, but you didn't provide a large enough buffer.\n", name);
+
+	else if(ret != bufferSize)
+		msg(WARNING, "DGR Slave: Successfully retrieved '%s' from DGR but you provided a buffer that didn't match the size of the data you are retrieving. Your buffer is %d bytes but the '%s' record is %d bytes.\n", name, bufferSize, name, ret);
 }
 
 /** Set a variable if we are a DGR master (so that we can send it to
@@ -347,18 +831,223 @@ void dgr_setget(const char *name, void* buffer, int bufferSize)
 	if(dgr_mode)
 		dgr_set(name, buffer, bufferSize);
 	else
+		dgr_get_checked(name, dgr_findIndex(name), buffer, bufferSize);
+}
+
+/** Looks up a variable name once so that dgr_setget_handle() can be
+ * used instead of dgr_setget() to avoid looking up the name every
+ * frame. This is useful when many variables are shared (for
+ * example, one per object). Handles remain valid until dgr_init() is
+ * called again.
+ *
+ * @param name A string representing the name of the variable. Both the DGR master and DGR slaves must use the same string for the same variable.
+ * @return A handle for the variable or -1 if DGR is disabled.
+ */
+int dgr_register(const char *name)
+{
+	if(dgr_disabled)
+		return -1;
+	return dgr_findOrAdd(name);
+}
+
+/** Same as dgr_setget() but uses a handle returned by dgr_register()
+ * instead of a name.
+ *
+ * @param handle A handle returned by dgr_register().
+ * @param buffer A pointer to the data (an int, float, array, struct, etc.)
+ * @param bufferSize The size of the data in the buffer in bytes.
+ */
+void dgr_setget_handle(int handle, void* buffer, int bufferSize)
+{
+	if(dgr_disabled)
+		return;
+	if(handle < 0 || handle >= dgr_list_size)
+	{
+		msg(ERROR, "DGR: Invalid handle %d.\n", handle);
+		return;
+	}
+
+	if(dgr_mode)
+		dgr_set_index(handle, buffer, bufferSize);
+	else
+		dgr_get_checked(dgr_list[handle].name, handle, buffer, bufferSize);
+}
+
+
+/** Makes sure that a buffer that DGR reuses can hold at least
+ * 'needed' elements. The buffer grows by doubling so that it is
+ * rarely reallocated.
+ *
+ * @param buffer The buffer, which may be moved.
+ * @param capacity The number of elements that the buffer can hold.
+ * @param needed The number of elements that must fit.
+ * @param elementSize The size of an element in bytes.
+ */
+static void dgr_reserve(void **buffer, int *capacity, int needed, size_t elementSize)
+{
+	if(needed <= *capacity)
+		return;
+	int newCapacity = *capacity > 0 ? *capacity : 256;
+	while(newCapacity < needed)
+		newCapacity *= 2;
+	void *newBuffer = realloc(*buffer, newCapacity*elementSize);
+	if(newBuffer == NULL)
 	{
-		int ret = dgr_get(name, buffer, bufferSize);
-		if(ret == -1)
-			msg(ERROR, "DGR Slave: Tried to get '%s' from DGR, but DGR didn't have it!\n", name);
-		else if(ret == -2)
-			msg(ERROR, "DGR Slave: Tried to get '%s' from DGR, but you didn't provide a large enough buffer.\n", name);
+		msg(FATAL, "DGR: Failed to allocate %d bytes.\n", (int) (newCapacity*elementSize));
+		exit(EXIT_FAILURE);
+	}
+	*buffer = newBuffer;
+	*capacity = newCapacity;
+}
 
-		else if(ret != bufferSize)
-			msg(WARNING, "DGR Slave: Successfully retrieved '%s' from DGR but you provided a buffer that didn't match the size of the data you are retrieving. Your buffer is %d bytes but the '%s' record is %d bytes.\n", name, bufferSize, name, ret);
+/** Adds a piece of memory to the end of the packet described by
+ * dgr_send_iov. Pieces that are next to each other in memory share an
+ * iovec. Space for the iovec must already be reserved. */
+static void dgr_pack_append(const void *ptr, int len)
+{
+	if(len == 0)
+		return;
+	if(dgr_send_iovcnt > 0)
+	{
+		struct iovec *prev = &(dgr_send_iov[dgr_send_iovcnt-1]);
+		if((char*)prev->iov_base + prev->iov_len == ptr)
+		{
+			prev->iov_len += len;
+			return;
+		}
 	}
+	dgr_send_iov[dgr_send_iovcnt].iov_base = (void*) ptr;
+	dgr_send_iov[dgr_send_iovcnt].iov_len = len;
+	dgr_send_iovcnt++;
 }
 
+/** Should a record be included in a packet?
+ *
+ * @param r The record.
+ * @param delta 1 if the packet is delta-encoded.
+ * @param keyframe 1 if the delta-encoded packet contains all records.
+ */
+static int dgr_pack_includes(const dgr_record *r, int delta, int keyframe)
+{
+	if(!r->has_data)
+		return 0;
+	return !delta || keyframe || r->changed;
+}
+
+/** Assembles a packet from the list of DGR records into
+ * dgr_send_iov. The headers of the records are written into
+ * dgr_send_arena and large records are referenced where they are
+ * stored. See dgr_serialize() and dgr_unserialize_delta() for the
+ * formats.
+ *
+ * @param delta 1 to create a delta-encoded packet (see DGR_DELTA_MAGIC).
+ * @param keyframe 1 if a delta-encoded packet should include all records.
+ * @return The size of the packet in bytes.
+ */
+static int dgr_pack(int delta, int keyframe)
+{
+	/* Find out how much space we need before writing anything
+	 * because the arena may move when it grows. */
+	int arenaNeeded = delta ? sizeof(dgr_delta_header) : 0;
+	int iovNeeded = 1;
+	for(int i=0; i<dgr_list_size; i++)
+	{
+		dgr_record *r = &(dgr_list[i]);
+		if(!dgr_pack_includes(r, delta, keyframe))
+			continue;
+		if(delta)
+		{
+			arenaNeeded += 2*sizeof(int)+1;
+			if(keyframe || !r->announced)
+				arenaNeeded += strlen(r->name)+1;
+		}
+		else
+			arenaNeeded += strlen(r->name)+1+sizeof(int);
+		if(r->size < DGR_COPY_BELOW)
+			arenaNeeded += r->size;
+		iovNeeded += 2;
+	}
+	dgr_reserve((void**) &dgr_send_arena, &dgr_send_arena_capacity, arenaNeeded, 1);
+	dgr_reserve((void**) &dgr_send_iov, &dgr_send_iov_capacity, iovNeeded, sizeof(struct iovec));
+	dgr_send_iovcnt = 0;
+
+	char *ptr = dgr_send_arena;
+	int total = 0;
+	if(delta)
+	{
+		dgr_delta_header header;
+		header.magic = DGR_DELTA_MAGIC;
+		header.session = dgr_session;
+		header.sequence = dgr_sequence;
+		header.keyframe = keyframe;
+		memcpy(ptr, &header, sizeof(header));
+		dgr_pack_append(ptr, sizeof(header));
+		ptr += sizeof(header);
+		total += sizeof(header);
+	}
+
+	for(int i=0; i<dgr_list_size; i++)
+	{
+		dgr_record *r = &(dgr_list[i]);
+		if(!dgr_pack_includes(r, delta, keyframe))
+			continue;
+
+		char *start = ptr;
+		if(delta)
+		{
+			memcpy(ptr, &i, sizeof(int));
+			ptr += sizeof(int);
+			memcpy(ptr, &(r->size), sizeof(int));
+			ptr += sizeof(int);
+			char hasName = (keyframe || !r->announced);
+			*(ptr++) = hasName;
+			if(hasName)
+				ptr += sprintf(ptr, "%s", r->name)+1;
+			r->changed = 0;
+			r->announced = 1;
+		}
+		else
+		{
+			ptr += sprintf(ptr, "%s", r->name)+1; // extra byte for null terminated string.
+			memcpy(ptr, &(r->size), sizeof(int));
+			ptr += sizeof(int);
+		}
+
+		if(r->size < DGR_COPY_BELOW)
+		{
+			memcpy(ptr, r->buffer, r->size);
+			ptr += r->size;
+			dgr_pack_append(start, ptr-start);
+		}
+		else
+		{
+			dgr_pack_append(start, ptr-start);
+			dgr_pack_append(r->buffer, r->size);
+			total += r->size;
+		}
+		total += ptr-start;
+	}
+	return total;
+}
+
+/** Copies pieces of memory into dgr_send_flat.
+ *
+ * @param iov The pieces.
+ * @param iovcnt The number of pieces.
+ * @param size The total size of the pieces.
+ * @return dgr_send_flat
+ */
+static char* dgr_flatten(const struct iovec *iov, int iovcnt, int size)
+{
+	dgr_reserve((void**) &dgr_send_flat, &dgr_send_flat_capacity, size, 1);
+	char *ptr = dgr_send_flat;
+	for(int i=0; i<iovcnt; i++)
+	{
+		memcpy(ptr, iov[i].iov_base, iov[i].iov_len);
+		ptr += iov[i].iov_len;
+	}
+	return dgr_send_flat;
+}
 
 /** Takes the list of DGR records and puts them into a compact byte
  * stream. The format is:
@@ -368,34 +1057,104 @@ void dgr_setget(const char *name, void* buffer, int bufferSize)
  * An integer indicating the size of the data that follows.<br>
  * A buffer of the data.<br>
  *
+ * dgr_update() sends packets without calling this function (it
+ * doesn't need the bytes to be in a single buffer).
+ *
  * @param size The size of the data being serialized.
- * @return A serialized array of bytes (to be free()'d by the caller)
+ * @return A serialized array of bytes or NULL if there is nothing to
+ * serialize. The array belongs to DGR and is overwritten the next
+ * time a packet is serialized.
 */
 char* dgr_serialize(int *size)
 {
-	int spaceNeeded = 0;
-	for(int i=0; i<dgr_list_size; i++)
-		spaceNeeded += strlen(dgr_list[i].name)+1+sizeof(int)+dgr_list[i].size;
-	*size = spaceNeeded;
-
-	if(spaceNeeded == 0)
+	*size = dgr_pack(0, 0);
+	if(*size == 0)
 		return NULL;
-	
-	char *serialized = malloc(spaceNeeded);
-	char *ptr = serialized;
-	for(int i=0; i<dgr_list_size; i++)
+	return dgr_flatten(dgr_send_iov, dgr_send_iovcnt, *size);
+}
+
+
+/** Unserializes a delta-encoded packet (see DGR_DELTA_MAGIC and dgr_pack()).
+ * Records with IDs that we haven't seen a name for are ignored until
+ * the next keyframe. A delta only makes sense if every packet before
+ * it was applied, so once a packet is missing (or if we haven't
+ * received a keyframe yet) non-keyframe packets are dropped until
+ * the next keyframe arrives.
+ *
+ * @param size Length of the serialized data.
+ * @param serialized The serialized data as an array of bytes.
+ */
+static void dgr_unserialize_delta(int size, const char *serialized)
+{
+	if(size < (int) sizeof(dgr_delta_header))
+		return;
+	dgr_delta_header header;
+	memcpy(&header, serialized, sizeof(header));
+
+	/* Record IDs from a different session mean something else. */
+	if(header.session != dgr_slave_session)
 	{
-		int bytesPrinted = sprintf(ptr, "%s", dgr_list[i].name);
-		ptr += bytesPrinted+1; // extra byte for null terminated string.
-		memcpy(ptr, &(dgr_list[i].size), sizeof(int));
-		ptr += sizeof(int);
-		memcpy(ptr, dgr_list[i].buffer, dgr_list[i].size);
-		ptr += dgr_list[i].size;
+		for(int i=0; i<dgr_slave_ids_size; i++)
+			dgr_slave_ids[i] = -1;
+		dgr_slave_session = header.session;
+		dgr_slave_synced = 0;
 	}
 
-	return serialized;
-}
+	if(!header.keyframe)
+	{
+		int diff = (int) (header.sequence - dgr_slave_sequence);
+		if(dgr_slave_synced && diff <= 0 && diff > -DGR_FRAME_WINDOW)
+			return; // a duplicate or a packet older than one that we applied
+		if(!dgr_slave_synced || diff != 1)
+		{
+			if(dgr_slave_synced)
+				msg(DEBUG, "DGR Slave: Missed delta packets %u to %u, waiting for a keyframe.\n",
+				    dgr_slave_sequence+1, header.sequence-1);
+			dgr_slave_synced = 0;
+			return;
+		}
+	}
+	dgr_slave_sequence = header.sequence;
+	dgr_slave_synced = 1;
 
+	const char *ptr = serialized + sizeof(header);
+	const char *end = serialized + size;
+	while(ptr + 2*(int)sizeof(int)+1 <= end)
+	{
+		int id, recordSize;
+		memcpy(&id, ptr, sizeof(int));
+		ptr += sizeof(int);
+		memcpy(&recordSize, ptr, sizeof(int));
+		ptr += sizeof(int);
+		char hasName = *(ptr++);
+		const char *name = NULL;
+		if(hasName)
+		{
+			name = ptr;
+			ptr += strnlen(ptr, end-ptr)+1;
+		}
+		if(id < 0 || recordSize < 0 || ptr + recordSize > end)
+		{
+			msg(ERROR, "DGR Slave: Received a malformed packet.\n");
+			return;
+		}
+
+		if(id >= dgr_slave_ids_size)
+		{
+			int newSize = id+1 > dgr_slave_ids_size*2 ? id+1 : dgr_slave_ids_size*2;
+			dgr_slave_ids = realloc(dgr_slave_ids, sizeof(int)*newSize);
+			for(int i=dgr_slave_ids_size; i<newSize; i++)
+				dgr_slave_ids[i] = -1;
+			dgr_slave_ids_size = newSize;
+		}
+
+		if(name != NULL)
+			dgr_slave_ids[id] = dgr_findOrAdd(name);
+		if(dgr_slave_ids[id] >= 0)
+			dgr_set_index(dgr_slave_ids[id], ptr, recordSize);
+		ptr += recordSize;
+	}
+}
 
 /** Unserializes serialized data and stores it in our global dgr_list
  * variable. We do not blow away the list, instead we just update the
@@ -404,29 +1163,39 @@ char* dgr_serialize(int *size)
  * @param size Length of the serialized data.
  * @param serialized The serialized data as an array of bytes.
  **/
-static void dgr_unserialize(int size, const char *serialized)
+void dgr_unserialize(int size, const char *serialized)
 {
-	const char *ptr = serialized;
+	unsigned int magic = 0;
+	if(size >= (int) sizeof(magic))
+		memcpy(&magic, serialized, sizeof(magic));
+	if(magic == DGR_DELTA_MAGIC)
+	{
+		dgr_unserialize_delta(size, serialized);
+		return;
+	}
 
-	while(ptr < serialized + size)
+	/* The names and data are used where they are in the packet. */
+	const char *ptr = serialized;
+	const char *end = serialized + size;
+	while(ptr < end)
 	{
-		int c = 0;
-		char name[1024];
-		while(*ptr != 0)
-		{
-			name[c++] = *ptr;
-			ptr++;
-		}
-		name[c++] = '\0';
-		ptr++;
+		const char *name = ptr;
+		int nameLength = strnlen(ptr, end-ptr);
+		ptr += nameLength+1;
 		// printf("unserialized: %s\n", name);
 
-		int size = 0;
-		memcpy(&size, ptr, sizeof(int));
+		int recordSize = 0;
+		if(ptr + sizeof(int) <= end)
+			memcpy(&recordSize, ptr, sizeof(int));
 		ptr += sizeof(int);
+		if(ptr > end || recordSize < 0 || ptr + recordSize > end)
+		{
+			msg(ERROR, "DGR Slave: Received a malformed packet.\n");
+			return;
+		}
 
-		dgr_set(name, ptr, size);
-		ptr += size;
+		dgr_set(name, ptr, recordSize);
+		ptr += recordSize;
 	}
 }
 
@@ -449,6 +1218,99 @@ void dgr_print_list(void)
 		msg(DEBUG, "[ the list is empty ]\n");
 }
 
+/** Sends the packet assembled by dgr_pack() as a frame (see
+ * DGR_FRAME_MAGIC) split into fragments that are at most dgr_mtu
+ * bytes. Relying on IPv4 fragmentation instead would make the whole
+ * packet disappear when any piece of it is lost and wouldn't work at
+ * all for packets larger than 64 KiB.
+ *
+ * @param size The size of the packet.
+ */
+static void dgr_send_frame(int size)
+{
+#ifndef __MINGW32__
+	int fragmentPayload = dgr_mtu - sizeof(dgr_frame_header);
+	int fragments = (size + fragmentPayload-1) / fragmentPayload;
+	if(fragments > 65535)
+	{
+		msg(ERROR, "DGR Master: Not sending %d bytes because it would require more than 65535 fragments. Increase DGR_MTU?\n", size);
+		return;
+	}
+
+	dgr_frame_header header;
+	header.magic = DGR_FRAME_MAGIC;
+	header.frame = dgr_frame++;
+	header.size = size;
+	header.fragments = fragments;
+
+	/* A fragment never needs more iovecs than the header plus all of
+	 * the pieces of the packet. */
+	dgr_reserve((void**) &dgr_fragment_iov, &dgr_fragment_iov_capacity, dgr_send_iovcnt+1, sizeof(struct iovec));
+
+	int piece = 0;        // dgr_send_iov that the next fragment starts in
+	size_t pieceOffset = 0; // offset into that piece
+	for(int f=0; f<fragments; f++)
+	{
+		header.fragment = f;
+		header.offset = f*fragmentPayload;
+		int len = size - (int)header.offset < fragmentPayload ? size - (int)header.offset : fragmentPayload;
+
+		dgr_fragment_iov[0].iov_base = &header;
+		dgr_fragment_iov[0].iov_len = sizeof(header);
+		int iovcnt = 1;
+		int remaining = len;
+		while(remaining > 0)
+		{
+			const struct iovec *src = &(dgr_send_iov[piece]);
+			int take = src->iov_len - pieceOffset;
+			if(take > remaining)
+				take = remaining;
+			dgr_fragment_iov[iovcnt].iov_base = (char*)src->iov_base + pieceOffset;
+			dgr_fragment_iov[iovcnt].iov_len = take;
+			iovcnt++;
+			remaining -= take;
+			pieceOffset += take;
+			if(pieceOffset == src->iov_len)
+			{
+				piece++;
+				pieceOffset = 0;
+			}
+		}
+
+		/* If the message is too large to send, sendmsg() will not send
+		 * the message, and will set errno to EMSGSIZE. With an MTU of
+		 * 1500, we can only expect to send 1472 bytes (1452 with
+		 * IPv6). */
+		int numbytes;
+		if(iovcnt <= IOV_MAX)
+		{
+			struct msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_name = dgr_addrinfo->ai_addr;
+			message.msg_namelen = dgr_addrinfo->ai_addrlen;
+			message.msg_iov = dgr_fragment_iov;
+			message.msg_iovlen = iovcnt;
+			numbytes = sendmsg(dgr_socket, &message, 0);
+		}
+		else /* Too many pieces for one sendmsg(), copy them together. */
+			numbytes = sendto(dgr_socket, dgr_flatten(dgr_fragment_iov, iovcnt, sizeof(header)+len),
+			                  sizeof(header)+len, 0,
+			                  dgr_addrinfo->ai_addr, dgr_addrinfo->ai_addrlen);
+		if(numbytes == -1) {
+			msg(FATAL, "DGR Master: sendmsg: %s", strerror(errno));
+			if(errno == EMSGSIZE)
+				msg(FATAL, "DGR Master: Try setting DGR_MTU to a value smaller than %d.\n", dgr_mtu);
+			exit(EXIT_FAILURE);
+		}
+		if(numbytes != (int) sizeof(header)+len) // double check that everything got sent
+		{
+			msg(FATAL, "DGR Master: Error sending all of the bytes in the message.");
+			exit(EXIT_FAILURE);
+		}
+	}
+#endif // __MINGW32__
+}
+
 /** Serializes and sends DGR data out across a network. */
 static void dgr_send(void)
 {
@@ -456,32 +1318,182 @@ static void dgr_send(void)
 	if(dgr_disabled)
 		return;
 
-	int  bufSize = 0;
-	char *buf = dgr_serialize(&bufSize);
+	int bufSize;
+	if(dgr_delta)
+	{
+		/* Delta packets are sent even if nothing changed so that
+		 * slaves know that the master is still running. */
+		bufSize = dgr_pack(1, dgr_sequence % dgr_keyframe_interval == 0);
+		dgr_sequence++;
+	}
+	else
+		bufSize = dgr_pack(0, 0);
 	
 	// no need to send an empty packet.
 	if(bufSize == 0 || dgr_list_size == 0)
 		return;
 	
-	/* If the message is too large to send, sendto() will not send the
-	 * message, and will set errno to EMSGSIZE. The MTU may limit the
-	 * amount of data that we can send. With an MTU of 1500, we can
-	 * only expect to send 1472 bytes. Even with the small MTU, the
-	 * system may still allow us to send larger UDP packets due to
-	 * IPv4 fragmentation. */
-	int numbytes;
-	if((numbytes = sendto(dgr_socket, buf, bufSize, 0,
-	                      dgr_addrinfo->ai_addr, dgr_addrinfo->ai_addrlen)) == -1) {
-		msg(FATAL, "DGR Master: sendto: %s", strerror(errno));
-		exit(EXIT_FAILURE);
+	dgr_send_frame(bufSize);
+#endif // __MINGW32__
+}
+
+/** Is a frame older than another frame?
+ *
+ * @param frame The frame number to check.
+ * @param newest The number of the newest frame.
+ * @return 1 if 'frame' is not newer than 'newest' and not so old
+ * that the master must have restarted.
+ */
+static int dgr_frame_is_old(unsigned int frame, unsigned int newest)
+{
+	int diff = (int) (frame - newest);
+	return diff <= 0 && diff > -DGR_FRAME_WINDOW;
+}
+
+/** Slave: Called before a newly completed frame replaces the one in
+ * dgr_complete_buffer. A full packet that is replaced doesn't matter
+ * because the new packet contains every record too. Each
+ * delta-encoded packet only contains the records that changed, so a
+ * replaced delta-encoded packet is unserialized right away to apply
+ * every packet in order. */
+static void dgr_complete_replace(void)
+{
+	unsigned int magic = 0;
+	if(!dgr_complete_ready || dgr_complete_size < (int) sizeof(magic))
+		return;
+	memcpy(&magic, dgr_complete_buffer, sizeof(magic));
+	if(magic == DGR_DELTA_MAGIC)
+		dgr_unserialize(dgr_complete_size, dgr_complete_buffer);
+}
+
+/** Stores a complete frame so that it can be unserialized after all
+ * available datagrams have been read. */
+static void dgr_frame_complete(const char *data, int size)
+{
+	dgr_complete_replace();
+	dgr_reserve((void**) &dgr_complete_buffer, &dgr_complete_buffer_capacity, size, 1);
+	memcpy(dgr_complete_buffer, data, size);
+	dgr_complete_size = size;
+	dgr_complete_ready = 1;
+}
+
+/** Processes one datagram received by a slave. Fragments are copied
+ * into the frame that is being reassembled. A fragment of a newer
+ * frame causes an incomplete frame to be skipped.
+ *
+ * @param data The datagram.
+ * @param len The size of the datagram.
+ */
+static void dgr_receive_datagram(const char *data, int len)
+{
+	dgr_frame_header header;
+	if(len >= (int) sizeof(header))
+		memcpy(&header, data, sizeof(header));
+	dgr_swap_packet release;
+	if(len == (int) sizeof(release))
+		memcpy(&release, data, sizeof(release));
+	if(len == (int) sizeof(release) && release.magic == DGR_SWAP_RELEASE_MAGIC)
+	{
+		if(!dgr_swap_released || !dgr_frame_is_old(release.frame, dgr_swap_release_frame))
+			dgr_swap_release_frame = release.frame;
+		dgr_swap_released = 1;
+		return;
 	}
-	free(buf);
-	if(numbytes != bufSize) // double check that everything got sent
+	if(len < (int) sizeof(header) || header.magic != DGR_FRAME_MAGIC)
 	{
-		msg(FATAL, "DGR Master: Error sending all of the bytes in the message.");
-		exit(EXIT_FAILURE);
+		/* A master that doesn't split packets into frames. */
+		dgr_frame_complete(data, len);
+		dgr_complete_numbered = 0;
+		return;
+	}
+
+	const char *payload = data + sizeof(header);
+	int payloadLen = len - sizeof(header);
+	if(header.fragments == 0 || header.fragment >= header.fragments ||
+	   header.size > DGR_FRAME_MAX_SIZE ||
+	   header.offset > header.size || payloadLen > (int)(header.size - header.offset))
+	{
+		msg(ERROR, "DGR Slave: Received a malformed fragment.\n");
+		return;
+	}
+
+	/* Ignore frames older than one we already have. */
+	if(dgr_complete_any && dgr_frame_is_old(header.frame, dgr_complete_frame))
+		return;
+
+	if(!dgr_frame_started || header.frame != dgr_frame_current.frame)
+	{
+		if(dgr_frame_started && dgr_frame_is_old(header.frame, dgr_frame_current.frame))
+			return; // a late fragment of a frame that we skipped
+		if(dgr_frame_started)
+			msg(DEBUG, "DGR Slave: Skipping frame %u, received %d of %d fragments.\n",
+			    dgr_frame_current.frame, dgr_frame_received, dgr_frame_current.fragments);
+
+		dgr_frame_current = header;
+		dgr_frame_started = 1;
+		dgr_frame_received = 0;
+		dgr_reserve((void**) &dgr_frame_buffer, &dgr_frame_buffer_capacity, header.size, 1);
+		dgr_reserve((void**) &dgr_frame_have, &dgr_frame_have_capacity, header.fragments, 1);
+		memset(dgr_frame_have, 0, header.fragments);
+	}
+	else if(header.size != dgr_frame_current.size || header.fragments != dgr_frame_current.fragments)
+	{
+		msg(ERROR, "DGR Slave: Received a fragment that doesn't match the other fragments of frame %u.\n", header.frame);
+		return;
+	}
+
+	if(dgr_frame_have[header.fragment])
+		return; // duplicate
+	dgr_frame_have[header.fragment] = 1;
+	memcpy(dgr_frame_buffer + header.offset, payload, payloadLen);
+	dgr_frame_received++;
+
+	if(dgr_frame_received == dgr_frame_current.fragments)
+	{
+		dgr_complete_replace();
+		/* Swap the buffers instead of copying the frame. */
+		char *tmp = dgr_complete_buffer;
+		int tmpCapacity = dgr_complete_buffer_capacity;
+		dgr_complete_buffer = dgr_frame_buffer;
+		dgr_complete_buffer_capacity = dgr_frame_buffer_capacity;
+		dgr_frame_buffer = tmp;
+		dgr_frame_buffer_capacity = tmpCapacity;
+
+		dgr_complete_size = dgr_frame_current.size;
+		dgr_complete_ready = 1;
+		dgr_complete_any = 1;
+		dgr_complete_numbered = 1;
+		dgr_complete_frame = dgr_frame_current.frame;
+		dgr_frame_started = 0;
 	}
-#endif // __MINGW32__
+}
+
+/** Slave: Remembers which computer sent us a packet so that swap
+ * barrier acknowledgments can be sent to it. */
+static void dgr_swap_learn_master(const struct sockaddr_storage *addr, socklen_t len)
+{
+#ifndef __MINGW32__
+	if(!dgr_swap || dgr_swap_master_fixed)
+		return;
+	memcpy(&dgr_swap_master, addr, len);
+	dgr_swap_master_len = len;
+	if(addr->ss_family == AF_INET)
+		((struct sockaddr_in*) &dgr_swap_master)->sin_port = dgr_swap_port;
+	else if(addr->ss_family == AF_INET6)
+		((struct sockaddr_in6*) &dgr_swap_master)->sin6_port = dgr_swap_port;
+#endif
+}
+
+/** Slave: Unserializes the newest complete frame (if there is one
+ * that we haven't unserialized yet). */
+static void dgr_apply_complete(void)
+{
+	if(!dgr_complete_ready)
+		return;
+	dgr_unserialize(dgr_complete_size, dgr_complete_buffer);
+	dgr_complete_ready = 0;
+	dgr_applied_frame = dgr_complete_frame;
+	dgr_applied_numbered = dgr_complete_numbered;
 }
 
 /** Receives DGR data from the network.
@@ -519,6 +1531,8 @@ static void dgr_receive(int timeout)
 	}
 	else if(retval == 0) // nothing to read within timeout value
 	{
+		/* The swap barrier may have reassembled a frame already. */
+		dgr_apply_complete();
 		/* If a non-zero timeout value was specified and we timed out, exit() */
 		if(timeout > 0)
 		{
@@ -533,19 +1547,23 @@ static void dgr_receive(int timeout)
 	struct sockaddr_storage their_addr;
 	socklen_t addr_len = sizeof their_addr;
 
-	char serialized[1024*1024];
+	if(dgr_receive_buffer == NULL)
+		dgr_receive_buffer = malloc(DGR_RECEIVE_SIZE);
+	char *serialized = dgr_receive_buffer;
 	int numbytes;
 	/* Read packets until there are no more to read. This ensures that
-	 * we are always using the newest packet. For example, 5 packets
-	 * might arrive while the slave is rendering a scene. We want to
-	 * make sure that we use the newest packet. */
+	 * we are always using the newest complete frame. For example, 5
+	 * frames might arrive while the slave is rendering a scene. We
+	 * want to make sure that we use the newest frame. */
 	while(1)
 	{
-		if ((numbytes = recvfrom(dgr_socket, serialized, 1024*1024, 0,
+		if ((numbytes = recvfrom(dgr_socket, serialized, DGR_RECEIVE_SIZE, 0,
 		                         (struct sockaddr *)&their_addr, &addr_len)) == -1) {
 			msg(FATAL, "recvfrom: %s", strerror(errno));
 			exit(EXIT_FAILURE);
 		}
+		dgr_receive_datagram(serialized, numbytes);
+		dgr_swap_learn_master(&their_addr, addr_len);
 
 		// if there is nothing to read anymore from the socket, break out of loop.
 		struct pollfd fds;
@@ -556,11 +1574,352 @@ static void dgr_receive(int timeout)
 			break;
 	}
 	dgr_time_lastreceive = time(NULL);
-	
-	dgr_unserialize(numbytes, serialized);
+
+	dgr_apply_complete();
 #endif // __MINGW32__
 }
 
+/** Reads the swap barrier environment variables and creates the
+ * master's socket for acknowledgments. */
+static void dgr_swap_init(void)
+{
+#ifndef __MINGW32__
+	const char *swap = getenv("DGR_SWAP_BARRIER");
+	dgr_swap = (swap != NULL && strcmp(swap, "1") == 0);
+	if(!dgr_swap)
+		return;
+
+	const char *timeout = getenv("DGR_SWAP_TIMEOUT");
+	if(timeout != NULL && atoi(timeout) > 0)
+		dgr_swap_timeout = atoi(timeout);
+	const char *port = getenv("DGR_SWAP_PORT");
+	if(port == NULL || strlen(port) == 0)
+		port = DGR_SWAP_DEFAULT_PORT;
+
+	struct addrinfo hints, *servinfo, *p;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	int rv;
+
+	if(dgr_mode)
+	{
+		const char *nodes = getenv("DGR_SWAP_NODES");
+		if(nodes != NULL && atoi(nodes) > 0)
+			dgr_swap_nodes_expected = atoi(nodes);
+
+		/* Listen for acknowledgments with the same protocol that we
+		 * send packets with. */
+		hints.ai_family = dgr_addrinfo->ai_family;
+		hints.ai_flags = AI_PASSIVE;
+		if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
+			msg(FATAL, "DGR Master: getaddrinfo: %s\n", gai_strerror(rv));
+			exit(EXIT_FAILURE);
+		}
+		for(p = servinfo; p != NULL; p = p->ai_next) {
+			if ((dgr_swap_socket = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+				continue;
+			if (bind(dgr_swap_socket, p->ai_addr, p->ai_addrlen) == -1) {
+				close(dgr_swap_socket);
+				msg(ERROR, "DGR Master: bind: %s", strerror(errno));
+				continue;
+			}
+			break;
+		}
+		if (p == NULL) {
+			msg(FATAL, "DGR Master: Failed to bind socket for swap barrier on port %s\n", port);
+			exit(EXIT_FAILURE);
+		}
+		freeaddrinfo(servinfo);
+		msg(INFO, "DGR Master: Swap barrier is enabled, listening on port %s with a %d ms timeout.\n", port, dgr_swap_timeout);
+	}
+	else
+	{
+		dgr_swap_port = htons(atoi(port));
+		const char *masterIp = getenv("DGR_SWAP_MASTER_IP");
+		if(masterIp != NULL && strlen(masterIp) > 0)
+		{
+			if ((rv = getaddrinfo(masterIp, port, &hints, &servinfo)) != 0) {
+				msg(FATAL, "DGR Slave: DGR_SWAP_MASTER_IP: getaddrinfo: %s\n", gai_strerror(rv));
+				exit(EXIT_FAILURE);
+			}
+			memcpy(&dgr_swap_master, servinfo->ai_addr, servinfo->ai_addrlen);
+			dgr_swap_master_len = servinfo->ai_addrlen;
+			dgr_swap_master_fixed = 1;
+			freeaddrinfo(servinfo);
+		}
+		msg(INFO, "DGR Slave: Swap barrier is enabled with a %d ms timeout.\n", dgr_swap_timeout);
+	}
+#endif // __MINGW32__
+}
+
+/** Master: Finds (or adds) the slave that sent an acknowledgment. */
+static dgr_swap_node* dgr_swap_find_node(const struct sockaddr_storage *addr, socklen_t len)
+{
+#ifndef __MINGW32__
+	for(int i=0; i<dgr_swap_node_count; i++)
+		if(dgr_swap_nodes[i].addrlen == len && memcmp(&dgr_swap_nodes[i].addr, addr, len) == 0)
+			return &(dgr_swap_nodes[i]);
+
+	dgr_reserve((void**) &dgr_swap_nodes, &dgr_swap_node_capacity, dgr_swap_node_count+1, sizeof(dgr_swap_node));
+	dgr_swap_node *node = &(dgr_swap_nodes[dgr_swap_node_count++]);
+	memset(node, 0, sizeof(dgr_swap_node));
+	memcpy(&node->addr, addr, len);
+	node->addrlen = len;
+	char host[64], serv[16];
+	if(getnameinfo((const struct sockaddr*) addr, len, host, sizeof(host), serv, sizeof(serv),
+	               NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+		snprintf(node->name, sizeof(node->name), "%.63s:%.15s", host, serv);
+	else
+		snprintf(node->name, sizeof(node->name), "slave %d", dgr_swap_node_count-1);
+	msg(INFO, "DGR Master: Slave %s joined the swap barrier.\n", node->name);
+	return node;
+#else
+	return NULL;
+#endif
+}
+
+/** Master: Waits until every slave has acknowledged 'frame' or until
+ * the timeout expires. */
+static void dgr_swap_barrier_master(unsigned int frame)
+{
+#ifndef __MINGW32__
+	long start = kuhl_microseconds();
+	for(int i=0; i<dgr_swap_node_count; i++)
+		dgr_swap_nodes[i].ready = 0;
+
+	while(1)
+	{
+		/* Read every acknowledgment that has arrived */
+		dgr_swap_packet ack;
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof(addr);
+		int numbytes;
+		while((numbytes = recvfrom(dgr_swap_socket, &ack, sizeof(ack), MSG_DONTWAIT,
+		                           (struct sockaddr*) &addr, &addrlen)) >= 0)
+		{
+			if(numbytes == sizeof(ack) && ack.magic == DGR_SWAP_ACK_MAGIC)
+			{
+				dgr_swap_node *node = dgr_swap_find_node(&addr, addrlen);
+				if(ack.frame == frame && !node->ready)
+				{
+					long skew = kuhl_microseconds() - start;
+					node->ready = 1;
+					node->misses = 0;
+					node->skewTotal += skew;
+					node->samples++;
+					if(skew > node->skewMax)
+						node->skewMax = skew;
+				}
+			}
+			addrlen = sizeof(addr);
+		}
+
+		int waiting = dgr_swap_node_count < dgr_swap_nodes_expected;
+		for(int i=0; i<dgr_swap_node_count; i++)
+			if(!dgr_swap_nodes[i].ready && dgr_swap_nodes[i].misses < DGR_SWAP_MAX_MISSES)
+				waiting = 1;
+		if(!waiting)
+			break;
+
+		int remaining = dgr_swap_timeout - (kuhl_microseconds() - start)/1000;
+		if(remaining <= 0)
+			break;
+		struct pollfd fds;
+		fds.fd = dgr_swap_socket;
+		fds.events = POLLIN;
+		poll(&fds, 1, remaining);
+	}
+
+	for(int i=0; i<dgr_swap_node_count; i++)
+	{
+		if(dgr_swap_nodes[i].ready)
+			continue;
+		if(dgr_swap_nodes[i].misses == DGR_SWAP_MAX_MISSES-1)
+			msg(WARNING, "DGR Master: Slave %s missed %d swap barriers in a row, not waiting for it until it catches up.\n",
+			    dgr_swap_nodes[i].name, DGR_SWAP_MAX_MISSES);
+		dgr_swap_nodes[i].misses++;
+		dgr_swap_nodes[i].timeouts++;
+	}
+
+	dgr_swap_packet release;
+	release.magic = DGR_SWAP_RELEASE_MAGIC;
+	release.frame = frame;
+	if(sendto(dgr_socket, &release, sizeof(release), 0,
+	          dgr_addrinfo->ai_addr, dgr_addrinfo->ai_addrlen) == -1)
+		msg(ERROR, "DGR Master: Failed to release swap barrier: %s\n", strerror(errno));
+#endif // __MINGW32__
+}
+
+/** Slave: Tells the master that we rendered 'frame' and waits until
+ * the master says that we should swap (or until the timeout
+ * expires). */
+static void dgr_swap_barrier_slave(unsigned int frame)
+{
+#ifndef __MINGW32__
+	if(dgr_swap_master_len == 0)
+		return;
+	dgr_swap_packet ack;
+	ack.magic = DGR_SWAP_ACK_MAGIC;
+	ack.frame = frame;
+	if(sendto(dgr_socket, &ack, sizeof(ack), 0,
+	          (struct sockaddr*) &dgr_swap_master, dgr_swap_master_len) == -1)
+	{
+		msg(ERROR, "DGR Slave: Failed to send acknowledgment to swap barrier: %s\n", strerror(errno));
+		return;
+	}
+
+	if(dgr_receive_buffer == NULL)
+		dgr_receive_buffer = malloc(DGR_RECEIVE_SIZE);
+	long start = kuhl_microseconds();
+	/* Fragments of the next frame that arrive while we wait are
+	 * reassembled and used by the next dgr_update(). */
+	while(!dgr_swap_released || (int) (dgr_swap_release_frame - frame) < 0)
+	{
+		int remaining = dgr_swap_timeout - (kuhl_microseconds() - start)/1000;
+		struct pollfd fds;
+		fds.fd = dgr_socket;
+		fds.events = POLLIN;
+		if(remaining <= 0 || poll(&fds, 1, remaining) <= 0)
+		{
+			dgr_swap_timeouts++;
+			break;
+		}
+		int numbytes;
+		while((numbytes = recv(dgr_socket, dgr_receive_buffer, DGR_RECEIVE_SIZE, MSG_DONTWAIT)) >= 0)
+			dgr_receive_datagram(dgr_receive_buffer, numbytes);
+	}
+
+	long wait = kuhl_microseconds() - start;
+	dgr_swap_waitTotal += wait;
+	dgr_swap_waits++;
+	if(wait > dgr_swap_waitMax)
+		dgr_swap_waitMax = wait;
+#endif // __MINGW32__
+}
+
+/** Slave: When the swap barrier is used, the master sends the next
+ * frame right after releasing the barrier. Waits (up to the swap
+ * timeout) for that frame to arrive so that we don't render the
+ * same frame twice and fall behind the other slaves. */
+static void dgr_swap_wait_frame(void)
+{
+#ifndef __MINGW32__
+	if(dgr_receive_buffer == NULL)
+		dgr_receive_buffer = malloc(DGR_RECEIVE_SIZE);
+	long start = kuhl_microseconds();
+	while(!dgr_complete_ready || !dgr_complete_numbered ||
+	      dgr_frame_is_old(dgr_complete_frame, dgr_applied_frame))
+	{
+		int remaining = dgr_swap_timeout - (kuhl_microseconds() - start)/1000;
+		struct pollfd fds;
+		fds.fd = dgr_socket;
+		fds.events = POLLIN;
+		if(remaining <= 0 || poll(&fds, 1, remaining) <= 0)
+			return;
+		int numbytes;
+		while((numbytes = recv(dgr_socket, dgr_receive_buffer, DGR_RECEIVE_SIZE, MSG_DONTWAIT)) >= 0)
+			dgr_receive_datagram(dgr_receive_buffer, numbytes);
+	}
+#endif // __MINGW32__
+}
+
+/** Indicates if the swap barrier is enabled (see DGR_SWAP_BARRIER).
+
+    @return 1 if the swap barrier is enabled, 0 otherwise.
+*/
+int dgr_swap_enabled(void)
+{
+	return !dgr_disabled && dgr_swap;
+}
+
+/** Waits until all of the computers in the cluster are ready to swap
+ * buffers. This should be called right before swapping buffers (and
+ * after glFinish() so that rendering has actually completed). It
+ * returns immediately if the swap barrier is not enabled. */
+void dgr_swap_barrier(void)
+{
+	if(!dgr_swap_enabled())
+		return;
+	TRACE_SCOPE("dgr_swap_barrier");
+	long start = kuhl_microseconds();
+	if(dgr_mode)
+	{
+		dgr_swap_barrier_master(dgr_frame-1);
+		long wait = kuhl_microseconds() - start;
+		dgr_swap_waitTotal += wait;
+		dgr_swap_waits++;
+		if(wait > dgr_swap_waitMax)
+			dgr_swap_waitMax = wait;
+	}
+	else if(dgr_applied_numbered)
+		dgr_swap_barrier_slave(dgr_applied_frame);
+}
+
+/** Gets statistics about how long the master waited at the swap
+ * barrier for one slave.
+ *
+ * @param node The index of the slave (starting at 0). Use -1 for
+ * statistics about this process (how long the master or slave
+ * waited at the barrier in total).
+ * @param name Set to the address of the slave (may be NULL).
+ * @param avgMs Set to the average number of milliseconds (may be NULL).
+ * @param maxMs Set to the maximum number of milliseconds (may be NULL).
+ * @param timeouts Set to the number of times that the barrier timed out (may be NULL).
+ * @return 1 if the slave exists, 0 otherwise.
+ */
+int dgr_swap_stats(int node, const char **name, float *avgMs, float *maxMs, int *timeouts)
+{
+	long total, max;
+	int samples, missed;
+	const char *n;
+	if(node == -1)
+	{
+		if(!dgr_swap_enabled())
+			return 0;
+		n = dgr_mode ? "master" : "slave";
+		total = dgr_swap_waitTotal;
+		max = dgr_swap_waitMax;
+		samples = dgr_swap_waits;
+		missed = dgr_swap_timeouts;
+		if(dgr_mode)
+			for(int i=0; i<dgr_swap_node_count; i++)
+				missed += dgr_swap_nodes[i].timeouts;
+	}
+	else if(node >= 0 && node < dgr_swap_node_count)
+	{
+		dgr_swap_node *s = &(dgr_swap_nodes[node]);
+		n = s->name;
+		total = s->skewTotal;
+		max = s->skewMax;
+		samples = s->samples;
+		missed = s->timeouts;
+	}
+	else
+		return 0;
+
+	if(name)
+		*name = n;
+	if(avgMs)
+		*avgMs = samples > 0 ? total/1000.0f/samples : 0;
+	if(maxMs)
+		*maxMs = max/1000.0f;
+	if(timeouts)
+		*timeouts = missed;
+	return 1;
+}
+
+/** Prints statistics about the swap barrier for each slave. */
+void dgr_swap_print_stats(void)
+{
+	const char *name;
+	float avg, max;
+	int timeouts;
+	for(int i=-1; dgr_swap_stats(i, &name, &avg, &max, &timeouts); i++)
+		msg(INFO, "DGR swap barrier: %-24s wait avg %6.2f ms max %6.2f ms, %d timeouts\n",
+		    name, avg, max, timeouts);
+}
+
 /** Send or receive data depending on DGR configuration. If we are a
  * DGR master, dgr_update() will send data to the network. if we are
  * DGR slave, dgr_update() will receive data from the network. In an
@@ -570,6 +1929,7 @@ static void dgr_receive(int timeout)
  * exit. */
 void dgr_update(void)
 {
+	TRACE_SCOPE("dgr_update");
 	if(dgr_mode)
 		dgr_send();
 	else
@@ -578,7 +1938,11 @@ void dgr_update(void)
 		if(dgr_time_lastreceive == 0)
 			dgr_receive(10000);
 		else
+		{
+			if(dgr_swap_enabled() && dgr_applied_numbered)
+				dgr_swap_wait_frame();
 			dgr_receive(0);
+		}
 
 		int died = 0;
 		if(dgr_get("!!!dgr_died!!!", &died, sizeof(int)) >= 0 &&
@@ -20,10 +20,18 @@ extern "C" {
 void dgr_init(void);
 void dgr_update(void);
 void dgr_setget(const char *name, void* buffer, int bufferSize);
+int dgr_register(const char *name);
+void dgr_setget_handle(int handle, void* buffer, int bufferSize);
 void dgr_print_list(void);
 int dgr_is_master(void);
 int dgr_is_enabled(void);
 void dgr_exit(void);
+char* dgr_serialize(int *size);
+void dgr_unserialize(int size, const char *serialized);
+int dgr_swap_enabled(void);
+void dgr_swap_barrier(void);
+int dgr_swap_stats(int node, const char **name, float *avgMs, float *maxMs, int *timeouts);
+void dgr_swap_print_stats(void);
 	
 #ifdef __cplusplus
 } // end extern "C"
@@ -1,8 +1,10 @@
+#include <stdlib.h>
+#include <string.h>
 #include "font-helper.h"
 #include "kuhl-util.h"
 
-#define min(x, y) (x < y) ? x : y
-#define max(x, y) (x > y) ? x : y
+#define min(x, y) ((x) < (y) ? (x) : (y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
 
 #ifdef KUHL_UTIL_USE_FREETYPE
 static FT_Library lib;
@@ -32,10 +34,104 @@ static int font_load(FT_Face* face, const char* fileName, const unsigned int poi
 	printf("Font: Loaded %s successfully\n", (*face)->family_name);
 	return 1;
 }
+
+/** Rasterizes every character once and packs them into rows of the
+ * atlas texture (info->tex, which must be bound). Also stores the
+ * metrics and kerning for each character so that font_append() never
+ * needs to call FreeType. */
+static int font_build_atlas(font_info* info) {
+	FT_Face face = info->face;
+	FT_GlyphSlot g = face->glyph;
+
+	/* Measure the glyphs and pick an atlas width that gives a roughly
+	 * square texture. Glyphs are separated by a pixel so that linear
+	 * filtering doesn't blend neighboring glyphs. */
+	long area = 0;
+	int widest = 0;
+	for(int i=0; i<FONT_NUM_CHARS; i++) {
+		font_glyph *glyph = &info->glyphs[i];
+		memset(glyph, 0, sizeof(font_glyph));
+		if(FT_Load_Char(face, FONT_FIRST_CHAR+i, FT_LOAD_RENDER))
+			continue;
+		glyph->width = g->bitmap.width;
+		glyph->rows = g->bitmap.rows;
+		glyph->left = g->bitmap_left;
+		glyph->top = g->bitmap_top;
+		glyph->advance = g->advance.x >> 6;
+		area += (long) (glyph->width+1) * (glyph->rows+1);
+		widest = max(widest, glyph->width+1);
+	}
+	int atlasWidth = 64;
+	while(atlasWidth < 4096 && ((long) atlasWidth*atlasWidth < area || atlasWidth < widest))
+		atlasWidth *= 2;
+
+	/* Place the glyphs left to right in rows. */
+	int penX = 0, penY = 0, rowHeight = 0;
+	int *position = kuhl_malloc(sizeof(int)*2*FONT_NUM_CHARS);
+	for(int i=0; i<FONT_NUM_CHARS; i++) {
+		font_glyph *glyph = &info->glyphs[i];
+		if(penX + glyph->width+1 > atlasWidth) {
+			penX = 0;
+			penY += rowHeight;
+			rowHeight = 0;
+		}
+		position[i*2] = penX;
+		position[i*2+1] = penY;
+		penX += glyph->width+1;
+		rowHeight = max(rowHeight, glyph->rows+1);
+	}
+	int atlasHeight = 1;
+	while(atlasHeight < penY + rowHeight)
+		atlasHeight *= 2;
+
+	unsigned char *pixels = kuhl_malloc(atlasWidth*atlasHeight);
+	memset(pixels, 0, atlasWidth*atlasHeight);
+	for(int i=0; i<FONT_NUM_CHARS; i++) {
+		font_glyph *glyph = &info->glyphs[i];
+		if(glyph->width == 0 || glyph->rows == 0 || FT_Load_Char(face, FONT_FIRST_CHAR+i, FT_LOAD_RENDER))
+			continue;
+		for(int row=0; row<glyph->rows; row++)
+			memcpy(pixels + (position[i*2+1]+row)*atlasWidth + position[i*2],
+			       g->bitmap.buffer + row*g->bitmap.pitch, glyph->width);
+		glyph->s0 = position[i*2] / (float) atlasWidth;
+		glyph->t0 = position[i*2+1] / (float) atlasHeight;
+		glyph->s1 = (position[i*2] + glyph->width) / (float) atlasWidth;
+		glyph->t1 = (position[i*2+1] + glyph->rows) / (float) atlasHeight;
+	}
+
+	GLint alignment;
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, atlasWidth, atlasHeight, 0, GL_RED, GL_UNSIGNED_BYTE, pixels);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+	kuhl_errorcheck();
+	free(pixels);
+	free(position);
+
+	info->kerning = NULL;
+	if(FT_HAS_KERNING(face)) {
+		info->kerning = kuhl_malloc(sizeof(short)*FONT_NUM_CHARS*FONT_NUM_CHARS);
+		for(int a=0; a<FONT_NUM_CHARS; a++) {
+			FT_UInt left = FT_Get_Char_Index(face, FONT_FIRST_CHAR+a);
+			for(int b=0; b<FONT_NUM_CHARS; b++) {
+				FT_Vector delta;
+				FT_UInt right = FT_Get_Char_Index(face, FONT_FIRST_CHAR+b);
+				if(FT_Get_Kerning(face, left, right, FT_KERNING_DEFAULT, &delta))
+					delta.x = 0;
+				info->kerning[a*FONT_NUM_CHARS+b] = delta.x >> 6;
+			}
+		}
+	}
+
+	printf("Font: Created %dx%d glyph atlas for %s\n", atlasWidth, atlasHeight, face->family_name);
+	return 1;
+}
 #endif
 
 /** Initializes the vertex array object (VAO), vertex buffer object (VBO) and texture
 	associated with this font_info and initializes other variables inside of the struct.
+	Every printable ASCII character is rendered once into the texture (a glyph atlas)
+	so that text can be drawn without calling FreeType again.
 
     @param info A font_info struct populated with the information necessary to draw text.
 
@@ -85,8 +181,6 @@ int font_info_new(font_info* info, const GLuint program, const char* fontFile, c
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-
 	glGenVertexArrays(1, &info->vao);
 	kuhl_errorcheck();
 	glBindVertexArray(info->vao);
@@ -109,8 +203,12 @@ int font_info_new(font_info* info, const GLuint program, const char* fontFile, c
 	info->program = program;
 	info->pointSize = pointSize;
 	info->pixelsPerPoint = pixelsPerPoint;
+	info->vertices = NULL;
+	info->vertexCount = 0;
+	info->vertexCapacity = 0;
+	info->vboSize = 0;
 	
-	return 1;
+	return font_build_atlas(info);
 	#endif
 }
 
@@ -136,6 +234,14 @@ void font_info_release(font_info* info)
 	glDeleteTextures(1, &info->tex);
 	glDeleteVertexArrays(1, &info->vao);
 	glDeleteBuffers(1, &info->vbo);
+	free(info->vertices);
+	info->vertices = NULL;
+	info->vertexCount = info->vertexCapacity = 0;
+	#ifdef KUHL_UTIL_USE_FREETYPE
+	free(info->kerning);
+	info->kerning = NULL;
+	FT_Done_Face(info->face);
+	#endif
 }
 
 void font_release() {
@@ -144,76 +250,132 @@ void font_release() {
 	#endif
 }
 
-static void render_char(font_info* info, const char ch, float* x, float* y, float sx, float sy, float startX, float startY) {
-	#ifdef KUHL_UTIL_USE_FREETYPE
-	FT_GlyphSlot g = info->face->glyph;
-	if(FT_Load_Char(info->face, ch, FT_LOAD_RENDER))
-		return;
-	
-	if (ch == '\n') {
-		*y -= info->pointSize * sy;
-		*x = startX;
-		return;
-	} else if (ch == '\r') {
-		*x = startX;
-		return;
+/** Adds a vertex (in glyph pixels, with y pointing down) to the
+ * vertices that font_flush() will draw. */
+static void add_vertex(font_info* info, float x, float y, float s, float t) {
+	if(info->vertexCount == info->vertexCapacity) {
+		info->vertexCapacity = info->vertexCapacity ? info->vertexCapacity*2 : 6*64;
+		info->vertices = realloc(info->vertices, sizeof(GLfloat)*4*info->vertexCapacity);
+		if(info->vertices == NULL) {
+			fprintf(stderr, "Font: Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
 	}
+	GLfloat *v = info->vertices + 4*info->vertexCount;
+	v[0] = x;
+	v[1] = y;
+	v[2] = s;
+	v[3] = t;
+	info->vertexCount++;
+}
 
-	glTexImage2D(
-		GL_TEXTURE_2D,
-		0,
-		GL_RED,
-		g->bitmap.width,
-		g->bitmap.rows,
-		0,
-		GL_RED,
-		GL_UNSIGNED_BYTE,
-		g->bitmap.buffer
-	);
-	kuhl_errorcheck();
-	
-	float x2 = *x + g->bitmap_left * sx;
-	float y2 = -*y - g->bitmap_top * sy;
-	float w = g->bitmap.width * sx;
-	float h = g->bitmap.rows * sy;
-	
-	GLfloat box[4][4] = {
-		{x2,     -y2    , 0, 0},
-		{x2 + w, -y2    , 1, 0},
-		{x2,     -y2 - h, 0, 1},
-		{x2 + w, -y2 - h, 1, 1},
-	};
-
-	glBufferData(GL_ARRAY_BUFFER, sizeof box, box, GL_DYNAMIC_DRAW);
-	kuhl_errorcheck();
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	kuhl_errorcheck();
-	
-	*x += (g->advance.x >> 6) * sx;
-	*y += (g->advance.y >> 6) * sy;
+/** Adds a string to the text that will be drawn by the next call to
+	font_flush(). Adding several strings and then calling font_flush()
+	once draws all of them with a single draw call.
+
+	@param info The font to draw with.
+
+	@param text The string. Only printable ASCII characters, newlines
+	and carriage returns are drawn.
+
+	@param x The distance from the left edge of the window to the start of the text in glyph pixels.
+
+	@param y The distance from the top of the window to the top of the text in glyph pixels.
+*/
+void font_append(font_info* info, const char *text, float x, float y) {
+	if (info == NULL || text == NULL)
+		return;
+	#ifdef KUHL_UTIL_USE_FREETYPE
+	float penX = x;
+	float penY = y + info->pointSize; // Bitmaps start at bottom-left corner.
+	int previous = -1;
+	for(const char *p = text; *p; p++) {
+		if (*p == '\n') {
+			penY += info->pointSize;
+			penX = x;
+			previous = -1;
+			continue;
+		} else if (*p == '\r') {
+			penX = x;
+			previous = -1;
+			continue;
+		}
+		int c = (unsigned char) *p - FONT_FIRST_CHAR;
+		if(c < 0 || c >= FONT_NUM_CHARS) {
+			previous = -1;
+			continue;
+		}
+		if(previous >= 0 && info->kerning)
+			penX += info->kerning[previous*FONT_NUM_CHARS+c];
+		previous = c;
+
+		const font_glyph *g = &info->glyphs[c];
+		if(g->width > 0 && g->rows > 0) {
+			float x0 = penX + g->left;
+			float x1 = x0 + g->width;
+			float y0 = penY - g->top;
+			float y1 = y0 + g->rows;
+			add_vertex(info, x0, y0, g->s0, g->t0);
+			add_vertex(info, x1, y0, g->s1, g->t0);
+			add_vertex(info, x0, y1, g->s0, g->t1);
+			add_vertex(info, x0, y1, g->s0, g->t1);
+			add_vertex(info, x1, y0, g->s1, g->t0);
+			add_vertex(info, x1, y1, g->s1, g->t1);
+		}
+		penX += g->advance;
+	}
 	#endif
 }
 
-void font_draw(font_info* info, const char *text, float x, float y) {
-	if (info == NULL || text == NULL)
+/** Draws all of the text added with font_append() since the last
+	call to font_flush(). The caller should call glUseProgram() with
+	the font's program first.
+
+	@param info The font to draw with.
+*/
+void font_flush(font_info* info) {
+	if (info == NULL || info->vertexCount == 0)
 		return;
-	
+
+	/* Convert from glyph pixels to normalized device coordinates. */
+	float sx = (float)info->pixelsPerPoint / glutGet(GLUT_WINDOW_WIDTH);
+	float sy = (float)info->pixelsPerPoint / glutGet(GLUT_WINDOW_HEIGHT);
+	for(int i=0; i<info->vertexCount; i++) {
+		info->vertices[i*4]   = -1 + info->vertices[i*4]   * sx;
+		info->vertices[i*4+1] =  1 - info->vertices[i*4+1] * sy;
+	}
+
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, info->tex);
 	glBindVertexArray(info->vao);
 	glBindBuffer(GL_ARRAY_BUFFER, info->vbo);
-	glEnableVertexAttribArray(info->attribute_coord);
-	
-	y += info->pointSize; // Bitmaps start at bottom-left corner.
-	
-	float aspect = 1.0; //min((float) glutGet(GLUT_WINDOW_WIDTH) / width, (float) glutGet(GLUT_WINDOW_HEIGHT) / height);
-	float sx = aspect * (float)info->pixelsPerPoint / glutGet(GLUT_WINDOW_WIDTH);//
-	float sy = aspect * (float)info->pixelsPerPoint / glutGet(GLUT_WINDOW_HEIGHT);
-
-	x = -1 + x * sx;
-	y = 1 - y * sy;
-	float startX = x, startY = y;
-	const char *p;
-	for(p = text; *p; p++)
-		render_char(info, *p, &x, &y, sx, sy, startX, startY);
+
+	/* Orphan the buffer each time so that we don't wait for the
+	 * previous draw to finish using it. */
+	GLsizeiptr size = sizeof(GLfloat)*4*info->vertexCount;
+	if(size > info->vboSize)
+		info->vboSize = sizeof(GLfloat)*4*info->vertexCapacity;
+	glBufferData(GL_ARRAY_BUFFER, info->vboSize, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, size, info->vertices);
+	kuhl_errorcheck();
+	glDrawArrays(GL_TRIANGLES, 0, info->vertexCount);
+	kuhl_errorcheck();
+	info->vertexCount = 0;
+}
+
+/** Draws a string immediately. To draw several strings, it is faster
+	to call font_append() for each of them and then call font_flush()
+	once.
+
+	@param info The font to draw with.
+
+	@param text The string.
+
+	@param x The distance from the left edge of the window to the start of the text in glyph pixels.
+
+	@param y The distance from the top of the window to the top of the text in glyph pixels.
+*/
+void font_draw(font_info* info, const char *text, float x, float y) {
+	font_append(info, text, x, y);
+	font_flush(info);
 }
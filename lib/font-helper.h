@@ -16,6 +16,18 @@
 #include FT_FREETYPE_H
 #endif
 
+#define FONT_FIRST_CHAR 32 /**< First character (space) stored in the glyph atlas */
+#define FONT_NUM_CHARS 95 /**< Number of characters (printable ASCII) stored in the glyph atlas */
+
+/** The location of a character in the glyph atlas and its metrics
+ * (in glyph pixels). */
+typedef struct {
+	float s0, t0, s1, t1; /**< Texture coordinates of the glyph (t0 is the top row) */
+	short width, rows; /**< Size of the glyph bitmap */
+	short left, top; /**< Offset from the pen position to the upper left corner of the bitmap */
+	short advance; /**< How far to move the pen after drawing the glyph */
+} font_glyph;
+
 typedef struct _font_info_ {
 	#ifdef KUHL_UTIL_USE_FREETYPE
 	FT_Face face;
@@ -25,17 +37,28 @@ typedef struct _font_info_ {
 	float color[4];
 	//float colorBG[4];
 	GLuint program;
-	GLuint tex;
+	GLuint tex; /**< Glyph atlas containing all of the characters */
 	GLuint vbo;
 	GLuint vao;
 	GLint uniform_tex;
 	GLint attribute_coord;
+
+	font_glyph glyphs[FONT_NUM_CHARS];
+	short *kerning; /**< Kerning between each pair of characters (NULL if the font has no kerning) */
+
+	GLfloat *vertices; /**< Quads added by font_append() that haven't been drawn yet */
+	int vertexCount, vertexCapacity;
+	GLsizeiptr vboSize; /**< Size of the vertex buffer in bytes */
 } font_info;
 
 int font_init();
 
 int font_info_new(font_info* info, const GLuint program, const char* fontFile, const unsigned int pointSize, const unsigned int pixelsPerPoint);
 
+void font_append(font_info* info, const char *text, float x, float y);
+
+void font_flush(font_info* info);
+
 void font_draw(font_info* info, const char *text, float x, float y);
 
 void font_info_release(font_info* info);
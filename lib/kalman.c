@@ -13,6 +13,8 @@
 #include "kalman.h"
 #include "vecmat.h"
 
+#define KALMAN_PREDICT_MAX 100000 /**< Never predict more than this many microseconds past the latest measurement */
+#define KALMAN_ANGVEL_TAU 0.05 /**< Time constant (seconds) of the angular velocity smoothing */
 
 
 /** Given a fully initialized kalman_state object, and a new
@@ -32,12 +34,34 @@
  *
  */
 float kalman_estimate(kalman_state * state, float measured)
+{
+	return kalman_estimate_at(state, measured, kuhl_microseconds());
+}
+
+/** Same as kalman_estimate() except that the time of the measurement
+ * is provided. This should be used when the measurements have
+ * timestamps (for example, from a tracking system) because the time
+ * that we receive a measurement varies more than the time that the
+ * measurement was made.
+ *
+ * @param state An kalman_state struct initialized by kalman_initialize()
+ *
+ * @param measured The newest, unfiltered measurement.
+ *
+ * @param microseconds The time of the measurement. Measurements that
+ * are older than the previous measurement are ignored.
+ *
+ * @return The filtered data.
+ */
+float kalman_estimate_at(kalman_state * state, float measured, long microseconds)
 {
 	if(state->isEnabled == 0)
 		return measured;
 
-	long now = kuhl_milliseconds();
-	double dt = (now - state->time_prev)/1000.0;
+	long now = microseconds;
+	if(now < state->time_prev)
+		return state->xk_prev[0];
+	double dt = (now - state->time_prev)/1000000.0;
 	
 	/* A is the transition matrix which will move our state ahead by
 	 * one timestep. */
@@ -154,7 +178,7 @@ void kalman_initialize(kalman_state * state, float sigma_meas, float qScale)
 	memset(state, 0, sizeof(kalman_state));
 
 	state->isEnabled = 1;
-	state->time_prev = kuhl_milliseconds();
+	state->time_prev = kuhl_microseconds();
 
 	float sigma_model = 100; // confidence in current state (smaller=more confident)
 
@@ -189,3 +213,162 @@ void kalman_initialize(kalman_state * state, float sigma_meas, float qScale)
 	// Converts our state into the set of variables we are measuring.
 	vec3d_set(state->h, 1,0,0);
 }
+
+/** Extrapolates the filtered data to a different time using the
+ * filtered velocity and acceleration.
+ *
+ * @param state An kalman_state struct that kalman_estimate() has been used with.
+ * @param microseconds The time to predict the data for.
+ *
+ * @return The predicted data.
+ */
+double kalman_predict(const kalman_state * state, long microseconds)
+{
+	const double *x = state->xk_prev;
+	if(state->isEnabled == 0)
+		return x[0];
+	long ahead = microseconds - state->time_prev;
+	if(ahead < 0)
+		ahead = 0;
+	if(ahead > KALMAN_PREDICT_MAX)
+		ahead = KALMAN_PREDICT_MAX;
+	double dt = ahead / 1000000.0;
+	return x[0] + x[1]*dt + .5*x[2]*dt*dt;
+}
+
+/** Multiplies two quaternions (x,y,z,w): result = a*b */
+static void kalman_quat_mult(double result[4], const double a[4], const double b[4])
+{
+	double r[4];
+	r[0] = a[3]*b[0] + a[0]*b[3] + a[1]*b[2] - a[2]*b[1];
+	r[1] = a[3]*b[1] - a[0]*b[2] + a[1]*b[3] + a[2]*b[0];
+	r[2] = a[3]*b[2] + a[0]*b[1] - a[1]*b[0] + a[2]*b[3];
+	r[3] = a[3]*b[3] - a[0]*b[0] - a[1]*b[1] - a[2]*b[2];
+	for(int i=0; i<4; i++)
+		result[i] = r[i];
+}
+
+/** Initializes a kalman_pose_state struct.
+
+   @param state A pointer to a kalman_pose_state struct which should be initialized.
+
+   @param sigma_meas Standard deviation of the position measurement noise.
+
+   @param qScale See kalman_initialize().
+*/
+void kalman_pose_initialize(kalman_pose_state * state, float sigma_meas, float qScale)
+{
+	memset(state, 0, sizeof(kalman_pose_state));
+	for(int i=0; i<3; i++)
+		kalman_initialize(&(state->pos[i]), sigma_meas, qScale);
+	state->quat[3] = 1;
+}
+
+/** Adds a measurement of the position and orientation of a tracked
+ * object. The position is filtered with a constant acceleration
+ * Kalman filter. The angular velocity is estimated from the change
+ * in orientation between measurements.
+ *
+ * @param state A kalman_pose_state initialized by kalman_pose_initialize().
+ * @param pos The measured position.
+ * @param quat The measured orientation as a quaternion (x,y,z,w).
+ * @param microseconds The time that the measurement was made.
+ */
+void kalman_pose_update(kalman_pose_state * state, const double pos[3], const double quat[4], long microseconds)
+{
+	double q[4];
+	quatd_normalize_new(q, quat);
+
+	if(state->count == 0)
+	{
+		/* Start the position filters at the first measurement instead
+		 * of at 0 so they don't estimate a huge velocity. */
+		for(int i=0; i<3; i++)
+		{
+			vec3d_set(state->pos[i].xk_prev, pos[i], 0, 0);
+			state->pos[i].time_prev = microseconds;
+		}
+		for(int i=0; i<4; i++)
+			state->quat[i] = q[i];
+		state->time = microseconds;
+		state->count = 1;
+		return;
+	}
+	if(microseconds <= state->time)
+		return; // old or duplicate measurement
+
+	for(int i=0; i<3; i++)
+		kalman_estimate_at(&(state->pos[i]), pos[i], microseconds);
+
+	/* Rotation from the previous orientation to this one */
+	double conj[4] = { -state->quat[0], -state->quat[1], -state->quat[2], state->quat[3] };
+	double dq[4];
+	kalman_quat_mult(dq, q, conj);
+	if(dq[3] < 0) // use the shortest rotation
+		for(int i=0; i<4; i++)
+			dq[i] = -dq[i];
+
+	double dt = (microseconds - state->time) / 1000000.0;
+	double sinHalf = sqrt(dq[0]*dq[0] + dq[1]*dq[1] + dq[2]*dq[2]);
+	double angle = 2*atan2(sinHalf, dq[3]);
+	double angVel[3] = { 0, 0, 0 };
+	if(sinHalf > 1e-12)
+		for(int i=0; i<3; i++)
+			angVel[i] = dq[i]/sinHalf * angle/dt;
+
+	/* Smooth the angular velocity with an exponential moving average
+	 * that is independent of the measurement rate. */
+	double alpha = 1 - exp(-dt/KALMAN_ANGVEL_TAU);
+	for(int i=0; i<3; i++)
+		state->angVel[i] += alpha*(angVel[i] - state->angVel[i]);
+
+	for(int i=0; i<4; i++)
+		state->quat[i] = q[i];
+	state->time = microseconds;
+	state->count++;
+}
+
+/** Predicts the position and orientation of a tracked object at a
+ * time after the latest measurement. The position is extrapolated by
+ * the Kalman filters and the orientation is rotated by the angular
+ * velocity. Predictions are limited to 100 ms past the latest
+ * measurement.
+ *
+ * @param state A kalman_pose_state that has been updated with kalman_pose_update().
+ * @param microseconds The time to predict the pose at.
+ * @param pos Set to the predicted position.
+ * @param quat Set to the predicted orientation (x,y,z,w).
+ */
+void kalman_pose_predict(const kalman_pose_state * state, long microseconds, double pos[3], double quat[4])
+{
+	if(state->count < 2)
+	{
+		for(int i=0; i<3; i++)
+			pos[i] = state->pos[i].xk_prev[0];
+		for(int i=0; i<4; i++)
+			quat[i] = state->quat[i];
+		return;
+	}
+	for(int i=0; i<3; i++)
+		pos[i] = kalman_predict(&(state->pos[i]), microseconds);
+
+	long ahead = microseconds - state->time;
+	if(ahead < 0)
+		ahead = 0;
+	if(ahead > KALMAN_PREDICT_MAX)
+		ahead = KALMAN_PREDICT_MAX;
+	double dt = ahead / 1000000.0;
+
+	double speed = vec3d_norm(state->angVel);
+	double angle = speed*dt;
+	if(angle < 1e-12)
+	{
+		for(int i=0; i<4; i++)
+			quat[i] = state->quat[i];
+		return;
+	}
+	double s = sin(angle/2)/speed;
+	double dq[4] = { state->angVel[0]*s, state->angVel[1]*s, state->angVel[2]*s, cos(angle/2) };
+	kalman_quat_mult(quat, dq, state->quat);
+	quatd_normalize(quat);
+}
@@ -18,7 +18,7 @@ typedef struct {
 	int isEnabled; /**< If set to 0, disable kalman filter */
 	
 	double xk_prev[3]; /**< Filtered position, velocity, and acceleration */
-	long time_prev;    /**< Time of previous measurement in milliseconds */
+	long time_prev;    /**< Time of previous measurement in microseconds */
 
 	double p[9];   /**< Estimated error of our current state */
 	double qScale; /**< Scaling factor for Q matrix (system error) */
@@ -27,8 +27,24 @@ typedef struct {
 	double a[9];   /**< Transition matrix (moves state forward one step) */
 } kalman_state;
 
+/** Filters the position and predicts the position and orientation
+ * of a tracked object. */
+typedef struct {
+	kalman_state pos[3];  /**< One filter for each of X, Y and Z */
+	double quat[4];       /**< Latest orientation (x,y,z,w) */
+	double angVel[3];     /**< Smoothed angular velocity (axis scaled by radians per second) */
+	long time;            /**< Time of latest measurement in microseconds */
+	int count;            /**< Number of measurements so far */
+} kalman_pose_state;
+
 void kalman_initialize(kalman_state * state, float sigma_meas, float qScale);
 float kalman_estimate(kalman_state * state, float measured);
+float kalman_estimate_at(kalman_state * state, float measured, long microseconds);
+double kalman_predict(const kalman_state * state, long microseconds);
+
+void kalman_pose_initialize(kalman_pose_state * state, float sigma_meas, float qScale);
+void kalman_pose_update(kalman_pose_state * state, const double pos[3], const double quat[4], long microseconds);
+void kalman_pose_predict(const kalman_pose_state * state, long microseconds, double pos[3], double quat[4]);
 
 #ifdef __cplusplus
 } // end extern "C"
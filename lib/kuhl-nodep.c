@@ -20,6 +20,13 @@
 #include <ctype.h> // isspace()
 #include <unistd.h>
 #include <libgen.h> // dirname()
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <errno.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
 
 #include "kuhl-nodep.h"
 
@@ -189,6 +196,185 @@ static char* kuhl_path_concat_read(const char* a, const char* b)
 	}
 }
 
+#define KUHL_FIND_FILE_BUCKETS 256
+
+/** A path that kuhl_find_file() has resolved or that is listed in the
+ * manifest. */
+typedef struct kuhl_find_file_entry
+{
+	char *name; /**< The filename that was requested */
+	char *path; /**< The path to the file (NULL if the name matches more than one file in the manifest) */
+	struct kuhl_find_file_entry *next;
+} kuhl_find_file_entry;
+
+static kuhl_find_file_entry *kuhl_find_file_cache[KUHL_FIND_FILE_BUCKETS];
+static kuhl_find_file_entry *kuhl_find_file_manifest[KUHL_FIND_FILE_BUCKETS];
+static pthread_mutex_t kuhl_find_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int kuhl_find_file_manifest_loaded = 0;
+static char *kuhl_find_file_exe_dir = NULL; /**< Directory containing the executable */
+
+static unsigned int kuhl_find_file_hash(const char *str)
+{
+	unsigned int h = 5381;
+	while(*str)
+		h = h*33 + (unsigned char) *str++;
+	return h % KUHL_FIND_FILE_BUCKETS;
+}
+
+/** Finds an entry in a table. Must be called with kuhl_find_file_mutex locked. */
+static const char* kuhl_find_file_lookup(kuhl_find_file_entry **table, const char *name)
+{
+	for(kuhl_find_file_entry *e = table[kuhl_find_file_hash(name)]; e != NULL; e = e->next)
+		if(strcmp(e->name, name) == 0)
+			return e->path;
+	return NULL;
+}
+
+/** Adds an entry to a table unless the name is already there. Must be
+ * called with kuhl_find_file_mutex locked. */
+static void kuhl_find_file_insert(kuhl_find_file_entry **table, const char *name, const char *path)
+{
+	if(kuhl_find_file_lookup(table, name) != NULL)
+		return;
+	kuhl_find_file_entry *e = kuhl_malloc(sizeof(kuhl_find_file_entry));
+	e->name = strdup(name);
+	e->path = strdup(path);
+	unsigned int h = kuhl_find_file_hash(name);
+	e->next = table[h];
+	table[h] = e;
+}
+
+/** Adds a name to the manifest table. If the name is already there
+ * for a different file, it is ambiguous and the name no longer finds
+ * either file. Must be called with kuhl_find_file_mutex locked.
+ *
+ * @return 1 if the name just became ambiguous, 0 otherwise.
+ */
+static int kuhl_find_file_manifest_insert(const char *name, const char *path)
+{
+	for(kuhl_find_file_entry *e = kuhl_find_file_manifest[kuhl_find_file_hash(name)]; e != NULL; e = e->next)
+	{
+		if(strcmp(e->name, name) != 0)
+			continue;
+		if(e->path == NULL || strcmp(e->path, path) == 0)
+			return 0;
+		free(e->path);
+		e->path = NULL;
+		return 1;
+	}
+	kuhl_find_file_insert(kuhl_find_file_manifest, name, path);
+	return 0;
+}
+
+/** Removes leading "./" and "../" components from a relative path
+ * (after changing '\' into '/') so that it can be found in the
+ * manifest regardless of the directory the program expected the file
+ * to be relative to. */
+static const char* kuhl_find_file_strip(const char *path)
+{
+	for(;;)
+	{
+		if(strncmp(path, "./", 2) == 0)
+			path += 2;
+		else if(strncmp(path, "../", 3) == 0)
+			path += 3;
+		else
+			return path;
+	}
+}
+
+/** Reads the manifest named by the KUHL_FILE_MANIFEST environment
+ * variable (if it is set). Each line in the manifest is the path of a
+ * file relative to the directory containing the manifest (for
+ * example, the output of "find . -type f"). A file can then be found
+ * by any trailing part of its path. For example, if the manifest
+ * contains "./data/images/rainbow.png", kuhl_find_file() resolves
+ * "../images/rainbow.png", "images/rainbow.png" and "rainbow.png" to
+ * that file without checking the file system. A name that matches
+ * more than one file in the manifest (e.g., "rainbow.png" if there is
+ * also a "./other/rainbow.png") isn't resolved by the manifest. Must
+ * be called with kuhl_find_file_mutex locked. */
+static void kuhl_find_file_load_manifest(void)
+{
+	kuhl_find_file_manifest_loaded = 1;
+	const char *manifest = getenv("KUHL_FILE_MANIFEST");
+	if(manifest == NULL || strlen(manifest) == 0)
+		return;
+	FILE *fp = fopen(manifest, "r");
+	if(fp == NULL)
+	{
+		fprintf(stderr, "ERROR: Can't open file manifest %s (from KUHL_FILE_MANIFEST).\n", manifest);
+		return;
+	}
+	char *manifestCopy = strdup(manifest);
+	char *dir = dirname(manifestCopy);
+
+	int count = 0, ambiguous = 0;
+	char line[4096];
+	while(fgets(line, sizeof(line), fp) != NULL)
+	{
+		char *name = kuhl_trim_whitespace(line);
+		if(strlen(name) == 0 || name[0] == '#')
+			continue;
+		char *fixed = kuhl_fix_path(name);
+		char *path;
+		if(fixed[0] == '/')
+			path = strdup(fixed);
+		else
+		{
+			const char *relative = fixed;
+			if(strncmp(relative, "./", 2) == 0)
+				relative += 2;
+			path = kuhl_malloc(strlen(dir) + strlen(relative) + 2);
+			sprintf(path, "%s/%s", dir, relative);
+		}
+
+		/* Index the file by every trailing part of its path. */
+		const char *suffix = kuhl_find_file_strip(fixed[0] == '/' ? fixed+1 : fixed);
+		while(suffix != NULL && *suffix != '\0')
+		{
+			if(kuhl_find_file_manifest_insert(suffix, path))
+			{
+				if(ambiguous < 10)
+					fprintf(stderr, "WARNING: '%s' matches more than one file in file manifest %s and will be searched for instead.\n", suffix, manifest);
+				ambiguous++;
+			}
+			suffix = strchr(suffix, '/');
+			if(suffix)
+				suffix++;
+		}
+		free(path);
+		free(fixed);
+		count++;
+	}
+	fclose(fp);
+	free(manifestCopy);
+	printf("Read %d files from file manifest %s\n", count, manifest);
+	if(ambiguous > 10)
+		fprintf(stderr, "WARNING: %d names match more than one file in file manifest %s.\n", ambiguous, manifest);
+}
+
+/** Forgets the paths that kuhl_find_file() has found. Call this if
+ * files that were found previously may have moved. */
+void kuhl_find_file_cache_clear(void)
+{
+	pthread_mutex_lock(&kuhl_find_file_mutex);
+	for(int i=0; i<KUHL_FIND_FILE_BUCKETS; i++)
+	{
+		kuhl_find_file_entry *e = kuhl_find_file_cache[i];
+		while(e != NULL)
+		{
+			kuhl_find_file_entry *next = e->next;
+			free(e->name);
+			free(e->path);
+			free(e);
+			e = next;
+		}
+		kuhl_find_file_cache[i] = NULL;
+	}
+	pthread_mutex_unlock(&kuhl_find_file_mutex);
+}
+
 /* Given a filename, tries to find that file by:
    1) Looking for the file using the given path.
 
@@ -200,6 +386,13 @@ static char* kuhl_path_concat_read(const char* a, const char* b)
 
    4) Search for file using a list of hard-coded directories (also,
    try changing the path separators).
+   Paths that are found are cached for the rest of the program so
+   that asking for the same file again (from any thread) doesn't check
+   the file system again; this matters when files are on a slow
+   network file system. If KUHL_FILE_MANIFEST is set, relative paths
+   that can't be opened as they are given are looked up in the
+   manifest (see kuhl_find_file_load_manifest()) before searching the
+   other directories.
 
    @param filename The name of the file the caller wants to open.
    @return A path to the file that may be different than the path
@@ -207,7 +400,58 @@ static char* kuhl_path_concat_read(const char* a, const char* b)
    free()'d. If the file was not found, a copy of the original
    filename is returned.
 */
+static char* kuhl_find_file_search(const char *filename);
+
 char* kuhl_find_file(const char *filename)
+{
+	pthread_mutex_lock(&kuhl_find_file_mutex);
+	if(!kuhl_find_file_manifest_loaded)
+		kuhl_find_file_load_manifest();
+	const char *found = kuhl_find_file_lookup(kuhl_find_file_cache, filename);
+	if(found != NULL)
+	{
+		char *result = strdup(found);
+		pthread_mutex_unlock(&kuhl_find_file_mutex);
+		return result;
+	}
+	pthread_mutex_unlock(&kuhl_find_file_mutex);
+
+	/* A file at the path that the caller gave is always used, even
+	 * if the manifest lists a different file with that name. */
+	char *result = NULL;
+	if(kuhl_can_read_file(filename))
+		result = strdup(filename);
+	else if(filename[0] != '/')
+	{
+		char *fixed = kuhl_fix_path(filename);
+		pthread_mutex_lock(&kuhl_find_file_mutex);
+		found = kuhl_find_file_lookup(kuhl_find_file_manifest, kuhl_find_file_strip(fixed));
+		if(found != NULL)
+			result = strdup(found);
+		pthread_mutex_unlock(&kuhl_find_file_mutex);
+		free(fixed);
+	}
+
+	/* Search without holding the lock since it may be slow. Files
+	 * that aren't found aren't cached since they may be created
+	 * later. */
+	if(result == NULL)
+		result = kuhl_find_file_search(filename);
+	if(result != NULL)
+	{
+		pthread_mutex_lock(&kuhl_find_file_mutex);
+		kuhl_find_file_insert(kuhl_find_file_cache, filename, result);
+		pthread_mutex_unlock(&kuhl_find_file_mutex);
+		return result;
+	}
+	return strdup(filename);
+}
+
+/** Searches for a file (see kuhl_find_file()).
+
+    @return The path to the file or NULL if it wasn't found.
+*/
+static char* kuhl_find_file_search(const char *filename)
 {
 	if(kuhl_can_read_file(filename))
 		return strdup(filename);
@@ -224,10 +468,16 @@ char* kuhl_find_file(const char *filename)
 	   outside of the same directory that the executable that the
 	   executable resides without having to specify an absolute
 	   path to our shader programs. */
-	char exe[1024];
-	ssize_t len = readlink("/proc/self/exe", exe, 1023);
-	exe[len]='\0';
-	char *dir = dirname(exe);
+	pthread_mutex_lock(&kuhl_find_file_mutex);
+	if(kuhl_find_file_exe_dir == NULL)
+	{
+		char exe[1024];
+		ssize_t len = readlink("/proc/self/exe", exe, 1023);
+		exe[len > 0 ? len : 0]='\0';
+		kuhl_find_file_exe_dir = strdup(dirname(exe));
+	}
+	const char *dir = kuhl_find_file_exe_dir;
+	pthread_mutex_unlock(&kuhl_find_file_mutex);
 	newPath = kuhl_path_concat_read(dir, filename);
 	if(newPath)
 	{
@@ -266,11 +516,81 @@ char* kuhl_find_file(const char *filename)
 	}
 	
 	free(pathSepChange);
-	return strdup(filename);
+	return NULL;
 }
 
 
 
+/** Maps a file into memory so that it can be read without copying
+ * it. Mapping a file only reads the parts of it that are used and
+ * avoids many small read() calls (which are slow on network file
+ * systems).
+ *
+ * @param filename The file (found with kuhl_find_file()).
+ *
+ * @param size Set to the size of the file in bytes.
+ *
+ * @return A read-only pointer to the contents of the file, or NULL if
+ * the file can't be read or is empty. Release it with
+ * kuhl_munmap_file().
+ */
+void* kuhl_mmap_file(const char *filename, size_t *size)
+{
+	*size = 0;
+	char *newFilename = kuhl_find_file(filename);
+	int fd = open(newFilename, O_RDONLY);
+	free(newFilename);
+	if(fd < 0)
+		return NULL;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size <= 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	void *data = NULL;
+#ifdef __MINGW32__
+	data = kuhl_malloc(st.st_size);
+	size_t total = 0;
+	while(data != NULL && total < (size_t) st.st_size)
+	{
+		ssize_t r = read(fd, (char*) data + total, st.st_size - total);
+		if(r <= 0)
+		{
+			free(data);
+			data = NULL;
+		}
+		else
+			total += r;
+	}
+#else
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(data == MAP_FAILED)
+		data = NULL;
+#endif
+	close(fd);
+	if(data != NULL)
+		*size = st.st_size;
+	return data;
+}
+
+/** Releases a file mapped by kuhl_mmap_file().
+ *
+ * @param data The pointer returned by kuhl_mmap_file().
+ *
+ * @param size The size returned by kuhl_mmap_file().
+ */
+void kuhl_munmap_file(void *data, size_t size)
+{
+	if(data == NULL)
+		return;
+#ifdef __MINGW32__
+	free(data);
+#else
+	munmap(data, size);
+#endif
+}
+
 /** Reads a text file.
  *
  * @param filename The file that we want to read in.
@@ -281,53 +601,169 @@ char* kuhl_find_file(const char *filename)
  */
 char* kuhl_text_read(const char *filename)
 {
-	int chunkSize    = 1024;        /* read in chunkSize bytes at a time */
-	int contentSpace = chunkSize;   /* space in 'content' array */
-
-	/* We add one more character to create room to store a '\0' at the
-	 * end. */
-	char *content = (char*) kuhl_malloc(sizeof(char)*(contentSpace+1));
-
-	/* Pointer to where next chunk should be stored */
-	char *contentLoc = content;
+	size_t size = 0;
+	char *data = kuhl_mmap_file(filename, &size);
+	if(data != NULL)
+	{
+		char *content = (char*) kuhl_malloc(size+1);
+		memcpy(content, data, size);
+		content[size] = '\0';
+		kuhl_munmap_file(data, size);
+		return content;
+	}
 
+	/* Empty files can't be mapped. */
 	char *newFilename = kuhl_find_file(filename);
-	FILE *fp = fopen(newFilename,"rt");
+	int readable = kuhl_can_read_file(newFilename);
 	free(newFilename);
-	int readChars;
-
-	if(fp == NULL)
+	if(!readable)
 	{
 		fprintf(stderr, "ERROR: Can't open %s.\n", filename);
 		exit(EXIT_FAILURE);
 	}
+	char *content = (char*) kuhl_malloc(1);
+	content[0] = '\0';
+	return content;
+}
 
-	do
-	{
-		readChars = fread(contentLoc, sizeof(char), chunkSize, fp);
-		contentLoc[readChars] = '\0';
-		contentSpace += chunkSize;
-		content = (char*) realloc(content, sizeof(char)*(contentSpace+1));
-		contentLoc = content + contentSpace - chunkSize;
 
-	} while( readChars == chunkSize );
 
-	/* We should now be at end of file. If not, there was an error. */
-	if(feof(fp) == 0)
+
+/** Returns the time in seconds on a clock that is never adjusted
+ * (unlike gettimeofday()). The time is only useful for measuring the
+ * time between two calls.
+ *
+ * @return Seconds since some arbitrary time.
+ */
+double kuhl_monotonic(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Sleeps until a time returned by kuhl_monotonic(). Returns
+ * immediately if the time has passed. */
+static void kuhl_sleep_until(double t)
+{
+#ifdef __MINGW32__
+	double wait = t - kuhl_monotonic();
+	if(wait > 0)
+		Sleep((DWORD) (wait * 1000));
+#else
+	struct timespec ts;
+	ts.tv_sec = (time_t) t;
+	ts.tv_nsec = (long) ((t - ts.tv_sec) * 1e9);
+	if(ts.tv_nsec >= 1000000000)
 	{
-		fprintf(stderr, "ERROR: Can't read %s\n", filename);
-		exit(EXIT_FAILURE);
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
 	}
+	/* Absolute deadlines don't drift if the sleep is interrupted by a signal. */
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+#endif
+}
 
-	fclose(fp);
-	return content;
+/** Initializes a frame pacer. The first call to kuhl_pacer_wait()
+ * returns immediately and the following calls return once per
+ * period.
+ *
+ * The pacer sleeps until shortly before each deadline and then spins
+ * until the deadline because sleeps often end late when the system
+ * is busy. By default, it spins for the last millisecond; set the
+ * KUHL_PACER_SPIN environment variable to the number of microseconds
+ * to spin for (0 to never spin).
+ *
+ * @param pacer The pacer to initialize.
+ *
+ * @param fps The number of times per second that kuhl_pacer_wait() should return.
+ */
+void kuhl_pacer_init(kuhl_pacer *pacer, double fps)
+{
+	pacer->period = fps > 0 ? 1.0 / fps : 0;
+	pacer->next = -1;
+	pacer->frames = 0;
+	pacer->missed = 0;
+	pacer->maxLate = 0;
+	pacer->spin = .001;
+
+	const char *str = getenv("KUHL_PACER_SPIN");
+	if(str != NULL)
+	{
+		long us = strtol(str, NULL, 10);
+		pacer->spin = us > 0 ? us / 1000000.0 : 0;
+	}
 }
 
+/** Waits until the next deadline of a pacer. Deadlines are exactly
+ * one period apart, so time spent between calls doesn't make the
+ * rate drift. If the caller took so long that one or more deadlines
+ * passed, those deadlines are skipped (instead of returning
+ * immediately several times to catch up) and counted in
+ * pacer->missed.
+ *
+ * @param pacer A pacer initialized with kuhl_pacer_init().
+ *
+ * @return The number of deadlines that were missed since the previous call.
+ */
+int kuhl_pacer_wait(kuhl_pacer *pacer)
+{
+	double now = kuhl_monotonic();
+	pacer->frames++;
+	if(pacer->next < 0 || pacer->period <= 0)
+	{
+		pacer->next = now + pacer->period;
+		return 0;
+	}
+
+	int missed = 0;
+	double late = now - pacer->next;
+	if(late >= pacer->period)
+	{
+		/* Keep the deadlines on the same phase. */
+		missed = (int) (late / pacer->period);
+		pacer->next += missed * pacer->period;
+		pacer->missed += missed;
+	}
+	if(late > pacer->maxLate)
+		pacer->maxLate = late;
 
+	if(now < pacer->next)
+	{
+		kuhl_sleep_until(pacer->next - pacer->spin);
+		while(kuhl_monotonic() < pacer->next)
+			;
+	}
+	pacer->next += pacer->period;
+	return missed;
+}
 
+/** Moves the deadlines of a pacer so that they line up with an
+ * event that happens once per period, such as the time that
+ * glutSwapBuffers() returns when vsync is on. The rate of the pacer
+ * doesn't change.
+ *
+ * @param pacer A pacer initialized with kuhl_pacer_init().
+ *
+ * @param t A time (see kuhl_monotonic()) that a deadline should fall on.
+ */
+void kuhl_pacer_sync(kuhl_pacer *pacer, double t)
+{
+	if(pacer->next < 0 || pacer->period <= 0)
+		return;
+	double offset = fmod(pacer->next - t, pacer->period);
+	if(offset < 0)
+		offset += pacer->period;
+	/* Move to the nearest deadline that is on the event's phase. */
+	if(offset > pacer->period / 2)
+		pacer->next += pacer->period - offset;
+	else
+		pacer->next -= offset;
+}
 
-/** The time at which kuhl_limitfps() was last called. */
-static struct timeval limitfps_last = { .tv_sec = 0, .tv_usec = 0 };
+/** The pacer used by kuhl_limitfps(). */
+static kuhl_pacer limitfps_pacer = { .period = -1 };
 /** When called per frame, sleeps for a short period of time to limit
  * the frames per second. There are two potential uses for this: (1)
  * When FPS are far higher than the monitor refresh rate and CPU load
@@ -343,36 +779,266 @@ static struct timeval limitfps_last = { .tv_sec = 0, .tv_usec = 0 };
  * environment variable (on Linux machines with NVIDIA cards):
  * http://us.download.nvidia.com/XFree86/Linux-x86/180.22/README/chapter-11.html
  *
+ * This is a shortcut for a kuhl_pacer, use a kuhl_pacer directly to
+ * find out how many frames missed their deadline.
+ *
  * @param fps Requested frames per second that we should not exceed.
  *
- * @see kuhl_getfps()
+ * @see kuhl_getfps(), kuhl_pacer_wait()
  */
 void kuhl_limitfps(int fps)
 {
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
+	if(limitfps_pacer.period != 1.0 / fps)
+		kuhl_pacer_init(&limitfps_pacer, fps);
+	kuhl_pacer_wait(&limitfps_pacer);
+}
 
-	// How many microseconds have elapsed since previous call to limitfps() was completed? */
-	suseconds_t elapsed_micro = (tv.tv_sec - limitfps_last.tv_sec)*1000000L + (tv.tv_usec - limitfps_last.tv_usec);
-	// printf("elapsed_micro %ld\n", elapsed_micro);
-	
-	// How many microseconds should elapse per frame?
-	float microspf = 1.0/fps * 1000000;
-	// printf("microsec per frame %f\n", microspf);
+/** A piece of memory that a kuhl_arena allocates from. The
+ * allocations start KUHL_ARENA_HEADER bytes after the start of the
+ * block. */
+struct kuhl_arena_block_
+{
+	struct kuhl_arena_block_ *prev; /**< The block that was in use before this one */
+	size_t start; /**< Value of arena->used when this block was added */
+	size_t size; /**< Bytes available in this block */
+	size_t used; /**< Bytes allocated from this block */
+};
+
+#define KUHL_ARENA_ALIGN 16 /**< Alignment of every allocation */
+#define KUHL_ARENA_HEADER ((sizeof(struct kuhl_arena_block_) + KUHL_ARENA_ALIGN-1) & ~(size_t)(KUHL_ARENA_ALIGN-1))
+#define KUHL_ARENA_MIN_BLOCK 4096 /**< Smallest block that is allocated */
+
+/** Set to 1 if the KUHL_ARENA_DEBUG environment variable is set, -1 before it is checked. */
+static int kuhl_arena_debug = -1;
 
-	// How many microseconds do we have to kill? 
-	suseconds_t microsec_sleep = (suseconds_t)microspf - elapsed_micro;
-	if(microsec_sleep > 0)
+static int kuhl_arena_debug_enabled(void)
+{
+	if(kuhl_arena_debug == -1)
 	{
-		// printf("sleeping %ld\n", microsec_sleep);
-		usleep(microsec_sleep);
+		const char *str = getenv("KUHL_ARENA_DEBUG");
+		kuhl_arena_debug = (str != NULL && strcmp(str, "0") != 0);
 	}
-	else
+	return kuhl_arena_debug;
+}
+
+static char* kuhl_arena_data(struct kuhl_arena_block_ *b)
+{
+	return (char*) b + KUHL_ARENA_HEADER;
+}
+
+/** Initializes an arena.
+ *
+ * @param arena The arena to initialize.
+ *
+ * @param size Bytes to allocate now. The arena grows as needed, so
+ * this can be 0.
+ */
+void kuhl_arena_init(kuhl_arena *arena, size_t size)
+{
+	memset(arena, 0, sizeof(kuhl_arena));
+	if(size > 0)
 	{
-		// printf("Sleep not needed! We are %ld behind.\n", microsec_sleep);
+		arena->block = kuhl_malloc(KUHL_ARENA_HEADER + size);
+		memset(arena->block, 0, sizeof(struct kuhl_arena_block_));
+		arena->block->size = size;
+		arena->capacity = size;
 	}
+}
 
-	gettimeofday(&limitfps_last, NULL);
+/** Allocates memory from an arena. The memory is aligned to 16 bytes
+ * and is not initialized. It must not be passed to free(); it is
+ * freed when the arena is reset or released past it.
+ *
+ * @param arena The arena to allocate from.
+ *
+ * @param size The number of bytes to allocate.
+ *
+ * @return The memory. The function does not return if the memory
+ * can't be allocated.
+ */
+void* kuhl_arena_alloc(kuhl_arena *arena, size_t size)
+{
+	size = (size + KUHL_ARENA_ALIGN-1) & ~(size_t)(KUHL_ARENA_ALIGN-1);
+	if(size == 0)
+		size = KUHL_ARENA_ALIGN;
+
+	struct kuhl_arena_block_ *b = arena->block;
+	if(b == NULL || b->used + size > b->size)
+	{
+		/* Reuse the spare block if it is big enough. Otherwise,
+		 * double the capacity of the arena. */
+		struct kuhl_arena_block_ *nb = arena->spare;
+		if(nb != NULL && nb->size >= size)
+			arena->spare = NULL;
+		else
+		{
+			size_t blockSize = arena->capacity > size ? arena->capacity : size;
+			if(blockSize < KUHL_ARENA_MIN_BLOCK)
+				blockSize = KUHL_ARENA_MIN_BLOCK;
+			nb = kuhl_malloc(KUHL_ARENA_HEADER + blockSize);
+			nb->size = blockSize;
+			arena->capacity += blockSize;
+		}
+		nb->prev = b;
+		nb->start = arena->used;
+		nb->used = 0;
+		arena->block = b = nb;
+	}
+
+	void *ptr = kuhl_arena_data(b) + b->used;
+	b->used += size;
+	arena->used += size;
+	if(arena->used > arena->highWater)
+		arena->highWater = arena->used;
+	return ptr;
+}
+
+/** Returns a mark that can be passed to kuhl_arena_release() to free
+ * everything that is allocated after this call. */
+size_t kuhl_arena_mark(const kuhl_arena *arena)
+{
+	return arena->used;
+}
+
+/** Frees everything that was allocated from an arena after a call to
+ * kuhl_arena_mark(). Marks must be released in the opposite order
+ * that they were made. No memory is returned to the system, so a
+ * function that allocates the same amount of temporary memory every
+ * time it is called doesn't use malloc() after its first call.
+ *
+ * @param arena The arena.
+ *
+ * @param mark A value returned by kuhl_arena_mark().
+ */
+void kuhl_arena_release(kuhl_arena *arena, size_t mark)
+{
+	if(mark > arena->used)
+	{
+		msg(ERROR, "Arena mark %lu is past the end of the arena (%lu bytes).",
+		    (unsigned long) mark, (unsigned long) arena->used);
+		return;
+	}
+
+	/* Keep the largest block that is no longer needed as the spare. */
+	while(arena->block != NULL && arena->block->prev != NULL && arena->block->start >= mark)
+	{
+		struct kuhl_arena_block_ *b = arena->block;
+		arena->block = b->prev;
+		if(arena->spare == NULL || arena->spare->size < b->size)
+		{
+			if(arena->spare != NULL)
+			{
+				arena->capacity -= arena->spare->size;
+				free(arena->spare);
+			}
+			arena->spare = b;
+		}
+		else
+		{
+			arena->capacity -= b->size;
+			free(b);
+		}
+	}
+
+	struct kuhl_arena_block_ *b = arena->block;
+	if(b != NULL)
+	{
+		size_t used = mark - b->start;
+		/* Fill freed memory with garbage so that it is obvious when
+		 * freed memory is used. */
+		if(kuhl_arena_debug_enabled() && b->used > used)
+			memset(kuhl_arena_data(b) + used, 0xCD, b->used - used);
+		b->used = used;
+	}
+	arena->used = mark;
+}
+
+/** Frees everything that was allocated from an arena. If the arena
+ * needed more than one block since the previous reset, the blocks
+ * are replaced with a single block that can hold all of them.
+ *
+ * If the KUHL_ARENA_DEBUG environment variable is set, freed memory
+ * is filled with garbage and a message is printed whenever an arena
+ * reaches a new high-water mark.
+ *
+ * @param arena The arena to reset.
+ */
+void kuhl_arena_reset(kuhl_arena *arena)
+{
+	if(kuhl_arena_debug_enabled() && arena->highWater > arena->reported)
+	{
+		msg(DEBUG, "Arena %p: new high-water mark of %lu bytes (%lu bytes allocated)",
+		    (void*) arena, (unsigned long) arena->highWater, (unsigned long) arena->capacity);
+		arena->reported = arena->highWater;
+	}
+
+	kuhl_arena_release(arena, 0);
+	struct kuhl_arena_block_ *b = arena->block;
+	if(b != NULL && b->size < arena->capacity)
+	{
+		size_t capacity = arena->capacity;
+		free(arena->spare);
+		free(b);
+		arena->spare = NULL;
+		arena->block = kuhl_malloc(KUHL_ARENA_HEADER + capacity);
+		memset(arena->block, 0, sizeof(struct kuhl_arena_block_));
+		arena->block->size = capacity;
+	}
+}
+
+/** Frees all of the memory used by an arena. The arena can be used
+ * again without calling kuhl_arena_init(). */
+void kuhl_arena_free(kuhl_arena *arena)
+{
+	kuhl_arena_release(arena, 0);
+	free(arena->block);
+	free(arena->spare);
+	memset(arena, 0, sizeof(kuhl_arena));
+}
+
+/** Incremented by kuhl_arena_frame_begin(). */
+static unsigned long kuhl_arena_frame_count = 0;
+static __thread kuhl_arena kuhl_arena_thread; /**< The calling thread's frame arena */
+static __thread int kuhl_arena_thread_ready = 0;
+
+/** Returns the calling thread's frame arena. Memory allocated from a
+ * frame arena is freed automatically at the start of the next frame
+ * (see kuhl_arena_frame_begin(), which viewmat_begin_frame() calls),
+ * so it is useful for temporary data that is needed for the rest of
+ * the frame. Each thread has its own frame arena, so no locking is
+ * needed; an arena is reset the first time its thread uses it in a
+ * new frame. Threads must not keep memory from their frame arena
+ * from one frame to the next.
+ *
+ * Functions that only need memory until they return should free it
+ * with kuhl_arena_mark() and kuhl_arena_release() so that they can
+ * be used by programs that don't call kuhl_arena_frame_begin().
+ *
+ * @return The frame arena of the calling thread.
+ */
+kuhl_arena* kuhl_arena_frame(void)
+{
+	unsigned long frame = __atomic_load_n(&kuhl_arena_frame_count, __ATOMIC_ACQUIRE);
+	if(!kuhl_arena_thread_ready)
+	{
+		kuhl_arena_init(&kuhl_arena_thread, 0);
+		kuhl_arena_thread.frame = frame;
+		kuhl_arena_thread_ready = 1;
+	}
+	else if(kuhl_arena_thread.frame != frame)
+	{
+		kuhl_arena_reset(&kuhl_arena_thread);
+		kuhl_arena_thread.frame = frame;
+	}
+	return &kuhl_arena_thread;
+}
+
+/** Starts a new frame for every thread's frame arena (see
+ * kuhl_arena_frame()). viewmat_begin_frame() calls this; programs
+ * that don't use viewmat may call it once per frame themselves. */
+void kuhl_arena_frame_begin(void)
+{
+	__atomic_add_fetch(&kuhl_arena_frame_count, 1, __ATOMIC_RELEASE);
 }
 
 /** Returns the current time in microseconds. 1 second = 1,000,000 microseconds. 1 millisecond = 1000 microseconds */
@@ -15,6 +15,7 @@
 #ifndef __KUHL_NODEP_H__
 #define __KUHL_NODEP_H__
 
+#include <stddef.h> // size_t
 #include "msg.h"
 
 // When compiling on windows, add suseconds_t and the rand48 functions.
@@ -37,17 +38,61 @@ typedef struct
 	float fps; /**< Current estimate of FPS? */
 } kuhl_fps_state;
 
+/** A frame pacer which returns from kuhl_pacer_wait() at a fixed
+ * rate. Create with kuhl_pacer_init(). */
+typedef struct
+{
+	double period; /**< Seconds between deadlines */
+	double next; /**< Next deadline (see kuhl_monotonic()), negative before the first wait */
+	double spin; /**< Seconds before a deadline to stop sleeping and start spinning */
+	long frames; /**< Number of calls to kuhl_pacer_wait() */
+	long missed; /**< Number of deadlines that were skipped because the caller was late */
+	double maxLate; /**< The latest that kuhl_pacer_wait() has been called after a deadline, in seconds */
+} kuhl_pacer;
+
+/** A linear allocator for temporary memory. Allocations are freed
+ * all at once with kuhl_arena_reset() or kuhl_arena_release(). See
+ * kuhl_arena_frame() for an arena that is reset every frame. */
+typedef struct
+{
+	struct kuhl_arena_block_ *block; /**< Block that memory is allocated from (the newest block) */
+	struct kuhl_arena_block_ *spare; /**< A block that was released and can be reused */
+	size_t used; /**< Bytes allocated since the last reset */
+	size_t capacity; /**< Bytes in all blocks */
+	size_t highWater; /**< The most bytes that have been allocated at once */
+	size_t reported; /**< Largest high-water mark that has been printed in debug mode */
+	unsigned long frame; /**< Frame that a frame arena was last reset for */
+} kuhl_arena;
+
 
 /** An alternative to malloc() which behaves the same way except it
  * prints a message when common errors occur (out of memory, trying to
  * allocate 0 bytes). */
 #define kuhl_malloc(size) kuhl_mallocFileLine(size, __FILE__, __LINE__)
+// kuhl_malloc() calls this C function:
+void* kuhl_mallocFileLine(size_t size, const char *file, int line);
 
 
 int kuhl_can_read_file(const char *filename);
 char* kuhl_find_file(const char *filename);
+void kuhl_find_file_cache_clear(void);
+void* kuhl_mmap_file(const char *filename, size_t *size);
+void kuhl_munmap_file(void *data, size_t size);
 char* kuhl_text_read(const char *filename);
 void kuhl_limitfps(int fps);
+double kuhl_monotonic(void);
+void kuhl_pacer_init(kuhl_pacer *pacer, double fps);
+int kuhl_pacer_wait(kuhl_pacer *pacer);
+void kuhl_pacer_sync(kuhl_pacer *pacer, double t);
+
+void kuhl_arena_init(kuhl_arena *arena, size_t size);
+void* kuhl_arena_alloc(kuhl_arena *arena, size_t size);
+size_t kuhl_arena_mark(const kuhl_arena *arena);
+void kuhl_arena_release(kuhl_arena *arena, size_t mark);
+void kuhl_arena_reset(kuhl_arena *arena);
+void kuhl_arena_free(kuhl_arena *arena);
+kuhl_arena* kuhl_arena_frame(void);
+void kuhl_arena_frame_begin(void);
 
 int kuhl_randomInt(int min, int max);
 void kuhl_shuffle(void *array, int n, int size);
@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <float.h> // for FLT_MAX
+#include <stdint.h> // uintptr_t
 #include <libgen.h> // for dirname()
 #include <sys/time.h> // gettimeofday()
 #include <unistd.h> // usleep()
@@ -27,6 +28,7 @@
 #ifdef __linux__
 #include <sys/prctl.h> // kill a forked child when parent exits
 #include <signal.h>
+#include <pthread.h>
 #endif
 
 #include "kuhl-nodep.h"
@@ -40,6 +42,13 @@
 
 #include "kuhl-util.h"
 #include "vecmat.h"
+#include "model-cache.h"
+#include "mesh-opt.h"
+#include "trace.h"
+#include "capture.h"
+#include "texstream.h"
+#include "texcache.h"
+#include "progcache.h"
 #ifdef KUHL_UTIL_USE_IMAGEMAGICK
 #include "imageio.h"
 #else /* use STB image loading if ImageMagick isn't available' */
@@ -81,25 +90,60 @@ int kuhl_errorcheckFileLine(const char *file, int line, const char *func)
 
 
 
-/** Creates a vertex of fragment shader from a file. This function
- * loads, compiles, and checks for errors for the shader.
+/** Reads a GLSL shader from a file and adds preprocessor
+ * definitions to it. The definitions are placed after the #version
+ * line (if there is one) and are followed
+ * by a #line directive so that compiler messages refer to the lines
+ * in the file.
  *
  * @param filename The file containing a GLSL shader.
  *
- * @param shader_type Either GL_FRAGMENT_SHADER or GL_VERTEX_SHADER
+ * @param defines Lines to add to the shader (e.g., "#define
+ * USE_BONES 1\n#define MAX_LIGHTS 4\n") or NULL.
  *
- * @return The ID for the shader. Exits if an error occurs.
+ * @return The source of the shader which should be free()'d. Exits
+ * if the file can't be read.
  */
-GLuint kuhl_create_shader(const char *filename, GLuint shader_type)
+static char* kuhl_private_shader_source(const char *filename, const char *defines)
 {
-	if((shader_type != GL_FRAGMENT_SHADER &&
-	    shader_type != GL_VERTEX_SHADER ) ||
-	   filename == NULL)
+	char *text = kuhl_text_read(filename);
+	if(defines == NULL || strlen(defines) == 0)
+		return text;
+
+	/* Find the end of the #version line, if there is one. */
+	size_t split = 0;
+	int line = 1;
+	const char *start = text + strspn(text, " \t\r\n");
+	if(strncmp(start, "#version", 8) == 0)
 	{
-		fprintf(stderr, "%s: ERROR: You passed inappropriate information into this function.\n", __func__);
-		return 0;
+		const char *end = strchr(start, '\n');
+		split = end ? (size_t) (end+1 - text) : strlen(text);
+		for(const char *c = text; c < text+split; c++)
+			if(*c == '\n')
+				line++;
 	}
 
+	size_t len = strlen(text) + strlen(defines) + 32;
+	char *result = kuhl_malloc(len);
+	snprintf(result, len, "%.*s%s%s#line %d\n%s", (int) split, text, defines,
+	         defines[strlen(defines)-1] != '\n' ? "\n" : "", line, text+split);
+	free(text);
+	return result;
+}
+
+/** Compiles a shader and checks for errors.
+ *
+ * @param text The source of the shader.
+ *
+ * @param filename The file the shader was read from (used in messages).
+ *
+ * @param shader_type Either GL_FRAGMENT_SHADER or GL_VERTEX_SHADER
+ *
+ * @return The ID for the shader. Exits if an error occurs.
+ */
+static GLuint kuhl_private_shader_compile(const char *text, const char *filename, GLuint shader_type)
+{
+
 	/* Make sure that the shader program functions are available via
 	 * an extension or because we are using a new enough version of
 	 * OpenGL to be guaranteed that the functions exist. */
@@ -114,14 +158,10 @@ GLuint kuhl_create_shader(const char *filename, GLuint shader_type)
 		exit(EXIT_FAILURE);
 	}
 
-	/* read in program from the text file */
-	// printf("%s shader: %s\n", shader_type == GL_VERTEX_SHADER ? "vertex" : "fragment" , filename);
 	GLuint shader = glCreateShader(shader_type);
 	kuhl_errorcheck();
-	char *text = kuhl_text_read(filename);
-	glShaderSource(shader, 1, (const char**) &text, NULL);
+	glShaderSource(shader, 1, &text, NULL);
 	kuhl_errorcheck();
-	free(text);
 
 	/* compile program */
 	glCompileShader(shader);
@@ -146,6 +186,33 @@ GLuint kuhl_create_shader(const char *filename, GLuint shader_type)
 	return shader;
 }
 
+/** Creates a vertex of fragment shader from a file. This function
+ * loads, compiles, and checks for errors for the shader.
+ *
+ * @param filename The file containing a GLSL shader.
+ *
+ * @param shader_type Either GL_FRAGMENT_SHADER or GL_VERTEX_SHADER
+ *
+ * @return The ID for the shader. Exits if an error occurs.
+ */
+GLuint kuhl_create_shader(const char *filename, GLuint shader_type)
+{
+	if((shader_type != GL_FRAGMENT_SHADER &&
+	    shader_type != GL_VERTEX_SHADER ) ||
+	   filename == NULL)
+	{
+		fprintf(stderr, "%s: ERROR: You passed inappropriate information into this function.\n", __func__);
+		return 0;
+	}
+
+	/* read in program from the text file */
+	// printf("%s shader: %s\n", shader_type == GL_VERTEX_SHADER ? "vertex" : "fragment" , filename);
+	char *text = kuhl_text_read(filename);
+	GLuint shader = kuhl_private_shader_compile(text, filename, shader_type);
+	free(text);
+	return shader;
+}
+
 
 /** Prints out useful information about an OpenGL program including a
  * listing of the active attribute variables and active uniform
@@ -237,6 +304,7 @@ void kuhl_delete_program(GLuint program)
 		glDeleteShader(shaders[i]);
 	}
 	glDeleteProgram(program);
+	kuhl_uniform_cache_invalidate(program);
 }
 
 /** Creates an OpenGL program from pair of files containing a vertex
@@ -244,6 +312,10 @@ void kuhl_delete_program(GLuint program)
  * support from the video card, error checking, and setting attribute
  * locations.
  *
+ * If the driver supports program binaries, the linked program is
+ * stored in a cache (see progcache.h) and later calls with the same
+ * shaders load it instead of compiling the shaders again.
+ *
  * @param vertexFilename The filename of the vertex program.
  *
  * @param fragFilename The filename of the fragment program.
@@ -252,6 +324,27 @@ void kuhl_delete_program(GLuint program)
  * program. Returns 0 if no shader program was created.
  */
 GLuint kuhl_create_program(const char *vertexFilename, const char *fragFilename)
+{
+	return kuhl_create_program_defines(vertexFilename, fragFilename, NULL);
+}
+
+/** Creates an OpenGL program from a pair of files containing a
+ * vertex shader and a fragment shader after adding preprocessor
+ * definitions to both shaders. Otherwise, this is the same as
+ * kuhl_create_program(). Programs that are created with different
+ * definitions are stored separately in the program cache.
+ *
+ * @param vertexFilename The filename of the vertex program.
+ *
+ * @param fragFilename The filename of the fragment program.
+ *
+ * @param defines Lines to add after the #version line of both shaders
+ * (e.g., "#define USE_BONES 1\n") or NULL.
+ *
+ * @return If success, returns the GLuint used to refer to the
+ * program. Returns 0 if no shader program was created.
+ */
+GLuint kuhl_create_program_defines(const char *vertexFilename, const char *fragFilename, const char *defines)
 {
 	if(vertexFilename == NULL || fragFilename == NULL)
 	{
@@ -266,34 +359,67 @@ GLuint kuhl_create_program(const char *vertexFilename, const char *fragFilename)
 		msg(FATAL, "Failed to create program.\n");
 		exit(EXIT_FAILURE);
 	}
-	msg(INFO, "GLSL prog %d: Creating vertex (%s) & fragment (%s) shaders\n",
-	    program, vertexFilename, fragFilename);
-	
-	/* Create the shaders */
-	GLuint fragShader   = kuhl_create_shader(fragFilename, GL_FRAGMENT_SHADER);
-	GLuint vertexShader = kuhl_create_shader(vertexFilename, GL_VERTEX_SHADER);
+	char *vertexText = kuhl_private_shader_source(vertexFilename, defines);
+	char *fragText = kuhl_private_shader_source(fragFilename, defines);
+
+	/* The definitions are part of the sources, so they are included
+	 * in the hash. */
+	int cache = progcache_enabled();
+	uint64_t hash = 0;
+	if(cache)
+	{
+		const char *sources[2] = { vertexText, fragText };
+		hash = progcache_hash(sources, 2);
+	}
+	if(cache && progcache_load(program, hash))
+	{
+		msg(INFO, "GLSL prog %d: Loaded vertex (%s) & fragment (%s) shaders from the program cache\n",
+		    program, vertexFilename, fragFilename);
+	}
+	else
+	{
+		msg(INFO, "GLSL prog %d: Creating vertex (%s) & fragment (%s) shaders\n",
+		    program, vertexFilename, fragFilename);
 
-	/* Attach shaders, check for errors. */
-	glAttachShader(program, fragShader);
-	kuhl_errorcheck();
-	glAttachShader(program, vertexShader);
-	kuhl_errorcheck();
+		/* Create the shaders */
+		GLuint fragShader   = kuhl_private_shader_compile(fragText, fragFilename, GL_FRAGMENT_SHADER);
+		GLuint vertexShader = kuhl_private_shader_compile(vertexText, vertexFilename, GL_VERTEX_SHADER);
 
-	/* Try to link the program. */
-	glLinkProgram(program);
-	kuhl_errorcheck();
+		/* Attach shaders, check for errors. */
+		glAttachShader(program, fragShader);
+		kuhl_errorcheck();
+		glAttachShader(program, vertexShader);
+		kuhl_errorcheck();
 
-	/* Check if glLinkProgram was successful. */
-	GLint linked;
-	glGetProgramiv((GLuint)program, GL_LINK_STATUS, &linked);
-	kuhl_errorcheck();
+		/* Ask the driver to keep the binary so that we can cache it. */
+		if(cache)
+			glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 
-	if(linked == GL_FALSE)
-	{
-		kuhl_print_program_log(program);
-		msg(FATAL, "Failed to link GLSL program.\n");
-		exit(EXIT_FAILURE);
+		/* Try to link the program. */
+		glLinkProgram(program);
+		kuhl_errorcheck();
+
+		/* Check if glLinkProgram was successful. */
+		GLint linked;
+		glGetProgramiv((GLuint)program, GL_LINK_STATUS, &linked);
+		kuhl_errorcheck();
+
+		if(linked == GL_FALSE)
+		{
+			kuhl_print_program_log(program);
+			msg(FATAL, "Failed to link GLSL program.\n");
+			exit(EXIT_FAILURE);
+		}
+		if(cache)
+			progcache_save(program, hash);
 	}
+	free(vertexText);
+	free(fragText);
+
+	/* The program ID may have been used by a program that was
+	 * deleted without kuhl_delete_program(). Make sure we don't reuse
+	 * its uniform locations. */
+	kuhl_uniform_cache_invalidate(program);
 
 	/* We used to call glValidateProgram() here. However, some drivers
 	 * assume that you only call glValidateProgram() when you are
@@ -319,6 +445,121 @@ void kuhl_print_program_log(GLuint program)
 
 
 
+/** Uniform locations that have been looked up for a single GLSL
+ * program. */
+typedef struct
+{
+	GLuint program; /**< Program that the locations belong to */
+	unsigned int count; /**< Number of names/locations in the cache */
+	unsigned int capacity; /**< Allocated length of names and locations */
+	char **names; /**< Uniform variable names */
+	GLint *locations; /**< Location for each name (may be -1) */
+} kuhl_uniform_cache;
+
+static kuhl_uniform_cache *uniformCache = NULL; /**< One entry per GLSL program */
+static unsigned int uniformCacheCount = 0; /**< Number of entries in uniformCache */
+/** Incremented whenever any cached location is invalidated so that
+ * copies of locations stored in kuhl_geometry can be refreshed. */
+static unsigned int uniformCacheGeneration = 1;
+
+/** Finds (or creates) the uniform cache entry for a program.
+ *
+ * @param program The GLSL program.
+ * @param create If nonzero, create an entry if one doesn't exist.
+ * @return The cache entry or NULL if there is no entry.
+ */
+static kuhl_uniform_cache* kuhl_private_uniform_cache_find(GLuint program, int create)
+{
+	for(unsigned int i=0; i<uniformCacheCount; i++)
+		if(uniformCache[i].program == program)
+			return &(uniformCache[i]);
+	if(!create)
+		return NULL;
+
+	uniformCache = realloc(uniformCache, sizeof(kuhl_uniform_cache)*(uniformCacheCount+1));
+	if(uniformCache == NULL)
+	{
+		msg(FATAL, "Failed to allocate space for uniform location cache.\n");
+		exit(EXIT_FAILURE);
+	}
+	kuhl_uniform_cache *entry = &(uniformCache[uniformCacheCount]);
+	uniformCacheCount++;
+	entry->program = program;
+	entry->count = 0;
+	entry->capacity = 0;
+	entry->names = NULL;
+	entry->locations = NULL;
+	return entry;
+}
+
+/** Discards all cached uniform locations for a GLSL program. This is
+ * called automatically by kuhl_create_program() and
+ * kuhl_delete_program(). If you relink a program yourself with
+ * glLinkProgram(), call this function afterwards since the locations
+ * of the uniforms in the program may have changed.
+ *
+ * @param program The GLSL program to discard the locations for.
+ */
+void kuhl_uniform_cache_invalidate(GLuint program)
+{
+	kuhl_uniform_cache *entry = kuhl_private_uniform_cache_find(program, 0);
+	if(entry == NULL)
+		return;
+	for(unsigned int i=0; i<entry->count; i++)
+		free(entry->names[i]);
+	free(entry->names);
+	free(entry->locations);
+
+	/* Move the last entry into the slot we just emptied. */
+	uniformCacheCount--;
+	*entry = uniformCache[uniformCacheCount];
+	uniformCacheGeneration++;
+}
+
+/** Returns the location of a uniform variable in a specific GLSL
+ * program. The first time a name is requested, this function calls
+ * glGetUniformLocation(). Subsequent requests for the same name in
+ * the same program are answered without talking to OpenGL. Unlike
+ * kuhl_get_uniform(), this function does not print any messages if
+ * the variable is missing.
+ *
+ * @param program The GLSL program containing the uniform variable.
+ *
+ * @param uniformName The name of the uniform variable.
+ *
+ * @return The location of the uniform variable or -1 if it is
+ * missing or inactive.
+ */
+GLint kuhl_get_uniform_cached(GLuint program, const char *uniformName)
+{
+	if(program == 0 || uniformName == NULL)
+		return -1;
+	
+	kuhl_uniform_cache *entry = kuhl_private_uniform_cache_find(program, 1);
+	for(unsigned int i=0; i<entry->count; i++)
+		if(strcmp(entry->names[i], uniformName) == 0)
+			return entry->locations[i];
+
+	GLint loc = glGetUniformLocation(program, uniformName);
+	kuhl_errorcheck();
+
+	if(entry->count == entry->capacity)
+	{
+		entry->capacity = entry->capacity == 0 ? 8 : entry->capacity*2;
+		entry->names = realloc(entry->names, sizeof(char*)*entry->capacity);
+		entry->locations = realloc(entry->locations, sizeof(GLint)*entry->capacity);
+		if(entry->names == NULL || entry->locations == NULL)
+		{
+			msg(FATAL, "Failed to allocate space for uniform location cache.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	entry->names[entry->count] = strdup(uniformName);
+	entry->locations[entry->count] = loc;
+	entry->count++;
+	return loc;
+}
+
 static int missingUniformCount = 0; /**< Used by kuhl_get_uniform() */
 /** Provides functionality similar to glGetUniformLocation() with
  * error checking. However, unlike glGetUniformLocation(), this
@@ -348,15 +589,18 @@ GLint kuhl_get_uniform(const char *uniformName)
 		msg(ERROR, "Can't get the uniform location of %s because no GLSL program is currently being used.\n", uniformName);
 		return -1;
 	}
-	
-	if(!glIsProgram(currentProgram))
+
+	/* Only check the program the first time we see it---programs
+	 * that are deleted with kuhl_delete_program() are removed from
+	 * the cache. */
+	if(kuhl_private_uniform_cache_find(currentProgram, 0) == NULL &&
+	   !glIsProgram(currentProgram))
 	{
 		msg(ERROR, "The current active program (%d) is not a valid GLSL program.\n", currentProgram);
 		return -1;
 	}
 
-	GLint loc = glGetUniformLocation(currentProgram, uniformName);
-	kuhl_errorcheck();
+	GLint loc = kuhl_get_uniform_cached(currentProgram, uniformName);
 	if(loc == -1 && missingUniformCount < 50)
 	{
 		msg(ERROR, "Uniform variable '%s' is missing or inactive in your GLSL program.\n", uniformName);
@@ -533,17 +777,17 @@ void kuhl_bbox_transform(float bbox[6], float mat[16])
 
 	int xmin=0, xmax=1, ymin=2, ymax=3, zmin=4, zmax=5;
 
-	// The 8 vertices of the bounding box
-	float coords[8][3] = { {bbox[xmin], bbox[ymin], bbox[zmin] },
-	                       {bbox[xmin], bbox[ymin], bbox[zmax] },
-	                       {bbox[xmin], bbox[ymax], bbox[zmin] },
-	                       {bbox[xmin], bbox[ymax], bbox[zmax] },
-	                       {bbox[xmax], bbox[ymin], bbox[zmax] },
-	                       {bbox[xmax], bbox[ymax], bbox[zmin] },
-	                       {bbox[xmax], bbox[ymax], bbox[zmax] } };
+	// The 8 vertices of the bounding box (as points with w=1)
+	float coords[8][4] = { {bbox[xmin], bbox[ymin], bbox[zmin], 1 },
+	                       {bbox[xmin], bbox[ymin], bbox[zmax], 1 },
+	                       {bbox[xmin], bbox[ymax], bbox[zmin], 1 },
+	                       {bbox[xmin], bbox[ymax], bbox[zmax], 1 },
+	                       {bbox[xmax], bbox[ymin], bbox[zmin], 1 },
+	                       {bbox[xmax], bbox[ymin], bbox[zmax], 1 },
+	                       {bbox[xmax], bbox[ymax], bbox[zmin], 1 },
+	                       {bbox[xmax], bbox[ymax], bbox[zmax], 1 } };
 	// Transform the 8 vertices of the bounding box
-	for(int i=0; i<8; i++)
-		mat4f_mult_vec4f_new(coords[i], mat, coords[i]);
+	mat4f_mult_vec4f_batch(coords[0], mat, coords[0], 8);
 	
 	/* Calculate new axis aligned bounding box */
 	for(int i=0; i<6; i=i+2) // set min values to the largest float
@@ -569,17 +813,318 @@ void kuhl_bbox_transform(float bbox[6], float mat[16])
 			bbox[5] = coords[i][2];
 	}
 }
+
+/** Extracts the six planes of a view frustum from a projection matrix
+ * and a modelview matrix. The planes are expressed in the coordinate
+ * system that vertices are in before they are multiplied by the
+ * modelview matrix (but after the kuhl_geometry matrix is
+ * applied). Typically, you would pass in the same matrices that you
+ * send to the Projection and ModelView uniform variables. If
+ * modelviewMat is the view matrix returned by viewmat_get(), the
+ * planes are in world coordinates.
+ *
+ * @param frustum The frustum to fill in.
+ *
+ * @param projMat A projection matrix.
+ *
+ * @param modelviewMat A modelview matrix. If NULL, the identity
+ * matrix is used.
+ */
+void kuhl_frustum_extract(kuhl_frustum *frustum, const float projMat[16], const float modelviewMat[16])
+{
+	float m[16];
+	if(modelviewMat == NULL)
+		mat4f_copy(m, projMat);
+	else
+		mat4f_mult_mat4f_new(m, projMat, modelviewMat);
+
+	/* Each plane is the sum or difference of the last row and one of
+	 * the other rows of the matrix (Gribb and Hartmann). Matrices are
+	 * column-major, so row r is m[r], m[4+r], m[8+r], m[12+r]. */
+	for(int p=0; p<6; p++)
+	{
+		int row = p/2;
+		float sign = (p%2 == 0) ? 1.0f : -1.0f;
+		float len = 0;
+		for(int c=0; c<4; c++)
+		{
+			frustum->planes[p][c] = m[c*4+3] + sign*m[c*4+row];
+			if(c < 3)
+				len += frustum->planes[p][c]*frustum->planes[p][c];
+		}
+		len = sqrtf(len);
+		if(len > 0)
+			for(int c=0; c<4; c++)
+				frustum->planes[p][c] /= len;
+	}
+
+	/* Store the corners of the frustum so that frustums can be
+	 * combined with kuhl_frustum_union(). */
+	float inv[16];
+	if(mat4f_invert_new(inv, m) == 0)
+	{
+		frustum->corner_count = 0;
+		return;
+	}
+	for(int i=0; i<8; i++)
+	{
+		float ndc[4] = { (i&1) ? 1.0f : -1.0f,
+		                 (i&2) ? 1.0f : -1.0f,
+		                 (i&4) ? 1.0f : -1.0f, 1.0f };
+		mat4f_mult_vec4f_new(ndc, inv, ndc);
+		for(int c=0; c<3; c++)
+			frustum->corners[i][c] = ndc[c] / ndc[3];
+	}
+	frustum->corner_count = 8;
+}
+
+/** Calculates a frustum that contains two other frustums. This is
+ * useful for stereo rendering: culling against the combined frustum
+ * of both eyes once per frame lets the same list of visible geometry
+ * (see kuhl_render_queue_add_visible()) be drawn in each eye's
+ * viewport. Each plane of the result is the corresponding plane of
+ * whichever frustum contains all of the corners of the other
+ * frustum. If neither does (for example, if the frustums point in
+ * very different directions), that plane is dropped so that the
+ * result is always conservative.
+ *
+ * @param result The combined frustum. May be the same as a or b.
+ *
+ * @param a One of the frustums.
+ *
+ * @param b The other frustum.
+ */
+void kuhl_frustum_union(kuhl_frustum *result, const kuhl_frustum *a, const kuhl_frustum *b)
+{
+	kuhl_frustum u;
+	for(int p=0; p<6; p++)
+	{
+		const kuhl_frustum *pair[2][2] = { { a, b }, { b, a } };
+		int found = 0;
+		for(int i=0; i<2 && !found; i++)
+		{
+			const float *plane = pair[i][0]->planes[p];
+			const kuhl_frustum *other = pair[i][1];
+			if(other->corner_count == 0)
+				continue;
+			float eps = 1e-4f * (1 + fabsf(plane[3]));
+			int inside = 1;
+			for(int c=0; c<other->corner_count && inside; c++)
+			{
+				const float *pt = other->corners[c];
+				if(plane[0]*pt[0] + plane[1]*pt[1] + plane[2]*pt[2] + plane[3] < -eps)
+					inside = 0;
+			}
+			if(inside)
+			{
+				for(int c=0; c<4; c++)
+					u.planes[p][c] = plane[c];
+				found = 1;
+			}
+		}
+		if(!found) // a plane that every point is in front of.
+		{
+			u.planes[p][0] = u.planes[p][1] = u.planes[p][2] = 0;
+			u.planes[p][3] = 1;
+		}
+	}
+
+	/* Keep the corners of both frustums so that the result can be
+	 * combined with more frustums. */
+	u.corner_count = 0;
+	if(a->corner_count > 0 && b->corner_count > 0 &&
+	   a->corner_count + b->corner_count <= KUHL_FRUSTUM_MAX_CORNERS)
+	{
+		for(int c=0; c<a->corner_count; c++)
+			vec3f_copy(u.corners[u.corner_count++], a->corners[c]);
+		for(int c=0; c<b->corner_count; c++)
+			vec3f_copy(u.corners[u.corner_count++], b->corners[c]);
+	}
+	*result = u;
+}
+
+/** Checks if an axis-aligned bounding box is at least partially
+ * inside of a view frustum. The test is conservative: some boxes
+ * that are slightly outside of the frustum near its corners are
+ * reported as visible.
+ *
+ * @param frustum The frustum to test against.
+ *
+ * @param bbox The bounding box (xmin, xmax, ymin, ymax, zmin, zmax).
+ * If the box is empty (i.e., xmin > xmax), it is assumed to be
+ * visible.
+ *
+ * @param mat A matrix that should be applied to the box before
+ * testing it, or NULL.
+ *
+ * @return 1 if the box may be visible, 0 if it is entirely outside
+ * of the frustum.
+ */
+int kuhl_frustum_test_bbox(const kuhl_frustum *frustum, const float bbox[6], const float mat[16])
+{
+	if(bbox[0] > bbox[1] || bbox[2] > bbox[3] || bbox[4] > bbox[5])
+		return 1;
+
+	float box[6];
+	for(int i=0; i<6; i++)
+		box[i] = bbox[i];
+	if(mat != NULL)
+	{
+		float m[16];
+		mat4f_copy(m, mat);
+		kuhl_bbox_transform(box, m);
+	}
+
+	for(int p=0; p<6; p++)
+	{
+		/* Use the corner of the box that is furthest in the
+		 * direction of the plane's normal. If that corner is behind
+		 * the plane, the whole box is. */
+		const float *plane = frustum->planes[p];
+		float x = plane[0] >= 0 ? box[1] : box[0];
+		float y = plane[1] >= 0 ? box[3] : box[2];
+		float z = plane[2] >= 0 ? box[5] : box[4];
+		if(plane[0]*x + plane[1]*y + plane[2]*z + plane[3] < 0)
+			return 0;
+	}
+	return 1;
+}
+
+/** Checks if a single kuhl_geometry object (but not the rest of the
+ * list) may be visible in a view frustum. The geometry's aabbox is
+ * transformed by its matrix before it is tested. Geometry with bones
+ * is always considered visible since animation may move vertices
+ * outside of the bounding box.
+ *
+ * @param geom The geometry to test.
+ *
+ * @param frustum A frustum created with kuhl_frustum_extract().
+ *
+ * @return 1 if the geometry may be visible, 0 otherwise.
+ */
+int kuhl_geometry_visible(const kuhl_geometry *geom, const kuhl_frustum *frustum)
+{
+	if(geom == NULL)
+		return 0;
+	if(frustum == NULL)
+		return 1;
+#ifdef KUHL_UTIL_USE_ASSIMP
+	if(geom->bones != NULL && geom->bones->count > 0)
+		return 1;
+#endif
+	return kuhl_frustum_test_bbox(frustum, geom->aabbox, geom->matrix);
+}
+
+#define KUHL_LOD_PIXELS 1024.0f /**< Default size on the screen below which the first simplified version of a geometry is drawn */
+#define KUHL_LOD_HYSTERESIS 0.15f /**< How far past a switching size a geometry must go before its level of detail changes */
+#define KUHL_LOD_RATIO 0.25f /**< Fraction of the triangles kept in each level of detail that kuhl_load_model() creates */
+#define KUHL_LOD_MIN_TRIANGLES 16384 /**< kuhl_load_model() only creates levels of detail for meshes with at least this many triangles */
+
+/** Estimates the size of a geometry on the screen. The geometry's
+ * aabbox is transformed by its matrix and the modelview matrix and
+ * the diameter of the sphere around the box is projected.
+ *
+ * @param geom The geometry.
+ * @param modelview The modelview matrix that the geometry is drawn with.
+ * @param projection The projection matrix that the geometry is drawn with.
+ * @param viewportHeight The height of the viewport in pixels.
+ *
+ * @return The approximate height in pixels of the geometry on the
+ * screen. FLT_MAX if the camera is inside of the bounding sphere or
+ * the bounding box is empty.
+ */
+float kuhl_geometry_screen_size(const kuhl_geometry *geom, const float modelview[16],
+                                const float projection[16], int viewportHeight)
+{
+	const float *b = geom->aabbox;
+	if(b[0] > b[1] || b[2] > b[3] || b[4] > b[5])
+		return FLT_MAX;
+	float box[6], m[16];
+	for(int i=0; i<6; i++)
+		box[i] = b[i];
+	mat4f_mult_mat4f_new(m, modelview, geom->matrix);
+	kuhl_bbox_transform(box, m);
+
+	float center[3] = { (box[0]+box[1])/2, (box[2]+box[3])/2, (box[4]+box[5])/2 };
+	float half[3] = { (box[1]-box[0])/2, (box[3]-box[2])/2, (box[5]-box[4])/2 };
+	float radius = vec3f_norm(half);
+	/* Orthographic projections don't depend on the distance. */
+	if(projection[11] == 0)
+		return radius * projection[5] * viewportHeight;
+	float dist = vec3f_norm(center);
+	if(dist <= radius)
+		return FLT_MAX;
+	return radius * projection[5] * viewportHeight / dist;
+}
+
+/** Returns the size on the screen below which a geometry should use
+ * a level of detail (see kuhl_geometry_lod_select()).
+ *
+ * @param level The level of detail (1 for the first simplified version).
+ */
+static float kuhl_private_lod_switch_size(GLuint level)
+{
+	static float pixels = -1;
+	if(pixels < 0)
+	{
+		const char *s = getenv("KUHL_LOD_PIXELS");
+		pixels = s != NULL && atof(s) > 0 ? (float) atof(s) : KUHL_LOD_PIXELS;
+	}
+	/* Each level has KUHL_LOD_RATIO as many triangles, so it should
+	 * cover sqrt(KUHL_LOD_RATIO) times the height on the screen to
+	 * keep the same number of triangles per pixel. */
+	return pixels * powf(sqrtf(KUHL_LOD_RATIO), (float) level - 1);
+}
+
+/** Chooses which version of the indices (see kuhl_geometry_lods())
+ * kuhl_geometry_draw() uses for each geometry in a list based on its
+ * size on the screen (see kuhl_geometry_screen_size()). A geometry
+ * only changes to a less detailed version once it is
+ * KUHL_LOD_HYSTERESIS smaller than the switching size, and back once
+ * it is that much larger, so that geometry near a switching size
+ * doesn't flicker between versions. The switching size of the first
+ * simplified version can be changed with the KUHL_LOD_PIXELS
+ * environment variable. For stereo rendering, call this once per
+ * frame with the matrices of one eye so that both eyes draw the same
+ * version.
+ *
+ * @param geom A kuhl_geometry list.
+ * @param modelview The modelview matrix that the geometry is drawn with.
+ * @param projection The projection matrix that the geometry is drawn with.
+ * @param viewportHeight The height of the viewport in pixels.
+ */
+void kuhl_geometry_lod_select(kuhl_geometry *geom, const float modelview[16],
+                              const float projection[16], int viewportHeight)
+{
+	for(; geom != NULL; geom = geom->next)
+	{
+		if(geom->lod_count == 0)
+			continue;
+		float pixels = kuhl_geometry_screen_size(geom, modelview, projection, viewportHeight);
+		GLuint level = geom->lod_current;
+		if(level > geom->lod_count)
+			level = geom->lod_count;
+		while(level < geom->lod_count &&
+		      pixels < kuhl_private_lod_switch_size(level+1) * (1-KUHL_LOD_HYSTERESIS))
+			level++;
+		while(level > 0 &&
+		      pixels > kuhl_private_lod_switch_size(level) * (1+KUHL_LOD_HYSTERESIS))
+			level--;
+		geom->lod_current = level;
+	}
+}
     
 
-#if 0
 /** Checks if the axis-aligned bounding box of two kuhl_geometry objects intersect.
 
+    To test many pieces of geometry against each other, see bvh.h.
+
     @return 1 if the bounding boxes intersect; 0 otherwise
 
     @param geom1 One of the pieces of geometry.
-    @param mat1 A 4x4 transformation matrix to be applied to the bounding box of geom1 prior to checking for collision.
+    @param mat1 A 4x4 transformation matrix to be applied to the bounding box of geom1 prior to checking for collision (or NULL).
     @param geom2 The other piece of geometry.
-    @param mat2 A 4x4 transformation matrix to be applied to the bounding box of geom2 prior to checking for collision.
+    @param mat2 A 4x4 transformation matrix to be applied to the bounding box of geom2 prior to checking for collision (or NULL).
 */
 int kuhl_geometry_collide(kuhl_geometry *geom1, float mat1[16],
                           kuhl_geometry *geom2, float mat2[16])
@@ -590,8 +1135,10 @@ int kuhl_geometry_collide(kuhl_geometry *geom1, float mat1[16],
 		box1[i] = geom1->aabbox[i];
 		box2[i] = geom2->aabbox[i];
 	}
-	kuhl_bbox_transform(box1, mat1);
-	kuhl_bbox_transform(box2, mat1);
+	if(mat1 != NULL)
+		kuhl_bbox_transform(box1, mat1);
+	if(mat2 != NULL)
+		kuhl_bbox_transform(box2, mat2);
 
 	int xmin=0, xmax=1, ymin=2, ymax=3, zmin=4, zmax=5;
 	// If the smallest x coordinate in geom1 is larger than the
@@ -611,7 +1158,74 @@ int kuhl_geometry_collide(kuhl_geometry *geom1, float mat1[16],
 	if(box1[zmax] < box2[zmin]) return 0;
 	return 1;
 }
+
+
+#ifdef KUHL_UTIL_USE_ASSIMP
+/** Checks if the geometry's program reads bone matrices from a
+ * buffer object and, if it does, connects the block to
+ * KUHL_BONE_BINDING. A shader can declare:
+ *
+ * buffer BoneBuffer { mat4 BoneMat[]; }; (GLSL 4.30, no bone limit)
+ *
+ * layout(std140) uniform BoneBlock { mat4 BoneMat[128]; }; (GLSL 1.40)
+ *
+ * If neither block exists, kuhl_geometry_draw() sets a "uniform mat4
+ * BoneMat[128]" array instead.
+ *
+ * @param geom The geometry to check. Geometry without bones is skipped.
+ */
+static void kuhl_private_geometry_bone_block(kuhl_geometry *geom)
+{
+	geom->bone_block_target = 0;
+	geom->bone_block_size = 0;
+	if(geom->bones == NULL || geom->program == 0)
+		return;
+
+	if(GLEW_VERSION_4_3 || GLEW_ARB_shader_storage_buffer_object)
+	{
+		GLuint index = glGetProgramResourceIndex(geom->program, GL_SHADER_STORAGE_BLOCK, "BoneBuffer");
+		if(index != GL_INVALID_INDEX)
+		{
+			glShaderStorageBlockBinding(geom->program, index, KUHL_BONE_BINDING);
+			geom->bone_block_target = GL_SHADER_STORAGE_BUFFER;
+			return;
+		}
+	}
+	if(GLEW_VERSION_3_1 || GLEW_ARB_uniform_buffer_object)
+	{
+		GLuint index = glGetUniformBlockIndex(geom->program, "BoneBlock");
+		if(index != GL_INVALID_INDEX)
+		{
+			GLint size = 0;
+			glGetActiveUniformBlockiv(geom->program, index, GL_UNIFORM_BLOCK_DATA_SIZE, &size);
+			glUniformBlockBinding(geom->program, index, KUHL_BONE_BINDING);
+			geom->bone_block_target = GL_UNIFORM_BUFFER;
+			geom->bone_block_size = size;
+		}
+	}
+}
+#endif
+
+/** Looks up and stores the locations of the uniform variables and
+ * texture samplers that kuhl_geometry_draw() uses for a single
+ * kuhl_geometry object (it does not process the rest of the list).
+ *
+ * @param geom The geometry to update the cached locations of.
+ */
+static void kuhl_private_geometry_uniforms(kuhl_geometry *geom)
+{
+	static const char *names[KG_UNIFORM_COUNT] = {
+		"HasTex", "BoneMat", "NumBones", "GeomTransform" };
+	for(int i=0; i<KG_UNIFORM_COUNT; i++)
+		geom->uniform_locations[i] = kuhl_get_uniform_cached(geom->program, names[i]);
+	for(unsigned int i=0; i<geom->texture_count; i++)
+		geom->textures[i].location = kuhl_get_uniform_cached(geom->program, geom->textures[i].name);
+#ifdef KUHL_UTIL_USE_ASSIMP
+	kuhl_private_geometry_bone_block(geom);
 #endif
+	geom->uniform_program = geom->program;
+	geom->uniform_generation = uniformCacheGeneration;
+}
 
 
 /** Adds a texture to the provided kuhl_geometry object.
@@ -661,7 +1275,7 @@ void kuhl_geometry_texture(kuhl_geometry *geom, GLuint texture, const char* name
 	
 	/* If this attribute isn't available in the GLSL program, move
 	 * on to the next one. */
-	GLint samplerLocation = glGetUniformLocation(geom->program, name);
+	GLint samplerLocation = kuhl_get_uniform_cached(geom->program, name);
 	if(samplerLocation == -1)
 	{
 		if(kg_options & KG_WARN)
@@ -697,13 +1311,71 @@ void kuhl_geometry_texture(kuhl_geometry *geom, GLuint texture, const char* name
 
 	geom->textures[destIndex].name = strdup(name);
 	geom->textures[destIndex].textureId = texture;
+	geom->textures[destIndex].location = samplerLocation;
 }
 
 
 
-/** Finds the index of a kuhl_attrib stored inside of a kuhl_geometry
- * by GLSL variable name.
- *
+/** Vertex and index data from many kuhl_geometry objects can be
+ * packed into a small number of large buffers with
+ * kuhl_geometry_pool(). Each kuhl_buffer_chunk holds one interleaved
+ * vertex buffer, one index buffer and a vertex array object that
+ * describes the layout of the vertices. All geometry in a chunk has
+ * the same attributes at the same attribute locations, so a single
+ * vertex array object can be shared by all of it. Space in a chunk is
+ * handed out like an arena: it is not reused when a geometry is
+ * deleted, and the whole chunk is freed when the last geometry using
+ * it is deleted.
+ */
+typedef struct kuhl_buffer_chunk
+{
+	GLuint vao; /**< Vertex array object shared by all geometry in the chunk */
+	GLuint vbo; /**< Interleaved vertex buffer */
+	GLuint ibo; /**< Index buffer */
+	unsigned int attrib_count; /**< Number of attributes in each vertex */
+	char *names[MAX_ATTRIBUTES]; /**< GLSL names of the attributes */
+	GLint locations[MAX_ATTRIBUTES]; /**< Attribute locations used in the vertex array object */
+	GLuint components[MAX_ATTRIBUTES]; /**< Floats per vertex for each attribute */
+	GLuint offsets[MAX_ATTRIBUTES]; /**< Offset of each attribute within a vertex (in floats) */
+	GLuint stride; /**< Floats per vertex */
+	GLuint vertex_capacity, vertex_used; /**< Size and used part of the vertex buffer (in vertices) */
+	GLuint index_capacity, index_used; /**< Size and used part of the index buffer (in indices) */
+	unsigned int refcount; /**< Number of kuhl_geometry objects stored in this chunk */
+	int mapped; /**< Set when kuhl_geometry_attrib_get() has mapped vbo */
+	struct kuhl_buffer_chunk *next;
+} kuhl_buffer_chunk;
+
+/** All chunks that have been created by kuhl_geometry_pool() */
+static kuhl_buffer_chunk *kuhl_buffer_chunks = NULL;
+
+/** Number of copies of the data of a KG_DYNAMIC attribute that are
+ * kept in its buffer. The CPU writes one copy while the GPU may
+ * still be reading the others. */
+#define KUHL_STREAM_COPIES 3
+
+/** Storage for an attribute that was added with KG_DYNAMIC. The
+ * caller changes a copy of the data in CPU memory (see
+ * kuhl_geometry_attrib_get()). When the geometry is drawn, changed
+ * data is copied into the next region of a buffer that is
+ * persistently mapped (OpenGL 4.4 or ARB_buffer_storage) and a fence
+ * tells us when the GPU is done reading each region. On older
+ * contexts, the buffer is orphaned with glBufferData() and refilled
+ * with glBufferSubData() instead.
+ */
+typedef struct kuhl_attrib_stream
+{
+	GLfloat *data;    /**< The attribute data that the caller changes */
+	GLsizeiptr size;  /**< Bytes in data and in each region of the buffer */
+	int dirty;        /**< 1 if data has changed since it was copied into the buffer */
+	int region;       /**< The region that the vertex array object reads from */
+	GLint location;   /**< Attribute location in the geometry's program, -1 if unused */
+	char *mapped;     /**< The persistently mapped buffer (KUHL_STREAM_COPIES regions), NULL if the buffer is orphaned instead */
+	GLsync fence[KUHL_STREAM_COPIES]; /**< Signaled when the GPU has finished the last draw that read each region */
+} kuhl_attrib_stream;
+
+/** Finds the index of a kuhl_attrib stored inside of a kuhl_geometry
+ * by GLSL variable name.
+ *
  * @param geom The geometry object to search.
  *
  * @param name The GLSL variable name of the attribute that you are
@@ -746,6 +1418,22 @@ int kuhl_geometry_attrib_index(kuhl_geometry *geom, const char *name)
  * data but still want access to it, it is best to make a copy of the
  * array that kuhl_geometry_attrib_get() returns instead of calling it
  * every single frame to retrieve the same data repeatedly.
+ *
+ * If the attribute was stored with kuhl_geometry_attrib_interleaved(),
+ * the returned array is the entire interleaved buffer and size is
+ * the number of floats in it. Use the stride and offset of the
+ * kuhl_attrib to find the values for a specific vertex. If the
+ * geometry was moved into a shared buffer with kuhl_geometry_pool(),
+ * the returned array starts at the first vertex of this geometry and
+ * only contains this geometry's vertices.
+ *
+ * If the attribute was added with the KG_DYNAMIC option, the
+ * returned array is a copy of the data in CPU memory that remains
+ * valid until the attribute is replaced or the geometry is
+ * deleted. Each call marks the data as changed and the whole array
+ * is copied into a part of the OpenGL buffer that the GPU isn't using
+ * the next time the geometry is drawn, so the CPU never waits for
+ * the GPU to finish drawing the previous frame.
  */
 GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *size)
 {
@@ -759,8 +1447,15 @@ GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *
 	if(index < 0)
 		return NULL;
 
-	/* Bind the VAO and the buffer we are interested in */
 	kuhl_attrib *attrib = &(geom->attribs[index]);
+	if(attrib->stream != NULL)
+	{
+		attrib->stream->dirty = 1;
+		*size = (GLint) (attrib->stream->size / sizeof(GLfloat));
+		return attrib->stream->data;
+	}
+
+	/* Bind the VAO and the buffer we are interested in */
 	if(!glIsBuffer(attrib->bufferobject) || !glIsVertexArray(geom->vao))
 		return NULL;
 	glBindVertexArray(geom->vao);
@@ -785,6 +1480,17 @@ GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *
 	if(ret == NULL)
 		return NULL;
 	*size = bufferNumFloats;
+	attrib->mapped = 1;
+
+	/* Geometry stored in a shared buffer (see kuhl_geometry_pool())
+	 * only owns the vertices starting at its base vertex. */
+	if(geom->pool != NULL)
+	{
+		geom->pool->mapped = 1;
+		GLint strideFloats = attrib->stride / sizeof(GLfloat);
+		ret += geom->base_vertex * strideFloats;
+		*size = geom->vertex_count * strideFloats;
+	}
 
 	// unbind
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -794,569 +1500,3048 @@ GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *
 	return ret;
 }
 
-/** Changes the GLSL program that is used by a kuhl_geometry object.
- *
- * @param geom A geometry that you want to change the GLSL program for.
- *
- * @param program The new GLSL program you wish to use with the geometry.
+/** Sets the divisor for a vertex attribute location. OpenGL 3.3 is
+ * required for glVertexAttribDivisor(). On OpenGL 3.2 contexts, we
+ * use the ARB_instanced_arrays extension if it is available.
  *
- * @param kg_options Set this to KG_FULL_LIST to apply the new program
- * to all geometries in the kuhl_geometry linked list. Otherwise, set
- * to 0.
+ * @param location The attribute location.
+ * @param divisor 0 for per-vertex data, 1 for per-instance data.
  */
-void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options)
+static void kuhl_private_attrib_divisor(GLuint location, GLuint divisor)
 {
-	if(geom == NULL)
-		return;
-
-	if(kg_options & KG_FULL_LIST)
-		kuhl_geometry_program(geom->next, program, kg_options);
-
-	// If the caller deleted their old program and created a new one,
-	// the new program ID might match the old program ID. Therefore,
-	// we can't rely on the program IDs to verify that the user
-	// changed the program.
-
-	if(!glIsProgram(program))
+	if(GLEW_VERSION_3_3)
+		glVertexAttribDivisor(location, divisor);
+	else if(GLEW_ARB_instanced_arrays)
+		glVertexAttribDivisorARB(location, divisor);
+	else if(divisor != 0)
 	{
-		msg(WARNING, "GLSL program %d is not a valid program.\n",program);
+		msg(ERROR, "Instanced attributes require OpenGL 3.3 or the ARB_instanced_arrays extension.\n");
 	}
-	
-	geom->program = program;
-	
-	glBindVertexArray(geom->vao);
+}
+
+/** Number of views (i.e., eyes) that each draw call renders. Set by
+ * kuhl_geometry_view_count(). */
+static GLuint kuhl_private_view_count = 1;
+
+/** Sets the number of views that every kuhl_geometry draw call should
+ * render. This is used for single-pass stereo rendering (see
+ * viewmat_begin_stereo()): when set to 2, each geometry is drawn
+ * with two instances (or twice as many instances if it already uses
+ * instancing) and the vertex program uses gl_InstanceID % 2 to pick
+ * the eye that it is drawing. Per-instance attributes added with
+ * kuhl_geometry_instance_attrib() still advance once per instance of
+ * the geometry.
+ *
+ * @param count The number of views. 1 (the default) disables
+ * multi-view drawing.
+ */
+void kuhl_geometry_view_count(unsigned int count)
+{
+	kuhl_private_view_count = count > 0 ? count : 1;
+}
+
+/** Multiplies the divisor of every per-instance attribute of a
+ * geometry. The geometry's vertex array object must be bound. */
+static void kuhl_private_geometry_divisors(kuhl_geometry *geom, GLuint multiplier)
+{
 	for(unsigned int i=0; i<geom->attrib_count; i++)
 	{
 		kuhl_attrib *attrib = &(geom->attribs[i]);
-		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
-		kuhl_errorcheck();
+		if(attrib->divisor == 0 || attrib->location == -1)
+			continue;
+		for(GLuint slot=0; slot<(attrib->components+3)/4; slot++)
+			kuhl_private_attrib_divisor(attrib->location+slot, attrib->divisor*multiplier);
+	}
+}
 
-		GLint attribLocation = kuhl_get_attribute(geom->program, attrib->name);
-		glEnableVertexAttribArray(attribLocation);
+/** Updates the aabbox of a geometry if an attribute contains the
+ * vertex positions (i.e., it is named in_Position).
+ *
+ * @param geom The geometry that the attribute is being added to.
+ * @param name The GLSL name of the attribute.
+ * @param data geom->vertex_count * components floats.
+ * @param components The number of floats per vertex.
+ */
+static void kuhl_private_geometry_bbox(kuhl_geometry *geom, const char *name, const GLfloat *data, GLuint components)
+{
+	if(strcmp(name, "in_Position") != 0 || components < 3)
+		return;
 
-		/* Get the size of the buffer */
-		GLint bufferSize = 0;
-		glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &bufferSize);
-		GLint bufferNumFloats = bufferSize/sizeof(GLfloat);
-		GLint components = bufferNumFloats / geom->vertex_count;
+	for(int i=0; i<6; i=i+2) // set min values to the largest float
+		geom->aabbox[i] = FLT_MAX;
+	for(int i=1; i<6; i=i+2) // set max values to the smallest float
+		geom->aabbox[i] = -FLT_MAX;
+	for(GLuint v=0; v<geom->vertex_count; v++)
+	{
+		for(int c=0; c<3; c++)
+		{
+			float val = data[v*components+c];
+			if(val < geom->aabbox[c*2])
+				geom->aabbox[c*2] = val;
+			if(val > geom->aabbox[c*2+1])
+				geom->aabbox[c*2+1] = val;
+		}
+	}
+}
 
-		/* Connect this vertex attribute with the (possibly different)
-		 * attribute location. */
+/** Describes the layout of an attribute stored in the currently bound
+ * GL_ARRAY_BUFFER to the currently bound vertex array object. An
+ * attribute with more than 4 components (for example, a mat4 with 16
+ * components) uses consecutive attribute locations---one location
+ * for each group of 4 floats (i.e., each column of a matrix).
+ *
+ * @param location The location of the attribute in the GLSL program.
+ * @param attrib The attribute. The components, divisor, stride and
+ * offset fields must be filled in.
+ */
+static void kuhl_private_attrib_pointer(GLint location, const kuhl_attrib *attrib)
+{
+	GLuint slots = (attrib->components+3)/4;
+	GLsizei stride = attrib->stride;
+	if(stride == 0 && slots > 1)
+		stride = (GLsizei) (attrib->components*sizeof(GLfloat));
+	for(GLuint i=0; i<slots; i++)
+	{
+		GLuint count = attrib->components - i*4;
+		if(count > 4)
+			count = 4;
+		glEnableVertexAttribArray(location+i);
 		glVertexAttribPointer(
-			attribLocation, // attribute location in glsl program
-			components, // number of elements (x,y,z)
-			GL_FLOAT, // type of each element
-			GL_FALSE, // should OpenGL normalize values?
-			0,        // no extra data between each position
-			0 );      // offset of first element
+			location+i, // attribute location in glsl program
+			count,      // number of elements (x,y,z)
+			GL_FLOAT,   // type of each element
+			GL_FALSE,   // should OpenGL normalize values?
+			stride,     // distance between the start of each vertex
+			(void*) (attrib->offset + i*4*sizeof(GLfloat)) ); // offset of first element
+		kuhl_private_attrib_divisor(location+i, attrib->divisor);
 		kuhl_errorcheck();
 	}
-
-	/* NOTE: We do not have to update the uniform locations because
-	 * they are determined in kuhl_geometry_draw() */
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
 }
 
+/** Checks if buffers can be persistently mapped (see kuhl_attrib_stream). */
+static int kuhl_private_stream_persistent(void)
+{
+	return GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+}
 
-/** Adds a vertex attribute (such as vertex position, normal, color,
- * texture coordinate, etc) to the geometry object.
- *
- * @param geom The geometry to add the attribute to.
- *
- * @param data An array of floats that contains the attribute
- * data. This array should contain geom->vertex_count * components
- * floats.
- *
- * @param components The number of floats per vertex in this attribute.
+/** Creates the storage for a KG_DYNAMIC attribute in the buffer that
+ * is bound to GL_ARRAY_BUFFER and copies data into it.
  *
- * @param name The GLSL variable name that this attribute should be
- * connected to.
- *
- * @param warnIfAttribMissing If nonzero, print a warning if the
- * attribute isn't present in the GLSL program for this geometry
- * object.
+ * @param attrib The attribute.
+ * @param location The attribute location in the geometry's program.
+ * @param data The attribute data.
+ * @param size The number of bytes in data.
  */
-void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint components, const char* name, int warnIfAttribMissing)
+static void kuhl_private_stream_new(kuhl_attrib *attrib, GLint location, const GLfloat *data, GLsizeiptr size)
 {
-	if(name == NULL || strlen(name) == 0)
-	{
-		msg(WARNING, "Unable to add an attribute that is NULL or an empty string.\n");
-		return;
-	}
-	if(geom == NULL)
+	kuhl_attrib_stream *stream = kuhl_malloc(sizeof(kuhl_attrib_stream));
+	stream->data = kuhl_malloc(size);
+	memcpy(stream->data, data, size);
+	stream->size = size;
+	stream->dirty = 0;
+	stream->region = 0;
+	stream->location = location;
+	stream->mapped = NULL;
+	for(int i=0; i<KUHL_STREAM_COPIES; i++)
+		stream->fence[i] = 0;
+
+	if(kuhl_private_stream_persistent())
 	{
-		msg(WARNING, "Unable to add attribute '%s' to the geometry object because you passed in a geometry object that was set to NULL.\n",name);
-		return;
+		/* Since the mapping is coherent, we don't need to flush the
+		 * regions that we write to. */
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, size*KUHL_STREAM_COPIES, NULL, flags);
+		stream->mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, size*KUHL_STREAM_COPIES, flags);
+		if(stream->mapped != NULL)
+			memcpy(stream->mapped, data, size);
+		else
+		{
+			/* The storage of the buffer can't be changed now, so
+			 * replace the buffer. */
+			msg(WARNING, "Unable to map the buffer for dynamic attribute '%s', using glBufferSubData() instead.\n", attrib->name);
+			glDeleteBuffers(1, &(attrib->bufferobject));
+			glGenBuffers(1, &(attrib->bufferobject));
+			glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		}
 	}
-	if(data == NULL)
-	{
-		msg(WARNING, "Unable to add attribute '%s' to the geometry object because you passed in an array set to NULL.\n",
-		             name);
+	if(stream->mapped == NULL)
+		glBufferData(GL_ARRAY_BUFFER, size, data, GL_STREAM_DRAW);
+	kuhl_errorcheck();
+	attrib->stream = stream;
+}
+
+/** Frees the storage of a KG_DYNAMIC attribute. Deleting the buffer
+ * (which the caller does) unmaps it. */
+static void kuhl_private_stream_free(kuhl_attrib *attrib)
+{
+	kuhl_attrib_stream *stream = attrib->stream;
+	if(stream == NULL)
 		return;
-	}
-	if(components == 0)
+	for(int i=0; i<KUHL_STREAM_COPIES; i++)
+		if(stream->fence[i] != 0)
+			glDeleteSync(stream->fence[i]);
+	free(stream->data);
+	free(stream);
+	attrib->stream = NULL;
+}
+
+/** Returns 1 if the geometry has an attribute that was added with KG_DYNAMIC. */
+static int kuhl_private_geometry_has_stream(const kuhl_geometry *geom)
+{
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+		if(geom->attribs[i].stream != NULL)
+			return 1;
+	return 0;
+}
+
+/** Copies the KG_DYNAMIC attributes of a geometry that have changed
+ * (see kuhl_geometry_attrib_get()) into their buffers. The vertex
+ * array object of the geometry must be bound.
+ */
+static void kuhl_private_geometry_stream(kuhl_geometry *geom)
+{
+	int bound = 0;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
 	{
-		msg(WARNING, "Unable to add attribute '%s' to the geometry object because this attribute has 0 components.\n",
-		             name);
-		return;
+		kuhl_attrib *attrib = &(geom->attribs[i]);
+		kuhl_attrib_stream *stream = attrib->stream;
+		if(stream == NULL || !stream->dirty)
+			continue;
+		stream->dirty = 0;
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		bound = 1;
+
+		if(stream->mapped == NULL)
+		{
+			/* Orphan the old storage so that we don't wait for
+			 * draws that are still reading it. */
+			glBufferData(GL_ARRAY_BUFFER, stream->size, NULL, GL_STREAM_DRAW);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, stream->size, stream->data);
+			continue;
+		}
+
+		/* Write into the region that was drawn least recently. The
+		 * GPU has usually finished with it, but we wait if it
+		 * hasn't. */
+		int region = (stream->region+1) % KUHL_STREAM_COPIES;
+		if(stream->fence[region] != 0)
+		{
+			GLenum result = glClientWaitSync(stream->fence[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+			if(result == GL_TIMEOUT_EXPIRED || result == GL_WAIT_FAILED)
+				msg(WARNING, "Failed to wait for the GPU to finish reading dynamic attribute '%s'.\n", attrib->name);
+			glDeleteSync(stream->fence[region]);
+			stream->fence[region] = 0;
+		}
+		memcpy(stream->mapped + region*stream->size, stream->data, stream->size);
+		stream->region = region;
+		attrib->offset = region*stream->size;
+		if(stream->location != -1)
+			kuhl_private_attrib_pointer(stream->location, attrib);
 	}
-	if(!glIsVertexArray(geom->vao))
+	if(bound)
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_errorcheck();
+}
+
+/** Creates fences that are signaled when the GPU finishes the draw
+ * that was just submitted for a geometry with KG_DYNAMIC
+ * attributes. */
+static void kuhl_private_geometry_stream_fence(kuhl_geometry *geom)
+{
+	for(unsigned int i=0; i<geom->attrib_count; i++)
 	{
-		msg(WARNING, "Unable to add attribute '%s' to the geometry object because the geometry has an invalid vertex array object %d\n", geom->vao, name);
-		return;
+		kuhl_attrib_stream *stream = geom->attribs[i].stream;
+		if(stream == NULL || stream->mapped == NULL)
+			continue;
+		if(stream->fence[stream->region] != 0)
+			glDeleteSync(stream->fence[stream->region]);
+		stream->fence[stream->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 	}
+}
 
-	/* If this attribute isn't available in the GLSL program, move
-	 * on to the next one. */
-	// GLint attribLocation = kuhl_get_attribute(geom->program, name);
+/** Unmaps the buffers of a geometry that kuhl_geometry_attrib_get()
+ * mapped. kuhl_geometry_draw() does this automatically. Call this
+ * function before reading the buffers of the geometry with OpenGL
+ * (for example, with glGetBufferSubData()). Only the buffers that
+ * kuhl_geometry_attrib_get() mapped are unmapped, so OpenGL isn't
+ * asked which buffers are mapped.
+ *
+ * @param geom The geometry (the rest of the list is not changed).
+ */
+void kuhl_geometry_unmap(kuhl_geometry *geom)
+{
+	if(geom == NULL)
+		return;
 
-	// Get attribute location directly so kuhl_get_attribute() and
-	// this function don't print the same error repeatedly.
-	GLint attribLocation = glGetAttribLocation(geom->program, name);
-	if(attribLocation == -1)
+	/* Geometry in a shared chunk (see kuhl_geometry_pool()) uses the
+	 * same buffer as other geometry which may have been mapped or
+	 * unmapped already. */
+	if(geom->pool != NULL)
 	{
-		if(warnIfAttribMissing)
-			msg(WARNING, "Unable to add attribute '%s' to the geometry object because it was missing or inactive in program %d\n",
-			    name, geom->program);
+		if(geom->pool->mapped)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, geom->pool->vbo);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			geom->pool->mapped = 0;
+		}
+		for(unsigned int i=0; i<geom->attrib_count; i++)
+			geom->attribs[i].mapped = 0;
 		return;
 	}
 
-	/* If another attribute in kuhl_geometry has the same name,
-	 * overwrite it. */
-	int destIndex = kuhl_geometry_attrib_index(geom, name);
-
-	if(destIndex < 0)
-	{
-		/* If this is a new attribute for this geometry object */
-		destIndex = geom->attrib_count;
-		geom->attrib_count++;
-	}
-	else
-	{
-		/* If overwriting, free resources from old attribute. */
-		free(geom->attribs[destIndex].name);
-		if(glIsBuffer(geom->attribs[destIndex].bufferobject))
-			glDeleteBuffers(1, &(geom->attribs[destIndex].bufferobject));
-	}
-//	printf("%s: Storing attribute %s at index %d in kuhl_geometry; connected to location %d in program %d\n", __func__, name, destIndex, attribLocation, geom->program);
-	
-	/* If we are writing past the end of the array. */
-	if(destIndex == MAX_ATTRIBUTES)
+	int bound = 0;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
 	{
-		msg(FATAL, "You tried to add more than %d attributes to a kuhl_geometry object\n", MAX_ATTRIBUTES);
-		exit(EXIT_FAILURE);
+		if(geom->attribs[i].mapped == 0)
+			continue;
+		glBindBuffer(GL_ARRAY_BUFFER, geom->attribs[i].bufferobject);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		bound = 1;
+		/* Interleaved attributes share a buffer. */
+		for(unsigned int j=i; j<geom->attrib_count; j++)
+			if(geom->attribs[j].bufferobject == geom->attribs[i].bufferobject)
+				geom->attribs[j].mapped = 0;
 	}
+	if(bound)
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_errorcheck();
+}
 
-	/* Set up this attribute. */
-	kuhl_attrib *attrib = &(geom->attribs[destIndex]);
-	attrib->name = strdup(name);
-
-	/* Switch to our vertex array object. */
-	glBindVertexArray(geom->vao);
+/** Frees the name and buffer of an attribute stored in a
+ * kuhl_geometry object. The buffer is only deleted if no other
+ * attribute in the geometry shares it (see
+ * kuhl_geometry_attrib_interleaved()).
+ *
+ * @param geom The geometry containing the attribute.
+ * @param index The index of the attribute in geom->attribs.
+ */
+static void kuhl_private_attrib_release(kuhl_geometry *geom, unsigned int index)
+{
+	kuhl_attrib *attrib = &(geom->attribs[index]);
+	if(attrib->name)
+		free(attrib->name);
+	attrib->name = NULL;
+	kuhl_private_stream_free(attrib);
 
-	/* Enable this attribute location for this vertex array object. */
-	glEnableVertexAttribArray(attribLocation);
-	
-	/* Ask OpenGL for one new buffer "name" (or ID number). */
-	glGenBuffers(1, &(attrib->bufferobject));
-	/* Tell OpenGL that we are going to use this buffer until we
-	 * say otherwise. GL_ARRAY_BUFFER basically means that the
-	 * data stored in this buffer will be an array containing
-	 * vertex information. */
-	glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
-	kuhl_errorcheck();
+	int shared = 0;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+		if(i != index && geom->attribs[i].name != NULL &&
+		   geom->attribs[i].bufferobject == attrib->bufferobject)
+			shared = 1;
+	if(!shared && geom->pool == NULL && glIsBuffer(attrib->bufferobject))
+		glDeleteBuffers(1, &(attrib->bufferobject));
+	attrib->bufferobject = 0;
+}
 
-	/* Copy our data into the buffer object that is currently bound. */
-	glBufferData(GL_ARRAY_BUFFER,
-	             sizeof(GLfloat)*geom->vertex_count*components,
-	             data, GL_STATIC_DRAW);
-	kuhl_errorcheck();
+/** Prints a warning and returns 1 if the geometry has been moved into
+ * a shared buffer with kuhl_geometry_pool(). The vertex data of such
+ * geometry can no longer be replaced. */
+static int kuhl_private_geometry_is_pooled(const kuhl_geometry *geom, const char *func)
+{
+	if(geom == NULL || geom->pool == NULL)
+		return 0;
+	msg(WARNING, "%s() can't change the geometry because it was moved into a shared buffer with kuhl_geometry_pool().\n", func);
+	return 1;
+}
 
-	/* Tell OpenGL some information about the data that is in the
-	 * buffer. Among other things, we need to tell OpenGL which
-	 * attribute number (i.e., variable) the data should correspond to
-	 * in the vertex program. */
-	glVertexAttribPointer(
-		attribLocation, // attribute location in glsl program
-		components, // number of elements (x,y,z)
-		GL_FLOAT, // type of each element
-		GL_FALSE, // should OpenGL normalize values?
-		0,        // no extra data between each position
-		0 );      // offset of first element
-	kuhl_errorcheck();
+/** Size of the vertex buffer in a new chunk. Geometry that is larger
+ * than this gets a chunk of its own. */
+#define KUHL_CHUNK_VERTEX_BYTES (16*1024*1024)
 
-	// unbind
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
+/** Checks if the OpenGL context can draw geometry that is stored in
+ * a shared buffer (i.e., if glDrawElementsBaseVertex() is available).
+ */
+static int kuhl_private_pool_supported(void)
+{
+	return GLEW_VERSION_3_2 || GLEW_ARB_draw_elements_base_vertex;
 }
 
-/** Calculates the number of objects in the kuhl_geometry linked list.
+/** Decrements the number of geometry objects that use a chunk and
+ * frees the chunk if it is no longer used. */
+static void kuhl_private_chunk_unref(kuhl_buffer_chunk *chunk)
+{
+	if(chunk == NULL || --chunk->refcount > 0)
+		return;
 
-    @param geom The geometry object which you want to know the length of.
+	glDeleteVertexArrays(1, &(chunk->vao));
+	glDeleteBuffers(1, &(chunk->vbo));
+	glDeleteBuffers(1, &(chunk->ibo));
+	for(unsigned int i=0; i<chunk->attrib_count; i++)
+		free(chunk->names[i]);
+
+	kuhl_buffer_chunk **prev = &kuhl_buffer_chunks;
+	while(*prev != chunk)
+		prev = &((*prev)->next);
+	*prev = chunk->next;
+	free(chunk);
+}
 
-    @return The number of geometry objects in the list.
-*/
-unsigned int kuhl_geometry_count(const kuhl_geometry *geom)
+/** Connects the vertex and index buffers of a chunk to the currently
+ * bound vertex array object. */
+static void kuhl_private_chunk_attribs(const kuhl_buffer_chunk *chunk)
 {
-	if(geom == NULL)
-		return 0;
-	const kuhl_geometry *g = geom;
-	unsigned int count = 1;
-	while(g->next != NULL)
+	glBindBuffer(GL_ARRAY_BUFFER, chunk->vbo);
+	for(unsigned int i=0; i<chunk->attrib_count; i++)
 	{
-		count++;
-		g = g->next;
+		kuhl_attrib attrib;
+		attrib.components = chunk->components[i];
+		attrib.divisor = 0;
+		attrib.stride = (GLsizei) (chunk->stride*sizeof(GLfloat));
+		attrib.offset = chunk->offsets[i]*sizeof(GLfloat);
+		kuhl_private_attrib_pointer(chunk->locations[i], &attrib);
 	}
-	return count;
+	/* The vertex array object keeps track of the index buffer. */
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, chunk->ibo);
 }
 
+/** Creates a new chunk that has the same vertex layout as the
+ * template chunk and enough space for at least the given number of
+ * vertices and indices. */
+static kuhl_buffer_chunk* kuhl_private_chunk_new(const kuhl_buffer_chunk *layout, GLuint vertexCount, GLuint indexCount)
+{
+	kuhl_buffer_chunk *chunk = kuhl_malloc(sizeof(kuhl_buffer_chunk));
+	*chunk = *layout;
+	for(unsigned int i=0; i<chunk->attrib_count; i++)
+		chunk->names[i] = strdup(layout->names[i]);
+
+	GLuint strideBytes = chunk->stride * sizeof(GLfloat);
+	chunk->vertex_capacity = KUHL_CHUNK_VERTEX_BYTES / strideBytes;
+	if(chunk->vertex_capacity < vertexCount)
+		chunk->vertex_capacity = vertexCount;
+	chunk->index_capacity = chunk->vertex_capacity * 2;
+	if(chunk->index_capacity < indexCount)
+		chunk->index_capacity = indexCount;
+	chunk->vertex_used = 0;
+	chunk->index_used = 0;
+	chunk->refcount = 0;
+	chunk->mapped = 0;
+
+	glGenVertexArrays(1, &(chunk->vao));
+	glBindVertexArray(chunk->vao);
+
+	glGenBuffers(1, &(chunk->vbo));
+	glBindBuffer(GL_ARRAY_BUFFER, chunk->vbo);
+	glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr) strideBytes*chunk->vertex_capacity,
+	             NULL, GL_STATIC_DRAW);
+	glGenBuffers(1, &(chunk->ibo));
+	glBindBuffer(GL_ARRAY_BUFFER, chunk->ibo);
+	glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr) sizeof(GLuint)*chunk->index_capacity,
+	             NULL, GL_STATIC_DRAW);
+	kuhl_private_chunk_attribs(chunk);
+	kuhl_errorcheck();
 
-/** Initializes the vertex array object (VAO) associated with this
-    kuhl_geometry and initializes other variables inside of the struct.
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-    @param geom A kuhl_geometry struct populated with the information
-    necessary to draw some geometry.
-
-    @param program A GLSL program to be used when rendering this
-    geometry.
-
-    @param vertexCount The number of vertices in this piece of geometry.
+	chunk->next = kuhl_buffer_chunks;
+	kuhl_buffer_chunks = chunk;
+	return chunk;
+}
 
-    @param primitive_type OpenGL primitive type of the geometry.
-*/
-void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexCount, GLint primitive_type)
+/** Deletes the buffers and vertex array object that a geometry owns
+ * (or releases its reference to a shared chunk). The rest of the
+ * kuhl_geometry struct is left as it is.
+ */
+static void kuhl_private_geometry_release_buffers(kuhl_geometry *geom)
 {
-	kuhl_errorcheck();
-
-	/* Ask OpenGL for one vertex array object "name" (really an
-	 * integer that you can think of as an ID number) that we can use
-	 * for a new VAO (vertex array object) */
-	glGenVertexArrays(1, &(geom->vao));
-	/* Bind to the VAO to finish creating it */
-	glBindVertexArray(geom->vao);
-	glBindVertexArray(0); // unbind
-
-	/* Check if the program is valid (we don't need to enable it here). */
-	if(!glIsProgram(program))
-	{
-		msg(ERROR, "The program you specified in your kuhl_geometry struct (%d) is not a valid GLSL program.\n", geom->program);
-		exit(EXIT_FAILURE);
-	}
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+		kuhl_private_attrib_release(geom, i);
+	geom->attrib_count = 0;
 
-	if(vertexCount == 0)
+	if(geom->pool == NULL)
 	{
-		msg(WARNING, "You are creating a geometry object with a vertexCount of 0.\n");
+		if(glIsBuffer(geom->indices_bufferobject))
+			glDeleteBuffers(1, &(geom->indices_bufferobject));
+		if(glIsVertexArray(geom->vao))
+			glDeleteVertexArrays(1, &(geom->vao));
 	}
+	else
+		kuhl_private_chunk_unref(geom->pool);
 
-	geom->program = program;
-	geom->vertex_count = vertexCount;
-	geom->primitive_type = primitive_type;
-
-	geom->attrib_count = 0;
-	geom->texture_count = 0;
-
-	geom->indices = NULL;
-	geom->indices_len = 0;
 	geom->indices_bufferobject = 0;
-
-	mat4f_identity(geom->matrix);
-	geom->has_been_drawn = 0;
-	
-#if KUHL_UTIL_USE_ASSIMP
-	geom->assimp_node  = NULL;
-	geom->assimp_scene = NULL;
-	geom->bones        = NULL;
-#endif
-
-	geom->next = NULL;
+	geom->indices_type = GL_UNSIGNED_INT;
+	geom->indices_len = 0;
+	geom->lod_count = 0;
+	geom->lod_current = 0;
+	geom->instance_count = 0;
+	geom->vao = 0;
+	geom->pool = NULL;
+	geom->base_vertex = 0;
+	geom->first_index = 0;
 }
 
-/** Applies a set of indices to the geometry so that vertices can be
- * re-used by multiple triangles or lines.
+/** Stores vertex and index data for a geometry in a shared chunk
+ * (creating a new chunk if necessary) and releases the buffers that
+ * the geometry previously used. Attributes that are missing in the
+ * geometry's GLSL program are not stored.
  *
- * @param geom The geometry that the indices should be used with.
- *
- * @param indicies A list of indices. Each index refers to a specific vertex.
- *
- * @param indexCount The number of indices. For example, if the
- * geometry object consists of triangles, indexCount should be
- * numTriangles*3.
-*/
-void kuhl_geometry_indices(kuhl_geometry *geom, GLuint *indices, GLuint indexCount)
+ * @return 1 if the geometry was stored in a chunk, 0 if the geometry
+ * was left unchanged.
+ */
+static int kuhl_private_geometry_store_pooled(kuhl_geometry *geom, unsigned int count,
+                                              const GLfloat *data[], const GLuint components[],
+                                              const char *names[],
+                                              const GLuint *indices, GLuint indexCount)
 {
-	if(indexCount == 0 || indices == NULL)
+	if(!kuhl_private_pool_supported() || geom->vertex_count == 0)
+		return 0;
+
+	/* Describe the vertex layout that this geometry needs. */
+	kuhl_buffer_chunk layout;
+	const GLfloat *layoutData[MAX_ATTRIBUTES];
+	layout.attrib_count = 0;
+	layout.stride = 0;
+	for(unsigned int i=0; i<count && i<MAX_ATTRIBUTES; i++)
 	{
-		printf("%s: WARNING: indexCount was zero or indices array was NULL\n", __func__);
-		return;
+		GLint loc = glGetAttribLocation(geom->program, names[i]);
+		if(loc == -1 || data[i] == NULL || components[i] == 0)
+			continue;
+		unsigned int a = layout.attrib_count++;
+		layout.names[a] = (char*) names[i];
+		layout.locations[a] = loc;
+		layout.components[a] = components[i];
+		layout.offsets[a] = layout.stride;
+		layoutData[a] = data[i];
+		layout.stride += components[i];
 	}
+	if(layout.attrib_count == 0)
+		return 0;
 
-	if(geom->primitive_type == GL_TRIANGLES && indexCount % 3 != 0)
+	/* Find a chunk with the same layout and enough free space. */
+	kuhl_buffer_chunk *chunk = kuhl_buffer_chunks;
+	for(; chunk != NULL; chunk = chunk->next)
 	{
-		printf("%s: ERROR: indexCount=%u was not a multiple of 3 even though this geometry has triangles in it.", __func__, indexCount);
-		exit(EXIT_FAILURE);
+		if(chunk->stride != layout.stride ||
+		   chunk->attrib_count != layout.attrib_count ||
+		   chunk->vertex_used + geom->vertex_count > chunk->vertex_capacity ||
+		   chunk->index_used + indexCount > chunk->index_capacity)
+			continue;
+		unsigned int a = 0;
+		while(a < layout.attrib_count &&
+		      chunk->locations[a] == layout.locations[a] &&
+		      chunk->components[a] == layout.components[a] &&
+		      strcmp(chunk->names[a], layout.names[a]) == 0)
+			a++;
+		if(a == layout.attrib_count)
+			break;
 	}
-	else if(geom->primitive_type == GL_LINES && indexCount % 2 != 0)
+	if(chunk == NULL)
+		chunk = kuhl_private_chunk_new(&layout, geom->vertex_count, indexCount);
+
+	/* Copy the vertices into the chunk. */
+	kuhl_arena *arena = kuhl_arena_frame();
+	size_t mark = kuhl_arena_mark(arena);
+	GLfloat *interleaved = kuhl_arena_alloc(arena, sizeof(GLfloat)*geom->vertex_count*layout.stride);
+	for(unsigned int a=0; a<layout.attrib_count; a++)
 	{
-		printf("%s: ERROR: indexCount=%u was not a multiple of 2 even though this geometry has lines in it.", __func__, indexCount);
-		exit(EXIT_FAILURE);
+		for(GLuint v=0; v<geom->vertex_count; v++)
+			memcpy(interleaved + v*layout.stride + layout.offsets[a],
+			       layoutData[a] + v*layout.components[a],
+			       sizeof(GLfloat)*layout.components[a]);
+		kuhl_private_geometry_bbox(geom, layout.names[a], layoutData[a], layout.components[a]);
 	}
-	
-	geom->indices_len = indexCount;
-	geom->indices     = indices;
-
-	/* Verify that the indices the user passed in are
-	 * appropriate. If there are only 10 vertices, then a user
-	 * can't draw a vertex at index 10, 11, 13, etc. */
-	for(GLuint i=0; i<geom->indices_len; i++)
+	GLsizeiptr strideBytes = sizeof(GLfloat)*layout.stride;
+	glBindBuffer(GL_ARRAY_BUFFER, chunk->vbo);
+	glBufferSubData(GL_ARRAY_BUFFER, strideBytes*chunk->vertex_used,
+	                strideBytes*geom->vertex_count, interleaved);
+	kuhl_arena_release(arena, mark);
+
+	/* Copy the indices into the chunk. Binding the index buffer to
+	 * GL_ARRAY_BUFFER avoids changing the currently bound vertex
+	 * array object. */
+	if(indexCount > 0)
 	{
-		if(geom->indices[i] >= geom->vertex_count)
-			fprintf(stderr, "%s: kuhl_geometry has %d vertices but indices[%d] is asking for vertex at index %d to be drawn.\n", __func__, geom->vertex_count, i, geom->indices[i]);
+		glBindBuffer(GL_ARRAY_BUFFER, chunk->ibo);
+		glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLuint)*chunk->index_used,
+		                sizeof(GLuint)*indexCount, indices);
 	}
-
-	/* Enable VAO */
-	glBindVertexArray(geom->vao);
-		
-	/* Set up a buffer object (BO) which is a place to store the
-	 * *indices* on the graphics card. */
-	glGenBuffers(1, &(geom->indices_bufferobject));
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geom->indices_bufferobject);
-	kuhl_errorcheck();
-
-	/* Copy the indices data into the currently bound buffer. */
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*geom->indices_len,
-	             geom->indices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	kuhl_errorcheck();
-	// Don't unbind GL_ELEMENT_ARRAY_BUFFER since the VAO keeps track of this for us.
 
-	// unbind vao
-	glBindVertexArray(0);
+	/* Replace the geometry's own buffers with the chunk. */
+	kuhl_private_geometry_release_buffers(geom);
+	for(unsigned int a=0; a<chunk->attrib_count; a++)
+	{
+		kuhl_attrib *attrib = &(geom->attribs[a]);
+		attrib->name = strdup(chunk->names[a]);
+		attrib->bufferobject = chunk->vbo;
+		attrib->mapped = 0;
+		attrib->stream = NULL;
+		attrib->components = chunk->components[a];
+		attrib->divisor = 0;
+		attrib->stride = (GLsizei) strideBytes;
+		attrib->offset = (GLsizeiptr) (sizeof(GLfloat)*chunk->offsets[a]);
+	}
+	geom->attrib_count = chunk->attrib_count;
+	geom->vao = chunk->vao;
+	geom->indices = NULL;
+	geom->indices_len = indexCount;
+	geom->indices_bufferobject = indexCount > 0 ? chunk->ibo : 0;
+	geom->indices_type = GL_UNSIGNED_INT;
+	geom->pool = chunk;
+	geom->base_vertex = (GLint) chunk->vertex_used;
+	geom->first_index = chunk->index_used;
+
+	chunk->vertex_used += geom->vertex_count;
+	chunk->index_used += indexCount;
+	chunk->refcount++;
+	return 1;
 }
 
-
-
-#if 0
-void kuhl_geometry_init(kuhl_geometry *geom)
+/** Copies the per-vertex attributes and the indices of a geometry
+ * from OpenGL buffers back into arrays. The caller must free() each
+ * data[i], names[i] and *indices.
+ *
+ * @return The number of attributes copied into data, components and
+ * names.
+ */
+static unsigned int kuhl_private_geometry_readback(kuhl_geometry *geom, GLfloat *data[],
+                                                   GLuint components[], char *names[],
+                                                   GLuint **indices)
 {
+	unsigned int count = 0;
+	*indices = NULL;
+	if(geom->vertex_count == 0)
+		return 0;
 
-	/* Calculate the bounding box. */
-	for(int i=0; i<6; i=i+2) // set min values to the largest float
-		geom->aabbox[i] = FLT_MAX;
-	for(int i=1; i<6; i=i+2) // set max values to the smallest float
-		geom->aabbox[i] = -FLT_MAX;
-	for(unsigned int i=0; i<geom->vertex_count; i++)
+	glBindVertexArray(0);
+	kuhl_geometry_unmap(geom);
+	for(unsigned int i=0; i<geom->attrib_count; i++)
 	{
-		// Check for new min values
-		if(geom->attrib_pos[i*3+0] < geom->aabbox[0])
-			geom->aabbox[0] = geom->attrib_pos[i*3+0];
-		if(geom->attrib_pos[i*3+1] < geom->aabbox[2])
-			geom->aabbox[2] = geom->attrib_pos[i*3+1];
-		if(geom->attrib_pos[i*3+2] < geom->aabbox[4])
-			geom->aabbox[4] = geom->attrib_pos[i*3+2];
+		kuhl_attrib *attrib = &(geom->attribs[i]);
+		if(attrib->divisor != 0)
+			continue;
 
-		// Check for new max values
-		if(geom->attrib_pos[i*3+0] > geom->aabbox[1])
-			geom->aabbox[1] = geom->attrib_pos[i*3+0];
-		if(geom->attrib_pos[i*3+1] > geom->aabbox[3])
-			geom->aabbox[3] = geom->attrib_pos[i*3+1];
-		if(geom->attrib_pos[i*3+2] > geom->aabbox[5])
-			geom->aabbox[5] = geom->attrib_pos[i*3+2];
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+
+		GLsizeiptr attribBytes = sizeof(GLfloat)*attrib->components;
+		GLsizeiptr stride = attrib->stride ? attrib->stride : attribBytes;
+		GLsizeiptr start = stride*geom->base_vertex + attrib->offset;
+		GLsizeiptr length = stride*(geom->vertex_count-1) + attribBytes;
+		kuhl_arena *arena = kuhl_arena_frame();
+		size_t mark = kuhl_arena_mark(arena);
+		char *raw = kuhl_arena_alloc(arena, length);
+		glGetBufferSubData(GL_ARRAY_BUFFER, start, length, raw);
+
+		data[count] = kuhl_malloc(attribBytes*geom->vertex_count);
+		for(GLuint v=0; v<geom->vertex_count; v++)
+			memcpy(data[count] + v*attrib->components, raw + v*stride, attribBytes);
+		kuhl_arena_release(arena, mark);
+		components[count] = attrib->components;
+		names[count] = strdup(attrib->name);
+		count++;
 	}
 
+	if(geom->indices_len > 0 && glIsBuffer(geom->indices_bufferobject))
+	{
+		*indices = kuhl_malloc(sizeof(GLuint)*geom->indices_len);
+		glBindBuffer(GL_ARRAY_BUFFER, geom->indices_bufferobject);
+		if(geom->indices_type == GL_UNSIGNED_SHORT)
+		{
+			kuhl_arena *arena = kuhl_arena_frame();
+			size_t mark = kuhl_arena_mark(arena);
+			GLushort *shortIndices = kuhl_arena_alloc(arena, sizeof(GLushort)*geom->indices_len);
+			glGetBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLushort)*geom->indices_len, shortIndices);
+			for(GLuint i=0; i<geom->indices_len; i++)
+				(*indices)[i] = shortIndices[i];
+			kuhl_arena_release(arena, mark);
+		}
+		else
+			glGetBufferSubData(GL_ARRAY_BUFFER, sizeof(GLuint)*geom->first_index,
+			                   sizeof(GLuint)*geom->indices_len, *indices);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_errorcheck();
+	return count;
 }
-#endif
 
-/** Draws a kuhl_geometry struct to the screen. The struct passed into
- * this function should have been set up with kuhl_geometry_new() and
- * at least one position attribute with kuhl_geometry_attrib() before
- * calling this function.
+/** Moves a geometry into a shared chunk. If the geometry is already
+ * stored in a chunk, it is moved into a chunk that matches the
+ * attribute locations of its current GLSL program. */
+static int kuhl_private_geometry_move_pooled(kuhl_geometry *geom)
+{
+	GLfloat *data[MAX_ATTRIBUTES];
+	GLuint components[MAX_ATTRIBUTES];
+	char *names[MAX_ATTRIBUTES];
+	GLuint *indices = NULL;
+	unsigned int count = kuhl_private_geometry_readback(geom, data, components, names, &indices);
+	GLuint indexCount = indices ? geom->indices_len : 0;
+
+	int ret = kuhl_private_geometry_store_pooled(geom, count, (const GLfloat**) data, components,
+	                                             (const char**) names, indices, indexCount);
+	for(unsigned int i=0; i<count; i++)
+	{
+		free(data[i]);
+		free(names[i]);
+	}
+	free(indices);
+	return ret;
+}
 
- @param geom The geometry to draw to the screen. If the kuhl_geometry
- object is a part of a linked list, this function will draw each of
- the objects in order. */
-void kuhl_geometry_draw(kuhl_geometry *geom)
+/** Changes the GLSL program that is used by a kuhl_geometry object.
+ *
+ * @param geom A geometry that you want to change the GLSL program for.
+ *
+ * @param program The new GLSL program you wish to use with the geometry.
+ *
+ * @param kg_options Set this to KG_FULL_LIST to apply the new program
+ * to all geometries in the kuhl_geometry linked list. Otherwise, set
+ * to 0.
+ */
+void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options)
 {
 	if(geom == NULL)
 		return;
+
+	if(kg_options & KG_FULL_LIST)
+		kuhl_geometry_program(geom->next, program, kg_options);
+
+	// If the caller deleted their old program and created a new one,
+	// the new program ID might match the old program ID. Therefore,
+	// we can't rely on the program IDs to verify that the user
+	// changed the program.
+
+	if(!glIsProgram(program))
+	{
+		msg(WARNING, "GLSL program %d is not a valid program.\n",program);
+	}
 	
-	kuhl_errorcheck();
-	
-	/* Record the OpenGL state so that we can restore it when we have
-	 * finished drawing. */
-	GLint previouslyUsedProgram = 0;
-	glGetIntegerv(GL_CURRENT_PROGRAM, &previouslyUsedProgram);
-	GLint previouslyBoundTexture = 0;
-	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previouslyBoundTexture);
-	GLint previouslyActiveTexture = 0;
-	glGetIntegerv(GL_ACTIVE_TEXTURE, &previouslyActiveTexture);
-	GLint previousVAO=0;
-	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVAO);
+	geom->program = program;
 
-	/* Check that there is a valid program and VAO object for us to use. */
-	if(glIsProgram(geom->program) == 0 || glIsVertexArray(geom->vao) == 0)
+	/* The vertex array object of geometry in a shared chunk is used
+	 * by other geometry too. If the new program uses different
+	 * attribute locations, the geometry must move to another chunk. */
+	if(geom->pool != NULL)
 	{
-		fprintf(stderr, "%s: Program (%d) or vertex array object (%d) were invalid\n",
-		        __func__, geom->program, geom->vao);
-		kuhl_errorcheck();
+		for(unsigned int i=0; i<geom->pool->attrib_count; i++)
+		{
+			GLint loc = glGetAttribLocation(program, geom->pool->names[i]);
+			if(loc != -1 && loc != geom->pool->locations[i])
+			{
+				kuhl_private_geometry_move_pooled(geom);
+				break;
+			}
+		}
+		kuhl_private_geometry_uniforms(geom);
 		return;
 	}
-
-	glUseProgram(geom->program);
-	kuhl_errorcheck();
-
-	/* Bind all of the textures used in this geometry to texture
-	 * units. */
-	int hasTex = 0;
-	for(unsigned int i=0; i<geom->texture_count; i++)
+	
+	glBindVertexArray(geom->vao);
+	for(unsigned int i=0; i<geom->attrib_count; i++)
 	{
-		kuhl_texture *tex = &(geom->textures[i]);
-		if(!glIsTexture(tex->textureId))
-			continue;
+		kuhl_attrib *attrib = &(geom->attribs[i]);
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		kuhl_errorcheck();
 
-		/* Check if the sampler variable is available in the GLSL
-		 * program. If not, don't send the texture. */
-		GLint loc = glGetUniformLocation(geom->program, tex->name);
-		if(loc == -1)
+		GLint attribLocation = kuhl_get_attribute(geom->program, attrib->name);
+		attrib->location = attribLocation;
+		if(attrib->stream != NULL)
+			attrib->stream->location = attribLocation;
+		if(attribLocation == -1)
 			continue;
 
-		if(strcmp(tex->name, "tex") == 0)
-			hasTex = 1;
-		
-		/* Tell OpenGL that the texture that we refer to in our
-		 * GLSL program is going to be in texture unit number 'i'.
-		 */
-		glUniform1i(loc, i);
-		kuhl_errorcheck();
-		/* Turn on appropriate texture unit */
-		glActiveTexture(GL_TEXTURE0+i);
-		kuhl_errorcheck();
-		/* Bind the texture that we want to use while the correct
-		 * texture unit is enabled. */
-		glBindTexture(GL_TEXTURE_2D, tex->textureId);
-		kuhl_errorcheck();
+		/* Connect this vertex attribute with the (possibly different)
+		 * attribute location. */
+		kuhl_private_attrib_pointer(attribLocation, attrib);
 	}
 
-	GLint loc;
-	loc = glGetUniformLocation(geom->program, "HasTex");
-	if(loc != -1)
-	    glUniform1i(loc, hasTex);
+	/* Look up the uniform locations in the new program now so that
+	 * kuhl_geometry_draw() doesn't have to. */
+	kuhl_private_geometry_uniforms(geom);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+}
+
+
+/** Adds a vertex attribute (such as vertex position, normal, color,
+ * texture coordinate, etc) to the geometry object.
+ *
+ * @param geom The geometry to add the attribute to.
+ *
+ * @param data An array of floats that contains the attribute
+ * data. This array should contain geom->vertex_count * components
+ * floats.
+ *
+ * @param components The number of floats per vertex in this attribute.
+ *
+ * @param name The GLSL variable name that this attribute should be
+ * connected to.
+ *
+ * @param kg_options If KG_WARN is set, print a warning if the
+ * attribute isn't present in the GLSL program for this geometry
+ * object. Set KG_DYNAMIC if the data will be changed often with
+ * kuhl_geometry_attrib_get() (for example, every frame).
+ */
+void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint components, const char* name, int kg_options)
+{
+	if(name == NULL || strlen(name) == 0)
+	{
+		msg(WARNING, "Unable to add an attribute that is NULL or an empty string.\n");
+		return;
+	}
+	if(geom == NULL)
+	{
+		msg(WARNING, "Unable to add attribute '%s' to the geometry object because you passed in a geometry object that was set to NULL.\n",name);
+		return;
+	}
+	if(data == NULL)
+	{
+		msg(WARNING, "Unable to add attribute '%s' to the geometry object because you passed in an array set to NULL.\n",
+		             name);
+		return;
+	}
+	if(components == 0)
+	{
+		msg(WARNING, "Unable to add attribute '%s' to the geometry object because this attribute has 0 components.\n",
+		             name);
+		return;
+	}
+	if(!glIsVertexArray(geom->vao))
+	{
+		msg(WARNING, "Unable to add attribute '%s' to the geometry object because the geometry has an invalid vertex array object %d\n", geom->vao, name);
+		return;
+	}
+	if(kuhl_private_geometry_is_pooled(geom, __func__))
+		return;
+
+	/* If this attribute isn't available in the GLSL program, move
+	 * on to the next one. */
+	// GLint attribLocation = kuhl_get_attribute(geom->program, name);
+
+	// Get attribute location directly so kuhl_get_attribute() and
+	// this function don't print the same error repeatedly.
+	GLint attribLocation = glGetAttribLocation(geom->program, name);
+	if(attribLocation == -1)
+	{
+		if(kg_options & KG_WARN)
+			msg(WARNING, "Unable to add attribute '%s' to the geometry object because it was missing or inactive in program %d\n",
+			    name, geom->program);
+		return;
+	}
+
+	/* If another attribute in kuhl_geometry has the same name,
+	 * overwrite it. */
+	int destIndex = kuhl_geometry_attrib_index(geom, name);
+
+	if(destIndex < 0)
+	{
+		/* If this is a new attribute for this geometry object */
+		destIndex = geom->attrib_count;
+		geom->attrib_count++;
+	}
+	else
+	{
+		/* If overwriting, free resources from old attribute. */
+		kuhl_private_attrib_release(geom, destIndex);
+	}
+//	printf("%s: Storing attribute %s at index %d in kuhl_geometry; connected to location %d in program %d\n", __func__, name, destIndex, attribLocation, geom->program);
+	
+	/* If we are writing past the end of the array. */
+	if(destIndex == MAX_ATTRIBUTES)
+	{
+		msg(FATAL, "You tried to add more than %d attributes to a kuhl_geometry object\n", MAX_ATTRIBUTES);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Set up this attribute. */
+	kuhl_attrib *attrib = &(geom->attribs[destIndex]);
+	attrib->name = strdup(name);
+	attrib->mapped = 0;
+	attrib->stream = NULL;
+	attrib->components = components;
+	attrib->divisor = 0;
+	attrib->stride = 0;
+	attrib->offset = 0;
+
+	/* Switch to our vertex array object. */
+	glBindVertexArray(geom->vao);
+
+	/* Ask OpenGL for one new buffer "name" (or ID number). */
+	glGenBuffers(1, &(attrib->bufferobject));
+	/* Tell OpenGL that we are going to use this buffer until we
+	 * say otherwise. GL_ARRAY_BUFFER basically means that the
+	 * data stored in this buffer will be an array containing
+	 * vertex information. */
+	glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+	kuhl_errorcheck();
+
+	/* Copy our data into the buffer object that is currently bound. */
+	if(kg_options & KG_DYNAMIC)
+		kuhl_private_stream_new(attrib, attribLocation, data,
+		                        sizeof(GLfloat)*geom->vertex_count*components);
+	else
+		glBufferData(GL_ARRAY_BUFFER,
+		             sizeof(GLfloat)*geom->vertex_count*components,
+		             data, GL_STATIC_DRAW);
+	kuhl_errorcheck();
+	kuhl_private_geometry_bbox(geom, name, data, components);
+
+	/* Tell OpenGL some information about the data that is in the
+	 * buffer. Among other things, we need to tell OpenGL which
+	 * attribute number (i.e., variable) the data should correspond to
+	 * in the vertex program. This also enables the attribute location
+	 * for this vertex array object. */
+	attrib->location = attribLocation;
+	kuhl_private_attrib_pointer(attribLocation, attrib);
+
+	// unbind
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+}
+
+/** Adds several vertex attributes to a geometry object and stores
+ * them interleaved in a single OpenGL buffer (i.e., position, normal,
+ * texcoord for vertex 0, then position, normal, texcoord for vertex
+ * 1, etc). Compared to calling kuhl_geometry_attrib() once per
+ * attribute, this reduces the number of buffers that need to be
+ * bound and keeps all of the data for a vertex next to each other in
+ * memory which is friendlier to the vertex fetch hardware.
+ *
+ * Attributes that are missing or inactive in the GLSL program are
+ * not added to the buffer. An attribute with the same name as one
+ * already in the geometry object replaces the existing attribute.
+ *
+ * @param geom The geometry to add the attributes to.
+ *
+ * @param count The number of attributes in the data, components and
+ * names arrays.
+ *
+ * @param data An array of count pointers. Each pointer points to an
+ * array containing geom->vertex_count * components[i] floats.
+ *
+ * @param components The number of floats per vertex for each
+ * attribute.
+ *
+ * @param names The GLSL variable name for each attribute.
+ *
+ * @param kg_options If KG_WARN is set, print a warning for each
+ * attribute that isn't present in the GLSL program for this geometry
+ * object.
+ */
+void kuhl_geometry_attrib_interleaved(kuhl_geometry *geom, unsigned int count, const GLfloat *data[], const GLuint components[], const char *names[], int kg_options)
+{
+	if(geom == NULL || data == NULL || components == NULL || names == NULL)
+	{
+		msg(WARNING, "Unable to add interleaved attributes to the geometry object because one of the arguments was NULL.\n");
+		return;
+	}
+	if(!glIsVertexArray(geom->vao))
+	{
+		msg(WARNING, "Unable to add interleaved attributes to the geometry object because the geometry has an invalid vertex array object %d\n", geom->vao);
+		return;
+	}
+	if(kuhl_private_geometry_is_pooled(geom, __func__))
+		return;
+	if(count > MAX_ATTRIBUTES)
+	{
+		msg(FATAL, "You tried to add more than %d attributes to a kuhl_geometry object\n", MAX_ATTRIBUTES);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Figure out which attributes are used by the program and where
+	 * each one will be stored within a vertex. */
+	GLint locations[MAX_ATTRIBUTES];
+	GLuint offsets[MAX_ATTRIBUTES]; // in floats
+	GLuint floatsPerVertex = 0;
+	for(unsigned int i=0; i<count; i++)
+	{
+		locations[i] = -1;
+		if(names[i] == NULL || strlen(names[i]) == 0 || data[i] == NULL || components[i] == 0)
+		{
+			msg(WARNING, "Skipping interleaved attribute %u because its name, data or number of components was missing.\n", i);
+			continue;
+		}
+		locations[i] = glGetAttribLocation(geom->program, names[i]);
+		if(locations[i] == -1)
+		{
+			if(kg_options & KG_WARN)
+				msg(WARNING, "Unable to add attribute '%s' to the geometry object because it was missing or inactive in program %d\n",
+				    names[i], geom->program);
+			continue;
+		}
+		offsets[i] = floatsPerVertex;
+		floatsPerVertex += components[i];
+	}
+	if(floatsPerVertex == 0)
+		return;
+
+	/* Interleave the data */
+	kuhl_arena *arena = kuhl_arena_frame();
+	size_t mark = kuhl_arena_mark(arena);
+	GLfloat *interleaved = kuhl_arena_alloc(arena, sizeof(GLfloat)*geom->vertex_count*floatsPerVertex);
+	for(unsigned int i=0; i<count; i++)
+	{
+		if(locations[i] == -1)
+			continue;
+		for(GLuint v=0; v<geom->vertex_count; v++)
+			memcpy(interleaved + v*floatsPerVertex + offsets[i],
+			       data[i] + v*components[i],
+			       sizeof(GLfloat)*components[i]);
+		kuhl_private_geometry_bbox(geom, names[i], data[i], components[i]);
+	}
+
+	glBindVertexArray(geom->vao);
+	GLuint bufferobject = 0;
+	glGenBuffers(1, &bufferobject);
+	glBindBuffer(GL_ARRAY_BUFFER, bufferobject);
+	glBufferData(GL_ARRAY_BUFFER,
+	             sizeof(GLfloat)*geom->vertex_count*floatsPerVertex,
+	             interleaved, GL_STATIC_DRAW);
+	kuhl_arena_release(arena, mark);
+	kuhl_errorcheck();
+
+	for(unsigned int i=0; i<count; i++)
+	{
+		if(locations[i] == -1)
+			continue;
+
+		/* If another attribute in kuhl_geometry has the same name,
+		 * overwrite it. */
+		int destIndex = kuhl_geometry_attrib_index(geom, names[i]);
+		if(destIndex < 0)
+		{
+			destIndex = geom->attrib_count;
+			if(destIndex == MAX_ATTRIBUTES)
+			{
+				msg(FATAL, "You tried to add more than %d attributes to a kuhl_geometry object\n", MAX_ATTRIBUTES);
+				exit(EXIT_FAILURE);
+			}
+			geom->attrib_count++;
+		}
+		else
+			kuhl_private_attrib_release(geom, destIndex);
+
+		kuhl_attrib *attrib = &(geom->attribs[destIndex]);
+		attrib->name = strdup(names[i]);
+		attrib->bufferobject = bufferobject;
+		attrib->mapped = 0;
+		attrib->stream = NULL;
+		attrib->components = components[i];
+		attrib->divisor = 0;
+		attrib->stride = (GLsizei) (sizeof(GLfloat)*floatsPerVertex);
+		attrib->offset = (GLsizeiptr) (sizeof(GLfloat)*offsets[i]);
+		attrib->location = locations[i];
+		kuhl_private_attrib_pointer(locations[i], attrib);
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+}
+
+/** Adds a per-instance attribute to a geometry object and enables
+ * instanced drawing. When kuhl_geometry_draw() draws a geometry
+ * object with instance attributes, it draws instanceCount copies of
+ * the geometry with a single glDrawElementsInstanced() or
+ * glDrawArraysInstanced() call. Each copy receives the next set of
+ * 'components' floats from data. For example, to draw many copies of
+ * a model at different locations, you might provide a mat4 (16
+ * components) for each instance and declare "in mat4 in_InstanceMat;"
+ * in your vertex program.
+ *
+ * Calling this function again with the same name replaces the data
+ * in the existing buffer, so it can be used to update per-instance
+ * data every frame.
+ *
+ * @param geom The geometry to add the attribute to.
+ *
+ * @param data An array containing instanceCount * components floats.
+ *
+ * @param components The number of floats per instance. Values larger
+ * than 4 use multiple consecutive attribute locations (i.e., a mat4
+ * attribute uses 16 components).
+ *
+ * @param instanceCount The number of instances to draw. All of the
+ * instance attributes in a geometry object should have the same
+ * number of instances.
+ *
+ * @param name The GLSL variable name that this attribute should be
+ * connected to.
+ *
+ * @param kg_options If the KG_WARN bit is set, warn if the attribute
+ * is missing in the GLSL program. If KG_FULL_LIST is set, add the
+ * attribute to all of the geometry in the list.
+ */
+void kuhl_geometry_instance_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint components, GLuint instanceCount, const char* name, int kg_options)
+{
+	if(geom == NULL || name == NULL || data == NULL || components == 0 || instanceCount == 0)
+	{
+		msg(WARNING, "Unable to add instance attribute '%s' because one of the parameters was NULL or 0.\n",
+		    name ? name : "(null)");
+		return;
+	}
+	if(kg_options & KG_FULL_LIST && geom->next != NULL)
+		kuhl_geometry_instance_attrib(geom->next, data, components, instanceCount, name, kg_options);
+	if(kuhl_private_geometry_is_pooled(geom, __func__))
+		return;
+
+	GLint attribLocation = glGetAttribLocation(geom->program, name);
+	if(attribLocation == -1)
+	{
+		if(kg_options & KG_WARN)
+			msg(WARNING, "Unable to add instance attribute '%s' to the geometry object because it was missing or inactive in program %d\n",
+			    name, geom->program);
+		return;
+	}
+
+	int destIndex = kuhl_geometry_attrib_index(geom, name);
+	/* The buffer of a KG_DYNAMIC attribute can't be resized, so it
+	 * must be replaced. */
+	if(destIndex >= 0 && geom->attribs[destIndex].stream != NULL)
+	{
+		kuhl_private_attrib_release(geom, destIndex);
+		geom->attribs[destIndex].name = strdup(name);
+		glGenBuffers(1, &(geom->attribs[destIndex].bufferobject));
+	}
+	if(destIndex < 0)
+	{
+		if(geom->attrib_count == MAX_ATTRIBUTES)
+		{
+			msg(FATAL, "You tried to add more than %d attributes to a kuhl_geometry object\n", MAX_ATTRIBUTES);
+			exit(EXIT_FAILURE);
+		}
+		destIndex = geom->attrib_count;
+		geom->attrib_count++;
+		kuhl_attrib *attrib = &(geom->attribs[destIndex]);
+		attrib->name = strdup(name);
+		attrib->mapped = 0;
+		attrib->stream = NULL;
+		glGenBuffers(1, &(attrib->bufferobject));
+	}
+	kuhl_attrib *attrib = &(geom->attribs[destIndex]);
+	attrib->components = components;
+	attrib->divisor = 1;
+	attrib->stride = 0;
+	attrib->offset = 0;
+
+	glBindVertexArray(geom->vao);
+	glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+	if(attrib->mapped)
+	{
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		attrib->mapped = 0;
+	}
+	/* The data is likely to be updated frequently. */
+	glBufferData(GL_ARRAY_BUFFER,
+	             sizeof(GLfloat)*instanceCount*components,
+	             data, GL_DYNAMIC_DRAW);
+	kuhl_errorcheck();
+	attrib->location = attribLocation;
+	kuhl_private_attrib_pointer(attribLocation, attrib);
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+	geom->instance_count = instanceCount;
+}
+
+/** Calculates the number of objects in the kuhl_geometry linked list.
+
+    @param geom The geometry object which you want to know the length of.
+
+    @return The number of geometry objects in the list.
+*/
+unsigned int kuhl_geometry_count(const kuhl_geometry *geom)
+{
+	if(geom == NULL)
+		return 0;
+	const kuhl_geometry *g = geom;
+	unsigned int count = 1;
+	while(g->next != NULL)
+	{
+		count++;
+		g = g->next;
+	}
+	return count;
+}
+
+
+/** Initializes the vertex array object (VAO) associated with this
+    kuhl_geometry and initializes other variables inside of the struct.
+
+    @param geom A kuhl_geometry struct populated with the information
+    necessary to draw some geometry.
+
+    @param program A GLSL program to be used when rendering this
+    geometry.
+
+    @param vertexCount The number of vertices in this piece of geometry.
+
+    @param primitive_type OpenGL primitive type of the geometry.
+*/
+void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexCount, GLint primitive_type)
+{
+	kuhl_errorcheck();
+
+	/* Ask OpenGL for one vertex array object "name" (really an
+	 * integer that you can think of as an ID number) that we can use
+	 * for a new VAO (vertex array object) */
+	glGenVertexArrays(1, &(geom->vao));
+	/* Bind to the VAO to finish creating it */
+	glBindVertexArray(geom->vao);
+	glBindVertexArray(0); // unbind
+
+	/* Check if the program is valid (we don't need to enable it here). */
+	if(!glIsProgram(program))
+	{
+		msg(ERROR, "The program you specified in your kuhl_geometry struct (%d) is not a valid GLSL program.\n", geom->program);
+		exit(EXIT_FAILURE);
+	}
+
+	if(vertexCount == 0)
+	{
+		msg(WARNING, "You are creating a geometry object with a vertexCount of 0.\n");
+	}
+
+	geom->program = program;
+	geom->vertex_count = vertexCount;
+	geom->primitive_type = primitive_type;
+
+	geom->attrib_count = 0;
+	geom->texture_count = 0;
+
+	geom->indices = NULL;
+	geom->indices_len = 0;
+	geom->indices_bufferobject = 0;
+	geom->indices_type = GL_UNSIGNED_INT;
+	geom->lod_count = 0;
+	geom->lod_current = 0;
+	geom->instance_count = 0;
+	geom->pool = NULL;
+	geom->base_vertex = 0;
+	geom->first_index = 0;
+	static unsigned int occlusion_id = 0;
+	geom->occlusion_id = __sync_add_and_fetch(&occlusion_id, 1);
+
+	/* The bounding box is empty until positions are added. */
+	for(int i=0; i<6; i=i+2)
+		geom->aabbox[i] = FLT_MAX;
+	for(int i=1; i<6; i=i+2)
+		geom->aabbox[i] = -FLT_MAX;
+
+	mat4f_identity(geom->matrix);
+	geom->has_been_drawn = 0;
+	
+#ifdef KUHL_UTIL_USE_ASSIMP
+	geom->assimp_node  = NULL;
+	geom->assimp_scene = NULL;
+	geom->assimp_node_index = -1;
+	geom->bones        = NULL;
+	geom->bone_block_target = 0;
+	geom->bone_block_size = 0;
+#endif
+	kuhl_private_geometry_uniforms(geom);
+
+	geom->next = NULL;
+}
+
+/** Applies a set of indices to the geometry so that vertices can be
+ * re-used by multiple triangles or lines.
+ *
+ * @param geom The geometry that the indices should be used with.
+ *
+ * @param indicies A list of indices. Each index refers to a specific vertex.
+ *
+ * @param indexCount The number of indices. For example, if the
+ * geometry object consists of triangles, indexCount should be
+ * numTriangles*3.
+ *
+ * If every index fits in 16 bits, the indices are stored in the
+ * OpenGL buffer as GL_UNSIGNED_SHORT to halve the index bandwidth.
+*/
+void kuhl_geometry_indices(kuhl_geometry *geom, GLuint *indices, GLuint indexCount)
+{
+	if(indexCount == 0 || indices == NULL)
+	{
+		printf("%s: WARNING: indexCount was zero or indices array was NULL\n", __func__);
+		return;
+	}
+	if(kuhl_private_geometry_is_pooled(geom, __func__))
+		return;
+
+	if(geom->primitive_type == GL_TRIANGLES && indexCount % 3 != 0)
+	{
+		printf("%s: ERROR: indexCount=%u was not a multiple of 3 even though this geometry has triangles in it.", __func__, indexCount);
+		exit(EXIT_FAILURE);
+	}
+	else if(geom->primitive_type == GL_LINES && indexCount % 2 != 0)
+	{
+		printf("%s: ERROR: indexCount=%u was not a multiple of 2 even though this geometry has lines in it.", __func__, indexCount);
+		exit(EXIT_FAILURE);
+	}
+	
+	geom->indices_len = indexCount;
+	geom->indices     = indices;
+
+	/* Verify that the indices the user passed in are
+	 * appropriate. If there are only 10 vertices, then a user
+	 * can't draw a vertex at index 10, 11, 13, etc. */
+	GLuint maxIndex = 0;
+	for(GLuint i=0; i<geom->indices_len; i++)
+	{
+		if(geom->indices[i] >= geom->vertex_count)
+			fprintf(stderr, "%s: kuhl_geometry has %d vertices but indices[%d] is asking for vertex at index %d to be drawn.\n", __func__, geom->vertex_count, i, geom->indices[i]);
+		if(geom->indices[i] > maxIndex)
+			maxIndex = geom->indices[i];
+	}
+
+	/* Enable VAO */
+	glBindVertexArray(geom->vao);
+		
+	/* Set up a buffer object (BO) which is a place to store the
+	 * *indices* on the graphics card. */
+	glGenBuffers(1, &(geom->indices_bufferobject));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geom->indices_bufferobject);
+	kuhl_errorcheck();
+
+	/* Copy the indices data into the currently bound buffer. */
+	if(maxIndex <= 0xFFFF)
+	{
+		geom->indices_type = GL_UNSIGNED_SHORT;
+		kuhl_arena *arena = kuhl_arena_frame();
+		size_t mark = kuhl_arena_mark(arena);
+		GLushort *shortIndices = kuhl_arena_alloc(arena, sizeof(GLushort)*geom->indices_len);
+		for(GLuint i=0; i<geom->indices_len; i++)
+			shortIndices[i] = (GLushort) geom->indices[i];
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort)*geom->indices_len,
+		             shortIndices, GL_STATIC_DRAW);
+		kuhl_arena_release(arena, mark);
+	}
+	else
+	{
+		geom->indices_type = GL_UNSIGNED_INT;
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*geom->indices_len,
+		             geom->indices, GL_STATIC_DRAW);
+	}
+	kuhl_errorcheck();
+	// Don't unbind GL_ELEMENT_ARRAY_BUFFER since the VAO keeps track of this for us.
+
+	// unbind vao
+	glBindVertexArray(0);
+}
+
+/** Adds simplified versions of the indices of a geometry (levels of
+ * detail) that kuhl_geometry_draw() uses instead of the indices when
+ * kuhl_geometry_lod_select() decides that the geometry is small on
+ * the screen. All versions are stored in the same index buffer and
+ * use the same vertices. Call kuhl_geometry_indices() first. Geometry
+ * with levels of detail isn't moved into shared buffers by
+ * kuhl_geometry_pool().
+ *
+ * @param geom The geometry.
+ *
+ * @param levels The number of simplified versions (at most KUHL_MAX_LODS).
+ *
+ * @param indices An array of levels index lists, from most to least detailed.
+ *
+ * @param indexCounts The number of indices in each list.
+ */
+void kuhl_geometry_lods(kuhl_geometry *geom, unsigned int levels, GLuint **indices, const GLuint *indexCounts)
+{
+	if(kuhl_private_geometry_is_pooled(geom, __func__))
+		return;
+	if(geom->indices_len == 0 || !glIsBuffer(geom->indices_bufferobject))
+	{
+		msg(ERROR, "%s: Call kuhl_geometry_indices() before adding levels of detail.\n", __func__);
+		return;
+	}
+	if(levels > KUHL_MAX_LODS)
+	{
+		msg(WARNING, "%s: Only using %d of the %u levels of detail.\n", __func__, KUHL_MAX_LODS, levels);
+		levels = KUHL_MAX_LODS;
+	}
+
+	GLuint total = geom->indices_len;
+	for(unsigned int l=0; l<levels; l++)
+	{
+		for(GLuint i=0; i<indexCounts[l]; i++)
+		{
+			if(indices[l][i] >= geom->vertex_count)
+			{
+				msg(ERROR, "%s: kuhl_geometry has %u vertices but level %u refers to vertex %u.\n",
+				    __func__, geom->vertex_count, l+1, indices[l][i]);
+				return;
+			}
+		}
+		geom->lod_first[l] = total;
+		geom->lod_len[l] = indexCounts[l];
+		total += indexCounts[l];
+	}
+
+	/* Make a larger buffer and copy the original indices to the
+	 * start of it. */
+	size_t indexSize = geom->indices_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr) (indexSize*total), NULL, GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_READ_BUFFER, geom->indices_bufferobject);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+	                    (GLsizeiptr) (indexSize*geom->indices_len));
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+	for(unsigned int l=0; l<levels; l++)
+	{
+		GLintptr offset = (GLintptr) (indexSize*geom->lod_first[l]);
+		if(geom->indices_type == GL_UNSIGNED_SHORT)
+		{
+			kuhl_arena *arena = kuhl_arena_frame();
+			size_t mark = kuhl_arena_mark(arena);
+			GLushort *shortIndices = kuhl_arena_alloc(arena, sizeof(GLushort)*indexCounts[l]);
+			for(GLuint i=0; i<indexCounts[l]; i++)
+				shortIndices[i] = (GLushort) indices[l][i];
+			glBufferSubData(GL_COPY_WRITE_BUFFER, offset, sizeof(GLushort)*indexCounts[l], shortIndices);
+			kuhl_arena_release(arena, mark);
+		}
+		else
+			glBufferSubData(GL_COPY_WRITE_BUFFER, offset, sizeof(GLuint)*indexCounts[l], indices[l]);
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	glBindVertexArray(geom->vao);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+	glBindVertexArray(0);
+	glDeleteBuffers(1, &(geom->indices_bufferobject));
+	geom->indices_bufferobject = buffer;
+	geom->lod_count = levels;
+	geom->lod_current = 0;
+	kuhl_errorcheck();
+}
+
+/** Moves the vertex and index data of a geometry object into large
+ * buffers that are shared with other geometry objects. Loading a
+ * scene with many small meshes otherwise creates thousands of small
+ * OpenGL buffers. Geometry with the same attributes at the same
+ * attribute locations also shares a vertex array object, so drawing
+ * it (especially with kuhl_render_queue or kuhl_geometry_draw_list())
+ * requires fewer state changes. The geometry is drawn with
+ * glDrawElementsBaseVertex() and requires OpenGL 3.2 or the
+ * ARB_draw_elements_base_vertex extension.
+ *
+ * After a geometry has been moved, its attributes and indices can no
+ * longer be replaced, but kuhl_geometry_attrib_get() can still be
+ * used to modify the vertices. Geometry with per-instance attributes
+ * (see kuhl_geometry_instance_attrib()) is not moved.
+ *
+ * @param geom The geometry to move into shared buffers.
+ *
+ * @param kg_options Set to KG_FULL_LIST to move all of the geometry
+ * objects in the linked list. If KG_WARN is set, print a warning if
+ * a geometry could not be moved.
+ *
+ * @return The number of geometry objects that were moved.
+ */
+unsigned int kuhl_geometry_pool(kuhl_geometry *geom, int kg_options)
+{
+	unsigned int moved = 0;
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+	{
+		/* KG_DYNAMIC attributes need buffers of their own. */
+		if(g->pool == NULL && g->instance_count == 0 && g->lod_count == 0 && !kuhl_private_geometry_has_stream(g))
+		{
+			if(kuhl_private_geometry_move_pooled(g))
+				moved++;
+			else if(kg_options & KG_WARN)
+				msg(WARNING, "Unable to move geometry with %u vertices into a shared buffer.\n", g->vertex_count);
+		}
+		if(!(kg_options & KG_FULL_LIST))
+			break;
+	}
+	return moved;
+}
+
+
+
+#if 0
+void kuhl_geometry_init(kuhl_geometry *geom)
+{
+
+	/* Calculate the bounding box. */
+	for(int i=0; i<6; i=i+2) // set min values to the largest float
+		geom->aabbox[i] = FLT_MAX;
+	for(int i=1; i<6; i=i+2) // set max values to the smallest float
+		geom->aabbox[i] = -FLT_MAX;
+	for(unsigned int i=0; i<geom->vertex_count; i++)
+	{
+		// Check for new min values
+		if(geom->attrib_pos[i*3+0] < geom->aabbox[0])
+			geom->aabbox[0] = geom->attrib_pos[i*3+0];
+		if(geom->attrib_pos[i*3+1] < geom->aabbox[2])
+			geom->aabbox[2] = geom->attrib_pos[i*3+1];
+		if(geom->attrib_pos[i*3+2] < geom->aabbox[4])
+			geom->aabbox[4] = geom->attrib_pos[i*3+2];
+
+		// Check for new max values
+		if(geom->attrib_pos[i*3+0] > geom->aabbox[1])
+			geom->aabbox[1] = geom->attrib_pos[i*3+0];
+		if(geom->attrib_pos[i*3+1] > geom->aabbox[3])
+			geom->aabbox[3] = geom->attrib_pos[i*3+1];
+		if(geom->attrib_pos[i*3+2] > geom->aabbox[5])
+			geom->aabbox[5] = geom->attrib_pos[i*3+2];
+	}
+
+}
+#endif
+
+#ifdef KUHL_UTIL_USE_ASSIMP
+/** Copies a bone palette into its buffer object if the matrices
+ * changed since the last time they were copied. This happens once per
+ * frame regardless of how many meshes use the palette.
+ *
+ * @param palette The palette to upload.
+ *
+ * @param target The buffer target to use while uploading.
+ *
+ * @param needed The minimum size of the buffer in bytes.
+ */
+static void kuhl_private_bone_palette_upload(kuhl_bonepalette *palette, GLenum target, GLsizeiptr needed)
+{
+	GLsizeiptr size = palette->count * (GLsizeiptr) sizeof(palette->matrices[0]);
+	if(palette->buffer == 0)
+		glGenBuffers(1, &(palette->buffer));
+	if(needed > palette->buffer_size || palette->buffer_size == 0)
+	{
+		palette->buffer_size = needed > size ? needed : size;
+		glBindBuffer(target, palette->buffer);
+		glBufferData(target, palette->buffer_size, NULL, GL_DYNAMIC_DRAW);
+		palette->dirty = 1;
+	}
+	if(palette->dirty)
+	{
+		glBindBuffer(target, palette->buffer);
+		glBufferSubData(target, 0, size, palette->matrices);
+		palette->dirty = 0;
+	}
+}
+
+/** Makes the bone matrices of a geometry available to its program by
+ * binding the geometry's range of the bone palette to
+ * KUHL_BONE_BINDING or, if the program has no bone block, by setting
+ * the BoneMat uniform array.
+ *
+ * @param geom The geometry that is about to be drawn.
+ *
+ * @return The number of bones that the program can use.
+ */
+static int kuhl_private_geometry_bind_bones(kuhl_geometry *geom)
+{
+	kuhl_bonemat *bones = geom->bones;
+	int count = bones->count;
+	GLenum target = geom->bone_block_target;
+	if(target != 0 && bones->palette != NULL)
+	{
+		GLintptr offset = bones->offset * (GLintptr) sizeof(bones->matrices[0]);
+		GLsizeiptr size = count * (GLsizeiptr) sizeof(bones->matrices[0]);
+		if(target == GL_UNIFORM_BUFFER)
+		{
+			/* The range bound to the uniform block must be as large
+			 * as the block even if the mesh has fewer bones. */
+			GLsizeiptr maxBones = geom->bone_block_size / (GLsizeiptr) sizeof(bones->matrices[0]);
+			if(count > maxBones)
+			{
+				if(geom->has_been_drawn == 0)
+					msg(WARNING, "Mesh has %d bones but BoneBlock in program %d only holds %d. Use a BoneBuffer shader storage block instead.\n", count, geom->program, (int) maxBones);
+				count = maxBones;
+			}
+			size = geom->bone_block_size;
+		}
+		kuhl_private_bone_palette_upload(bones->palette, target, offset + size);
+		glBindBufferRange(target, KUHL_BONE_BINDING, bones->palette->buffer, offset, size);
+		return count;
+	}
+
+	GLint loc = geom->uniform_locations[KG_UNIFORM_BONEMAT];
+	if(loc == -1)
+		return 0;
+	if(count > MAX_BONES)
+	{
+		if(geom->has_been_drawn == 0)
+			msg(WARNING, "Mesh has %d bones but BoneMat only holds %d. Use a BoneBuffer shader storage block instead.\n", count, MAX_BONES);
+		count = MAX_BONES;
+	}
+	glUniformMatrix4fv(loc, count, 0, bones->matrices[0]);
+	return count;
+}
+#endif
+
+/** Sets the uniform variables that kuhl_geometry_draw() manages
+ * automatically (HasTex, BoneMat, NumBones and GeomTransform) for a
+ * single kuhl_geometry object. The geometry's program must already be
+ * in use.
+ *
+ * @param geom The geometry that is about to be drawn.
+ *
+ * @param hasTex 1 if a texture named "tex" was bound for this geometry.
+ */
+static void kuhl_private_geometry_set_uniforms(kuhl_geometry *geom, int hasTex)
+{
+	GLint loc;
+	loc = geom->uniform_locations[KG_UNIFORM_HASTEX];
+	if(loc != -1)
+	    glUniform1i(loc, hasTex);
+
+	/* Try to set uniform variables if they are active in the current
+	 * GLSL program. If they are not active, don't print any warning
+	 * messages. */
+	int numBones = 0;
+#ifdef KUHL_UTIL_USE_ASSIMP
+	if(geom->bones)
+		numBones = kuhl_private_geometry_bind_bones(geom);
+#endif
+	loc = geom->uniform_locations[KG_UNIFORM_NUMBONES];
+	if(loc != -1)
+	    glUniform1i(loc, numBones);
+
+	loc = geom->uniform_locations[KG_UNIFORM_GEOMTRANSFORM];
+	if(loc != -1)
+		glUniformMatrix4fv(loc, 1, 0, geom->matrix);
+	else
+	{ /* If the geom->matrix was not the identity and if it is not in
+	   * the GLSL shader program, print a helpful warning message. */
+		float identity[16];
+		mat4f_identity(identity);
+		float sum = 0;
+		for(int i=0; i<16; i++)
+			sum += fabsf(identity[i] - (geom->matrix)[i]);
+		if(sum > 0.00001 && geom->has_been_drawn == 0)
+		{
+			printf("\n\n");
+			printf("ERROR: You must include a 'uniform mat4 GeomTransform' variable in your GLSL shader (program %d) when you load/display a model with kuhl-util. This matrix should be applied to the vertices in your model before you multiply by your modelview matrix in the vertex program. For example:\n\ngl_Position = Projection * ModelView * GeomTransform * in_Position\n\n", geom->program);
+			printf("This matrix is required to correctly translate/rotate/scale your geometry and is also used by some models to implement animation. This matrix is stored inside of a variable called 'matrix' in kuhl_geometry and is set to the identity matrix by default. This message only gets printed if you are using something that actually sets the matrix to something other than the identity. Earlier versions of this software simply transformed the vertices as the file was being loaded instead of doing it in the vertex program.\n");
+			printf("\n");
+			printf("We would set the GeomTransform to:\n");
+			mat4f_print(geom->matrix);
+			printf("This program will resume running in 2 seconds...\n");
+			sleep(2);
+			printf("...continuing despite the missing variable.\n");
+		}
+	}
+}
+
+/** Issues the glDrawElements() or glDrawArrays() call for a single
+ * kuhl_geometry object. The geometry's program and vertex array
+ * object must already be bound.
+ *
+ * @param geom The geometry to draw.
+ *
+ * @param validate If nonzero, verify that the index buffer is a valid
+ * OpenGL buffer before using it.
+ */
+static void kuhl_private_geometry_submit(kuhl_geometry *geom, int validate)
+{
+	/* In single-pass stereo, every geometry is drawn once per view
+	 * with instancing. Per-instance attributes need to advance once
+	 * for every group of views instead of once per instance. */
+	GLuint views = kuhl_private_view_count;
+	GLuint instances = geom->instance_count;
+	if(views > 1)
+	{
+		if(instances > 0)
+			kuhl_private_geometry_divisors(geom, views);
+		instances = (instances > 0 ? instances : 1) * views;
+	}
+
+	/* If the user provided us with indices, use glDrawElements() to
+	 * draw the geometry. */
+	if(geom->indices_len > 0 &&
+	   (validate == 0 || glIsBuffer(geom->indices_bufferobject)))
+	{
+		/* Geometry in a shared buffer (see kuhl_geometry_pool())
+		 * starts at first_index in the index buffer and its indices
+		 * are relative to base_vertex. */
+		GLenum type = geom->indices_type;
+		size_t indexSize = type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+		GLuint first = geom->first_index;
+		GLsizei count = (GLsizei) geom->indices_len;
+		/* Draw the simplified version chosen by kuhl_geometry_lod_select(). */
+		if(geom->lod_current > 0 && geom->lod_current <= geom->lod_count)
+		{
+			first += geom->lod_first[geom->lod_current-1];
+			count = (GLsizei) geom->lod_len[geom->lod_current-1];
+		}
+		const void *firstIndex = (const void*) (first*indexSize);
+		if(geom->base_vertex != 0)
+		{
+			if(instances > 0)
+				glDrawElementsInstancedBaseVertex(geom->primitive_type,
+				                                  count,
+				                                  type, firstIndex,
+				                                  instances,
+				                                  geom->base_vertex);
+			else
+				glDrawElementsBaseVertex(geom->primitive_type,
+				                         count,
+				                         type, firstIndex,
+				                         geom->base_vertex);
+		}
+		else if(instances > 0)
+			glDrawElementsInstanced(geom->primitive_type,
+			                        count,
+			                        type,
+			                        firstIndex, instances);
+		else
+			glDrawElements(geom->primitive_type,
+			               count,
+			               type,
+			               firstIndex);
+		kuhl_errorcheck();
+	}
+	else
+	{
+		/* If the user didn't provide us with indices, just draw the
+		 * vertices in order. */
+		if(instances > 0)
+			glDrawArraysInstanced(geom->primitive_type, geom->base_vertex,
+			                      geom->vertex_count, instances);
+		else
+			glDrawArrays(geom->primitive_type, geom->base_vertex,
+			             geom->vertex_count);
+		kuhl_errorcheck();
+	}
+
+	if(views > 1 && geom->instance_count > 0)
+		kuhl_private_geometry_divisors(geom, 1);
+}
+
+/** Draws a kuhl_geometry struct to the screen. The struct passed into
+ * this function should have been set up with kuhl_geometry_new() and
+ * at least one position attribute with kuhl_geometry_attrib() before
+ * calling this function.
+
+ @param geom The geometry to draw to the screen. If the kuhl_geometry
+ object is a part of a linked list, this function will draw each of
+ the objects in order. */
+void kuhl_geometry_draw(kuhl_geometry *geom)
+{
+	if(geom == NULL)
+		return;
+	TRACE_SCOPE("kuhl_geometry_draw");
+	
+	kuhl_errorcheck();
+	
+	/* Record the OpenGL state so that we can restore it when we have
+	 * finished drawing. */
+	GLint previouslyUsedProgram = 0;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &previouslyUsedProgram);
+	GLint previouslyBoundTexture = 0;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previouslyBoundTexture);
+	GLint previouslyActiveTexture = 0;
+	glGetIntegerv(GL_ACTIVE_TEXTURE, &previouslyActiveTexture);
+	GLint previousVAO=0;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVAO);
+
+	/* Check that there is a valid program and VAO object for us to use. */
+	if(glIsProgram(geom->program) == 0 || glIsVertexArray(geom->vao) == 0)
+	{
+		fprintf(stderr, "%s: Program (%d) or vertex array object (%d) were invalid\n",
+		        __func__, geom->program, geom->vao);
+		kuhl_errorcheck();
+		return;
+	}
+
+	glUseProgram(geom->program);
+	kuhl_errorcheck();
+
+	/* The uniform locations are normally looked up when the program
+	 * is set. Refresh them if the program was changed directly or if
+	 * it has been relinked since then. */
+	if(geom->uniform_program != geom->program ||
+	   geom->uniform_generation != uniformCacheGeneration)
+		kuhl_private_geometry_uniforms(geom);
+
+	/* Bind all of the textures used in this geometry to texture
+	 * units. */
+	int hasTex = 0;
+	for(unsigned int i=0; i<geom->texture_count; i++)
+	{
+		kuhl_texture *tex = &(geom->textures[i]);
+		if(!glIsTexture(tex->textureId))
+			continue;
+
+		/* Check if the sampler variable is available in the GLSL
+		 * program. If not, don't send the texture. */
+		GLint loc = tex->location;
+		if(loc == -1)
+			continue;
+
+		if(strcmp(tex->name, "tex") == 0)
+			hasTex = 1;
+		
+		/* Tell OpenGL that the texture that we refer to in our
+		 * GLSL program is going to be in texture unit number 'i'.
+		 */
+		glUniform1i(loc, i);
+		kuhl_errorcheck();
+		/* Turn on appropriate texture unit */
+		glActiveTexture(GL_TEXTURE0+i);
+		kuhl_errorcheck();
+		/* Bind the texture that we want to use while the correct
+		 * texture unit is enabled. */
+		glBindTexture(GL_TEXTURE_2D, tex->textureId);
+		kuhl_errorcheck();
+	}
+
+	kuhl_private_geometry_set_uniforms(geom, hasTex);
+
+	/* Use the vertex array object for this geometry */
+	glBindVertexArray(geom->vao);
+	kuhl_errorcheck();
+
+	/* kuhl_geometry_attrib_get() allows vertex attribute buffers to
+	 * be mapped (or KG_DYNAMIC attributes to be changed). Make the
+	 * changes visible to OpenGL before we draw the geometry. */
+	kuhl_geometry_unmap(geom);
+	kuhl_private_geometry_stream(geom);
+
+	kuhl_private_geometry_submit(geom, 1);
+	kuhl_private_geometry_stream_fence(geom);
+
+	/* For each texture unit that we bound a texture to, unbind the
+	 * texture since we have finished drawing the geometry */
+	for(unsigned int i=0; i<geom->texture_count; i++)
+	{
+		kuhl_errorcheck();
+		/* Turn on appropriate texture unit */
+		glActiveTexture(GL_TEXTURE0+i);
+		kuhl_errorcheck();
+		/* Unbind the texture */
+		glBindTexture(GL_TEXTURE_2D, 0);
+		kuhl_errorcheck();
+	}
+
+	
+	/* Indicate in the struct that we have successfully drawn this
+	 * geom once. */
+	geom->has_been_drawn = 1;
+
+	/* Restore previously active texture */
+	glActiveTexture(previouslyActiveTexture);
+	
+	/* Unbind texture */
+	glBindTexture(GL_TEXTURE_2D, previouslyBoundTexture);
+
+	/* Restore the GLSL program that was used before this function was
+	 * called. */
+	glUseProgram(previouslyUsedProgram);
+	
+	/* Unbind the VAO */
+	glBindVertexArray(previousVAO);
+	kuhl_errorcheck();
+
+	/* Draw the next nodes in the list. */
+	kuhl_geometry_draw(geom->next);
+}
+
+
+/** A shadow copy of the OpenGL state that the fast drawing path
+ * (kuhl_geometry_draw_list()) has bound. Keeping track of the state
+ * ourselves lets us skip redundant binds without calling glGet*(). */
+typedef struct
+{
+	GLuint program; /**< Program in use */
+	GLuint vao; /**< Bound vertex array object */
+	GLuint activeUnit; /**< Active texture unit (0 means GL_TEXTURE0) */
+	GLuint textures[MAX_TEXTURES]; /**< Texture bound to GL_TEXTURE_2D on each unit */
+} kuhl_draw_state;
+
+/** Initializes a kuhl_draw_state. Since we don't query OpenGL, the
+ * state is marked as unknown so that the first geometry binds
+ * everything that it needs.
+ *
+ * @param state The state to initialize.
+ */
+static void kuhl_private_draw_state_begin(kuhl_draw_state *state)
+{
+	state->program = (GLuint) -1;
+	state->vao = (GLuint) -1;
+	state->activeUnit = (GLuint) -1;
+	for(int i=0; i<MAX_TEXTURES; i++)
+		state->textures[i] = (GLuint) -1;
+}
+
+/** Returns OpenGL to a predictable state after drawing with the fast
+ * path: no program, no vertex array object, no textures on the units
+ * that were used and GL_TEXTURE0 active.
+ *
+ * @param state The state that was used while drawing.
+ */
+static void kuhl_private_draw_state_end(kuhl_draw_state *state)
+{
+	for(GLuint i=0; i<MAX_TEXTURES; i++)
+	{
+		if(state->textures[i] == 0 || state->textures[i] == (GLuint) -1)
+			continue;
+		glActiveTexture(GL_TEXTURE0+i);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+	glActiveTexture(GL_TEXTURE0);
+	glUseProgram(0);
+	glBindVertexArray(0);
+	kuhl_errorcheck();
+}
+
+/** Draws a single kuhl_geometry object (not the rest of the list)
+ * while only issuing the OpenGL calls that change state relative to
+ * the previous geometry. Validation queries (glIsProgram(),
+ * glIsTexture(), etc) are only performed until the geometry has been
+ * drawn successfully once.
+ *
+ * @param geom The geometry to draw.
+ *
+ * @param state The shadow copy of the OpenGL state.
+ */
+static void kuhl_private_geometry_draw_fast(kuhl_geometry *geom, kuhl_draw_state *state)
+{
+	int validate = !geom->has_been_drawn;
+	if(validate &&
+	   (glIsProgram(geom->program) == 0 || glIsVertexArray(geom->vao) == 0))
+	{
+		msg(ERROR, "Program (%d) or vertex array object (%d) were invalid\n",
+		    geom->program, geom->vao);
+		return;
+	}
+
+	if(state->program != geom->program)
+	{
+		glUseProgram(geom->program);
+		state->program = geom->program;
+	}
+
+	if(geom->uniform_program != geom->program ||
+	   geom->uniform_generation != uniformCacheGeneration)
+		kuhl_private_geometry_uniforms(geom);
+
+	int hasTex = 0;
+	for(unsigned int i=0; i<geom->texture_count; i++)
+	{
+		kuhl_texture *tex = &(geom->textures[i]);
+		if(tex->location == -1)
+			continue;
+		if(validate && !glIsTexture(tex->textureId))
+			continue;
+		if(strcmp(tex->name, "tex") == 0)
+			hasTex = 1;
+
+		/* The sampler uniform is part of the program state which
+		 * may be shared with geometry that uses a different unit
+		 * for this sampler, so we always set it. */
+		glUniform1i(tex->location, i);
+		if(state->textures[i] != tex->textureId)
+		{
+			if(state->activeUnit != i)
+			{
+				glActiveTexture(GL_TEXTURE0+i);
+				state->activeUnit = i;
+			}
+			glBindTexture(GL_TEXTURE_2D, tex->textureId);
+			state->textures[i] = tex->textureId;
+		}
+	}
+
+	kuhl_private_geometry_set_uniforms(geom, hasTex);
+
+	if(state->vao != geom->vao)
+	{
+		glBindVertexArray(geom->vao);
+		state->vao = geom->vao;
+	}
+
+	kuhl_geometry_unmap(geom);
+	kuhl_private_geometry_stream(geom);
+
+	kuhl_private_geometry_submit(geom, validate);
+	kuhl_private_geometry_stream_fence(geom);
+	geom->has_been_drawn = 1;
+}
+
+/** Draws a kuhl_geometry linked list using a faster path than
+ * kuhl_geometry_draw(). This function does not query the OpenGL state
+ * with glGet*() and does not restore it afterwards. Instead, it keeps
+ * track of what it has bound and only changes the program, vertex
+ * array object and textures when they differ from the previous
+ * geometry in the list. Once a geometry has been drawn successfully,
+ * the validation checks that kuhl_geometry_draw() performs are
+ * skipped for it.
+ *
+ * When this function returns, no program or vertex array object is
+ * bound, the texture units that were used are unbound and GL_TEXTURE0
+ * is active.
+ *
+ * @param geom The geometry list to draw. Unlike kuhl_geometry_draw(),
+ * the list is walked iteratively.
+ */
+void kuhl_geometry_draw_list(kuhl_geometry *geom)
+{
+	if(geom == NULL)
+		return;
+	kuhl_errorcheck();
+
+	kuhl_draw_state state;
+	kuhl_private_draw_state_begin(&state);
+	for(; geom != NULL; geom = geom->next)
+		kuhl_private_geometry_draw_fast(geom, &state);
+	kuhl_private_draw_state_end(&state);
+}
+
+/** Number of geometry objects drawn and culled by
+ * kuhl_geometry_draw_culled() and kuhl_render_queue_add_visible()
+ * since kuhl_cull_stats() was last called. */
+static unsigned int kuhl_cull_drawn = 0, kuhl_cull_culled = 0;
+
+/** Retrieves the number of geometry objects that were drawn and
+ * culled by kuhl_geometry_draw_culled() and
+ * kuhl_render_queue_add_visible() since the last time this function
+ * was called. Call this once per frame to get per-frame
+ * counts.
+ *
+ * @param drawn Filled in with the number of visible geometry objects
+ * (may be NULL).
+ *
+ * @param culled Filled in with the number of geometry objects that
+ * were skipped because they were outside of the frustum (may be
+ * NULL).
+ */
+void kuhl_cull_stats(unsigned int *drawn, unsigned int *culled)
+{
+	if(drawn)
+		*drawn = kuhl_cull_drawn;
+	if(culled)
+		*culled = kuhl_cull_culled;
+	kuhl_cull_drawn = 0;
+	kuhl_cull_culled = 0;
+}
+
+/** Draws the geometry in a kuhl_geometry linked list that is at least
+ * partially inside of a view frustum (see kuhl_geometry_visible())
+ * and skips the rest. Drawing is done the same way as
+ * kuhl_geometry_draw_list(), so the OpenGL state is left as described
+ * there. Since the frustum depends on the viewport, call
+ * kuhl_frustum_extract() once for each viewport with the matrices
+ * that you use in that viewport.
+ *
+ * @param geom The geometry list to draw.
+ *
+ * @param frustum The frustum to cull against. If NULL, all geometry
+ * is drawn.
+ */
+void kuhl_geometry_draw_culled(kuhl_geometry *geom, const kuhl_frustum *frustum)
+{
+	if(geom == NULL)
+		return;
+	kuhl_errorcheck();
+
+	kuhl_draw_state state;
+	kuhl_private_draw_state_begin(&state);
+	for(; geom != NULL; geom = geom->next)
+	{
+		if(!kuhl_geometry_visible(geom, frustum))
+		{
+			kuhl_cull_culled++;
+			continue;
+		}
+		kuhl_cull_drawn++;
+		kuhl_private_geometry_draw_fast(geom, &state);
+	}
+	kuhl_private_draw_state_end(&state);
+}
+
+/** Orders kuhl_render_record structs by program, then by the set of
+ * textures, then by vertex array object. Records that are otherwise
+ * equal keep the order that they were added in. */
+static int kuhl_private_render_record_compar(const void *a, const void *b)
+{
+	const kuhl_render_record *ra = (const kuhl_render_record*) a;
+	const kuhl_render_record *rb = (const kuhl_render_record*) b;
+	if(ra->program != rb->program)
+		return ra->program < rb->program ? -1 : 1;
+
+	const kuhl_geometry *ga = ra->geom;
+	const kuhl_geometry *gb = rb->geom;
+	for(unsigned int i=0; i<ga->texture_count && i<gb->texture_count; i++)
+	{
+		GLuint ta = ga->textures[i].textureId;
+		GLuint tb = gb->textures[i].textureId;
+		if(ta != tb)
+			return ta < tb ? -1 : 1;
+	}
+	if(ga->texture_count != gb->texture_count)
+		return ga->texture_count < gb->texture_count ? -1 : 1;
+
+	if(ra->vao != rb->vao)
+		return ra->vao < rb->vao ? -1 : 1;
+	if(ra->order != rb->order)
+		return ra->order < rb->order ? -1 : 1;
+	return 0;
+}
+
+/** Initializes a render queue. A render queue stores a flat array of
+ * kuhl_geometry objects which are sorted to minimize the number of
+ * state changes and drawn without recursion by
+ * kuhl_render_queue_draw(). Typically, you would add your geometry
+ * to the queue once and then draw the queue every frame.
+ *
+ * @param queue The queue to initialize.
+ */
+void kuhl_render_queue_init(kuhl_render_queue *queue)
+{
+	kuhl_render_record_list_init(&(queue->records));
+	kuhl_render_record_list_reserve(&(queue->records), 64);
+	queue->sorted = 1;
+}
+
+/** Adds a single kuhl_geometry object (but not the rest of the list)
+ * to a render queue. */
+static void kuhl_private_render_queue_add_one(kuhl_render_queue *queue, kuhl_geometry *geom)
+{
+	kuhl_render_record *record = kuhl_render_record_list_push(&(queue->records));
+	record->program = geom->program;
+	record->vao = geom->vao;
+	record->order = (unsigned int) queue->records.length - 1;
+	record->geom = geom;
+	queue->sorted = 0;
+}
+
+/** Adds every kuhl_geometry object in a linked list to a render
+ * queue. The geometry is not copied, so it must not be deleted while
+ * it is in the queue.
+ *
+ * @param queue The queue to add the geometry to.
+ *
+ * @param geom A kuhl_geometry list to add.
+ *
+ * @return The number of kuhl_geometry objects that were added.
+ */
+int kuhl_render_queue_add(kuhl_render_queue *queue, kuhl_geometry *geom)
+{
+	if(queue == NULL)
+		return 0;
+	int count = 0;
+	for(; geom != NULL; geom = geom->next)
+	{
+		kuhl_private_render_queue_add_one(queue, geom);
+		count++;
+	}
+	return count;
+}
+
+/** Adds the geometry in a kuhl_geometry linked list that is at least
+ * partially inside of a frustum to a render queue (see
+ * kuhl_geometry_visible()). The number of geometry objects that were
+ * added and skipped is included in kuhl_cull_stats(). Clearing the
+ * queue and calling this function once per frame with a frustum
+ * that covers all viewports (see kuhl_frustum_union()) lets each
+ * viewport draw the queue without culling the scene again.
+ *
+ * @param queue The queue to add the geometry to.
+ *
+ * @param geom A kuhl_geometry list.
+ *
+ * @param frustum The frustum to cull against. If NULL, all geometry
+ * is added.
+ *
+ * @return The number of kuhl_geometry objects that were added.
+ */
+int kuhl_render_queue_add_visible(kuhl_render_queue *queue, kuhl_geometry *geom, const kuhl_frustum *frustum)
+{
+	if(queue == NULL)
+		return 0;
+	int count = 0;
+	for(; geom != NULL; geom = geom->next)
+	{
+		if(!kuhl_geometry_visible(geom, frustum))
+		{
+			kuhl_cull_culled++;
+			continue;
+		}
+		kuhl_private_render_queue_add_one(queue, geom);
+		kuhl_cull_drawn++;
+		count++;
+	}
+	return count;
+}
+
+/** Removes all geometry from a render queue without freeing the
+ * queue.
+ *
+ * @param queue The queue to empty.
+ */
+void kuhl_render_queue_clear(kuhl_render_queue *queue)
+{
+	if(queue == NULL)
+		return;
+	kuhl_render_record_list_clear(&(queue->records));
+	queue->sorted = 1;
+}
+
+/** Sorts a render queue by program, texture set and vertex array
+ * object. kuhl_render_queue_draw() calls this automatically when new
+ * geometry has been added. Call it yourself if you have changed the
+ * program or textures of geometry that is already in the queue.
+ *
+ * @param queue The queue to sort.
+ */
+void kuhl_render_queue_sort(kuhl_render_queue *queue)
+{
+	if(queue == NULL)
+		return;
+	int len = queue->records.length;
+	kuhl_render_record *records = queue->records.data;
+	for(int i=0; i<len; i++)
+	{
+		records[i].program = records[i].geom->program;
+		records[i].vao = records[i].geom->vao;
+	}
+	kuhl_render_record_list_sort(&(queue->records), kuhl_private_render_record_compar);
+	/* Make the current order the tie-breaker for the next sort. */
+	for(int i=0; i<len; i++)
+		records[i].order = (unsigned int) i;
+	queue->sorted = 1;
+}
+
+/** Draws all of the geometry in a render queue. The geometry is drawn
+ * iteratively in sorted order using the same state tracking that
+ * kuhl_geometry_draw_list() uses, so only the binds that change
+ * between consecutive records are issued. The OpenGL state is left
+ * as described in kuhl_geometry_draw_list().
+ *
+ * @param queue The queue to draw.
+ */
+void kuhl_render_queue_draw(kuhl_render_queue *queue)
+{
+	if(queue == NULL)
+		return;
+	if(!queue->sorted)
+		kuhl_render_queue_sort(queue);
+	kuhl_errorcheck();
+
+	kuhl_draw_state state;
+	kuhl_private_draw_state_begin(&state);
+	int len = queue->records.length;
+	kuhl_render_record *records = queue->records.data;
+	for(int i=0; i<len; i++)
+		kuhl_private_geometry_draw_fast(records[i].geom, &state);
+	kuhl_private_draw_state_end(&state);
+}
+
+/** Frees the memory used by a render queue. The geometry in the queue
+ * is not deleted.
+ *
+ * @param queue The queue to free.
+ */
+void kuhl_render_queue_free(kuhl_render_queue *queue)
+{
+	if(queue == NULL)
+		return;
+	kuhl_render_record_list_free(&(queue->records));
+}
+
+#define KUHL_OCCLUDER_COUNT 8 /**< Number of geometry objects that are largest on the screen that kuhl_render_queue_draw_occluded() draws first without testing them */
+#define KUHL_OCCLUSION_INTERVAL 4 /**< Visible geometry is tested again every this many frames */
+#define KUHL_OCCLUSION_EVICT_FRAMES 120 /**< Queries of geometry that hasn't been drawn for this many frames may be deleted */
+
+static GLuint kuhl_occlusion_program = 0; /**< Program that draws bounding boxes into the depth buffer */
+static GLuint kuhl_occlusion_vao = 0; /**< Vertex array object of a unit cube */
+static GLint kuhl_occlusion_modelview = -1, kuhl_occlusion_projection = -1;
+
+/** Creates the program and unit cube that bounding boxes are drawn
+ * with, if they haven't been created yet.
+ *
+ * @return 1 if boxes can be drawn, 0 otherwise.
+ */
+static int kuhl_private_occlusion_setup(void)
+{
+	static int failed = 0;
+	if(kuhl_occlusion_program != 0)
+		return 1;
+	if(failed)
+		return 0;
+
+	GLuint program = kuhl_create_program("occlude.vert", "occlude.frag");
+	if(program == 0)
+	{
+		msg(ERROR, "Failed to create the occlusion query program, occlusion culling is disabled.\n");
+		failed = 1;
+		return 0;
+	}
+	kuhl_occlusion_modelview = glGetUniformLocation(program, "ModelView");
+	kuhl_occlusion_projection = glGetUniformLocation(program, "Projection");
+	GLint location = glGetAttribLocation(program, "in_Position");
+
+	/* A cube from (0,0,0) to (1,1,1) with counterclockwise faces
+	 * when viewed from the outside. */
+	static const GLfloat corners[] = { 0,0,0, 1,0,0, 0,1,0, 1,1,0,
+	                                   0,0,1, 1,0,1, 0,1,1, 1,1,1 };
+	static const GLubyte faces[] = { 0,2,1, 1,2,3,   4,5,6, 5,7,6,
+	                                 0,1,4, 1,5,4,   2,6,3, 3,6,7,
+	                                 0,4,2, 2,4,6,   1,3,5, 3,7,5 };
+	GLuint buffers[2];
+	glGenVertexArrays(1, &kuhl_occlusion_vao);
+	glBindVertexArray(kuhl_occlusion_vao);
+	glGenBuffers(2, buffers);
+	glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+	glEnableVertexAttribArray(location);
+	glVertexAttribPointer(location, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[1]);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(faces), faces, GL_STATIC_DRAW);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_errorcheck();
 
-	/* Try to set uniform variables if they are active in the current
-	 * GLSL program. If they are not active, don't print any warning
-	 * messages. */
-	int numBones = 0;
-#ifdef KUHL_UTIL_USE_ASSIMP
-	loc = glGetUniformLocation(geom->program, "BoneMat");
-	if(loc != -1 && geom->bones)
+	kuhl_occlusion_program = program;
+	return 1;
+}
+
+/** Initializes a kuhl_occlusion. See
+ * kuhl_render_queue_draw_occluded().
+ *
+ * @param occ The kuhl_occlusion to initialize.
+ */
+void kuhl_occlusion_init(kuhl_occlusion *occ)
+{
+	memset(occ, 0, sizeof(kuhl_occlusion));
+}
+
+/** Deletes the query objects in a kuhl_occlusion and frees its
+ * memory. The kuhl_occlusion can be used again after it is
+ * initialized with kuhl_occlusion_init().
+ *
+ * @param occ The kuhl_occlusion to free.
+ */
+void kuhl_occlusion_free(kuhl_occlusion *occ)
+{
+	if(occ == NULL)
+		return;
+	for(unsigned int i=0; i<occ->capacity; i++)
 	{
-		glUniformMatrix4fv(loc, MAX_BONES, 0, geom->bones->matrices[0]);
-		numBones = geom->bones->count;
+		if(occ->entries[i].geom != NULL)
+			glDeleteQueries(1, &(occ->entries[i].query));
 	}
-#endif
-	loc = glGetUniformLocation(geom->program, "NumBones");
-	if(loc != -1)
-	    glUniform1i(loc, numBones);
+	free(occ->entries);
+	memset(occ, 0, sizeof(kuhl_occlusion));
+}
 
-	loc = glGetUniformLocation(geom->program, "GeomTransform");
-	if(loc != -1)
-		glUniformMatrix4fv(loc, 1, 0, geom->matrix);
-	else
-	{ /* If the geom->matrix was not the identity and if it is not in
-	   * the GLSL shader program, print a helpful warning message. */
-		float identity[16];
-		mat4f_identity(identity);
-		float sum = 0;
-		for(int i=0; i<16; i++)
-			sum += fabsf(identity[i] - (geom->matrix)[i]);
-		if(sum > 0.00001 && geom->has_been_drawn == 0)
+/** Retrieves the number of geometry objects that
+ * kuhl_render_queue_draw_occluded() drew and skipped with a
+ * kuhl_occlusion since the last time this function was called for
+ * it.
+ *
+ * @param occ The kuhl_occlusion.
+ *
+ * @param drawn Filled in with the number of geometry objects that
+ * were drawn (may be NULL).
+ *
+ * @param conditional Filled in with the number of geometry objects
+ * that were drawn with conditional rendering, which the GPU skips if
+ * their bounding box was hidden (may be NULL).
+ *
+ * @param skipped Filled in with the number of geometry objects that
+ * were not drawn because they were hidden in a previous frame (may be
+ * NULL).
+ */
+void kuhl_occlusion_stats(kuhl_occlusion *occ, unsigned int *drawn, unsigned int *conditional, unsigned int *skipped)
+{
+	if(drawn)
+		*drawn = occ->drawn;
+	if(conditional)
+		*conditional = occ->conditional;
+	if(skipped)
+		*skipped = occ->skipped;
+	occ->drawn = 0;
+	occ->conditional = 0;
+	occ->skipped = 0;
+}
+
+/** Returns the slot in a kuhl_occlusion hash table where a geometry
+ * is or should be stored. */
+static unsigned int kuhl_private_occlusion_slot(const kuhl_occlusion_entry *entries, unsigned int capacity,
+                                                const kuhl_geometry *geom)
+{
+	unsigned int slot = (unsigned int) (((uintptr_t) geom >> 4) * 2654435761u) & (capacity-1);
+	while(entries[slot].geom != NULL && entries[slot].geom != geom)
+		slot = (slot+1) & (capacity-1);
+	return slot;
+}
+
+/** Finds the query of a geometry in a kuhl_occlusion, creating it if
+ * the geometry hasn't been drawn with the kuhl_occlusion before. New
+ * geometry is assumed to be visible. When the table is full, entries
+ * of geometry that hasn't been drawn for KUHL_OCCLUSION_EVICT_FRAMES
+ * frames (e.g., geometry that was deleted) are removed before the
+ * table is made larger. */
+static kuhl_occlusion_entry* kuhl_private_occlusion_entry(kuhl_occlusion *occ, const kuhl_geometry *geom)
+{
+	/* Keep the table at most half full. */
+	if((occ->count+1)*2 > occ->capacity)
+	{
+		unsigned int live = 0;
+		for(unsigned int i=0; i<occ->capacity; i++)
 		{
-			printf("\n\n");
-			printf("ERROR: You must include a 'uniform mat4 GeomTransform' variable in your GLSL shader (program %d) when you load/display a model with kuhl-util. This matrix should be applied to the vertices in your model before you multiply by your modelview matrix in the vertex program. For example:\n\ngl_Position = Projection * ModelView * GeomTransform * in_Position\n\n", geom->program);
-			printf("This matrix is required to correctly translate/rotate/scale your geometry and is also used by some models to implement animation. This matrix is stored inside of a variable called 'matrix' in kuhl_geometry and is set to the identity matrix by default. This message only gets printed if you are using something that actually sets the matrix to something other than the identity. Earlier versions of this software simply transformed the vertices as the file was being loaded instead of doing it in the vertex program.\n");
-			printf("\n");
-			printf("We would set the GeomTransform to:\n");
-			mat4f_print(geom->matrix);
-			printf("This program will resume running in 2 seconds...\n");
-			sleep(2);
-			printf("...continuing despite the missing variable.\n");
+			kuhl_occlusion_entry *e = &(occ->entries[i]);
+			if(e->geom == NULL)
+				continue;
+			if(occ->frame - e->frame > KUHL_OCCLUSION_EVICT_FRAMES)
+			{
+				glDeleteQueries(1, &(e->query));
+				e->geom = NULL;
+			}
+			else
+				live++;
+		}
+		unsigned int capacity = 64;
+		while((live+1)*2 > capacity)
+			capacity *= 2;
+		kuhl_occlusion_entry *entries = kuhl_malloc(sizeof(kuhl_occlusion_entry)*capacity);
+		memset(entries, 0, sizeof(kuhl_occlusion_entry)*capacity);
+		for(unsigned int i=0; i<occ->capacity; i++)
+		{
+			const kuhl_occlusion_entry *e = &(occ->entries[i]);
+			if(e->geom != NULL)
+				entries[kuhl_private_occlusion_slot(entries, capacity, e->geom)] = *e;
 		}
+		free(occ->entries);
+		occ->entries = entries;
+		occ->capacity = capacity;
+		occ->count = live;
 	}
 
-	/* Use the vertex array object for this geometry */
-	glBindVertexArray(geom->vao);
+	unsigned int slot = kuhl_private_occlusion_slot(occ->entries, occ->capacity, geom);
+	kuhl_occlusion_entry *e = &(occ->entries[slot]);
+	if(e->geom == NULL)
+	{
+		e->geom = geom;
+		glGenQueries(1, &(e->query));
+		occ->count++;
+	}
+	else if(e->id == geom->occlusion_id)
+	{
+		e->frame = occ->frame;
+		return e;
+	}
+	/* A new geometry or a new geometry at the address of one that
+	 * was deleted. */
+	e->id = geom->occlusion_id;
+	e->frame = occ->frame;
+	e->pending = 0;
+	e->visible = 1;
+	return e;
+}
+
+/** Checks if a geometry can be occlusion tested by drawing its
+ * bounding box. Boxes that reach the near clipping plane are partly
+ * clipped away and may be hidden even though the geometry is
+ * visible. Geometry whose vertices are moved by bones or that is
+ * instanced may be outside of its box.
+ *
+ * @return 1 if the geometry can be tested, 0 if it should always be
+ * drawn.
+ */
+static int kuhl_private_occlusion_testable(const kuhl_geometry *geom, const float modelview[16],
+                                           const float projection[16])
+{
+	const float *b = geom->aabbox;
+	if(b[0] > b[1] || b[2] > b[3] || b[4] > b[5] || geom->instance_count > 0)
+		return 0;
+#ifdef KUHL_UTIL_USE_ASSIMP
+	if(geom->bones != NULL)
+		return 0;
+#endif
+	/* Orthographic projections don't clip boxes near the camera. */
+	if(projection[11] == 0)
+		return 1;
+	float box[6], m[16];
+	for(int i=0; i<6; i++)
+		box[i] = b[i];
+	mat4f_mult_mat4f_new(m, modelview, geom->matrix);
+	kuhl_bbox_transform(box, m);
+	float near = projection[14] / (projection[10] - 1);
+	return box[5] < -near*1.01f;
+}
+
+/** Draws the bounding box of a geometry into the depth buffer
+ * without changing it while a query counts whether any of it passes
+ * the depth test. */
+static void kuhl_private_occlusion_query_box(kuhl_occlusion_entry *e, GLenum target,
+                                             const float modelview[16], kuhl_draw_state *state)
+{
+	const kuhl_geometry *geom = e->geom;
+	const float *b = geom->aabbox;
+	float box[16], scale[16], translate[16], geomModelview[16], m[16];
+	mat4f_scale_new(scale, b[1]-b[0], b[3]-b[2], b[5]-b[4]);
+	mat4f_translate_new(translate, b[0], b[2], b[4]);
+	mat4f_mult_mat4f_new(box, translate, scale);
+	mat4f_mult_mat4f_new(geomModelview, modelview, geom->matrix);
+	mat4f_mult_mat4f_new(m, geomModelview, box);
+
+	if(state->program != kuhl_occlusion_program)
+	{
+		glUseProgram(kuhl_occlusion_program);
+		state->program = kuhl_occlusion_program;
+	}
+	if(state->vao != kuhl_occlusion_vao)
+	{
+		glBindVertexArray(kuhl_occlusion_vao);
+		state->vao = kuhl_occlusion_vao;
+	}
+	glUniformMatrix4fv(kuhl_occlusion_modelview, 1, 0, m);
+
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDepthMask(GL_FALSE);
+	glBeginQuery(target, e->query);
+	glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_BYTE, 0);
+	glEndQuery(target);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glDepthMask(GL_TRUE);
+	e->pending = 1;
+}
+
+/** Draws a render queue while skipping geometry that is hidden
+ * behind other geometry. The KUHL_OCCLUDER_COUNT geometry objects
+ * that are largest on the screen are drawn first since they are the
+ * most likely to hide the rest. Then, the rest of the queue is drawn
+ * in sorted order using occlusion queries:
+ *
+ * - Geometry that was visible is drawn. Every
+ *   KUHL_OCCLUSION_INTERVAL frames, a query counts whether any of it
+ *   passed the depth test.
+ *
+ * - Geometry that was hidden has its bounding box tested with a
+ *   query. If conditional rendering is supported (OpenGL 3.0), the
+ *   geometry is drawn with glBeginConditionalRender() so that the GPU
+ *   skips it if the box is hidden. Otherwise, it is skipped until the
+ *   result says that it is visible again.
+ *
+ * The results of queries are only read once they are available
+ * (typically in the next frame) so that we don't wait for the
+ * GPU. Geometry that is animated with bones, instanced, or whose
+ * bounding box reaches the near clipping plane is always drawn.
+ *
+ * The depth buffer must be cleared before this is called, depth
+ * testing must be enabled, and the color and depth masks are all
+ * left enabled afterwards. Since the queries depend on the view, use
+ * a separate kuhl_occlusion for each viewport and don't use this for
+ * single-pass stereo rendering. The OpenGL state is otherwise left as
+ * described in kuhl_geometry_draw_list().
+ *
+ * @param queue The queue to draw.
+ *
+ * @param occ The query results from previous frames. If NULL or if
+ * occlusion queries are not supported, this is the same as
+ * kuhl_render_queue_draw().
+ *
+ * @param modelview The modelview matrix that the geometry is drawn
+ * with (not including the matrix in each kuhl_geometry).
+ *
+ * @param projection The projection matrix that the geometry is
+ * drawn with.
+ */
+void kuhl_render_queue_draw_occluded(kuhl_render_queue *queue, kuhl_occlusion *occ,
+                                     const float modelview[16], const float projection[16])
+{
+	if(queue == NULL)
+		return;
+	if(occ == NULL || !kuhl_private_occlusion_setup())
+	{
+		kuhl_render_queue_draw(queue);
+		if(occ)
+			occ->drawn += queue->records.length;
+		return;
+	}
+	if(!queue->sorted)
+		kuhl_render_queue_sort(queue);
 	kuhl_errorcheck();
 
-	/* kuhl_geometry_attrib_get() allows vertex attribute buffers to
-	 * be mapped. Here, we check if the buffers are mapped. If they
-	 * are, we unmap them before we draw the geometry. */
-	for(unsigned int i=0; i<geom->attrib_count; i++)
+	/* GL_SAMPLES_PASSED is available everywhere but may make the GPU
+	 * count every sample. */
+	GLenum target = GLEW_VERSION_3_3 || GLEW_ARB_occlusion_query2 ? GL_ANY_SAMPLES_PASSED : GL_SAMPLES_PASSED;
+	int conditional = GLEW_VERSION_3_0 || GLEW_NV_conditional_render;
+
+	int len = queue->records.length;
+	kuhl_render_record *records = queue->records.data;
+	kuhl_arena *arena = kuhl_arena_frame();
+	size_t mark = kuhl_arena_mark(arena);
+	char *first = kuhl_arena_alloc(arena, len > 0 ? len : 1);
+
+	/* Find the geometry that is always drawn: The geometry that can't
+	 * be tested and the largest geometry on the screen. */
+	int occluders[KUHL_OCCLUDER_COUNT];
+	float occluderSize[KUHL_OCCLUDER_COUNT];
+	int occluderCount = 0;
+	for(int i=0; i<len; i++)
 	{
-		glBindBuffer(GL_ARRAY_BUFFER, geom->attribs[i].bufferobject);
-		GLint bufferIsMapped = 0;
-		glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_MAPPED, &bufferIsMapped);
-		kuhl_errorcheck();
-		if(bufferIsMapped)
-			glUnmapBuffer(GL_ARRAY_BUFFER);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		kuhl_errorcheck();
+		const kuhl_geometry *geom = records[i].geom;
+		first[i] = !kuhl_private_occlusion_testable(geom, modelview, projection);
+		if(first[i])
+			continue;
+		float size = kuhl_geometry_screen_size(geom, modelview, projection, 1);
+		int pos = occluderCount;
+		while(pos > 0 && occluderSize[pos-1] < size)
+			pos--;
+		if(pos >= KUHL_OCCLUDER_COUNT)
+			continue;
+		int last = occluderCount < KUHL_OCCLUDER_COUNT ? occluderCount : KUHL_OCCLUDER_COUNT-1;
+		for(int j=last; j>pos; j--)
+		{
+			occluders[j] = occluders[j-1];
+			occluderSize[j] = occluderSize[j-1];
+		}
+		occluders[pos] = i;
+		occluderSize[pos] = size;
+		if(occluderCount < KUHL_OCCLUDER_COUNT)
+			occluderCount++;
 	}
+	for(int i=0; i<occluderCount; i++)
+		first[occluders[i]] = 1;
 
-	
-	/* If the user provided us with indices, use glDrawElements() to
-	 * draw the geometry. */
-	if(geom->indices_len > 0 && glIsBuffer(geom->indices_bufferobject))
+	kuhl_draw_state state;
+	kuhl_private_draw_state_begin(&state);
+	glUseProgram(kuhl_occlusion_program);
+	glUniformMatrix4fv(kuhl_occlusion_projection, 1, 0, projection);
+	state.program = kuhl_occlusion_program;
+
+	for(int i=0; i<len; i++)
 	{
-		glDrawElements(geom->primitive_type,
-		               geom->indices_len,
-		               GL_UNSIGNED_INT,
-		               NULL);
-		kuhl_errorcheck();
+		if(!first[i])
+			continue;
+		kuhl_private_geometry_draw_fast(records[i].geom, &state);
+		occ->drawn++;
 	}
-	else
+
+	for(int i=0; i<len; i++)
 	{
-		/* If the user didn't provide us with indices, just draw the
-		 * vertices in order. */
-		glDrawArrays(geom->primitive_type, 0, geom->vertex_count);
-		kuhl_errorcheck();
+		if(first[i])
+			continue;
+		kuhl_geometry *geom = records[i].geom;
+		kuhl_occlusion_entry *e = kuhl_private_occlusion_entry(occ, geom);
+
+		if(e->pending)
+		{
+			GLuint available = 0;
+			glGetQueryObjectuiv(e->query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if(available)
+			{
+				GLuint samples = 0;
+				glGetQueryObjectuiv(e->query, GL_QUERY_RESULT, &samples);
+				e->visible = samples > 0;
+				e->pending = 0;
+			}
+		}
+
+		if(e->visible)
+		{
+			/* Spread the tests of visible geometry across frames. */
+			int test = !e->pending && (occ->frame + (unsigned int) i) % KUHL_OCCLUSION_INTERVAL == 0;
+			if(test)
+				glBeginQuery(target, e->query);
+			kuhl_private_geometry_draw_fast(geom, &state);
+			if(test)
+			{
+				glEndQuery(target);
+				e->pending = 1;
+			}
+			occ->drawn++;
+		}
+		else if(conditional)
+		{
+			/* Test the box again even if the last result isn't
+			 * available. The GPU waits for the new result before
+			 * deciding whether to draw. */
+			kuhl_private_occlusion_query_box(e, target, modelview, &state);
+			glBeginConditionalRender(e->query, GL_QUERY_WAIT);
+			kuhl_private_geometry_draw_fast(geom, &state);
+			glEndConditionalRender();
+			occ->conditional++;
+		}
+		else
+		{
+			if(!e->pending)
+				kuhl_private_occlusion_query_box(e, target, modelview, &state);
+			occ->skipped++;
+		}
 	}
+	kuhl_private_draw_state_end(&state);
+	kuhl_arena_release(arena, mark);
+	occ->frame++;
+}
 
+/** The layout of a single command in a GL_DRAW_INDIRECT_BUFFER used
+ * by glMultiDrawElementsIndirect(). */
+typedef struct
+{
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLint  baseVertex;
+	GLuint baseInstance;
+} kuhl_draw_elements_indirect;
+
+/** Checks if two geometry objects use the same textures with the same
+ * samplers. */
+static int kuhl_private_same_textures(const kuhl_geometry *a, const kuhl_geometry *b)
+{
+	if(a->texture_count != b->texture_count)
+		return 0;
+	for(unsigned int i=0; i<a->texture_count; i++)
+		if(a->textures[i].textureId != b->textures[i].textureId ||
+		   a->textures[i].location != b->textures[i].location)
+			return 0;
+	return 1;
+}
 
-	/* For each texture unit that we bound a texture to, unbind the
-	 * texture since we have finished drawing the geometry */
-	for(unsigned int i=0; i<geom->texture_count; i++)
+/** Checks if the OpenGL context supports glMultiDrawElementsIndirect()
+ * with a base instance. */
+static int kuhl_private_scene_supported(void)
+{
+	return kuhl_private_pool_supported() &&
+		(GLEW_VERSION_4_3 || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance));
+}
+
+/** Checks if a geometry can be drawn by kuhl_scene with
+ * glMultiDrawElementsIndirect(). Geometry with bones, instances or
+ * no indices, and geometry whose program has no in_GeomTransform
+ * attribute is drawn by the fallback render queue instead.
+ *
+ * @return The location of in_GeomTransform or -1.
+ */
+static GLint kuhl_private_scene_eligible(kuhl_geometry *geom)
+{
+	if(geom->instance_count > 0 || geom->indices_len == 0)
+		return -1;
+#ifdef KUHL_UTIL_USE_ASSIMP
+	if(geom->bones != NULL && geom->bones->count > 0)
+		return -1;
+#endif
+	GLint loc = glGetAttribLocation(geom->program, "in_GeomTransform");
+	if(loc == -1)
+		return -1;
+	if(geom->pool == NULL && kuhl_geometry_pool(geom, KG_NONE) == 0)
+		return -1;
+
+	/* The matrix uses 4 locations which must not overlap with the
+	 * attributes in the chunk. */
+	for(unsigned int i=0; i<geom->pool->attrib_count; i++)
 	{
-		kuhl_errorcheck();
-		/* Turn on appropriate texture unit */
-		glActiveTexture(GL_TEXTURE0+i);
-		kuhl_errorcheck();
-		/* Unbind the texture */
-		glBindTexture(GL_TEXTURE_2D, 0);
-		kuhl_errorcheck();
+		GLint a = geom->pool->locations[i];
+		GLint slots = (GLint) (geom->pool->components[i]+3)/4;
+		if(a < loc+4 && loc < a+slots)
+			return -1;
 	}
+	return loc;
+}
 
-	
-	/* Indicate in the struct that we have successfully drawn this
-	 * geom once. */
-	geom->has_been_drawn = 1;
+/** Initializes a kuhl_scene. A kuhl_scene draws large amounts of
+ * static geometry (such as the meshes in an architectural model
+ * loaded with kuhl_load_model()) with a handful of
+ * glMultiDrawElementsIndirect() calls: one for each combination of
+ * GLSL program, textures and shared buffer chunk (see
+ * kuhl_geometry_pool()). The geometry's matrix is not sent as the
+ * GeomTransform uniform. Instead, the scene stores the matrices of
+ * all geometry in a buffer which the vertex program reads as a
+ * per-draw attribute:
+ *
+ * <pre>
+ * in mat4 in_GeomTransform;
+ * ...
+ * gl_Position = Projection * ModelView * in_GeomTransform * vec4(in_Position,1);
+ * </pre>
+ *
+ * Geometry that can't be drawn this way (for example, if the context
+ * does not support OpenGL 4.3 or ARB_multi_draw_indirect, if the
+ * program has no in_GeomTransform attribute, or if the geometry has
+ * bones) is drawn with a kuhl_render_queue instead.
+ *
+ * @param scene The scene to initialize.
+ */
+void kuhl_scene_init(kuhl_scene *scene)
+{
+	kuhl_render_queue_init(&(scene->fallback));
+	kuhl_geometry_ptr_list_init(&(scene->geoms));
+	kuhl_scene_batch_list_init(&(scene->batches));
+	scene->indirect_buffer = 0;
+	scene->transform_buffer = 0;
+	scene->built = 1;
+	scene->views = kuhl_private_view_count;
+}
 
-	/* Restore previously active texture */
-	glActiveTexture(previouslyActiveTexture);
-	
-	/* Unbind texture */
-	glBindTexture(GL_TEXTURE_2D, previouslyBoundTexture);
+/** Adds every kuhl_geometry object in a linked list to a scene. The
+ * geometry is not copied, so it must not be deleted while it is in
+ * the scene. Geometry that can be drawn with
+ * glMultiDrawElementsIndirect() is moved into shared buffers with
+ * kuhl_geometry_pool() when the scene is built.
+ *
+ * @param scene The scene to add the geometry to.
+ *
+ * @param geom A kuhl_geometry list to add.
+ *
+ * @return The number of kuhl_geometry objects that were added.
+ */
+int kuhl_scene_add(kuhl_scene *scene, kuhl_geometry *geom)
+{
+	if(scene == NULL)
+		return 0;
+	int count = 0;
+	for(; geom != NULL; geom = geom->next)
+	{
+		kuhl_geometry_ptr_list_append(&(scene->geoms), geom);
+		count++;
+	}
+	if(count > 0)
+		scene->built = 0;
+	return count;
+}
 
-	/* Restore the GLSL program that was used before this function was
-	 * called. */
-	glUseProgram(previouslyUsedProgram);
-	
-	/* Unbind the VAO */
-	glBindVertexArray(previousVAO);
+/** Deletes the OpenGL objects owned by a scene and empties its
+ * batches and fallback queue. */
+static void kuhl_private_scene_release(kuhl_scene *scene)
+{
+	for(int i=0; i<scene->batches.length; i++)
+		glDeleteVertexArrays(1, &(scene->batches.data[i].vao));
+	kuhl_scene_batch_list_clear(&(scene->batches));
+	kuhl_render_queue_clear(&(scene->fallback));
+	if(scene->indirect_buffer)
+		glDeleteBuffers(1, &(scene->indirect_buffer));
+	if(scene->transform_buffer)
+		glDeleteBuffers(1, &(scene->transform_buffer));
+	scene->indirect_buffer = 0;
+	scene->transform_buffer = 0;
+}
+
+/** Builds the indirect draw commands and the per-draw matrices for
+ * a scene. kuhl_scene_draw() calls this automatically when geometry
+ * has been added. Call it yourself after changing the matrix, program
+ * or textures of geometry in the scene.
+ *
+ * @param scene The scene to build.
+ */
+void kuhl_scene_build(kuhl_scene *scene)
+{
+	if(scene == NULL)
+		return;
+	kuhl_private_scene_release(scene);
+
+	int len = scene->geoms.length;
+	kuhl_geometry **geoms = scene->geoms.data;
+	int supported = kuhl_private_scene_supported();
+
+	/* Sort the eligible geometry with the same order that
+	 * kuhl_render_queue uses so that geometry which can share a
+	 * draw call is next to each other. */
+	kuhl_render_record_list records;
+	kuhl_render_record_list_init(&records);
+	kuhl_render_record_list_reserve(&records, len);
+	for(int i=0; i<len; i++)
+	{
+		kuhl_geometry *g = geoms[i];
+		if(!supported || kuhl_private_scene_eligible(g) == -1)
+		{
+			kuhl_private_render_queue_add_one(&(scene->fallback), g);
+			continue;
+		}
+		kuhl_render_record *record = kuhl_render_record_list_push(&records);
+		record->program = g->program;
+		record->vao = g->vao;
+		record->order = (unsigned int) records.length - 1;
+		record->geom = g;
+	}
+	kuhl_render_record_list_sort(&records, kuhl_private_render_record_compar);
+
+	int count = records.length;
+	if(count > 0)
+	{
+		kuhl_draw_elements_indirect *commands = kuhl_malloc(sizeof(kuhl_draw_elements_indirect)*count);
+		GLfloat *matrices = kuhl_malloc(sizeof(GLfloat)*16*count);
+		kuhl_render_record *r = records.data;
+		kuhl_scene_batch *batch = NULL;
+		for(int i=0; i<count; i++)
+		{
+			kuhl_geometry *g = r[i].geom;
+			commands[i].count = g->indices_len;
+			commands[i].instanceCount = kuhl_private_view_count;
+			commands[i].firstIndex = g->first_index;
+			commands[i].baseVertex = g->base_vertex;
+			commands[i].baseInstance = (GLuint) i;
+			mat4f_copy(matrices+16*i, g->matrix);
+
+			/* Start a new batch if this geometry can't be drawn in
+			 * the same call as the previous one. */
+			if(batch == NULL || batch->program != g->program ||
+			   batch->geom->pool != g->pool ||
+			   batch->primitive_type != g->primitive_type ||
+			   !kuhl_private_same_textures(batch->geom, g))
+			{
+				batch = kuhl_scene_batch_list_push(&(scene->batches));
+				batch->program = g->program;
+				batch->vao = 0;
+				batch->primitive_type = g->primitive_type;
+				batch->geom = g;
+				batch->first = (unsigned int) i;
+				batch->count = 0;
+			}
+			batch->count++;
+		}
+
+		glGenBuffers(1, &(scene->indirect_buffer));
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, scene->indirect_buffer);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(kuhl_draw_elements_indirect)*count,
+		             commands, GL_STATIC_DRAW);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+		glGenBuffers(1, &(scene->transform_buffer));
+		glBindBuffer(GL_ARRAY_BUFFER, scene->transform_buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*16*count, matrices, GL_STATIC_DRAW);
+		free(commands);
+		free(matrices);
+
+		/* Each batch gets a vertex array object with the attributes
+		 * of its chunk plus the per-draw matrix. The matrix for a
+		 * command is selected by its base instance. */
+		for(int i=0; i<scene->batches.length; i++)
+		{
+			kuhl_scene_batch *b = &(scene->batches.data[i]);
+			kuhl_buffer_chunk *chunk = b->geom->pool;
+			glGenVertexArrays(1, &(b->vao));
+			glBindVertexArray(b->vao);
+			kuhl_private_chunk_attribs(chunk);
+
+			/* In single-pass stereo, each view is an instance but all
+			 * views use the same matrix. */
+			kuhl_attrib transform;
+			transform.components = 16;
+			transform.divisor = kuhl_private_view_count;
+			transform.stride = 0;
+			transform.offset = 0;
+			glBindBuffer(GL_ARRAY_BUFFER, scene->transform_buffer);
+			kuhl_private_attrib_pointer(glGetAttribLocation(b->program, "in_GeomTransform"), &transform);
+			glBindVertexArray(0);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		kuhl_errorcheck();
+	}
+	kuhl_render_record_list_free(&records);
+
+	msg(DEBUG, "Scene has %d geometry objects: %d in %d indirect draw calls, %d in the fallback queue.\n",
+	    len, count, scene->batches.length, scene->fallback.records.length);
+	scene->built = 1;
+	scene->views = kuhl_private_view_count;
+}
+
+/** Draws all of the geometry in a scene. The OpenGL state is left as
+ * described in kuhl_geometry_draw_list().
+ *
+ * @param scene The scene to draw.
+ */
+void kuhl_scene_draw(kuhl_scene *scene)
+{
+	if(scene == NULL)
+		return;
+	if(!scene->built || scene->views != kuhl_private_view_count)
+		kuhl_scene_build(scene);
 	kuhl_errorcheck();
 
-	/* Draw the next nodes in the list. */
-	kuhl_geometry_draw(geom->next);
+	int numBatches = scene->batches.length;
+	if(numBatches > 0)
+	{
+		kuhl_draw_state state;
+		kuhl_private_draw_state_begin(&state);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, scene->indirect_buffer);
+		kuhl_scene_batch *batches = scene->batches.data;
+		for(int i=0; i<numBatches; i++)
+		{
+			kuhl_scene_batch *b = &(batches[i]);
+			kuhl_geometry *geom = b->geom;
+			if(state.program != b->program)
+			{
+				glUseProgram(b->program);
+				state.program = b->program;
+			}
+			if(geom->uniform_program != geom->program ||
+			   geom->uniform_generation != uniformCacheGeneration)
+				kuhl_private_geometry_uniforms(geom);
+
+			int hasTex = 0;
+			for(unsigned int t=0; t<geom->texture_count; t++)
+			{
+				kuhl_texture *tex = &(geom->textures[t]);
+				if(tex->location == -1)
+					continue;
+				if(strcmp(tex->name, "tex") == 0)
+					hasTex = 1;
+				glUniform1i(tex->location, t);
+				if(state.textures[t] != tex->textureId)
+				{
+					if(state.activeUnit != t)
+					{
+						glActiveTexture(GL_TEXTURE0+t);
+						state.activeUnit = t;
+					}
+					glBindTexture(GL_TEXTURE_2D, tex->textureId);
+					state.textures[t] = tex->textureId;
+				}
+			}
+			GLint loc = geom->uniform_locations[KG_UNIFORM_HASTEX];
+			if(loc != -1)
+				glUniform1i(loc, hasTex);
+			loc = geom->uniform_locations[KG_UNIFORM_NUMBONES];
+			if(loc != -1)
+				glUniform1i(loc, 0);
+
+			/* The chunk may have been mapped by kuhl_geometry_attrib_get(). */
+			kuhl_geometry_unmap(geom);
+
+			glBindVertexArray(b->vao);
+			state.vao = b->vao;
+			glMultiDrawElementsIndirect(b->primitive_type, GL_UNSIGNED_INT,
+			                            (const void*) (b->first*sizeof(kuhl_draw_elements_indirect)),
+			                            b->count, 0);
+			kuhl_errorcheck();
+		}
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		kuhl_private_draw_state_end(&state);
+	}
+
+	kuhl_render_queue_draw(&(scene->fallback));
+}
+
+/** Frees the memory and OpenGL objects used by a scene. The geometry
+ * in the scene is not deleted.
+ *
+ * @param scene The scene to free.
+ */
+void kuhl_scene_free(kuhl_scene *scene)
+{
+	if(scene == NULL)
+		return;
+	kuhl_private_scene_release(scene);
+	kuhl_render_queue_free(&(scene->fallback));
+	kuhl_geometry_ptr_list_free(&(scene->geoms));
+	kuhl_scene_batch_list_free(&(scene->batches));
+}
+
+#ifdef KUHL_UTIL_USE_ASSIMP
+/** Frees the bones of a geometry and releases its reference to the
+ * bone palette. */
+static void kuhl_private_bones_free(kuhl_geometry *geom)
+{
+	kuhl_bonemat *bones = geom->bones;
+	if(bones == NULL)
+		return;
+	kuhl_bonepalette *palette = bones->palette;
+	if(palette != NULL && --(palette->refcount) == 0)
+	{
+		if(glIsBuffer(palette->buffer))
+			glDeleteBuffers(1, &(palette->buffer));
+		free(palette->matrices);
+		free(palette);
+	}
+	free(bones->boneList);
+	free(bones->nodeIndex);
+	free(bones);
+	geom->bones = NULL;
+	geom->bone_block_target = 0;
 }
 
+static void kuhl_private_scene_nodes_free(const struct aiScene *scene);
+#endif
+
 /** Deletes kuhl_geometry struct by freeing the OpenGL buffers that
  * may have been created by kuhl_geometry_attrib() and
  * kuhl_geometry_indices(). It also frees the vertex array object in
@@ -1371,30 +4556,17 @@ void kuhl_geometry_draw(kuhl_geometry *geom)
 */
 void kuhl_geometry_delete(kuhl_geometry *geom)
 {
-	while(geom->next != NULL)
+	if(geom->next != NULL)
 		kuhl_geometry_delete(geom->next);
 	
-	for(unsigned int i=0; i<geom->attrib_count; i++)
-	{
-		kuhl_attrib *attrib = &(geom->attribs[i]);
-		if(attrib->name)
-			free(attrib->name);
-		attrib->name = NULL;
-		if(glIsBuffer(attrib->bufferobject))
-			glDeleteBuffers(1, &(attrib->bufferobject));
-		attrib->bufferobject = 0;
-	}
-	geom->attrib_count = 0;
-
-	if(glIsBuffer(geom->indices_bufferobject))
-		glDeleteBuffers(1, &(geom->indices_bufferobject));
-	geom->indices_bufferobject = 0;
-	geom->indices_len = 0;
-	
-	if(glIsVertexArray(geom->vao))
-		glDeleteVertexArrays(1, &(geom->vao));
-	geom->vao = 0;
+	kuhl_private_geometry_release_buffers(geom);
+#ifdef KUHL_UTIL_USE_ASSIMP
+	kuhl_private_bones_free(geom);
+	if(geom->assimp_scene != NULL)
+		kuhl_private_scene_nodes_free(geom->assimp_scene);
+#endif
 	geom->has_been_drawn = 0;
+	geom->occlusion_id = 0; // stale kuhl_occlusion entries won't match
 }
 
 
@@ -1420,6 +4592,7 @@ void kuhl_geometry_delete(kuhl_geometry *geom)
  */
 GLuint kuhl_read_texture_rgba_array_wrap(const unsigned char* array, int width, int height, GLuint wrapS, GLuint wrapT)
 {
+	TRACE_SCOPE("kuhl_read_texture_rgba_array");
 	GLuint texName = 0;
 	if(!GLEW_VERSION_2_0)
 	{
@@ -1625,10 +4798,10 @@ static float kuhl_read_texture_file_im(const char *filename, GLuint *texName, GL
 	iioinfo.map        = (char*) "RGBA";
 	iioinfo.colorspace = sRGBColorspace;
 	unsigned char *image = (unsigned char*) imagein(&iioinfo);
-	free(newFilename);
 	if(image == NULL)
 	{
 		msg(ERROR, "Unable to read '%s'.\n", filename);
+		free(newFilename);
 		return -1;
 	}
 
@@ -1640,7 +4813,12 @@ static float kuhl_read_texture_file_im(const char *filename, GLuint *texName, GL
 	int height = (int)iioinfo.height;
 	float aspectRatio = (float)width/height;
 	msg(DEBUG, "Finished reading '%s' (%dx%d)\n", filename, width, height);
-	*texName = kuhl_read_texture_rgba_array_wrap(image, width, height, wrapS, wrapT);
+	*texName = 0;
+	if(texcache_enabled())
+		*texName = texcache_store(newFilename, image, width, height, wrapS, wrapT);
+	if(*texName == 0)
+		*texName = kuhl_read_texture_rgba_array_wrap(image, width, height, wrapS, wrapT);
+	free(newFilename);
 
 	if(iioinfo.comment)
 		free(iioinfo.comment);
@@ -1678,10 +4856,10 @@ static float kuhl_read_texture_file_stb(const char *filename, GLuint *texName, G
 	 * image should be flipped. */
 	stbi_set_flip_vertically_on_load(1);
 	unsigned char *image = (unsigned char*) stbi_load(newFilename, &width, &height, &comp, requestedComponents);
-	free(newFilename);
 	if(image == NULL)
 	{
 		msg(ERROR, "Unable to read '%s'.\n", filename);
+		free(newFilename);
 		return -1;
 	}
 
@@ -1691,7 +4869,12 @@ static float kuhl_read_texture_file_stb(const char *filename, GLuint *texName, G
 	 * for the lowest left pixel in the texture. */
 	float aspectRatio = (float)width/height;
 	msg(DEBUG, "Finished reading '%s' (%dx%d)\n", filename, width, height);
-	*texName = kuhl_read_texture_rgba_array_wrap(image, width, height, wrapS, wrapT);
+	*texName = 0;
+	if(texcache_enabled())
+		*texName = texcache_store(newFilename, image, width, height, wrapS, wrapT);
+	if(*texName == 0)
+		*texName = kuhl_read_texture_rgba_array_wrap(image, width, height, wrapS, wrapT);
+	free(newFilename);
 	stbi_image_free(image);
 	
 	if(*texName == 0)
@@ -1725,6 +4908,17 @@ static float kuhl_read_texture_file_stb(const char *filename, GLuint *texName, G
  */
 float kuhl_read_texture_file_wrap(const char *filename, GLuint *texName, GLuint wrapS, GLuint wrapT)
 {
+	TRACE_SCOPE("kuhl_read_texture_file");
+	/* KTX files contain compressed textures (with their mipmaps) that
+	 * are uploaded directly. See texcache.h. */
+	if(texcache_is_ktx(filename))
+		return texcache_read_texture(filename, texName, wrapS, wrapT);
+	if(texcache_enabled())
+	{
+		float aspectRatio = texcache_load(filename, texName, wrapS, wrapT);
+		if(aspectRatio > 0)
+			return aspectRatio;
+	}
 #ifdef KUHL_UTIL_USE_IMAGEMAGICK
 	return kuhl_read_texture_file_im(filename, texName, wrapS, wrapT);
 #else
@@ -1750,6 +4944,289 @@ float kuhl_read_texture_file(const char *filename, GLuint *texName)
 	return kuhl_read_texture_file_wrap(filename, texName, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
 }
 
+/** Reads an image into an array of RGBA pixels with the bottom row
+ * first. Free the array with kuhl_free_image_rgba().
+ *
+ * @return The pixels or NULL on error.
+ */
+static unsigned char* kuhl_read_image_rgba(const char *filename, int *width, int *height)
+{
+	char *newFilename = kuhl_find_file(filename);
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	imageio_info iioinfo;
+	iioinfo.filename   = newFilename;
+	iioinfo.type       = CharPixel;
+	iioinfo.map        = (char*) "RGBA";
+	iioinfo.colorspace = sRGBColorspace;
+	unsigned char *image = (unsigned char*) imagein(&iioinfo);
+	if(iioinfo.comment)
+		free(iioinfo.comment);
+	*width  = (int)iioinfo.width;
+	*height = (int)iioinfo.height;
+#else
+	int comp = -1;
+	stbi_set_flip_vertically_on_load(1);
+	unsigned char *image = (unsigned char*) stbi_load(newFilename, width, height, &comp, STBI_rgb_alpha);
+#endif
+	free(newFilename);
+	if(image == NULL)
+		msg(ERROR, "Unable to read '%s'.\n", filename);
+	return image;
+}
+
+static void kuhl_free_image_rgba(unsigned char *image)
+{
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	free(image);
+#else
+	stbi_image_free(image);
+#endif
+}
+
+/** An RGBA image with the bottom row first. */
+typedef struct
+{
+	unsigned char *pixels;
+	int width, height;
+} kuhl_cubemap_image;
+
+/** Bilinearly samples an image. u and v range from 0 to 1 (v=0 is the
+ * bottom of the image). If wrapU is set, the left and right edges of
+ * the image are blended together (for equirectangular images). */
+static void kuhl_cubemap_sample(const kuhl_cubemap_image *image, float u, float v, int wrapU, float result[4])
+{
+	float x = u * image->width - .5f;
+	float y = v * image->height - .5f;
+	int x0 = (int) floorf(x), y0 = (int) floorf(y);
+	float fx = x - x0, fy = y - y0;
+	for(int c=0; c<4; c++)
+		result[c] = 0;
+	for(int j=0; j<2; j++)
+	{
+		int sy = y0+j;
+		sy = sy < 0 ? 0 : (sy >= image->height ? image->height-1 : sy);
+		for(int i=0; i<2; i++)
+		{
+			int sx = x0+i;
+			if(wrapU)
+				sx = ((sx % image->width) + image->width) % image->width;
+			else
+				sx = sx < 0 ? 0 : (sx >= image->width ? image->width-1 : sx);
+			float weight = (i ? fx : 1-fx) * (j ? fy : 1-fy);
+			const unsigned char *p = image->pixels + ((size_t)sy*image->width + sx)*4;
+			for(int c=0; c<4; c++)
+				result[c] += weight * p[c];
+		}
+	}
+}
+
+/** Calculates the direction that a texel in a cubemap face points
+ * in. See the table in the "Cube Map Texture Selection" section of
+ * the OpenGL specification.
+ *
+ * @param face 0 through 5 for GL_TEXTURE_CUBE_MAP_POSITIVE_X .. NEGATIVE_Z.
+ *
+ * @param s The horizontal texture coordinate (0 to 1).
+ *
+ * @param t The vertical texture coordinate (0 to 1), t=0 is the first row of the face.
+ */
+static void kuhl_cubemap_direction(int face, float s, float t, float dir[3])
+{
+	float sc = 2*s-1, tc = 2*t-1;
+	switch(face)
+	{
+		case 0: dir[0] =   1; dir[1] = -tc; dir[2] = -sc; break; // +X
+		case 1: dir[0] =  -1; dir[1] = -tc; dir[2] =  sc; break; // -X
+		case 2: dir[0] =  sc; dir[1] =   1; dir[2] =  tc; break; // +Y
+		case 3: dir[0] =  sc; dir[1] =  -1; dir[2] = -tc; break; // -Y
+		case 4: dir[0] =  sc; dir[1] = -tc; dir[2] =   1; break; // +Z
+		default: dir[0] = -sc; dir[1] = -tc; dir[2] = -1; break; // -Z
+	}
+}
+
+/** Looks up the color in a direction from six images in the order
+ * front (-Z), back (+Z), left (-X), right (+X), down (-Y), up
+ * (+Y). Each image is oriented as it appears from the inside of the
+ * cube: The top of the side images face +Y, the top of the down image
+ * faces the front and the top of the up image faces the back. */
+static void kuhl_cubemap_lookup_faces(const kuhl_cubemap_image faces[6], const float d[3], float result[4])
+{
+	float ax = fabsf(d[0]), ay = fabsf(d[1]), az = fabsf(d[2]);
+	int image;
+	float u, v;
+	if(az >= ax && az >= ay)
+	{
+		image = d[2] < 0 ? 0 : 1;
+		u = (d[2] < 0 ? d[0] : -d[0]) / az;
+		v = d[1] / az;
+	}
+	else if(ax >= ay)
+	{
+		image = d[0] < 0 ? 2 : 3;
+		u = (d[0] < 0 ? -d[2] : d[2]) / ax;
+		v = d[1] / ax;
+	}
+	else
+	{
+		image = d[1] < 0 ? 4 : 5;
+		u = d[0] / ay;
+		v = (d[1] < 0 ? -d[2] : d[2]) / ay;
+	}
+	kuhl_cubemap_sample(&faces[image], (u+1)/2, (v+1)/2, 0, result);
+}
+
+/** Looks up the color in a direction from an equirectangular
+ * (latitude/longitude) image. The center of the image faces the
+ * front (-Z). */
+static void kuhl_cubemap_lookup_equirect(const kuhl_cubemap_image *image, const float d[3], float result[4])
+{
+	float longitude = atan2f(d[0], -d[2]);
+	float latitude  = atan2f(d[1], sqrtf(d[0]*d[0] + d[2]*d[2]));
+	kuhl_cubemap_sample(image, .5f + longitude/(2*M_PI), .5f + latitude/M_PI, 1, result);
+}
+
+/** Creates a cubemap texture by looking up the color of each texel
+ * of each face in either six face images or an equirectangular
+ * image.
+ *
+ * @return The texture name or 0 on error.
+ */
+static GLuint kuhl_cubemap_create(int faceSize, const kuhl_cubemap_image *faces, const kuhl_cubemap_image *equirect)
+{
+	GLint maxSize = 0;
+	glGetIntegerv(GL_MAX_CUBE_MAP_TEXTURE_SIZE, &maxSize);
+	if(maxSize > 0 && faceSize > maxSize)
+	{
+		msg(WARNING, "Cubemap faces reduced from %dx%d to the largest size your card supports (%dx%d).\n", faceSize, faceSize, maxSize, maxSize);
+		faceSize = maxSize;
+	}
+
+	GLuint texName = 0;
+	glGenTextures(1, &texName);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, texName);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	if(glewIsSupported("GL_EXT_texture_filter_anisotropic"))
+	{
+		float maxAniso;
+		glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAniso);
+		glTexParameterf(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_ANISOTROPY_EXT, maxAniso);
+	}
+	kuhl_errorcheck();
+
+	unsigned char *face = kuhl_malloc((size_t)faceSize*faceSize*4);
+	for(int f=0; f<6; f++)
+	{
+		for(int y=0; y<faceSize; y++)
+		{
+			for(int x=0; x<faceSize; x++)
+			{
+				float dir[3], color[4];
+				kuhl_cubemap_direction(f, (x+.5f)/faceSize, (y+.5f)/faceSize, dir);
+				if(equirect)
+					kuhl_cubemap_lookup_equirect(equirect, dir, color);
+				else
+					kuhl_cubemap_lookup_faces(faces, dir, color);
+				unsigned char *p = face + ((size_t)y*faceSize + x)*4;
+				for(int c=0; c<4; c++)
+					p[c] = (unsigned char) (color[c] + .5f);
+			}
+		}
+		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X+f, 0, GL_RGBA8, faceSize, faceSize,
+		             0, GL_RGBA, GL_UNSIGNED_BYTE, face);
+	}
+	free(face);
+	glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+
+	/* Filter across the edges of the faces instead of clamping to
+	 * the edge of each face. */
+	if(GLEW_VERSION_3_2 || glewIsSupported("GL_ARB_seamless_cube_map"))
+		glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	if(kuhl_errorcheck())
+	{
+		glDeleteTextures(1, &texName);
+		return 0;
+	}
+	return texName;
+}
+
+/** Reads six images into a cubemap texture (GL_TEXTURE_CUBE_MAP). A
+ * cubemap can be drawn in a single pass by sampling it with a
+ * samplerCube in GLSL, and it is filtered seamlessly across the edges
+ * of the faces. Requires OpenGL 3.0 or better.
+ *
+ * @param filenames The images in the order front (-Z), back (+Z),
+ * left (-X), right (+X), down (-Y), up (+Y). Each image should look
+ * correct when viewed from the inside of the cube. The top of the
+ * side images should point up (+Y), the top of the down image should
+ * point to the front and the top of the up image should point to the
+ * back.
+ *
+ * @param texName Set to the texture name (or 0 on error). Bind it to
+ * GL_TEXTURE_CUBE_MAP.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+int kuhl_read_cubemap_files(const char *filenames[6], GLuint *texName)
+{
+	TRACE_SCOPE("kuhl_read_cubemap_files");
+	*texName = 0;
+	kuhl_cubemap_image faces[6];
+	int faceSize = 0;
+	int ok = 1;
+	memset(faces, 0, sizeof(faces));
+	for(int i=0; i<6 && ok; i++)
+	{
+		faces[i].pixels = kuhl_read_image_rgba(filenames[i], &faces[i].width, &faces[i].height);
+		if(faces[i].pixels == NULL)
+			ok = 0;
+		else if(faces[i].width > faceSize)
+			faceSize = faces[i].width;
+	}
+	if(ok)
+		*texName = kuhl_cubemap_create(faceSize, faces, NULL);
+	for(int i=0; i<6; i++)
+		if(faces[i].pixels)
+			kuhl_free_image_rgba(faces[i].pixels);
+	return *texName != 0;
+}
+
+/** Reads an equirectangular (latitude/longitude, 360x180 degree)
+ * panorama into a cubemap texture (GL_TEXTURE_CUBE_MAP). See
+ * kuhl_read_cubemap_files().
+ *
+ * @param filename The image. The center of the image is placed in
+ * front (-Z) and the top of the image is up (+Y).
+ *
+ * @param texName Set to the texture name (or 0 on error). Bind it to
+ * GL_TEXTURE_CUBE_MAP.
+ *
+ * @param faceSize The width and height of each face in pixels. If 0,
+ * a quarter of the width of the image is used so that the cubemap has
+ * roughly the same resolution as the image.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+int kuhl_read_cubemap_equirect(const char *filename, GLuint *texName, int faceSize)
+{
+	TRACE_SCOPE("kuhl_read_cubemap_equirect");
+	*texName = 0;
+	kuhl_cubemap_image image;
+	image.pixels = kuhl_read_image_rgba(filename, &image.width, &image.height);
+	if(image.pixels == NULL)
+		return 0;
+	if(faceSize <= 0)
+		faceSize = image.width/4 > 1 ? image.width/4 : 1;
+	*texName = kuhl_cubemap_create(faceSize, NULL, &image);
+	kuhl_free_image_rgba(image.pixels);
+	return *texName != 0;
+}
+
 #ifdef KUHL_UTIL_USE_IMAGEMAGICK
 static void kuhl_screenshot_im(const char *outputImageFilename)
 {
@@ -1758,7 +5235,9 @@ static void kuhl_screenshot_im(const char *outputImageFilename)
 	int windowHeight = glutGet(GLUT_WINDOW_HEIGHT);
 
 	// Allocate space for data from window
-	char *data = kuhl_malloc(windowWidth * windowHeight * 3);
+	kuhl_arena *arena = kuhl_arena_frame();
+	size_t mark = kuhl_arena_mark(arena);
+	char *data = kuhl_arena_alloc(arena, windowWidth * windowHeight * 3);
 	// Read pixels from the window
 	glReadPixels(0,0,windowWidth,windowHeight,
 	             GL_RGB,GL_UNSIGNED_BYTE, data);
@@ -1777,7 +5256,7 @@ static void kuhl_screenshot_im(const char *outputImageFilename)
 	// Write image to disk
 	imageout(&info_out, data);
 	free(info_out.filename); // cleanup
-	free(data);
+	kuhl_arena_release(arena, mark);
 }
 #else // KUHL_UTIL_USE_IMAGEMAGICK
 
@@ -1789,7 +5268,9 @@ static void kuhl_screenshot_stb(const char *outputImageFilename)
 	int comp = 3; // 3 = RGB, 4 = RGBA
 	int stride_in_bytes = windowWidth*comp*sizeof(char);
 	// Allocate space for data from window
-	unsigned char *data = kuhl_malloc(stride_in_bytes*windowHeight);
+	kuhl_arena *arena = kuhl_arena_frame();
+	size_t mark = kuhl_arena_mark(arena);
+	unsigned char *data = kuhl_arena_alloc(arena, stride_in_bytes*windowHeight);
 	// Read pixels from the window
 	glReadPixels(0,0,windowWidth,windowHeight,
 	             GL_RGB,GL_UNSIGNED_BYTE, data);
@@ -1805,7 +5286,7 @@ static void kuhl_screenshot_stb(const char *outputImageFilename)
 		ok = stbi_write_tga(s, windowWidth, windowHeight, comp, data);
 	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".bmp"))
 		ok = stbi_write_bmp(s, windowWidth, windowHeight, comp, data);
-	free(data);
+	kuhl_arena_release(arena, mark);
 	
 	if (!ok)
 	{
@@ -1832,6 +5313,7 @@ void kuhl_screenshot(const char *outputImageFilename)
 static int kuhl_video_record_frame = 0; // frame that we have recorded.
 static time_t kuhl_video_record_prev_sec = 0; // time of previous frame (seconds)
 static suseconds_t kuhl_video_record_prev_usec = 0; // time of previous frame usecs
+static int kuhl_video_record_pipe = 0; // 1 if frames are sent to ffmpeg
 
 /** Records individual frames to image files that can later be
   combined into a single video file. Call this function every frame
@@ -1841,8 +5323,14 @@ static suseconds_t kuhl_video_record_prev_usec = 0; // time of previous frame us
   function writes TIFF files to avoid unnecessary computation
   compressing images. Instructions for converting the image files into
   a video file using ffmpeg or avconv will be printed to standard
-  out. This may run slowly if you are saving files to a non-local
-  filesystem.
+  out. The frames are read back and written in the background (see
+  capture.h), so recording doesn't stall rendering unless the frames
+  can't be written as quickly as they are recorded.
+
+  If the KUHL_VIDEO_FFMPEG environment variable is set, the frames
+  are sent directly to ffmpeg instead of being written to image
+  files. If the variable is "1", the video is written to "label.mp4";
+  otherwise the variable is the name of the video file to write.
 
     @param fileLabel If fileLabel is set to "label", this function
     will create files such as "label-00000000.tif"
@@ -1865,12 +5353,31 @@ void kuhl_video_record(const char *fileLabel, int fps)
 	{
 		kuhl_video_record_prev_sec  = tv.tv_sec;
 		kuhl_video_record_prev_usec = tv.tv_usec;
+
+		const char *ffmpeg = getenv("KUHL_VIDEO_FFMPEG");
+		if(ffmpeg != NULL && strlen(ffmpeg) > 0 && strcmp(ffmpeg, "0") != 0)
+		{
+			char videoFile[1024];
+			if(strcmp(ffmpeg, "1") == 0)
+				snprintf(videoFile, 1024, "%s.mp4", fileLabel);
+			else
+				snprintf(videoFile, 1024, "%s", ffmpeg);
+			int width  = glutGet(GLUT_WINDOW_WIDTH);
+			int height = glutGet(GLUT_WINDOW_HEIGHT);
+			char command[2048];
+			snprintf(command, 2048, "ffmpeg -y -loglevel error -f rawvideo -pixel_format rgb24 -video_size %dx%d -framerate %d -i - -vf vflip -pix_fmt yuv420p \"%s\"",
+			         width, height, fps, videoFile);
+			kuhl_video_record_pipe = capture_pipe_open(command, width, height);
+		}
 		printf("%s: Recording %d frames per second\n", __func__, fps);
-		printf("Use either of the following commands to assemble Ogg video (Ogg video files are widely supported and not encumbered by patent restrictions):\n");
-		printf("ffmpeg -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
-		printf(" - or -\n");
-		printf("avconv -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
-		printf("In either program, the -qscale:v parameter sets the quality: 0 (lowest) to 10 (highest)\n");
+		if(!kuhl_video_record_pipe)
+		{
+			printf("Use either of the following commands to assemble Ogg video (Ogg video files are widely supported and not encumbered by patent restrictions):\n");
+			printf("ffmpeg -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
+			printf(" - or -\n");
+			printf("avconv -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
+			printf("In either program, the -qscale:v parameter sets the quality: 0 (lowest) to 10 (highest)\n");
+		}
 	}
 
 	time_t sec       = tv.tv_sec;
@@ -1890,9 +5397,14 @@ void kuhl_video_record(const char *fileLabel, int fps)
 	{
 		kuhl_video_record_prev_sec  = sec;
 		kuhl_video_record_prev_usec = usec;
-		char filename[1024];
-		snprintf(filename, 1024, "%s-%08d.%s", fileLabel, kuhl_video_record_frame, exten);
-		kuhl_screenshot(filename); // TODO: Should we check if the screenshot writes?
+		if(kuhl_video_record_pipe)
+			capture_pipe_frame();
+		else
+		{
+			char filename[1024];
+			snprintf(filename, 1024, "%s-%08d.%s", fileLabel, kuhl_video_record_frame, exten);
+			capture_frame(filename);
+		}
 		kuhl_video_record_frame++;
 	}
 
@@ -1900,14 +5412,103 @@ void kuhl_video_record(const char *fileLabel, int fps)
 
 #ifdef KUHL_UTIL_USE_ASSIMP
 
-/** This struct is used internally by kuhl_util.c to keep track of all textures that are associated with models that have been loaded. */
+/** An entry in the table of textures that are used by models. The
+ * entries are found by the full path of the texture file (see
+ * kuhl_private_assimp_fullpath()) so that a texture used by several
+ * models is only loaded once. */
 typedef struct {
-	char *textureFileName; /**< The filename of a texture */
-	GLuint textureID;      /**< The OpenGL texture name for that texture */
+	char *textureFileName; /**< The full path of a texture, NULL if the entry is unused */
+	GLuint textureID;      /**< The OpenGL texture name for that texture, 0 if it isn't loaded (yet) */
 } textureIdMapStruct;
-#define textureIdMapMaxSize 1024*32 /**< Maximum number of textures that can be loaded from models */
-static textureIdMapStruct textureIdMap[textureIdMapMaxSize]; /**<List of textures for the models */
-static int textureIdMapSize = 0; /**< Number of items in textureIdMap */
+static textureIdMapStruct *textureIdMap = NULL; /**< Open addressing hash table of textures used by models */
+static unsigned int textureIdMapCapacity = 0; /**< Number of entries in textureIdMap (a power of 2) */
+static unsigned int textureIdMapSize = 0; /**< Number of used entries in textureIdMap */
+/** Locked while textureIdMap is used since kuhl_load_models() adds
+ * textures from several threads. */
+static pthread_mutex_t textureIdMapMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int kuhl_private_texture_hash(const char *str)
+{
+	unsigned int h = 5381;
+	while(*str)
+		h = h*33 + (unsigned char) *str++;
+	return h;
+}
+
+/** Returns the entry for a texture in textureIdMap: either the entry
+ * that has the filename or the unused entry where it would be
+ * added. Must be called with textureIdMapMutex locked. */
+static textureIdMapStruct* kuhl_private_texture_slot(const char *fullpath)
+{
+	unsigned int mask = textureIdMapCapacity-1;
+	unsigned int i = kuhl_private_texture_hash(fullpath) & mask;
+	while(textureIdMap[i].textureFileName != NULL &&
+	      strcmp(textureIdMap[i].textureFileName, fullpath) != 0)
+		i = (i+1) & mask;
+	return textureIdMap + i;
+}
+
+/** Adds a texture to textureIdMap unless it is already there.
+ *
+ * @param fullpath The full path of the texture file.
+ *
+ * @return 1 if the texture was added (and the caller should load it
+ * and call kuhl_private_texture_set()) or 0 if it was already in the
+ * table.
+ */
+static int kuhl_private_texture_claim(const char *fullpath)
+{
+	pthread_mutex_lock(&textureIdMapMutex);
+	/* Keep the table at most half full so that searches are short. */
+	if((textureIdMapSize+1)*2 > textureIdMapCapacity)
+	{
+		textureIdMapStruct *old = textureIdMap;
+		unsigned int oldCapacity = textureIdMapCapacity;
+		textureIdMapCapacity = oldCapacity ? oldCapacity*2 : 64;
+		textureIdMap = kuhl_malloc(sizeof(textureIdMapStruct)*textureIdMapCapacity);
+		memset(textureIdMap, 0, sizeof(textureIdMapStruct)*textureIdMapCapacity);
+		for(unsigned int i=0; i<oldCapacity; i++)
+			if(old[i].textureFileName != NULL)
+				*kuhl_private_texture_slot(old[i].textureFileName) = old[i];
+		free(old);
+	}
+
+	textureIdMapStruct *slot = kuhl_private_texture_slot(fullpath);
+	int added = 0;
+	if(slot->textureFileName == NULL)
+	{
+		slot->textureFileName = strdup(fullpath);
+		slot->textureID = 0;
+		textureIdMapSize++;
+		added = 1;
+	}
+	pthread_mutex_unlock(&textureIdMapMutex);
+	return added;
+}
+
+/** Sets the OpenGL texture for a texture that was added with kuhl_private_texture_claim(). */
+static void kuhl_private_texture_set(const char *fullpath, GLuint textureID)
+{
+	pthread_mutex_lock(&textureIdMapMutex);
+	if(textureIdMapCapacity > 0)
+	{
+		textureIdMapStruct *slot = kuhl_private_texture_slot(fullpath);
+		if(slot->textureFileName != NULL)
+			slot->textureID = textureID;
+	}
+	pthread_mutex_unlock(&textureIdMapMutex);
+}
+
+/** Returns the OpenGL texture for a texture file or 0 if it hasn't been loaded. */
+static GLuint kuhl_private_texture_get(const char *fullpath)
+{
+	GLuint textureID = 0;
+	pthread_mutex_lock(&textureIdMapMutex);
+	if(textureIdMapCapacity > 0)
+		textureID = kuhl_private_texture_slot(fullpath)->textureID;
+	pthread_mutex_unlock(&textureIdMapMutex);
+	return textureID;
+}
 
 
 /** Recursively traverse a tree of ASSIMP nodes and updates the
@@ -2189,52 +5790,228 @@ static char* kuhl_private_assimp_fullpath(const char *textureFile, const char *m
 	char *fullpath = malloc(1024);
 	if(textureDir == NULL)
 	{
-		if(modelFile == NULL)
+		if(modelFile == NULL)
+		{
+			msg(ERROR, "modelFile was NULL");
+			exit(EXIT_FAILURE);
+		}
+		char *editable = strdup(modelFile);
+		char *dname = dirname(editable);
+		snprintf(fullpath, 1024, "%s/%s", dname, textureFile);
+		free(editable);
+	}
+	else
+		snprintf(fullpath, 1024, "%s/%s", textureDir, textureFile);
+	return fullpath;
+}
+
+
+/** A texture that a model uses and that needs to be loaded. */
+typedef struct
+{
+	char *fullpath;         /**< Full path of the texture file */
+	char *name;             /**< The texture filename stored in the model */
+	const char *modelFilename; /**< The model that uses the texture */
+	unsigned char *pixels;  /**< RGBA pixels if they were already read (see kuhl_load_models()), NULL otherwise */
+	int width, height;      /**< Size of pixels */
+} kuhl_private_model_texture;
+TLIST_DEFINE(kuhl_private_model_texture_list, kuhl_private_model_texture, 0)
+
+/** Sends assimp's messages to the msg log. This must be called before
+ * models are imported on several threads. */
+static void kuhl_private_assimp_log_init(const char *modelFilename)
+{
+	struct aiLogStream stream;
+	stream = aiGetPredefinedLogStream(aiDefaultLogStream_STDOUT,NULL);
+	if(stream.callback != msg_assimp_callback)
+	{
+		// we only need to set this up once.
+		stream.callback = msg_assimp_callback;
+		stream.user = strdup(modelFilename); // memory leak
+		aiAttachLogStream(&stream);
+	}
+}
+
+/** Returns 1 if kuhl_private_assimp_optimize() should reorder the
+ * meshes in imported models. Set KUHL_MESH_OPT=0 to disable it. */
+static int kuhl_private_assimp_optimize_enabled(void)
+{
+	const char *s = getenv("KUHL_MESH_OPT");
+	if(s != NULL && strcmp(s, "0") == 0)
+		return 0;
+	return 1;
+}
+
+/** Moves each element of a per-vertex array to its new position.
+ *
+ * @param array The array to reorder, NULL if the mesh doesn't have it.
+ * @param elementSize The size of each element in bytes.
+ * @param remap The new position of each vertex (see mesh_opt_vertex_fetch()).
+ * @param vertexCount The number of vertices.
+ */
+static void kuhl_private_assimp_permute(void *array, size_t elementSize, const unsigned int *remap, size_t vertexCount)
+{
+	if(array == NULL)
+		return;
+	char *tmp = kuhl_malloc(elementSize*vertexCount);
+	for(size_t v=0; v<vertexCount; v++)
+		memcpy(tmp + remap[v]*elementSize, (char*)array + v*elementSize, elementSize);
+	memcpy(array, tmp, elementSize*vertexCount);
+	free(tmp);
+}
+
+/** Copies the indices of a mesh into a single array if the mesh only
+ * contains triangles and has no morph targets.
+ *
+ * @param mesh The mesh.
+ * @param indexCount Set to the number of indices.
+ *
+ * @return The indices, to be free'd by the caller, or NULL.
+ */
+static unsigned int* kuhl_private_assimp_triangles(const struct aiMesh *mesh, size_t *indexCount)
+{
+	if(mesh->mPrimitiveTypes != aiPrimitiveType_TRIANGLE || mesh->mNumAnimMeshes > 0 ||
+	   mesh->mNumFaces < 2)
+		return NULL;
+	*indexCount = (size_t) mesh->mNumFaces*3;
+	unsigned int *indices = kuhl_malloc(sizeof(unsigned int)*(*indexCount));
+	for(unsigned int f=0; f<mesh->mNumFaces; f++)
+	{
+		if(mesh->mFaces[f].mNumIndices != 3)
+		{
+			free(indices);
+			return NULL;
+		}
+		memcpy(indices+3*f, mesh->mFaces[f].mIndices, sizeof(unsigned int)*3);
+	}
+	return indices;
+}
+
+/** Returns 1 if kuhl_private_assimp_lods() should create simplified
+ * versions of large meshes. Set KUHL_LOD=0 to disable it. */
+static int kuhl_private_assimp_lods_enabled(void)
+{
+	const char *s = getenv("KUHL_LOD");
+	if(s != NULL && strcmp(s, "0") == 0)
+		return 0;
+	return 1;
+}
+
+/** Creates simplified versions (see mesh_opt_lod_build()) of the
+ * meshes in a scene that have at least KUHL_LOD_MIN_TRIANGLES
+ * triangles. kuhl_geometry_lod_select() chooses which version to draw.
+ *
+ * @param scene The scene.
+ *
+ * @return An array with one mesh_opt_lod for each mesh in the scene.
+ */
+static mesh_opt_lod* kuhl_private_assimp_lods(const struct aiScene *scene)
+{
+	mesh_opt_lod *lods = kuhl_malloc(sizeof(mesh_opt_lod)*(scene->mNumMeshes+1));
+	memset(lods, 0, sizeof(mesh_opt_lod)*(scene->mNumMeshes+1));
+	for(unsigned int m=0; m<scene->mNumMeshes; m++)
+	{
+		const struct aiMesh *mesh = scene->mMeshes[m];
+		if(mesh->mNumFaces < KUHL_LOD_MIN_TRIANGLES)
+			continue;
+		size_t indexCount;
+		unsigned int *indices = kuhl_private_assimp_triangles(mesh, &indexCount);
+		if(indices == NULL)
+			continue;
+		unsigned int levels = mesh_opt_lod_build(lods+m, indices, indexCount, (const float*) mesh->mVertices, 3,
+		                                         mesh->mNumVertices, KUHL_LOD_RATIO, 3*KUHL_LOD_MIN_TRIANGLES/16);
+		for(unsigned int l=0; l<levels; l++)
+			msg(DEBUG, "Mesh %u: LOD %u has %u of %u triangles\n", m, l+1,
+			    lods[m].indexCount[l]/3, mesh->mNumFaces);
+		free(indices);
+	}
+	return lods;
+}
+
+/** Frees an array returned by kuhl_private_assimp_lods() or model_cache_load().
+ *
+ * @param lods The array, may be NULL.
+ * @param count The number of meshes in the scene.
+ */
+static void kuhl_private_assimp_lods_free(mesh_opt_lod *lods, unsigned int count)
+{
+	if(lods == NULL)
+		return;
+	for(unsigned int m=0; m<count; m++)
+		mesh_opt_lod_free(lods+m);
+	free(lods);
+}
+
+/** Reorders the triangles and vertices of the meshes in a scene that
+ * ASSIMP just imported so that they can be drawn faster (see
+ * mesh-opt.h). Meshes that contain anything other than triangles or
+ * that have morph targets are left alone.
+ *
+ * @param scene The scene to change. It must not be a scene that
+ * model_cache_load() returned.
+ */
+static void kuhl_private_assimp_optimize(const struct aiScene *scene)
+{
+	for(unsigned int m=0; m<scene->mNumMeshes; m++)
+	{
+		/* ASSIMP returns a const scene but the scene belongs to us
+		 * until we free it. */
+		struct aiMesh *mesh = (struct aiMesh*) scene->mMeshes[m];
+		size_t indexCount;
+		unsigned int *indices = kuhl_private_assimp_triangles(mesh, &indexCount);
+		if(indices == NULL)
+			continue;
+		size_t vertexCount = mesh->mNumVertices;
+
+		float before = mesh_opt_acmr(indices, indexCount, vertexCount);
+		mesh_opt_vertex_cache(indices, indexCount, vertexCount);
+		mesh_opt_overdraw(indices, indexCount, (const float*) mesh->mVertices, 3, vertexCount, 1.05f);
+		unsigned int *remap = kuhl_malloc(sizeof(unsigned int)*vertexCount);
+		mesh_opt_vertex_fetch(remap, indices, indexCount, vertexCount);
+		msg(DEBUG, "Mesh %u: %u triangles, ACMR %.3f -> %.3f\n", m, mesh->mNumFaces,
+		    before, mesh_opt_acmr(indices, indexCount, vertexCount));
+
+		for(unsigned int f=0; f<mesh->mNumFaces; f++)
+			memcpy(mesh->mFaces[f].mIndices, indices+3*f, sizeof(unsigned int)*3);
+		kuhl_private_assimp_permute(mesh->mVertices,   sizeof(struct aiVector3D), remap, vertexCount);
+		kuhl_private_assimp_permute(mesh->mNormals,    sizeof(struct aiVector3D), remap, vertexCount);
+		kuhl_private_assimp_permute(mesh->mTangents,   sizeof(struct aiVector3D), remap, vertexCount);
+		kuhl_private_assimp_permute(mesh->mBitangents, sizeof(struct aiVector3D), remap, vertexCount);
+		for(int i=0; i<AI_MAX_NUMBER_OF_COLOR_SETS; i++)
+			kuhl_private_assimp_permute(mesh->mColors[i], sizeof(struct aiColor4D), remap, vertexCount);
+		for(int i=0; i<AI_MAX_NUMBER_OF_TEXTURECOORDS; i++)
+			kuhl_private_assimp_permute(mesh->mTextureCoords[i], sizeof(struct aiVector3D), remap, vertexCount);
+		for(unsigned int b=0; b<mesh->mNumBones; b++)
 		{
-			msg(ERROR, "modelFile was NULL");
-			exit(EXIT_FAILURE);
+			struct aiBone *bone = mesh->mBones[b];
+			for(unsigned int w=0; w<bone->mNumWeights; w++)
+				bone->mWeights[w].mVertexId = remap[bone->mWeights[w].mVertexId];
 		}
-		char *editable = strdup(modelFile);
-		char *dname = dirname(editable);
-		snprintf(fullpath, 1024, "%s/%s", dname, textureFile);
-		free(editable);
+		free(remap);
+		free(indices);
 	}
-	else
-		snprintf(fullpath, 1024, "%s/%s", textureDir, textureFile);
-	return fullpath;
 }
 
-
-/** Uses ASSIMP to load model (if needed) and returns ASSIMP aiScene
- * object. This function also reads texture files that the model
- * refers to. This function does not create any kuhl_geometry structs
- * for the model.
+/** Uses ASSIMP to load a model and returns an ASSIMP aiScene
+ * object. This function doesn't use OpenGL and doesn't read the
+ * textures that the model refers to, so it may be called on any
+ * thread.
  *
  * @param modelFilename The filename of a model to load.
  *
- * @param textureDirname The directory the textures for the model are
- * stored in. If textureDirname is NULL, we assume that the textures
- * are in the same directory as the model file.
+ * @param lods Set to an array with the simplified versions of each
+ * mesh (see kuhl_private_assimp_lods()) or NULL. Free it with
+ * kuhl_private_assimp_lods_free().
  *
  * @return An ASSIMP aiScene object for the requested model. Returns
  * NULL on error.
  */
-static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename, const char *textureDirname)
+static const struct aiScene* kuhl_private_assimp_import(const char *modelFilename, mesh_opt_lod **lods)
 {
+	*lods = NULL;
 	/* If we get here, we need to add the file to the sceneMap. */
 	msg(INFO, "Loading model: %s\n", modelFilename);
 
-	/* Write assimp messages to msg log */
-	struct aiLogStream stream;
-	stream = aiGetPredefinedLogStream(aiDefaultLogStream_STDOUT,NULL);
-	if(stream.callback != msg_assimp_callback)
-	{
-		// we only need to set this up once.
-		stream.callback = msg_assimp_callback;
-		stream.user = strdup(modelFilename); // memory leak
-		aiAttachLogStream(&stream);
-	}
-	
 	/* Try loading the model. We are using a postprocessing preset
 	 * here so we don't have to set many options. */
 	char *modelFilenameVarying = strdup(modelFilename); // aiImportFile doesn't declare filaname parameter as const!
@@ -2267,13 +6044,35 @@ static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename,
 
 	// If we are generating smooth normals, don't smooth edges that
 	// are 80 degrees or higher (i.e., use flat normals on a cube).
-	struct aiPropertyStore* propStore = aiCreatePropertyStore();
-	aiSetImportPropertyFloat(propStore, "PP_GSN_MAX_SMOOTHING_ANGLE", 50.0f);
-	// Import/load the model
 	int aiProcessFlags = aiProcess_Triangulate|aiProcess_SortByPType; // required! Use only these flags for fast loading.
 	// aiProcessFlags |= aiProcessPreset_TargetRealtime_Fast;    // a bit slower, adds additional processing
 	aiProcessFlags |= aiProcessPreset_TargetRealtime_Quality; // Does even more processing during model load.
-	const struct aiScene* scene = aiImportFileExWithProperties(modelFilenameVarying, aiProcessFlags, NULL, propStore);
+
+	/* If we have imported this model with the same flags before,
+	 * use the already processed scene in the cache file (see
+	 * model-cache.h). */
+	unsigned int cacheOptions = 0;
+	if(kuhl_private_assimp_optimize_enabled())
+		cacheOptions |= MODEL_CACHE_MESH_OPT;
+	if(kuhl_private_assimp_lods_enabled())
+		cacheOptions |= MODEL_CACHE_LOD;
+	const struct aiScene* scene = model_cache_load(modelFilename, aiProcessFlags, cacheOptions, lods);
+	if(scene == NULL)
+	{
+		struct aiPropertyStore* propStore = aiCreatePropertyStore();
+		aiSetImportPropertyFloat(propStore, "PP_GSN_MAX_SMOOTHING_ANGLE", 50.0f);
+		// Import/load the model
+		scene = aiImportFileExWithProperties(modelFilenameVarying, aiProcessFlags, NULL, propStore);
+		aiReleasePropertyStore(propStore);
+		if(scene != NULL)
+		{
+			if(cacheOptions & MODEL_CACHE_MESH_OPT)
+				kuhl_private_assimp_optimize(scene);
+			if(cacheOptions & MODEL_CACHE_LOD)
+				*lods = kuhl_private_assimp_lods(scene);
+			model_cache_save(modelFilename, aiProcessFlags, cacheOptions, scene, *lods);
+		}
+	}
 	free(modelFilenameVarying);
 	if(scene == NULL)
 		return NULL;
@@ -2293,55 +6092,49 @@ static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename,
 	// Uncomment this line to print additional information about the model:
 	// kuhl_print_aiScene_info(modelFilename, scene);
 
-	/* For safety, zero out our texture ID map if it is supposed to be empty right now. */
-	if(textureIdMapSize == 0)
-	{
-		for(int i=0; i<textureIdMapMaxSize; i++)
-		{
-			textureIdMap[i].textureFileName = NULL;
-			textureIdMap[i].textureID = 0;
-		}
-	}
+	return scene;
+}
 
-	/* For each material that has a texture in the scene, try to load the corresponding texture file. */
+/** Finds the diffuse textures in a scene that haven't been loaded
+ * yet and adds them to textureIdMap and to a list. This function
+ * doesn't use OpenGL so it may be called on any thread.
+ *
+ * @param scene The scene.
+ *
+ * @param modelFilename The filename of the model.
+ *
+ * @param textureDirname The directory the textures for the model are
+ * stored in, or NULL if they are in the same directory as the model.
+ *
+ * @param textures The textures that need to be loaded are appended
+ * to this list. Each one should be loaded and its memory freed with
+ * kuhl_private_assimp_texture_create().
+ */
+static void kuhl_private_assimp_textures(const struct aiScene *scene, const char *modelFilename, const char *textureDirname,
+                                         kuhl_private_model_texture_list *textures)
+{
+	/* For each material that has a texture in the scene, find the corresponding texture file. */
 	for(unsigned int m=0; m < scene->mNumMaterials; m++)
 	{
 		struct aiString path;
 		GLuint texIndex = 0;
 
-
 		if(aiGetMaterialTexture(scene->mMaterials[m], aiTextureType_DIFFUSE,  texIndex, &path, NULL, NULL, NULL, NULL, NULL, NULL) == AI_SUCCESS)
 		{
-			/* Don't load a texture that we have already loaded. */
+			/* Don't load a texture that we have already loaded
+			 * (or that another model is loading). */
 			char *fullpath = kuhl_private_assimp_fullpath(path.data, modelFilename, textureDirname);
-			int alreadyExists = 0;
-			for(int i=0; i<textureIdMapSize; i++)
-			{
-				if(strcmp(fullpath, textureIdMap[i].textureFileName) == 0)
-				{
-					alreadyExists=1;
-					break;
-				}
-			}
-			if(alreadyExists > 0) // no need to reload an already loaded texture
-				continue;
-
-			if(kuhl_read_texture_file(fullpath, &texIndex) < 0)
-			{
-				printf("%s: WARNING: %s refers to texture %s which we could not find at %s\n", __func__, modelFilename, path.data, fullpath);
-			}
-
-			/* Store the texture information in our list structure so
-			 * we can find the textureID from the filename when we
-			 * render the scene. */
-			if(textureIdMapSize >= textureIdMapMaxSize)
+			if(kuhl_private_texture_claim(fullpath))
 			{
-				fprintf(stderr, "%s: You have loaded more textures than the hardcoded limit. Exiting.\n", __func__);
-				exit(EXIT_FAILURE);
+				kuhl_private_model_texture *tex = kuhl_private_model_texture_list_push(textures);
+				tex->fullpath = fullpath;
+				tex->name = strdup(path.data);
+				tex->modelFilename = modelFilename;
+				tex->pixels = NULL;
+				tex->width = tex->height = 0;
 			}
-			textureIdMap[textureIdMapSize].textureFileName = strdup(fullpath);
-			textureIdMap[textureIdMapSize].textureID = texIndex;
-			textureIdMapSize++;
+			else
+				free(fullpath);
 		}
 
 		/* If we failed to load a diffuse texture and there are no
@@ -2382,114 +6175,279 @@ static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename,
 				msg(DEBUG, "The material also has more than one diffuse texture.\n");
 		}
 	}
+}
+
+/** Creates the OpenGL texture for a texture that
+ * kuhl_private_assimp_textures() found, stores it in textureIdMap and
+ * frees the memory used by tex. Must be called on the thread with
+ * the OpenGL context.
+ */
+static void kuhl_private_assimp_texture_create(kuhl_private_model_texture *tex)
+{
+	GLuint texIndex = 0;
+	if(tex->pixels != NULL)
+	{
+		/* The pixels were already read on a worker thread by
+		 * kuhl_load_models(). */
+		texIndex = kuhl_read_texture_rgba_array_wrap(tex->pixels, tex->width, tex->height,
+		                                             GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
+		kuhl_free_image_rgba(tex->pixels);
+		if(texIndex == 0)
+			msg(ERROR, "Failed to create OpenGL texture from %s\n", tex->fullpath);
+	}
+	else
+	{
+		/* Textures can optionally be streamed in the
+		 * background. The model is drawn with a gray
+		 * placeholder until each texture is ready. */
+		const char *async = getenv("KUHL_TEXTURE_ASYNC");
+		if(async != NULL && strlen(async) > 0 && strcmp(async, "0") != 0)
+		{
+			texIndex = texstream_load(tex->fullpath, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, NULL, NULL);
+			if(texIndex == 0)
+				printf("%s: WARNING: %s refers to texture %s which we could not find at %s\n", __func__, tex->modelFilename, tex->name, tex->fullpath);
+		}
+		else if(kuhl_read_texture_file(tex->fullpath, &texIndex) < 0)
+		{
+			printf("%s: WARNING: %s refers to texture %s which we could not find at %s\n", __func__, tex->modelFilename, tex->name, tex->fullpath);
+		}
+	}
+
+	/* Store the texture in textureIdMap so we can find the
+	 * textureID from the filename when we create the geometry. */
+	kuhl_private_texture_set(tex->fullpath, texIndex);
+	free(tex->fullpath);
+	free(tex->name);
+}
+
+/** Uses ASSIMP to load model (if needed) and returns ASSIMP aiScene
+ * object. This function also reads texture files that the model
+ * refers to. This function does not create any kuhl_geometry structs
+ * for the model.
+ *
+ * @param modelFilename The filename of a model to load.
+ *
+ * @param textureDirname The directory the textures for the model are
+ * stored in. If textureDirname is NULL, we assume that the textures
+ * are in the same directory as the model file.
+ *
+ * @param lods Set to the simplified versions of each mesh (see
+ * kuhl_private_assimp_import()).
+ *
+ * @return An ASSIMP aiScene object for the requested model. Returns
+ * NULL on error.
+ */
+static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename, const char *textureDirname,
+                                                      mesh_opt_lod **lods)
+{
+	/* Write assimp messages to msg log */
+	kuhl_private_assimp_log_init(modelFilename);
+	const struct aiScene *scene = kuhl_private_assimp_import(modelFilename, lods);
+	if(scene == NULL)
+		return NULL;
 
+	/* Try to load the texture files used by the scene. */
+	kuhl_private_model_texture_list textures;
+	kuhl_private_model_texture_list_init(&textures);
+	kuhl_private_assimp_textures(scene, modelFilename, textureDirname, &textures);
+	for(int i=0; i<textures.length; i++)
+		kuhl_private_assimp_texture_create(textures.data+i);
+	kuhl_private_model_texture_list_free(&textures);
 	return scene;
 }
 
-/** Given a aiNodeAnim object and a time, return an appropriate
- * transformation matrix.
+/** One track (position, rotation or scaling keys) of an animation
+ * channel. The times and values of the keys are stored in separate
+ * arrays so that searching the times touches as little memory as
+ * possible. */
+typedef struct
+{
+	unsigned int count;  /**< Number of keys */
+	int components;      /**< Floats per value: 3 for position and scaling, 4 for rotation (x,y,z,w) */
+	double *times;       /**< Time of each key in ticks */
+	float *values;       /**< count*components values */
+	double step;         /**< Ticks between keys if they are evenly spaced, 0 otherwise */
+	unsigned int cursor; /**< Key found by the previous lookup */
+} kuhl_anim_track;
+
+/** An aiNodeAnim converted into kuhl_anim_tracks. */
+typedef struct
+{
+	kuhl_anim_track position;
+	kuhl_anim_track rotation;
+	kuhl_anim_track scaling;
+} kuhl_anim_channel;
+
+/** Copies the keys of an aiNodeAnim into a kuhl_anim_track.
  *
- * @param transformResult The resulting transformation matrix.
- * @param na The aiNodeAnim to generate the matrix form.
- * @param ticks The time of the animation in TICKS (not seconds!)
+ * @param track The track to fill in.
+ * @param vecKeys The position or scaling keys (NULL for rotation keys).
+ * @param quatKeys The rotation keys (NULL for position or scaling keys).
+ * @param count The number of keys.
  */
-static void kuhl_private_anim_matrix(float transformResult[16], const struct aiNodeAnim *na, double ticks)
+static void kuhl_private_anim_track_init(kuhl_anim_track *track,
+                                         const struct aiVectorKey *vecKeys,
+                                         const struct aiQuatKey *quatKeys,
+                                         unsigned int count)
 {
+	track->count = count;
+	track->components = quatKeys ? 4 : 3;
+	track->times = kuhl_malloc(sizeof(double)*(count > 0 ? count : 1));
+	track->values = kuhl_malloc(sizeof(float)*track->components*(count > 0 ? count : 1));
+	track->cursor = 0;
+	for(unsigned int k=0; k<count; k++)
+	{
+		float *v = track->values + k*track->components;
+		if(quatKeys)
+		{
+			track->times[k] = quatKeys[k].mTime;
+			vec4f_set(v, quatKeys[k].mValue.x, quatKeys[k].mValue.y,
+			          quatKeys[k].mValue.z, quatKeys[k].mValue.w);
+		}
+		else
+		{
+			track->times[k] = vecKeys[k].mTime;
+			vec3f_set(v, vecKeys[k].mValue.x, vecKeys[k].mValue.y, vecKeys[k].mValue.z);
+		}
+	}
+
+	/* Motion capture data usually has a key at every frame. If the
+	 * keys are evenly spaced, the key for a time can be calculated
+	 * instead of searched for. */
+	track->step = 0;
+	if(count > 2)
+	{
+		double step = (track->times[count-1] - track->times[0]) / (count-1);
+		int even = step > 0;
+		for(unsigned int k=1; k<count && even; k++)
+			if(fabs(track->times[k] - (track->times[0] + k*step)) > step*1e-4)
+				even = 0;
+		if(even)
+			track->step = step;
+	}
+}
 
-	/* Find indices of start and stop position keys */
-	unsigned int positionStart = 0;
-	for(unsigned int j=0; j<na->mNumPositionKeys-1; j++)
-		if(ticks < na->mPositionKeys[j+1].mTime)
+/** Finds the two keys that surround a time in a track.
+ *
+ * @param track The track to search. Its cursor is updated so that
+ * the next search is fast if time moves forward.
+ * @param ticks The time in ticks.
+ * @param factor Set to how far ticks is between the returned key and
+ * the next one (0 to 1).
+ * @return The index of the key at or before ticks. If ticks is before
+ * the first key or after the last key, the first or last key is
+ * returned and factor is 0.
+ */
+static unsigned int kuhl_private_anim_track_find(kuhl_anim_track *track, double ticks, float *factor)
+{
+	*factor = 0;
+	unsigned int last = track->count-1;
+	const double *times = track->times;
+	if(track->count < 2 || ticks <= times[0])
+		return 0;
+	if(ticks >= times[last])
+		return last;
+
+	/* Several threads may use the same track when models made from
+	 * the same scene are updated at once (see kuhl_update_models()),
+	 * so the cursor is only a hint. */
+	unsigned int k = __atomic_load_n(&(track->cursor), __ATOMIC_RELAXED);
+	if(track->step > 0) // evenly spaced keys
+	{
+		double index = (ticks - times[0]) / track->step;
+		k = index < last ? (unsigned int) index : last-1;
+	}
+	if(k >= last)
+		k = last-1;
+
+	/* Typically, time moves forward a few keys at a time. Step
+	 * forward or back a little and fall back to a binary search for
+	 * large jumps. */
+	for(int tries=0; tries<4 && ticks < times[k]; tries++)
+		k--;
+	for(int tries=0; tries<4 && ticks >= times[k+1]; tries++)
+		k++;
+	if(ticks < times[k] || ticks >= times[k+1])
+	{
+		unsigned int lo = 0, hi = last; // times[lo] <= ticks < times[hi]
+		while(hi - lo > 1)
 		{
-			positionStart = j;
-			break;
+			unsigned int mid = (lo+hi)/2;
+			if(ticks < times[mid])
+				hi = mid;
+			else
+				lo = mid;
 		}
-	unsigned int positionEnd = positionStart+1;
-	if(positionEnd >= na->mNumPositionKeys)
-		positionEnd = positionStart;
-	/* Determine where we are in relation to the two nearest keys */
-	float deltaTime = na->mPositionKeys[positionEnd].mTime - na->mPositionKeys[positionStart].mTime;
-	float factor;
+		k = lo;
+	}
+	__atomic_store_n(&(track->cursor), k, __ATOMIC_RELAXED);
+
+	double deltaTime = times[k+1] - times[k];
 	if(deltaTime != 0)
-		factor = (ticks - na->mPositionKeys[positionStart].mTime)/deltaTime;
-	else
-		factor = 0;
-	
-	/* Interpolate between two nearest keys */
-	float positionValStart[3] = { na->mPositionKeys[positionStart].mValue.x,
-	                              na->mPositionKeys[positionStart].mValue.y,
-	                              na->mPositionKeys[positionStart].mValue.z };
-	float positionValEnd[3] = { na->mPositionKeys[positionEnd].mValue.x,
-	                            na->mPositionKeys[positionEnd].mValue.y,
-	                            na->mPositionKeys[positionEnd].mValue.z };
+		*factor = (ticks - times[k]) / deltaTime;
+	return k;
+}
+
+/** Interpolates the value of a position or scaling track at a time.
+ *
+ * @param result The interpolated value.
+ * @param track The track.
+ * @param ticks The time in ticks.
+ */
+static void kuhl_private_anim_track_vec3f(float result[3], kuhl_anim_track *track, double ticks)
+{
+	if(track->count == 0)
+	{
+		vec3f_set(result, 0, 0, 0);
+		return;
+	}
+	float factor;
+	unsigned int k = kuhl_private_anim_track_find(track, ticks, &factor);
+	const float *start = track->values + 3*k;
+	if(factor == 0)
+	{
+		vec3f_copy(result, start);
+		return;
+	}
+	const float *end = start+3;
+	for(int i=0; i<3; i++)
+		result[i] = start[i]*(1-factor) + end[i]*factor;
+}
+
+/** Given an animation channel and a time, return an appropriate
+ * transformation matrix.
+ *
+ * @param transformResult The resulting transformation matrix.
+ * @param channel The channel to generate the matrix from.
+ * @param ticks The time of the animation in TICKS (not seconds!)
+ */
+static void kuhl_private_anim_matrix(float transformResult[16], kuhl_anim_channel *channel, double ticks)
+{
+	/* Interpolate between the two nearest position keys */
 	float positionValMid[3];
-	vec3f_scalarMult(positionValStart, (1-factor));
-	vec3f_scalarMult(positionValEnd, factor);
-	vec3f_add_new(positionValMid, positionValStart, positionValEnd);
+	kuhl_private_anim_track_vec3f(positionValMid, &(channel->position), ticks);
 	float positionMatrix[16];
 	mat4f_translateVec_new(positionMatrix, positionValMid);
 
-	/* Find indices of start and stop rotation keys */
-	unsigned int rotationStart = 0;
-	for(unsigned int j=0; j<na->mNumRotationKeys-1; j++)
-		if(ticks < na->mRotationKeys[j+1].mTime)
-		{
-			rotationStart = j;
-			break;
-		}
-	unsigned int rotationEnd = rotationStart+1;
-	if(rotationEnd >= na->mNumRotationKeys)
-		rotationEnd = rotationStart;
-	/* Determine where we are in relation to the two nearest keys */
-	deltaTime = na->mRotationKeys[rotationEnd].mTime - na->mRotationKeys[rotationStart].mTime;
-	if(deltaTime != 0)
-		factor = (ticks - na->mRotationKeys[rotationStart].mTime)/deltaTime;
-	else
-		factor = 0;
-	/* Interpolate between two nearest keys */
-	float rotationValStart[4] = { na->mRotationKeys[rotationStart].mValue.x,
-	                              na->mRotationKeys[rotationStart].mValue.y,
-	                              na->mRotationKeys[rotationStart].mValue.z,
-	                              na->mRotationKeys[rotationStart].mValue.w };
-	float rotationValEnd[4] = { na->mRotationKeys[rotationEnd].mValue.x,
-	                            na->mRotationKeys[rotationEnd].mValue.y,
-	                            na->mRotationKeys[rotationEnd].mValue.z,
-	                            na->mRotationKeys[rotationEnd].mValue.w };
-	float rotationValMid[4];
-	//vec4f_normalize(rotationValStart);
-	//vec4f_normalize(rotationValEnd);
-	quatf_slerp_new(rotationValMid, rotationValStart, rotationValEnd, factor);
+	/* Interpolate between the two nearest rotation keys */
+	float rotationValMid[4] = { 0, 0, 0, 1 };
+	if(channel->rotation.count > 0)
+	{
+		float factor;
+		unsigned int k = kuhl_private_anim_track_find(&(channel->rotation), ticks, &factor);
+		const float *rotationValStart = channel->rotation.values + 4*k;
+		if(factor == 0)
+			vec4f_copy(rotationValMid, rotationValStart);
+		else
+			quatf_slerp_new(rotationValMid, rotationValStart, rotationValStart+4, factor);
+	}
 	float rotationMatrix[16];
 	mat4f_rotateQuatVec_new(rotationMatrix, rotationValMid);
 
-	/* Find indices of start and stop scaling keys */
-	unsigned int scalingStart = 0;
-	for(unsigned int j=0; j<na->mNumScalingKeys-1; j++)
-		if(ticks < na->mScalingKeys[j+1].mTime)
-		{
-			scalingStart = j;
-			break;
-		}
-	unsigned int scalingEnd = scalingStart+1;
-	if(scalingEnd >= na->mNumScalingKeys)
-		scalingEnd = scalingStart;
-	/* Determine where we are in relation to the two nearest keys */
-	deltaTime = na->mScalingKeys[scalingEnd].mTime - na->mScalingKeys[scalingStart].mTime;
-	if(deltaTime != 0)
-		factor = (ticks - na->mScalingKeys[scalingStart].mTime)/deltaTime;
-	else
-		factor = 0;
-	/* Interpolate between two nearest keys */
-	float scalingValStart[3] = { na->mScalingKeys[scalingStart].mValue.x,
-	                             na->mScalingKeys[scalingStart].mValue.y,
-	                             na->mScalingKeys[scalingStart].mValue.z };
-	float scalingValEnd[3] = { na->mScalingKeys[scalingEnd].mValue.x,
-	                           na->mScalingKeys[scalingEnd].mValue.y,
-	                           na->mScalingKeys[scalingEnd].mValue.z };
-	float scalingValMid[3];
-	vec3f_scalarMult(scalingValStart, (1-factor));
-	vec3f_scalarMult(scalingValEnd, factor);
-	vec3f_add_new(scalingValMid, scalingValStart, scalingValEnd);
+	/* Interpolate between the two nearest scaling keys */
+	float scalingValMid[3] = { 1, 1, 1 };
+	if(channel->scaling.count > 0)
+		kuhl_private_anim_track_vec3f(scalingValMid, &(channel->scaling), ticks);
 	float scalingMatrix[16];
 	mat4f_scaleVec_new(scalingMatrix, scalingValMid);
 	
@@ -2519,6 +6477,10 @@ static void kuhl_private_anim_matrix(float transformResult[16], const struct aiN
  * for. If time is negative, this function is guaranteed to return the
  * transformation matrix in the node.
  *
+ * @param channel The channel in the animation that corresponds to the
+ * node (see kuhl_scene_nodes), or NULL if the animation doesn't move
+ * the node.
+ *
  * @return Returns 1 if we successfully returned a matrix based on
  * animation information. Returns 0 if we simply returned the
  * transformation matrix in the node itself.
@@ -2526,7 +6488,8 @@ static void kuhl_private_anim_matrix(float transformResult[16], const struct aiN
 static int kuhl_private_node_matrix(float transformResult[16],
                                     const struct aiScene *scene,
                                     const struct aiNode *node,
-                                    unsigned int animationNum, double t)
+                                    unsigned int animationNum, double t,
+                                    kuhl_anim_channel *channel)
 {
 	/* Copy the transform matrix from the node itself. This is the
 	 * matrix that the user will see if we are unable to find the
@@ -2547,21 +6510,218 @@ static int kuhl_private_node_matrix(float transformResult[16],
 	if(currentTick > anim->mDuration)
 		return 0;
 
-	/* Find the channel corresponding to the node name passed in as
-	 * parameter. */
-	for(unsigned int i=0; i<anim->mNumChannels; i++)
+	if(channel == NULL)
+		return 0;
+
+	/* Get this node's matrix according to the animation
+	 * information. */
+	kuhl_private_anim_matrix(transformResult, channel, currentTick);
+	return 1;
+}
+
+
+/** The nodes of an ASSIMP scene flattened into an array where every
+ * node comes after its parent. This lets kuhl_update_model()
+ * calculate the world matrix of every node with one pass through the
+ * array instead of walking up to the root for every mesh and
+ * bone. */
+typedef struct kuhl_scene_nodes
+{
+	const struct aiScene *scene;
+	unsigned int count;          /**< Number of nodes in the scene */
+	const struct aiNode **nodes; /**< The nodes, parents before children */
+	int *parent;                 /**< Index of the parent of each node (-1 for the root) */
+	kuhl_anim_channel **channel; /**< channel[a*count+i] is the channel of animation a that moves node i (NULL if none) */
+	struct kuhl_scene_nodes *next;
+} kuhl_scene_nodes;
+
+/** All scenes that kuhl_update_model() has been used with. */
+static kuhl_scene_nodes *kuhl_private_scene_nodes_list = NULL;
+/** Protects kuhl_private_scene_nodes_list when models are updated by
+ * several threads (see kuhl_update_models()). */
+static pthread_mutex_t kuhl_private_scene_nodes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** World matrix of each node of the scene that is being updated. Each
+ * thread has its own so that several models made from the same scene
+ * can be updated at once. */
+static __thread float (*kuhl_private_world)[16] = NULL;
+static __thread unsigned int kuhl_private_world_capacity = 0;
+
+/** Counts a node and all of its descendants. */
+static unsigned int kuhl_private_count_nodes(const struct aiNode *node)
+{
+	unsigned int count = 1;
+	for(unsigned int i=0; i<node->mNumChildren; i++)
+		count += kuhl_private_count_nodes(node->mChildren[i]);
+	return count;
+}
+
+/** Adds a node and its descendants to the flattened nodes in the same
+ * order that kuhl_assimp_find_node() searches them.
+ *
+ * @param sn The flattened nodes.
+ * @param node The node to add.
+ * @param parent The index of the parent node (-1 for the root).
+ * @param added The number of nodes that have been added so far.
+ * @return The number of nodes that have been added.
+ */
+static unsigned int kuhl_private_flatten_nodes(kuhl_scene_nodes *sn, const struct aiNode *node, int parent, unsigned int added)
+{
+	int index = added;
+	sn->nodes[index] = node;
+	sn->parent[index] = parent;
+	added++;
+	for(unsigned int i=0; i<node->mNumChildren; i++)
+		added = kuhl_private_flatten_nodes(sn, node->mChildren[i], index, added);
+	return added;
+}
+
+/** Frees the flattened nodes of a scene (if kuhl_update_model() has
+ * created them). Called when geometry made from the scene is deleted;
+ * the nodes are created again if other geometry from the scene is
+ * updated later.
+ *
+ * @param scene The scene whose flattened nodes should be freed.
+ */
+static void kuhl_private_scene_nodes_free(const struct aiScene *scene)
+{
+	pthread_mutex_lock(&kuhl_private_scene_nodes_mutex);
+	kuhl_scene_nodes **prev = &kuhl_private_scene_nodes_list;
+	while(*prev != NULL && (*prev)->scene != scene)
+		prev = &((*prev)->next);
+	kuhl_scene_nodes *sn = *prev;
+	if(sn != NULL)
+		*prev = sn->next;
+	pthread_mutex_unlock(&kuhl_private_scene_nodes_mutex);
+	if(sn == NULL)
+		return;
+
+	unsigned int numAnim = scene->mNumAnimations;
+	for(unsigned int i=0; i<sn->count*numAnim; i++)
 	{
-		if(strcmp(anim->mChannels[i]->mNodeName.data, node->mName.data) == 0)
+		kuhl_anim_channel *channel = sn->channel[i];
+		if(channel == NULL)
+			continue;
+		kuhl_anim_track *tracks[3] = { &(channel->position), &(channel->rotation), &(channel->scaling) };
+		for(int t=0; t<3; t++)
 		{
-			/* Get this node's matrix according to the animation
-			 * information. */
-			struct aiNodeAnim *na = anim->mChannels[i];
-			kuhl_private_anim_matrix(transformResult, na, currentTick);
-			return 1;
+			free(tracks[t]->times);
+			free(tracks[t]->values);
 		}
+		free(channel);
 	}
+	free(sn->channel);
+	free(sn->parent);
+	free(sn->nodes);
+	free(sn);
+}
 
-	return 0;
+/** Finds the flattened nodes of a scene, creating them the first
+ * time the scene is used.
+ *
+ * @param scene The scene to find the nodes of.
+ * @return The flattened nodes of the scene.
+ */
+static kuhl_scene_nodes* kuhl_private_scene_nodes(const struct aiScene *scene)
+{
+	pthread_mutex_lock(&kuhl_private_scene_nodes_mutex);
+	for(kuhl_scene_nodes *sn = kuhl_private_scene_nodes_list; sn != NULL; sn = sn->next)
+		if(sn->scene == scene)
+		{
+			pthread_mutex_unlock(&kuhl_private_scene_nodes_mutex);
+			return sn;
+		}
+
+	kuhl_scene_nodes *sn = kuhl_malloc(sizeof(kuhl_scene_nodes));
+	sn->scene = scene;
+	sn->count = kuhl_private_count_nodes(scene->mRootNode);
+	sn->nodes = kuhl_malloc(sizeof(struct aiNode*)*sn->count);
+	sn->parent = kuhl_malloc(sizeof(int)*sn->count);
+
+	kuhl_private_flatten_nodes(sn, scene->mRootNode, -1, 0);
+
+	/* Match the animation channels to the nodes by name once instead
+	 * of every frame. */
+	unsigned int numAnim = scene->mNumAnimations;
+	sn->channel = kuhl_malloc(sizeof(kuhl_anim_channel*)*sn->count*(numAnim > 0 ? numAnim : 1));
+	for(unsigned int a=0; a<numAnim; a++)
+	{
+		kuhl_anim_channel **channel = sn->channel + a*sn->count;
+		const struct aiAnimation *anim = scene->mAnimations[a];
+		for(unsigned int i=0; i<sn->count; i++)
+		{
+			channel[i] = NULL;
+			for(unsigned int c=0; c<anim->mNumChannels; c++)
+			{
+				const struct aiNodeAnim *na = anim->mChannels[c];
+				if(strcmp(na->mNodeName.data, sn->nodes[i]->mName.data) == 0)
+				{
+					channel[i] = kuhl_malloc(sizeof(kuhl_anim_channel));
+					kuhl_private_anim_track_init(&(channel[i]->position), na->mPositionKeys, NULL, na->mNumPositionKeys);
+					kuhl_private_anim_track_init(&(channel[i]->rotation), NULL, na->mRotationKeys, na->mNumRotationKeys);
+					kuhl_private_anim_track_init(&(channel[i]->scaling), na->mScalingKeys, NULL, na->mNumScalingKeys);
+					break;
+				}
+			}
+		}
+	}
+
+	sn->next = kuhl_private_scene_nodes_list;
+	kuhl_private_scene_nodes_list = sn;
+	pthread_mutex_unlock(&kuhl_private_scene_nodes_mutex);
+	return sn;
+}
+
+/** Finds the index of a node in the flattened nodes of a scene.
+ *
+ * @param sn The flattened nodes.
+ * @param node The node to look for (or NULL).
+ * @param name If node is NULL, look for a node with this name instead.
+ * @return The index of the node or -1 if it wasn't found.
+ */
+static int kuhl_private_scene_node_index(const kuhl_scene_nodes *sn, const struct aiNode *node, const char *name)
+{
+	for(unsigned int i=0; i<sn->count; i++)
+		if(sn->nodes[i] == node || (node == NULL && strcmp(sn->nodes[i]->mName.data, name) == 0))
+			return i;
+	return -1;
+}
+
+/** Calculates the world matrix of every node in a scene at a certain
+ * time in an animation. Each node's animation matrix is calculated
+ * once and multiplied with its parent's world matrix.
+ *
+ * @param sn The flattened nodes of the scene.
+ * @param animationNum The animation to use.
+ * @param time The time in seconds (negative for the bind pose).
+ * @return The world matrix of each node. The matrices are only valid
+ * until this function is called again on the same thread.
+ */
+static float (*kuhl_private_scene_nodes_update(const kuhl_scene_nodes *sn, unsigned int animationNum, float time))[16]
+{
+	if(kuhl_private_world_capacity < sn->count)
+	{
+		free(kuhl_private_world);
+		kuhl_private_world = kuhl_malloc(sizeof(float)*16*sn->count);
+		kuhl_private_world_capacity = sn->count;
+	}
+	float (*world)[16] = kuhl_private_world;
+
+	kuhl_anim_channel **channel = NULL;
+	if(animationNum < sn->scene->mNumAnimations)
+		channel = sn->channel + animationNum*sn->count;
+
+	for(unsigned int i=0; i<sn->count; i++)
+	{
+		float local[16];
+		kuhl_private_node_matrix(local, sn->scene, sn->nodes[i], animationNum, time,
+		                         channel ? channel[i] : NULL);
+		if(sn->parent[i] < 0)
+			mat4f_copy(world[i], local);
+		else
+			mat4f_mult_mat4f_new(world[i], world[sn->parent[i]], local);
+	}
+	return world;
 }
 
 
@@ -2594,14 +6754,35 @@ kuhl_geometry* kuhl_geometry_append(kuhl_geometry *a, kuhl_geometry *b)
 
 
 
+/** Options used by kuhl_load_model(). Set with kuhl_load_model_options(). */
+static int kuhl_private_load_model_options = KG_NONE;
+
+/** Changes how kuhl_load_model() creates kuhl_geometry objects for
+ * models that are loaded after this function is called.
+ *
+ * @param kg_options Set to KG_INTERLEAVED to store all of the vertex
+ * attributes of each mesh in a single interleaved buffer (see
+ * kuhl_geometry_attrib_interleaved()). Set to KG_POOLED to pack the
+ * vertices and indices of all meshes into large shared buffers (see
+ * kuhl_geometry_pool()). Set to KG_NONE (the default) to use one
+ * buffer per attribute.
+ */
+void kuhl_load_model_options(int kg_options)
+{
+	kuhl_private_load_model_options = kg_options;
+}
+
 /** Recursively calls itself to create one or more kuhl_geometry
  * structs for all of the nodes in the scene.
  *
  * @param sc The scene that we want to render.
  *
+ * @param lods The simplified versions of each mesh in the scene or NULL.
+ *
  * @param nd The current node that we are rendering.
  */
 static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
+                                              const mesh_opt_lod *lods,
                                               const struct aiNode* nd,
                                               GLuint program,
                                               float currentTransform[16],
@@ -2701,6 +6882,19 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 		geom->assimp_scene = (struct aiScene*) sc;
 		mat4f_copy(geom->matrix, currentTransform);
 
+		/* Collect the vertex attributes for this mesh so that they
+		 * can be stored in separate buffers or in a single
+		 * interleaved buffer. */
+		const GLfloat *attribData[6];
+		GLuint attribComps[6];
+		const char *attribNames[6];
+		int attribWarn[6];
+		unsigned int attribCount = 0;
+#define KUHL_PRIVATE_MESH_ATTRIB(d, c, n, w) do { \
+			attribData[attribCount] = (d); attribComps[attribCount] = (c); \
+			attribNames[attribCount] = (n); attribWarn[attribCount] = (w); \
+			attribCount++; } while(0)
+
 		/* Store the vertex position attribute into the kuhl_geometry struct */
 		float *vertexPositions = kuhl_malloc(sizeof(float)*mesh->mNumVertices*3);
 		for(unsigned int i=0; i<mesh->mNumVertices; i++)
@@ -2709,8 +6903,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 			vertexPositions[i*3+1] = (mesh->mVertices)[i].y;
 			vertexPositions[i*3+2] = (mesh->mVertices)[i].z;
 		}
-		kuhl_geometry_attrib(geom, vertexPositions, 3, "in_Position", 0);
-		free(vertexPositions);
+		KUHL_PRIVATE_MESH_ATTRIB(vertexPositions, 3, "in_Position", 0);
 
 		/* Store the normal vectors in the kuhl_geometry struct */
 		if(mesh->mNormals != NULL)
@@ -2722,8 +6915,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 				normals[i*3+1] = (mesh->mNormals)[i].y;
 				normals[i*3+2] = (mesh->mNormals)[i].z;
 			}
-			kuhl_geometry_attrib(geom, normals, 3, "in_Normal", 0);
-			free(normals);
+			KUHL_PRIVATE_MESH_ATTRIB(normals, 3, "in_Normal", 0);
 		}
 
 		/* Store the vertex color attribute */
@@ -2740,8 +6932,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 				if(colorComps == 4)
 					colors[i*colorComps+3] = mesh->mColors[0][i].a;
 			}
-			kuhl_geometry_attrib(geom, colors, colorComps, "in_Color", 0);
-			free(colors);
+			KUHL_PRIVATE_MESH_ATTRIB(colors, colorComps, "in_Color", 0);
 		}
 		/* If there are no vertex colors, try to use material colors instead */
 		else
@@ -2762,7 +6953,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 					colors[i*3+1] = diffuse.g;
 					colors[i*3+2] = diffuse.b;
 				}
-				kuhl_geometry_attrib(geom, colors, 3, "in_Color", 0);
+				KUHL_PRIVATE_MESH_ATTRIB(colors, 3, "in_Color", 0);
 			}
 		}
 		
@@ -2776,14 +6967,16 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 				texCoord[i*2+0] = mesh->mTextureCoords[0][i].x;
 				texCoord[i*2+1] = mesh->mTextureCoords[0][i].y;
 			}
-			kuhl_geometry_attrib(geom, texCoord, 2, "in_TexCoord", 1);
-			free(texCoord);
+			KUHL_PRIVATE_MESH_ATTRIB(texCoord, 2, "in_TexCoord", 1);
 		}
 
 		/* Fill in bone information */
 		if(mesh->mBones != NULL && mesh->mNumBones > 0)
 		{
-			if(mesh->mNumBones > MAX_BONES)
+			/* Meshes with many bones need a shader storage block to
+			 * hold their matrices. */
+			if(mesh->mNumBones > MAX_BONES &&
+			   !(GLEW_VERSION_4_3 || GLEW_ARB_shader_storage_buffer_object))
 			{
 				printf("%s: This mesh has %d bones but we only support %d\n",
 				       __func__, mesh->mNumBones, MAX_BONES);
@@ -2835,11 +7028,11 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 					exit(EXIT_FAILURE);
 				}
 			}
-			kuhl_geometry_attrib(geom, indices, 4, "in_BoneIndex", 0);
-			kuhl_geometry_attrib(geom, weights, 4, "in_BoneWeight", 0);
-			free(indices);
-			free(weights);
+			KUHL_PRIVATE_MESH_ATTRIB(indices, 4, "in_BoneIndex", 0);
+			KUHL_PRIVATE_MESH_ATTRIB(weights, 4, "in_BoneWeight", 0);
 		} // end if there are bones 
+#undef KUHL_PRIVATE_MESH_ATTRIB
+
 		
 		/* Find our texture and tell our kuhl_geometry object about
 		 * it. */
@@ -2849,14 +7042,9 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 		                                      aiTextureType_DIFFUSE, texIndex, &texPath,
 		                                      NULL, NULL, NULL, NULL, NULL, NULL))
 		{
-			GLuint texture = 0;
-			for(int i=0; i<textureIdMapSize; i++)
-			{
-				char *fullpath = kuhl_private_assimp_fullpath(texPath.data, modelFilename, textureDirname);
-				if(strcmp(textureIdMap[i].textureFileName, fullpath) == 0)
-					texture = textureIdMap[i].textureID;
-				free(fullpath);
-			}
+			char *fullpath = kuhl_private_assimp_fullpath(texPath.data, modelFilename, textureDirname);
+			GLuint texture = kuhl_private_texture_get(fullpath);
+			free(fullpath);
 			if(texture == 0)
 			{
 				printf("%s: WARNING: Mesh %u uses texture '%s'. This texture should have been loaded earlier, but we can't find it now.\n",
@@ -2875,20 +7063,60 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 			}
 		}
 
+		/* Get indices to draw with */
+		GLuint numIndices = 0;
+		GLuint *indices = NULL;
 		if(mesh->mNumFaces > 0)
 		{
-			/* Get indices to draw with */
-			GLuint numIndices = mesh->mNumFaces * meshPrimitiveType;
-			GLuint *indices = kuhl_malloc(sizeof(GLuint)*numIndices);
-			for(unsigned int t = 0; t<mesh->mNumFaces; t++) // for each face
+			numIndices = mesh->mNumFaces * meshPrimitiveType;
+			indices = kuhl_malloc(sizeof(GLuint)*numIndices);
+			for(unsigned int t = 0; t<mesh->mNumFaces; t++) // for each face
+			{
+				const struct aiFace* face = &mesh->mFaces[t];
+				for(unsigned int x = 0; x < meshPrimitiveType; x++) // for each index
+					indices[t*meshPrimitiveType+x] = face->mIndices[x];
+			}
+		}
+
+		/* Upload the vertex attributes and indices. Geometry stored
+		 * in shared buffers is always interleaved. */
+		int loadOptions = kuhl_private_load_model_options;
+		if(loadOptions & (KG_INTERLEAVED|KG_POOLED))
+		{
+			/* Warn about missing attributes (i.e., texture
+			 * coordinates) just as kuhl_geometry_attrib() would. */
+			for(unsigned int i=0; i<attribCount; i++)
+				if(attribWarn[i] && glGetAttribLocation(program, attribNames[i]) == -1)
+					msg(WARNING, "Unable to add attribute '%s' to the geometry object because it was missing or inactive in program %d\n",
+					    attribNames[i], program);
+		}
+		/* Simplified versions of the mesh are stored after the
+		 * indices in the mesh's own index buffer. */
+		const mesh_opt_lod *lod = lods ? lods + nd->mMeshes[n] : NULL;
+		int hasLods = lod != NULL && lod->levels > 0 && numIndices > 0;
+		int pooled = 0;
+		if((loadOptions & KG_POOLED) && !hasLods)
+			pooled = kuhl_private_geometry_store_pooled(geom, attribCount, attribData, attribComps,
+			                                            attribNames, indices, numIndices);
+		if(!pooled)
+		{
+			if(loadOptions & (KG_INTERLEAVED|KG_POOLED))
+				kuhl_geometry_attrib_interleaved(geom, attribCount, attribData,
+				                                 attribComps, attribNames, KG_NONE);
+			else
 			{
-				const struct aiFace* face = &mesh->mFaces[t];
-				for(unsigned int x = 0; x < meshPrimitiveType; x++) // for each index
-					indices[t*meshPrimitiveType+x] = face->mIndices[x];
+				for(unsigned int i=0; i<attribCount; i++)
+					kuhl_geometry_attrib(geom, attribData[i], attribComps[i],
+					                     attribNames[i], attribWarn[i]);
 			}
-			kuhl_geometry_indices(geom, indices, numIndices);
-			free(indices);
+			if(numIndices > 0)
+				kuhl_geometry_indices(geom, indices, numIndices);
+			if(hasLods)
+				kuhl_geometry_lods(geom, lod->levels, (GLuint**) lod->indices, lod->indexCount);
 		}
+		for(unsigned int i=0; i<attribCount; i++)
+			free((GLfloat*) attribData[i]);
+		free(indices);
 
 
 		/* Initialize list of bone matrices if this mesh has bones. */
@@ -2897,12 +7125,20 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 			kuhl_bonemat *bones = (kuhl_bonemat*) kuhl_malloc(sizeof(kuhl_bonemat));
 			bones->count = mesh->mNumBones;
 			bones->mesh = n;
+			bones->boneList = (const struct aiBone**) kuhl_malloc(sizeof(struct aiBone*)*mesh->mNumBones);
+			bones->nodeIndex = (int*) kuhl_malloc(sizeof(int)*mesh->mNumBones);
 			for(unsigned int b=0; b < mesh->mNumBones; b++)
+			{
 				bones->boneList[b] = mesh->mBones[b];
-			// set any unused bone matrices to the identity.
-			for(unsigned int b=mesh->mNumBones; b < MAX_BONES; b++)
-				mat4f_identity(bones->matrices[b]);
+				bones->nodeIndex[b] = -1;
+			}
+			// The matrices are allocated by kuhl_private_bone_palette()
+			bones->matrices = NULL;
+			bones->palette = NULL;
+			bones->offset = 0;
+			bones->shared = 0;
 			geom->bones = bones;
+			kuhl_private_geometry_uniforms(geom);
 		}
 
 		msg(DEBUG, "Mesh #%03u in node \"%s\" (node has %d meshes): verts=%d indices=%d primType=%d normals=%s colors=%s texCoords=%s bones=%d tex=%s\n",
@@ -2920,7 +7156,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 	/* Process all of the meshes in the aiNode's children too */
 	for (unsigned int i = 0; i < nd->mNumChildren; i++)
 	{
-		kuhl_geometry *child_geom = kuhl_private_load_model(sc, nd->mChildren[i], program, currentTransform, modelFilename, textureDirname);
+		kuhl_geometry *child_geom = kuhl_private_load_model(sc, lods, nd->mChildren[i], program, currentTransform, modelFilename, textureDirname);
 		first_geom = kuhl_geometry_append(first_geom, child_geom);
 	}
 
@@ -2932,132 +7168,520 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 }
 
 
-/** Setup a model to draw at a specific time.
+/** Checks if two meshes are deformed by the same bones in the same
+ * order so that they can share their bone matrices. */
+static int kuhl_private_bones_equal(const kuhl_bonemat *a, const kuhl_bonemat *b)
+{
+	if(a->count != b->count)
+		return 0;
+	for(int i=0; i<a->count; i++)
+	{
+		const struct aiBone *boneA = a->boneList[i];
+		const struct aiBone *boneB = b->boneList[i];
+		if(strcmp(boneA->mName.data, boneB->mName.data) != 0 ||
+		   memcmp(&(boneA->mOffsetMatrix), &(boneB->mOffsetMatrix), sizeof(boneA->mOffsetMatrix)) != 0)
+			return 0;
+	}
+	return 1;
+}
 
-    @param modelFilename Name of model file to update.
+/** Stores the bone matrices of every mesh in a model in a single
+ * kuhl_bonepalette. Each mesh uses a range of the palette that starts
+ * at an offset that can be bound with glBindBufferRange(). Meshes that
+ * have identical bones share the same range.
+ *
+ * @param first_geom The model.
+ */
+static void kuhl_private_bone_palette(kuhl_geometry *first_geom)
+{
+	/* Find the alignment (in matrices) of buffer ranges. */
+	GLint alignBytes = 0;
+	if(GLEW_VERSION_3_1 || GLEW_ARB_uniform_buffer_object)
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignBytes);
+	if(GLEW_VERSION_4_3 || GLEW_ARB_shader_storage_buffer_object)
+	{
+		GLint ssboAlign = 0;
+		glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &ssboAlign);
+		if(ssboAlign > alignBytes)
+			alignBytes = ssboAlign;
+	}
+	int align = (alignBytes + (int) sizeof(float)*16 - 1) / ((int) sizeof(float)*16);
+	if(align < 1)
+		align = 1;
 
-    @param animationNum The animation to use. If the file only
-    contains one animation, set it to 0.
+	int count = 0;
+	for(kuhl_geometry *g = first_geom; g != NULL; g=g->next)
+	{
+		if(g->bones == NULL)
+			continue;
+		for(kuhl_geometry *prev = first_geom; prev != g; prev=prev->next)
+		{
+			if(prev->bones != NULL && !prev->bones->shared &&
+			   kuhl_private_bones_equal(prev->bones, g->bones))
+			{
+				g->bones->shared = 1;
+				g->bones->offset = prev->bones->offset;
+				break;
+			}
+		}
+		if(g->bones->shared)
+			continue;
+		count = (count + align - 1) / align * align;
+		g->bones->offset = count;
+		count += g->bones->count;
+	}
+	if(count == 0)
+		return;
 
-    @param time The time in seconds to set the animation to. Setting
-    time to a negative displays the model in its bind pose.
-*/
-void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, float time)
+	kuhl_bonepalette *palette = (kuhl_bonepalette*) kuhl_malloc(sizeof(kuhl_bonepalette));
+	palette->count = count;
+	palette->matrices = kuhl_malloc(sizeof(float)*16*count);
+	for(int i=0; i<count; i++)
+		mat4f_identity(palette->matrices[i]);
+	palette->buffer = 0;
+	palette->buffer_size = 0;
+	palette->dirty = 1;
+	palette->refcount = 0;
+	for(kuhl_geometry *g = first_geom; g != NULL; g=g->next)
+	{
+		if(g->bones == NULL)
+			continue;
+		g->bones->palette = palette;
+		g->bones->matrices = palette->matrices + g->bones->offset;
+		palette->refcount++;
+	}
+	msg(DEBUG, "Bone palette contains %d matrices\n", count);
+}
+
+/** Returns the number of floats that kuhl_private_update_model()
+ * writes when it is given a destination array.
+ *
+ * @param first_geom The model.
+ * @return The number of floats.
+ */
+static size_t kuhl_private_update_model_size(const kuhl_geometry *first_geom)
+{
+	size_t size = 0;
+	for(const kuhl_geometry *g = first_geom; g != NULL; g=g->next)
+	{
+		const struct aiScene *scene = g->assimp_scene;
+		if(scene == NULL || scene->mNumAnimations == 0 || g->assimp_node == NULL)
+			continue;
+		if(g->bones == NULL)
+			size += 16;
+		else if(!g->bones->shared)
+			size += 16 * g->bones->count;
+	}
+	return size;
+}
+
+/** Calculates the matrices of a model at a specific time. See
+ * kuhl_update_model().
+ *
+ * @param first_geom The model.
+ * @param animationNum The animation to use.
+ * @param time The time in seconds (negative for the bind pose).
+ * @param dest If NULL, the matrices are stored in the geometry. Otherwise,
+ * the matrices are stored in this array (which must be large enough to
+ * store kuhl_private_update_model_size() floats) and the geometry isn't
+ * changed.
+ */
+static void kuhl_private_update_model(kuhl_geometry *first_geom, unsigned int animationNum, float time, float *dest)
 {
+	/* The scene whose world matrices were calculated most
+	 * recently. Typically, every kuhl_geometry in the list is part of
+	 * the same scene. */
+	kuhl_scene_nodes *sn = NULL;
+	float (*world)[16] = NULL;
 	for(kuhl_geometry *g = first_geom; g != NULL; g=g->next)
 	{
 		/* The aiScene object that this kuhl_geometry refers to. */
 		struct aiScene *scene = g->assimp_scene;
-		/* The aiNode object that this kuhl_geometry refers to. */
-		struct aiNode *node = g->assimp_node;
 
 		/* If the geometry contains no animations, isn't associated
 		 * with an ASSIMP scene or node, then there is no need to try
 		 * to animate it. */
-		if(scene == NULL || scene->mNumAnimations == 0 || node == NULL)
+		if(scene == NULL || scene->mNumAnimations == 0 || g->assimp_node == NULL)
 			continue;
 
+		if(sn == NULL || sn->scene != scene)
+		{
+			sn = kuhl_private_scene_nodes(scene);
+			world = kuhl_private_scene_nodes_update(sn, animationNum, time);
+		}
+
 		/* If there are no bones, or if a negative time value was
 		 * provided, update g->matrix. If there are bones, we assume
 		 * that the bones will drive the animation. */
 		if(g->bones == NULL )
 		{
-			/* Start at our current node and traverse up. Apply all of the
-			 * transformation matrices as we traverse up.
-			 *
-			 * TODO: By repeatedly traversing up, we repeatedly
-			 * recalculate the transformation matrices for the nodes
-			 * near the root---potentially reducing performance.
-			 */
-			mat4f_identity(g->matrix);
-			do
+			if(g->assimp_node_index < 0)
+				g->assimp_node_index = kuhl_private_scene_node_index(sn, g->assimp_node, NULL);
+			if(g->assimp_node_index < 0)
+			{
+				msg(ERROR, "Failed to find node \"%s\" in its scene.\n", g->assimp_node->mName.data);
+				exit(EXIT_FAILURE);
+			}
+			float *matrix = g->matrix;
+			if(dest != NULL)
 			{
-				float transform[16];
-				kuhl_private_node_matrix(transform, scene, node, animationNum, time);
-				mat4f_mult_mat4f_new(g->matrix, transform, g->matrix);
-				node = node->mParent;
-			} while(node != NULL);
+				matrix = dest;
+				dest += 16;
+			}
+			mat4f_copy(matrix, world[g->assimp_node_index]);
+			continue;
 		}
 
-		/* Don't process bones if there aren't any. */
-		if(g->bones == NULL)
+		/* Another mesh with the same bones updates the matrices
+		 * that this mesh uses. */
+		if(g->bones->shared)
 			continue;
+		if(dest == NULL && g->bones->palette != NULL)
+			g->bones->palette->dirty = 1;
 
 		/* Update the list of bone matrices. */
 		for(int b=0; b < g->bones->count; b++) // For each bone
 		{
-			// Find the bone node and the bone itself.
-			const struct aiNode *node = kuhl_assimp_find_node(g->bones->boneList[b]->mName.data, scene->mRootNode);
-			if(node == NULL)
+			const struct aiBone *bone = g->bones->boneList[b];
+			// Find the bone node the first time
+			if(g->bones->nodeIndex[b] < 0)
+				g->bones->nodeIndex[b] = kuhl_private_scene_node_index(sn, NULL, bone->mName.data);
+			if(g->bones->nodeIndex[b] < 0)
 			{
-				msg(ERROR, "Failed to find node that corresponded to bone: %s\n", g->bones->boneList[b]->mName.data);
+				msg(ERROR, "Failed to find node that corresponded to bone: %s\n", bone->mName.data);
 				exit(EXIT_FAILURE);
 			}
-			const struct aiBone *bone = g->bones->boneList[b];
-
-
-			/* Start at our current node and traverse up. Apply all of the
-			 * transformation matrices as we traverse up.
-			 *
-			 * TODO: By repeatedly traversing up, we repeatedly
-			 * recalculate the transformation matrices for the nodes
-			 * near the root---potentially reducing performance.
-			 */
-			mat4f_identity(g->bones->matrices[b]);
-			do
+			float *matrix = g->bones->matrices[b];
+			if(dest != NULL)
 			{
-				float transform[16];
-				kuhl_private_node_matrix(transform, scene, node, animationNum, time);
-				mat4f_mult_mat4f_new(g->bones->matrices[b], transform, g->bones->matrices[b]);
-				node = node->mParent; // move to next node up
-			} while(node != NULL);
+				matrix = dest;
+				dest += 16;
+			}
 
-			/* Also apply the bone offset */
+			/* Apply the bone offset and then all of the transformation
+			 * matrices from the bone's node up to the root. */
 			float offset[16];
 			mat4f_from_aiMatrix4x4(offset, bone->mOffsetMatrix);
-			mat4f_mult_mat4f_new(g->bones->matrices[b], g->bones->matrices[b], offset);
+			mat4f_mult_mat4f_new(matrix, world[g->bones->nodeIndex[b]], offset);
 
 		} // end for each bone
 	} // end for each geometry
 }
 
-/** Loads a model without drawing it.
- *
- * @param modelFilename The filename of the model.
- *
- * @param textureDirname The directory that the model's textures are
- * saved in. If set to NULL, the textures are assumed to be in the
- * same directory as the model is in. If the model has already been
- * drawn/loaded, this parameter is unused.
+/** Copies matrices calculated by kuhl_private_update_model() into
+ * the geometry.
  *
- * @param program The GLSL program to draw the model with.
+ * @param first_geom The model.
+ * @param src The matrices.
+ */
+static void kuhl_private_update_model_publish(kuhl_geometry *first_geom, const float *src)
+{
+	for(kuhl_geometry *g = first_geom; g != NULL; g=g->next)
+	{
+		const struct aiScene *scene = g->assimp_scene;
+		if(scene == NULL || scene->mNumAnimations == 0 || g->assimp_node == NULL)
+			continue;
+		if(g->bones == NULL)
+		{
+			mat4f_copy(g->matrix, src);
+			src += 16;
+		}
+		else if(!g->bones->shared)
+		{
+			memcpy(g->bones->matrices, src, sizeof(float)*16*g->bones->count);
+			src += 16*g->bones->count;
+			if(g->bones->palette != NULL)
+				g->bones->palette->dirty = 1;
+		}
+	}
+}
+
+/** Setup a model to draw at a specific time.
+
+    @param modelFilename Name of model file to update.
+
+    @param animationNum The animation to use. If the file only
+    contains one animation, set it to 0.
+
+    @param time The time in seconds to set the animation to. Setting
+    time to a negative displays the model in its bind pose.
+*/
+void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, float time)
+{
+	TRACE_SCOPE("kuhl_update_model");
+	kuhl_private_update_model(first_geom, animationNum, time, NULL);
+}
+
+
+#define KUHL_UPDATE_MAX_THREADS 16 /**< Maximum number of threads that kuhl_update_models() uses */
+
+/** The models that are being updated by kuhl_update_models_begin(). */
+static struct
+{
+	kuhl_geometry **models;
+	float *times;
+	size_t *offsets;    /**< Offset of each model's matrices in dest */
+	float *dest;        /**< Matrices calculated for the models (the back buffer) */
+	int count;          /**< Number of models */
+	int capacity;       /**< Number of models that models, times and offsets can store */
+	size_t destCapacity; /**< Number of floats dest can store */
+	unsigned int animationNum;
+	int next;           /**< Next model to be updated (accessed atomically) */
+	int finished;       /**< Number of models that have been updated (accessed atomically) */
+	int active;         /**< Worker threads that are working on this job */
+	unsigned int generation; /**< Incremented each time a job is started */
+	int pending;        /**< Set between kuhl_update_models_begin() and kuhl_update_models_wait() */
+} kuhl_private_update_job;
+
+static pthread_mutex_t kuhl_private_update_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kuhl_private_update_start = PTHREAD_COND_INITIALIZER; /**< Signaled when a job is started */
+static pthread_cond_t kuhl_private_update_done = PTHREAD_COND_INITIALIZER;  /**< Signaled when a worker finishes a job */
+static int kuhl_private_update_threads = -1; /**< Number of worker threads (-1 if they haven't been started) */
+
+/** The parts of kuhl_private_update_job that a thread needs to work
+ * on a job. A copy is made while kuhl_private_update_mutex is locked
+ * so that a thread never sees a job that is only partly set up. */
+typedef struct
+{
+	kuhl_geometry **models;
+	const float *times;
+	const size_t *offsets;
+	float *dest;
+	int count;
+	unsigned int animationNum;
+	unsigned int generation;
+} kuhl_private_update_snapshot;
+
+/** Copies the current job. kuhl_private_update_mutex must be locked. */
+static void kuhl_private_update_snapshot_take(kuhl_private_update_snapshot *snap)
+{
+	snap->models = kuhl_private_update_job.models;
+	snap->times = kuhl_private_update_job.times;
+	snap->offsets = kuhl_private_update_job.offsets;
+	snap->dest = kuhl_private_update_job.dest;
+	snap->count = kuhl_private_update_job.count;
+	snap->animationNum = kuhl_private_update_job.animationNum;
+	snap->generation = kuhl_private_update_job.generation;
+}
+
+/** Updates models from a job until there are none left.
+ * Each thread claims the next model that nobody has started, so
+ * threads that get small models simply update more of them. A thread
+ * stops if a different job has been started. */
+static void kuhl_private_update_work(const kuhl_private_update_snapshot *snap)
+{
+	int i;
+	while((i = __sync_fetch_and_add(&kuhl_private_update_job.next, 1)) < snap->count)
+	{
+		if(__sync_fetch_and_add(&kuhl_private_update_job.generation, 0) != snap->generation)
+			break;
+		kuhl_private_update_model(snap->models[i], snap->animationNum, snap->times[i],
+		                          snap->dest + snap->offsets[i]);
+		__sync_fetch_and_add(&kuhl_private_update_job.finished, 1);
+	}
+}
+
+/** The main function of the worker threads used by kuhl_update_models(). */
+static void* kuhl_private_update_thread(void *arg)
+{
+	unsigned int generation = 0;
+	kuhl_private_update_snapshot snap;
+	while(1)
+	{
+		pthread_mutex_lock(&kuhl_private_update_mutex);
+		while(kuhl_private_update_job.generation == generation)
+			pthread_cond_wait(&kuhl_private_update_start, &kuhl_private_update_mutex);
+		generation = kuhl_private_update_job.generation;
+		kuhl_private_update_snapshot_take(&snap);
+		kuhl_private_update_job.active++;
+		pthread_mutex_unlock(&kuhl_private_update_mutex);
+
+		TRACE_BEGIN("kuhl_update_models worker");
+		kuhl_private_update_work(&snap);
+		TRACE_END();
+
+		pthread_mutex_lock(&kuhl_private_update_mutex);
+		kuhl_private_update_job.active--;
+		pthread_cond_signal(&kuhl_private_update_done);
+		pthread_mutex_unlock(&kuhl_private_update_mutex);
+	}
+	return NULL;
+}
+
+/** Starts the worker threads the first time kuhl_update_models() is
+ * called. The number of threads can be set with the
+ * KUHL_UPDATE_THREADS environment variable (0 updates all models on
+ * the calling thread). */
+static void kuhl_private_update_threads_start(void)
+{
+	if(kuhl_private_update_threads >= 0)
+		return;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	const char *str = getenv("KUHL_UPDATE_THREADS");
+	if(str != NULL && strlen(str) > 0)
+		threads = atoi(str);
+	if(threads < 0)
+		threads = 0;
+	if(threads > KUHL_UPDATE_MAX_THREADS)
+		threads = KUHL_UPDATE_MAX_THREADS;
+
+	kuhl_private_update_threads = 0;
+	for(long i=0; i<threads; i++)
+	{
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, kuhl_private_update_thread, NULL) != 0)
+		{
+			msg(WARNING, "Failed to create thread to update models, using %d threads.\n", kuhl_private_update_threads);
+			break;
+		}
+		pthread_detach(thread);
+		kuhl_private_update_threads++;
+	}
+	msg(DEBUG, "Using %d worker threads to update models.\n", kuhl_private_update_threads);
+}
+
+/** Starts updating several models to draw at specific times on
+ * worker threads. The matrices are calculated into separate storage
+ * so the models can be drawn (with the matrices from the previous
+ * update) while the update is happening. The new matrices are copied
+ * into the models by kuhl_update_models_wait(), which must be called
+ * before this function is called again.
  *
- * @param bbox To be filled in with the bounding box of the model
- * (xmin, xmax, ymin, etc). The bounding box may be incorrect if the
- * model includes animation.
+ * The models may be made from the same file. The same model must not
+ * appear twice in the list.
  *
- * @return Returns a kuhl_geometry object that can be later drawn. If
- * the model contains multiple meshes, kuhl_geometry will be a linked
- * list (i.e., geom->next will not be NULL).
+ * @param models An array of models (returned by kuhl_load_model()).
+ * @param n The number of models.
+ * @param animationNum The animation to use (see kuhl_update_model()).
+ * @param times The time in seconds to set each model's animation to
+ * (an array of n values, see kuhl_update_model()).
  */
-kuhl_geometry* kuhl_load_model(const char *modelFilename, const char *textureDirname,
-                               GLuint program, float bbox[6])
+void kuhl_update_models_begin(kuhl_geometry **models, int n, unsigned int animationNum, const float *times)
 {
-	char *newModelFilename = kuhl_find_file(modelFilename);
-	// Loads the model from the file and reads in all of the textures:
-	const struct aiScene *scene = kuhl_private_assimp_load(newModelFilename, textureDirname);
-	if(scene == NULL)
+	if(kuhl_private_update_job.pending)
 	{
-		msg(ERROR, "ASSIMP was unable to import the model '%s'.\n", modelFilename);
-		return NULL;
+		msg(WARNING, "kuhl_update_models_wait() wasn't called after kuhl_update_models_begin().\n");
+		kuhl_update_models_wait();
+	}
+	kuhl_private_update_threads_start();
+
+	/* A worker that woke up late might still be looking at the
+	 * previous job. The job is only changed once no worker is
+	 * active, and workers can't become active while the mutex is
+	 * locked. */
+	pthread_mutex_lock(&kuhl_private_update_mutex);
+	while(kuhl_private_update_job.active > 0)
+		pthread_cond_wait(&kuhl_private_update_done, &kuhl_private_update_mutex);
+
+	/* Copy the list of models so that the caller can change it while
+	 * the models are being updated. */
+	if(n > kuhl_private_update_job.capacity)
+	{
+		free(kuhl_private_update_job.models);
+		free(kuhl_private_update_job.times);
+		free(kuhl_private_update_job.offsets);
+		kuhl_private_update_job.models = kuhl_malloc(sizeof(kuhl_geometry*)*n);
+		kuhl_private_update_job.times = kuhl_malloc(sizeof(float)*n);
+		kuhl_private_update_job.offsets = kuhl_malloc(sizeof(size_t)*n);
+		kuhl_private_update_job.capacity = n;
 	}
+	size_t size = 0;
+	for(int i=0; i<n; i++)
+	{
+		kuhl_private_update_job.models[i] = models[i];
+		kuhl_private_update_job.times[i] = times[i];
+		kuhl_private_update_job.offsets[i] = size;
+		size += kuhl_private_update_model_size(models[i]);
+	}
+	if(size > kuhl_private_update_job.destCapacity)
+	{
+		free(kuhl_private_update_job.dest);
+		kuhl_private_update_job.dest = kuhl_malloc(sizeof(float)*size);
+		kuhl_private_update_job.destCapacity = size;
+	}
+
+	kuhl_private_update_job.count = n;
+	kuhl_private_update_job.animationNum = animationNum;
+	kuhl_private_update_job.next = 0;
+	kuhl_private_update_job.finished = 0;
+	kuhl_private_update_job.pending = 1;
+	kuhl_private_update_job.generation++;
+	pthread_cond_broadcast(&kuhl_private_update_start);
+	pthread_mutex_unlock(&kuhl_private_update_mutex);
+}
+
+/** Waits for the models passed to kuhl_update_models_begin() to be
+ * updated and copies their new matrices into them. The calling
+ * thread helps update any models that haven't been started yet. */
+void kuhl_update_models_wait(void)
+{
+	if(!kuhl_private_update_job.pending)
+		return;
+	TRACE_SCOPE("kuhl_update_models_wait");
+	kuhl_private_update_snapshot snap;
+	pthread_mutex_lock(&kuhl_private_update_mutex);
+	kuhl_private_update_snapshot_take(&snap);
+	pthread_mutex_unlock(&kuhl_private_update_mutex);
+	kuhl_private_update_work(&snap);
+
+	/* Wait until all models are updated and no worker is still
+	 * looking at this job. */
+	pthread_mutex_lock(&kuhl_private_update_mutex);
+	while(__sync_fetch_and_add(&kuhl_private_update_job.finished, 0) < kuhl_private_update_job.count ||
+	      kuhl_private_update_job.active > 0)
+		pthread_cond_wait(&kuhl_private_update_done, &kuhl_private_update_mutex);
+	kuhl_private_update_job.pending = 0;
+	pthread_mutex_unlock(&kuhl_private_update_mutex);
+
+	for(int i=0; i<kuhl_private_update_job.count; i++)
+		kuhl_private_update_model_publish(kuhl_private_update_job.models[i],
+		                                  kuhl_private_update_job.dest + kuhl_private_update_job.offsets[i]);
+}
+
+/** Updates several models to draw at specific times. The models are
+ * spread across worker threads. This is equivalent to calling
+ * kuhl_update_model() on each model, but faster if there are many
+ * animated models. To calculate the matrices while the previous frame
+ * is being drawn, use kuhl_update_models_begin() and
+ * kuhl_update_models_wait() instead.
+ *
+ * @param models An array of models (returned by kuhl_load_model()).
+ * @param n The number of models.
+ * @param animationNum The animation to use (see kuhl_update_model()).
+ * @param times The time in seconds to set each model's animation to
+ * (an array of n values, see kuhl_update_model()).
+ */
+void kuhl_update_models(kuhl_geometry **models, int n, unsigned int animationNum, const float *times)
+{
+	TRACE_SCOPE("kuhl_update_models");
+	kuhl_update_models_begin(models, n, animationNum, times);
+	kuhl_update_models_wait();
+}
 
+/** Creates the kuhl_geometry for a scene that has been imported and
+ * whose textures have been loaded. This is the part of
+ * kuhl_load_model() that must happen on the thread with the OpenGL
+ * context.
+ *
+ * @param scene The imported scene.
+ * @param lods The simplified versions of each mesh in the scene or NULL.
+ * @param modelFilename The filename that the caller asked for (for messages).
+ * @param foundFilename The path of the model file (see kuhl_find_file()).
+ * @param textureDirname The texture directory (see kuhl_load_model()).
+ * @param program The GLSL program to draw the model with.
+ * @param bbox To be filled in with the bounding box or NULL.
+ */
+static kuhl_geometry* kuhl_private_load_model_scene(const struct aiScene *scene, const mesh_opt_lod *lods,
+                                                    const char *modelFilename, const char *foundFilename, const char *textureDirname,
+                                                    GLuint program, float bbox[6])
+{
 	// Convert the information in aiScene into a kuhl_geometry object.
 	float transform[16];
 	mat4f_identity(transform);
-	kuhl_geometry *ret = kuhl_private_load_model(scene, scene->mRootNode,
+	kuhl_geometry *ret = kuhl_private_load_model(scene, lods, scene->mRootNode,
 	                                             program, transform,
-	                                             newModelFilename, textureDirname);
+	                                             foundFilename, textureDirname);
+	kuhl_private_bone_palette(ret);
 
 	/* Ensure model shows up in bind pose if the caller doesn't
 	 * also call kuhl_update_model(). */
@@ -3086,6 +7710,255 @@ kuhl_geometry* kuhl_load_model(const char *modelFilename, const char *textureDir
 	}
 	return ret;
 }
+
+/** Loads a model without drawing it.
+ *
+ * @param modelFilename The filename of the model.
+ *
+ * @param textureDirname The directory that the model's textures are
+ * saved in. If set to NULL, the textures are assumed to be in the
+ * same directory as the model is in. If the model has already been
+ * drawn/loaded, this parameter is unused.
+ *
+ * @param program The GLSL program to draw the model with.
+ *
+ * @param bbox To be filled in with the bounding box of the model
+ * (xmin, xmax, ymin, etc). The bounding box may be incorrect if the
+ * model includes animation.
+ *
+ * @return Returns a kuhl_geometry object that can be later drawn. If
+ * the model contains multiple meshes, kuhl_geometry will be a linked
+ * list (i.e., geom->next will not be NULL).
+ */
+kuhl_geometry* kuhl_load_model(const char *modelFilename, const char *textureDirname,
+                               GLuint program, float bbox[6])
+{
+	char *newModelFilename = kuhl_find_file(modelFilename);
+	// Loads the model from the file and reads in all of the textures:
+	mesh_opt_lod *lods;
+	const struct aiScene *scene = kuhl_private_assimp_load(newModelFilename, textureDirname, &lods);
+	if(scene == NULL)
+	{
+		msg(ERROR, "ASSIMP was unable to import the model '%s'.\n", modelFilename);
+		free(newModelFilename);
+		return NULL;
+	}
+
+	kuhl_geometry *ret = kuhl_private_load_model_scene(scene, lods, modelFilename, newModelFilename,
+	                                                   textureDirname, program, bbox);
+	kuhl_private_assimp_lods_free(lods, scene->mNumMeshes);
+	free(newModelFilename);
+	return ret;
+}
+
+#define KUHL_LOAD_MAX_THREADS 16 /**< Maximum number of threads that kuhl_load_models() uses */
+
+/** The work shared by the threads in kuhl_load_models(). */
+typedef struct
+{
+	int count;                      /**< Number of models */
+	const char **modelFilenames;    /**< The filenames the caller asked for */
+	const char **textureDirnames;   /**< Texture directory for each model (may be NULL) */
+	char **foundFilenames;          /**< Path of each model file */
+	const struct aiScene **scenes;  /**< The imported scenes (NULL if the import failed) */
+	mesh_opt_lod **lods;            /**< The simplified meshes of each scene (may be NULL) */
+	kuhl_private_model_texture_list *textures; /**< The new textures used by each model */
+	kuhl_private_model_texture **decode; /**< Textures whose pixels are read by the threads */
+	int decodeCount;                /**< Number of items in decode */
+	int next;                       /**< The next model or texture to be claimed by a thread */
+} kuhl_private_load_job;
+
+/** Imports models (and finds the textures they use) until every
+ * model in the job has been claimed. */
+static void* kuhl_private_load_import_work(void *arg)
+{
+	kuhl_private_load_job *job = (kuhl_private_load_job*) arg;
+	int i;
+	while((i = __atomic_fetch_add(&(job->next), 1, __ATOMIC_RELAXED)) < job->count)
+	{
+		TRACE_SCOPE("kuhl_load_models import");
+		job->foundFilenames[i] = kuhl_find_file(job->modelFilenames[i]);
+		job->scenes[i] = kuhl_private_assimp_import(job->foundFilenames[i], job->lods+i);
+		if(job->scenes[i] != NULL)
+		{
+			const char *textureDirname = job->textureDirnames ? job->textureDirnames[i] : NULL;
+			kuhl_private_assimp_textures(job->scenes[i], job->foundFilenames[i],
+			                             textureDirname, job->textures+i);
+		}
+	}
+	return NULL;
+}
+
+/** Reads the pixels of textures until every texture in the job has
+ * been claimed. */
+static void* kuhl_private_load_decode_work(void *arg)
+{
+	kuhl_private_load_job *job = (kuhl_private_load_job*) arg;
+	int i;
+	while((i = __atomic_fetch_add(&(job->next), 1, __ATOMIC_RELAXED)) < job->decodeCount)
+	{
+		TRACE_SCOPE("kuhl_load_models decode");
+		kuhl_private_model_texture *tex = job->decode[i];
+		/* If the image can't be read, pixels stays NULL and
+		 * kuhl_private_assimp_texture_create() tries again and
+		 * prints the usual warning. */
+		tex->pixels = kuhl_read_image_rgba(tex->fullpath, &(tex->width), &(tex->height));
+	}
+	return NULL;
+}
+
+/** Runs a function on the calling thread and on up to threads-1
+ * additional threads and waits for all of them to return. */
+static void kuhl_private_load_run(kuhl_private_load_job *job, int threads, void* (*work)(void*))
+{
+	pthread_t thread[KUHL_LOAD_MAX_THREADS];
+	int started = 0;
+	job->next = 0;
+	for(int i=1; i<threads; i++)
+	{
+		if(pthread_create(&thread[started], NULL, work, job) != 0)
+		{
+			msg(WARNING, "Failed to create thread to load models, using %d threads.\n", started+1);
+			break;
+		}
+		started++;
+	}
+	work(job);
+	for(int i=0; i<started; i++)
+		pthread_join(thread[i], NULL);
+}
+
+/** Loads several models without drawing them. The models are
+ * imported by ASSIMP on several threads and the textures that they
+ * use are read on several threads. Only the OpenGL objects are
+ * created on the calling thread (which must have the OpenGL
+ * context). A texture used by more than one model is only loaded
+ * once.
+ *
+ * The number of threads can be set with the KUHL_LOAD_THREADS
+ * environment variable (1 loads everything on the calling thread);
+ * the default is the number of processors. Textures are read on the
+ * calling thread when streaming (KUHL_TEXTURE_ASYNC) or the texture
+ * cache (see texcache.h) is used.
+ *
+ * @param modelFilenames An array of n model filenames. The same file
+ * may not appear twice.
+ *
+ * @param textureDirnames An array of n directories containing the
+ * textures for each model (see kuhl_load_model()). If the array is
+ * NULL, the textures are in the same directories as the models.
+ *
+ * @param n The number of models.
+ *
+ * @param program The GLSL program to draw the models with.
+ *
+ * @param models An array of n pointers which are set to the loaded
+ * models (see kuhl_load_model()). If a model fails to load, its
+ * pointer is set to NULL.
+ *
+ * @param bboxes An array of n bounding boxes to be filled in (see
+ * kuhl_load_model()) or NULL.
+ *
+ * @return The number of models that were loaded.
+ */
+int kuhl_load_models(const char **modelFilenames, const char **textureDirnames, int n,
+                     GLuint program, kuhl_geometry **models, float (*bboxes)[6])
+{
+	if(n <= 0)
+		return 0;
+	TRACE_SCOPE("kuhl_load_models");
+
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *str = getenv("KUHL_LOAD_THREADS");
+	if(str != NULL && strlen(str) > 0)
+		threads = atoi(str);
+	if(threads < 1)
+		threads = 1;
+	if(threads > KUHL_LOAD_MAX_THREADS)
+		threads = KUHL_LOAD_MAX_THREADS;
+
+	kuhl_private_load_job job;
+	job.count = n;
+	job.modelFilenames = modelFilenames;
+	job.textureDirnames = textureDirnames;
+	job.foundFilenames = kuhl_malloc(sizeof(char*)*n);
+	job.scenes = kuhl_malloc(sizeof(struct aiScene*)*n);
+	job.lods = kuhl_malloc(sizeof(mesh_opt_lod*)*n);
+	job.textures = kuhl_malloc(sizeof(kuhl_private_model_texture_list)*n);
+	for(int i=0; i<n; i++)
+		kuhl_private_model_texture_list_init(job.textures+i);
+
+	/* The log stream must be attached before assimp is used on
+	 * several threads. */
+	kuhl_private_assimp_log_init(modelFilenames[0]);
+	msg(DEBUG, "Loading %d models with %ld threads.\n", n, threads < n ? threads : n);
+	kuhl_private_load_run(&job, threads < n ? threads : n, kuhl_private_load_import_work);
+
+	/* Read the pixels of the new textures on several threads. KTX
+	 * files, cached textures and streamed textures are loaded by
+	 * kuhl_private_assimp_texture_create() instead. */
+	int textureCount = 0;
+	for(int i=0; i<n; i++)
+		textureCount += job.textures[i].length;
+	job.decode = kuhl_malloc(sizeof(kuhl_private_model_texture*)*(textureCount+1));
+	job.decodeCount = 0;
+#ifndef KUHL_UTIL_USE_IMAGEMAGICK
+	const char *async = getenv("KUHL_TEXTURE_ASYNC");
+	int streaming = async != NULL && strlen(async) > 0 && strcmp(async, "0") != 0;
+	if(!streaming && !texcache_enabled())
+	{
+		for(int i=0; i<n; i++)
+			for(int t=0; t<job.textures[i].length; t++)
+				if(!texcache_is_ktx(job.textures[i].data[t].fullpath))
+					job.decode[job.decodeCount++] = job.textures[i].data + t;
+	}
+	/* stbi_load() flips images based on a global setting. It
+	 * is set before the threads start so that they all agree. */
+	stbi_set_flip_vertically_on_load(1);
+#endif
+	if(job.decodeCount > 0)
+		kuhl_private_load_run(&job, threads < job.decodeCount ? threads : job.decodeCount,
+		                      kuhl_private_load_decode_work);
+
+	/* Create the OpenGL textures on this thread. Two models might
+	 * share a texture that was claimed by either one of them, so all
+	 * of the textures are created before any geometry looks them
+	 * up. */
+	for(int i=0; i<n; i++)
+	{
+		for(int t=0; t<job.textures[i].length; t++)
+			kuhl_private_assimp_texture_create(job.textures[i].data + t);
+		kuhl_private_model_texture_list_free(job.textures+i);
+	}
+
+	/* Create the geometry on this thread. */
+	int loaded = 0;
+	for(int i=0; i<n; i++)
+	{
+		if(job.scenes[i] == NULL)
+		{
+			msg(ERROR, "ASSIMP was unable to import the model '%s'.\n", modelFilenames[i]);
+			models[i] = NULL;
+		}
+		else
+		{
+			const char *textureDirname = textureDirnames ? textureDirnames[i] : NULL;
+			models[i] = kuhl_private_load_model_scene(job.scenes[i], job.lods[i], modelFilenames[i],
+			                                          job.foundFilenames[i], textureDirname, program,
+			                                          bboxes ? bboxes[i] : NULL);
+			kuhl_private_assimp_lods_free(job.lods[i], job.scenes[i]->mNumMeshes);
+			loaded++;
+		}
+		free(job.foundFilenames[i]);
+	}
+
+	free(job.decode);
+	free(job.textures);
+	free(job.lods);
+	free(job.scenes);
+	free(job.foundFilenames);
+	return loaded;
+}
 #endif // KUHL_UTIL_USE_ASSIMP
 
 
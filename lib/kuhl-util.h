@@ -36,6 +36,8 @@
 #endif
 
 #include "kuhl-nodep.h"
+#include "list.h"
+#include "tlist.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -50,18 +52,42 @@ extern "C" {
 #define M_PI 3.14159265358979323846
 #endif
 
-/** Maximum number of bones that can be sent to GLSL program */
+/** Maximum number of bones that can be sent to GLSL program through
+ * a "uniform mat4 BoneMat[]" array or a "BoneBlock" uniform
+ * block. Meshes with more bones can only be drawn with a "BoneBuffer"
+ * shader storage block. */
 #define MAX_BONES 128
 #define MAX_ATTRIBUTES 16
 #define MAX_TEXTURES 8
+#define KUHL_MAX_LODS 4 /**< Maximum number of simplified versions of the indices in a kuhl_geometry */
+/** Uniform buffer and shader storage buffer binding point that
+ * kuhl_geometry_draw() binds bone matrices to. */
+#define KUHL_BONE_BINDING 7
 	
 #if KUHL_UTIL_USE_ASSIMP
+/** The bone matrices of all of the meshes in a model. The matrices
+ * are stored together so that they can be uploaded into a single
+ * buffer object once per frame. */
+typedef struct
+{
+	int count; /**< Number of matrices (including padding between meshes) */
+	float (*matrices)[16]; /**< Transformation matrices for each bone in the model */
+	GLuint buffer; /**< Uniform/shader storage buffer containing the matrices (0 until the model is drawn) */
+	GLsizeiptr buffer_size; /**< Size of buffer in bytes */
+	int dirty; /**< 1 if the matrices changed since they were copied into buffer */
+	int refcount; /**< Number of kuhl_bonemat structs that use this palette */
+} kuhl_bonepalette;
+
 typedef struct
 {
 	int count; /**< Number of bones in this struct */
 	unsigned int mesh; /**< The bones in this struct are associated with this matrix index */
-	const struct aiBone *boneList[MAX_BONES];
-	float matrices[MAX_BONES][16]; /**< Transformation matrices for each bone */
+	const struct aiBone **boneList;
+	int *nodeIndex; /**< Index of each bone's node in the scene's flattened node list (-1 until kuhl_update_model() finds it) */
+	float (*matrices)[16]; /**< Transformation matrices for each bone (points into palette) */
+	kuhl_bonepalette *palette; /**< Storage shared by all meshes in the model */
+	int offset; /**< Index of matrices[0] in palette->matrices */
+	int shared; /**< 1 if an earlier mesh in the model has identical bones and calculates these matrices */
 } kuhl_bonemat;
 #endif
 
@@ -70,15 +96,27 @@ enum
 { /* Options used for some kuhl_geometry functions */
 	KG_NONE = 0,     /**< No options */
 	KG_WARN = 1,     /**< Warn if GLSL variable is missing */
-	KG_FULL_LIST = 2 /**< Apply to entire list of kuhl_geometry objects */
+	KG_FULL_LIST = 2, /**< Apply to entire list of kuhl_geometry objects */
+	KG_INTERLEAVED = 4, /**< Store vertex attributes in a single interleaved buffer */
+	KG_POOLED = 8, /**< Store vertex and index data in buffers shared with other geometry */
+	KG_DYNAMIC = 16 /**< The attribute data will be changed often (see kuhl_geometry_attrib_get()) */
 };
 
+struct kuhl_attrib_stream;
+
 /** There is an array of kuhl_attrib structs inside of
  * kuhl_geometry to store all vertex attribute information */
 typedef struct
 {
 	char*    name; /**< GLSL variable name the attribute information should be linked with. */
 	GLuint   bufferobject; /**< OpenGL buffer the attribute is stored in */
+	int      mapped; /**< Set when kuhl_geometry_attrib_get() has mapped the buffer */
+	struct kuhl_attrib_stream *stream; /**< Storage for attributes added with KG_DYNAMIC, NULL otherwise */
+	GLuint   components; /**< Number of floats per vertex (or per instance) */
+	GLuint   divisor; /**< 0 for per-vertex attributes, 1 for per-instance attributes added with kuhl_geometry_instance_attrib() */
+	GLint    location; /**< Location of the attribute in the geometry's program, -1 if the program doesn't use it - Set when the attribute is connected to the vertex array object. */
+	GLsizei  stride; /**< Bytes between the start of consecutive vertices, 0 if the buffer only contains this attribute */
+	GLsizeiptr offset; /**< Byte offset of this attribute within a vertex in an interleaved buffer */
 } kuhl_attrib;
 
 /** There is an array of kuhl_texture structs inside of
@@ -87,8 +125,16 @@ typedef struct
 {
 	char* name; /**< GLSL variable name the texture should be linked with. */
 	GLuint textureId; /**< OpenGL texture id/name of the texture */
+	GLint location; /**< Cached location of the sampler in the geometry's GLSL program */
 } kuhl_texture;
+
+/** Indices into kuhl_geometry's uniform_locations array for the
+ * uniform variables that kuhl_geometry_draw() sets automatically. */
+enum { KG_UNIFORM_HASTEX, KG_UNIFORM_BONEMAT, KG_UNIFORM_NUMBONES,
+       KG_UNIFORM_GEOMTRANSFORM, KG_UNIFORM_COUNT };
 	
+struct kuhl_buffer_chunk;
+
 /** The kuhl_geometry struct is used to quickly draw 3D objects in
  * OpenGL 3.0. For more information, see the example programs and the
  * documentation for kuhl_geometry_new() and kuhl_geometry_draw(). The
@@ -111,15 +157,33 @@ typedef struct _kuhl_geometry_
 	GLuint *indices; /**< Allows you to specify which vertices are a part of a primitive. This is useful if a single vertex is shared by multiple primitives. If this is set to NULL, the vertices are drawn in order. - User should set this. */
 	GLuint indices_len; /**< How many indices are there? - User should set this. */
 	GLuint indices_bufferobject; /**< What is the OpenGL buffer object that holds the indices? - Set by kuhl_geometry_init(). */
+	GLenum indices_type; /**< GL_UNSIGNED_SHORT if the index buffer stores 16-bit indices, GL_UNSIGNED_INT otherwise - Set by kuhl_geometry_indices(). */
+	GLuint instance_count; /**< Number of instances to draw. 0 disables instanced drawing. - Set by kuhl_geometry_instance_attrib(). */
+	struct kuhl_buffer_chunk *pool; /**< Shared buffers that the vertices and indices are stored in, NULL if the geometry has its own buffers - Set by kuhl_geometry_pool(). */
+	GLint base_vertex; /**< Index of the first vertex of this geometry in the shared vertex buffer */
+	GLuint first_index; /**< Position of the first index of this geometry in the shared index buffer */
+	GLuint lod_count; /**< Number of simplified versions of the indices (levels of detail) - Set by kuhl_geometry_lods(). */
+	GLuint lod_first[KUHL_MAX_LODS]; /**< Position of each simplified version in the index buffer */
+	GLuint lod_len[KUHL_MAX_LODS]; /**< Number of indices in each simplified version */
+	GLuint lod_current; /**< Version that is drawn: 0 for all of the indices, i for lod_first[i-1] - Set by kuhl_geometry_lod_select(). */
 
 	
 	float matrix[16]; /**< A matrix that all of this geometry should be transformed by */
+	float aabbox[6]; /**< Axis-aligned bounding box of the in_Position attribute (xmin, xmax, ymin, ...) before matrix is applied. Empty (xmin > xmax) if unknown - Set by kuhl_geometry_attrib(). */
 	int has_been_drawn; /**< Has this piece of geometry been drawn yet? */
+
+	GLint uniform_locations[KG_UNIFORM_COUNT]; /**< Cached uniform locations used by kuhl_geometry_draw() - Set by kuhl_geometry_program(). */
+	GLuint uniform_program; /**< Program that uniform_locations were looked up in. */
+	unsigned int uniform_generation; /**< Uniform cache generation that uniform_locations were looked up in. */
+	unsigned int occlusion_id; /**< Distinguishes this geometry in a kuhl_occlusion from earlier geometry at the same address - Set by kuhl_geometry_new(). */
 	
 #if KUHL_UTIL_USE_ASSIMP
 	struct aiNode *assimp_node; /**< Assimp node that this kuhl_geometry object was created from. */
 	struct aiScene *assimp_scene; /**< Assimp scene that this kuhl_geometry object is a part of. */
+	int assimp_node_index; /**< Index of assimp_node in the scene's flattened node list (-1 until kuhl_update_model() finds it) */
 	kuhl_bonemat *bones; /**< Information about bones in the model */
+	GLenum bone_block_target; /**< GL_UNIFORM_BUFFER or GL_SHADER_STORAGE_BUFFER if the program has a bone block, 0 otherwise - Set by kuhl_geometry_program(). */
+	GLsizeiptr bone_block_size; /**< Size of the program's BoneBlock uniform block in bytes */
 #endif
 
 	struct _kuhl_geometry_ *next; /**< A kuhl_geometry object can be a linked list. */
@@ -127,6 +191,93 @@ typedef struct _kuhl_geometry_
 } kuhl_geometry;
 
 
+/** A single entry in a kuhl_render_queue. */
+typedef struct
+{
+	GLuint program; /**< Program of the geometry when it was queued */
+	GLuint vao; /**< Vertex array object of the geometry */
+	unsigned int order; /**< Position in the queue before sorting */
+	kuhl_geometry *geom; /**< The geometry to draw */
+} kuhl_render_record;
+
+TLIST_DEFINE(kuhl_render_record_list, kuhl_render_record, 0)
+TLIST_DEFINE(kuhl_geometry_ptr_list, kuhl_geometry*, 0)
+
+/** A render queue holds a flat, sorted list of kuhl_geometry objects
+ * that can be drawn with a minimal number of state changes. See
+ * kuhl_render_queue_init(). */
+typedef struct
+{
+	kuhl_render_record_list records; /**< Draw records, one per kuhl_geometry object */
+	int sorted; /**< Set to 0 when the records need to be sorted again */
+} kuhl_render_queue;
+
+/** The occlusion query of one kuhl_geometry in a kuhl_occlusion. */
+typedef struct
+{
+	const kuhl_geometry *geom; /**< Geometry that the query belongs to, NULL if the slot is unused */
+	unsigned int id; /**< occlusion_id of the geometry when the entry was created */
+	unsigned int frame; /**< Value of kuhl_occlusion.frame when the geometry was last drawn */
+	GLuint query; /**< Query object */
+	int pending; /**< 1 if the query has been issued and its result hasn't been read yet */
+	int visible; /**< Result of the last query that was read */
+} kuhl_occlusion_entry;
+
+/** Occlusion query results that kuhl_render_queue_draw_occluded()
+ * keeps from one frame to the next. Since the results depend on the
+ * viewport, use one kuhl_occlusion per viewport. Initialize it with
+ * kuhl_occlusion_init(). */
+typedef struct
+{
+	kuhl_occlusion_entry *entries; /**< Hash table of queries keyed by geometry */
+	unsigned int capacity; /**< Number of slots in entries (a power of 2) */
+	unsigned int count; /**< Number of slots that are used */
+	unsigned int frame; /**< Number of times the results have been used to draw a queue */
+	unsigned int drawn; /**< Geometry drawn since kuhl_occlusion_stats() was last called */
+	unsigned int conditional; /**< Geometry drawn with conditional rendering (the GPU skips it if its box was hidden) */
+	unsigned int skipped; /**< Geometry skipped because it was hidden in a previous frame */
+} kuhl_occlusion;
+
+#define KUHL_FRUSTUM_MAX_CORNERS 32 /**< Corners stored in a kuhl_frustum (enough for the union of 4 frustums) */
+
+/** The six planes of a view frustum (left, right, bottom, top, near,
+ * far) and its corners. Create with kuhl_frustum_extract() and
+ * combine frustums with kuhl_frustum_union(). */
+typedef struct
+{
+	float planes[6][4]; /**< Normalized plane equations; ax+by+cz+d >= 0 is inside */
+	float corners[KUHL_FRUSTUM_MAX_CORNERS][3]; /**< Corners of the frustum (or of all frustums in a union) */
+	int corner_count; /**< Number of corners, 0 if they are unknown */
+} kuhl_frustum;
+
+/** A group of geometry in a kuhl_scene that is drawn with a single
+ * glMultiDrawElementsIndirect() call. */
+typedef struct
+{
+	GLuint program; /**< Program used by all geometry in the batch */
+	GLuint vao; /**< Vertex array object owned by the scene */
+	GLenum primitive_type; /**< Primitive type of all geometry in the batch */
+	kuhl_geometry *geom; /**< First geometry in the batch (supplies the textures) */
+	unsigned int first; /**< Index of the first command in the indirect buffer */
+	unsigned int count; /**< Number of commands */
+} kuhl_scene_batch;
+
+TLIST_DEFINE(kuhl_scene_batch_list, kuhl_scene_batch, 0)
+
+/** A kuhl_scene draws static geometry with
+ * glMultiDrawElementsIndirect(). Initialize it with
+ * kuhl_scene_init(). */
+typedef struct
+{
+	kuhl_geometry_ptr_list geoms; /**< All kuhl_geometry objects in the scene */
+	kuhl_scene_batch_list batches; /**< Groups of geometry that are drawn with one indirect draw call */
+	kuhl_render_queue fallback; /**< Geometry that can't be drawn with an indirect draw call */
+	GLuint indirect_buffer; /**< GL_DRAW_INDIRECT_BUFFER holding one command per geometry */
+	GLuint transform_buffer; /**< Matrix of each geometry, read by the in_GeomTransform attribute */
+	int built; /**< Set to 0 when kuhl_scene_build() needs to be called */
+	unsigned int views; /**< kuhl_geometry_view_count() when the scene was built */
+} kuhl_scene;
+
 /** Call kuhl_errorcheck() with no parameters frequently for easy
  * OpenGL error checking. OpenGL doesn't report errors by
  * default. Instead, we must periodically check for errors
@@ -149,36 +300,70 @@ typedef struct _kuhl_geometry_
 	
 // kuhl_errorcheck() calls this C function:
 int kuhl_errorcheckFileLine(const char *file, int line, const char *func);
-// kuhl_malloc() calls this C function:
-void* kuhl_mallocFileLine(size_t size, const char *file, int line);
 
 
 GLuint kuhl_create_shader(const char *filename, GLuint shader_type);
 GLuint kuhl_create_program(const char *vertexFilename, const char *fragFilename);
+GLuint kuhl_create_program_defines(const char *vertexFilename, const char *fragFilename, const char *defines);
 void kuhl_delete_program(GLuint program);
 void kuhl_print_program_log(GLuint program);
 void kuhl_print_program_info(GLuint program);
 GLint kuhl_get_uniform(const char *uniformName);
+GLint kuhl_get_uniform_cached(GLuint program, const char *uniformName);
+void kuhl_uniform_cache_invalidate(GLuint program);
 GLint kuhl_get_attribute(GLuint program, const char *attributeName);
 
 
 
 void kuhl_bbox_transform(float bbox[6], float mat[16]);
+void kuhl_frustum_extract(kuhl_frustum *frustum, const float projMat[16], const float modelviewMat[16]);
+void kuhl_frustum_union(kuhl_frustum *result, const kuhl_frustum *a, const kuhl_frustum *b);
+int kuhl_frustum_test_bbox(const kuhl_frustum *frustum, const float bbox[6], const float mat[16]);
+int kuhl_geometry_visible(const kuhl_geometry *geom, const kuhl_frustum *frustum);
+float kuhl_geometry_screen_size(const kuhl_geometry *geom, const float modelview[16],
+                                const float projection[16], int viewportHeight);
+void kuhl_geometry_lod_select(kuhl_geometry *geom, const float modelview[16],
+                              const float projection[16], int viewportHeight);
+void kuhl_geometry_draw_culled(kuhl_geometry *geom, const kuhl_frustum *frustum);
+void kuhl_cull_stats(unsigned int *drawn, unsigned int *culled);
 
-#if 0
 int kuhl_geometry_collide(kuhl_geometry *geom1, float mat1[16],
                           kuhl_geometry *geom2, float mat2[16]);
-#endif
 
 void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexCount, GLint primitive_type);
 void kuhl_geometry_draw(kuhl_geometry *geom);
+void kuhl_geometry_draw_list(kuhl_geometry *geom);
+void kuhl_geometry_view_count(unsigned int count);
+void kuhl_render_queue_init(kuhl_render_queue *queue);
+int kuhl_render_queue_add(kuhl_render_queue *queue, kuhl_geometry *geom);
+int kuhl_render_queue_add_visible(kuhl_render_queue *queue, kuhl_geometry *geom, const kuhl_frustum *frustum);
+void kuhl_render_queue_clear(kuhl_render_queue *queue);
+void kuhl_render_queue_sort(kuhl_render_queue *queue);
+void kuhl_render_queue_draw(kuhl_render_queue *queue);
+void kuhl_render_queue_free(kuhl_render_queue *queue);
+void kuhl_occlusion_init(kuhl_occlusion *occ);
+void kuhl_occlusion_free(kuhl_occlusion *occ);
+void kuhl_occlusion_stats(kuhl_occlusion *occ, unsigned int *drawn, unsigned int *conditional, unsigned int *skipped);
+void kuhl_render_queue_draw_occluded(kuhl_render_queue *queue, kuhl_occlusion *occ,
+                                     const float modelview[16], const float projection[16]);
+void kuhl_scene_init(kuhl_scene *scene);
+int kuhl_scene_add(kuhl_scene *scene, kuhl_geometry *geom);
+void kuhl_scene_build(kuhl_scene *scene);
+void kuhl_scene_draw(kuhl_scene *scene);
+void kuhl_scene_free(kuhl_scene *scene);
 void kuhl_geometry_delete(kuhl_geometry *geom);
 unsigned int kuhl_geometry_count(const kuhl_geometry *geom);
 
 void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options);
+int kuhl_geometry_attrib_index(kuhl_geometry *geom, const char *name);
 GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *size);
+void kuhl_geometry_unmap(kuhl_geometry *geom);
 void kuhl_geometry_indices(kuhl_geometry *geom, GLuint *indices, GLuint indexCount);
+void kuhl_geometry_lods(kuhl_geometry *geom, unsigned int levels, GLuint **indices, const GLuint *indexCounts);
+unsigned int kuhl_geometry_pool(kuhl_geometry *geom, int kg_options);
 void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint components, const char* name, int kg_options);
+void kuhl_geometry_attrib_interleaved(kuhl_geometry *geom, unsigned int count, const GLfloat *data[], const GLuint components[], const char *names[], int kg_options);
+void kuhl_geometry_instance_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint components, GLuint instanceCount, const char* name, int kg_options);
 void kuhl_geometry_texture(kuhl_geometry *geom, GLuint texture, const char* name, int kg_options);
 
 
@@ -190,12 +375,20 @@ GLuint kuhl_read_texture_rgba_array(const unsigned char *array, int width, int h
 float kuhl_make_label(const char *label, GLuint *texName, float color[3], float bgcolor[4], float pointsize);
 float kuhl_read_texture_file_wrap(const char *filename, GLuint *texName, GLuint wrapS, GLuint wrapT);
 float kuhl_read_texture_file(const char *filename, GLuint *texName);
+int kuhl_read_cubemap_files(const char *filenames[6], GLuint *texName);
+int kuhl_read_cubemap_equirect(const char *filename, GLuint *texName, int faceSize);
 void kuhl_screenshot(const char *outputImageFilename);
 void kuhl_video_record(const char *fileLabel, int fps);
 
 #ifdef KUHL_UTIL_USE_ASSIMP
 void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, float time);
+void kuhl_update_models(kuhl_geometry **models, int n, unsigned int animationNum, const float *times);
+void kuhl_update_models_begin(kuhl_geometry **models, int n, unsigned int animationNum, const float *times);
+void kuhl_update_models_wait(void);
+void kuhl_load_model_options(int kg_options);
 kuhl_geometry* kuhl_load_model(const char *modelFilename, const char *textureDirname, GLuint program, float bbox[6]);
+int kuhl_load_models(const char **modelFilenames, const char **textureDirnames, int n,
+                     GLuint program, kuhl_geometry **models, float (*bboxes)[6]);
 #endif // end use assimp
 
 void kuhl_bbox_fit(float result[16], const float bbox[6], int sitOnXZPlane);
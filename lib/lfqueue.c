@@ -0,0 +1,208 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lfqueue.h"
+#include "msg.h"
+
+/** Returns the sequence number at the start of an MPMC slot. */
+static inline uint64_t* lfqueue_sequence(const lfqueue *q, uint64_t pos)
+{
+	return (uint64_t*) (q->slots + (pos & (q->capacity-1)) * q->slotSize);
+}
+
+/** Creates a new bounded lock-free queue.
+
+    @param capacity Number of items the queue can hold. It is rounded
+    up to a power of two.
+
+    @param itemSize The size of each item to be stored in the queue.
+
+    @param mode LFQUEUE_SPSC if only one thread adds items and only
+    one thread removes them, LFQUEUE_MPMC otherwise.
+
+    @return A pointer to a queue or NULL if we failed to allocate
+    the queue. The queue should eventually be free'd with
+    lfqueue_free().
+*/
+lfqueue* lfqueue_new(int capacity, int itemSize, lfqueue_mode mode)
+{
+	if(capacity < 1 || itemSize < 1)
+	{
+		msg(ERROR, "Invalid capacity (%d) or item size (%d)", capacity, itemSize);
+		return NULL;
+	}
+	int pow2 = 1;
+	while(pow2 < capacity)
+		pow2 *= 2;
+
+	lfqueue *q = malloc(sizeof(lfqueue));
+	if(q == NULL)
+	{
+		msg(ERROR, "Failed to allocate queue");
+		return NULL;
+	}
+	memset(q, 0, sizeof(lfqueue));
+	q->itemSize = itemSize;
+	q->capacity = pow2;
+	q->mode = mode;
+
+	/* MPMC slots have a sequence number in front of the item. Keep
+	 * the sequence numbers aligned. */
+	if(mode == LFQUEUE_MPMC)
+		q->slotSize = (sizeof(uint64_t) + itemSize + 7) / 8 * 8;
+	else
+		q->slotSize = itemSize;
+
+	q->slots = malloc((size_t) q->slotSize * pow2);
+	if(q->slots == NULL)
+	{
+		msg(ERROR, "Failed to allocate queue which can hold %d %d byte items.", pow2, itemSize);
+		free(q);
+		return NULL;
+	}
+
+	/* Slot i is ready to be written when its sequence number is i. */
+	if(mode == LFQUEUE_MPMC)
+	{
+		for(int i=0; i<pow2; i++)
+			*lfqueue_sequence(q, i) = i;
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return q;
+}
+
+/** Frees a queue. No other threads may be using the queue. */
+void lfqueue_free(lfqueue *q)
+{
+	if(q == NULL)
+		return;
+	free(q->slots);
+	free(q);
+}
+
+/** Adds a copy of an item to the end of the queue without waiting.
+
+    @param q The queue.
+
+    @param item A pointer to the item to add (itemSize bytes).
+
+    @return 1 if the item was added, 0 if the queue was full.
+*/
+int lfqueue_try_add(lfqueue *q, const void *item)
+{
+	if(q->mode == LFQUEUE_SPSC)
+	{
+		/* Only this thread changes tail. Reading head (which the
+		 * consumer changes) is only needed when the queue looks full. */
+		uint64_t tail = q->tail;
+		if(tail - q->cachedHead == (uint64_t) q->capacity)
+		{
+			q->cachedHead = __atomic_load_n(&(q->head), __ATOMIC_ACQUIRE);
+			if(tail - q->cachedHead == (uint64_t) q->capacity)
+				return 0;
+		}
+		memcpy(q->slots + (tail & (q->capacity-1)) * q->slotSize, item, q->itemSize);
+		__atomic_store_n(&(q->tail), tail+1, __ATOMIC_RELEASE);
+		return 1;
+	}
+
+	uint64_t pos = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
+	uint64_t *sequence;
+	while(1)
+	{
+		sequence = lfqueue_sequence(q, pos);
+		int64_t dif = (int64_t) (__atomic_load_n(sequence, __ATOMIC_ACQUIRE) - pos);
+		if(dif == 0)
+		{
+			/* The slot is free; try to claim it. */
+			if(__atomic_compare_exchange_n(&(q->tail), &pos, pos+1, 1,
+			                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(dif < 0)
+			return 0; /* The consumers haven't removed this slot's item yet. */
+		else
+			pos = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
+	}
+	memcpy(sequence+1, item, q->itemSize);
+	__atomic_store_n(sequence, pos+1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/** Removes the item at the front of the queue without waiting.
+
+    @param q The queue.
+
+    @param result If not NULL, the item is copied here (itemSize bytes).
+
+    @return 1 if an item was removed, 0 if the queue was empty.
+*/
+int lfqueue_try_remove(lfqueue *q, void *result)
+{
+	if(q->mode == LFQUEUE_SPSC)
+	{
+		uint64_t head = q->head;
+		if(head == q->cachedTail)
+		{
+			q->cachedTail = __atomic_load_n(&(q->tail), __ATOMIC_ACQUIRE);
+			if(head == q->cachedTail)
+				return 0;
+		}
+		if(result != NULL)
+			memcpy(result, q->slots + (head & (q->capacity-1)) * q->slotSize, q->itemSize);
+		__atomic_store_n(&(q->head), head+1, __ATOMIC_RELEASE);
+		return 1;
+	}
+
+	uint64_t pos = __atomic_load_n(&(q->head), __ATOMIC_RELAXED);
+	uint64_t *sequence;
+	while(1)
+	{
+		sequence = lfqueue_sequence(q, pos);
+		int64_t dif = (int64_t) (__atomic_load_n(sequence, __ATOMIC_ACQUIRE) - (pos+1));
+		if(dif == 0)
+		{
+			/* The slot has an item; try to claim it. */
+			if(__atomic_compare_exchange_n(&(q->head), &pos, pos+1, 1,
+			                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(dif < 0)
+			return 0; /* No producer has finished writing this slot. */
+		else
+			pos = __atomic_load_n(&(q->head), __ATOMIC_RELAXED);
+	}
+	if(result != NULL)
+		memcpy(result, sequence+1, q->itemSize);
+	/* Let producers reuse the slot the next time around the ring. */
+	__atomic_store_n(sequence, pos + q->capacity, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/** Returns the number of items in the queue. If other threads are
+ * using the queue, the length may have changed by the time this
+ * function returns. */
+int lfqueue_length(const lfqueue *q)
+{
+	uint64_t head = __atomic_load_n(&(q->head), __ATOMIC_ACQUIRE);
+	uint64_t tail = __atomic_load_n(&(q->tail), __ATOMIC_ACQUIRE);
+	if(tail < head)
+		return 0;
+	int length = (int) (tail - head);
+	return length > q->capacity ? q->capacity : length;
+}
+
+/** Returns the number of items that the queue can hold. */
+int lfqueue_capacity(const lfqueue *q)
+{
+	return q->capacity;
+}
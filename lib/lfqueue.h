@@ -0,0 +1,91 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    lfqueue is a bounded queue that threads can use to pass items to
+    each other without locks. Like queue (see queue.h), it stores a
+    *copy* of each item and all items must be the same size. Unlike
+    queue, it never grows: lfqueue_try_add() returns 0 if the queue is
+    full and lfqueue_try_remove() returns 0 if it is empty, so neither
+    function ever waits.
+
+    For example, to send ints from one thread to another:
+
+    <pre>
+    lfqueue *q = lfqueue_new(1024, sizeof(int), LFQUEUE_SPSC);
+    // producer thread:
+    int i = 4;
+    if(!lfqueue_try_add(q, &i))
+        printf("Queue was full\n");
+    // consumer thread:
+    int x;
+    while(lfqueue_try_remove(q, &x))
+        printf("%d\n", x);
+    </pre>
+
+    An LFQUEUE_SPSC queue may only be used by one thread that adds
+    items and one thread that removes them (for example, a tracker
+    thread and the render thread). An LFQUEUE_MPMC queue may be used
+    by any number of threads (for example, a pool of workers); it is
+    Dmitry Vyukov's bounded MPMC queue, the same algorithm used by
+    msg's asynchronous mode.
+
+    The positions that producers and consumers change are on separate
+    cache lines so that they don't slow each other down.
+
+    @author Scott Kuhl
+ */
+
+#ifndef __LFQUEUE_H__
+#define __LFQUEUE_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LFQUEUE_CACHE_LINE 64 /**< Bytes between fields written by different threads */
+
+/** How an lfqueue may be used. */
+typedef enum
+{
+	LFQUEUE_SPSC, /**< One thread adds items, one thread removes items */
+	LFQUEUE_MPMC  /**< Any number of threads add and remove items */
+} lfqueue_mode;
+
+/** A bounded lock-free queue. Create with lfqueue_new(). */
+typedef struct
+{
+	char *slots; /**< capacity slots of slotSize bytes (MPMC slots start with a sequence number) */
+	int itemSize; /**< Size of each item in bytes */
+	int slotSize; /**< Bytes between the start of each slot */
+	int capacity; /**< Number of items that the queue can hold (a power of 2) */
+	lfqueue_mode mode;
+	char pad0[LFQUEUE_CACHE_LINE];
+
+	uint64_t tail; /**< Number of items that have been added */
+	uint64_t cachedHead; /**< SPSC: The producer's copy of head */
+	char pad1[LFQUEUE_CACHE_LINE];
+
+	uint64_t head; /**< Number of items that have been removed */
+	uint64_t cachedTail; /**< SPSC: The consumer's copy of tail */
+	char pad2[LFQUEUE_CACHE_LINE];
+} lfqueue;
+
+lfqueue* lfqueue_new(int capacity, int itemSize, lfqueue_mode mode);
+void lfqueue_free(lfqueue *q);
+
+int lfqueue_try_add(lfqueue *q, const void *item);
+int lfqueue_try_remove(lfqueue *q, void *result);
+
+int lfqueue_length(const lfqueue *q);
+int lfqueue_capacity(const lfqueue *q);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+#endif // __LFQUEUE_H__
@@ -0,0 +1,717 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ *
+ * Reorders the triangles and vertices of meshes. See mesh-opt.h for
+ * details.
+ *
+ * The post-transform cache is simulated as a FIFO: each vertex
+ * remembers the time it was last added and it is still in the cache
+ * if fewer than MESH_OPT_CACHE_SIZE vertices have been added since
+ * then. The cache is emptied by advancing the time.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#include "mesh-opt.h"
+#include "kuhl-nodep.h"
+#include "msg.h"
+
+#define MESH_OPT_FORSYTH_CACHE 32 /**< Size of the LRU cache that mesh_opt_vertex_cache() scores vertices with */
+#define MESH_OPT_FORSYTH_VALENCE 32 /**< Number of precomputed valence scores */
+
+/** Returns 1 if every index refers to one of the vertices and there
+ * are whole triangles. */
+static int mesh_opt_check(const unsigned int *indices, size_t indexCount, size_t vertexCount, const char *func)
+{
+	if(indexCount % 3 != 0)
+	{
+		msg(ERROR, "%s: The number of indices (%zu) isn't a multiple of 3.\n", func, indexCount);
+		return 0;
+	}
+	for(size_t i=0; i<indexCount; i++)
+	{
+		if(indices[i] >= vertexCount)
+		{
+			msg(ERROR, "%s: Index %zu refers to vertex %u but there are only %zu vertices.\n",
+			    func, i, indices[i], vertexCount);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/** Adds a vertex to the simulated FIFO cache.
+ *
+ * @return 1 if the vertex was not in the cache.
+ */
+static inline unsigned int mesh_opt_cache_miss(unsigned int *timestamps, unsigned int *time, unsigned int v)
+{
+	if(*time - timestamps[v] > MESH_OPT_CACHE_SIZE)
+	{
+		timestamps[v] = (*time)++;
+		return 1;
+	}
+	return 0;
+}
+
+/** Calculates the average number of vertices that the GPU transforms
+ * per triangle, assuming a FIFO post-transform cache with
+ * MESH_OPT_CACHE_SIZE vertices. The result is between 0.5 (for
+ * large regular grids) and 3 (no vertex is reused).
+ *
+ * @param indices Three indices for each triangle.
+ * @param indexCount The number of indices.
+ * @param vertexCount The number of vertices.
+ *
+ * @return The average cache miss ratio, 0 if there are no triangles.
+ */
+float mesh_opt_acmr(const unsigned int *indices, size_t indexCount, size_t vertexCount)
+{
+	if(indexCount < 3 || !mesh_opt_check(indices, indexCount, vertexCount, __func__))
+		return 0;
+	unsigned int *timestamps = kuhl_malloc(sizeof(unsigned int)*vertexCount);
+	memset(timestamps, 0, sizeof(unsigned int)*vertexCount);
+	unsigned int time = MESH_OPT_CACHE_SIZE+1;
+	size_t misses = 0;
+	for(size_t i=0; i<indexCount; i++)
+		misses += mesh_opt_cache_miss(timestamps, &time, indices[i]);
+	free(timestamps);
+	return (float) misses / (indexCount/3);
+}
+
+/** Reorders triangles so that vertices are reused while they are in
+ * the post-transform cache (Tom Forsyth's algorithm). Each step
+ * draws the triangle with the highest score next. A vertex scores
+ * highly if it was used recently (but not by the last triangle, whose
+ * vertices may be reused anyway) and if few triangles that use it
+ * haven't been drawn yet, so that no vertex is left behind with a
+ * single triangle.
+ *
+ * @param indices Three indices for each triangle. The triangles are
+ * reordered in place; the vertices of each triangle stay in the same
+ * order so that the winding doesn't change.
+ *
+ * @param indexCount The number of indices.
+ *
+ * @param vertexCount The number of vertices.
+ */
+void mesh_opt_vertex_cache(unsigned int *indices, size_t indexCount, size_t vertexCount)
+{
+	size_t triCount = indexCount / 3;
+	if(triCount < 2 || !mesh_opt_check(indices, indexCount, vertexCount, __func__))
+		return;
+
+	float cacheScore[MESH_OPT_FORSYTH_CACHE];
+	for(int i=0; i<MESH_OPT_FORSYTH_CACHE; i++)
+	{
+		if(i < 3)
+			cacheScore[i] = 0.75f;
+		else
+			cacheScore[i] = powf(1.0f - (i-3) / (float) (MESH_OPT_FORSYTH_CACHE-3), 1.5f);
+	}
+	float valenceScore[MESH_OPT_FORSYTH_VALENCE];
+	valenceScore[0] = 0;
+	for(int i=1; i<MESH_OPT_FORSYTH_VALENCE; i++)
+		valenceScore[i] = 2.0f / sqrtf((float) i);
+
+	/* Find the triangles that use each vertex. The first remaining[v]
+	 * entries of adjacency starting at adjStart[v] are the triangles
+	 * that use vertex v and that haven't been drawn yet. */
+	unsigned int *adjStart = kuhl_malloc(sizeof(unsigned int)*(vertexCount+1));
+	unsigned int *remaining = kuhl_malloc(sizeof(unsigned int)*vertexCount);
+	unsigned int *adjacency = kuhl_malloc(sizeof(unsigned int)*indexCount);
+	memset(remaining, 0, sizeof(unsigned int)*vertexCount);
+	for(size_t i=0; i<indexCount; i++)
+		remaining[indices[i]]++;
+	adjStart[0] = 0;
+	for(size_t v=0; v<vertexCount; v++)
+		adjStart[v+1] = adjStart[v] + remaining[v];
+	memset(remaining, 0, sizeof(unsigned int)*vertexCount);
+	for(size_t i=0; i<indexCount; i++)
+	{
+		unsigned int v = indices[i];
+		adjacency[adjStart[v] + remaining[v]++] = (unsigned int) (i/3);
+	}
+
+	int *cachePos = kuhl_malloc(sizeof(int)*vertexCount);
+	float *vertexScore = kuhl_malloc(sizeof(float)*vertexCount);
+	for(size_t v=0; v<vertexCount; v++)
+	{
+		cachePos[v] = -1;
+		unsigned int r = remaining[v];
+		vertexScore[v] = valenceScore[r < MESH_OPT_FORSYTH_VALENCE ? r : MESH_OPT_FORSYTH_VALENCE-1];
+	}
+
+	float *triScore = kuhl_malloc(sizeof(float)*triCount);
+	unsigned char *drawn = kuhl_malloc(triCount);
+	memset(drawn, 0, triCount);
+	long best = -1;
+	float bestScore = -1;
+	for(size_t t=0; t<triCount; t++)
+	{
+		triScore[t] = vertexScore[indices[3*t]] + vertexScore[indices[3*t+1]] + vertexScore[indices[3*t+2]];
+		if(triScore[t] > bestScore)
+		{
+			bestScore = triScore[t];
+			best = (long) t;
+		}
+	}
+
+	unsigned int *result = kuhl_malloc(sizeof(unsigned int)*indexCount);
+	unsigned int cache[MESH_OPT_FORSYTH_CACHE+3];
+	unsigned int newCache[MESH_OPT_FORSYTH_CACHE+3];
+	int cacheCount = 0;
+	size_t next = 0; /* The first triangle that might not have been drawn */
+
+	for(size_t n=0; n<triCount; n++)
+	{
+		/* If no triangle uses a vertex in the cache, start again
+		 * with the next triangle in the original order. */
+		if(best < 0)
+		{
+			while(drawn[next])
+				next++;
+			best = (long) next;
+		}
+
+		const unsigned int *tri = indices + 3*best;
+		memcpy(result + 3*n, tri, sizeof(unsigned int)*3);
+		drawn[best] = 1;
+
+		/* Put the vertices of the triangle at the front of the
+		 * cache and remove the triangle from their lists. */
+		int newCount = 0;
+		for(int k=0; k<3; k++)
+		{
+			unsigned int v = tri[k];
+			unsigned int *list = adjacency + adjStart[v];
+			for(unsigned int j=0; j<remaining[v]; j++)
+			{
+				if(list[j] == (unsigned int) best)
+				{
+					list[j] = list[--remaining[v]];
+					break;
+				}
+			}
+			int duplicate = 0;
+			for(int j=0; j<newCount; j++)
+				if(newCache[j] == v)
+					duplicate = 1;
+			if(!duplicate)
+				newCache[newCount++] = v;
+		}
+		for(int j=0; j<cacheCount; j++)
+		{
+			unsigned int v = cache[j];
+			if(v != tri[0] && v != tri[1] && v != tri[2])
+				newCache[newCount++] = v;
+		}
+
+		/* Update the scores of the vertices that are in the cache
+		 * or that just fell out of it. */
+		for(int j=0; j<newCount; j++)
+		{
+			unsigned int v = newCache[j];
+			cachePos[v] = j < MESH_OPT_FORSYTH_CACHE ? j : -1;
+			unsigned int r = remaining[v];
+			float score = valenceScore[r < MESH_OPT_FORSYTH_VALENCE ? r : MESH_OPT_FORSYTH_VALENCE-1];
+			if(r > 0 && cachePos[v] >= 0)
+				score += cacheScore[cachePos[v]];
+			vertexScore[v] = score;
+		}
+
+		/* The next triangle is the best triangle that uses one of
+		 * these vertices. */
+		best = -1;
+		bestScore = -1;
+		for(int j=0; j<newCount; j++)
+		{
+			unsigned int v = newCache[j];
+			const unsigned int *list = adjacency + adjStart[v];
+			for(unsigned int a=0; a<remaining[v]; a++)
+			{
+				unsigned int t = list[a];
+				triScore[t] = vertexScore[indices[3*t]] + vertexScore[indices[3*t+1]] + vertexScore[indices[3*t+2]];
+				if(triScore[t] > bestScore)
+				{
+					bestScore = triScore[t];
+					best = (long) t;
+				}
+			}
+		}
+
+		cacheCount = newCount < MESH_OPT_FORSYTH_CACHE ? newCount : MESH_OPT_FORSYTH_CACHE;
+		memcpy(cache, newCache, sizeof(unsigned int)*cacheCount);
+	}
+
+	memcpy(indices, result, sizeof(unsigned int)*indexCount);
+	free(result);
+	free(drawn);
+	free(triScore);
+	free(vertexScore);
+	free(cachePos);
+	free(adjacency);
+	free(remaining);
+	free(adjStart);
+}
+
+/** A group of consecutive triangles that mesh_opt_overdraw() keeps together. */
+typedef struct
+{
+	size_t start; /**< First triangle in the cluster */
+	size_t count; /**< Number of triangles */
+	float key;    /**< Clusters with larger keys are drawn first */
+} mesh_opt_cluster;
+
+static int mesh_opt_cluster_compare(const void *a, const void *b)
+{
+	const mesh_opt_cluster *ca = (const mesh_opt_cluster*) a;
+	const mesh_opt_cluster *cb = (const mesh_opt_cluster*) b;
+	if(ca->key != cb->key)
+		return ca->key > cb->key ? -1 : 1;
+	return ca->start < cb->start ? -1 : (ca->start > cb->start);
+}
+
+/** Reorders clusters of triangles to reduce overdraw. This should be
+ * called after mesh_opt_vertex_cache().
+ *
+ * The triangles are split wherever all three vertices of a
+ * triangle miss the cache, since moving the triangles after that
+ * point costs nothing. Those clusters are split further as long as
+ * the cache miss ratio of each part stays within threshold times
+ * the ratio of the whole cluster. The clusters that face away from
+ * the center of the mesh are then drawn first.
+ *
+ * @param indices Three indices for each triangle, reordered in place.
+ * @param indexCount The number of indices.
+ * @param positions The x, y and z coordinates of each vertex.
+ * @param positionStride The number of floats between the start of the positions of consecutive vertices (3 if they are packed).
+ * @param vertexCount The number of vertices.
+ * @param threshold How much worse the cache miss ratio may become (1.05 allows 5%). Values below 1 are treated as 1.
+ */
+void mesh_opt_overdraw(unsigned int *indices, size_t indexCount, const float *positions,
+                       size_t positionStride, size_t vertexCount, float threshold)
+{
+	size_t triCount = indexCount / 3;
+	if(triCount < 2 || !mesh_opt_check(indices, indexCount, vertexCount, __func__))
+		return;
+	if(threshold < 1)
+		threshold = 1;
+
+	unsigned int *timestamps = kuhl_malloc(sizeof(unsigned int)*vertexCount);
+	memset(timestamps, 0, sizeof(unsigned int)*vertexCount);
+	unsigned int time = MESH_OPT_CACHE_SIZE+1;
+
+	/* Find the hard boundaries. */
+	size_t *hard = kuhl_malloc(sizeof(size_t)*(triCount+1));
+	size_t hardCount = 0;
+	for(size_t t=0; t<triCount; t++)
+	{
+		unsigned int misses = mesh_opt_cache_miss(timestamps, &time, indices[3*t]) +
+			mesh_opt_cache_miss(timestamps, &time, indices[3*t+1]) +
+			mesh_opt_cache_miss(timestamps, &time, indices[3*t+2]);
+		if(misses == 3 || t == 0)
+			hard[hardCount++] = t;
+	}
+	hard[hardCount] = triCount;
+
+	/* Split the clusters further wherever the part of the cluster
+	 * since the last split has a low enough miss ratio. */
+	mesh_opt_cluster *clusters = kuhl_malloc(sizeof(mesh_opt_cluster)*triCount);
+	size_t clusterCount = 0;
+	for(size_t h=0; h<hardCount; h++)
+	{
+		size_t start = hard[h], end = hard[h+1];
+		time += MESH_OPT_CACHE_SIZE+1;
+		size_t clusterMisses = 0;
+		for(size_t i=3*start; i<3*end; i++)
+			clusterMisses += mesh_opt_cache_miss(timestamps, &time, indices[i]);
+		float limit = threshold * clusterMisses / (end-start);
+
+		time += MESH_OPT_CACHE_SIZE+1;
+		size_t misses = 0;
+		size_t first = start;
+		for(size_t t=start; t<end; t++)
+		{
+			for(int k=0; k<3; k++)
+				misses += mesh_opt_cache_miss(timestamps, &time, indices[3*t+k]);
+			if(t+1 < end && misses <= limit * (t+1-first))
+			{
+				clusters[clusterCount].start = first;
+				clusters[clusterCount].count = t+1-first;
+				clusterCount++;
+				first = t+1;
+				misses = 0;
+				time += MESH_OPT_CACHE_SIZE+1;
+			}
+		}
+		clusters[clusterCount].start = first;
+		clusters[clusterCount].count = end-first;
+		clusterCount++;
+	}
+	free(hard);
+	free(timestamps);
+
+	/* Calculate the center of the mesh (weighted by area) and the
+	 * center and direction of each cluster. */
+	float *clusterData = kuhl_malloc(sizeof(float)*6*clusterCount);
+	double meshCenter[3] = { 0, 0, 0 };
+	double meshArea = 0;
+	for(size_t c=0; c<clusterCount; c++)
+	{
+		float *center = clusterData + 6*c;
+		float *normal = center + 3;
+		double sum[3] = { 0, 0, 0 }, dir[3] = { 0, 0, 0 }, area = 0;
+		for(size_t t=clusters[c].start; t<clusters[c].start+clusters[c].count; t++)
+		{
+			const float *a = positions + indices[3*t]*positionStride;
+			const float *b = positions + indices[3*t+1]*positionStride;
+			const float *d = positions + indices[3*t+2]*positionStride;
+			double e1[3] = { b[0]-a[0], b[1]-a[1], b[2]-a[2] };
+			double e2[3] = { d[0]-a[0], d[1]-a[1], d[2]-a[2] };
+			double n[3] = { e1[1]*e2[2]-e1[2]*e2[1],
+			                e1[2]*e2[0]-e1[0]*e2[2],
+			                e1[0]*e2[1]-e1[1]*e2[0] };
+			double triArea = sqrt(n[0]*n[0]+n[1]*n[1]+n[2]*n[2]) / 2;
+			for(int k=0; k<3; k++)
+			{
+				sum[k] += triArea * (a[k]+b[k]+d[k]) / 3;
+				dir[k] += n[k];
+			}
+			area += triArea;
+		}
+		for(int k=0; k<3; k++)
+		{
+			meshCenter[k] += sum[k];
+			center[k] = (float) (area > 0 ? sum[k]/area : 0);
+		}
+		meshArea += area;
+		double len = sqrt(dir[0]*dir[0]+dir[1]*dir[1]+dir[2]*dir[2]);
+		for(int k=0; k<3; k++)
+			normal[k] = (float) (len > 0 ? dir[k]/len : 0);
+	}
+	for(int k=0; k<3; k++)
+		meshCenter[k] = meshArea > 0 ? meshCenter[k]/meshArea : 0;
+
+	/* Clusters that are far from the center and face outward are
+	 * likely to be in front of the rest of the mesh. */
+	for(size_t c=0; c<clusterCount; c++)
+	{
+		const float *center = clusterData + 6*c;
+		const float *normal = center + 3;
+		clusters[c].key = (float) ((center[0]-meshCenter[0])*normal[0] +
+		                           (center[1]-meshCenter[1])*normal[1] +
+		                           (center[2]-meshCenter[2])*normal[2]);
+	}
+	free(clusterData);
+	qsort(clusters, clusterCount, sizeof(mesh_opt_cluster), mesh_opt_cluster_compare);
+
+	unsigned int *result = kuhl_malloc(sizeof(unsigned int)*indexCount);
+	size_t n = 0;
+	for(size_t c=0; c<clusterCount; c++)
+	{
+		memcpy(result + n, indices + 3*clusters[c].start, sizeof(unsigned int)*3*clusters[c].count);
+		n += 3*clusters[c].count;
+	}
+	memcpy(indices, result, sizeof(unsigned int)*indexCount);
+	free(result);
+	free(clusters);
+}
+
+/** Renumbers the vertices in the order that the indices first use
+ * them. The caller must move the data of each vertex v to position
+ * remap[v] in every vertex attribute.
+ *
+ * @param remap An array of vertexCount values to be filled in with
+ * the new position of each vertex. Vertices that no triangle uses
+ * are moved after the ones that are used.
+ *
+ * @param indices The indices, which are changed to refer to the new
+ * positions of the vertices.
+ *
+ * @param indexCount The number of indices.
+ *
+ * @param vertexCount The number of vertices.
+ *
+ * @return The number of vertices that are used by the indices.
+ */
+size_t mesh_opt_vertex_fetch(unsigned int *remap, unsigned int *indices, size_t indexCount, size_t vertexCount)
+{
+	for(size_t v=0; v<vertexCount; v++)
+		remap[v] = (unsigned int) v;
+	if(!mesh_opt_check(indices, indexCount, vertexCount, __func__))
+		return vertexCount;
+
+	const unsigned int unused = ~0u;
+	for(size_t v=0; v<vertexCount; v++)
+		remap[v] = unused;
+	unsigned int next = 0;
+	for(size_t i=0; i<indexCount; i++)
+	{
+		unsigned int v = indices[i];
+		if(remap[v] == unused)
+			remap[v] = next++;
+		indices[i] = remap[v];
+	}
+	size_t used = next;
+	for(size_t v=0; v<vertexCount; v++)
+		if(remap[v] == unused)
+			remap[v] = next++;
+	return used;
+}
+
+/** Assigns each vertex to a cell of a grid that has cells cells
+ * along the longest side of the bounding box.
+ *
+ * @param cellOf Filled in with the cell of each vertex. Cells are
+ * numbered from 0 in the order that they are first found.
+ *
+ * @return The number of cells that contain vertices.
+ */
+static size_t mesh_opt_grid(unsigned int *cellOf, const float *positions, size_t positionStride,
+                               size_t vertexCount, const float bbox[6], unsigned int cells)
+{
+	float extent = 0;
+	for(int k=0; k<3; k++)
+		if(bbox[2*k+1] - bbox[2*k] > extent)
+			extent = bbox[2*k+1] - bbox[2*k];
+	float scale = extent > 0 ? cells / extent : 0;
+
+	/* Cell coordinates are hashed into an open addressing table that
+	 * is at most half full. */
+	size_t capacity = 1;
+	while(capacity < 2*vertexCount)
+		capacity *= 2;
+	uint64_t *keys = kuhl_malloc(sizeof(uint64_t)*capacity);
+	unsigned int *values = kuhl_malloc(sizeof(unsigned int)*capacity);
+	memset(keys, 0xFF, sizeof(uint64_t)*capacity);
+
+	size_t count = 0;
+	for(size_t v=0; v<vertexCount; v++)
+	{
+		const float *p = positions + v*positionStride;
+		uint64_t key = 0;
+		for(int k=0; k<3; k++)
+		{
+			uint64_t c = (uint64_t) ((p[k] - bbox[2*k]) * scale);
+			if(c >= cells)
+				c = cells-1;
+			key = (key << 21) | c;
+		}
+		size_t slot = (size_t) ((key * 0x9E3779B97F4A7C15ull) >> 32) & (capacity-1);
+		while(keys[slot] != key && keys[slot] != UINT64_MAX)
+			slot = (slot+1) & (capacity-1);
+		if(keys[slot] == UINT64_MAX)
+		{
+			keys[slot] = key;
+			values[slot] = (unsigned int) count++;
+		}
+		cellOf[v] = values[slot];
+	}
+	free(values);
+	free(keys);
+	return count;
+}
+
+/** Counts the triangles whose vertices are in three different cells. */
+static size_t mesh_opt_grid_triangles(const unsigned int *cellOf, const unsigned int *indices, size_t indexCount)
+{
+	size_t count = 0;
+	for(size_t i=0; i<indexCount; i+=3)
+	{
+		unsigned int a = cellOf[indices[i]], b = cellOf[indices[i+1]], c = cellOf[indices[i+2]];
+		if(a != b && b != c && a != c)
+			count++;
+	}
+	return count;
+}
+
+/** Creates a simplified version of a mesh by merging the vertices
+ * that are close to each other. The size of the grid is chosen so
+ * that the result has as many triangles as possible without having
+ * more than targetIndexCount/3. Each group of merged vertices is
+ * replaced by the vertex that is closest to their average, so the
+ * result uses the same vertices as the original mesh. Triangles that
+ * become degenerate are removed.
+ *
+ * @param dest An array of at least indexCount values to store the
+ * simplified indices in.
+ *
+ * @param indices Three indices for each triangle.
+ * @param indexCount The number of indices.
+ * @param positions The x, y and z coordinates of each vertex.
+ * @param positionStride The number of floats between the start of the positions of consecutive vertices.
+ * @param vertexCount The number of vertices.
+ * @param targetIndexCount The maximum number of indices to create.
+ *
+ * @return The number of indices stored in dest.
+ */
+size_t mesh_opt_simplify(unsigned int *dest, const unsigned int *indices, size_t indexCount,
+                         const float *positions, size_t positionStride, size_t vertexCount,
+                         size_t targetIndexCount)
+{
+	if(indexCount < 3 || !mesh_opt_check(indices, indexCount, vertexCount, __func__))
+		return 0;
+	if(targetIndexCount >= indexCount)
+	{
+		memcpy(dest, indices, sizeof(unsigned int)*indexCount);
+		return indexCount;
+	}
+
+	float bbox[6] = { FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX };
+	for(size_t v=0; v<vertexCount; v++)
+	{
+		const float *p = positions + v*positionStride;
+		for(int k=0; k<3; k++)
+		{
+			if(p[k] < bbox[2*k])   bbox[2*k]   = p[k];
+			if(p[k] > bbox[2*k+1]) bbox[2*k+1] = p[k];
+		}
+	}
+
+	/* Find the finest grid that removes enough triangles. Finer
+	 * grids nearly always keep more triangles. */
+	unsigned int *cellOf = kuhl_malloc(sizeof(unsigned int)*vertexCount);
+	unsigned int lo = 1, hi = 1 << 20;
+	while(lo < hi)
+	{
+		unsigned int mid = lo + (hi-lo+1)/2;
+		mesh_opt_grid(cellOf, positions, positionStride, vertexCount, bbox, mid);
+		if(3*mesh_opt_grid_triangles(cellOf, indices, indexCount) <= targetIndexCount)
+			lo = mid;
+		else
+			hi = mid-1;
+	}
+	size_t cellCount = mesh_opt_grid(cellOf, positions, positionStride, vertexCount, bbox, lo);
+
+	/* Use the vertex closest to the average of each cell. Vertices
+	 * that no triangle uses are ignored. */
+	unsigned char *used = kuhl_malloc(vertexCount);
+	memset(used, 0, vertexCount);
+	for(size_t i=0; i<indexCount; i++)
+		used[indices[i]] = 1;
+	double *sum = kuhl_malloc(sizeof(double)*4*cellCount);
+	memset(sum, 0, sizeof(double)*4*cellCount);
+	for(size_t v=0; v<vertexCount; v++)
+	{
+		if(!used[v])
+			continue;
+		double *s = sum + 4*cellOf[v];
+		for(int k=0; k<3; k++)
+			s[k] += positions[v*positionStride+k];
+		s[3]++;
+	}
+	unsigned int *best = kuhl_malloc(sizeof(unsigned int)*cellCount);
+	float *bestDist = kuhl_malloc(sizeof(float)*cellCount);
+	for(size_t c=0; c<cellCount; c++)
+		bestDist[c] = FLT_MAX;
+	for(size_t v=0; v<vertexCount; v++)
+	{
+		if(!used[v])
+			continue;
+		unsigned int c = cellOf[v];
+		const double *s = sum + 4*c;
+		float dist = 0;
+		for(int k=0; k<3; k++)
+		{
+			float d = (float) (positions[v*positionStride+k] - s[k]/s[3]);
+			dist += d*d;
+		}
+		if(dist < bestDist[c])
+		{
+			bestDist[c] = dist;
+			best[c] = (unsigned int) v;
+		}
+	}
+
+	size_t n = 0;
+	for(size_t i=0; i<indexCount && n+3 <= targetIndexCount; i+=3)
+	{
+		unsigned int a = cellOf[indices[i]], b = cellOf[indices[i+1]], c = cellOf[indices[i+2]];
+		if(a == b || b == c || a == c)
+			continue;
+		dest[n++] = best[a];
+		dest[n++] = best[b];
+		dest[n++] = best[c];
+	}
+
+	free(bestDist);
+	free(best);
+	free(sum);
+	free(used);
+	free(cellOf);
+	return n;
+}
+
+/** Creates a chain of simplified versions of a mesh. Each level has
+ * about ratio times as many triangles as the level before it. Levels
+ * are added until a level would have fewer than minIndexCount
+ * indices, until simplifying stops removing triangles, or until there
+ * are MESH_OPT_MAX_LODS levels. Each level is ordered with
+ * mesh_opt_vertex_cache().
+ *
+ * @param lod The structure to fill in. Free it with mesh_opt_lod_free().
+ * @param indices Three indices for each triangle of the original mesh.
+ * @param indexCount The number of indices.
+ * @param positions The x, y and z coordinates of each vertex.
+ * @param positionStride The number of floats between the start of the positions of consecutive vertices.
+ * @param vertexCount The number of vertices.
+ * @param ratio The fraction of the triangles to keep in each level (for example, 0.25).
+ * @param minIndexCount The smallest number of indices that a level may have.
+ *
+ * @return The number of levels that were created.
+ */
+unsigned int mesh_opt_lod_build(mesh_opt_lod *lod, const unsigned int *indices, size_t indexCount,
+                                const float *positions, size_t positionStride, size_t vertexCount,
+                                float ratio, size_t minIndexCount)
+{
+	memset(lod, 0, sizeof(mesh_opt_lod));
+	if(ratio <= 0 || ratio >= 1)
+		return 0;
+
+	size_t prevCount = indexCount;
+	unsigned int *buffer = kuhl_malloc(sizeof(unsigned int)*indexCount);
+	while(lod->levels < MESH_OPT_MAX_LODS)
+	{
+		size_t target = (size_t) (prevCount * ratio) / 3 * 3;
+		if(target < minIndexCount)
+			break;
+		/* Simplify the original mesh each time so that errors don't
+		 * accumulate. */
+		size_t count = mesh_opt_simplify(buffer, indices, indexCount, positions,
+		                                 positionStride, vertexCount, target);
+		if(count < 3 || count < minIndexCount || count > prevCount*0.9)
+			break;
+		unsigned int *level = kuhl_malloc(sizeof(unsigned int)*count);
+		memcpy(level, buffer, sizeof(unsigned int)*count);
+		mesh_opt_vertex_cache(level, count, vertexCount);
+		lod->indices[lod->levels] = level;
+		lod->indexCount[lod->levels] = (unsigned int) count;
+		lod->levels++;
+		prevCount = count;
+	}
+	free(buffer);
+	return lod->levels;
+}
+
+/** Frees the index lists in a mesh_opt_lod (unless they are in a
+ * memory-mapped file) and sets the number of levels to 0. */
+void mesh_opt_lod_free(mesh_opt_lod *lod)
+{
+	if(lod == NULL)
+		return;
+	if(!lod->mapped)
+		for(unsigned int i=0; i<lod->levels; i++)
+			free(lod->indices[i]);
+	memset(lod, 0, sizeof(mesh_opt_lod));
+}
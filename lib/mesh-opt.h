@@ -0,0 +1,92 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    mesh-opt reorders the triangles and vertices of an indexed
+    triangle mesh so that the GPU can draw it faster without changing
+    what is drawn. kuhl_load_model() applies it to every mesh that
+    ASSIMP imports before the scene is stored in the model cache (see
+    model-cache.h). The steps are usually applied in this order:
+
+    <pre>
+    mesh_opt_vertex_cache(indices, indexCount, vertexCount);
+    mesh_opt_overdraw(indices, indexCount, positions, 3, vertexCount, 1.05f);
+    mesh_opt_vertex_fetch(remap, indices, indexCount, vertexCount);
+    // reorder every vertex attribute with remap
+    </pre>
+
+    mesh_opt_vertex_cache() orders the triangles so that recently
+    used vertices are used again while they are still in the GPU's
+    post-transform cache, which reduces the number of times that the
+    vertex shader runs. It is Tom Forsyth's "Linear-Speed Vertex
+    Cache Optimisation" algorithm.
+
+    mesh_opt_overdraw() splits the triangles into clusters at the
+    points where the cache is mostly cold and draws clusters that
+    face away from the center of the mesh first so that they hide the
+    triangles behind them. The threshold limits how much vertex cache
+    efficiency may be lost (1.05 allows 5% more vertex shader runs).
+
+    mesh_opt_vertex_fetch() numbers the vertices in the order that
+    they are first used so that vertex data is read from memory
+    sequentially.
+
+    mesh_opt_simplify() creates a version of a mesh with fewer
+    triangles that uses the same vertices, so that it can be drawn
+    from the same vertex buffer when the mesh is far away. It merges
+    all of the vertices in each cell of a grid into one (vertex
+    clustering), which is fast enough for meshes with millions of
+    triangles but does not preserve texture seams or sharp
+    edges. mesh_opt_lod_build() calls it repeatedly to create a chain
+    of levels of detail (LODs).
+
+    mesh_opt_acmr() measures the average number of vertex shader runs
+    per triangle (the average cache miss ratio) of a mesh.
+
+    @author Scott Kuhl
+ */
+
+#ifndef __MESH_OPT_H__
+#define __MESH_OPT_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MESH_OPT_CACHE_SIZE 16 /**< Post-transform cache size that mesh_opt_acmr() and mesh_opt_overdraw() simulate */
+#define MESH_OPT_MAX_LODS 4 /**< Maximum number of simplified index lists in a mesh_opt_lod */
+
+/** Simplified versions of the triangles of one mesh, from the most
+ * detailed to the least detailed. The original indices are not
+ * included. Create with mesh_opt_lod_build(). */
+typedef struct
+{
+	unsigned int levels; /**< Number of simplified index lists */
+	unsigned int indexCount[MESH_OPT_MAX_LODS]; /**< Number of indices in each list */
+	unsigned int *indices[MESH_OPT_MAX_LODS]; /**< The index lists */
+	int mapped; /**< 1 if the lists point into a memory-mapped file and must not be free'd */
+} mesh_opt_lod;
+
+void mesh_opt_vertex_cache(unsigned int *indices, size_t indexCount, size_t vertexCount);
+void mesh_opt_overdraw(unsigned int *indices, size_t indexCount, const float *positions,
+                       size_t positionStride, size_t vertexCount, float threshold);
+size_t mesh_opt_vertex_fetch(unsigned int *remap, unsigned int *indices, size_t indexCount, size_t vertexCount);
+float mesh_opt_acmr(const unsigned int *indices, size_t indexCount, size_t vertexCount);
+
+size_t mesh_opt_simplify(unsigned int *dest, const unsigned int *indices, size_t indexCount,
+                         const float *positions, size_t positionStride, size_t vertexCount,
+                         size_t targetIndexCount);
+unsigned int mesh_opt_lod_build(mesh_opt_lod *lod, const unsigned int *indices, size_t indexCount,
+                                const float *positions, size_t positionStride, size_t vertexCount,
+                                float ratio, size_t minIndexCount);
+void mesh_opt_lod_free(mesh_opt_lod *lod);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+#endif // __MESH_OPT_H__
@@ -0,0 +1,758 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ *
+ * See model-cache.h for a description of how the cache is used. The
+ * file starts with a model_cache_header followed by the meshes,
+ * materials, node hierarchy and animations of the scene and (if the
+ * header includes MODEL_CACHE_LOD) the simplified index lists of
+ * each mesh. Every array
+ * in the file begins on an 8 byte boundary so that it can be used in
+ * place once the file is memory-mapped.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assimp/cimport.h>
+#include <assimp/scene.h>
+
+#include "msg.h"
+#include "model-cache.h"
+#include "mesh-opt.h"
+
+#define MODEL_CACHE_MAGIC "KUHLMDL"
+#define MODEL_CACHE_VERSION 2
+
+/** The first bytes in every cache file. */
+typedef struct
+{
+	char magic[8]; /**< MODEL_CACHE_MAGIC */
+	uint32_t version; /**< MODEL_CACHE_VERSION */
+	uint32_t aiFlags; /**< ASSIMP post-processing flags used to import the model */
+	uint32_t options; /**< MODEL_CACHE_* processing that kuhl_load_model() applied after importing */
+	int64_t modelSize; /**< Size of the model file in bytes */
+	int64_t modelMtime; /**< Modification time of the model file */
+	/** Sizes of the ASSIMP structs that we store directly in the
+	 * file. If ASSIMP is compiled differently, the cache is ignored. */
+	uint32_t structSizes[7];
+	char modelPath[1024]; /**< Path of the model that this cache is for */
+} model_cache_header;
+
+/** Fills in the structSizes array for a model_cache_header. */
+static void model_cache_struct_sizes(uint32_t sizes[7])
+{
+	sizes[0] = sizeof(struct aiVector3D);
+	sizes[1] = sizeof(struct aiColor4D);
+	sizes[2] = sizeof(struct aiMatrix4x4);
+	sizes[3] = sizeof(struct aiVertexWeight);
+	sizes[4] = sizeof(struct aiVectorKey);
+	sizes[5] = sizeof(struct aiQuatKey);
+	sizes[6] = sizeof(struct aiMeshKey);
+}
+
+/** Returns 0 if the cache should not be used. */
+static int model_cache_enabled(void)
+{
+	const char *s = getenv("KUHL_MODEL_CACHE");
+	if(s != NULL && strcmp(s, "0") == 0)
+		return 0;
+	return 1;
+}
+
+/** Determines the name of the cache file for a model.
+ *
+ * @param result A buffer to write the name into.
+ * @param len The length of the result buffer.
+ * @param modelFilename The model file.
+ */
+static void model_cache_filename(char *result, size_t len, const char *modelFilename)
+{
+	const char *dir = getenv("KUHL_MODEL_CACHE_DIR");
+	if(dir == NULL || strlen(dir) == 0)
+	{
+		snprintf(result, len, "%s.kuhlcache", modelFilename);
+		return;
+	}
+
+	/* Flatten the model path into a single filename. */
+	char flat[1024];
+	snprintf(flat, 1024, "%s", modelFilename);
+	for(char *c = flat; *c != '\0'; c++)
+		if(*c == '/')
+			*c = '_';
+	snprintf(result, len, "%s/%s.kuhlcache", dir, flat);
+}
+
+/** Fills in a header for the model file as it currently exists on
+ * disk.
+ *
+ * @return 1 on success, 0 if the model file can't be stat()'d.
+ */
+static int model_cache_make_header(model_cache_header *header, const char *modelFilename, unsigned int aiFlags, unsigned int options)
+{
+	struct stat st;
+	if(stat(modelFilename, &st) != 0)
+		return 0;
+	memset(header, 0, sizeof(model_cache_header));
+	memcpy(header->magic, MODEL_CACHE_MAGIC, strlen(MODEL_CACHE_MAGIC)+1);
+	header->version = MODEL_CACHE_VERSION;
+	header->aiFlags = aiFlags;
+	header->options = options;
+	header->modelSize = (int64_t) st.st_size;
+	header->modelMtime = (int64_t) st.st_mtime;
+	model_cache_struct_sizes(header->structSizes);
+	snprintf(header->modelPath, 1024, "%s", modelFilename);
+	return 1;
+}
+
+
+/* ====== Writing ====== */
+
+/** Keeps track of a cache file while it is being written. */
+typedef struct
+{
+	FILE *f;
+	long offset; /**< Number of bytes written so far */
+	int error; /**< Set to 1 if any write failed */
+} model_cache_writer;
+
+static void mcw_bytes(model_cache_writer *w, const void *data, size_t len)
+{
+	if(len == 0 || w->error)
+		return;
+	if(fwrite(data, 1, len, w->f) != len)
+		w->error = 1;
+	w->offset += (long) len;
+}
+
+/** Writes zeros until the file offset is a multiple of 8. */
+static void mcw_align(model_cache_writer *w)
+{
+	static const char zeros[8] = { 0 };
+	if(w->offset % 8 != 0)
+		mcw_bytes(w, zeros, 8 - w->offset % 8);
+}
+
+static void mcw_u32(model_cache_writer *w, uint32_t val)
+{ mcw_bytes(w, &val, sizeof(uint32_t)); }
+
+static void mcw_f64(model_cache_writer *w, double val)
+{ mcw_align(w); mcw_bytes(w, &val, sizeof(double)); }
+
+/** Writes an array that will be used in place when the file is read. */
+static void mcw_array(model_cache_writer *w, const void *data, size_t len)
+{ mcw_align(w); mcw_bytes(w, data, len); }
+
+static void mcw_string(model_cache_writer *w, const struct aiString *s)
+{
+	uint32_t len = (uint32_t) strlen(s->data);
+	mcw_u32(w, len);
+	mcw_bytes(w, s->data, len);
+}
+
+static void mcw_mesh(model_cache_writer *w, const struct aiMesh *mesh)
+{
+	uint32_t present = 0;
+	if(mesh->mNormals)    present |= 1;
+	if(mesh->mTangents)   present |= 2;
+	if(mesh->mBitangents) present |= 4;
+	for(int i=0; i<AI_MAX_NUMBER_OF_COLOR_SETS && i<8; i++)
+		if(mesh->mColors[i])
+			present |= 1 << (8+i);
+	for(int i=0; i<AI_MAX_NUMBER_OF_TEXTURECOORDS && i<8; i++)
+		if(mesh->mTextureCoords[i])
+			present |= 1 << (16+i);
+
+	mcw_u32(w, mesh->mPrimitiveTypes);
+	mcw_u32(w, mesh->mNumVertices);
+	mcw_u32(w, mesh->mNumFaces);
+	mcw_u32(w, mesh->mMaterialIndex);
+	mcw_u32(w, mesh->mNumBones);
+	mcw_u32(w, present);
+	for(int i=0; i<AI_MAX_NUMBER_OF_TEXTURECOORDS && i<8; i++)
+		mcw_u32(w, mesh->mNumUVComponents[i]);
+	mcw_string(w, &mesh->mName);
+
+	size_t vecLen = sizeof(struct aiVector3D)*mesh->mNumVertices;
+	mcw_array(w, mesh->mVertices, vecLen);
+	if(mesh->mNormals)    mcw_array(w, mesh->mNormals, vecLen);
+	if(mesh->mTangents)   mcw_array(w, mesh->mTangents, vecLen);
+	if(mesh->mBitangents) mcw_array(w, mesh->mBitangents, vecLen);
+	for(int i=0; i<AI_MAX_NUMBER_OF_COLOR_SETS && i<8; i++)
+		if(mesh->mColors[i])
+			mcw_array(w, mesh->mColors[i], sizeof(struct aiColor4D)*mesh->mNumVertices);
+	for(int i=0; i<AI_MAX_NUMBER_OF_TEXTURECOORDS && i<8; i++)
+		if(mesh->mTextureCoords[i])
+			mcw_array(w, mesh->mTextureCoords[i], vecLen);
+
+	/* Faces: The number of indices in each face followed by all of
+	 * the indices. */
+	mcw_align(w);
+	uint32_t totalIndices = 0;
+	for(unsigned int i=0; i<mesh->mNumFaces; i++)
+	{
+		mcw_u32(w, mesh->mFaces[i].mNumIndices);
+		totalIndices += mesh->mFaces[i].mNumIndices;
+	}
+	mcw_u32(w, totalIndices);
+	mcw_align(w);
+	for(unsigned int i=0; i<mesh->mNumFaces; i++)
+		mcw_bytes(w, mesh->mFaces[i].mIndices, sizeof(unsigned int)*mesh->mFaces[i].mNumIndices);
+
+	for(unsigned int i=0; i<mesh->mNumBones; i++)
+	{
+		const struct aiBone *bone = mesh->mBones[i];
+		mcw_string(w, &bone->mName);
+		mcw_array(w, &bone->mOffsetMatrix, sizeof(struct aiMatrix4x4));
+		mcw_u32(w, bone->mNumWeights);
+		mcw_array(w, bone->mWeights, sizeof(struct aiVertexWeight)*bone->mNumWeights);
+	}
+}
+
+static void mcw_material(model_cache_writer *w, const struct aiMaterial *mtl)
+{
+	mcw_u32(w, mtl->mNumProperties);
+	for(unsigned int i=0; i<mtl->mNumProperties; i++)
+	{
+		const struct aiMaterialProperty *p = mtl->mProperties[i];
+		mcw_string(w, &p->mKey);
+		mcw_u32(w, p->mSemantic);
+		mcw_u32(w, p->mIndex);
+		mcw_u32(w, (uint32_t) p->mType);
+		mcw_u32(w, p->mDataLength);
+		mcw_array(w, p->mData, p->mDataLength);
+	}
+}
+
+static void mcw_node(model_cache_writer *w, const struct aiNode *node)
+{
+	mcw_string(w, &node->mName);
+	mcw_array(w, &node->mTransformation, sizeof(struct aiMatrix4x4));
+	mcw_u32(w, node->mNumMeshes);
+	mcw_array(w, node->mMeshes, sizeof(unsigned int)*node->mNumMeshes);
+	mcw_u32(w, node->mNumChildren);
+	for(unsigned int i=0; i<node->mNumChildren; i++)
+		mcw_node(w, node->mChildren[i]);
+}
+
+static void mcw_animation(model_cache_writer *w, const struct aiAnimation *anim)
+{
+	mcw_string(w, &anim->mName);
+	mcw_f64(w, anim->mDuration);
+	mcw_f64(w, anim->mTicksPerSecond);
+	mcw_u32(w, anim->mNumChannels);
+	for(unsigned int i=0; i<anim->mNumChannels; i++)
+	{
+		const struct aiNodeAnim *na = anim->mChannels[i];
+		mcw_string(w, &na->mNodeName);
+		mcw_u32(w, (uint32_t) na->mPreState);
+		mcw_u32(w, (uint32_t) na->mPostState);
+		mcw_u32(w, na->mNumPositionKeys);
+		mcw_array(w, na->mPositionKeys, sizeof(struct aiVectorKey)*na->mNumPositionKeys);
+		mcw_u32(w, na->mNumRotationKeys);
+		mcw_array(w, na->mRotationKeys, sizeof(struct aiQuatKey)*na->mNumRotationKeys);
+		mcw_u32(w, na->mNumScalingKeys);
+		mcw_array(w, na->mScalingKeys, sizeof(struct aiVectorKey)*na->mNumScalingKeys);
+	}
+	mcw_u32(w, anim->mNumMeshChannels);
+	for(unsigned int i=0; i<anim->mNumMeshChannels; i++)
+	{
+		const struct aiMeshAnim *ma = anim->mMeshChannels[i];
+		mcw_string(w, &ma->mName);
+		mcw_u32(w, ma->mNumKeys);
+		mcw_array(w, ma->mKeys, sizeof(struct aiMeshKey)*ma->mNumKeys);
+	}
+}
+
+/** Writes a cache file for a scene that was imported by ASSIMP. The
+ * file is written to a temporary file and renamed so that other
+ * processes (for example, other DGR slaves loading the same model)
+ * never see a partially written cache.
+ *
+ * @param modelFilename The model file that the scene was imported from.
+ *
+ * @param aiFlags The post-processing flags that the scene was imported with.
+ *
+ * @param options The MODEL_CACHE_* flags describing how the scene was
+ * changed after it was imported.
+ *
+ * @param scene The scene to store.
+ *
+ * @param lods The simplified versions of each mesh in the scene
+ * (scene->mNumMeshes of them) or NULL. Only stored if options
+ * includes MODEL_CACHE_LOD.
+ *
+ * @return 1 if the cache file was written, 0 otherwise.
+ */
+int model_cache_save(const char *modelFilename, unsigned int aiFlags, unsigned int options,
+                     const struct aiScene *scene, const mesh_opt_lod *lods)
+{
+	if(!model_cache_enabled() || modelFilename == NULL || scene == NULL)
+		return 0;
+
+	model_cache_header header;
+	if(!model_cache_make_header(&header, modelFilename, aiFlags, options))
+		return 0;
+
+	char cacheFile[2048], tmpFile[2100];
+	model_cache_filename(cacheFile, 2048, modelFilename);
+	snprintf(tmpFile, 2100, "%s.%d.tmp", cacheFile, (int) getpid());
+
+	model_cache_writer w;
+	w.f = fopen(tmpFile, "wb");
+	w.offset = 0;
+	w.error = 0;
+	if(w.f == NULL)
+	{
+		msg(DEBUG, "Unable to write model cache file %s\n", tmpFile);
+		return 0;
+	}
+
+	mcw_bytes(&w, &header, sizeof(header));
+	mcw_u32(&w, scene->mNumMeshes);
+	mcw_u32(&w, scene->mNumMaterials);
+	mcw_u32(&w, scene->mNumAnimations);
+	for(unsigned int i=0; i<scene->mNumMeshes; i++)
+		mcw_mesh(&w, scene->mMeshes[i]);
+	for(unsigned int i=0; i<scene->mNumMaterials; i++)
+		mcw_material(&w, scene->mMaterials[i]);
+	mcw_node(&w, scene->mRootNode);
+	for(unsigned int i=0; i<scene->mNumAnimations; i++)
+		mcw_animation(&w, scene->mAnimations[i]);
+	if(options & MODEL_CACHE_LOD)
+	{
+		for(unsigned int i=0; i<scene->mNumMeshes; i++)
+		{
+			unsigned int levels = lods ? lods[i].levels : 0;
+			mcw_u32(&w, levels);
+			for(unsigned int l=0; l<levels; l++)
+			{
+				mcw_u32(&w, lods[i].indexCount[l]);
+				mcw_array(&w, lods[i].indices[l], sizeof(unsigned int)*lods[i].indexCount[l]);
+			}
+		}
+	}
+	mcw_align(&w);
+
+	if(fclose(w.f) != 0)
+		w.error = 1;
+	if(w.error || rename(tmpFile, cacheFile) != 0)
+	{
+		msg(WARNING, "Failed to write model cache file %s\n", cacheFile);
+		unlink(tmpFile);
+		return 0;
+	}
+	msg(INFO, "Wrote model cache %s (%ld bytes)\n", cacheFile, w.offset);
+	return 1;
+}
+
+
+/* ====== Reading ====== */
+
+/** Keeps track of our position in a memory-mapped cache file and of
+ * all of the structs we allocate while reading it (so that they can
+ * be freed if the file turns out to be invalid). */
+typedef struct
+{
+	const char *base; /**< Start of the mapped file */
+	size_t size; /**< Size of the mapped file */
+	size_t pos; /**< Current position in the file */
+	int error; /**< Set to 1 if the file is truncated or invalid */
+	void **allocs; /**< Everything allocated by mcr_alloc() */
+	size_t allocCount;
+	size_t allocCapacity;
+} model_cache_reader;
+
+/** Allocates zeroed memory that is owned by the scene being read. */
+static void* mcr_alloc(model_cache_reader *r, size_t size)
+{
+	void *ptr = calloc(1, size);
+	if(ptr == NULL)
+	{
+		msg(FATAL, "Failed to allocate memory while reading model cache.\n");
+		exit(EXIT_FAILURE);
+	}
+	if(r->allocCount == r->allocCapacity)
+	{
+		r->allocCapacity = r->allocCapacity == 0 ? 256 : r->allocCapacity*2;
+		r->allocs = realloc(r->allocs, sizeof(void*)*r->allocCapacity);
+		if(r->allocs == NULL)
+		{
+			msg(FATAL, "Failed to allocate memory while reading model cache.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	r->allocs[r->allocCount++] = ptr;
+	return ptr;
+}
+
+/** Returns a pointer to the next len bytes in the file, or NULL
+ * (and sets the error flag) if the file is too short. */
+static const void* mcr_bytes(model_cache_reader *r, size_t len)
+{
+	if(r->error || len > r->size - r->pos)
+	{
+		r->error = 1;
+		return NULL;
+	}
+	const void *ret = r->base + r->pos;
+	r->pos += len;
+	return ret;
+}
+
+static void mcr_align(model_cache_reader *r)
+{
+	if(r->pos % 8 != 0)
+		mcr_bytes(r, 8 - r->pos % 8);
+}
+
+static uint32_t mcr_u32(model_cache_reader *r)
+{
+	const uint32_t *val = mcr_bytes(r, sizeof(uint32_t));
+	return val ? *val : 0;
+}
+
+static double mcr_f64(model_cache_reader *r)
+{
+	mcr_align(r);
+	const double *val = mcr_bytes(r, sizeof(double));
+	return val ? *val : 0;
+}
+
+/** Returns a pointer to an array stored in the mapped file. */
+static void* mcr_array(model_cache_reader *r, size_t len)
+{
+	mcr_align(r);
+	if(len == 0)
+		return NULL;
+	/* The scene structs don't declare their arrays as const, but
+	 * nothing writes to them. The file is mapped read-only. */
+	return (void*) mcr_bytes(r, len);
+}
+
+static void mcr_string(model_cache_reader *r, struct aiString *s)
+{
+	uint32_t len = mcr_u32(r);
+	const char *data = mcr_bytes(r, len);
+	if(data == NULL || len >= MAXLEN)
+	{
+		r->error = 1;
+		len = 0;
+	}
+	if(len > 0)
+		memcpy(s->data, data, len);
+	s->data[len] = '\0';
+	s->length = len;
+}
+
+static struct aiMesh* mcr_mesh(model_cache_reader *r)
+{
+	struct aiMesh *mesh = mcr_alloc(r, sizeof(struct aiMesh));
+	mesh->mPrimitiveTypes = mcr_u32(r);
+	mesh->mNumVertices = mcr_u32(r);
+	mesh->mNumFaces = mcr_u32(r);
+	mesh->mMaterialIndex = mcr_u32(r);
+	mesh->mNumBones = mcr_u32(r);
+	uint32_t present = mcr_u32(r);
+	for(int i=0; i<AI_MAX_NUMBER_OF_TEXTURECOORDS && i<8; i++)
+		mesh->mNumUVComponents[i] = mcr_u32(r);
+	mcr_string(r, &mesh->mName);
+	if(r->error)
+		return NULL;
+
+	size_t vecLen = sizeof(struct aiVector3D)*mesh->mNumVertices;
+	mesh->mVertices = mcr_array(r, vecLen);
+	if(present & 1) mesh->mNormals    = mcr_array(r, vecLen);
+	if(present & 2) mesh->mTangents   = mcr_array(r, vecLen);
+	if(present & 4) mesh->mBitangents = mcr_array(r, vecLen);
+	for(int i=0; i<AI_MAX_NUMBER_OF_COLOR_SETS && i<8; i++)
+		if(present & (1 << (8+i)))
+			mesh->mColors[i] = mcr_array(r, sizeof(struct aiColor4D)*mesh->mNumVertices);
+	for(int i=0; i<AI_MAX_NUMBER_OF_TEXTURECOORDS && i<8; i++)
+		if(present & (1 << (16+i)))
+			mesh->mTextureCoords[i] = mcr_array(r, vecLen);
+
+	mcr_align(r);
+	const uint32_t *faceSizes = mcr_bytes(r, sizeof(uint32_t)*mesh->mNumFaces);
+	uint32_t totalIndices = mcr_u32(r);
+	mcr_align(r);
+	unsigned int *indices = (unsigned int*) mcr_bytes(r, sizeof(unsigned int)*totalIndices);
+	if(r->error)
+		return NULL;
+	mesh->mFaces = mcr_alloc(r, sizeof(struct aiFace)*(mesh->mNumFaces+1));
+	uint32_t used = 0;
+	for(unsigned int i=0; i<mesh->mNumFaces; i++)
+	{
+		if(faceSizes[i] > totalIndices - used)
+		{
+			r->error = 1;
+			return NULL;
+		}
+		mesh->mFaces[i].mNumIndices = faceSizes[i];
+		mesh->mFaces[i].mIndices = indices + used;
+		used += faceSizes[i];
+	}
+
+	if(mesh->mNumBones > 0)
+	{
+		mesh->mBones = mcr_alloc(r, sizeof(struct aiBone*)*mesh->mNumBones);
+		for(unsigned int i=0; i<mesh->mNumBones && !r->error; i++)
+		{
+			struct aiBone *bone = mcr_alloc(r, sizeof(struct aiBone));
+			mcr_string(r, &bone->mName);
+			const struct aiMatrix4x4 *offset = mcr_array(r, sizeof(struct aiMatrix4x4));
+			if(offset)
+				bone->mOffsetMatrix = *offset;
+			bone->mNumWeights = mcr_u32(r);
+			bone->mWeights = mcr_array(r, sizeof(struct aiVertexWeight)*bone->mNumWeights);
+			mesh->mBones[i] = bone;
+		}
+	}
+	return r->error ? NULL : mesh;
+}
+
+static struct aiMaterial* mcr_material(model_cache_reader *r)
+{
+	struct aiMaterial *mtl = mcr_alloc(r, sizeof(struct aiMaterial));
+	mtl->mNumProperties = mcr_u32(r);
+	mtl->mNumAllocated = mtl->mNumProperties;
+	if(r->error || mtl->mNumProperties > r->size)
+	{
+		r->error = 1;
+		return NULL;
+	}
+	mtl->mProperties = mcr_alloc(r, sizeof(struct aiMaterialProperty*)*(mtl->mNumProperties+1));
+	for(unsigned int i=0; i<mtl->mNumProperties && !r->error; i++)
+	{
+		struct aiMaterialProperty *p = mcr_alloc(r, sizeof(struct aiMaterialProperty));
+		mcr_string(r, &p->mKey);
+		p->mSemantic = mcr_u32(r);
+		p->mIndex = mcr_u32(r);
+		p->mType = (enum aiPropertyTypeInfo) mcr_u32(r);
+		p->mDataLength = mcr_u32(r);
+		p->mData = mcr_array(r, p->mDataLength);
+		mtl->mProperties[i] = p;
+	}
+	return r->error ? NULL : mtl;
+}
+
+static struct aiNode* mcr_node(model_cache_reader *r, struct aiNode *parent, unsigned int numMeshes, int depth)
+{
+	/* A corrupt file could otherwise make us recurse forever. */
+	if(depth > 10000)
+	{
+		r->error = 1;
+		return NULL;
+	}
+	struct aiNode *node = mcr_alloc(r, sizeof(struct aiNode));
+	node->mParent = parent;
+	mcr_string(r, &node->mName);
+	const struct aiMatrix4x4 *transform = mcr_array(r, sizeof(struct aiMatrix4x4));
+	if(transform)
+		node->mTransformation = *transform;
+	node->mNumMeshes = mcr_u32(r);
+	node->mMeshes = mcr_array(r, sizeof(unsigned int)*node->mNumMeshes);
+	for(unsigned int i=0; i<node->mNumMeshes && !r->error; i++)
+		if(node->mMeshes[i] >= numMeshes)
+			r->error = 1;
+	node->mNumChildren = mcr_u32(r);
+	if(r->error || node->mNumChildren > r->size)
+	{
+		r->error = 1;
+		return NULL;
+	}
+	if(node->mNumChildren > 0)
+		node->mChildren = mcr_alloc(r, sizeof(struct aiNode*)*node->mNumChildren);
+	for(unsigned int i=0; i<node->mNumChildren && !r->error; i++)
+		node->mChildren[i] = mcr_node(r, node, numMeshes, depth+1);
+	return r->error ? NULL : node;
+}
+
+static struct aiAnimation* mcr_animation(model_cache_reader *r)
+{
+	struct aiAnimation *anim = mcr_alloc(r, sizeof(struct aiAnimation));
+	mcr_string(r, &anim->mName);
+	anim->mDuration = mcr_f64(r);
+	anim->mTicksPerSecond = mcr_f64(r);
+	anim->mNumChannels = mcr_u32(r);
+	if(r->error || anim->mNumChannels > r->size)
+	{
+		r->error = 1;
+		return NULL;
+	}
+	if(anim->mNumChannels > 0)
+		anim->mChannels = mcr_alloc(r, sizeof(struct aiNodeAnim*)*anim->mNumChannels);
+	for(unsigned int i=0; i<anim->mNumChannels && !r->error; i++)
+	{
+		struct aiNodeAnim *na = mcr_alloc(r, sizeof(struct aiNodeAnim));
+		mcr_string(r, &na->mNodeName);
+		na->mPreState = mcr_u32(r);
+		na->mPostState = mcr_u32(r);
+		na->mNumPositionKeys = mcr_u32(r);
+		na->mPositionKeys = mcr_array(r, sizeof(struct aiVectorKey)*na->mNumPositionKeys);
+		na->mNumRotationKeys = mcr_u32(r);
+		na->mRotationKeys = mcr_array(r, sizeof(struct aiQuatKey)*na->mNumRotationKeys);
+		na->mNumScalingKeys = mcr_u32(r);
+		na->mScalingKeys = mcr_array(r, sizeof(struct aiVectorKey)*na->mNumScalingKeys);
+		anim->mChannels[i] = na;
+	}
+	anim->mNumMeshChannels = mcr_u32(r);
+	if(r->error || anim->mNumMeshChannels > r->size)
+	{
+		r->error = 1;
+		return NULL;
+	}
+	if(anim->mNumMeshChannels > 0)
+		anim->mMeshChannels = mcr_alloc(r, sizeof(struct aiMeshAnim*)*anim->mNumMeshChannels);
+	for(unsigned int i=0; i<anim->mNumMeshChannels && !r->error; i++)
+	{
+		struct aiMeshAnim *ma = mcr_alloc(r, sizeof(struct aiMeshAnim));
+		mcr_string(r, &ma->mName);
+		ma->mNumKeys = mcr_u32(r);
+		ma->mKeys = mcr_array(r, sizeof(struct aiMeshKey)*ma->mNumKeys);
+		anim->mMeshChannels[i] = ma;
+	}
+	return r->error ? NULL : anim;
+}
+
+/** Tries to load a scene from a cache file. The returned scene is
+ * assembled from structs that we allocate ourselves and arrays that
+ * point directly into the memory-mapped cache file. Like the scenes
+ * returned by ASSIMP in kuhl_load_model(), it is never freed.
+ *
+ * @param modelFilename The model file that the scene should be
+ * imported from.
+ *
+ * @param aiFlags The ASSIMP post-processing flags that would be
+ * used to import the model.
+ *
+ * @param options The MODEL_CACHE_* flags that the cached scene must
+ * have been saved with.
+ *
+ * @param lods If options includes MODEL_CACHE_LOD, set to an array
+ * with the simplified versions of each mesh in the scene. The index
+ * lists point into the mapped file; the caller should free the array
+ * after calling mesh_opt_lod_free() on each element. Otherwise, set
+ * to NULL. May be NULL.
+ *
+ * @return The scene or NULL if there is no valid cache file for
+ * this model and these flags.
+ */
+const struct aiScene* model_cache_load(const char *modelFilename, unsigned int aiFlags, unsigned int options,
+                                      mesh_opt_lod **lods)
+{
+	if(lods != NULL)
+		*lods = NULL;
+	if(!model_cache_enabled() || modelFilename == NULL)
+		return NULL;
+
+	model_cache_header expected;
+	if(!model_cache_make_header(&expected, modelFilename, aiFlags, options))
+		return NULL;
+
+	char cacheFile[2048];
+	model_cache_filename(cacheFile, 2048, modelFilename);
+	int fd = open(cacheFile, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(model_cache_header))
+	{
+		close(fd);
+		return NULL;
+	}
+	size_t size = (size_t) st.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // the mapping stays valid after we close the file.
+	if(map == MAP_FAILED)
+		return NULL;
+
+	/* The model file name, size, modification time, flags and struct
+	 * sizes must all match. */
+	if(memcmp(map, &expected, sizeof(model_cache_header)) != 0)
+	{
+		msg(DEBUG, "Model cache %s is out of date.\n", cacheFile);
+		munmap(map, size);
+		return NULL;
+	}
+
+	model_cache_reader r;
+	memset(&r, 0, sizeof(r));
+	r.base = map;
+	r.size = size;
+	r.pos = sizeof(model_cache_header);
+
+	struct aiScene *scene = mcr_alloc(&r, sizeof(struct aiScene));
+	scene->mNumMeshes = mcr_u32(&r);
+	scene->mNumMaterials = mcr_u32(&r);
+	scene->mNumAnimations = mcr_u32(&r);
+	if(scene->mNumMeshes > size || scene->mNumMaterials > size || scene->mNumAnimations > size)
+		r.error = 1;
+	if(!r.error)
+	{
+		scene->mMeshes = mcr_alloc(&r, sizeof(struct aiMesh*)*(scene->mNumMeshes+1));
+		scene->mMaterials = mcr_alloc(&r, sizeof(struct aiMaterial*)*(scene->mNumMaterials+1));
+		scene->mAnimations = mcr_alloc(&r, sizeof(struct aiAnimation*)*(scene->mNumAnimations+1));
+	}
+	for(unsigned int i=0; i<scene->mNumMeshes && !r.error; i++)
+		scene->mMeshes[i] = mcr_mesh(&r);
+	for(unsigned int i=0; i<scene->mNumMaterials && !r.error; i++)
+		scene->mMaterials[i] = mcr_material(&r);
+	for(unsigned int i=0; i<scene->mNumMeshes && !r.error; i++)
+		if(scene->mMeshes[i]->mMaterialIndex >= scene->mNumMaterials)
+			r.error = 1;
+	if(!r.error)
+		scene->mRootNode = mcr_node(&r, NULL, scene->mNumMeshes, 0);
+	for(unsigned int i=0; i<scene->mNumAnimations && !r.error; i++)
+		scene->mAnimations[i] = mcr_animation(&r);
+
+	mesh_opt_lod *meshLods = NULL;
+	if((options & MODEL_CACHE_LOD) && !r.error)
+	{
+		meshLods = mcr_alloc(&r, sizeof(mesh_opt_lod)*(scene->mNumMeshes+1));
+		for(unsigned int i=0; i<scene->mNumMeshes && !r.error; i++)
+		{
+			mesh_opt_lod *lod = meshLods+i;
+			lod->mapped = 1;
+			lod->levels = mcr_u32(&r);
+			if(lod->levels > MESH_OPT_MAX_LODS)
+				r.error = 1;
+			for(unsigned int l=0; l<lod->levels && !r.error; l++)
+			{
+				lod->indexCount[l] = mcr_u32(&r);
+				lod->indices[l] = mcr_array(&r, sizeof(unsigned int)*lod->indexCount[l]);
+				if(lod->indices[l] == NULL)
+					r.error = 1;
+			}
+		}
+	}
+
+	if(r.error)
+	{
+		msg(WARNING, "Model cache %s is corrupt; ignoring it.\n", cacheFile);
+		for(size_t i=0; i<r.allocCount; i++)
+			free(r.allocs[i]);
+		free(r.allocs);
+		munmap(map, size);
+		return NULL;
+	}
+
+	/* The scene owns the allocations now except for the LOD array,
+	 * which belongs to the caller. */
+	free(r.allocs);
+	if(lods != NULL)
+		*lods = meshLods;
+	msg(INFO, "Loaded model from cache %s\n", cacheFile);
+	return scene;
+}
@@ -0,0 +1,61 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    model-cache stores ASSIMP scenes in a compact binary file so that
+    later runs of a program can memory-map the scene instead of asking
+    ASSIMP to import and post-process the original model file
+    again. kuhl_load_model() uses this module automatically.
+
+    A cache file is only used if it was created from a model file
+    with the same path, size and modification time and with the same
+    ASSIMP post-processing flags and options (for example,
+    MODEL_CACHE_MESH_OPT if the meshes were reordered by mesh-opt, see
+    mesh-opt.h). Otherwise, the model is imported with ASSIMP and the
+    cache file is rewritten.
+
+    The vertex positions, normals, colors, texture coordinates, face
+    indices, bone weights, animation keys and simplified index lists
+    (levels of detail) are stored so that the arrays in the mapped
+    file can be used directly by the aiScene structs that
+    model_cache_load() creates.
+
+    The following environment variables change the behavior of the
+    cache:
+
+    KUHL_MODEL_CACHE="0" - Don't read or write cache files.<br>
+    KUHL_MODEL_CACHE_DIR="/tmp/cache" - Store cache files in this
+    directory instead of next to the model file (i.e.,
+    "model.dae.kuhlcache").
+
+    @author Scott Kuhl
+ */
+
+#ifndef __MODEL_CACHE_H__
+#define __MODEL_CACHE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef KUHL_UTIL_USE_ASSIMP
+struct aiScene;
+
+#include "mesh-opt.h"
+
+#define MODEL_CACHE_MESH_OPT 1 /**< The meshes were reordered with mesh-opt after importing */
+#define MODEL_CACHE_LOD 2 /**< Simplified versions of the meshes are stored (see mesh_opt_lod_build()) */
+
+const struct aiScene* model_cache_load(const char *modelFilename, unsigned int aiFlags, unsigned int options,
+                                      mesh_opt_lod **lods);
+int model_cache_save(const char *modelFilename, unsigned int aiFlags, unsigned int options,
+                     const struct aiScene *scene, const mesh_opt_lod *lods);
+#endif
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+#endif // __MODEL_CACHE_H__
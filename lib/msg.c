@@ -17,6 +17,24 @@
    case of significant error messages, stderr. The messages printed to
    the console are also highlighted to attract attention to the most
    significant messages.
+
+   By default, messages are written by the thread that calls msg().
+   If the environment variable MSG_ASYNC is set to "1", msg() only
+   formats the user's message and places it into a lock-free ring
+   buffer; a background thread adds the timestamp and colors and
+   writes it to the console and log file. Messages are written in the
+   order that they were queued. Remaining messages are written when
+   the program exits and before any FATAL message. If the ring is
+   full, DEBUG messages are dropped (and counted) while other messages
+   wait for space.
+
+   To keep a message that is printed every frame from slowing the
+   program down, the environment variable MSG_RATE_LIMIT can limit
+   each call site (file and line) to that many messages per second
+   (e.g., 20). By default, there is no limit. The number of suppressed
+   messages is appended to the next message from that call site that
+   is printed; counts that are still pending when the program exits
+   are written then. FATAL messages are never suppressed.
    
     @author Scott Kuhl
  */
@@ -30,34 +48,76 @@
 #include <string.h>
 #include <unistd.h> // isatty()
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h> // sched_yield()
 
 #include "msg.h"
 
+#define MSG_TEXT_LENGTH 1024 /*< Longest message (including the terminator) */
+#define MSG_RING_SIZE 1024 /*< Number of messages the ring can hold in asynchronous mode (power of 2) */
+#define MSG_RATE_SITES 512 /*< Number of call sites that the rate limiter keeps track of (power of 2) */
+
 static FILE *f = NULL;  /*< The file stream for our log file */
 static char *logfile = NULL;
+static double msg_first_time = 0; /*< Time that the first message was printed */
 
-static void msg_timestamp(char *buf, int len)
+/** A message that has been formatted by the caller but not yet
+ * written. */
+typedef struct
+{
+	uint64_t sequence; /*< Position in the ring that the slot is ready for (asynchronous mode only) */
+	msg_type type;
+	const char *fileName; /*< Must be a string literal (i.e., __FILE__) */
+	int lineNum;
+	const char *funcName; /*< Must be a string literal (i.e., __func__) */
+	struct timeval time;
+	char text[MSG_TEXT_LENGTH];
+} msg_record;
+
+/* Bounded multiple-producer queue (see Dmitry Vyukov's bounded MPMC
+ * queue). A producer claims a slot by advancing msg_enqueue_pos with
+ * compare-and-swap, fills it in and then publishes it by setting the
+ * slot's sequence number. */
+static int msg_async = 0; /*< Are messages written by msg_thread? */
+static msg_record *msg_ring = NULL;
+static uint64_t msg_enqueue_pos = 0;
+static uint64_t msg_dequeue_pos = 0; /*< Only modified by msg_thread */
+static unsigned long msg_dropped = 0; /*< DEBUG messages dropped because the ring was full */
+static int msg_sleeping = 0; /*< Set while msg_thread is waiting for messages */
+static pthread_mutex_t msg_wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t msg_wake = PTHREAD_COND_INITIALIZER;
+static pthread_once_t msg_once = PTHREAD_ONCE_INIT;
+static int msg_announce = 0; /*< Print the location of the log file with the next message? */
+
+/** Information about the messages recently printed by a call site. */
+typedef struct
+{
+	uintptr_t key; /*< Identifies the call site (0 for unused entries) */
+	msg_type type; /*< Type of the most recent message from the call site */
+	const char *fileName;
+	int lineNum;
+	const char *funcName;
+	long second; /*< Second that count is for */
+	int count; /*< Messages printed during the second */
+	int suppressed; /*< Messages suppressed since the last one that was printed */
+} msg_rate_site;
+
+static int msg_rate_limit = 0; /*< Messages per second per call site, 0 for no limit */
+static msg_rate_site msg_rate_sites[MSG_RATE_SITES];
+
+static void msg_timestamp(const struct timeval *tv, char *buf, int len)
 {
-	struct timeval tv;
-	if(gettimeofday(&tv, NULL) < 0)
-	{
-		msg(FATAL, "gettimeofday: %s", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
-
 #if 0
 	// Absolute time
-	struct tm *now = localtime(&(tv.tv_sec));
+	struct tm *now = localtime(&(tv->tv_sec));
 	char buf1[1024];
 	strftime(buf1, 1024, "%H%M%S", now);
-	snprintf(buf, len, "%s.%06ld", buf1, tv.tv_usec);
+	snprintf(buf, len, "%s.%06ld", buf1, tv->tv_usec);
 #else
 	// Relative to start time.
-	double time = tv.tv_sec + tv.tv_usec / 1000000.0;
-	static double firstTime = -1;
-	if(firstTime < 0)
-		firstTime = time;
-	snprintf(buf, len, "%11.6f", time-firstTime);
+	double time = tv->tv_sec + tv->tv_usec / 1000000.0;
+	snprintf(buf, len, "%11.6f", time-msg_first_time);
 #endif
 }
 
@@ -168,38 +228,337 @@ static void msg_end_color(msg_type type, FILE *stream)
 
 
 
+/** Writes a message to the console and the log file. */
+static void msg_write(const msg_record *r)
+{
+	/* info to prepend to message printed to console */
+	char typestr[1024];
+	msg_type_string(r->type, typestr, 1024);
+
+	/* Determine the stream that we are going to print out to: stdout,
+	 * stderr, or don't print to console */
+	FILE *stream = stdout;
+	if(r->type == ERROR || r->type == FATAL)
+		stream = stderr;
+	if(msg_show_type(r->type) == 0)
+		stream = NULL;
+
+	char timestamp[1024];
+	msg_timestamp(&(r->time), timestamp, 1024);
+	char *fileNameCopy = strdup(r->fileName);
+	char *shortFileName = basename(fileNameCopy);
+	
+	/* Print the message to stderr or stdout */
+	if(stream)
+	{
+		// If using a non-standard logfile name, prepend the name to
+		// the message. This makes it easier to distinguish between
+		// which process is creating which message if there are
+		// multiple programs running at once.
+		char prepend[1024];
+		if(strcmp(logfile, "log.txt") == 0)
+			prepend[0] = '\0';
+		else
+			snprintf(prepend, 1024, "(%s) ", logfile);
+		
+		msg_start_color(r->type, stream);
+		/* Print additional details to console for fatal errors */
+		if(r->type == FATAL)
+		{
+			fprintf(stream, "%s %s%s\n", typestr, prepend, r->text);
+			fprintf(stream, "%s %sOccurred at %s:%d in the function %s()\n",
+			        typestr, prepend, shortFileName, r->lineNum, r->funcName);
+		}
+		else
+			fprintf(stream, "%s %s%s\n", typestr, prepend, r->text);
+		msg_end_color(r->type, stream);
+	}
+
+	// Not using funcName to try to keep log shorter.
+	if(f)
+		fprintf(f, "%s%s %12s:%-4d %s\n", typestr, timestamp, shortFileName, r->lineNum, r->text);
+	free(fileNameCopy);
+}
+
+/** Writes the messages in the ring until it is empty.
+ *
+ * @return The number of messages written. */
+static int msg_drain(void)
+{
+	int count = 0;
+	for(;;)
+	{
+		msg_record *r = &msg_ring[msg_dequeue_pos & (MSG_RING_SIZE-1)];
+		uint64_t sequence = __atomic_load_n(&(r->sequence), __ATOMIC_ACQUIRE);
+		if(sequence != msg_dequeue_pos+1)
+			break;
+		msg_write(r);
+		/* Let producers reuse the slot the next time around the ring. */
+		__atomic_store_n(&(r->sequence), msg_dequeue_pos+MSG_RING_SIZE, __ATOMIC_RELEASE);
+		__atomic_store_n(&msg_dequeue_pos, msg_dequeue_pos+1, __ATOMIC_RELEASE);
+		count++;
+	}
+
+	unsigned long dropped = __atomic_exchange_n(&msg_dropped, 0, __ATOMIC_RELAXED);
+	if(dropped > 0)
+	{
+		msg_record r;
+		r.type = WARNING;
+		r.fileName = __FILE__;
+		r.lineNum = __LINE__;
+		r.funcName = __func__;
+		gettimeofday(&(r.time), NULL);
+		snprintf(r.text, MSG_TEXT_LENGTH, "%lu debug messages were dropped because messages were printed faster than they could be written.", dropped);
+		msg_write(&r);
+	}
+	return count;
+}
+
+/** Writes queued messages in asynchronous mode. */
+static void* msg_thread(void *arg)
+{
+	for(;;)
+	{
+		if(msg_drain() > 0)
+		{
+			if(f)
+				fflush(f);
+			fflush(stdout);
+			fflush(stderr);
+			continue;
+		}
+
+		/* Wait for a producer to wake us up. The timeout handles the
+		 * case where a message is queued just before we set
+		 * msg_sleeping. */
+		pthread_mutex_lock(&msg_wake_mutex);
+		__atomic_store_n(&msg_sleeping, 1, __ATOMIC_SEQ_CST);
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 5*1000*1000;
+		if(ts.tv_nsec >= 1000000000)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&msg_wake, &msg_wake_mutex, &ts);
+		__atomic_store_n(&msg_sleeping, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&msg_wake_mutex);
+	}
+	return NULL;
+}
+
+/** Waits until every message that has been queued is written. Does
+ * nothing if messages aren't written asynchronously. */
+void msg_flush(void)
+{
+	if(!msg_async)
+		return;
+	uint64_t end = __atomic_load_n(&msg_enqueue_pos, __ATOMIC_ACQUIRE);
+	while(__atomic_load_n(&msg_dequeue_pos, __ATOMIC_ACQUIRE) < end)
+	{
+		pthread_cond_signal(&msg_wake);
+		sched_yield();
+	}
+}
+
+/** Writes the number of messages that were suppressed since the last
+ * message that each call site printed. Called when the program
+ * exits. */
+static void msg_rate_report(void)
+{
+	msg_flush();
+	for(int i=0; i<MSG_RATE_SITES; i++)
+	{
+		msg_rate_site *site = &msg_rate_sites[i];
+		if(__atomic_load_n(&(site->key), __ATOMIC_ACQUIRE) == 0)
+			continue;
+		int suppressed = __atomic_exchange_n(&(site->suppressed), 0, __ATOMIC_RELAXED);
+		if(suppressed == 0)
+			continue;
+		msg_record record;
+		record.type = site->type;
+		record.fileName = site->fileName;
+		record.lineNum = site->lineNum;
+		record.funcName = site->funcName;
+		if(gettimeofday(&(record.time), NULL) < 0)
+			memset(&(record.time), 0, sizeof(record.time));
+		snprintf(record.text, MSG_TEXT_LENGTH, "(%d similar messages suppressed)", suppressed);
+		msg_write(&record);
+	}
+	fflush(stdout);
+	fflush(stderr);
+	if(f)
+		fflush(f);
+}
+
 /** Initializes the logging system, creates the log file if
- * needed. Also, writes a message informing the user about the
- * location of the log file. The time printed in the log file will be
- * relative to the time that this first message was printed.
+ * needed. The time printed in the log file will be relative to the
+ * time that this function is called. The location of the log file is
+ * printed with the first message.
  */
 static void msg_init(void)
 {
 	// Set to 1 to overwrite existing log file, 0 to append.
 	const int append = 0;
+
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	msg_first_time = tv.tv_sec + tv.tv_usec / 1000000.0;
 	
-	logfile = strdup("log.txt");
 	const char* envvar_logfile = getenv("MSG_LOGFILE");
 	if(envvar_logfile != NULL && strlen(envvar_logfile) > 0)
 		logfile = strdup(envvar_logfile);
-	
-	if(f != NULL)
-		return;
+	else
+		logfile = strdup("log.txt");
 
+	const char *envvar_rate = getenv("MSG_RATE_LIMIT");
+	if(envvar_rate != NULL && strlen(envvar_rate) > 0)
+		msg_rate_limit = atoi(envvar_rate);
+	if(msg_rate_limit > 0)
+		atexit(msg_rate_report);
+	
 	if(append)
 	{
 		f = fopen(logfile, "a");
-		fprintf(f, "============================================================\n");
-		fprintf(f, "=== Program started ========================================\n");
-		fprintf(f, "============================================================\n");
-		msg(INFO, "Messages are being appended to '%s'\n", logfile);
+		if(f)
+		{
+			fprintf(f, "============================================================\n");
+			fprintf(f, "=== Program started ========================================\n");
+			fprintf(f, "============================================================\n");
+		}
 	}
 	else
 		f = fopen(logfile, "w"); // overwrite
 
-	fprintf(f, "[TYPE ]    seconds     filename:line message\n");
-	fprintf(f, "------------------------------------------\n");
-	msg(INFO, "Messages are being written to '%s'\n", logfile);
+	if(f)
+	{
+		fprintf(f, "[TYPE ]    seconds     filename:line message\n");
+		fprintf(f, "------------------------------------------\n");
+	}
+	msg_announce = 1;
+
+	const char *envvar_async = getenv("MSG_ASYNC");
+	if(envvar_async != NULL && strcmp(envvar_async, "1") == 0)
+	{
+		msg_ring = malloc(sizeof(msg_record)*MSG_RING_SIZE);
+		pthread_t thread;
+		if(msg_ring != NULL)
+		{
+			for(uint64_t i=0; i<MSG_RING_SIZE; i++)
+				msg_ring[i].sequence = i;
+			if(pthread_create(&thread, NULL, msg_thread, NULL) == 0)
+			{
+				pthread_detach(thread);
+				msg_async = 1;
+				atexit(msg_flush);
+			}
+		}
+	}
+}
+
+/** Checks if a call site has printed too many messages recently.
+ *
+ * @param suppressed Set to the number of messages from this call
+ * site that were suppressed since the last one that was printed.
+ *
+ * @return 1 if the message should be printed, 0 if it should be
+ * suppressed.
+ */
+static int msg_rate_check(msg_type type, const char *fileName, int lineNum, const char *funcName,
+                          const struct timeval *now, int *suppressed)
+{
+	*suppressed = 0;
+	if(msg_rate_limit <= 0)
+		return 1;
+
+	/* Find (or claim) the entry for this call site. */
+	uintptr_t key = ((uintptr_t) fileName * 31 + (uintptr_t) lineNum) | 1;
+	msg_rate_site *site = NULL;
+	for(int i=0; i<MSG_RATE_SITES && site == NULL; i++)
+	{
+		msg_rate_site *s = &msg_rate_sites[(key + i) & (MSG_RATE_SITES-1)];
+		uintptr_t existing = __atomic_load_n(&(s->key), __ATOMIC_ACQUIRE);
+		if(existing == 0)
+		{
+			uintptr_t expected = 0;
+			if(__atomic_compare_exchange_n(&(s->key), &expected, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				site = s;
+			else if(expected == key)
+				site = s;
+		}
+		else if(existing == key)
+			site = s;
+	}
+	if(site == NULL) // table is full
+		return 1;
+
+	/* Start counting again every second. */
+	long second = __atomic_load_n(&(site->second), __ATOMIC_RELAXED);
+	if(second != now->tv_sec &&
+	   __atomic_compare_exchange_n(&(site->second), &second, (long) now->tv_sec, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_store_n(&(site->count), 0, __ATOMIC_RELAXED);
+
+	if(__atomic_fetch_add(&(site->count), 1, __ATOMIC_RELAXED) >= msg_rate_limit)
+	{
+		/* Remembered so that msg_rate_report() can describe the
+		 * call site. */
+		site->type = type;
+		site->fileName = fileName;
+		site->lineNum = lineNum;
+		site->funcName = funcName;
+		__atomic_fetch_add(&(site->suppressed), 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	*suppressed = __atomic_exchange_n(&(site->suppressed), 0, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/** Places a message into the ring for msg_thread to write.
+ *
+ * @return 1 if the message was queued, 0 if it was a DEBUG message
+ * and the ring was full. */
+static int msg_enqueue(const msg_record *record)
+{
+	uint64_t pos = __atomic_load_n(&msg_enqueue_pos, __ATOMIC_RELAXED);
+	msg_record *r;
+	for(;;)
+	{
+		r = &msg_ring[pos & (MSG_RING_SIZE-1)];
+		uint64_t sequence = __atomic_load_n(&(r->sequence), __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t) sequence - (int64_t) pos;
+		if(diff == 0)
+		{
+			if(__atomic_compare_exchange_n(&msg_enqueue_pos, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(diff < 0)
+		{
+			/* The ring is full. */
+			if(record->type == DEBUG)
+			{
+				__atomic_fetch_add(&msg_dropped, 1, __ATOMIC_RELAXED);
+				return 0;
+			}
+			pthread_cond_signal(&msg_wake);
+			sched_yield();
+			pos = __atomic_load_n(&msg_enqueue_pos, __ATOMIC_RELAXED);
+		}
+		else
+			pos = __atomic_load_n(&msg_enqueue_pos, __ATOMIC_RELAXED);
+	}
+
+	r->type = record->type;
+	r->fileName = record->fileName;
+	r->lineNum = record->lineNum;
+	r->funcName = record->funcName;
+	r->time = record->time;
+	memcpy(r->text, record->text, strlen(record->text)+1);
+	__atomic_store_n(&(r->sequence), pos+1, __ATOMIC_RELEASE);
+
+	if(__atomic_load_n(&msg_sleeping, __ATOMIC_SEQ_CST))
+		pthread_cond_signal(&msg_wake);
+	return 1;
 }
 
 /** Writes a message to the log file.
@@ -211,73 +570,60 @@ static void msg_init(void)
 */
 void msg_details(msg_type type, const char *fileName, int lineNum, const char *funcName, const char *msg, ...)
 {
-	msg_init();
+	pthread_once(&msg_once, msg_init);
+	if(__atomic_exchange_n(&msg_announce, 0, __ATOMIC_ACQ_REL))
+	{
+		msg(INFO, "Messages are being written to '%s'%s\n", logfile,
+		    msg_async ? " (asynchronously)" : "");
+	}
+
+	msg_record record;
+	record.type = type;
+	record.fileName = fileName;
+	record.lineNum = lineNum;
+	record.funcName = funcName;
+	if(gettimeofday(&(record.time), NULL) < 0)
+		memset(&(record.time), 0, sizeof(record.time));
+
+	int suppressed = 0;
+	if(type != FATAL && !msg_rate_check(type, fileName, lineNum, funcName, &(record.time), &suppressed))
+		return;
 	
 	/* Construct a string for the user's message */
-	char msgbuf[1024];
 	va_list args;
 	va_start(args, msg);
-	vsnprintf(msgbuf, 1024, msg, args);
+	vsnprintf(record.text, MSG_TEXT_LENGTH, msg, args);
 	va_end(args);
 
 	/* Remove any newlines at the end of the message. */
-	int msgbufidx = strlen(msgbuf)-1;
-	while(msgbuf[msgbufidx] == '\n')
+	int msgbufidx = strlen(record.text)-1;
+	while(msgbufidx >= 0 && record.text[msgbufidx] == '\n')
 	{
-		msgbuf[msgbufidx] = '\0';
+		record.text[msgbufidx] = '\0';
 		msgbufidx--;
 	}
-	
-	/* info to prepend to message printed to console */
-	char typestr[1024];
-	msg_type_string(type, typestr, 1024);
-
-	/* Determine the stream that we are going to print out to: stdout,
-	 * stderr, or don't print to console */
-	FILE *stream = stdout;
-	if(type == ERROR || type == FATAL)
-		stream = stderr;
-	if(msg_show_type(type) == 0)
-		stream = NULL;
+	if(suppressed > 0)
+	{
+		size_t len = strlen(record.text);
+		snprintf(record.text+len, MSG_TEXT_LENGTH-len, " (%d similar messages suppressed)", suppressed);
+	}
 
-	char timestamp[1024];
-	msg_timestamp(timestamp, 1024);
-	char *fileNameCopy = strdup(fileName);
-	char *shortFileName = basename(fileNameCopy);
-	
-	/* Print the message to stderr or stdout */
-	if(stream)
+	if(msg_async && type != FATAL)
 	{
-		// If using a non-standard logfile name, prepend the name to
-		// the message. This makes it easier to distinguish between
-		// which process is creating which message if there are
-		// multiple programs running at once.
-		char prepend[1024];
-		if(strcmp(logfile, "log.txt") == 0)
-			prepend[0] = '\0';
-		else
-			snprintf(prepend, 1024, "(%s) ", logfile);
-		
-		msg_start_color(type, stream);
-		/* Print additional details to console for fatal errors */
-		if(type == FATAL)
-		{
-			fprintf(stream, "%s %s%s\n", typestr, prepend, msgbuf);
-			fprintf(stream, "%s %sOccurred at %s:%d in the function %s()\n",
-			        typestr, prepend, shortFileName, lineNum, funcName);
-		}
-		else
-			fprintf(stream, "%s %s%s\n", typestr, prepend, msgbuf);
-		msg_end_color(type, stream);
+		msg_enqueue(&record);
+		return;
 	}
 
-	// Not using funcName to try to keep log shorter.
-	fprintf(f, "%s%s %12s:%-4d %s\n", typestr, timestamp, shortFileName, lineNum, msgbuf);
-	free(fileNameCopy);
+	/* Fatal messages are written immediately (after any queued
+	 * messages) since the program is probably about to exit. */
+	msg_flush();
+	msg_write(&record);
 
 	/* Ensure messages are written to the file or console. */
-	fflush(stream);
-	fflush(f);
+	if(msg_show_type(type))
+		fflush(type == ERROR || type == FATAL ? stderr : stdout);
+	if(f)
+		fflush(f);
 }
 
 /** ASSIMP can be configured to call a callback function every time it
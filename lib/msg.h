@@ -28,10 +28,13 @@ typedef enum {
 
 void msg_details(msg_type type, const char *fileName, int lineNum, const char *funcName, const char *msg, ...);
 void msg_assimp_callback(const char* msg, char *usr);
+void msg_flush(void);
 
 /** Prints the message and saves information to a logfile. C99
  * requires that __VA_ARGS__ corresponds to at least one parameter
- * (not zero parameters). */
+ * (not zero parameters). The file and function names must be string
+ * literals since they may be used after msg_details() returns when
+ * MSG_ASYNC is set. */
 #define msg(TYPE, ...) msg_details(TYPE, __FILE__, __LINE__, __func__, __VA_ARGS__)
 
 
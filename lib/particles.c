@@ -0,0 +1,311 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ *
+ * Moves particles on the GPU with transform feedback. See particles.h
+ * for details.
+ *
+ * Each geometry has two buffers of particles. Every pass reads one
+ * of them (along with the geometry's original positions and normals)
+ * with the program in particles.vert and writes the result into the
+ * other one while rasterization is disabled. Afterwards, the
+ * geometry's in_Position attribute is pointed at the buffer that was
+ * just written.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <GL/glew.h>
+
+#include "particles.h"
+#include "kuhl-util.h"
+#include "msg.h"
+#include "trace.h"
+
+/** Attribute locations used by the update program. */
+enum
+{
+	PARTICLES_POSITION = 0,
+	PARTICLES_VELOCITY = 1,
+	PARTICLES_REST = 2,
+	PARTICLES_NORMAL = 3
+};
+
+/** Passes that the update program can perform (the "mode" uniform) */
+enum
+{
+	PARTICLES_MODE_RESET = 0,
+	PARTICLES_MODE_EXPLODE = 1,
+	PARTICLES_MODE_MOVE = 2
+};
+
+/** Bytes used by each particle in a state buffer (position and velocity). */
+#define PARTICLES_STRIDE (6*sizeof(GLfloat))
+
+/** The program that updates the particles. It is shared by all
+ * particle systems and created the first time it is needed. */
+static GLuint particles_program = 0;
+
+/** Creates the program in particles.vert which writes out_Position
+ * and out_Velocity with transform feedback.
+ *
+ * @return The program or 0 if it couldn't be linked.
+ */
+static GLuint particles_create_program(void)
+{
+	if(particles_program != 0)
+		return particles_program;
+
+	GLuint program = glCreateProgram();
+	GLuint shader = kuhl_create_shader("particles.vert", GL_VERTEX_SHADER);
+	glAttachShader(program, shader);
+	glBindAttribLocation(program, PARTICLES_POSITION, "in_Position");
+	glBindAttribLocation(program, PARTICLES_VELOCITY, "in_Velocity");
+	glBindAttribLocation(program, PARTICLES_REST, "in_RestPosition");
+	glBindAttribLocation(program, PARTICLES_NORMAL, "in_Normal");
+	const char *varyings[] = { "out_Position", "out_Velocity" };
+	glTransformFeedbackVaryings(program, 2, varyings, GL_INTERLEAVED_ATTRIBS);
+	glLinkProgram(program);
+	kuhl_errorcheck();
+
+	GLint linked = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if(linked == GL_FALSE)
+	{
+		kuhl_print_program_log(program);
+		msg(ERROR, "Failed to link the particle update program.\n");
+		kuhl_delete_program(program);
+		return 0;
+	}
+	kuhl_uniform_cache_invalidate(program);
+	particles_program = program;
+	return program;
+}
+
+/** Points a vertex attribute location at a kuhl_attrib in the
+ * currently bound vertex array object. */
+static void particles_attrib_pointer(GLuint location, const kuhl_attrib *attrib)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+	glVertexAttribPointer(location, attrib->components, GL_FLOAT, GL_FALSE,
+	                      attrib->stride, (const void*) attrib->offset);
+	glEnableVertexAttribArray(location);
+}
+
+/** Creates the state buffers and the vertex array objects for one
+ * geometry. */
+static void particles_mesh_init(particle_mesh *mesh, kuhl_geometry *geom, int attrib)
+{
+	mesh->geom = geom;
+	mesh->attrib = attrib;
+	mesh->rest = geom->attribs[attrib];
+	mesh->current = 1;
+
+	/* kuhl_geometry_draw() would unmap the buffer later, but we read
+	 * it with OpenGL before then. */
+	if(mesh->rest.mapped)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, mesh->rest.bufferobject);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		geom->attribs[attrib].mapped = 0;
+		mesh->rest.mapped = 0;
+	}
+
+	int normal = kuhl_geometry_attrib_index(geom, "in_Normal");
+
+	glGenBuffers(2, mesh->state);
+	glGenVertexArrays(2, mesh->vao);
+	for(int i=0; i<2; i++)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, mesh->state[i]);
+		glBufferData(GL_ARRAY_BUFFER, PARTICLES_STRIDE*geom->vertex_count, NULL, GL_DYNAMIC_COPY);
+
+		glBindVertexArray(mesh->vao[i]);
+		glVertexAttribPointer(PARTICLES_POSITION, 3, GL_FLOAT, GL_FALSE, PARTICLES_STRIDE, (const void*) 0);
+		glEnableVertexAttribArray(PARTICLES_POSITION);
+		glVertexAttribPointer(PARTICLES_VELOCITY, 3, GL_FLOAT, GL_FALSE, PARTICLES_STRIDE, (const void*) (3*sizeof(GLfloat)));
+		glEnableVertexAttribArray(PARTICLES_VELOCITY);
+		particles_attrib_pointer(PARTICLES_REST, &(mesh->rest));
+		/* Without normals, particles_explode() only moves the
+		 * particles up and in random directions. */
+		if(normal >= 0)
+			particles_attrib_pointer(PARTICLES_NORMAL, &(geom->attribs[normal]));
+	}
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_errorcheck();
+}
+
+/** Runs one pass of the update program over every particle.
+ *
+ * @param ps The particle system.
+ * @param mode One of the PARTICLES_MODE_* values.
+ * @param explode Speed along the normal, speed up and amount of randomness (only used by PARTICLES_MODE_EXPLODE).
+ */
+static void particles_run(particle_system *ps, int mode, const float explode[3])
+{
+	if(ps->count == 0)
+		return;
+	TRACE_SCOPE("particles_run");
+
+	GLint previousProgram = 0, previousVAO = 0;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &previousProgram);
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVAO);
+
+	glUseProgram(particles_program);
+	glUniform1i(kuhl_get_uniform("mode"), mode);
+	glUniform1f(kuhl_get_uniform("timestep"), ps->timestep);
+	glUniform3fv(kuhl_get_uniform("accel"), 1, ps->accel);
+	glUniform1f(kuhl_get_uniform("bounce"), ps->bounce);
+	if(mode == PARTICLES_MODE_EXPLODE)
+	{
+		glUniform3fv(kuhl_get_uniform("explode"), 1, explode);
+		glUniform1ui(kuhl_get_uniform("seed"), (GLuint) (drand48()*4294967295.0));
+	}
+	glVertexAttrib3f(PARTICLES_NORMAL, 0, 0, 0);
+
+	glEnable(GL_RASTERIZER_DISCARD);
+	for(unsigned int i=0; i<ps->count; i++)
+	{
+		particle_mesh *mesh = &(ps->meshes[i]);
+		int next = 1 - mesh->current;
+		glBindVertexArray(mesh->vao[mesh->current]);
+		glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, mesh->state[next]);
+		glBeginTransformFeedback(GL_POINTS);
+		glDrawArrays(GL_POINTS, 0, mesh->geom->vertex_count);
+		glEndTransformFeedback();
+		mesh->current = next;
+
+		/* Draw the geometry at the new particle positions. */
+		kuhl_attrib *attrib = &(mesh->geom->attribs[mesh->attrib]);
+		attrib->bufferobject = mesh->state[next];
+		attrib->components = 3;
+		attrib->stride = PARTICLES_STRIDE;
+		attrib->offset = 0;
+		GLint loc = kuhl_get_attribute(mesh->geom->program, attrib->name);
+		if(loc >= 0)
+		{
+			glBindVertexArray(mesh->geom->vao);
+			particles_attrib_pointer(loc, attrib);
+		}
+	}
+	glDisable(GL_RASTERIZER_DISCARD);
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glBindVertexArray(previousVAO);
+	glUseProgram(previousProgram);
+	kuhl_errorcheck();
+}
+
+/** Creates a particle for every vertex in a list of kuhl_geometry
+ * objects. The particles start at the vertex positions and don't
+ * move until particles_explode() is called.
+ *
+ * @param ps The particle system to initialize.
+ *
+ * @param geom The first geometry in the list. Geometry without an
+ * in_Position attribute is skipped.
+ *
+ * @return 1 on success, 0 if transform feedback isn't supported or
+ * the geometry was moved into a shared buffer with kuhl_geometry_pool().
+ */
+int particles_init(particle_system *ps, kuhl_geometry *geom)
+{
+	memset(ps, 0, sizeof(particle_system));
+	ps->accel[1] = -1;
+	ps->timestep = .1f;
+	ps->bounce = .4f;
+
+	if(!GLEW_VERSION_3_0)
+	{
+		msg(ERROR, "Particles require OpenGL 3.0 (for transform feedback).\n");
+		return 0;
+	}
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+	{
+		if(g->pool != NULL)
+		{
+			msg(WARNING, "Particles can't be created from geometry that was moved into a shared buffer with kuhl_geometry_pool().\n");
+			return 0;
+		}
+	}
+	if(particles_create_program() == 0)
+		return 0;
+
+	ps->meshes = kuhl_malloc(sizeof(particle_mesh)*kuhl_geometry_count(geom));
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+	{
+		int attrib = kuhl_geometry_attrib_index(g, "in_Position");
+		if(attrib < 0 || g->vertex_count == 0 || g->attribs[attrib].components < 3)
+			continue;
+		particles_mesh_init(&(ps->meshes[ps->count]), g, attrib);
+		ps->count++;
+	}
+	particles_run(ps, PARTICLES_MODE_RESET, NULL);
+	return 1;
+}
+
+/** Gives every particle a new velocity and starts moving the
+ * particles.
+ *
+ * @param ps The particle system.
+ * @param speed Speed of the particles in the direction of the vertex normal.
+ * @param up Speed added in the +Y direction.
+ * @param randomness Each component of the velocity is changed by a random amount between -randomness/2 and randomness/2.
+ */
+void particles_explode(particle_system *ps, float speed, float up, float randomness)
+{
+	float explode[3] = { speed, up, randomness };
+	particles_run(ps, PARTICLES_MODE_EXPLODE, explode);
+	ps->moving = 1;
+}
+
+/** Moves the particles forward by one timestep (ps->timestep). Does
+ * nothing until particles_explode() has been called. */
+void particles_update(particle_system *ps)
+{
+	if(ps->moving)
+		particles_run(ps, PARTICLES_MODE_MOVE, NULL);
+}
+
+/** Moves the particles back to the original vertex positions and
+ * stops them. */
+void particles_reset(particle_system *ps)
+{
+	particles_run(ps, PARTICLES_MODE_RESET, NULL);
+	ps->moving = 0;
+}
+
+/** Deletes the particles and gives each geometry back its original
+ * in_Position attribute. Must be called before the geometry is
+ * deleted. */
+void particles_free(particle_system *ps)
+{
+	for(unsigned int i=0; i<ps->count; i++)
+	{
+		particle_mesh *mesh = &(ps->meshes[i]);
+		kuhl_attrib *attrib = &(mesh->geom->attribs[mesh->attrib]);
+		*attrib = mesh->rest;
+		GLint loc = kuhl_get_attribute(mesh->geom->program, attrib->name);
+		if(loc >= 0)
+		{
+			glBindVertexArray(mesh->geom->vao);
+			particles_attrib_pointer(loc, attrib);
+		}
+		glDeleteVertexArrays(2, mesh->vao);
+		glDeleteBuffers(2, mesh->state);
+	}
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	free(ps->meshes);
+	memset(ps, 0, sizeof(particle_system));
+	kuhl_errorcheck();
+}
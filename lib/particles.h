@@ -0,0 +1,85 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    particles turns every vertex of a kuhl_geometry list into a
+    particle that is moved by gravity and bounces off of the XZ
+    plane. The position and velocity of each particle are kept in
+    OpenGL buffers and are updated with transform feedback (OpenGL
+    3.0), so the CPU never reads or writes the vertices after
+    particles_init() returns. For example:
+
+    <pre>
+    particle_system ps;
+    particles_init(&ps, modelgeom);
+    particles_explode(&ps, 10, .5, 1);
+    ...
+    // every frame:
+    particles_update(&ps);
+    kuhl_geometry_draw(modelgeom);
+    ...
+    particles_free(&ps);
+    kuhl_geometry_delete(modelgeom);
+    </pre>
+
+    particles_init() replaces the "in_Position" attribute of each
+    geometry with a buffer holding the particles, so the geometry is
+    drawn with its own program, textures and other attributes at the
+    particle positions. Like the rest of libkuhl, gravity is applied
+    in object coordinates. The update is performed by the vertex
+    program in "particles.vert", which must be in a directory that
+    kuhl_find_file() searches.
+
+    Geometry that was moved into a shared buffer with
+    kuhl_geometry_pool() can't be used because the particles can't
+    replace only part of the shared buffer.
+
+    @author Scott Kuhl
+ */
+
+#ifndef __PARTICLES_H__
+#define __PARTICLES_H__
+
+#include "kuhl-util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** The particles for one kuhl_geometry. */
+typedef struct
+{
+	kuhl_geometry *geom; /**< The geometry that is drawn at the particle positions */
+	int attrib; /**< Index of the geometry's in_Position attribute */
+	kuhl_attrib rest; /**< The geometry's original in_Position attribute */
+	GLuint state[2]; /**< Interleaved position and velocity (6 floats per particle) */
+	GLuint vao[2]; /**< Reads state[i] and the geometry's rest position and normal */
+	int current; /**< Index of the state buffer that holds the latest particles */
+} particle_mesh;
+
+/** A set of particles created from a kuhl_geometry list. The fields
+ * up to meshes may be changed at any time. */
+typedef struct
+{
+	float accel[3]; /**< Acceleration (default is 0,-1,0) */
+	float timestep; /**< Time that passes in each particles_update() (default is .1) */
+	float bounce; /**< Fraction of the velocity that is kept when bouncing off of the XZ plane, 0 to let particles fall through it (default is .4) */
+
+	particle_mesh *meshes; /**< One entry for each geometry */
+	unsigned int count; /**< Number of meshes */
+	int moving; /**< Set by particles_explode(), cleared by particles_reset() */
+} particle_system;
+
+int particles_init(particle_system *ps, kuhl_geometry *geom);
+void particles_explode(particle_system *ps, float speed, float up, float randomness);
+void particles_update(particle_system *ps);
+void particles_reset(particle_system *ps);
+void particles_free(particle_system *ps);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+#endif // __PARTICLES_H__
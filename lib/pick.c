@@ -0,0 +1,470 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ *
+ * Picks objects by drawing IDs into an integer framebuffer. See
+ * pick.h for details.
+ *
+ * The framebuffer is only region x region pixels. pick_begin()
+ * multiplies the projection matrix by a matrix that stretches the
+ * pixels around the picked pixel across the whole framebuffer (like
+ * gluPickMatrix()), so the size of the window doesn't matter and
+ * almost no pixels are shaded. Each pixel stores the index of the
+ * geometry in the slot's list of draws (plus 1) and gl_PrimitiveID.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+
+#include <GL/glew.h>
+
+#include "pick.h"
+#include "kuhl-util.h"
+#include "vecmat.h"
+#include "msg.h"
+#include "trace.h"
+
+#define PICK_MAX_LOCATIONS 16 /**< Attribute locations that in_Position may be at */
+
+/** Programs that draw IDs, one for each location that in_Position
+ * may be bound to in a geometry's vertex array object. */
+static GLuint pick_programs[PICK_MAX_LOCATIONS];
+static GLuint pick_vertex_shader = 0, pick_fragment_shader = 0;
+
+/** Returns the program that draws IDs for geometry whose in_Position
+ * attribute is at the given location, creating it if needed.
+ *
+ * @return The program or 0 if it couldn't be linked.
+ */
+static GLuint pick_program(GLint location)
+{
+	if(location < 0 || location >= PICK_MAX_LOCATIONS)
+		return 0;
+	if(pick_programs[location] != 0)
+		return pick_programs[location];
+
+	if(pick_vertex_shader == 0)
+	{
+		pick_vertex_shader = kuhl_create_shader("pick.vert", GL_VERTEX_SHADER);
+		pick_fragment_shader = kuhl_create_shader("pick.frag", GL_FRAGMENT_SHADER);
+	}
+	GLuint program = glCreateProgram();
+	glAttachShader(program, pick_vertex_shader);
+	glAttachShader(program, pick_fragment_shader);
+	glBindAttribLocation(program, location, "in_Position");
+	glBindFragDataLocation(program, 0, "out_Id");
+	glLinkProgram(program);
+	kuhl_errorcheck();
+
+	GLint linked = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if(linked == GL_FALSE)
+	{
+		kuhl_print_program_log(program);
+		msg(ERROR, "Failed to link the picking program.\n");
+		glDeleteProgram(program);
+		return 0;
+	}
+	kuhl_uniform_cache_invalidate(program);
+	pick_programs[location] = program;
+	return program;
+}
+
+/** Checks if the pixels can be read back without waiting for them. */
+static int pick_async_supported(void)
+{
+	return GLEW_VERSION_3_2 || (GLEW_VERSION_3_0 && GLEW_ARB_sync && GLEW_ARB_pixel_buffer_object);
+}
+
+/** Finds the object at the center of the region (or the closest one
+ * to the center) and stores it in pb->result.
+ *
+ * @param pixels Two values (draw index+1 and primitive) for each pixel in the region.
+ */
+static void pick_process(pick_buffer *pb, const pick_slot *slot, const GLuint *pixels)
+{
+	int r = pb->region;
+	int center = r/2;
+	int best = -1, bestDist = 0;
+	for(int j=0; j<r; j++)
+		for(int i=0; i<r; i++)
+		{
+			const GLuint *p = pixels + 2*(j*r+i);
+			if(p[0] == 0 || p[0] > (GLuint) slot->draws)
+				continue;
+			int dist = (i-center)*(i-center) + (j-center)*(j-center);
+			if(best < 0 || dist < bestDist)
+			{
+				best = j*r+i;
+				bestDist = dist;
+			}
+		}
+
+	memset(&(pb->result), 0, sizeof(pick_result));
+	pb->result.x = slot->x;
+	pb->result.y = slot->y;
+	if(best >= 0)
+	{
+		const GLuint *p = pixels + 2*best;
+		pb->result.id = slot->ids[p[0]-1];
+		pb->result.geom = slot->geoms[p[0]-1];
+		pb->result.primitive = (int) p[1];
+		pb->result.x = slot->x + best%r - center;
+		pb->result.y = slot->y + best/r - center;
+	}
+	pb->fresh = 1;
+}
+
+/** Processes a slot whose readback has finished.
+ *
+ * @param wait 1 to wait for the readback if the GPU hasn't finished it.
+ *
+ * @return 1 if the slot is now empty, 0 if the readback isn't ready.
+ */
+static int pick_collect(pick_buffer *pb, pick_slot *slot, int wait)
+{
+	if(!slot->busy)
+		return 1;
+
+	GLenum result = glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+	if(result == GL_TIMEOUT_EXPIRED)
+	{
+		if(!wait)
+			return 0;
+		TRACE_SCOPE("pick_wait");
+		while(result == GL_TIMEOUT_EXPIRED)
+			result = glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+	}
+	glDeleteSync(slot->fence);
+	slot->fence = 0;
+
+	GLsizeiptr size = (GLsizeiptr) pb->region * pb->region * 2 * sizeof(GLuint);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	const GLuint *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+	if(mapped != NULL)
+	{
+		pick_process(pb, slot, mapped);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	else
+		msg(ERROR, "Failed to map pixel buffer for picking.\n");
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	kuhl_errorcheck();
+	slot->busy = 0;
+	return 1;
+}
+
+/** Processes all finished readbacks in the order that they were
+ * started. */
+static void pick_collect_all(pick_buffer *pb, int wait)
+{
+	for(int i=0; i<PICK_SLOTS; i++)
+	{
+		pick_slot *slot = &(pb->slots[(pb->next+i) % PICK_SLOTS]);
+		if(!pick_collect(pb, slot, wait))
+			return;
+	}
+}
+
+/** Creates the framebuffer used for picking.
+ *
+ * @param pb The pick buffer to initialize.
+ *
+ * @param region The width and height of the area around the picked
+ * pixel that is searched for objects (an odd number, 1 only looks at
+ * the pixel itself).
+ *
+ * @return 1 on success, 0 if the framebuffer couldn't be created.
+ */
+int pick_init(pick_buffer *pb, int region)
+{
+	memset(pb, 0, sizeof(pick_buffer));
+	if(region < 1)
+		region = 1;
+	if(region % 2 == 0)
+		region++;
+	pb->region = region;
+
+	GLint prevFbo = 0;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prevFbo);
+
+	glGenTextures(1, &(pb->idTexture));
+	glBindTexture(GL_TEXTURE_2D, pb->idTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, region, region, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenRenderbuffers(1, &(pb->depthBuffer));
+	glBindRenderbuffer(GL_RENDERBUFFER, pb->depthBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, region, region);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &(pb->fbo));
+	glBindFramebuffer(GL_FRAMEBUFFER, pb->fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, pb->idTexture, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, pb->depthBuffer);
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, prevFbo);
+	kuhl_errorcheck();
+	if(status != GL_FRAMEBUFFER_COMPLETE)
+	{
+		msg(ERROR, "Picking framebuffer is incomplete (status 0x%x).\n", status);
+		pick_free(pb);
+		return 0;
+	}
+
+	if(pick_async_supported())
+	{
+		GLsizeiptr size = (GLsizeiptr) region * region * 2 * sizeof(GLuint);
+		for(int i=0; i<PICK_SLOTS; i++)
+		{
+			glGenBuffers(1, &(pb->slots[i].pbo));
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pb->slots[i].pbo);
+			glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+	kuhl_errorcheck();
+	return 1;
+}
+
+/** Starts drawing objects to pick.
+ *
+ * @param pb The pick buffer.
+ * @param viewport The viewport that the scene is drawn in (x, y, width, height).
+ * @param x The window coordinates of the pixel to pick (0,0 is the lower left corner).
+ * @param y The window coordinates of the pixel to pick.
+ * @param viewMat The view matrix the scene is drawn with.
+ * @param projMat The projection matrix the scene is drawn with.
+ */
+void pick_begin(pick_buffer *pb, const int viewport[4], int x, int y, const float viewMat[16], const float projMat[16])
+{
+	if(pb->fbo == 0 || pb->drawing)
+		return;
+	TRACE_SCOPE("pick_begin");
+
+	/* Make sure that the slot we are about to use is free. */
+	pick_collect_all(pb, 0);
+	pick_slot *slot = &(pb->slots[pb->next]);
+	pick_collect(pb, slot, 1);
+	slot->draws = 0;
+	slot->x = x;
+	slot->y = y;
+
+	/* Stretch the region around the pixel over the whole
+	 * framebuffer. */
+	float r = (float) pb->region;
+	float sx = viewport[2] / r, sy = viewport[3] / r;
+	float nx = 2*(x + .5f - viewport[0]) / viewport[2] - 1;
+	float ny = 2*(y + .5f - viewport[1]) / viewport[3] - 1;
+	float pickMat[16];
+	mat4f_identity(pickMat);
+	pickMat[0] = sx;
+	pickMat[5] = sy;
+	pickMat[12] = -sx*nx;
+	pickMat[13] = -sy*ny;
+	mat4f_mult_mat4f_new(pb->proj, pickMat, projMat);
+	mat4f_copy(pb->view, viewMat);
+
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &(pb->prevFbo));
+	glGetIntegerv(GL_VIEWPORT, pb->prevViewport);
+	glGetIntegerv(GL_CURRENT_PROGRAM, &(pb->prevProgram));
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &(pb->prevVao));
+
+	glBindFramebuffer(GL_FRAMEBUFFER, pb->fbo);
+	glViewport(0, 0, pb->region, pb->region);
+	glEnable(GL_DEPTH_TEST);
+	glDepthMask(GL_TRUE);
+	GLuint zero[4] = { 0, 0, 0, 0 };
+	glClearBufferuiv(GL_COLOR, 0, zero);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	kuhl_errorcheck();
+	pb->drawing = 1;
+}
+
+/** Draws a kuhl_geometry list into the pick buffer. Must be called
+ * between pick_begin() and pick_end().
+ *
+ * @param pb The pick buffer.
+ * @param geom The geometry to draw (the whole list is drawn).
+ * @param modelMat The model matrix of the geometry (the geometry's own matrix is applied too).
+ * @param id A number that pick_get() returns when the geometry is picked (0 is the same as nothing).
+ */
+void pick_draw(pick_buffer *pb, kuhl_geometry *geom, const float modelMat[16], GLuint id)
+{
+	if(!pb->drawing)
+		return;
+	pick_slot *slot = &(pb->slots[pb->next]);
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+	{
+		if(g->instance_count > 0 || g->vertex_count == 0 || !glIsVertexArray(g->vao))
+			continue;
+		if(slot->draws == PICK_MAX_DRAWS)
+		{
+			msg(WARNING, "More than %d objects were drawn for picking.\n", PICK_MAX_DRAWS);
+			return;
+		}
+		GLuint program = pick_program(kuhl_get_attribute(g->program, "in_Position"));
+		if(program == 0)
+			continue;
+		/* kuhl_geometry_draw() usually does this. */
+		kuhl_geometry_unmap(g);
+
+		slot->geoms[slot->draws] = g;
+		slot->ids[slot->draws] = id;
+		slot->draws++;
+
+		float modelview[16];
+		mat4f_mult_mat4f_new(modelview, pb->view, modelMat);
+		mat4f_mult_mat4f_new(modelview, modelview, g->matrix);
+		glUseProgram(program);
+		glUniformMatrix4fv(kuhl_get_uniform("Projection"), 1, 0, pb->proj);
+		glUniformMatrix4fv(kuhl_get_uniform("ModelView"), 1, 0, modelview);
+		glUniform1ui(kuhl_get_uniform("DrawId"), (GLuint) slot->draws);
+
+		glBindVertexArray(g->vao);
+		if(g->indices_len > 0)
+		{
+			size_t indexSize = g->indices_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+			const void *firstIndex = (const void*) (g->first_index*indexSize);
+			if(g->base_vertex != 0)
+				glDrawElementsBaseVertex(g->primitive_type, g->indices_len, g->indices_type,
+				                         firstIndex, g->base_vertex);
+			else
+				glDrawElements(g->primitive_type, g->indices_len, g->indices_type, firstIndex);
+		}
+		else
+			glDrawArrays(g->primitive_type, g->base_vertex, g->vertex_count);
+		kuhl_errorcheck();
+	}
+}
+
+/** Finishes drawing objects to pick and starts reading back the IDs
+ * around the pixel. */
+void pick_end(pick_buffer *pb)
+{
+	if(!pb->drawing)
+		return;
+	TRACE_SCOPE("pick_end");
+	pb->drawing = 0;
+	pick_slot *slot = &(pb->slots[pb->next]);
+
+	GLint packAlignment = 4;
+	glGetIntegerv(GL_PACK_ALIGNMENT, &packAlignment);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	if(slot->pbo != 0)
+	{
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+		glReadPixels(0, 0, pb->region, pb->region, GL_RG_INTEGER, GL_UNSIGNED_INT, 0);
+		slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		slot->busy = 1;
+		pb->next = (pb->next+1) % PICK_SLOTS;
+	}
+	else
+	{
+		/* Without sync objects, read the pixels immediately. */
+		GLuint *pixels = kuhl_malloc(sizeof(GLuint)*2*pb->region*pb->region);
+		glReadPixels(0, 0, pb->region, pb->region, GL_RG_INTEGER, GL_UNSIGNED_INT, pixels);
+		pick_process(pb, slot, pixels);
+		free(pixels);
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, packAlignment);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, pb->prevFbo);
+	glViewport(pb->prevViewport[0], pb->prevViewport[1], pb->prevViewport[2], pb->prevViewport[3]);
+	glBindVertexArray(pb->prevVao);
+	glUseProgram(pb->prevProgram);
+	kuhl_errorcheck();
+}
+
+/** Gets the most recent result that the GPU has finished.
+ *
+ * @param pb The pick buffer.
+ *
+ * @param result Filled in with the latest result. The geometry
+ * pointer is the geometry that was drawn when the result was
+ * started (usually one frame ago).
+ *
+ * @return 1 if the result is new since the last call, 0 if it is the
+ * same result as before (or no result has finished yet).
+ */
+int pick_get(pick_buffer *pb, pick_result *result)
+{
+	pick_collect_all(pb, 0);
+	*result = pb->result;
+	int fresh = pb->fresh;
+	pb->fresh = 0;
+	return fresh;
+}
+
+/** Deletes the OpenGL objects used by a pick buffer. */
+void pick_free(pick_buffer *pb)
+{
+	for(int i=0; i<PICK_SLOTS; i++)
+	{
+		if(pb->slots[i].fence != 0)
+			glDeleteSync(pb->slots[i].fence);
+		if(pb->slots[i].pbo != 0)
+			glDeleteBuffers(1, &(pb->slots[i].pbo));
+	}
+	if(pb->fbo != 0)
+		glDeleteFramebuffers(1, &(pb->fbo));
+	if(pb->idTexture != 0)
+		glDeleteTextures(1, &(pb->idTexture));
+	if(pb->depthBuffer != 0)
+		glDeleteRenderbuffers(1, &(pb->depthBuffer));
+	memset(pb, 0, sizeof(pick_buffer));
+}
+
+/** Picks by intersecting the ray through a pixel with a bounding
+ * volume hierarchy on the CPU. The result is available immediately
+ * and the GPU is not used.
+ *
+ * @param tree The tree to search (see bvh_build()).
+ * @param viewport The viewport that the scene is drawn in (x, y, width, height).
+ * @param x The window coordinates of the pixel to pick (0,0 is the lower left corner).
+ * @param y The window coordinates of the pixel to pick.
+ * @param viewMat The view matrix the scene is drawn with.
+ * @param projMat The projection matrix the scene is drawn with.
+ * @param hit Filled in with the closest item that the ray hits.
+ *
+ * @return 1 if something was hit between the near and far planes, 0 otherwise.
+ */
+int pick_ray(const bvh_tree *tree, const int viewport[4], float x, float y, const float viewMat[16], const float projMat[16], bvh_hit *hit)
+{
+	float viewProj[16], inv[16];
+	mat4f_mult_mat4f_new(viewProj, projMat, viewMat);
+	if(!mat4f_invert_new(inv, viewProj))
+		return 0;
+
+	float nx = 2*(x + .5f - viewport[0]) / viewport[2] - 1;
+	float ny = 2*(y + .5f - viewport[1]) / viewport[3] - 1;
+	float nearPt[4] = { nx, ny, -1, 1 };
+	float farPt[4]  = { nx, ny,  1, 1 };
+	mat4f_mult_vec4f(nearPt, inv);
+	mat4f_mult_vec4f(farPt, inv);
+	if(nearPt[3] == 0 || farPt[3] == 0)
+		return 0;
+	for(int i=0; i<3; i++)
+	{
+		nearPt[i] /= nearPt[3];
+		farPt[i] /= farPt[3];
+	}
+
+	float dir[3];
+	vec3f_sub_new(dir, farPt, nearPt);
+	float length = vec3f_norm(dir);
+	if(length == 0)
+		return 0;
+	return bvh_ray_nearest(tree, nearPt, dir, length, hit);
+}
@@ -0,0 +1,107 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    pick finds the object (and the triangle in it) that is under a
+    pixel, such as the cursor, without making the program wait for
+    the GPU. For example:
+
+    <pre>
+    pick_buffer pb;
+    pick_init(&pb, 5);
+    ...
+    // every frame:
+    pick_begin(&pb, viewport, cursorX, cursorY, viewMat, projMat);
+    pick_draw(&pb, &triangle, modelMat, 1);
+    pick_draw(&pb, &quad, modelMat, 2);
+    pick_end(&pb);
+    pick_result result;
+    if(pick_get(&pb, &result) && result.id != 0)
+        printf("Object %u, triangle %d\n", result.id, result.primitive);
+    </pre>
+
+    Between pick_begin() and pick_end(), each object is drawn with an
+    ID into a small integer framebuffer that only covers the pixels
+    around the cursor (region x region pixels). pick_end() starts
+    copying the IDs into a pixel buffer object, and pick_get() returns
+    the most recent result that the GPU has finished copying, which is
+    usually the one from the previous frame. The object under the
+    center pixel is returned; if there isn't one, the nearest object
+    in the region is returned so that thin objects are easy to pick.
+
+    Geometry is drawn with the "pick.vert" and "pick.frag" programs,
+    which must be in a directory that kuhl_find_file() searches. Only
+    the in_Position attribute and the geometry's matrix are used, so
+    animated (skinned) geometry is picked in its bind pose. Instanced
+    geometry is not drawn.
+
+    pick_ray() picks without the GPU by intersecting the ray through
+    a pixel with a bvh_tree (see bvh.h).
+
+    @author Scott Kuhl
+ */
+
+#ifndef __PICK_H__
+#define __PICK_H__
+
+#include "kuhl-util.h"
+#include "bvh.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PICK_SLOTS 3 /**< Number of readbacks that can be in flight */
+#define PICK_MAX_DRAWS 4096 /**< Most pick_draw() geometry in one pick_begin()/pick_end() pair */
+
+/** The result of picking. */
+typedef struct
+{
+	GLuint id; /**< ID passed to pick_draw(), 0 if nothing was picked */
+	kuhl_geometry *geom; /**< Geometry that was picked, NULL if nothing was picked */
+	int primitive; /**< Index of the primitive (i.e., triangle) in the geometry */
+	int x, y; /**< The pixel that the object was found at */
+} pick_result;
+
+/** A readback started by pick_end(). */
+typedef struct
+{
+	GLuint pbo;
+	GLsync fence;
+	int busy;
+	int x, y; /**< The pixel that was picked */
+	int draws; /**< Number of geometry drawn */
+	kuhl_geometry *geoms[PICK_MAX_DRAWS];
+	GLuint ids[PICK_MAX_DRAWS];
+} pick_slot;
+
+/** Framebuffer and readback state for picking. Create with pick_init(). */
+typedef struct
+{
+	int region; /**< Width and height of the area around the pixel that is read back */
+	GLuint fbo, idTexture, depthBuffer;
+	pick_slot slots[PICK_SLOTS];
+	int next; /**< Slot used by the next pick_end() */
+	int drawing; /**< Set between pick_begin() and pick_end() */
+	float view[16], proj[16]; /**< Matrices set by pick_begin() */
+	GLint prevFbo, prevViewport[4], prevProgram, prevVao; /**< State restored by pick_end() */
+	pick_result result; /**< Latest result */
+	int fresh; /**< Set when result hasn't been returned by pick_get() yet */
+} pick_buffer;
+
+int pick_init(pick_buffer *pb, int region);
+void pick_begin(pick_buffer *pb, const int viewport[4], int x, int y, const float viewMat[16], const float projMat[16]);
+void pick_draw(pick_buffer *pb, kuhl_geometry *geom, const float modelMat[16], GLuint id);
+void pick_end(pick_buffer *pb);
+int pick_get(pick_buffer *pb, pick_result *result);
+void pick_free(pick_buffer *pb);
+
+int pick_ray(const bvh_tree *tree, const int viewport[4], float x, float y, const float viewMat[16], const float projMat[16], bvh_hit *hit);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+#endif // __PICK_H__
@@ -0,0 +1,295 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ *
+ * Reads and writes program binaries. See progcache.h for a
+ * description of how the cache is used.
+ *
+ * A cache file is a progcache_header followed by the binary that
+ * glGetProgramBinary() returned.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <GL/glew.h>
+
+#include "msg.h"
+#include "kuhl-util.h"
+#include "progcache.h"
+
+#define PROGCACHE_MAGIC "KUHLPRG"
+#define PROGCACHE_VERSION 1
+#define PROGCACHE_DRIVER_LEN 512 /**< Space for the vendor, renderer and version strings in a cache file */
+
+/** The first bytes in every cache file. */
+typedef struct
+{
+	char magic[8]; /**< PROGCACHE_MAGIC */
+	uint32_t version; /**< PROGCACHE_VERSION */
+	uint32_t format; /**< Binary format returned by glGetProgramBinary() */
+	uint64_t hash; /**< progcache_hash() of the sources */
+	uint64_t length; /**< Size of the binary in bytes */
+	char driver[PROGCACHE_DRIVER_LEN]; /**< See progcache_driver() */
+} progcache_header;
+
+/** Returns 1 if program binaries should be read and written, 0
+ * otherwise. There must be a current OpenGL context. */
+int progcache_enabled(void)
+{
+	static int enabled = -1;
+	if(enabled >= 0)
+		return enabled;
+
+	enabled = 0;
+	const char *s = getenv("KUHL_PROGRAM_CACHE");
+	if(s != NULL && strcmp(s, "0") == 0)
+		return enabled;
+	if(!(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary))
+		return enabled;
+	/* Some drivers support the functions without supporting any
+	 * binary formats. */
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	enabled = formats > 0;
+	return enabled;
+}
+
+/** Describes the driver that binaries are created by. A binary from
+ * a different driver is never loaded. */
+static void progcache_driver(char *result, size_t len)
+{
+	const char *vendor = (const char*) glGetString(GL_VENDOR);
+	const char *renderer = (const char*) glGetString(GL_RENDERER);
+	const char *version = (const char*) glGetString(GL_VERSION);
+	snprintf(result, len, "%s|%s|%s", vendor ? vendor : "", renderer ? renderer : "", version ? version : "");
+}
+
+/** Adds a string (including its terminating null) to a 64-bit
+ * FNV-1a hash. */
+static uint64_t progcache_hash_string(uint64_t hash, const char *str)
+{
+	do
+	{
+		hash ^= (unsigned char) *str;
+		hash *= 1099511628211ull;
+	} while(*str++ != '\0');
+	return hash;
+}
+
+/** Creates the key that a program is stored under from the strings
+ * that determine what the program does and the driver that compiles
+ * it.
+ *
+ * @param strings The shader sources and anything else that changes
+ * the program (e.g., preprocessor definitions). NULL strings are
+ * hashed as empty strings.
+ *
+ * @param count The number of strings.
+ *
+ * @return A hash of the strings and the driver description.
+ */
+uint64_t progcache_hash(const char *const *strings, int count)
+{
+	char driver[PROGCACHE_DRIVER_LEN];
+	progcache_driver(driver, PROGCACHE_DRIVER_LEN);
+	uint64_t hash = progcache_hash_string(14695981039346656037ull, driver);
+	for(int i=0; i<count; i++)
+		hash = progcache_hash_string(hash, strings[i] ? strings[i] : "");
+	return hash;
+}
+
+/** Creates a directory if it doesn't exist.
+ *
+ * @return 1 if the directory exists, 0 otherwise.
+ */
+static int progcache_mkdir(const char *dir)
+{
+	if(mkdir(dir, 0755) == 0 || errno == EEXIST)
+		return 1;
+	msg(DEBUG, "Unable to create program cache directory %s\n", dir);
+	return 0;
+}
+
+/** Determines the name of the cache file for a program.
+ *
+ * @param result A buffer to write the name into.
+ * @param len The length of the result buffer.
+ * @param hash The key of the program (see progcache_hash()).
+ * @param create If 1, create the cache directory if it doesn't exist.
+ *
+ * @return 1 on success, 0 if there is no cache directory.
+ */
+static int progcache_filename(char *result, size_t len, uint64_t hash, int create)
+{
+	char dir[1024];
+	const char *s = getenv("KUHL_PROGRAM_CACHE_DIR");
+	if(s != NULL && strlen(s) > 0)
+	{
+		snprintf(dir, 1024, "%s", s);
+		if(create && !progcache_mkdir(dir))
+			return 0;
+	}
+	else
+	{
+		s = getenv("XDG_CACHE_HOME");
+		if(s != NULL && strlen(s) > 0)
+		{
+			if(create && !progcache_mkdir(s))
+				return 0;
+			snprintf(dir, 1024, "%s/libkuhl", s);
+		}
+		else
+		{
+			s = getenv("HOME");
+			if(s == NULL || strlen(s) == 0)
+				return 0;
+			snprintf(dir, 1024, "%s/.cache", s);
+			if(create && !progcache_mkdir(dir))
+				return 0;
+			snprintf(dir, 1024, "%s/.cache/libkuhl", s);
+		}
+		if(create && !progcache_mkdir(dir))
+			return 0;
+	}
+	snprintf(result, len, "%s/%016llx.kuhlprog", dir, (unsigned long long) hash);
+	return 1;
+}
+
+/** Loads a program binary that was stored by progcache_save().
+ *
+ * @param program A program that hasn't been linked yet.
+ *
+ * @param hash The key of the program (see progcache_hash()).
+ *
+ * @return 1 if the program was loaded and is linked, 0 if there is
+ * no usable binary. The program can still be compiled and linked if
+ * this returns 0.
+ */
+int progcache_load(GLuint program, uint64_t hash)
+{
+	char filename[2048];
+	if(!progcache_enabled() || !progcache_filename(filename, 2048, hash, 0))
+		return 0;
+	FILE *f = fopen(filename, "rb");
+	if(f == NULL)
+		return 0;
+
+	progcache_header header;
+	char driver[PROGCACHE_DRIVER_LEN];
+	progcache_driver(driver, PROGCACHE_DRIVER_LEN);
+	if(fread(&header, sizeof(header), 1, f) != 1 ||
+	   memcmp(header.magic, PROGCACHE_MAGIC, strlen(PROGCACHE_MAGIC)+1) != 0 ||
+	   header.version != PROGCACHE_VERSION || header.hash != hash ||
+	   header.length == 0 || header.length > INT32_MAX ||
+	   strncmp(header.driver, driver, PROGCACHE_DRIVER_LEN) != 0)
+	{
+		msg(DEBUG, "Ignoring program cache file %s\n", filename);
+		fclose(f);
+		return 0;
+	}
+
+	void *binary = malloc(header.length);
+	if(binary == NULL || fread(binary, header.length, 1, f) != 1)
+	{
+		msg(WARNING, "Failed to read program cache file %s\n", filename);
+		free(binary);
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	/* Report errors from earlier calls so that the error check below
+	 * only sees errors from glProgramBinary(). */
+	kuhl_errorcheck();
+	glProgramBinary(program, header.format, binary, (GLsizei) header.length);
+	free(binary);
+	/* An unsupported format is reported as an OpenGL error. */
+	GLenum error = glGetError();
+	if(error != GL_NO_ERROR)
+		msg(DEBUG, "glProgramBinary() failed with error 0x%x for %s\n", error, filename);
+	GLint linked = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if(linked == GL_FALSE)
+	{
+		msg(INFO, "The driver rejected program cache file %s\n", filename);
+		return 0;
+	}
+	return 1;
+}
+
+/** Stores a linked program so that progcache_load() can load it
+ * later. The file is written to a temporary file and renamed so that
+ * other processes (for example, DGR slaves sharing a home directory)
+ * never see a partially written file. For drivers to keep the binary,
+ * glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+ * GL_TRUE) should be called before the program is linked.
+ *
+ * @param program A linked program.
+ *
+ * @param hash The key of the program (see progcache_hash()).
+ *
+ * @return 1 if the cache file was written, 0 otherwise.
+ */
+int progcache_save(GLuint program, uint64_t hash)
+{
+	char filename[2048], tmpFile[2100];
+	if(!progcache_enabled() || !progcache_filename(filename, 2048, hash, 1))
+		return 0;
+
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if(length <= 0)
+		return 0;
+	void *binary = malloc(length);
+	if(binary == NULL)
+		return 0;
+	progcache_header header;
+	memset(&header, 0, sizeof(header));
+	GLenum format = 0;
+	GLsizei actualLength = 0;
+	glGetProgramBinary(program, length, &actualLength, &format, binary);
+	if(actualLength <= 0)
+	{
+		free(binary);
+		return 0;
+	}
+	memcpy(header.magic, PROGCACHE_MAGIC, strlen(PROGCACHE_MAGIC)+1);
+	header.version = PROGCACHE_VERSION;
+	header.format = format;
+	header.hash = hash;
+	header.length = (uint64_t) actualLength;
+	progcache_driver(header.driver, PROGCACHE_DRIVER_LEN);
+
+	snprintf(tmpFile, 2100, "%s.%d.tmp", filename, (int) getpid());
+	FILE *f = fopen(tmpFile, "wb");
+	if(f == NULL)
+	{
+		msg(DEBUG, "Unable to write program cache file %s\n", tmpFile);
+		free(binary);
+		return 0;
+	}
+	int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+	         fwrite(binary, actualLength, 1, f) == 1;
+	free(binary);
+	if(fclose(f) != 0)
+		ok = 0;
+	if(!ok || rename(tmpFile, filename) != 0)
+	{
+		msg(WARNING, "Failed to write program cache file %s\n", filename);
+		unlink(tmpFile);
+		return 0;
+	}
+	msg(DEBUG, "Wrote program cache %s (%d bytes)\n", filename, (int) actualLength);
+	return 1;
+}
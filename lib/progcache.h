@@ -0,0 +1,52 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    progcache stores linked GLSL programs with glGetProgramBinary()
+    so that later runs of a program can load them with
+    glProgramBinary() instead of compiling and linking the shaders
+    again, which can take several seconds per program with some
+    drivers. kuhl_create_program() uses this module automatically
+    when OpenGL 4.1 or ARB_get_program_binary is available.
+
+    Each cache file is named after a hash of the shader sources, the
+    preprocessor definitions that were added to them and the
+    GL_VENDOR, GL_RENDERER and GL_VERSION strings. The strings are
+    also stored in the file, so a program is compiled again whenever
+    the sources or the driver change. If the driver rejects a binary
+    (for example, after an update that didn't change the version
+    string), the program is compiled and the file is rewritten.
+
+    The following environment variables change the behavior of the
+    cache:
+
+    KUHL_PROGRAM_CACHE="0" - Don't read or write cache files.<br>
+    KUHL_PROGRAM_CACHE_DIR="/tmp/cache" - Store cache files in this
+    directory instead of $XDG_CACHE_HOME/libkuhl (or
+    ~/.cache/libkuhl if XDG_CACHE_HOME isn't set).
+
+    @author Scott Kuhl
+ */
+
+#ifndef __PROGCACHE_H__
+#define __PROGCACHE_H__
+
+#include <stdint.h>
+#include <GL/glew.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int progcache_enabled(void);
+uint64_t progcache_hash(const char *const *strings, int count);
+int progcache_load(GLuint program, uint64_t hash);
+int progcache_save(GLuint program, uint64_t hash);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+#endif // __PROGCACHE_H__
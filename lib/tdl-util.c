@@ -9,6 +9,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <time.h>
+#include <errno.h>
 
 #ifdef __cplusplus
 #include <cstdlib>
@@ -17,6 +19,24 @@
 #endif
 
 #include "tdl-util.h"
+#include "kuhl-nodep.h"
+#include "vecmat.h"
+
+/* The first 8 bytes of every tdl file. */
+static const unsigned char tdl_magic[8] = { 219, 84, 68, 76, 13, 10, 26, 10 };
+
+/*
+ * Copies a path into a buffer and appends ".tdl" if the path doesn't
+ * already end with it.
+ */
+static void tdl_path(char* buff, size_t len, const char* path)
+{
+	size_t pathLen = strlen(path);
+	if(pathLen < 4 || strncmp(path + pathLen - 4, ".tdl", 4) != 0)
+		snprintf(buff, len, "%s.tdl", path);
+	else
+		snprintf(buff, len, "%s", path);
+}
 /*
  * Moves the cursor to the first data point entry.
  * This MUST be called before any calls to tdl_read.
@@ -95,20 +115,12 @@ int tdl_prepare(int fd, char** name)
  */
 int tdl_create(const char* path, const char* name)
 {
-	int pathLen = strlen(path);
 	int nameLen = strlen(name);
 	nameLen = nameLen > 32 ? 32 : nameLen;
 
 	char buff[1024];
-	//Check the last 4 chars in the path to see if they are .tdl.
-	if(pathLen < 4 || strncmp(path + pathLen - 4, ".tdl", 4) != 0)
-	{
-		buff[0] = '\0';
-		strncat(buff, path, pathLen);
-		strncat(buff, ".tdl", 4);
-		path = buff;
-		pathLen += 4;
-	}
+	tdl_path(buff, sizeof(buff), path);
+	path = buff;
 
 	int fd = -1;
 	if((fd = open(path, O_CREAT | O_EXCL | O_RDWR , S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH)) < 0)
@@ -251,3 +263,440 @@ int tdl_validate(int fd)
 }
 
 
+
+/*
+ * Returns the current time of the monotonic clock in seconds.
+ */
+static double tdl_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Writes all of a buffer to a file, even if write() only writes part of it.
+ *
+ * @return int - 1 if everything was written, 0 otherwise.
+ */
+static int tdl_write_all(int fd, const void* data, size_t len)
+{
+	const char* p = (const char*) data;
+	while(len > 0)
+	{
+		ssize_t n = write(fd, p, len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/*
+ * Returns the offset of the first record in a version 2 file.
+ */
+static uint64_t tdl_data_offset(uint32_t objectCount)
+{
+	uint64_t offset = sizeof(tdl_header) + (uint64_t) objectCount * TDL_NAME_LEN;
+	return (offset + sizeof(tdl_record) - 1) / sizeof(tdl_record) * sizeof(tdl_record);
+}
+
+/*
+ * Creates a new version 2 tdl file. ".tdl" will be appended to the path
+ * if it is not there already.
+ *
+ * @param char* path - the file to create.
+ *		  char** names - the names of the tracked objects. Names longer than
+ *						 TDL_NAME_LEN-1 chars are truncated.
+ *		  int count - the number of names.
+ *
+ * @return tdl_writer* - the writer or NULL if the file could not be created.
+ */
+tdl_writer* tdl_writer_open(const char* path, const char** names, int count)
+{
+	if(count < 1)
+	{
+		fprintf(stderr, "%s: A tdl file needs at least one object.\n", __func__);
+		return NULL;
+	}
+
+	char buff[1024];
+	tdl_path(buff, sizeof(buff), path);
+	int fd = open(buff, O_CREAT | O_EXCL | O_RDWR , S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	if(fd < 0)
+	{
+		perror("File creation failed");
+		return NULL;
+	}
+
+	tdl_writer* w = (tdl_writer*) calloc(1, sizeof(tdl_writer));
+	w->fd = fd;
+	memcpy(w->header.magic, tdl_magic, 8);
+	w->header.version = TDL_VERSION;
+	w->header.objectCount = count;
+	w->header.blockRecords = TDL_BLOCK_RECORDS;
+	w->dataOffset = tdl_data_offset(count);
+
+	/* Write the header, the names and the padding at once. */
+	char* start = (char*) calloc(1, w->dataOffset);
+	memcpy(start, &(w->header), sizeof(tdl_header));
+	for(int i=0; i<count; i++)
+		strncpy(start + sizeof(tdl_header) + i*TDL_NAME_LEN, names[i], TDL_NAME_LEN-1);
+	int ok = tdl_write_all(fd, start, w->dataOffset);
+	free(start);
+	if(!ok)
+	{
+		perror("Writing header failed");
+		close(fd);
+		free(w);
+		return NULL;
+	}
+
+	w->start = tdl_now();
+	return w;
+}
+
+/*
+ * Adds a record to a version 2 file. Records are written a block at a time.
+ *
+ * @param tdl_writer* w - the writer.
+ *		  int object - the index of the object's name.
+ *		  double time - seconds since the file was created or a negative number to
+ *						use the current time. A time before the previous record
+ *						is changed to the time of the previous record.
+ *		  float* pos - the position (length 3).
+ *		  float* orient - the orientation (length 9).
+ *
+ * @return int - 1 if the record was added, 0 otherwise.
+ */
+int tdl_writer_add(tdl_writer* w, int object, double time, const float pos[3], const float orient[9])
+{
+	if(w == NULL || object < 0 || (uint32_t) object >= w->header.objectCount)
+		return 0;
+	if(time < 0)
+		time = tdl_now() - w->start;
+
+	/* Records must be in time order for the index to work. */
+	uint64_t count = w->header.recordCount;
+	if(count > 0 && time < w->lastTime)
+		time = w->lastTime;
+	w->lastTime = time;
+
+	if(count % TDL_BLOCK_RECORDS == 0)
+	{
+		if(w->blockCount == w->blockCapacity)
+		{
+			w->blockCapacity = w->blockCapacity ? w->blockCapacity*2 : 64;
+			w->blockTimes = (double*) realloc(w->blockTimes, sizeof(double)*w->blockCapacity);
+		}
+		w->blockTimes[w->blockCount++] = time;
+	}
+
+	tdl_record* rec = &(w->buffer[w->buffered++]);
+	memset(rec, 0, sizeof(tdl_record));
+	rec->time = time;
+	rec->object = object;
+	memcpy(rec->pos, pos, sizeof(float)*3);
+	memcpy(rec->orient, orient, sizeof(float)*9);
+	w->header.recordCount++;
+
+	if(w->buffered == TDL_BLOCK_RECORDS)
+		return tdl_writer_flush(w);
+	return 1;
+}
+
+/*
+ * Writes any buffered records to the file.
+ *
+ * @return int - 1 if the records were written, 0 otherwise.
+ */
+int tdl_writer_flush(tdl_writer* w)
+{
+	if(w == NULL || w->buffered == 0)
+		return 1;
+	int ok = tdl_write_all(w->fd, w->buffer, sizeof(tdl_record)*w->buffered);
+	if(!ok)
+		perror("Writing records failed");
+	w->buffered = 0;
+	return ok;
+}
+
+/*
+ * Writes the remaining records and the index, closes the file and frees the writer.
+ *
+ * @return int - 1 if the file was written, 0 otherwise.
+ */
+int tdl_writer_close(tdl_writer* w)
+{
+	if(w == NULL)
+		return 0;
+	int ok = tdl_writer_flush(w);
+
+	w->header.indexOffset = w->dataOffset + w->header.recordCount * sizeof(tdl_record);
+	if(ok && w->blockCount > 0)
+		ok = tdl_write_all(w->fd, w->blockTimes, sizeof(double)*w->blockCount);
+
+	/* The record count and index are only set in the header once the
+	 * index is in the file. */
+	if(ok && pwrite(w->fd, &(w->header), sizeof(tdl_header), 0) != (ssize_t) sizeof(tdl_header))
+		ok = 0;
+	if(!ok)
+		perror("Writing index failed");
+
+	close(w->fd);
+	free(w->blockTimes);
+	free(w);
+	return ok;
+}
+
+/*
+ * Builds the block index of a file whose index wasn't written.
+ */
+static double* tdl_build_index(const tdl_record* records, uint64_t count, uint64_t* blockCount)
+{
+	*blockCount = (count + TDL_BLOCK_RECORDS - 1) / TDL_BLOCK_RECORDS;
+	double* times = (double*) malloc(sizeof(double) * (*blockCount ? *blockCount : 1));
+	for(uint64_t b=0; b<*blockCount; b++)
+		times[b] = records[b*TDL_BLOCK_RECORDS].time;
+	return times;
+}
+
+/*
+ * Converts a version 1 file (one object, no time stamps) that has
+ * been mapped into memory into records.
+ */
+static int tdl_reader_v1(tdl_reader* r, const unsigned char* data, size_t size)
+{
+	/* Skip the 9 byte header and the name. */
+	size_t nameStart = 9, pos = nameStart;
+	while(pos < size && data[pos] != 0)
+		pos++;
+	if(pos >= size)
+		return 0;
+	pos++;
+
+	const size_t v1Size = 12 * sizeof(float);
+	uint64_t count = (size - pos) / v1Size;
+	uint64_t blockCount = (count + TDL_BLOCK_RECORDS - 1) / TDL_BLOCK_RECORDS;
+
+	/* Store the names, records and index in one allocation. */
+	size_t recordsStart = (TDL_NAME_LEN + sizeof(tdl_record) - 1) / sizeof(tdl_record) * sizeof(tdl_record);
+	size_t indexStart = recordsStart + count * sizeof(tdl_record);
+	char* owned = (char*) calloc(1, indexStart + sizeof(double) * (blockCount ? blockCount : 1));
+	size_t nameLen = pos - 1 - nameStart;
+	memcpy(owned, data + nameStart, nameLen < TDL_NAME_LEN ? nameLen : TDL_NAME_LEN-1);
+
+	tdl_record* records = (tdl_record*) (owned + recordsStart);
+	double* blockTimes = (double*) (owned + indexStart);
+	for(uint64_t i=0; i<count; i++)
+	{
+		/* Version 1 files were always recorded at 100 records per second. */
+		records[i].time = i / 100.0;
+		memcpy(records[i].pos, data + pos + i*v1Size, sizeof(float)*3);
+		memcpy(records[i].orient, data + pos + i*v1Size + sizeof(float)*3, sizeof(float)*9);
+		if(i % TDL_BLOCK_RECORDS == 0)
+			blockTimes[i / TDL_BLOCK_RECORDS] = records[i].time;
+	}
+
+	r->version = 1;
+	r->objectCount = 1;
+	r->names = (const char (*)[TDL_NAME_LEN]) owned;
+	r->records = records;
+	r->count = count;
+	r->blockTimes = blockTimes;
+	r->blockCount = blockCount;
+	r->owned = owned;
+	return 1;
+}
+
+/*
+ * Opens a version 1 or 2 tdl file. The file is mapped into memory.
+ * Version 1 files are assumed to have been recorded at 100 records per second.
+ *
+ * @param char* path - the file to open.
+ *
+ * @return tdl_reader* - the reader or NULL if the file could not be read.
+ */
+tdl_reader* tdl_reader_open(const char* path)
+{
+	size_t size = 0;
+	unsigned char* data = (unsigned char*) kuhl_mmap_file(path, &size);
+	if(data == NULL)
+	{
+		fprintf(stderr, "%s: Failed to read '%s'\n", __func__, path);
+		return NULL;
+	}
+
+	tdl_reader* r = (tdl_reader*) calloc(1, sizeof(tdl_reader));
+	r->map = data;
+	r->mapSize = size;
+	r->blockRecords = TDL_BLOCK_RECORDS;
+
+	int ok = 0;
+	if(size >= 9 && memcmp(data, tdl_magic, 8) == 0 && data[8] == 0)
+		ok = tdl_reader_v1(r, data, size);
+	else if(size >= sizeof(tdl_header) && memcmp(data, tdl_magic, 8) == 0)
+	{
+		const tdl_header* header = (const tdl_header*) data;
+		uint64_t dataOffset = tdl_data_offset(header->objectCount);
+		if(header->version == TDL_VERSION && header->objectCount > 0 &&
+		   header->blockRecords == TDL_BLOCK_RECORDS && dataOffset <= size)
+		{
+			r->version = header->version;
+			r->objectCount = header->objectCount;
+			r->names = (const char (*)[TDL_NAME_LEN]) (data + sizeof(tdl_header));
+			r->records = (const tdl_record*) (data + dataOffset);
+			r->count = header->recordCount;
+			r->blockCount = (r->count + TDL_BLOCK_RECORDS - 1) / TDL_BLOCK_RECORDS;
+			if(header->indexOffset != 0 &&
+			   header->indexOffset == dataOffset + r->count*sizeof(tdl_record) &&
+			   header->indexOffset + r->blockCount*sizeof(double) <= size)
+				r->blockTimes = (const double*) (data + header->indexOffset);
+			else
+			{
+				/* The writer didn't finish; use every complete record. */
+				r->count = (size - dataOffset) / sizeof(tdl_record);
+				double* times = tdl_build_index(r->records, r->count, &(r->blockCount));
+				r->blockTimes = times;
+				r->owned = times;
+			}
+			ok = 1;
+		}
+	}
+
+	if(!ok)
+	{
+		fprintf(stderr, "%s: '%s' is not a valid tdl file.\n", __func__, path);
+		tdl_reader_close(r);
+		return NULL;
+	}
+	return r;
+}
+
+/*
+ * Returns the index of the last record at or before a time using the block
+ * index, or -1 if the time is before the first record.
+ */
+int64_t tdl_reader_find(const tdl_reader* r, double time)
+{
+	if(r == NULL || r->count == 0 || time < r->blockTimes[0])
+		return -1;
+
+	/* Find the last block that starts at or before the time... */
+	uint64_t lo = 0, hi = r->blockCount;
+	while(hi - lo > 1)
+	{
+		uint64_t mid = (lo + hi) / 2;
+		if(r->blockTimes[mid] <= time)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	/* ...and then the last record in that block at or before the time. */
+	uint64_t first = lo * r->blockRecords;
+	uint64_t last = first + r->blockRecords;
+	if(last > r->count)
+		last = r->count;
+	lo = first;
+	hi = last;
+	while(hi - lo > 1)
+	{
+		uint64_t mid = (lo + hi) / 2;
+		if(r->records[mid].time <= time)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (int64_t) lo;
+}
+
+/*
+ * Finds the most recent record of an object at a time.
+ *
+ * @param tdl_reader* r - the reader.
+ *		  int object - the index of the object's name.
+ *		  double time - seconds since the start of the file.
+ *
+ * @return tdl_record* - the record or NULL if the object has no record at or
+ *						 before the time.
+ */
+const tdl_record* tdl_reader_sample(const tdl_reader* r, int object, double time)
+{
+	for(int64_t i = tdl_reader_find(r, time); i >= 0; i--)
+		if(r->records[i].object == (uint32_t) object)
+			return &(r->records[i]);
+	return NULL;
+}
+
+/*
+ * Finds the position and orientation of an object at a time by
+ * interpolating between the records before and after the time.
+ *
+ * @return int - 1 if pos and orient were set, 0 otherwise.
+ */
+int tdl_reader_interpolate(const tdl_reader* r, int object, double time, float pos[3], float orient[9])
+{
+	int64_t i = tdl_reader_find(r, time);
+	const tdl_record* before = NULL;
+	for(; i >= 0 && before == NULL; i--)
+		if(r->records[i].object == (uint32_t) object)
+			before = &(r->records[i]);
+	if(before == NULL)
+		return 0;
+
+	/* The next record of the object is usually only a few records later. */
+	const tdl_record* after = NULL;
+	for(const tdl_record* rec = before+1; rec < r->records + r->count; rec++)
+		if(rec->object == (uint32_t) object)
+		{
+			after = rec;
+			break;
+		}
+
+	if(after == NULL || after->time <= before->time)
+	{
+		memcpy(pos, before->pos, sizeof(float)*3);
+		memcpy(orient, before->orient, sizeof(float)*9);
+		return 1;
+	}
+
+	float t = (float) ((time - before->time) / (after->time - before->time));
+	if(t > 1)
+		t = 1;
+	for(int j=0; j<3; j++)
+		pos[j] = before->pos[j] + (after->pos[j] - before->pos[j]) * t;
+
+	float q1[4], q2[4], q[4];
+	quatf_from_mat3f(q1, before->orient);
+	quatf_from_mat3f(q2, after->orient);
+	quatf_slerp_new(q, q1, q2, t);
+	mat3f_rotateQuatVec_new(orient, q);
+	return 1;
+}
+
+/*
+ * Returns the time of the last record in the file.
+ */
+double tdl_reader_duration(const tdl_reader* r)
+{
+	if(r == NULL || r->count == 0)
+		return 0;
+	return r->records[r->count-1].time;
+}
+
+/*
+ * Unmaps the file and frees the reader.
+ */
+void tdl_reader_close(tdl_reader* r)
+{
+	if(r == NULL)
+		return;
+	if(r->map != NULL)
+		kuhl_munmap_file(r->map, r->mapSize);
+	free(r->owned);
+	free(r);
+}
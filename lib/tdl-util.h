@@ -1,12 +1,102 @@
 /*
  * This file contains useful methods for reading, writing and creating Tracked Data Log (.tdl) files
  * @author John Thomas
+ *
+ * There are two versions of the format. Version 1 files (tdl_create(),
+ * tdl_read(), tdl_write()) contain one tracked object and no time
+ * stamps, so they only play back at the right speed if they are read
+ * at the rate they were written.
+ *
+ * Version 2 files (tdl_writer_open(), tdl_reader_open()) contain any
+ * number of tracked objects and a time stamp for every record:
+ *
+ *   tdl_header, objectCount names (TDL_NAME_LEN bytes each), padding
+ *   to a multiple of sizeof(tdl_record), the records (in time order),
+ *   and an index with the time of the first record of each block of
+ *   blockRecords records.
+ *
+ * The writer collects a block of records in memory and writes it with
+ * a single write() call. The reader maps the file into memory and
+ * uses the index to find the record at a time with a binary search.
+ * If the program that wrote the file was killed before it called
+ * tdl_writer_close(), the index is rebuilt when the file is opened.
  */
 
+#ifndef __TDL_UTIL_H__
+#define __TDL_UTIL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define TDL_VERSION 2 /* Version written by tdl_writer_open() */
+#define TDL_NAME_LEN 32 /* Bytes stored for each object name (including the NULL term) */
+#define TDL_BLOCK_RECORDS 256 /* Records in each block of a version 2 file */
+
+/*
+ * The start of a version 2 file. The first 8 bytes match the header of a
+ * version 1 file, which has a NULL char instead of the version number.
+ */
+typedef struct
+{
+	unsigned char magic[8];
+	uint32_t version;
+	uint32_t objectCount;
+	uint32_t blockRecords;
+	uint32_t reserved;
+	uint64_t recordCount; /* 0 until tdl_writer_close() is called */
+	uint64_t indexOffset; /* 0 until tdl_writer_close() is called */
+} tdl_header;
+
+/*
+ * One sample of one tracked object (64 bytes).
+ */
+typedef struct
+{
+	double time; /* Seconds since the file was created */
+	uint32_t object; /* Index of the object name */
+	float pos[3];
+	float orient[9];
+	uint32_t reserved;
+} tdl_record;
+
+/*
+ * Writes a version 2 file. Create with tdl_writer_open().
+ */
+typedef struct
+{
+	int fd;
+	tdl_header header;
+	uint64_t dataOffset; /* Where the first record is in the file */
+	tdl_record buffer[TDL_BLOCK_RECORDS]; /* Records that haven't been written yet */
+	int buffered;
+	double *blockTimes; /* Time of the first record of each block */
+	uint64_t blockCount, blockCapacity;
+	double start; /* Monotonic clock time when the file was created */
+	double lastTime; /* Time of the most recent record */
+} tdl_writer;
+
+/*
+ * Reads a version 1 or version 2 file. Create with tdl_reader_open().
+ */
+typedef struct
+{
+	void *map; /* The mapped file */
+	size_t mapSize;
+	const tdl_record *records; /* All of the records in time order */
+	uint64_t count;
+	int objectCount;
+	const char (*names)[TDL_NAME_LEN];
+	const double *blockTimes; /* Time of the first record of each block */
+	uint64_t blockCount;
+	uint32_t blockRecords;
+	int version;
+	void *owned; /* Memory allocated for records or blockTimes that are not in the file */
+} tdl_reader;
+
 /*
  * Moves the cursor to the first data point entry.
  * This MUST be called before any calls to tdl_read.
@@ -84,6 +174,102 @@ bool tdl_validate(int fd);
 int tdl_validate(int fd);
 #endif
 
+/*
+ * Creates a new version 2 tdl file. ".tdl" will be appended to the path
+ * if it is not there already.
+ *
+ * @param char* path - the file to create.
+ *		  char** names - the names of the tracked objects.
+ *		  int count - the number of names.
+ *
+ * @return tdl_writer* - the writer or NULL if the file could not be created.
+ */
+tdl_writer* tdl_writer_open(const char* path, const char** names, int count);
+
+/*
+ * Adds a record to a version 2 file. Records are written a block at a time.
+ *
+ * @param tdl_writer* w - the writer.
+ *		  int object - the index of the object's name.
+ *		  double time - seconds since the file was created or a negative number to
+ *						use the current time. A time before the previous
+ *						record is changed to the time of the previous record.
+ *		  float* pos - the position (length 3).
+ *		  float* orient - the orientation (length 9).
+ *
+ * @return int - 1 if the record was added, 0 otherwise.
+ */
+int tdl_writer_add(tdl_writer* w, int object, double time, const float pos[3], const float orient[9]);
+
+/*
+ * Writes any buffered records to the file.
+ *
+ * @return int - 1 if the records were written, 0 otherwise.
+ */
+int tdl_writer_flush(tdl_writer* w);
+
+/*
+ * Writes the remaining records and the index, closes the file and frees the writer.
+ *
+ * @return int - 1 if the file was written, 0 otherwise.
+ */
+int tdl_writer_close(tdl_writer* w);
+
+/*
+ * Opens a version 1 or 2 tdl file. The file is mapped into memory.
+ * Version 1 files are assumed to have been recorded at 100 records per second.
+ *
+ * @param char* path - the file to open.
+ *
+ * @return tdl_reader* - the reader or NULL if the file could not be read.
+ */
+tdl_reader* tdl_reader_open(const char* path);
+
+/*
+ * Returns the index of the last record at or before a time using the block
+ * index, or -1 if the time is before the first record.
+ */
+int64_t tdl_reader_find(const tdl_reader* r, double time);
+
+/*
+ * Finds the most recent record of an object at a time.
+ *
+ * @param tdl_reader* r - the reader.
+ *		  int object - the index of the object's name.
+ *		  double time - seconds since the start of the file.
+ *
+ * @return tdl_record* - the record or NULL if the object has no record at or
+ *						 before the time.
+ */
+const tdl_record* tdl_reader_sample(const tdl_reader* r, int object, double time);
+
+/*
+ * Finds the position and orientation of an object at a time by
+ * interpolating between the records before and after the time. The
+ * positions are interpolated linearly and the orientations with slerp.
+ *
+ * @param tdl_reader* r - the reader.
+ *		  int object - the index of the object's name.
+ *		  double time - seconds since the start of the file.
+ *		  float* pos - set to the position (length 3).
+ *		  float* orient - set to the orientation (length 9).
+ *
+ * @return int - 1 if pos and orient were set, 0 if the object has no record
+ *				 at or before the time.
+ */
+int tdl_reader_interpolate(const tdl_reader* r, int object, double time, float pos[3], float orient[9]);
+
+/*
+ * Returns the time of the last record in the file.
+ */
+double tdl_reader_duration(const tdl_reader* r);
+
+/*
+ * Unmaps the file and frees the reader.
+ */
+void tdl_reader_close(tdl_reader* r);
+
 #ifdef __cplusplus
 } // end extern "C"
 #endif
+#endif // __TDL_UTIL_H__
@@ -0,0 +1,1012 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ *
+ * Compresses images into BC1/BC3 blocks, reads and writes KTX files
+ * and uploads them. See texcache.h for a description of how the
+ * cache is used.
+ *
+ * A KTX file starts with a 12 byte identifier and 13 32-bit header
+ * fields followed by key/value data and then each mipmap level
+ * (prefixed by its size in bytes). Cache files store the size and
+ * modification time of the image they were created from in the
+ * "kuhl.source" key. Like OpenGL, texcache stores the bottom row
+ * first, which files say with the "KTXorientation" key "S=r,T=u";
+ * BC1-BC3 files that store the top row first are flipped when they
+ * are read.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h> // strcasecmp()
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <GL/glew.h>
+
+#include "texcache.h"
+#include "kuhl-util.h"
+#include "kuhl-nodep.h"
+#include "msg.h"
+#include "trace.h"
+
+#define TEXCACHE_SOURCE_KEY "kuhl.source"
+#define TEXCACHE_ORIENTATION_KEY "KTXorientation"
+#define TEXCACHE_ORIENTATION "S=r,T=u" /**< Rows go up (bottom row first) */
+
+static const unsigned char texcache_ktx_identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+/* Compressed formats that may not be defined by older headers. */
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+#define GL_COMPRESSED_RGBA_BPTC_UNORM 0x8E8C
+#endif
+#ifndef GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM
+#define GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM 0x8E8D
+#endif
+#ifndef GL_COMPRESSED_RGB8_ETC2
+#define GL_COMPRESSED_RGB8_ETC2 0x9274
+#endif
+#ifndef GL_COMPRESSED_RGBA8_ETC2_EAC
+#define GL_COMPRESSED_RGBA8_ETC2_EAC 0x9278
+#endif
+
+/** The fields of a KTX header that follow the identifier. */
+typedef struct
+{
+	uint32_t endianness;
+	uint32_t glType;
+	uint32_t glTypeSize;
+	uint32_t glFormat;
+	uint32_t glInternalFormat;
+	uint32_t glBaseInternalFormat;
+	uint32_t pixelWidth;
+	uint32_t pixelHeight;
+	uint32_t pixelDepth;
+	uint32_t numberOfArrayElements;
+	uint32_t numberOfFaces;
+	uint32_t numberOfMipmapLevels;
+	uint32_t bytesOfKeyValueData;
+} texcache_ktx_header;
+
+
+/** Returns 1 if KUHL_TEXTURE_COMPRESS is set and the graphics card
+ * can use the textures that the cache creates. */
+int texcache_enabled(void)
+{
+	const char *s = getenv("KUHL_TEXTURE_COMPRESS");
+	if(s == NULL || strlen(s) == 0 || strcmp(s, "0") == 0)
+		return 0;
+	return glewIsSupported("GL_EXT_texture_compression_s3tc");
+}
+
+/** Returns 1 if the filename ends with ".ktx". */
+int texcache_is_ktx(const char *filename)
+{
+	size_t len = strlen(filename);
+	return len > 4 && strcasecmp(filename + len - 4, ".ktx") == 0;
+}
+
+/** Returns the number of bytes in each 4x4 block of a compressed
+ * format, or 0 if the format isn't supported by this module. */
+static int texcache_block_bytes(GLenum format)
+{
+	switch(format)
+	{
+		case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+		case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+		case GL_COMPRESSED_RGB8_ETC2:
+			return 8;
+		case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+		case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+		case GL_COMPRESSED_RGBA_BPTC_UNORM:
+		case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+		case GL_COMPRESSED_RGBA8_ETC2_EAC:
+			return 16;
+		default:
+			return 0;
+	}
+}
+
+/** Returns 1 if the graphics card supports a compressed format. */
+static int texcache_format_supported(GLenum format)
+{
+	switch(format)
+	{
+		case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+		case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+		case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+		case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+			return glewIsSupported("GL_EXT_texture_compression_s3tc");
+		case GL_COMPRESSED_RGBA_BPTC_UNORM:
+		case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+			return GLEW_VERSION_4_2 || glewIsSupported("GL_ARB_texture_compression_bptc");
+		case GL_COMPRESSED_RGB8_ETC2:
+		case GL_COMPRESSED_RGBA8_ETC2_EAC:
+			return GLEW_VERSION_4_3 || glewIsSupported("GL_ARB_ES3_compatibility");
+		default:
+			return 0;
+	}
+}
+
+/** Returns the size in bytes of one mipmap level. */
+size_t texcache_level_size(GLenum format, int width, int height)
+{
+	size_t blocksX = (width+3)/4;
+	size_t blocksY = (height+3)/4;
+	return blocksX * blocksY * texcache_block_bytes(format);
+}
+
+
+/* ====== Compression ====== */
+
+/** Converts an RGB color into RGB565. */
+static uint16_t texcache_pack565(const float c[3])
+{
+	int r = (int)(c[0] * 31 / 255.0f + .5f);
+	int g = (int)(c[1] * 63 / 255.0f + .5f);
+	int b = (int)(c[2] * 31 / 255.0f + .5f);
+	r = r < 0 ? 0 : (r > 31 ? 31 : r);
+	g = g < 0 ? 0 : (g > 63 ? 63 : g);
+	b = b < 0 ? 0 : (b > 31 ? 31 : b);
+	return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+/** Converts an RGB565 color into 8 bit components. */
+static void texcache_unpack565(uint16_t c, int rgb[3])
+{
+	int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+	rgb[0] = (r << 3) | (r >> 2);
+	rgb[1] = (g << 2) | (g >> 4);
+	rgb[2] = (b << 3) | (b >> 2);
+}
+
+/** Compresses the colors of a 4x4 block into an 8 byte BC1 color
+ * block. The endpoints are the extremes of the colors along their
+ * principal axis, moved slightly inward. */
+static void texcache_color_block(const unsigned char block[64], unsigned char out[8])
+{
+	float mean[3] = { 0, 0, 0 };
+	for(int i=0; i<16; i++)
+		for(int c=0; c<3; c++)
+			mean[c] += block[i*4+c] / 16.0f;
+
+	float cov[6] = { 0, 0, 0, 0, 0, 0 }; // rr rg rb gg gb bb
+	for(int i=0; i<16; i++)
+	{
+		float r = block[i*4+0]-mean[0], g = block[i*4+1]-mean[1], b = block[i*4+2]-mean[2];
+		cov[0] += r*r; cov[1] += r*g; cov[2] += r*b;
+		cov[3] += g*g; cov[4] += g*b; cov[5] += b*b;
+	}
+
+	/* Find the principal axis with a few steps of power iteration. */
+	float axis[3] = { 1, 1, 1 };
+	for(int iter=0; iter<8; iter++)
+	{
+		float x = cov[0]*axis[0] + cov[1]*axis[1] + cov[2]*axis[2];
+		float y = cov[1]*axis[0] + cov[3]*axis[1] + cov[4]*axis[2];
+		float z = cov[2]*axis[0] + cov[4]*axis[1] + cov[5]*axis[2];
+		float m = x*x + y*y + z*z;
+		if(m < 1e-12f)
+			break;
+		m = 1.0f / sqrtf(m);
+		axis[0] = x*m; axis[1] = y*m; axis[2] = z*m;
+	}
+
+	float minProj = 1e30f, maxProj = -1e30f;
+	for(int i=0; i<16; i++)
+	{
+		float p = (block[i*4+0]-mean[0])*axis[0] + (block[i*4+1]-mean[1])*axis[1] + (block[i*4+2]-mean[2])*axis[2];
+		if(p < minProj) minProj = p;
+		if(p > maxProj) maxProj = p;
+	}
+	float inset = (maxProj - minProj) / 32.0f;
+	float hi[3], lo[3];
+	for(int c=0; c<3; c++)
+	{
+		hi[c] = mean[c] + axis[c]*(maxProj - inset);
+		lo[c] = mean[c] + axis[c]*(minProj + inset);
+	}
+
+	uint16_t c0 = texcache_pack565(hi);
+	uint16_t c1 = texcache_pack565(lo);
+	if(c0 < c1)
+	{
+		uint16_t tmp = c0;
+		c0 = c1;
+		c1 = tmp;
+	}
+
+	/* c0 > c1 selects the four color mode. If they are equal, every
+	 * pixel uses c0. */
+	uint32_t indices = 0;
+	if(c0 != c1)
+	{
+		int palette[4][3];
+		texcache_unpack565(c0, palette[0]);
+		texcache_unpack565(c1, palette[1]);
+		for(int c=0; c<3; c++)
+		{
+			palette[2][c] = (2*palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2*palette[1][c]) / 3;
+		}
+		for(int i=0; i<16; i++)
+		{
+			int best = 0, bestDist = 1<<30;
+			for(int p=0; p<4; p++)
+			{
+				int dr = block[i*4+0]-palette[p][0];
+				int dg = block[i*4+1]-palette[p][1];
+				int db = block[i*4+2]-palette[p][2];
+				int dist = dr*dr + dg*dg + db*db;
+				if(dist < bestDist)
+				{
+					bestDist = dist;
+					best = p;
+				}
+			}
+			indices |= (uint32_t) best << (2*i);
+		}
+	}
+
+	out[0] = c0 & 0xff; out[1] = c0 >> 8;
+	out[2] = c1 & 0xff; out[3] = c1 >> 8;
+	for(int i=0; i<4; i++)
+		out[4+i] = (indices >> (8*i)) & 0xff;
+}
+
+/** Compresses the alpha values of a 4x4 block into an 8 byte BC3
+ * alpha block. */
+static void texcache_alpha_block(const unsigned char block[64], unsigned char out[8])
+{
+	int a0 = 0, a1 = 255;
+	for(int i=0; i<16; i++)
+	{
+		if(block[i*4+3] > a0) a0 = block[i*4+3];
+		if(block[i*4+3] < a1) a1 = block[i*4+3];
+	}
+
+	/* a0 > a1 selects eight interpolated values. If they are equal,
+	 * every pixel uses a0. */
+	uint64_t indices = 0;
+	if(a0 != a1)
+	{
+		int palette[8];
+		palette[0] = a0;
+		palette[1] = a1;
+		for(int p=1; p<7; p++)
+			palette[p+1] = ((7-p)*a0 + p*a1) / 7;
+		for(int i=0; i<16; i++)
+		{
+			int best = 0, bestDist = 1<<30;
+			for(int p=0; p<8; p++)
+			{
+				int dist = abs(block[i*4+3] - palette[p]);
+				if(dist < bestDist)
+				{
+					bestDist = dist;
+					best = p;
+				}
+			}
+			indices |= (uint64_t) best << (3*i);
+		}
+	}
+
+	out[0] = (unsigned char) a0;
+	out[1] = (unsigned char) a1;
+	for(int i=0; i<6; i++)
+		out[2+i] = (indices >> (8*i)) & 0xff;
+}
+
+/** Compresses an image into BC1 or BC3 blocks. Blocks that extend
+ * past the edge of the image repeat the last row or column.
+ *
+ * @param rgba The image (4 bytes per pixel).
+ *
+ * @param width The width of the image.
+ *
+ * @param height The height of the image.
+ *
+ * @param alpha 1 to write BC3 (DXT5) blocks, 0 to write BC1 (DXT1)
+ * blocks that ignore alpha.
+ *
+ * @param out Filled in with the blocks, left to right and then bottom
+ * to top. Must have room for texcache_level_size() bytes.
+ */
+void texcache_compress_blocks(const unsigned char *rgba, int width, int height, int alpha, unsigned char *out)
+{
+	unsigned char block[64];
+	for(int by=0; by<height; by+=4)
+	{
+		for(int bx=0; bx<width; bx+=4)
+		{
+			for(int y=0; y<4; y++)
+			{
+				int sy = by+y < height ? by+y : height-1;
+				for(int x=0; x<4; x++)
+				{
+					int sx = bx+x < width ? bx+x : width-1;
+					memcpy(block + (y*4+x)*4, rgba + ((size_t)sy*width + sx)*4, 4);
+				}
+			}
+			if(alpha)
+			{
+				texcache_alpha_block(block, out);
+				out += 8;
+			}
+			texcache_color_block(block, out);
+			out += 8;
+		}
+	}
+}
+
+/** Creates the next mipmap level of an RGBA image by averaging 2x2
+ * groups of pixels.
+ *
+ * @return The new image (free() it). newWidth and newHeight are set
+ * to its size.
+ */
+unsigned char* texcache_downsample(const unsigned char *rgba, int width, int height, int *newWidth, int *newHeight)
+{
+	int w = width > 1 ? width/2 : 1;
+	int h = height > 1 ? height/2 : 1;
+	unsigned char *out = kuhl_malloc((size_t)w*h*4);
+	for(int y=0; y<h; y++)
+	{
+		int y0 = y*2 < height ? y*2 : height-1;
+		int y1 = y*2+1 < height ? y*2+1 : height-1;
+		for(int x=0; x<w; x++)
+		{
+			int x0 = x*2 < width ? x*2 : width-1;
+			int x1 = x*2+1 < width ? x*2+1 : width-1;
+			for(int c=0; c<4; c++)
+			{
+				int sum = rgba[((size_t)y0*width+x0)*4+c] + rgba[((size_t)y0*width+x1)*4+c] +
+				          rgba[((size_t)y1*width+x0)*4+c] + rgba[((size_t)y1*width+x1)*4+c];
+				out[((size_t)y*w+x)*4+c] = (unsigned char)((sum+2)/4);
+			}
+		}
+	}
+	*newWidth = w;
+	*newHeight = h;
+	return out;
+}
+
+/** Compresses an image and all of its mipmap levels. Opaque images
+ * are stored as BC1 (DXT1) and other images as BC3 (DXT5).
+ *
+ * @param rgba The image (4 bytes per pixel, bottom row first).
+ *
+ * @param width The width of the image.
+ *
+ * @param height The height of the image.
+ *
+ * @param image Filled in with the compressed image. Free with
+ * texcache_free().
+ *
+ * @return 1 on success, 0 on failure.
+ */
+int texcache_compress(const unsigned char *rgba, int width, int height, texcache_image *image)
+{
+	TRACE_SCOPE("texcache_compress");
+	memset(image, 0, sizeof(texcache_image));
+	if(width <= 0 || height <= 0)
+		return 0;
+
+	int alpha = 0;
+	for(size_t i=0; i<(size_t)width*height && !alpha; i++)
+		if(rgba[i*4+3] != 255)
+			alpha = 1;
+	image->format = alpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	image->width = width;
+	image->height = height;
+
+	/* Work out the size of every level so that they can be stored in
+	 * a single array. */
+	size_t total = 0;
+	int w = width, h = height;
+	for(;;)
+	{
+		image->offset[image->levels] = total;
+		image->size[image->levels] = texcache_level_size(image->format, w, h);
+		total += image->size[image->levels];
+		image->levels++;
+		if((w == 1 && h == 1) || image->levels == TEXCACHE_MAX_LEVELS)
+			break;
+		w = w > 1 ? w/2 : 1;
+		h = h > 1 ? h/2 : 1;
+	}
+	image->data = kuhl_malloc(total);
+
+	const unsigned char *level = rgba;
+	unsigned char *next = NULL;
+	w = width;
+	h = height;
+	for(int i=0; i<image->levels; i++)
+	{
+		texcache_compress_blocks(level, w, h, alpha, image->data + image->offset[i]);
+		if(i+1 < image->levels)
+		{
+			next = texcache_downsample(level, w, h, &w, &h);
+			if(level != rgba)
+				free((void*) level);
+			level = next;
+		}
+	}
+	if(level != rgba)
+		free((void*) level);
+	return 1;
+}
+
+/** Frees the data in a texcache_image. */
+void texcache_free(texcache_image *image)
+{
+	free(image->data);
+	memset(image, 0, sizeof(texcache_image));
+}
+
+
+/* ====== KTX files ====== */
+
+/** Reverses the order of the first rows of a 4x4 block of BC1
+ * color indices (one byte per row). */
+static void texcache_flip_bc1(unsigned char *block, int rows)
+{
+	for(int r=0; r<rows/2; r++)
+	{
+		unsigned char t = block[4+r];
+		block[4+r] = block[4+rows-1-r];
+		block[4+rows-1-r] = t;
+	}
+}
+
+/** Reverses the order of the first rows of a 4x4 block of BC3 alpha
+ * indices (48 bits after the two alpha values, 12 bits per row). */
+static void texcache_flip_bc3_alpha(unsigned char *block, int rows)
+{
+	uint64_t bits = 0;
+	for(int i=0; i<6; i++)
+		bits |= (uint64_t) block[2+i] << (8*i);
+	uint64_t flipped = bits;
+	for(int r=0; r<rows; r++)
+	{
+		flipped &= ~((uint64_t) 0xfff << (12*r));
+		flipped |= ((bits >> (12*(rows-1-r))) & 0xfff) << (12*r);
+	}
+	for(int i=0; i<6; i++)
+		block[2+i] = (unsigned char)(flipped >> (8*i));
+}
+
+/** Flips one mipmap level upside down without decompressing it. Only
+ * works for BC1-BC3 (where each row of a block is stored separately)
+ * and for levels whose height is a multiple of 4 or less than 4 (so
+ * that rows don't need to move between blocks).
+ *
+ * @return 1 on success, 0 if the level can't be flipped.
+ */
+static int texcache_flip_level(GLenum format, unsigned char *data, int width, int height)
+{
+	if(format != GL_COMPRESSED_RGB_S3TC_DXT1_EXT && format != GL_COMPRESSED_RGBA_S3TC_DXT1_EXT &&
+	   format != GL_COMPRESSED_RGBA_S3TC_DXT3_EXT && format != GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)
+		return 0;
+	if(height > 4 && height % 4 != 0)
+		return 0;
+
+	size_t blockBytes = texcache_block_bytes(format);
+	size_t rowBytes = (size_t)((width+3)/4) * blockBytes;
+	int blocksY = (height+3)/4;
+	int rows = height < 4 ? height : 4;
+	unsigned char *tmp = kuhl_malloc(rowBytes);
+	for(int by=0; by<blocksY/2; by++)
+	{
+		unsigned char *a = data + by*rowBytes;
+		unsigned char *b = data + (blocksY-1-by)*rowBytes;
+		memcpy(tmp, a, rowBytes);
+		memcpy(a, b, rowBytes);
+		memcpy(b, tmp, rowBytes);
+	}
+	free(tmp);
+
+	for(size_t i=0; i<rowBytes*blocksY; i+=blockBytes)
+	{
+		unsigned char *block = data + i;
+		if(format == GL_COMPRESSED_RGBA_S3TC_DXT3_EXT)
+		{
+			/* 4 bits of alpha per pixel (2 bytes per row). */
+			for(int r=0; r<rows/2; r++)
+			{
+				unsigned char t[2];
+				memcpy(t, block + 2*r, 2);
+				memcpy(block + 2*r, block + 2*(rows-1-r), 2);
+				memcpy(block + 2*(rows-1-r), t, 2);
+			}
+			block += 8;
+		}
+		else if(format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)
+		{
+			texcache_flip_bc3_alpha(block, rows);
+			block += 8;
+		}
+		texcache_flip_bc1(block, rows);
+	}
+	return 1;
+}
+
+/** Reads a KTX file that contains a compressed 2D texture.
+ *
+ * @param filename The file to read.
+ *
+ * @param image Filled in with the texture. Free with texcache_free().
+ *
+ * @param source If not NULL, filled in with the value of the
+ * "kuhl.source" key (or an empty string).
+ *
+ * @param sourceLen The length of the source buffer.
+ *
+ * Files whose "KTXorientation" key doesn't say that rows go up
+ * ("T=u") are stored with the top row first and are flipped, or
+ * rejected if they can't be flipped. texcache files written before
+ * the key was added are rejected so that they are rebuilt.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+int texcache_read(const char *filename, texcache_image *image, char *source, size_t sourceLen)
+{
+	memset(image, 0, sizeof(texcache_image));
+	if(source && sourceLen > 0)
+		source[0] = '\0';
+
+	FILE *f = fopen(filename, "rb");
+	if(f == NULL)
+		return 0;
+	unsigned char identifier[12];
+	texcache_ktx_header header;
+	if(fread(identifier, 1, 12, f) != 12 ||
+	   fread(&header, sizeof(header), 1, f) != 1 ||
+	   memcmp(identifier, texcache_ktx_identifier, 12) != 0)
+	{
+		msg(ERROR, "%s is not a KTX file.\n", filename);
+		fclose(f);
+		return 0;
+	}
+	if(header.endianness != 0x04030201)
+	{
+		msg(ERROR, "%s was written on a computer with a different byte order.\n", filename);
+		fclose(f);
+		return 0;
+	}
+	if(header.glType != 0 || texcache_block_bytes(header.glInternalFormat) == 0 ||
+	   header.pixelDepth > 1 || header.numberOfArrayElements > 0 || header.numberOfFaces != 1 ||
+	   header.pixelWidth == 0 || header.pixelHeight == 0)
+	{
+		msg(ERROR, "%s does not contain a 2D texture in a supported compressed format (format=0x%x)\n", filename, header.glInternalFormat);
+		fclose(f);
+		return 0;
+	}
+	/* Don't trust the header to describe a texture that could be
+	 * uploaded (or that fits in the file). */
+	GLint maxTextureSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	if(maxTextureSize <= 0)
+		maxTextureSize = 16384; // no OpenGL context
+	if(header.pixelWidth > (uint32_t) maxTextureSize || header.pixelHeight > (uint32_t) maxTextureSize)
+	{
+		msg(ERROR, "%s contains a %ux%u texture but the largest texture allowed is %d\n", filename,
+		    header.pixelWidth, header.pixelHeight, maxTextureSize);
+		fclose(f);
+		return 0;
+	}
+
+	/* Look for the source and orientation keys in the key/value
+	 * data. */
+	int hasSource = 0, rowsUp = 0, hasOrientation = 0;
+	if(header.bytesOfKeyValueData > 0)
+	{
+		unsigned char *kv = kuhl_malloc(header.bytesOfKeyValueData);
+		if(fread(kv, 1, header.bytesOfKeyValueData, f) != header.bytesOfKeyValueData)
+		{
+			free(kv);
+			fclose(f);
+			return 0;
+		}
+		uint32_t pos = 0;
+		while(pos + 4 <= header.bytesOfKeyValueData)
+		{
+			uint32_t len;
+			memcpy(&len, kv+pos, 4);
+			pos += 4;
+			if(len > header.bytesOfKeyValueData - pos)
+				break;
+			const char *key = (const char*) kv+pos;
+			size_t keyLen = strnlen(key, len);
+			if(keyLen < len && strcmp(key, TEXCACHE_SOURCE_KEY) == 0)
+			{
+				hasSource = 1;
+				if(source)
+					snprintf(source, sourceLen, "%.*s", (int)(len-keyLen-1), key+keyLen+1);
+			}
+			if(keyLen < len && strcmp(key, TEXCACHE_ORIENTATION_KEY) == 0)
+			{
+				char value[32];
+				snprintf(value, sizeof(value), "%.*s", (int)(len-keyLen-1), key+keyLen+1);
+				hasOrientation = 1;
+				rowsUp = strstr(value, "T=u") != NULL;
+			}
+			pos += (len + 3) & ~3u;
+		}
+		free(kv);
+	}
+	if(hasSource && !hasOrientation)
+	{
+		msg(DEBUG, "Texture cache file %s was written by an older version of texcache.\n", filename);
+		fclose(f);
+		return 0;
+	}
+
+	image->format = header.glInternalFormat;
+	image->width = header.pixelWidth;
+	image->height = header.pixelHeight;
+	image->levels = header.numberOfMipmapLevels > 0 ? header.numberOfMipmapLevels : 1;
+	if(image->levels > TEXCACHE_MAX_LEVELS)
+		image->levels = TEXCACHE_MAX_LEVELS;
+
+	size_t total = 0;
+	int w = image->width, h = image->height;
+	for(int i=0; i<image->levels; i++)
+	{
+		image->offset[i] = total;
+		image->size[i] = texcache_level_size(image->format, w, h);
+		total += image->size[i];
+		w = w > 1 ? w/2 : 1;
+		h = h > 1 ? h/2 : 1;
+	}
+	struct stat st;
+	long pos = ftell(f);
+	if(fstat(fileno(f), &st) != 0 || pos < 0 || total > (size_t) (st.st_size - pos))
+	{
+		msg(ERROR, "%s is truncated or its header is corrupted (%zu bytes of mipmap levels expected)\n", filename, total);
+		fclose(f);
+		return 0;
+	}
+	image->data = kuhl_malloc(total);
+	for(int i=0; i<image->levels; i++)
+	{
+		uint32_t imageSize;
+		if(fread(&imageSize, 4, 1, f) != 1 || imageSize != image->size[i] ||
+		   fread(image->data + image->offset[i], 1, imageSize, f) != imageSize)
+		{
+			msg(ERROR, "%s is truncated or has an unexpected size for mipmap level %d\n", filename, i);
+			texcache_free(image);
+			fclose(f);
+			return 0;
+		}
+		/* Each level is padded to a multiple of 4 bytes. */
+		if(imageSize % 4 != 0)
+			fseek(f, 4 - imageSize % 4, SEEK_CUR);
+	}
+	fclose(f);
+
+	w = image->width;
+	h = image->height;
+	for(int i=0; !rowsUp && i<image->levels; i++)
+	{
+		if(!texcache_flip_level(image->format, image->data + image->offset[i], w, h))
+		{
+			msg(ERROR, "%s stores the top row first (KTXorientation is missing or isn't \"T=u\") and mipmap level %d (%dx%d, format=0x%x) can't be flipped. Write the file with the bottom row first.\n",
+			    filename, i, w, h, image->format);
+			texcache_free(image);
+			return 0;
+		}
+		w = w > 1 ? w/2 : 1;
+		h = h > 1 ? h/2 : 1;
+	}
+	return 1;
+}
+
+/** Writes a compressed texture to a KTX file. The file is written to
+ * a temporary file and renamed so that other processes (for example,
+ * DGR slaves loading the same image) never see a partially written
+ * file.
+ *
+ * @param filename The file to write.
+ *
+ * @param image The texture.
+ *
+ * @param source A string to store in the "kuhl.source" key (can be NULL).
+ *
+ * @return 1 on success, 0 on failure.
+ */
+int texcache_write(const char *filename, const texcache_image *image, const char *source)
+{
+	char tmpFile[2100];
+	snprintf(tmpFile, 2100, "%s.%d.tmp", filename, (int) getpid());
+	FILE *f = fopen(tmpFile, "wb");
+	if(f == NULL)
+	{
+		msg(DEBUG, "Unable to write texture cache file %s\n", tmpFile);
+		return 0;
+	}
+
+	/* Each key/value pair is: the length of the key and value, the
+	 * key, a null, the value, a null and padding. */
+	const char *keys[2] = { TEXCACHE_ORIENTATION_KEY, TEXCACHE_SOURCE_KEY };
+	const char *values[2] = { TEXCACHE_ORIENTATION, source };
+	int pairs = source ? 2 : 1;
+	uint32_t kvLen[2], kvSize = 0;
+	for(int i=0; i<pairs; i++)
+	{
+		kvLen[i] = strlen(keys[i]) + 1 + strlen(values[i]) + 1;
+		kvSize += 4 + ((kvLen[i] + 3) & ~3u);
+	}
+
+	texcache_ktx_header header;
+	memset(&header, 0, sizeof(header));
+	header.endianness = 0x04030201;
+	header.glTypeSize = 1;
+	header.glInternalFormat = image->format;
+	header.glBaseInternalFormat = image->format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? GL_RGB : GL_RGBA;
+	header.pixelWidth = image->width;
+	header.pixelHeight = image->height;
+	header.numberOfFaces = 1;
+	header.numberOfMipmapLevels = image->levels;
+	header.bytesOfKeyValueData = kvSize;
+
+	int ok = fwrite(texcache_ktx_identifier, 12, 1, f) == 1 &&
+	         fwrite(&header, sizeof(header), 1, f) == 1;
+	for(int i=0; ok && i<pairs; i++)
+	{
+		const char zeros[4] = { 0, 0, 0, 0 };
+		uint32_t padding = ((kvLen[i] + 3) & ~3u) - kvLen[i];
+		ok = fwrite(&kvLen[i], 4, 1, f) == 1 &&
+		     fwrite(keys[i], strlen(keys[i])+1, 1, f) == 1 &&
+		     fwrite(values[i], strlen(values[i])+1, 1, f) == 1 &&
+		     (padding == 0 || fwrite(zeros, padding, 1, f) == 1);
+	}
+	for(int i=0; ok && i<image->levels; i++)
+	{
+		uint32_t imageSize = image->size[i];
+		ok = fwrite(&imageSize, 4, 1, f) == 1 &&
+		     fwrite(image->data + image->offset[i], 1, imageSize, f) == imageSize;
+	}
+
+	if(fclose(f) != 0)
+		ok = 0;
+	if(!ok || rename(tmpFile, filename) != 0)
+	{
+		msg(WARNING, "Failed to write texture cache file %s\n", filename);
+		unlink(tmpFile);
+		return 0;
+	}
+	return 1;
+}
+
+/** Uploads a compressed texture and its mipmap levels.
+ *
+ * @param image The texture.
+ *
+ * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+ *
+ * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+ *
+ * @return The texture, or 0 if OpenGL didn't accept it.
+ */
+GLuint texcache_upload(const texcache_image *image, GLuint wrapS, GLuint wrapT)
+{
+	TRACE_SCOPE("texcache_upload");
+	if(!texcache_format_supported(image->format))
+	{
+		msg(ERROR, "Your graphics card doesn't support compressed texture format 0x%x\n", image->format);
+		return 0;
+	}
+
+	kuhl_errorcheck();
+	GLuint texName = 0;
+	glGenTextures(1, &texName);
+	glBindTexture(GL_TEXTURE_2D, texName);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapS);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, image->levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, image->levels-1);
+
+	/* See kuhl_read_texture_rgba_array_wrap() */
+	if(glewIsSupported("GL_EXT_texture_filter_anisotropic"))
+	{
+		float maxAniso;
+		glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAniso);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, maxAniso);
+	}
+
+	int w = image->width, h = image->height;
+	for(int i=0; i<image->levels; i++)
+	{
+		glCompressedTexImage2D(GL_TEXTURE_2D, i, image->format, w, h, 0,
+		                       (GLsizei) image->size[i], image->data + image->offset[i]);
+		w = w > 1 ? w/2 : 1;
+		h = h > 1 ? h/2 : 1;
+	}
+
+	GLenum err = glGetError();
+	glBindTexture(GL_TEXTURE_2D, 0);
+	if(err != GL_NO_ERROR)
+	{
+		msg(ERROR, "OpenGL rejected a %dx%d compressed texture (error 0x%x)\n", image->width, image->height, err);
+		glDeleteTextures(1, &texName);
+		return 0;
+	}
+	return texName;
+}
+
+
+/* ====== Cache ====== */
+
+/** Determines the name of a cache file for an image.
+ *
+ * @param result A buffer to write the name into.
+ * @param len The length of the result buffer.
+ * @param sourceFilename The image file.
+ * @param extension The extension of the cache file (e.g., ".ktx").
+ */
+void texcache_filename(char *result, size_t len, const char *sourceFilename, const char *extension)
+{
+	const char *dir = getenv("KUHL_TEXTURE_CACHE_DIR");
+	if(dir == NULL || strlen(dir) == 0)
+	{
+		snprintf(result, len, "%s%s", sourceFilename, extension);
+		return;
+	}
+
+	/* Flatten the image path into a single filename. */
+	char flat[1024];
+	snprintf(flat, 1024, "%s", sourceFilename);
+	for(char *c = flat; *c != '\0'; c++)
+		if(*c == '/')
+			*c = '_';
+	snprintf(result, len, "%s/%s%s", dir, flat, extension);
+}
+
+/** Describes the image file as it currently exists on disk so that
+ * stale cache files can be detected.
+ *
+ * @param result A buffer to write the description into.
+ * @param len The length of the result buffer.
+ * @param sourceFilename The image file.
+ *
+ * @return 1 on success, 0 if the image file can't be stat()'d.
+ */
+int texcache_source_id(char *result, size_t len, const char *sourceFilename)
+{
+	struct stat st;
+	if(stat(sourceFilename, &st) != 0)
+		return 0;
+	snprintf(result, len, "%lld %lld", (long long) st.st_size, (long long) st.st_mtime);
+	return 1;
+}
+
+/** Loads a KTX file into a texture.
+ *
+ * @param filename The KTX file.
+ *
+ * @param texName Set to the texture.
+ *
+ * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+ *
+ * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+ *
+ * @return The aspect ratio of the texture, or a negative number on
+ * error.
+ */
+float texcache_read_texture(const char *filename, GLuint *texName, GLuint wrapS, GLuint wrapT)
+{
+	TRACE_SCOPE("texcache_read_texture");
+	*texName = 0;
+	char *newFilename = kuhl_find_file(filename);
+	texcache_image image;
+	int ok = texcache_read(newFilename, &image, NULL, 0);
+	free(newFilename);
+	if(!ok)
+	{
+		msg(ERROR, "Unable to read '%s'.\n", filename);
+		return -1;
+	}
+	*texName = texcache_upload(&image, wrapS, wrapT);
+	float aspectRatio = (float)image.width/image.height;
+	msg(DEBUG, "Finished reading '%s' (%dx%d, %d levels)\n", filename, image.width, image.height, image.levels);
+	texcache_free(&image);
+	if(*texName == 0)
+		return -1;
+	return aspectRatio;
+}
+
+/** Loads the cached, compressed version of an image if it exists and
+ * is up to date.
+ *
+ * @param sourceFilename The image file.
+ *
+ * @param texName Set to the texture.
+ *
+ * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+ *
+ * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+ *
+ * @return The aspect ratio of the texture, or a negative number if
+ * there is no usable cache file.
+ */
+float texcache_load(const char *sourceFilename, GLuint *texName, GLuint wrapS, GLuint wrapT)
+{
+	*texName = 0;
+	char *fullpath = kuhl_find_file(sourceFilename);
+	char id[256], cacheFile[2048];
+	if(!texcache_source_id(id, 256, fullpath))
+	{
+		free(fullpath);
+		return -1;
+	}
+	texcache_filename(cacheFile, 2048, fullpath, ".ktx");
+	free(fullpath);
+	if(!kuhl_can_read_file(cacheFile))
+		return -1;
+
+	TRACE_SCOPE("texcache_load");
+	texcache_image image;
+	char source[256];
+	if(!texcache_read(cacheFile, &image, source, 256))
+		return -1;
+	if(strcmp(source, id) != 0)
+	{
+		msg(DEBUG, "Texture cache file %s is out of date.\n", cacheFile);
+		texcache_free(&image);
+		return -1;
+	}
+	*texName = texcache_upload(&image, wrapS, wrapT);
+	float aspectRatio = (float)image.width/image.height;
+	texcache_free(&image);
+	if(*texName == 0)
+		return -1;
+	msg(DEBUG, "Loaded '%s' from texture cache %s\n", sourceFilename, cacheFile);
+	return aspectRatio;
+}
+
+/** Compresses an image that was read from a file, writes it to the
+ * cache and uploads it.
+ *
+ * @param sourceFilename The file that the image was read from.
+ *
+ * @param rgba The image (4 bytes per pixel, bottom row first).
+ *
+ * @param width The width of the image.
+ *
+ * @param height The height of the image.
+ *
+ * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+ *
+ * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+ *
+ * @return The texture, or 0 if the image couldn't be compressed or
+ * uploaded (the caller should upload it uncompressed instead).
+ */
+GLuint texcache_store(const char *sourceFilename, const unsigned char *rgba, int width, int height, GLuint wrapS, GLuint wrapT)
+{
+	texcache_image image;
+	if(!texcache_compress(rgba, width, height, &image))
+		return 0;
+
+	char id[256], cacheFile[2048];
+	if(texcache_source_id(id, 256, sourceFilename))
+	{
+		texcache_filename(cacheFile, 2048, sourceFilename, ".ktx");
+		if(texcache_write(cacheFile, &image, id))
+			msg(INFO, "Wrote texture cache %s\n", cacheFile);
+	}
+
+	GLuint texName = texcache_upload(&image, wrapS, wrapT);
+	texcache_free(&image);
+	return texName;
+}
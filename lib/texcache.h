@@ -0,0 +1,85 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    texcache stores textures in a GPU-compressed format with all of
+    their mipmap levels so that they use less texture memory and can
+    be uploaded with glCompressedTexImage2D() without decoding the
+    original image or generating mipmaps again.
+    kuhl_read_texture_file_wrap() uses this module automatically.
+
+    Compressed textures are stored in KTX (version 1) files. Any
+    ".ktx" file passed to kuhl_read_texture_file() is uploaded
+    directly if it contains a compressed format that the graphics
+    card supports (S3TC/BC1-BC3, BPTC/BC7 or ETC2). The data is
+    passed to OpenGL as-is, so files should store the bottom row
+    first and say so with the KTXorientation key "S=r,T=u" (for
+    example, "toktx --lower_left_maps_to_s0t0"). Most tools store the
+    top row first ("T=d", which is also assumed when the key is
+    missing); those files are flipped when they are read if they are
+    BC1-BC3 and every mipmap level is either less than 4 pixels tall
+    or a multiple of 4 pixels tall, and are rejected otherwise.
+
+    When KUHL_TEXTURE_COMPRESS is set, the first time an image is
+    loaded it is compressed (BC1 if it is opaque, BC3 otherwise) along
+    with a full mipmap chain and written next to the image (i.e.,
+    "image.png.ktx"). Later loads use the KTX file as long as the
+    image's size and modification time haven't changed.
+
+    The following environment variables change the behavior of the
+    cache:
+
+    KUHL_TEXTURE_COMPRESS="1" - Compress images and cache the results.<br>
+    KUHL_TEXTURE_CACHE_DIR="/tmp/cache" - Store cache files in this
+    directory instead of next to the images.
+
+    @author Scott Kuhl
+ */
+
+#ifndef __TEXCACHE_H__
+#define __TEXCACHE_H__
+
+#include <stddef.h>
+#include <GL/glew.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TEXCACHE_MAX_LEVELS 32 /**< Most mipmap levels in a texcache_image */
+
+/** A compressed texture and its mipmap levels. */
+typedef struct
+{
+	GLenum format; /**< Compressed internal format (e.g., GL_COMPRESSED_RGBA_S3TC_DXT5_EXT) */
+	int width, height; /**< Size of level 0 in pixels */
+	int levels; /**< Number of mipmap levels */
+	unsigned char *data; /**< All of the levels */
+	size_t offset[TEXCACHE_MAX_LEVELS]; /**< Offset of each level in data */
+	size_t size[TEXCACHE_MAX_LEVELS]; /**< Size of each level in bytes */
+} texcache_image;
+
+int texcache_enabled(void);
+int texcache_is_ktx(const char *filename);
+int texcache_compress(const unsigned char *rgba, int width, int height, texcache_image *image);
+void texcache_compress_blocks(const unsigned char *rgba, int width, int height, int alpha, unsigned char *out);
+unsigned char* texcache_downsample(const unsigned char *rgba, int width, int height, int *newWidth, int *newHeight);
+size_t texcache_level_size(GLenum format, int width, int height);
+void texcache_filename(char *result, size_t len, const char *sourceFilename, const char *extension);
+int texcache_source_id(char *result, size_t len, const char *sourceFilename);
+int texcache_read(const char *filename, texcache_image *image, char *source, size_t sourceLen);
+int texcache_write(const char *filename, const texcache_image *image, const char *source);
+GLuint texcache_upload(const texcache_image *image, GLuint wrapS, GLuint wrapT);
+void texcache_free(texcache_image *image);
+
+float texcache_read_texture(const char *filename, GLuint *texName, GLuint wrapS, GLuint wrapT);
+float texcache_load(const char *sourceFilename, GLuint *texName, GLuint wrapS, GLuint wrapT);
+GLuint texcache_store(const char *sourceFilename, const unsigned char *rgba, int width, int height, GLuint wrapS, GLuint wrapT);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+#endif // __TEXCACHE_H__
@@ -0,0 +1,806 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ *
+ * Decodes image files on background threads and uploads them into
+ * textures a few rows at a time. See texstream.h for details.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // sysconf()
+#include <pthread.h>
+
+#include <GL/glew.h>
+
+#include "texstream.h"
+#include "kuhl-util.h"
+#include "kuhl-nodep.h"
+#include "msg.h"
+#include "trace.h"
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+#include "imageio.h"
+#else
+#include "stb_image.h"
+#endif
+
+#define TEXSTREAM_CHUNKS 4 /**< Number of chunks in the staging buffer */
+#define TEXSTREAM_CHUNK_SIZE (1024*1024) /**< Bytes in each chunk of the staging buffer (also the most bytes uploaded by one glTexSubImage2D() call) */
+#define TEXSTREAM_MAX_THREADS 4 /**< Default maximum number of decoding threads */
+#define TEXSTREAM_DEFAULT_BUDGET 2000 /**< Default microseconds that texstream_update_frame() spends uploading */
+
+/** The states that a request moves through. */
+enum
+{
+	TEXSTREAM_QUEUED,   /**< Waiting for a decoding thread */
+	TEXSTREAM_DECODING, /**< Being decoded by a thread */
+	TEXSTREAM_DECODED,  /**< Decoded, waiting for texstream_update() */
+	TEXSTREAM_UPLOADING,/**< Some rows have been uploaded */
+	TEXSTREAM_ERROR     /**< Decoding or uploading failed */
+};
+
+/** An image that is being loaded into a texture. */
+typedef struct texstream_request
+{
+	GLuint texture; /**< The texture returned to the caller (also the first tile) */
+	texstream_tiles *tiles; /**< The textures that the image is uploaded into */
+	texstream_tiles single; /**< Used as the tiles for requests from texstream_load() */
+	int maxTileSize; /**< Largest tile width or height, 0 to load the image into a single texture */
+	char *filename; /**< Full path to the image file */
+	GLuint wrapS, wrapT;
+	texstream_callback callback;
+	void *data; /**< Passed to the callback */
+	int state;
+	int canceled; /**< texstream_cancel() was called while the image was being decoded */
+	int reported; /**< 1 if the callback has been called for a failed request */
+	unsigned char *pixels; /**< RGBA pixels, bottom row first */
+	int width, height;
+	int tile; /**< Tile being uploaded */
+	int row; /**< Next row of the tile to upload */
+	struct texstream_request *next;
+} texstream_request;
+
+static texstream_request *texstream_head = NULL, *texstream_tail = NULL;
+static int texstream_pending = 0; /**< Number of requests that are queued or being decoded */
+static int texstream_threads = 0; /**< Number of threads started */
+static pthread_mutex_t texstream_mutex = PTHREAD_MUTEX_INITIALIZER; /**< Protects the request list and the request states */
+static pthread_cond_t texstream_work_cond = PTHREAD_COND_INITIALIZER; /**< Signaled when a request is queued */
+static pthread_cond_t texstream_done_cond = PTHREAD_COND_INITIALIZER; /**< Signaled when a request is decoded */
+
+/** The persistently mapped pixel unpack buffer that rows are copied
+ * through. */
+static GLuint texstream_pbo = 0;
+static unsigned char *texstream_mapped = NULL;
+static GLsync texstream_fences[TEXSTREAM_CHUNKS]; /**< Signaled when OpenGL has finished reading a chunk */
+static int texstream_next_chunk = 0;
+static int texstream_pbo_failed = 0; /**< 1 if the staging buffer couldn't be created */
+
+
+/** Reads an image file into RGBA pixels with the bottom row first.
+ *
+ * @return The pixels (free() them) or NULL on failure.
+ */
+static unsigned char* texstream_decode(const char *filename, int *width, int *height)
+{
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	imageio_info iioinfo;
+	iioinfo.filename   = (char*) filename;
+	iioinfo.type       = CharPixel;
+	iioinfo.map        = (char*) "RGBA";
+	iioinfo.colorspace = sRGBColorspace;
+	unsigned char *image = (unsigned char*) imagein(&iioinfo);
+	if(iioinfo.comment)
+		free(iioinfo.comment);
+	*width  = (int)iioinfo.width;
+	*height = (int)iioinfo.height;
+	return image;
+#else
+	/* stbi_set_flip_vertically_on_load() was called before the
+	 * threads were started. */
+	int comp = -1;
+	return (unsigned char*) stbi_load(filename, width, height, &comp, STBI_rgb_alpha);
+#endif
+}
+
+/** Decodes queued requests until the program exits. */
+static void* texstream_worker(void *arg)
+{
+	pthread_mutex_lock(&texstream_mutex);
+	for(;;)
+	{
+		texstream_request *req = NULL;
+		while(req == NULL)
+		{
+			for(req = texstream_head; req != NULL; req = req->next)
+				if(req->state == TEXSTREAM_QUEUED)
+					break;
+			if(req == NULL)
+				pthread_cond_wait(&texstream_work_cond, &texstream_mutex);
+		}
+		req->state = TEXSTREAM_DECODING;
+		int canceled = req->canceled;
+		pthread_mutex_unlock(&texstream_mutex);
+
+		unsigned char *pixels = NULL;
+		int width = 0, height = 0;
+		if(!canceled)
+		{
+			TRACE_BEGIN("texstream_decode");
+			pixels = texstream_decode(req->filename, &width, &height);
+			TRACE_END();
+			if(pixels == NULL)
+				msg(ERROR, "Unable to read '%s'.\n", req->filename);
+			else
+				msg(DEBUG, "Finished reading '%s' (%dx%d)\n", req->filename, width, height);
+		}
+
+		pthread_mutex_lock(&texstream_mutex);
+		req->pixels = pixels;
+		req->width = width;
+		req->height = height;
+		req->state = pixels ? TEXSTREAM_DECODED : TEXSTREAM_ERROR;
+		texstream_pending--;
+		pthread_cond_broadcast(&texstream_done_cond);
+	}
+	return NULL;
+}
+
+/** Starts the decoding threads the first time they are needed. Must
+ * be called with texstream_mutex locked. */
+static void texstream_start_threads(void)
+{
+	if(texstream_threads > 0)
+		return;
+
+	int count = (int) sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if(count > TEXSTREAM_MAX_THREADS)
+		count = TEXSTREAM_MAX_THREADS;
+	const char *str = getenv("KUHL_TEXSTREAM_THREADS");
+	if(str != NULL && strlen(str) > 0)
+		count = atoi(str);
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	/* imageio isn't known to be safe to use from several threads. */
+	count = 1;
+#else
+	/* This setting is shared by all threads, so it must be set before
+	 * any of them call stbi_load(). */
+	stbi_set_flip_vertically_on_load(1);
+#endif
+	if(count < 1)
+		count = 1;
+
+	for(int i=0; i<count; i++)
+	{
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, texstream_worker, NULL) != 0)
+		{
+			msg(ERROR, "Failed to create texture decoding thread.\n");
+			break;
+		}
+		pthread_detach(thread);
+		texstream_threads++;
+	}
+	if(texstream_threads == 0)
+	{
+		msg(FATAL, "Unable to create any texture decoding threads.\n");
+		exit(EXIT_FAILURE);
+	}
+	msg(DEBUG, "Decoding textures with %d threads.\n", texstream_threads);
+}
+
+/** Removes a request from the list and frees it. Must be called with
+ * texstream_mutex locked. */
+static void texstream_remove(texstream_request *req)
+{
+	texstream_request *prev = NULL;
+	for(texstream_request *r = texstream_head; r != NULL; r = r->next)
+	{
+		if(r == req)
+		{
+			if(prev == NULL)
+				texstream_head = r->next;
+			else
+				prev->next = r->next;
+			if(texstream_tail == r)
+				texstream_tail = prev;
+			break;
+		}
+		prev = r;
+	}
+	free(req->pixels);
+	free(req->filename);
+	free(req);
+}
+
+/** Finds the request for a texture. Canceled requests are skipped
+ * because the texture name might have been reused by a new request.
+ * Must be called with texstream_mutex locked. */
+static texstream_request* texstream_find(GLuint texture)
+{
+	for(texstream_request *r = texstream_head; r != NULL; r = r->next)
+		if(r->texture == texture && !r->canceled)
+			return r;
+	return NULL;
+}
+
+/** Checks if rows can be uploaded through a persistently mapped
+ * buffer. */
+static int texstream_pbo_supported(void)
+{
+	return !texstream_pbo_failed && (GLEW_VERSION_4_4 || (GLEW_ARB_buffer_storage && GLEW_VERSION_3_2));
+}
+
+/** Creates and maps the staging buffer.
+ *
+ * @return 1 if the buffer is available, 0 otherwise.
+ */
+static int texstream_pbo_init(void)
+{
+	if(texstream_mapped != NULL)
+		return 1;
+	if(!texstream_pbo_supported())
+		return 0;
+
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(1, &texstream_pbo);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, texstream_pbo);
+	glBufferStorage(GL_PIXEL_UNPACK_BUFFER, TEXSTREAM_CHUNKS*TEXSTREAM_CHUNK_SIZE, NULL, flags);
+	texstream_mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, TEXSTREAM_CHUNKS*TEXSTREAM_CHUNK_SIZE, flags);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	kuhl_errorcheck();
+	if(texstream_mapped == NULL)
+	{
+		msg(WARNING, "Failed to map texture staging buffer, uploading textures without it.\n");
+		glDeleteBuffers(1, &texstream_pbo);
+		texstream_pbo = 0;
+		texstream_pbo_failed = 1;
+		return 0;
+	}
+	for(int i=0; i<TEXSTREAM_CHUNKS; i++)
+		texstream_fences[i] = 0;
+	return 1;
+}
+
+/** Gets the size of a tile. Tiles in the last column and row
+ * contain the rest of the image and may be smaller than the others. */
+static void texstream_tile_size(const texstream_tiles *tiles, int tile, int *x, int *y, int *width, int *height)
+{
+	*x = (tile % tiles->columns) * tiles->tile_width;
+	*y = (tile / tiles->columns) * tiles->tile_height;
+	*width = tiles->width - *x;
+	if(*width > tiles->tile_width)
+		*width = tiles->tile_width;
+	*height = tiles->height - *y;
+	if(*height > tiles->tile_height)
+		*height = tiles->tile_height;
+}
+
+/** Splits a decoded request into tiles and allocates the full-size
+ * textures.
+ *
+ * @return 1 on success, 0 if OpenGL won't accept textures of that
+ * size.
+ */
+static int texstream_begin_upload(texstream_request *req)
+{
+	int columns = 1, rows = 1;
+	if(req->maxTileSize > 0)
+	{
+		GLint maxSize = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+		if(maxSize <= 0 || maxSize > req->maxTileSize)
+			maxSize = req->maxTileSize;
+		columns = (req->width  + maxSize-1) / maxSize;
+		rows    = (req->height + maxSize-1) / maxSize;
+	}
+	int tileWidth  = (req->width  + columns-1) / columns;
+	int tileHeight = (req->height + rows-1) / rows;
+
+	glTexImage2D(GL_PROXY_TEXTURE_2D, 0, GL_RGBA8, tileWidth, tileHeight,
+	             0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	int tmp;
+	glGetTexLevelParameteriv(GL_PROXY_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &tmp);
+	if(tmp == 0)
+	{
+		msg(ERROR, "Unable to load %dx%d texture from %s (possibily because it is too large)\n", tileWidth, tileHeight, req->filename);
+		return 0;
+	}
+
+	texstream_tiles *tiles = req->tiles;
+	int count = columns*rows;
+	if(count > 1)
+	{
+		/* The placeholder becomes the first tile. */
+		GLuint *textures = kuhl_malloc(sizeof(GLuint)*count);
+		textures[0] = req->texture;
+		glGenTextures(count-1, textures+1);
+		free(tiles->textures);
+		tiles->textures = textures;
+	}
+	tiles->columns = columns;
+	tiles->rows = rows;
+	tiles->width = req->width;
+	tiles->height = req->height;
+	tiles->tile_width = tileWidth;
+	tiles->tile_height = tileHeight;
+
+	for(int i=0; i<count; i++)
+	{
+		int x, y, width, height;
+		texstream_tile_size(tiles, i, &x, &y, &width, &height);
+		glBindTexture(GL_TEXTURE_2D, tiles->textures[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, req->wrapS);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, req->wrapT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height,
+		             0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	}
+	kuhl_errorcheck();
+	req->tile = 0;
+	req->row = 0;
+	return 1;
+}
+
+/** Uploads the next rows of the tile that is being uploaded.
+ *
+ * @param wait 1 to wait for a chunk of the staging buffer if OpenGL
+ * is still reading all of them.
+ *
+ * @return 1 if rows were uploaded, 0 if no chunk was available.
+ */
+static int texstream_upload_rows(texstream_request *req, int wait)
+{
+	int x, y, width, height;
+	texstream_tile_size(req->tiles, req->tile, &x, &y, &width, &height);
+	int rowBytes = width * 4;
+	int rows = TEXSTREAM_CHUNK_SIZE / rowBytes;
+	if(rows < 1)
+		rows = 1;
+	if(rows > height - req->row)
+		rows = height - req->row;
+	size_t stride = (size_t) req->width * 4;
+	const unsigned char *src = req->pixels + (size_t)(y + req->row) * stride + (size_t) x * 4;
+
+	glBindTexture(GL_TEXTURE_2D, req->tiles->textures[req->tile]);
+	if(rowBytes <= TEXSTREAM_CHUNK_SIZE && texstream_pbo_init())
+	{
+		int chunk = texstream_next_chunk;
+		if(texstream_fences[chunk] != 0)
+		{
+			GLenum result = glClientWaitSync(texstream_fences[chunk], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+			if(result == GL_TIMEOUT_EXPIRED)
+			{
+				if(!wait)
+					return 0;
+				TRACE_SCOPE("texstream_wait");
+				while(result == GL_TIMEOUT_EXPIRED)
+					result = glClientWaitSync(texstream_fences[chunk], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+			}
+			glDeleteSync(texstream_fences[chunk]);
+			texstream_fences[chunk] = 0;
+		}
+
+		/* Pack the rows of the tile together in the chunk. */
+		size_t offset = (size_t) chunk * TEXSTREAM_CHUNK_SIZE;
+		for(int i=0; i<rows; i++)
+			memcpy(texstream_mapped + offset + (size_t) i * rowBytes, src + i * stride, rowBytes);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, texstream_pbo);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, req->row, width, rows,
+		                GL_RGBA, GL_UNSIGNED_BYTE, (const GLvoid*) offset);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		texstream_fences[chunk] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		texstream_next_chunk = (chunk+1) % TEXSTREAM_CHUNKS;
+	}
+	else
+	{
+		/* Let OpenGL skip the parts of the rows that belong to other
+		 * tiles. */
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, req->width);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, req->row, width, rows,
+		                GL_RGBA, GL_UNSIGNED_BYTE, src);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	}
+	kuhl_errorcheck();
+	req->row += rows;
+	return 1;
+}
+
+/** Generates mipmaps for a tile whose rows have all been
+ * uploaded. */
+static void texstream_end_tile(texstream_request *req)
+{
+	glBindTexture(GL_TEXTURE_2D, req->tiles->textures[req->tile]);
+	if(glGenerateMipmap != NULL)
+	{
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	}
+
+	/* See kuhl_read_texture_rgba_array_wrap() */
+	if(glewIsSupported("GL_EXT_texture_filter_anisotropic"))
+	{
+		float maxAniso;
+		glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAniso);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, maxAniso);
+	}
+	kuhl_errorcheck();
+}
+
+/** Makes progress on the first request that has been decoded or has
+ * failed.
+ *
+ * @param wait 1 to wait for the staging buffer instead of returning.
+ *
+ * @return 1 if there may be more work to do, 0 if there is nothing
+ * left that can be done without waiting.
+ */
+static int texstream_step(int wait)
+{
+	pthread_mutex_lock(&texstream_mutex);
+	texstream_request *req;
+	for(req = texstream_head; req != NULL; req = req->next)
+	{
+		if(req->canceled && req->state != TEXSTREAM_DECODING)
+			break;
+		if(req->state == TEXSTREAM_DECODED || req->state == TEXSTREAM_UPLOADING ||
+		   (req->state == TEXSTREAM_ERROR && !req->reported))
+			break;
+	}
+	if(req != NULL && req->canceled)
+	{
+		texstream_remove(req);
+		pthread_mutex_unlock(&texstream_mutex);
+		return 1;
+	}
+	/* Only this thread changes the state of a decoded request, so the
+	 * upload can happen without holding the lock. */
+	pthread_mutex_unlock(&texstream_mutex);
+	if(req == NULL)
+		return 0;
+
+	if(req->state == TEXSTREAM_DECODED)
+	{
+		if(!texstream_begin_upload(req))
+		{
+			free(req->pixels);
+			req->pixels = NULL;
+			req->state = TEXSTREAM_ERROR;
+			return 1;
+		}
+		req->state = TEXSTREAM_UPLOADING;
+	}
+
+	if(req->state == TEXSTREAM_UPLOADING)
+	{
+		if(!texstream_upload_rows(req, wait))
+			return 0;
+		int x, y, width, height;
+		texstream_tile_size(req->tiles, req->tile, &x, &y, &width, &height);
+		if(req->row < height)
+			return 1;
+		texstream_end_tile(req);
+		req->tile++;
+		req->row = 0;
+		if(req->tile < req->tiles->columns * req->tiles->rows)
+			return 1;
+
+		float aspectRatio = (float)req->width/req->height;
+		texstream_callback callback = req->callback;
+		void *data = req->data;
+		GLuint texture = req->texture;
+		msg(DEBUG, "Finished uploading '%s' (%dx%d, %d tiles)\n", req->filename, req->width, req->height, req->tiles->columns*req->tiles->rows);
+		/* Finished requests are forgotten; texstream_status() reports
+		 * textures it doesn't know about as ready. */
+		pthread_mutex_lock(&texstream_mutex);
+		texstream_remove(req);
+		pthread_mutex_unlock(&texstream_mutex);
+		if(callback)
+			callback(texture, aspectRatio, data);
+		return 1;
+	}
+
+	/* The request failed. Keep it so that texstream_status() can
+	 * report the failure. */
+	req->reported = 1;
+	if(req->callback)
+		req->callback(req->texture, -1, req->data);
+	return 1;
+}
+
+/** Runs texstream_step() until the budget is used up. Saves and
+ * restores the texture binding. */
+static int texstream_run(long budget, int wait)
+{
+	if(texstream_head == NULL)
+		return 0;
+
+	GLint boundTexture = 0;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &boundTexture);
+	long start = kuhl_microseconds();
+	int steps = 0;
+	while(texstream_step(wait))
+	{
+		steps++;
+		if(budget >= 0 && kuhl_microseconds() - start >= budget)
+			break;
+	}
+	glBindTexture(GL_TEXTURE_2D, boundTexture);
+	kuhl_errorcheck();
+	return steps;
+}
+
+/** Creates the placeholder texture and the request for an image
+ * file. The request isn't queued.
+ *
+ * @return The request, or NULL if the file can't be found.
+ */
+static texstream_request* texstream_new_request(const char *filename, GLuint wrapS, GLuint wrapT, texstream_callback callback, void *data)
+{
+	if(!GLEW_VERSION_2_0)
+	{
+		msg(ERROR, "Streaming textures requires OpenGL 2.0.\n");
+		return NULL;
+	}
+	char *fullpath = kuhl_find_file(filename);
+	if(!kuhl_can_read_file(fullpath))
+	{
+		msg(ERROR, "Unable to find '%s'.\n", filename);
+		free(fullpath);
+		return NULL;
+	}
+
+	const unsigned char gray[4] = { 128, 128, 128, 255 };
+	GLint boundTexture = 0;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &boundTexture);
+	GLuint texture = 0;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapS);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, gray);
+	glBindTexture(GL_TEXTURE_2D, boundTexture);
+	kuhl_errorcheck();
+
+	texstream_request *req = kuhl_malloc(sizeof(texstream_request));
+	memset(req, 0, sizeof(texstream_request));
+	req->texture = texture;
+	req->filename = fullpath;
+	req->wrapS = wrapS;
+	req->wrapT = wrapT;
+	req->callback = callback;
+	req->data = data;
+	req->state = TEXSTREAM_QUEUED;
+	return req;
+}
+
+/** Adds a request to the end of the list and wakes up a decoding
+ * thread. */
+static void texstream_enqueue(texstream_request *req)
+{
+	pthread_mutex_lock(&texstream_mutex);
+	texstream_start_threads();
+	if(texstream_tail == NULL)
+		texstream_head = req;
+	else
+		texstream_tail->next = req;
+	texstream_tail = req;
+	texstream_pending++;
+	pthread_cond_signal(&texstream_work_cond);
+	pthread_mutex_unlock(&texstream_mutex);
+}
+
+/** Starts loading an image file into a texture. The texture that is
+ * returned contains a single gray pixel until the image has been
+ * decoded and uploaded by texstream_update().
+ *
+ * @param filename The image file to load.
+ *
+ * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+ *
+ * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+ *
+ * @param callback Function to call when the texture is ready or when
+ * loading fails (can be NULL).
+ *
+ * @param data Pointer passed to the callback.
+ *
+ * @return The texture, or 0 if the file can't be found. Call
+ * texstream_cancel() before deleting the texture.
+ */
+GLuint texstream_load(const char *filename, GLuint wrapS, GLuint wrapT, texstream_callback callback, void *data)
+{
+	TRACE_SCOPE("texstream_load");
+	texstream_request *req = texstream_new_request(filename, wrapS, wrapT, callback, data);
+	if(req == NULL)
+		return 0;
+	req->tiles = &(req->single);
+	req->single.textures = &(req->texture);
+	req->single.columns = req->single.rows = 1;
+	texstream_enqueue(req);
+	return req->texture;
+}
+
+/** Starts loading an image file that may be too large for a single
+ * texture. Once the image has been decoded, it is split into a grid
+ * of tiles that are each at most maxTileSize pixels wide and tall
+ * (and no larger than GL_MAX_TEXTURE_SIZE). Until then, tiles
+ * contains a single placeholder texture with one gray pixel. The
+ * tiles use GL_CLAMP_TO_EDGE.
+ *
+ * @param filename The image file to load.
+ *
+ * @param maxTileSize The largest width or height of a tile in pixels.
+ *
+ * @param tiles Filled in with the textures. This structure is
+ * updated by texstream_update() and must not move until the image is
+ * ready or texstream_tiles_delete() is called.
+ *
+ * @param callback Function to call when all of the tiles are ready or
+ * when loading fails (can be NULL). The texture passed to the
+ * callback is the first tile.
+ *
+ * @param data Pointer passed to the callback.
+ *
+ * @return The first tile (which can be passed to texstream_status()),
+ * or 0 if the file can't be found.
+ */
+GLuint texstream_load_tiles(const char *filename, int maxTileSize, texstream_tiles *tiles, texstream_callback callback, void *data)
+{
+	TRACE_SCOPE("texstream_load_tiles");
+	memset(tiles, 0, sizeof(texstream_tiles));
+	texstream_request *req = texstream_new_request(filename, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, callback, data);
+	if(req == NULL)
+		return 0;
+	req->maxTileSize = maxTileSize > 0 ? maxTileSize : 1;
+	req->tiles = tiles;
+	tiles->textures = kuhl_malloc(sizeof(GLuint));
+	tiles->textures[0] = req->texture;
+	tiles->columns = tiles->rows = 1;
+	tiles->width = tiles->height = 1;
+	tiles->tile_width = tiles->tile_height = 1;
+	texstream_enqueue(req);
+	return req->texture;
+}
+
+/** Stops loading an image from texstream_load_tiles() (if it hasn't
+ * finished) and deletes its textures.
+ *
+ * @param tiles The tiles to delete.
+ */
+void texstream_tiles_delete(texstream_tiles *tiles)
+{
+	if(tiles->textures == NULL)
+		return;
+	texstream_cancel(tiles->textures[0]);
+	glDeleteTextures(tiles->columns * tiles->rows, tiles->textures);
+	free(tiles->textures);
+	memset(tiles, 0, sizeof(texstream_tiles));
+}
+
+/** Checks if a texture from texstream_load() is ready.
+ *
+ * @param texture The texture.
+ *
+ * @param aspectRatio Set to the aspect ratio of the image if it is
+ * known (can be NULL).
+ *
+ * @return TEXSTREAM_READY, TEXSTREAM_LOADING or
+ * TEXSTREAM_FAILED. Textures that weren't loaded with
+ * texstream_load() are always ready.
+ */
+int texstream_status(GLuint texture, float *aspectRatio)
+{
+	int status = TEXSTREAM_READY;
+	pthread_mutex_lock(&texstream_mutex);
+	texstream_request *req = texstream_find(texture);
+	if(req != NULL)
+	{
+		if(req->state == TEXSTREAM_ERROR)
+			status = TEXSTREAM_FAILED;
+		else
+			status = TEXSTREAM_LOADING;
+		if(aspectRatio && req->width > 0 && req->height > 0)
+			*aspectRatio = (float)req->width/req->height;
+	}
+	pthread_mutex_unlock(&texstream_mutex);
+	return status;
+}
+
+/** Stops loading a texture. This must be called before a texture
+ * from texstream_load() is deleted if it might not be ready. The
+ * texture itself is not deleted and the callback won't be called.
+ *
+ * @param texture The texture.
+ */
+void texstream_cancel(GLuint texture)
+{
+	pthread_mutex_lock(&texstream_mutex);
+	texstream_request *req = texstream_find(texture);
+	if(req != NULL)
+	{
+		if(req->state == TEXSTREAM_QUEUED)
+			texstream_pending--;
+		if(req->state == TEXSTREAM_DECODING)
+		{
+			/* Removed by texstream_update() once the thread is
+			 * finished with it. The caller may free the tiles and
+			 * the callback data as soon as we return. */
+			req->canceled = 1;
+			req->tiles = NULL;
+			req->callback = NULL;
+			req->data = NULL;
+		}
+		else
+			texstream_remove(req);
+	}
+	pthread_mutex_unlock(&texstream_mutex);
+}
+
+/** Uploads decoded images into their textures and calls the
+ * callbacks of textures that are ready or failed. Must be called
+ * regularly from the thread that owns the OpenGL context;
+ * viewmat_begin_frame() calls texstream_update_frame() which calls
+ * this function.
+ *
+ * @param budget Approximate number of microseconds to spend. At
+ * least one chunk of rows is uploaded per call when one is
+ * available. A negative budget uploads everything that has been
+ * decoded.
+ *
+ * @return The number of steps (chunks uploaded or callbacks called)
+ * that were performed.
+ */
+int texstream_update(long budget)
+{
+	TRACE_SCOPE("texstream_update");
+	return texstream_run(budget, 0);
+}
+
+/** Calls texstream_update() with the budget in the
+ * KUHL_TEXSTREAM_BUDGET environment variable. Called by
+ * viewmat_begin_frame(). */
+void texstream_update_frame(void)
+{
+	static long budget = -1;
+	if(texstream_head == NULL)
+		return;
+	if(budget < 0)
+	{
+		budget = TEXSTREAM_DEFAULT_BUDGET;
+		const char *str = getenv("KUHL_TEXSTREAM_BUDGET");
+		if(str != NULL && strlen(str) > 0)
+			budget = atol(str);
+		if(budget < 0)
+			budget = 0;
+	}
+	texstream_update(budget);
+}
+
+/** Waits until every texture from texstream_load() is ready or has
+ * failed. */
+void texstream_finish(void)
+{
+	TRACE_SCOPE("texstream_finish");
+	for(;;)
+	{
+		texstream_run(-1, 1);
+		pthread_mutex_lock(&texstream_mutex);
+		if(texstream_pending == 0)
+		{
+			pthread_mutex_unlock(&texstream_mutex);
+			break;
+		}
+		pthread_cond_wait(&texstream_done_cond, &texstream_mutex);
+		pthread_mutex_unlock(&texstream_mutex);
+	}
+	texstream_run(-1, 1);
+}
@@ -0,0 +1,97 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    texstream loads image files into OpenGL textures without making
+    the render loop wait for them.
+
+    texstream_load() immediately returns a texture that contains a
+    single gray pixel. One or more background threads read and decode
+    the image file. texstream_update() then copies the decoded pixels
+    into the texture a few rows at a time, spending a limited amount
+    of time per call, and generates mipmaps when the last row arrives.
+    viewmat_begin_frame() calls texstream_update() automatically.
+
+    When a persistently mapped buffer is available (OpenGL 4.4 or
+    ARB_buffer_storage), the rows are copied into a ring of pixel
+    unpack buffer chunks and each chunk is reused once a fence shows
+    that OpenGL has finished reading it. Otherwise, the rows are
+    copied straight from memory with glTexSubImage2D().
+
+    Programs can find out when a texture is ready with the callback
+    passed to texstream_load() or with texstream_status().
+
+    Images that may be too large for a single texture can be loaded
+    with texstream_load_tiles(), which splits the image into a grid of
+    textures once its size is known.
+
+    The following environment variables change the behavior of the
+    module:
+
+    KUHL_TEXSTREAM_THREADS="2" - Number of threads that decode images
+    (default: one less than the number of processors, at most 4).<br>
+    KUHL_TEXSTREAM_BUDGET="2000" - Microseconds that
+    viewmat_begin_frame() lets texstream_update() spend uploading each
+    frame.<br>
+    KUHL_TEXTURE_ASYNC="1" - Make kuhl_load_model() load textures
+    with texstream_load().
+
+    @author Scott Kuhl
+ */
+
+#ifndef __TEXSTREAM_H__
+#define __TEXSTREAM_H__
+
+#include <GL/glew.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Values returned by texstream_status() */
+enum
+{
+	TEXSTREAM_FAILED = -1, /**< The image could not be loaded (the texture still contains the placeholder) */
+	TEXSTREAM_LOADING = 0, /**< The image is being loaded */
+	TEXSTREAM_READY = 1 /**< The texture contains the image */
+};
+
+/** Called by texstream_update() when a texture is ready or has
+ * failed to load.
+ *
+ * @param texture The texture returned by texstream_load().
+ *
+ * @param aspectRatio The aspect ratio of the image, negative if the
+ * image could not be loaded.
+ *
+ * @param data The pointer passed to texstream_load().
+ */
+typedef void (*texstream_callback)(GLuint texture, float aspectRatio, void *data);
+
+/** An image that is split into a grid of textures because it is
+ * larger than a single texture can be. Filled in by
+ * texstream_load_tiles(). */
+typedef struct
+{
+	GLuint *textures; /**< columns*rows textures, left to right starting with the bottom row */
+	int columns, rows;
+	int width, height; /**< Size of the whole image in pixels */
+	int tile_width, tile_height; /**< Size of each tile in pixels (the tiles in the last column and row may be smaller) */
+} texstream_tiles;
+
+GLuint texstream_load(const char *filename, GLuint wrapS, GLuint wrapT, texstream_callback callback, void *data);
+GLuint texstream_load_tiles(const char *filename, int maxTileSize, texstream_tiles *tiles, texstream_callback callback, void *data);
+void texstream_tiles_delete(texstream_tiles *tiles);
+int texstream_status(GLuint texture, float *aspectRatio);
+void texstream_cancel(GLuint texture);
+int texstream_update(long budget);
+void texstream_update_frame(void);
+void texstream_finish(void);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+#endif // __TEXSTREAM_H__
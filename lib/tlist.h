@@ -0,0 +1,186 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    tlist generates a list type for one item type. Unlike a list (see
+    list.h), the items are accessed directly with their own type, so
+    there are no calls through function pointers, no item sizes known
+    only at runtime and no checks on every access. All of the
+    functions are static inline so the compiler can specialize them.
+
+    For example, to make a list of ints:
+
+    <pre>
+    TLIST_DEFINE(intlist, int, 0)
+
+    intlist l;
+    intlist_init(&l);
+    intlist_append(&l, 4);
+    int more[3] = { 5, 6, 7 };
+    intlist_extend(&l, more, 3);
+    for(int i=0; i<l.length; i++)
+        printf("%d\n", l.data[i]);
+    intlist_free(&l);
+    </pre>
+
+    The third parameter is the number of items that are stored inside
+    of the list struct itself. A list that never holds more items
+    than that never allocates memory. Lists that have items stored
+    inside of the struct must not be copied with "=" or memcpy()
+    since data points into the struct.
+
+    If a list needs to grow, the capacity is set with the
+    TLIST_GROW(capacity, needed) macro which doubles the capacity by
+    default. Define TLIST_GROW before including this file to change
+    it. name_extend() and name_reserve() grow the list at most once.
+
+    The generated functions for a list type called "name" are:
+    name_init(), name_free(), name_reserve(), name_resize(),
+    name_clear(), name_at(), name_push(), name_append(),
+    name_extend(), name_pop(), name_remove(), name_remove_swap() and
+    name_sort().
+
+    @author Scott Kuhl
+ */
+
+#ifndef __TLIST_H__
+#define __TLIST_H__
+
+#include <stdlib.h>
+#include <string.h>
+#include "msg.h"
+
+/** Returns the new capacity of a list that has capacity items and
+ * needs to hold at least needed items. */
+#ifndef TLIST_GROW
+#define TLIST_GROW(capacity, needed) ((capacity)*2 > (needed) ? (capacity)*2 : ((needed) < 8 ? 8 : (needed)))
+#endif
+
+/** Defines a list type called name which stores items of type
+ * type. Up to smallCount items are stored inside of the struct. */
+#define TLIST_DEFINE(name, type, smallCount)                            \
+	typedef struct                                                      \
+	{                                                                   \
+		type *data; /**< The items in the list */                       \
+		int length; /**< Number of items in the list */                 \
+		int capacity; /**< Number of items that fit without growing */  \
+		type small[(smallCount) > 0 ? (smallCount) : 1];                \
+	} name;                                                             \
+	                                                                    \
+	/** Initializes an empty list. */                                   \
+	static inline void name##_init(name *l)                             \
+	{                                                                   \
+		l->data = (smallCount) > 0 ? l->small : NULL;                   \
+		l->length = 0;                                                  \
+		l->capacity = (smallCount);                                     \
+	}                                                                   \
+	                                                                    \
+	/** Frees the items in a list and leaves it empty. */               \
+	static inline void name##_free(name *l)                             \
+	{                                                                   \
+		if(l->data != l->small)                                         \
+			free(l->data);                                              \
+		name##_init(l);                                                 \
+	}                                                                   \
+	                                                                    \
+	/** Makes room for at least capacity items. */                      \
+	static inline void name##_reserve(name *l, int capacity)            \
+	{                                                                   \
+		if(capacity <= l->capacity)                                     \
+			return;                                                     \
+		int newCapacity = TLIST_GROW(l->capacity, capacity);            \
+		type *data;                                                     \
+		if(l->data == l->small)                                         \
+		{                                                               \
+			data = (type*) malloc(sizeof(type)*newCapacity);            \
+			if(data != NULL)                                            \
+				memcpy(data, l->small, sizeof(type)*l->length);         \
+		}                                                               \
+		else                                                            \
+			data = (type*) realloc(l->data, sizeof(type)*newCapacity);  \
+		if(data == NULL)                                                \
+		{                                                               \
+			msg(FATAL, "Unable to allocate space for %d items.", newCapacity); \
+			exit(EXIT_FAILURE);                                         \
+		}                                                               \
+		l->data = data;                                                 \
+		l->capacity = newCapacity;                                      \
+	}                                                                   \
+	                                                                    \
+	/** Sets the number of items in the list. New items are not         \
+	 * initialized. */                                                  \
+	static inline void name##_resize(name *l, int length)               \
+	{                                                                   \
+		name##_reserve(l, length);                                      \
+		l->length = length;                                             \
+	}                                                                   \
+	                                                                    \
+	/** Removes all items without freeing memory. */                    \
+	static inline void name##_clear(name *l)                            \
+	{                                                                   \
+		l->length = 0;                                                  \
+	}                                                                   \
+	                                                                    \
+	/** Returns a pointer to an item. The index isn't checked. */       \
+	static inline type* name##_at(const name *l, int index)             \
+	{                                                                   \
+		return l->data + index;                                         \
+	}                                                                   \
+	                                                                    \
+	/** Adds an uninitialized item to the end of the list and returns   \
+	 * a pointer to it. */                                              \
+	static inline type* name##_push(name *l)                            \
+	{                                                                   \
+		if(l->length == l->capacity)                                    \
+			name##_reserve(l, l->length+1);                             \
+		return l->data + l->length++;                                   \
+	}                                                                   \
+	                                                                    \
+	/** Adds an item to the end of the list. */                         \
+	static inline void name##_append(name *l, type item)                \
+	{                                                                   \
+		*name##_push(l) = item;                                         \
+	}                                                                   \
+	                                                                    \
+	/** Adds count items to the end of the list. */                     \
+	static inline void name##_extend(name *l, const type *items, int count) \
+	{                                                                   \
+		if(count <= 0)                                                  \
+			return;                                                     \
+		name##_reserve(l, l->length+count);                             \
+		memcpy(l->data + l->length, items, sizeof(type)*count);         \
+		l->length += count;                                             \
+	}                                                                   \
+	                                                                    \
+	/** Removes the last item and returns a pointer to it (valid until  \
+	 * the next item is added) or NULL if the list is empty. */         \
+	static inline type* name##_pop(name *l)                             \
+	{                                                                   \
+		return l->length > 0 ? l->data + --l->length : NULL;            \
+	}                                                                   \
+	                                                                    \
+	/** Removes an item and moves the later items forward. */           \
+	static inline void name##_remove(name *l, int index)                \
+	{                                                                   \
+		memmove(l->data + index, l->data + index + 1,                   \
+		        sizeof(type)*(l->length - index - 1));                  \
+		l->length--;                                                    \
+	}                                                                   \
+	                                                                    \
+	/** Removes an item by moving the last item into its place. */      \
+	static inline void name##_remove_swap(name *l, int index)           \
+	{                                                                   \
+		l->data[index] = l->data[--l->length];                          \
+	}                                                                   \
+	                                                                    \
+	/** Sorts the list with qsort(). */                                 \
+	static inline void name##_sort(name *l, int (*compar)(const void *, const void *)) \
+	{                                                                   \
+		if(l->length > 1)                                               \
+			qsort(l->data, l->length, sizeof(type), compar);            \
+	}
+
+#endif // __TLIST_H__
@@ -0,0 +1,141 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    tqueue generates a first-in first-out queue type for one item
+    type. It is the typed version of queue (see queue.h) the same way
+    that tlist.h is the typed version of list. For example:
+
+    <pre>
+    TQUEUE_DEFINE(intqueue, int)
+
+    intqueue q;
+    intqueue_init(&q);
+    intqueue_add(&q, 4);
+    int i;
+    while(intqueue_remove(&q, &i))
+        printf("%d\n", i);
+    intqueue_free(&q);
+    </pre>
+
+    The items are stored in a ring buffer whose capacity is a power of
+    two; it doubles when the queue is full.
+
+    The generated functions for a queue type called "name" are:
+    name_init(), name_free(), name_length(), name_reserve(), name_add(),
+    name_add_many(), name_remove(), name_peek() and name_clear().
+
+    @author Scott Kuhl
+ */
+
+#ifndef __TQUEUE_H__
+#define __TQUEUE_H__
+
+#include <stdlib.h>
+#include <string.h>
+#include "msg.h"
+
+/** Defines a queue type called name which stores items of type type. */
+#define TQUEUE_DEFINE(name, type)                                       \
+	typedef struct                                                      \
+	{                                                                   \
+		type *data; /**< Ring buffer of items */                        \
+		unsigned int head; /**< Number of items ever removed */         \
+		unsigned int tail; /**< Number of items ever added */           \
+		unsigned int capacity; /**< Size of data (a power of two) */    \
+	} name;                                                             \
+	                                                                    \
+	/** Initializes an empty queue. */                                  \
+	static inline void name##_init(name *q)                             \
+	{                                                                   \
+		q->data = NULL;                                                 \
+		q->head = q->tail = q->capacity = 0;                            \
+	}                                                                   \
+	                                                                    \
+	/** Frees the items in a queue and leaves it empty. */              \
+	static inline void name##_free(name *q)                             \
+	{                                                                   \
+		free(q->data);                                                  \
+		name##_init(q);                                                 \
+	}                                                                   \
+	                                                                    \
+	/** Returns the number of items in the queue. */                    \
+	static inline int name##_length(const name *q)                      \
+	{                                                                   \
+		return (int) (q->tail - q->head);                               \
+	}                                                                   \
+	                                                                    \
+	/** Makes room for at least count more items. The items are         \
+	 * moved to the start of the new buffer. */                         \
+	static inline void name##_reserve(name *q, unsigned int count)      \
+	{                                                                   \
+		unsigned int length = q->tail - q->head;                        \
+		if(length + count <= q->capacity)                               \
+			return;                                                     \
+		unsigned int capacity = q->capacity ? q->capacity : 8;          \
+		while(capacity < length + count)                                \
+			capacity *= 2;                                              \
+		type *data = (type*) malloc(sizeof(type)*capacity);             \
+		if(data == NULL)                                                \
+		{                                                               \
+			msg(FATAL, "Unable to allocate space for %u items.", capacity); \
+			exit(EXIT_FAILURE);                                         \
+		}                                                               \
+		for(unsigned int i=0; i<length; i++)                            \
+			data[i] = q->data[(q->head + i) & (q->capacity-1)];         \
+		free(q->data);                                                  \
+		q->data = data;                                                 \
+		q->head = 0;                                                    \
+		q->tail = length;                                               \
+		q->capacity = capacity;                                         \
+	}                                                                   \
+	                                                                    \
+	/** Adds an item to the end of the queue. */                        \
+	static inline void name##_add(name *q, type item)                   \
+	{                                                                   \
+		if(q->tail - q->head == q->capacity)                            \
+			name##_reserve(q, 1);                                       \
+		q->data[q->tail++ & (q->capacity-1)] = item;                    \
+	}                                                                   \
+	                                                                    \
+	/** Adds count items to the end of the queue. */                    \
+	static inline void name##_add_many(name *q, const type *items, int count) \
+	{                                                                   \
+		if(count <= 0)                                                  \
+			return;                                                     \
+		name##_reserve(q, count);                                       \
+		for(int i=0; i<count; i++)                                      \
+			q->data[q->tail++ & (q->capacity-1)] = items[i];            \
+	}                                                                   \
+	                                                                    \
+	/** Removes the item at the front of the queue and copies it into   \
+	 * result (if result isn't NULL). Returns 0 if the queue is empty. */ \
+	static inline int name##_remove(name *q, type *result)              \
+	{                                                                   \
+		if(q->tail == q->head)                                          \
+			return 0;                                                   \
+		if(result != NULL)                                              \
+			*result = q->data[q->head & (q->capacity-1)];               \
+		q->head++;                                                      \
+		return 1;                                                       \
+	}                                                                   \
+	                                                                    \
+	/** Returns a pointer to the item at the front of the queue or NULL \
+	 * if the queue is empty. */                                        \
+	static inline type* name##_peek(const name *q)                      \
+	{                                                                   \
+		if(q->tail == q->head)                                          \
+			return NULL;                                                \
+		return q->data + (q->head & (q->capacity-1));                   \
+	}                                                                   \
+	                                                                    \
+	/** Removes all items without freeing memory. */                    \
+	static inline void name##_clear(name *q)                            \
+	{                                                                   \
+		q->head = q->tail = 0;                                          \
+	}
+
+#endif // __TQUEUE_H__
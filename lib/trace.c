@@ -0,0 +1,231 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ *
+ * Records named zones into per-thread ring buffers and writes them
+ * as Chrome trace JSON. See trace.h for details.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // getpid(), gethostname()
+#include <pthread.h>
+
+#include "trace.h"
+#include "kuhl-nodep.h"
+#include "msg.h"
+
+#define TRACE_EVENTS 65536 /**< Number of zones each thread can store before the oldest zones are overwritten. */
+#define TRACE_DEPTH 64 /**< Maximum number of nested zones on a thread. */
+
+/** A zone that has ended. */
+typedef struct
+{
+	const char *name;
+	long start; /**< Microseconds */
+	long duration; /**< Microseconds */
+} trace_event;
+
+/** The zones recorded by one thread. */
+typedef struct trace_buffer
+{
+	trace_event events[TRACE_EVENTS];
+	unsigned long count; /**< Total number of zones recorded (may exceed TRACE_EVENTS). */
+	const char *open_names[TRACE_DEPTH]; /**< Zones that have started but not ended. */
+	long open_start[TRACE_DEPTH];
+	int depth; /**< Number of zones that have started but not ended (may exceed TRACE_DEPTH). */
+	int tid; /**< Thread number used in the trace file. */
+	struct trace_buffer *next;
+} trace_buffer;
+
+int trace_enabled = 0;
+static int trace_write_at_exit = 0; /**< Set by KUHL_TRACE */
+static char *trace_filename = NULL; /**< File named by KUHL_TRACE (NULL to use the default name) */
+static __thread trace_buffer *trace_local = NULL; /**< The buffer for the current thread */
+static trace_buffer *trace_buffers = NULL; /**< List of the buffers of all threads */
+static int trace_buffer_count = 0;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER; /**< Protects trace_buffers */
+
+
+/** Turns recording of zones on or off. Zones that were started while
+ * tracing was enabled should still be ended after it is disabled.
+ *
+ * @param enable 1 to record zones, 0 to stop recording zones.
+ */
+void trace_enable(int enable)
+{
+	trace_enabled = enable;
+}
+
+/** Allocates the buffer for the current thread. This only happens
+ * the first time that a thread starts a zone. */
+static trace_buffer* trace_buffer_new(void)
+{
+	trace_buffer *buf = calloc(1, sizeof(trace_buffer));
+	if(buf == NULL)
+	{
+		msg(ERROR, "Failed to allocate trace buffer, zones on this thread will not be recorded.\n");
+		return NULL;
+	}
+	pthread_mutex_lock(&trace_mutex);
+	buf->tid = trace_buffer_count++;
+	buf->next = trace_buffers;
+	trace_buffers = buf;
+	pthread_mutex_unlock(&trace_mutex);
+	return buf;
+}
+
+/** Starts a zone on the current thread. Typically called through
+ * TRACE_BEGIN() or TRACE_SCOPE().
+ *
+ * @param name The name of the zone. Only the pointer is stored, so
+ * the string must not be freed or changed.
+ */
+void trace_begin(const char *name)
+{
+	trace_buffer *buf = trace_local;
+	if(buf == NULL)
+		buf = trace_local = trace_buffer_new();
+	if(buf == NULL)
+		return;
+
+	if(buf->depth < TRACE_DEPTH)
+	{
+		buf->open_names[buf->depth] = name;
+		buf->open_start[buf->depth] = kuhl_microseconds();
+	}
+	buf->depth++;
+}
+
+/** Ends the most recent zone started on the current thread. Typically
+ * called through TRACE_END() or when a TRACE_SCOPE() goes out of
+ * scope. */
+void trace_end(void)
+{
+	trace_buffer *buf = trace_local;
+	if(buf == NULL || buf->depth == 0)
+		return;
+	buf->depth--;
+	if(buf->depth >= TRACE_DEPTH)
+		return;
+
+	trace_event *e = &(buf->events[buf->count % TRACE_EVENTS]);
+	e->name = buf->open_names[buf->depth];
+	e->start = buf->open_start[buf->depth];
+	e->duration = kuhl_microseconds() - e->start;
+	buf->count++;
+}
+
+/** Gets the name of this computer. */
+static void trace_hostname(char *hostname, size_t len)
+{
+	if(gethostname(hostname, len) != 0)
+		snprintf(hostname, len, "unknown");
+	hostname[len-1] = '\0';
+}
+
+/** Writes a string to a JSON file with quotes and escapes. */
+static void trace_write_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for(const char *c = str; *c != '\0'; c++)
+	{
+		if(*c == '"' || *c == '\\')
+			fputc('\\', f);
+		if((unsigned char) *c >= ' ')
+			fputc(*c, f);
+	}
+	fputc('"', f);
+}
+
+/** Writes all of the recorded zones to a Chrome trace JSON
+ * file. Zones that are recorded by other threads while the file is
+ * written may or may not be included.
+ *
+ * @param filename The name of the file to write. If NULL, the file
+ * named by the KUHL_TRACE environment variable is used (or
+ * kuhl-trace-HOSTNAME-PID.json if KUHL_TRACE isn't set).
+ *
+ * @return 1 if the file was written, 0 otherwise.
+ */
+int trace_write(const char *filename)
+{
+	char hostname[256];
+	trace_hostname(hostname, sizeof(hostname));
+
+	char defaultName[1024];
+	if(filename == NULL)
+		filename = trace_filename;
+	if(filename == NULL)
+	{
+		snprintf(defaultName, 1024, "kuhl-trace-%s-%d.json", hostname, (int) getpid());
+		filename = defaultName;
+	}
+
+	FILE *f = fopen(filename, "w");
+	if(f == NULL)
+	{
+		msg(ERROR, "Failed to open trace file %s\n", filename);
+		return 0;
+	}
+
+	int pid = (int) getpid();
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	/* Label the process with the hostname so that traces from
+	 * several computers can be viewed together. */
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":", pid);
+	trace_write_string(f, hostname);
+	fprintf(f, "}}");
+
+	unsigned long written = 0;
+	pthread_mutex_lock(&trace_mutex);
+	for(trace_buffer *buf = trace_buffers; buf != NULL; buf = buf->next)
+	{
+		unsigned long count = buf->count;
+		unsigned long first = count > TRACE_EVENTS ? count - TRACE_EVENTS : 0;
+		for(unsigned long i = first; i < count; i++)
+		{
+			const trace_event *e = &(buf->events[i % TRACE_EVENTS]);
+			fprintf(f, ",\n{\"name\":");
+			trace_write_string(f, e->name);
+			fprintf(f, ",\"ph\":\"X\",\"ts\":%ld,\"dur\":%ld,\"pid\":%d,\"tid\":%d}",
+			        e->start, e->duration, pid, buf->tid);
+			written++;
+		}
+	}
+	pthread_mutex_unlock(&trace_mutex);
+
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	msg(INFO, "Wrote %lu zones to trace file %s\n", written, filename);
+	return 1;
+}
+
+/** Writes the trace file when the program exits. */
+static void trace_atexit(void)
+{
+	if(trace_write_at_exit)
+		trace_write(trace_filename);
+}
+
+/** Checks the KUHL_TRACE environment variable when the program
+ * starts. */
+static void __attribute__((constructor)) trace_init(void)
+{
+	const char *str = getenv("KUHL_TRACE");
+	if(str == NULL || strlen(str) == 0 || strcmp(str, "0") == 0)
+		return;
+
+	if(strcmp(str, "1") != 0)
+		trace_filename = strdup(str);
+
+	trace_enable(1);
+	trace_write_at_exit = 1;
+	atexit(trace_atexit);
+}
@@ -0,0 +1,108 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    trace provides a lightweight profiler that records named zones
+    (regions of code) and writes them to a JSON file that can be
+    opened with the Chrome trace viewer (chrome://tracing) or
+    Perfetto (https://ui.perfetto.dev).
+
+    A zone is recorded by placing TRACE_BEGIN("name") and TRACE_END()
+    around some code or by placing TRACE_SCOPE("name") at the start of
+    a block (the zone ends when the block is exited, even by a return
+    statement). The name must be a string literal (or some other
+    string that exists until the trace is written) because only the
+    pointer is recorded.
+
+    Each thread records zones into its own fixed-size ring buffer so
+    that no memory is allocated and no locks are held while zones are
+    recorded. When a buffer is full, the oldest zones are
+    overwritten.
+
+    Tracing is off by default and a disabled zone costs a single
+    branch. The following environment variable turns it on:
+
+    KUHL_TRACE="trace.json" - Record zones and write them to the file
+    when the program exits. If the value is "1", the file is named
+    kuhl-trace-HOSTNAME-PID.json so that traces from different
+    computers in a cluster can be written into the same directory.
+
+    Programs can also call trace_enable() and trace_write() (for
+    example, when a key is pressed). Compiling with KUHL_TRACE_DISABLE
+    defined removes all zones from the code.
+
+    @author Scott Kuhl
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int trace_enabled; /**< Don't change directly, use trace_enable() */
+
+void trace_enable(int enable);
+void trace_begin(const char *name);
+void trace_end(void);
+int trace_write(const char *filename);
+
+/** Starts a zone for TRACE_SCOPE() if tracing is enabled.
+ * @return 1 if a zone was started. */
+static inline int trace_scope_begin(const char *name)
+{
+	if(!trace_enabled)
+		return 0;
+	trace_begin(name);
+	return 1;
+}
+
+/** Ends a zone that was started by TRACE_SCOPE(). */
+static inline void trace_scope_end(int *started)
+{
+	if(*started)
+		trace_end();
+}
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+
+#define TRACE_CONCAT2(a,b) a##b
+#define TRACE_CONCAT(a,b) TRACE_CONCAT2(a,b)
+
+#ifdef KUHL_TRACE_DISABLE
+#define TRACE_BEGIN(name) do { } while(0)
+#define TRACE_END() do { } while(0)
+#define TRACE_SCOPE(name) do { } while(0)
+#else
+
+/** Starts a zone named by the string literal name. Every
+ * TRACE_BEGIN() must be matched by a TRACE_END() on the same
+ * thread. */
+#define TRACE_BEGIN(name) do { if(trace_enabled) trace_begin(name); } while(0)
+/** Ends the most recently started zone on this thread. */
+#define TRACE_END() do { if(trace_enabled) trace_end(); } while(0)
+
+#ifdef __cplusplus
+/** Ends a zone when the TRACE_SCOPE() variable goes out of scope. */
+struct trace_scope
+{
+	int started;
+	trace_scope(const char *name) { started = trace_scope_begin(name); }
+	~trace_scope() { trace_scope_end(&started); }
+};
+/** Records a zone from this point until the end of the enclosing block. */
+#define TRACE_SCOPE(name) trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#else
+/** Records a zone from this point until the end of the enclosing block. */
+#define TRACE_SCOPE(name) int TRACE_CONCAT(trace_scope_, __LINE__) __attribute__((cleanup(trace_scope_end))) = trace_scope_begin(name)
+#endif
+
+#endif // KUHL_TRACE_DISABLE
+
+#endif // __TRACE_H__
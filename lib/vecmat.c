@@ -208,7 +208,9 @@ extern inline void matNf_mult_vecNf_new(float  result[ ], const float  m[  ], co
 extern inline void matNd_mult_vecNd_new(double result[ ], const double m[  ], const double v[ ], const int n);
 extern inline void mat3f_mult_vec3f_new(float  result[3], const float  m[ 9], const float  v[3]);
 extern inline void mat3d_mult_vec3d_new(double result[3], const double m[ 9], const double v[3]);
+extern inline void mat4f_mult_vec4f_simd(float  result[4], const float  m[16], const float  v[4], const int aligned);
 extern inline void mat4f_mult_vec4f_new(float  result[4], const float  m[16], const float  v[4]);
+extern inline void mat4f_mult_vec4f_aligned_new(float  result[4], const float  m[16], const float  v[4]);
 extern inline void mat4d_mult_vec4d_new(double result[4], const double m[16], const double v[4]);
 /* vector = matrix * vector */
 extern inline void matNf_mult_vecNf(float vector[], const float matrix[], const int n);
@@ -223,7 +225,9 @@ extern inline void matNf_mult_matNf_new(float  result[ ], const float  matA[  ],
 extern inline void matNd_mult_matNd_new(double result[ ], const double matA[  ], const double matB[  ], const int n);
 extern inline void mat3f_mult_mat3f_new(float  result[3], const float  matA[ 9], const float  matB[ 9]);
 extern inline void mat3d_mult_mat3d_new(double result[3], const double matA[ 9], const double matB[ 9]);
+extern inline void mat4f_mult_mat4f_simd(float  result[16], const float  matA[16], const float  matB[16], const int aligned);
 extern inline void mat4f_mult_mat4f_new(float  result[4], const float  matA[16], const float  matB[16]);
+extern inline void mat4f_mult_mat4f_aligned_new(float  result[16], const float  matA[16], const float  matB[16]);
 extern inline void mat4d_mult_mat4d_new(double result[4], const double matA[16], const double matB[16]);
 
 /* Transpose a matrix in place. */
@@ -446,6 +450,74 @@ int mat3d_invert_new(double out[9], const double m[9])
 
 	return 1;
 }
+/** Multiplies many column vectors by the same 4x4 matrix.
+
+    @param result Array of count*4 floats to store the results in. May
+    be the same as vecs.
+    @param m The matrix.
+    @param vecs Array of count*4 floats (count vectors with 4 components each).
+    @param count The number of vectors.
+*/
+void mat4f_mult_vec4f_batch(float *result, const float m[16], const float *vecs, int count)
+{
+#if defined(VECMAT_SSE)
+	__m128 c0 = _mm_loadu_ps(m),   c1 = _mm_loadu_ps(m+4);
+	__m128 c2 = _mm_loadu_ps(m+8), c3 = _mm_loadu_ps(m+12);
+	for(int i=0; i<count; i++)
+	{
+		__m128 v = _mm_loadu_ps(vecs+4*i);
+		__m128 r = _mm_mul_ps(c0, _mm_shuffle_ps(v, v, 0x00));
+		r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_shuffle_ps(v, v, 0x55)));
+		r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_shuffle_ps(v, v, 0xAA)));
+		r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_shuffle_ps(v, v, 0xFF)));
+		_mm_storeu_ps(result+4*i, r);
+	}
+#else
+	for(int i=0; i<count; i++)
+		mat4f_mult_vec4f_new(result+4*i, m, vecs+4*i);
+#endif
+}
+
+/** Transforms many points by the same 4x4 matrix. Each point has
+    three components and is treated as if it had a fourth component
+    set to 1. The results are not divided by w, so the matrix should
+    not be a projection matrix.
+
+    @param result Array of count*3 floats to store the results in. May
+    be the same as points.
+    @param m The matrix.
+    @param points Array of count*3 floats (count points with 3 components each).
+    @param count The number of points.
+*/
+void mat4f_mult_point3f_batch(float *result, const float m[16], const float *points, int count)
+{
+	/* Processing the points one component at a time lets the compiler
+	 * vectorize the loop across several points. */
+	for(int i=0; i<count; i++)
+	{
+		const float *p = points+3*i;
+		float x = p[0], y = p[1], z = p[2];
+		float *r = result+3*i;
+		r[0] = m[0]*x + m[4]*y + m[ 8]*z + m[12];
+		r[1] = m[1]*x + m[5]*y + m[ 9]*z + m[13];
+		r[2] = m[2]*x + m[6]*y + m[10]*z + m[14];
+	}
+}
+
+/** Multiplies many pairs of 4x4 matrices together.
+
+    @param result Array of count*16 floats. result[i] = matA[i] * matB[i].
+    May be the same as matA or matB.
+    @param matA Array of count*16 floats containing the left operands.
+    @param matB Array of count*16 floats containing the right operands.
+    @param count The number of pairs of matrices.
+*/
+void mat4f_mult_mat4f_batch(float *result, const float *matA, const float *matB, int count)
+{
+	for(int i=0; i<count; i++)
+		mat4f_mult_mat4f_new(result+16*i, matA+16*i, matB+16*i);
+}
+
 /** Inverts a 4x4 float matrix in place.
  * @param matrix The matrix to be inverted in place.
  * @return Returns 1 if the matrix was inverted. Returns 0 if an error occurred. When an error occurs, a message is also printed out to standard out and the matrix is left unchanged.
@@ -1373,7 +1445,7 @@ void quatf_slerp_new(float result[4], const float start[4], const float end[4],
 		{
 			float omega = acosf(cosOmega);
 			float sinOmega = sinf(omega);
-			startScale = sinf((1.0-t)*omega / sinOmega);
+			startScale = sinf((1.0-t)*omega)/sinOmega;
 			endScale = sinf(t*omega)/sinOmega;
 		}
 		else
@@ -1431,7 +1503,7 @@ void quatd_slerp_new(double result[4], const double start[4], const double end[4
 		{
 			double omega = acos(cosOmega);
 			double sinOmega = sin(omega);
-			startScale = sin((1.0-t)*omega / sinOmega);
+			startScale = sin((1.0-t)*omega)/sinOmega;
 			endScale = sin(t*omega)/sinOmega;
 		}
 		else
@@ -19,11 +19,30 @@ General tips for learning the vector and matrix functions provided by this file:
    Some functions end with "_new" to make it clear that the first argument is not part of the calculation and is simply the place where the result of the calculation is stored. For example, mat4f_invert_new(destMatrix, sourceMatrix) will invert sourceMatrix and store it in destMatrix. However, mat4f_invert(matrix) will invert matrix in place.
 
    Some functions include the "Vec" in their names such as: mat4f_translate_new() and mat4f_translateVec_new(). Both of these functions do the same thing but the first version takes a list of numbers as a parameter and the second one takes an array of numbers.
+
+   mat4f_mult_mat4f_new() and mat4f_mult_vec4f_new() use SSE (and AVX if the compiler is targeting it) on x86 processors and NEON on ARM processors. Define VECMAT_NO_SIMD before including this file (or on the compiler command line) to use the plain C versions instead. The "_aligned" versions of these functions are faster but require that every array is aligned to a 16 byte boundary (see VECMAT_ALIGNED). The "_batch" functions apply the same operation to many vectors or matrices at once.
  
 */
 
 #ifndef __VECMAT_H__
 #define __VECMAT_H__
+
+#if !defined(VECMAT_NO_SIMD) && (defined(__SSE__) || defined(_M_X64))
+#define VECMAT_SSE
+#include <xmmintrin.h>
+#if defined(__AVX__)
+#define VECMAT_AVX
+#include <immintrin.h>
+#endif
+#elif !defined(VECMAT_NO_SIMD) && defined(__ARM_NEON)
+#define VECMAT_NEON
+#include <arm_neon.h>
+#endif
+
+/** Aligns an array to a 16 byte boundary so that it can be used with
+ * the "_aligned" functions. For example: float m[16] VECMAT_ALIGNED; */
+#define VECMAT_ALIGNED __attribute__((aligned(16)))
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -1119,8 +1138,96 @@ static inline void mat3f_mult_mat3f_new(float  result[9], const float  matA[ 9],
 { matNf_mult_matNf_new(result, matA, matB, 3); }
 static inline void mat3d_mult_mat3d_new(double result[9], const double matA[ 9], const double matB[9])
 { matNd_mult_matNd_new(result, matA, matB, 3); }
+/** Multiplies two 4x4 matrices together using SIMD instructions if
+    they are available. Works even if result points to the same
+    location as matA or matB.
+
+    @param result The resulting matrix containing matA * matB.
+    @param matA The left operand.
+    @param matB The right operand.
+    @param aligned 1 if all three arrays are aligned to 16 bytes.
+ */
+static inline void mat4f_mult_mat4f_simd(float result[16], const float matA[16], const float matB[16], const int aligned)
+{
+#if defined(VECMAT_AVX)
+	/* Each 256 bit register holds two columns. Each column of the
+	 * result is the columns of matA weighted by one column of matB. */
+	__m256 a0 = _mm256_broadcast_ps((const __m128*) matA);
+	__m256 a1 = _mm256_broadcast_ps((const __m128*) (matA+4));
+	__m256 a2 = _mm256_broadcast_ps((const __m128*) (matA+8));
+	__m256 a3 = _mm256_broadcast_ps((const __m128*) (matA+12));
+	/* The arrays are only guaranteed to be 16 byte aligned, so
+	 * unaligned 256 bit loads and stores are always used. */
+	(void) aligned;
+	__m256 b01 = _mm256_loadu_ps(matB);
+	__m256 b23 = _mm256_loadu_ps(matB+8);
+	__m256 r01 = _mm256_mul_ps(a0, _mm256_shuffle_ps(b01, b01, 0x00));
+	r01 = _mm256_add_ps(r01, _mm256_mul_ps(a1, _mm256_shuffle_ps(b01, b01, 0x55)));
+	r01 = _mm256_add_ps(r01, _mm256_mul_ps(a2, _mm256_shuffle_ps(b01, b01, 0xAA)));
+	r01 = _mm256_add_ps(r01, _mm256_mul_ps(a3, _mm256_shuffle_ps(b01, b01, 0xFF)));
+	__m256 r23 = _mm256_mul_ps(a0, _mm256_shuffle_ps(b23, b23, 0x00));
+	r23 = _mm256_add_ps(r23, _mm256_mul_ps(a1, _mm256_shuffle_ps(b23, b23, 0x55)));
+	r23 = _mm256_add_ps(r23, _mm256_mul_ps(a2, _mm256_shuffle_ps(b23, b23, 0xAA)));
+	r23 = _mm256_add_ps(r23, _mm256_mul_ps(a3, _mm256_shuffle_ps(b23, b23, 0xFF)));
+	_mm256_storeu_ps(result, r01);
+	_mm256_storeu_ps(result+8, r23);
+#elif defined(VECMAT_SSE)
+	__m128 a0, a1, a2, a3, b[4];
+	if(aligned)
+	{
+		a0 = _mm_load_ps(matA);    a1 = _mm_load_ps(matA+4);
+		a2 = _mm_load_ps(matA+8);  a3 = _mm_load_ps(matA+12);
+		for(int j=0; j<4; j++)
+			b[j] = _mm_load_ps(matB+4*j);
+	}
+	else
+	{
+		a0 = _mm_loadu_ps(matA);   a1 = _mm_loadu_ps(matA+4);
+		a2 = _mm_loadu_ps(matA+8); a3 = _mm_loadu_ps(matA+12);
+		for(int j=0; j<4; j++)
+			b[j] = _mm_loadu_ps(matB+4*j);
+	}
+	for(int j=0; j<4; j++)
+	{
+		__m128 r = _mm_mul_ps(a0, _mm_shuffle_ps(b[j], b[j], 0x00));
+		r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_shuffle_ps(b[j], b[j], 0x55)));
+		r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_shuffle_ps(b[j], b[j], 0xAA)));
+		r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_shuffle_ps(b[j], b[j], 0xFF)));
+		if(aligned)
+			_mm_store_ps(result+4*j, r);
+		else
+			_mm_storeu_ps(result+4*j, r);
+	}
+#elif defined(VECMAT_NEON)
+	float32x4_t a0 = vld1q_f32(matA),   a1 = vld1q_f32(matA+4);
+	float32x4_t a2 = vld1q_f32(matA+8), a3 = vld1q_f32(matA+12);
+	float32x4_t b[4];
+	for(int j=0; j<4; j++)
+		b[j] = vld1q_f32(matB+4*j);
+	for(int j=0; j<4; j++)
+	{
+		float32x4_t r = vmulq_n_f32(a0, vgetq_lane_f32(b[j], 0));
+		r = vmlaq_n_f32(r, a1, vgetq_lane_f32(b[j], 1));
+		r = vmlaq_n_f32(r, a2, vgetq_lane_f32(b[j], 2));
+		r = vmlaq_n_f32(r, a3, vgetq_lane_f32(b[j], 3));
+		vst1q_f32(result+4*j, r);
+	}
+#else
+	/* Column j of the result is the columns of matA weighted by
+	 * column j of matB. Written so that compilers can vectorize it. */
+	float tmp[16];
+	for(int j=0; j<4; j++)
+		for(int i=0; i<4; i++)
+			tmp[4*j+i] = matA[i]*matB[4*j] + matA[4+i]*matB[4*j+1] + matA[8+i]*matB[4*j+2] + matA[12+i]*matB[4*j+3];
+	memcpy(result, tmp, sizeof(float)*16);
+#endif
+}
 static inline void mat4f_mult_mat4f_new(float  result[16], const float  matA[16], const float  matB[16])
-{ matNf_mult_matNf_new(result, matA, matB, 4); }
+{ mat4f_mult_mat4f_simd(result, matA, matB, 0); }
+/** Same as mat4f_mult_mat4f_new() except all three arrays must be
+ * aligned to 16 bytes (see VECMAT_ALIGNED). */
+static inline void mat4f_mult_mat4f_aligned_new(float  result[16], const float  matA[16], const float  matB[16])
+{ mat4f_mult_mat4f_simd(result, matA, matB, 1); }
 static inline void mat4d_mult_mat4d_new(double result[16], const double matA[16], const double matB[16])
 { matNd_mult_matNd_new(result, matA, matB, 4); }
 
@@ -1173,8 +1280,58 @@ static inline void mat3f_mult_vec3f_new(float result[3], const float m[9], const
 { matNf_mult_vecNf_new(result, m, v, 3); }
 static inline void mat3d_mult_vec3d_new(double result[3], const double m[9], const double v[3])
 { matNd_mult_vecNd_new(result, m, v, 3); }
+/** Multiplies a column vector by a 4x4 matrix using SIMD
+    instructions if they are available. Works even if result and v
+    point to the same location.
+
+    @param result The resulting vector.
+    @param m The matrix.
+    @param v The vector.
+    @param aligned 1 if all three arrays are aligned to 16 bytes.
+*/
+static inline void mat4f_mult_vec4f_simd(float result[4], const float m[16], const float v[4], const int aligned)
+{
+#if defined(VECMAT_SSE)
+	__m128 vec = aligned ? _mm_load_ps(v) : _mm_loadu_ps(v);
+	__m128 c0, c1, c2, c3;
+	if(aligned)
+	{
+		c0 = _mm_load_ps(m);   c1 = _mm_load_ps(m+4);
+		c2 = _mm_load_ps(m+8); c3 = _mm_load_ps(m+12);
+	}
+	else
+	{
+		c0 = _mm_loadu_ps(m);   c1 = _mm_loadu_ps(m+4);
+		c2 = _mm_loadu_ps(m+8); c3 = _mm_loadu_ps(m+12);
+	}
+	__m128 r = _mm_mul_ps(c0, _mm_shuffle_ps(vec, vec, 0x00));
+	r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_shuffle_ps(vec, vec, 0x55)));
+	r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_shuffle_ps(vec, vec, 0xAA)));
+	r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_shuffle_ps(vec, vec, 0xFF)));
+	if(aligned)
+		_mm_store_ps(result, r);
+	else
+		_mm_storeu_ps(result, r);
+#elif defined(VECMAT_NEON)
+	float32x4_t vec = vld1q_f32(v);
+	float32x4_t r = vmulq_n_f32(vld1q_f32(m), vgetq_lane_f32(vec, 0));
+	r = vmlaq_n_f32(r, vld1q_f32(m+4),  vgetq_lane_f32(vec, 1));
+	r = vmlaq_n_f32(r, vld1q_f32(m+8),  vgetq_lane_f32(vec, 2));
+	r = vmlaq_n_f32(r, vld1q_f32(m+12), vgetq_lane_f32(vec, 3));
+	vst1q_f32(result, r);
+#else
+	float tmp[4];
+	for(int i=0; i<4; i++)
+		tmp[i] = m[i]*v[0] + m[4+i]*v[1] + m[8+i]*v[2] + m[12+i]*v[3];
+	vec4f_copy(result, tmp);
+#endif
+}
 static inline void mat4f_mult_vec4f_new(float result[4], const float m[16], const float v[4])
-{ matNf_mult_vecNf_new(result, m, v, 4); }
+{ mat4f_mult_vec4f_simd(result, m, v, 0); }
+/** Same as mat4f_mult_vec4f_new() except all three arrays must be
+ * aligned to 16 bytes (see VECMAT_ALIGNED). */
+static inline void mat4f_mult_vec4f_aligned_new(float result[4], const float m[16], const float v[4])
+{ mat4f_mult_vec4f_simd(result, m, v, 1); }
 static inline void mat4d_mult_vec4d_new(double result[4], const double m[16], const double v[4])
 { matNd_mult_vecNd_new(result, m, v, 4); }
 
@@ -1640,6 +1797,11 @@ void mat4d_lookat_new(double result[16], double eyeX, double eyeY, double eyeZ,
 void mat4f_lookatVec_new(float  result[16], const float  eye[3], const float  center[3], const float  up[3]);
 void mat4d_lookatVec_new(double result[16], const double eye[3], const double center[3], const double up[3]);
 
+/* Apply one operation to many vectors or matrices */
+void mat4f_mult_vec4f_batch(float *result, const float m[16], const float *vecs, int count);
+void mat4f_mult_point3f_batch(float *result, const float m[16], const float *points, int count);
+void mat4f_mult_mat4f_batch(float *result, const float *matA, const float *matB, int count);
+
 /* Matrix stack implementation */
 void mat4f_stack_push(list *l);
 void mat4f_stack_mult(list *l, float m[16]);
@@ -19,10 +19,13 @@
 #include "mousemove.h"
 #include "vrpn-help.h"
 #include "hmd-dsight-orient.h"
+#include "kalman.h"
 #include "dgr.h"
 
 #include "viewmat.h"
 #include "projmat.h"
+#include "texstream.h"
+#include "capture.h"
 
 
 #ifndef MISSING_OVR
@@ -49,7 +52,11 @@ ovrFrameTiming timing;
 ovrPosef pose[2];
 float oculus_initialPos[3];
 
+static GLbitfield viewmat_resolve_mask = GL_COLOR_BUFFER_BIT; /**< Buffers that are copied out of the multisampled eye framebuffers, set by VIEWMAT_RESOLVE environment variable */
+static GLuint viewmat_resolve_queries[2] = { 0, 0 }; /**< GL_TIME_ELAPSED queries used to time the resolve on alternating frames */
+static unsigned int viewmat_resolve_count = 0; /**< Number of times the resolve has been timed */
 #endif
+static float viewmat_resolve_ms = -1; /**< Milliseconds the GPU needed to resolve the multisampled framebuffers, see viewmat_resolve_time() */
 
 
 
@@ -71,7 +78,335 @@ static int viewports_size = 0; /**< Number of viewports in viewports array */
 static ViewmatModeType viewmat_mode = 0; /**< 0=mousemove, 1=IVS (using VRPN), 2=HMD (using VRPN), 3=none */
 static const char *viewmat_vrpn_obj = NULL; /**< Name of the VRPN object that we are tracking */
 static HmdControlState viewmat_hmd;
+static int viewmat_single_pass_enabled = 0; /**< Set by VIEWMAT_SINGLE_PASS environment variable */
+
+#define VIEWMAT_PREDICT_AUTO -1 /**< viewmat_predict_usec value that predicts one frame interval ahead */
+static long viewmat_predict_usec = 0; /**< Set by VIEWMAT_PREDICT environment variable (0=no prediction) */
+static long viewmat_frame_start = 0; /**< Time (microseconds) that viewmat_begin_frame() was last called */
+static double viewmat_frame_interval = 0; /**< Smoothed microseconds between calls to viewmat_begin_frame() */
+static kalman_pose_state viewmat_dsight_filter; /**< Predicts the orientation of the dSight HMD */
+
+/* Dynamic resolution renders a smaller part of each viewport when the
+ * GPU takes longer than the budget to draw a frame and stretches it
+ * over the whole viewport at the end of the frame. The GPU time comes
+ * from the profiler's timer queries, so it is typically a few frames
+ * old. */
+#define VIEWMAT_DYNRES_HEADROOM 0.15f /**< The scale only increases once the GPU time is at least this fraction below the budget */
+#define VIEWMAT_DYNRES_DAMPING 0.3f /**< Fraction of the way to the ideal scale that the scale moves each frame */
+#define VIEWMAT_DYNRES_STEP 0.025f /**< The scale is a multiple of this so that it doesn't change by a pixel every frame */
+static float viewmat_dynres_budget = 0; /**< Target GPU milliseconds per frame, set by VIEWMAT_DYNAMIC_RESOLUTION environment variable (0=disabled) */
+static float viewmat_dynres_min = 0.5f; /**< Smallest scale, set by VIEWMAT_RESOLUTION_MIN environment variable */
+static float viewmat_dynres_max = 1; /**< Largest scale, set by VIEWMAT_RESOLUTION_MAX environment variable */
+static float viewmat_dynres_lock = 0; /**< If nonzero, the scale is fixed at this value, see viewmat_resolution_lock() */
+static float viewmat_dynres_scale = 1; /**< Fraction of the width and height of each viewport that is rendered during this frame */
+static float viewmat_dynres_gpu_ms = -1; /**< Smoothed GPU time of recent frames in milliseconds (-1 if unknown) */
+static GLuint viewmat_dynres_framebuffer = 0; /**< Framebuffer that is rendered into in modes that draw directly to the window */
+static GLuint viewmat_dynres_texture = 0; /**< Color texture of viewmat_dynres_framebuffer */
+static GLuint viewmat_dynres_framebufferAA = 0; /**< Multisampled framebuffer that is rendered into if the window is multisampled (otherwise, viewmat_dynres_framebuffer) */
+static GLuint viewmat_dynres_textureAA = 0; /**< Color texture of viewmat_dynres_framebufferAA */
+static int viewmat_dynres_size[2] = { 0, 0 }; /**< Size of viewmat_dynres_framebuffer */
+static int viewmat_dynres_bound = 0; /**< Was viewmat_dynres_framebuffer rendered into during this frame? */
+
+/** Returns 1 if viewports are scaled by dynamic resolution (or a
+ * locked scale), 0 if they are rendered at full resolution. */
+static int viewmat_dynres_active(void)
+{
+	return viewmat_dynres_budget > 0 || viewmat_dynres_lock > 0;
+}
 
+/** Scales a viewport position or size by the resolution scale of the
+ * current frame. */
+static int viewmat_dynres_apply(float value)
+{
+	if(!viewmat_dynres_active())
+		return (int) value;
+	return (int) floorf(value * viewmat_dynres_scale + 0.5f);
+}
+
+/** Adds the GPU time of a frame to the smoothed GPU time that dynamic
+ * resolution uses. */
+static void viewmat_dynres_measure(float ms)
+{
+	if(viewmat_dynres_gpu_ms < 0)
+		viewmat_dynres_gpu_ms = ms;
+	else
+		viewmat_dynres_gpu_ms += 0.3f * (ms - viewmat_dynres_gpu_ms);
+}
+
+/* The profiler places a marker at the start of viewmat_begin_frame(),
+ * at each viewmat_begin_eye(), at the start of viewmat_end_frame()
+ * and after the buffers are swapped. The markers record a CPU
+ * timestamp and issue a GL_TIMESTAMP query. Marker i starts
+ * viewmat_profile_stage i+1 which ends at the next marker that was
+ * reached during that frame. */
+#define VIEWMAT_PROFILE_MAX_EYES 4 /**< Eyes (viewports) that are timed separately */
+#define VIEWMAT_PROFILE_MARKER_END (VIEWMAT_PROFILE_MAX_EYES+1) /**< Marker at the start of viewmat_end_frame() */
+#define VIEWMAT_PROFILE_MARKERS (VIEWMAT_PROFILE_MAX_EYES+3) /**< Number of markers per frame */
+#define VIEWMAT_PROFILE_RING 4 /**< Frames that the GPU can fall behind before GPU times are dropped */
+#define VIEWMAT_PROFILE_HISTORY 128 /**< Number of frames that percentiles are computed from */
+
+/** The markers that were placed during one frame. */
+typedef struct
+{
+	GLuint queries[VIEWMAT_PROFILE_MARKERS]; /**< GL_TIMESTAMP queries (0 if timer queries aren't supported) */
+	long cpu[VIEWMAT_PROFILE_MARKERS]; /**< CPU time in microseconds */
+	int used[VIEWMAT_PROFILE_MARKERS]; /**< Was the marker reached during this frame? */
+	int pending; /**< Have the queries been issued without reading the results? */
+} viewmat_profile_frame;
+
+static int viewmat_profile_enabled = 0; /**< Set by VIEWMAT_PROFILE environment variable or viewmat_profile_enable() */
+
+/** Returns 1 if the profiler should time frames. It also runs when
+ * dynamic resolution needs GPU times. */
+static int viewmat_profile_active(void)
+{
+	return viewmat_profile_enabled || viewmat_dynres_budget > 0;
+}
+static viewmat_profile_frame viewmat_profile_ring[VIEWMAT_PROFILE_RING];
+static int viewmat_profile_current = 0; /**< Index into viewmat_profile_ring for the current frame */
+static int viewmat_profile_queries_made = 0;
+/** Recent stage durations in milliseconds for the CPU [0] and GPU [1]. */
+static float viewmat_profile_history[2][VIEWMAT_PROFILE_STAGES][VIEWMAT_PROFILE_HISTORY];
+static int viewmat_profile_history_count[2][VIEWMAT_PROFILE_STAGES];
+static int viewmat_profile_history_next[2][VIEWMAT_PROFILE_STAGES];
+
+
+/** Adds a stage duration to the profiler history.
+ *
+ * @param gpu 1 if the duration was measured on the GPU, 0 for the CPU.
+ * @param stage The stage that was measured.
+ * @param ms The duration in milliseconds.
+ */
+static void viewmat_profile_add(int gpu, int stage, float ms)
+{
+	int next = viewmat_profile_history_next[gpu][stage];
+	viewmat_profile_history[gpu][stage][next] = ms;
+	viewmat_profile_history_next[gpu][stage] = (next+1) % VIEWMAT_PROFILE_HISTORY;
+	if(viewmat_profile_history_count[gpu][stage] < VIEWMAT_PROFILE_HISTORY)
+		viewmat_profile_history_count[gpu][stage]++;
+}
+
+/** Converts the markers of one frame into stage durations and adds
+ * them to the profiler history.
+ *
+ * @param gpu 1 if times are GPU timestamps, 0 for CPU timestamps.
+ * @param used Which markers were reached during the frame.
+ * @param times The time at each marker in milliseconds.
+ */
+static void viewmat_profile_record(int gpu, const int used[VIEWMAT_PROFILE_MARKERS], const double times[VIEWMAT_PROFILE_MARKERS])
+{
+	int first = -1, last = -1;
+	for(int i=0; i<VIEWMAT_PROFILE_MARKERS; i++)
+	{
+		if(!used[i])
+			continue;
+		if(last >= 0)
+			viewmat_profile_add(gpu, last+1, times[i]-times[last]);
+		if(first < 0)
+			first = i;
+		last = i;
+	}
+	if(first >= 0 && last > first)
+		viewmat_profile_add(gpu, VIEWMAT_PROFILE_FRAME, times[last]-times[first]);
+}
+
+/** Reads the GL_TIMESTAMP queries of an earlier frame. If the GPU
+ * hasn't reached the end of that frame yet, the GPU times for the
+ * frame are dropped so that we never wait for the GPU. */
+static void viewmat_profile_collect(viewmat_profile_frame *frame)
+{
+	if(!frame->pending)
+		return;
+	frame->pending = 0;
+
+	/* The timestamps complete in order, so the others are available
+	 * if the last one is. */
+	int last = -1;
+	for(int i=0; i<VIEWMAT_PROFILE_MARKERS; i++)
+		if(frame->used[i])
+			last = i;
+	if(last < 0)
+		return;
+	GLint available = 0;
+	glGetQueryObjectiv(frame->queries[last], GL_QUERY_RESULT_AVAILABLE, &available);
+	if(!available)
+		return;
+	
+	double times[VIEWMAT_PROFILE_MARKERS];
+	for(int i=0; i<VIEWMAT_PROFILE_MARKERS; i++)
+	{
+		times[i] = 0;
+		if(frame->used[i])
+		{
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(frame->queries[i], GL_QUERY_RESULT, &ns);
+			times[i] = ns / 1000000.0;
+		}
+	}
+	viewmat_profile_record(1, frame->used, times);
+
+	/* Dynamic resolution only depends on the time spent rendering,
+	 * not on resolving or waiting for the buffers to be swapped. */
+	if(frame->used[0] && frame->used[VIEWMAT_PROFILE_MARKER_END])
+		viewmat_dynres_measure(times[VIEWMAT_PROFILE_MARKER_END] - times[0]);
+}
+
+/** Places a profiler marker for the current frame. Only the first
+ * time a marker is reached during a frame is recorded.
+ *
+ * @param marker The marker to place.
+ */
+static void viewmat_profile_marker(int marker)
+{
+	if(!viewmat_profile_active() || marker < 0 || marker >= VIEWMAT_PROFILE_MARKERS)
+		return;
+	viewmat_profile_frame *frame = &viewmat_profile_ring[viewmat_profile_current];
+	if(frame->used[marker])
+		return;
+	frame->used[marker] = 1;
+	frame->cpu[marker] = kuhl_microseconds();
+	if(frame->queries[marker] != 0)
+		glQueryCounter(frame->queries[marker], GL_TIMESTAMP);
+}
+
+/** Starts profiling a new frame. Called by viewmat_begin_frame(). */
+static void viewmat_profile_begin_frame(void)
+{
+	if(!viewmat_profile_active())
+		return;
+
+	if(!viewmat_profile_queries_made)
+	{
+		viewmat_profile_queries_made = 1;
+		if(GLEW_VERSION_3_3 || GLEW_ARB_timer_query)
+		{
+			for(int i=0; i<VIEWMAT_PROFILE_RING; i++)
+				glGenQueries(VIEWMAT_PROFILE_MARKERS, viewmat_profile_ring[i].queries);
+		}
+		else
+			msg(WARNING, "Timer queries are not supported, only CPU times will be profiled.\n");
+	}
+
+	/* Reuse the oldest frame in the ring. */
+	viewmat_profile_current = (viewmat_profile_current+1) % VIEWMAT_PROFILE_RING;
+	viewmat_profile_frame *frame = &viewmat_profile_ring[viewmat_profile_current];
+	viewmat_profile_collect(frame);
+	for(int i=0; i<VIEWMAT_PROFILE_MARKERS; i++)
+		frame->used[i] = 0;
+	viewmat_profile_marker(0);
+}
+
+/** Finishes profiling the current frame. Called at the end of
+ * viewmat_end_frame(). */
+static void viewmat_profile_end_frame(void)
+{
+	if(!viewmat_profile_active())
+		return;
+	viewmat_profile_marker(VIEWMAT_PROFILE_MARKERS-1);
+
+	viewmat_profile_frame *frame = &viewmat_profile_ring[viewmat_profile_current];
+	double times[VIEWMAT_PROFILE_MARKERS];
+	for(int i=0; i<VIEWMAT_PROFILE_MARKERS; i++)
+		times[i] = frame->cpu[i] / 1000.0;
+	viewmat_profile_record(0, frame->used, times);
+	frame->pending = (frame->queries[0] != 0);
+}
+
+/** Turns the frame profiler on or off. The profiler can also be
+ * turned on by setting the VIEWMAT_PROFILE environment variable to
+ * 1.
+ *
+ * @param enable 1 to turn on profiling, 0 to turn it off.
+ */
+void viewmat_profile_enable(int enable)
+{
+	viewmat_profile_enabled = enable;
+}
+
+/** Returns a short name for a profiler stage (for example, "prep" or
+ * "eye0").
+ *
+ * @param stage The stage to get the name of.
+ * @return The name of the stage.
+ */
+const char* viewmat_profile_stage_name(viewmat_profile_stage stage)
+{
+	static const char *names[VIEWMAT_PROFILE_STAGES] = { "frame", "prep", "eye0", "eye1", "eye2", "eye3", "end" };
+	if(stage < 0 || stage >= VIEWMAT_PROFILE_STAGES)
+		return "unknown";
+	return names[stage];
+}
+
+/** Compares two floats for qsort(). */
+static int viewmat_profile_compare(const void *a, const void *b)
+{
+	float fa = *(const float*)a, fb = *(const float*)b;
+	return (fa > fb) - (fa < fb);
+}
+
+/** Returns a percentile of the time that a stage of recent frames
+ * took. The GPU times are typically a few frames behind the CPU
+ * times.
+ *
+ * @param stage The stage of the frame.
+ * @param gpu 1 to get times measured on the GPU, 0 for the CPU.
+ * @param percentile The percentile to get (50 is the median, 100 is the maximum).
+ * @return The time in milliseconds or -1 if the stage hasn't been measured.
+ */
+float viewmat_profile_percentile(viewmat_profile_stage stage, int gpu, float percentile)
+{
+	if(stage < 0 || stage >= VIEWMAT_PROFILE_STAGES)
+		return -1;
+	gpu = gpu ? 1 : 0;
+	int count = viewmat_profile_history_count[gpu][stage];
+	if(count == 0)
+		return -1;
+
+	float sorted[VIEWMAT_PROFILE_HISTORY];
+	memcpy(sorted, viewmat_profile_history[gpu][stage], sizeof(float)*count);
+	qsort(sorted, count, sizeof(float), viewmat_profile_compare);
+
+	if(percentile < 0)
+		percentile = 0;
+	if(percentile > 100)
+		percentile = 100;
+	return sorted[(int) (percentile/100.0f*(count-1) + .5f)];
+}
+
+/** Writes a one-line summary of the median and 95th percentile time
+ * of each stage that was measured into a string. The string can be
+ * drawn on the screen with kuhl_make_label().
+ *
+ * @param str The string to write the summary into.
+ * @param size The size of str.
+ */
+void viewmat_profile_string(char *str, int size)
+{
+	if(size <= 0)
+		return;
+	str[0] = '\0';
+	int len = 0;
+	for(int gpu=0; gpu<2; gpu++)
+	{
+		len += snprintf(str+len, size-len, "%s%s ms p50/p95:",
+		                gpu ? " | " : "", gpu ? "GPU" : "CPU");
+		if(len > size-1)
+			len = size-1; // the string was truncated
+		for(int stage=0; stage<VIEWMAT_PROFILE_STAGES; stage++)
+		{
+			if(viewmat_profile_history_count[gpu][stage] == 0)
+				continue;
+			len += snprintf(str+len, size-len, " %s %.1f/%.1f",
+			                viewmat_profile_stage_name(stage),
+			                viewmat_profile_percentile(stage, gpu, 50),
+			                viewmat_profile_percentile(stage, gpu, 95));
+			if(len > size-1)
+				len = size-1;
+		}
+	}
+	if(viewmat_dynres_active())
+		snprintf(str+len, size-len, " | res %d%%", (int) (viewmat_dynres_scale*100+0.5f));
+}
 
 /** Sometimes calls to glutGet(GLUT_WINDOW_*) take several milliseconds
  * to complete. To maintain a 60fps frame rate, we have a budget of
@@ -134,9 +469,184 @@ static void viewmat_validate_viewportId(int viewportID)
 	}
 }
 
+/** Chooses the resolution scale for the next frame from the GPU
+ * time of recent frames. GPU time is roughly proportional to the
+ * number of pixels, so the ideal scale is the current scale times
+ * the square root of the budget divided by the GPU time. */
+static void viewmat_dynres_update(void)
+{
+	if(viewmat_dynres_lock > 0)
+		viewmat_dynres_scale = viewmat_dynres_lock;
+	else if(viewmat_dynres_budget > 0 && viewmat_dynres_gpu_ms > 0)
+	{
+		float scale = viewmat_dynres_scale;
+		if(viewmat_dynres_gpu_ms > viewmat_dynres_budget ||
+		   viewmat_dynres_gpu_ms < viewmat_dynres_budget * (1-VIEWMAT_DYNRES_HEADROOM))
+		{
+			float ideal = scale * sqrtf(viewmat_dynres_budget / viewmat_dynres_gpu_ms);
+			scale += VIEWMAT_DYNRES_DAMPING * (ideal - scale);
+			scale = floorf(scale / VIEWMAT_DYNRES_STEP + 0.5f) * VIEWMAT_DYNRES_STEP;
+		}
+		if(scale < viewmat_dynres_min)
+			scale = viewmat_dynres_min;
+		if(scale > viewmat_dynres_max)
+			scale = viewmat_dynres_max;
+		viewmat_dynres_scale = scale;
+	}
+
+	/* All tiles of a display wall must use the same scale. The
+	 * slaves use the scale chosen by the master. */
+	if(viewmat_dynres_active())
+		dgr_setget("!!viewMatResScale", &viewmat_dynres_scale, sizeof(float));
+}
+
+/** Deletes a framebuffer created by viewmat_dynres_bind() along with
+ * its color texture and depth renderbuffer. */
+static void viewmat_dynres_delete(GLuint *framebuffer, GLuint *texture)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, *framebuffer);
+	GLint depthbuffer = 0;
+	glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+	                                      GL_FRAMEBUFFER_ATTACHMENT_OBJECT_NAME, &depthbuffer);
+	GLuint rb = (GLuint) depthbuffer;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteRenderbuffers(1, &rb);
+	glDeleteTextures(1, texture);
+	glDeleteFramebuffers(1, framebuffer);
+	*framebuffer = 0;
+	*texture = 0;
+}
+
+/** Binds the framebuffer that viewports are rendered into when
+ * dynamic resolution is used in a mode that normally renders straight
+ * to the window. The framebuffer is (re)created to match the window
+ * size. If the window is multisampled, a multisampled framebuffer
+ * with the same number of samples is rendered into and it is
+ * resolved into viewmat_dynres_framebuffer before it is stretched
+ * over the window. */
+static void viewmat_dynres_bind(void)
+{
+	int width, height;
+	viewmat_window_size(&width, &height);
+	if(viewmat_dynres_framebuffer != 0 &&
+	   (viewmat_dynres_size[0] != width || viewmat_dynres_size[1] != height))
+	{
+		if(viewmat_dynres_framebufferAA != viewmat_dynres_framebuffer)
+			viewmat_dynres_delete(&viewmat_dynres_framebufferAA, &viewmat_dynres_textureAA);
+		viewmat_dynres_delete(&viewmat_dynres_framebuffer, &viewmat_dynres_texture);
+		viewmat_dynres_framebufferAA = 0;
+	}
+	if(viewmat_dynres_framebuffer == 0)
+	{
+		/* GL_SAMPLES describes the framebuffer that is bound. */
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		GLint samples = 0;
+		glGetIntegerv(GL_SAMPLES, &samples);
+
+		viewmat_dynres_framebuffer = kuhl_gen_framebuffer(width, height, &viewmat_dynres_texture, NULL);
+		if(samples > 1)
+			viewmat_dynres_framebufferAA = kuhl_gen_framebuffer_msaa(width, height, &viewmat_dynres_textureAA, NULL, samples);
+		else
+			viewmat_dynres_framebufferAA = viewmat_dynres_framebuffer;
+		viewmat_dynres_size[0] = width;
+		viewmat_dynres_size[1] = height;
+		msg(DEBUG, "Dynamic resolution framebuffer is %dx%d with %d samples.\n", width, height, samples > 1 ? samples : 1);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, viewmat_dynres_framebufferAA);
+	viewmat_dynres_bound = 1;
+}
+
+/** Stretches the part of viewmat_dynres_framebuffer that was rendered
+ * during this frame over the window. */
+static void viewmat_dynres_blit(void)
+{
+	if(!viewmat_dynres_bound)
+		return;
+	viewmat_dynres_bound = 0;
+	int width = viewmat_dynres_size[0], height = viewmat_dynres_size[1];
+	int scaledWidth = viewmat_dynres_apply(width), scaledHeight = viewmat_dynres_apply(height);
+
+	/* Blits are clipped by the scissor test. */
+	GLboolean scissor = glIsEnabled(GL_SCISSOR_TEST);
+	glDisable(GL_SCISSOR_TEST);
+
+	/* A multisampled framebuffer can't be scaled while it is
+	 * resolved, so it is resolved first. */
+	if(viewmat_dynres_framebufferAA != viewmat_dynres_framebuffer)
+	{
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, viewmat_dynres_framebufferAA);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, viewmat_dynres_framebuffer);
+		glBlitFramebuffer(0, 0, scaledWidth, scaledHeight, 0, 0, scaledWidth, scaledHeight,
+		                  GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, viewmat_dynres_framebuffer);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glBlitFramebuffer(0, 0, scaledWidth, scaledHeight, 0, 0, width, height, GL_COLOR_BUFFER_BIT,
+	                  scaledWidth == width && scaledHeight == height ? GL_NEAREST : GL_LINEAR);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if(scissor)
+		glEnable(GL_SCISSOR_TEST);
+	kuhl_errorcheck();
+}
+
+/** Returns the fraction of the width and height of each viewport that
+ * is rendered during the current frame. The viewports returned by
+ * viewmat_get_viewport() are already scaled. When dynamic resolution
+ * is off, this is 1.
+ */
+float viewmat_resolution_scale(void)
+{
+	return viewmat_dynres_active() ? viewmat_dynres_scale : 1;
+}
+
+/** Fixes the resolution scale so that it doesn't change from one
+ * frame to the next. This is useful while taking screenshots or
+ * recording videos. The scale can also be locked with the
+ * VIEWMAT_RESOLUTION_LOCK environment variable. The new scale is used
+ * starting with the next call to viewmat_begin_frame().
+ *
+ * @param scale The fraction of the width and height of each viewport
+ * to render (between 0 and 1; 1 renders at full resolution), or 0 to
+ * let dynamic resolution choose the scale again.
+ */
+void viewmat_resolution_lock(float scale)
+{
+	if(scale < 0 || scale > 1)
+	{
+		msg(ERROR, "Resolution scale must be between 0 and 1: %f\n", scale);
+		return;
+	}
+	viewmat_dynres_lock = scale;
+	if(scale == 0 && viewmat_dynres_budget <= 0)
+		viewmat_dynres_scale = 1;
+}
+
 /** Should be called prior to rendering a frame. */
 void viewmat_begin_frame(void)
 {
+	viewmat_profile_begin_frame();
+
+	long now = kuhl_microseconds();
+	if(viewmat_frame_start != 0)
+	{
+		long interval = now - viewmat_frame_start;
+		if(interval < 100000) // ignore long pauses
+		{
+			if(viewmat_frame_interval == 0)
+				viewmat_frame_interval = interval;
+			else
+				viewmat_frame_interval += .1 * (interval - viewmat_frame_interval);
+		}
+	}
+	viewmat_frame_start = now;
+
+	viewmat_dynres_update();
+
+	/* Memory from kuhl_arena_frame() is only used for one frame. */
+	kuhl_arena_frame_begin();
+
+	/* Upload a few rows of any textures that are streaming in. */
+	texstream_update_frame();
 #ifndef MISSING_OVR
 	if(viewmat_mode == VIEWMAT_HMD_OCULUS)
 	{
@@ -146,35 +656,148 @@ void viewmat_begin_frame(void)
 #endif
 }
 
+/** Estimates when the frame that is being rendered will be
+ * displayed. Tracked poses are predicted for this time to hide the
+ * latency between the tracker and the display.
+ *
+ * @return The time in microseconds (see kuhl_microseconds()) or 0 if
+ * VIEWMAT_PREDICT isn't set.
+ */
+static long viewmat_photon_time(void)
+{
+	if(viewmat_predict_usec == 0)
+		return 0;
+	long start = viewmat_frame_start;
+	if(start == 0) // viewmat_begin_frame() isn't being called
+		start = kuhl_microseconds();
+	if(viewmat_predict_usec == VIEWMAT_PREDICT_AUTO)
+		return start + (long) viewmat_frame_interval;
+	return start + viewmat_predict_usec;
+}
+
+#ifndef MISSING_OVR
+/** Checks if viewmat_resolve_oculus() stretches the rendered part of
+ * each eye over the whole eye texture. */
+static int viewmat_resolve_stretch(void)
+{
+	if(leftFramebufferAA == leftFramebuffer || viewmat_resolve_mask != GL_COLOR_BUFFER_BIT)
+		return 0;
+	if(viewmat_dynres_apply(recommendTexSizeL.w) == recommendTexSizeL.w &&
+	   viewmat_dynres_apply(recommendTexSizeL.h) == recommendTexSizeL.h)
+		return 0;
+	return GLEW_EXT_framebuffer_multisample_blit_scaled;
+}
+
+/** Tells libovr which part of each eye texture contains the image. If
+ * the image wasn't stretched to fill the texture while it was
+ * resolved, libovr stretches the rendered part during distortion
+ * correction. */
+static void viewmat_dynres_oculus_viewports(void)
+{
+	int stretched = viewmat_resolve_stretch();
+	for(int i=0; i<2; i++)
+	{
+		ovrSizei size = i == 0 ? recommendTexSizeL : recommendTexSizeR;
+		EyeTexture[i].OGL.Header.RenderViewport.Size.w = stretched ? size.w : viewmat_dynres_apply(size.w);
+		EyeTexture[i].OGL.Header.RenderViewport.Size.h = stretched ? size.h : viewmat_dynres_apply(size.h);
+	}
+}
+
+/** Copies the prerendered images from the multisample antialiasing
+ * framebuffers into the normal OpenGL textures that are sent to the
+ * Oculus. Only the buffers in viewmat_resolve_mask are copied. The
+ * color, depth and stencil buffers are copied with a single blit per
+ * eye (the depth and stencil buffers are a single GL_DEPTH24_STENCIL8
+ * renderbuffer in both framebuffers, so they can always be combined).
+ *
+ * Nothing is copied if multisampling is disabled because we render
+ * directly into the normal framebuffers in that case.
+ */
+static void viewmat_resolve_oculus(void)
+{
+	if(leftFramebufferAA == leftFramebuffer || viewmat_resolve_mask == 0)
+		return;
+
+	/* Read the time from the query that we issued during the
+	 * previous frame. It is usually ready by now. If it isn't, we
+	 * skip it instead of waiting for the GPU. */
+	GLuint query = viewmat_resolve_queries[viewmat_resolve_count % 2];
+	if(query != 0)
+	{
+		if(viewmat_resolve_count > 0)
+		{
+			GLuint previous = viewmat_resolve_queries[(viewmat_resolve_count+1) % 2];
+			GLint available = 0;
+			glGetQueryObjectiv(previous, GL_QUERY_RESULT_AVAILABLE, &available);
+			if(available)
+			{
+				GLuint64 elapsed = 0; // nanoseconds
+				glGetQueryObjectui64v(previous, GL_QUERY_RESULT, &elapsed);
+				viewmat_resolve_ms = elapsed / 1000000.0f;
+			}
+		}
+		glBeginQuery(GL_TIME_ELAPSED, query);
+	}
+
+	/* With dynamic resolution, only the lower left part of each eye
+	 * was rendered. Multisampled framebuffers can only be stretched
+	 * while they are resolved with an extension (and only the color
+	 * buffer). Otherwise, the part is copied as-is and libovr
+	 * stretches it (see viewmat_dynres_oculus_viewports()). */
+	for(int i=0; i<2; i++)
+	{
+		ovrSizei size = i == 0 ? recommendTexSizeL : recommendTexSizeR;
+		ovrSizei scaled = size;
+		scaled.w = viewmat_dynres_apply(size.w);
+		scaled.h = viewmat_dynres_apply(size.h);
+		ovrSizei dest = scaled;
+		GLenum filter = GL_NEAREST;
+		if(viewmat_resolve_stretch())
+		{
+			dest = size;
+			filter = GL_SCALED_RESOLVE_FASTEST_EXT;
+		}
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, i == 0 ? leftFramebufferAA : rightFramebufferAA);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, i == 0 ? leftFramebuffer : rightFramebuffer);
+		glBlitFramebuffer(0, 0, scaled.w, scaled.h,
+		                  0, 0, dest.w, dest.h,
+		                  viewmat_resolve_mask, filter);
+	}
+
+	if(query != 0)
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+		viewmat_resolve_count++;
+	}
+	kuhl_errorcheck();
+}
+#endif
+
+/** Returns the amount of time that the GPU spent copying the
+ * multisampled framebuffers into normal framebuffers in
+ * viewmat_end_frame(). The time is measured with an OpenGL timer
+ * query and is typically one frame old.
+ *
+ * @return The time in milliseconds or -1 if no time is available
+ * (for example, because the current viewmat mode doesn't need to
+ * resolve multisampled framebuffers).
+ */
+float viewmat_resolve_time(void)
+{
+	return viewmat_resolve_ms;
+}
+
 /** Should be called when we have completed rendering a frame. For
  * HMDs, this should be called after both the left and right eyes have
  * been rendered. */
 void viewmat_end_frame(void)
 {
+	viewmat_profile_marker(VIEWMAT_PROFILE_MARKER_END);
 	if(viewmat_mode == VIEWMAT_HMD_OCULUS)
 	{
 #ifndef MISSING_OVR
-		/* Copy the prerendered image from a multisample antialiasing
-		   texture into a normal OpenGL texture. This section of code
-		   is not necessary if we are rendering directly into the
-		   normal (non-antialiased) OpenGL texture. */
-		GLuint buffersToBlit[3] = { GL_COLOR_BUFFER_BIT, GL_STENCIL_BUFFER_BIT, GL_DEPTH_BUFFER_BIT };
-
-		glBindFramebuffer(GL_READ_FRAMEBUFFER, leftFramebufferAA);
-		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, leftFramebuffer);
-		for(unsigned int i=0; i<sizeof(buffersToBlit)/sizeof(buffersToBlit[0]); i++)
-			glBlitFramebuffer(0, 0, recommendTexSizeL.w,
-			                  recommendTexSizeL.h, 0, 0, recommendTexSizeL.w,
-			                  recommendTexSizeL.h, buffersToBlit[i], GL_NEAREST);
-
-		glBindFramebuffer(GL_READ_FRAMEBUFFER, rightFramebufferAA);
-		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, rightFramebuffer);
-		for(unsigned int i=0; i<sizeof(buffersToBlit)/sizeof(buffersToBlit[0]); i++)
-			glBlitFramebuffer(0, 0, recommendTexSizeL.w,
-			                  recommendTexSizeL.h, 0, 0, recommendTexSizeL.w,
-			                  recommendTexSizeL.h, buffersToBlit[i], GL_NEAREST);
-		kuhl_errorcheck();
-		
+		viewmat_resolve_oculus();
+		viewmat_dynres_oculus_viewports();
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 		if(hmd)
 			ovrHmd_EndFrame(hmd, pose, &EyeTexture[0].Texture);
@@ -184,11 +807,27 @@ void viewmat_end_frame(void)
 	{
 		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 	}
+	viewmat_dynres_blit();
 
 	/* Need to swap front and back buffers here unless we are using
 	 * Oculus. (Oculus draws to the screen directly). */
 	if(viewmat_mode != VIEWMAT_HMD_OCULUS)
+	{
+		/* Wait for the other computers in a DGR cluster to finish
+		 * rendering so that all displays swap at the same time. */
+		if(dgr_swap_enabled())
+		{
+			glFinish();
+			dgr_swap_barrier();
+		}
 		glutSwapBuffers();
+	}
+
+	/* Collect frames that were captured in earlier frames while the
+	 * OpenGL context is known to exist. */
+	capture_poll();
+
+	viewmat_profile_end_frame();
 }
 
 
@@ -226,6 +865,41 @@ int viewmat_get_blitted_framebuffer(int viewportID)
 }
 
 
+/** Returns the framebuffer that viewmat_begin_eye() binds for a
+ * viewport. Code that renders into its own framebuffer in the middle
+ * of a viewport should bind this framebuffer again afterwards instead
+ * of binding framebuffer 0 because viewports aren't always rendered
+ * straight to the window (e.g., on the Oculus or when dynamic
+ * resolution is used).
+ *
+ * @param viewportID The viewport that is being rendered.
+ *
+ * @return The framebuffer to render the viewport into (0 for the
+ * window).
+ */
+int viewmat_get_framebuffer(int viewportID)
+{
+	viewmat_validate_viewportId(viewportID);
+
+#ifndef MISSING_OVR
+	if(viewmat_mode == VIEWMAT_HMD_OCULUS)
+	{
+		ovrEyeType eye = hmd->EyeRenderOrder[viewportID];
+		if(eye == ovrEye_Left)
+			return leftFramebufferAA;
+		else if(eye == ovrEye_Right)
+			return rightFramebufferAA;
+		else
+			return 0;
+	}
+#endif
+
+	if(viewmat_dynres_active() && viewmat_dynres_framebufferAA != 0)
+		return viewmat_dynres_framebufferAA;
+	return 0;
+}
+
+
 /** Changes the framebuffer (as needed) that OpenGL is rendering
  * to. Some HMDs (such as the Oculus Rift) require us to prerender the
  * left and right eye scenes to a texture. Those textures are then
@@ -241,6 +915,8 @@ int viewmat_get_blitted_framebuffer(int viewportID)
 void viewmat_begin_eye(int viewportID)
 {
 	viewmat_validate_viewportId(viewportID);
+	if(viewportID < VIEWMAT_PROFILE_MAX_EYES)
+		viewmat_profile_marker(1+viewportID);
 	
 #ifndef MISSING_OVR
 	if(viewmat_mode == VIEWMAT_HMD_OCULUS)
@@ -261,6 +937,11 @@ void viewmat_begin_eye(int viewportID)
 	}
 #endif
 
+	/* Modes that render to the window render into a framebuffer
+	 * instead when the resolution is scaled. */
+	if(viewmat_mode != VIEWMAT_HMD_OCULUS && viewmat_dynres_active())
+		viewmat_dynres_bind();
+
 	if(viewmat_mode == VIEWMAT_ANAGLYPH)
 	{
 		if(viewportID == 0)
@@ -358,8 +1039,10 @@ static void viewmat_two_viewports(void)
 static void viewmat_oculus_viewports(void)
 {
 #ifndef MISSING_OVR
-	int windowWidth  = EyeTexture[0].OGL.Header.RenderViewport.Size.w;
-	int windowHeight = EyeTexture[0].OGL.Header.RenderViewport.Size.h;
+	/* The render viewport in EyeTexture may be scaled by dynamic
+	 * resolution, so use the full size of the texture. */
+	int windowWidth  = recommendTexSizeL.w;
+	int windowHeight = recommendTexSizeL.h;
 
 	/* The two Oculus viewports are the same (they each fill the
 	 * entire scree) because we are rendering the left and right eyes
@@ -403,6 +1086,84 @@ static void viewmat_refresh_viewports(void)
 	}
 }
 
+/** Checks if both eyes can be rendered in a single pass (see
+ * viewmat_begin_stereo()). Single-pass stereo must be requested by
+ * setting the VIEWMAT_SINGLE_PASS environment variable to 1. It is
+ * used when there are two viewports of the same size next to each
+ * other in the same framebuffer (i.e., the side-by-side "hmd" and
+ * "dsight" modes). Anaglyph images and the Oculus (which uses one
+ * framebuffer per eye) are always rendered one viewport at a time.
+ *
+ * @return 1 if the application should render both eyes with
+ * viewmat_begin_stereo(), 0 if it should loop over the viewports.
+ */
+int viewmat_single_pass(void)
+{
+	if(!viewmat_single_pass_enabled ||
+	   viewmat_mode == VIEWMAT_HMD_OCULUS || viewmat_mode == VIEWMAT_ANAGLYPH)
+		return 0;
+	viewmat_refresh_viewports();
+	if(viewports_size != 2)
+		return 0;
+	if(viewports[1][0] != viewports[0][0] + viewports[0][2] ||
+	   viewports[1][1] != viewports[0][1] ||
+	   viewports[1][2] != viewports[0][2] ||
+	   viewports[1][3] != viewports[0][3])
+		return 0;
+	return 1;
+}
+
+/** Gets the view and projection matrices for both eyes at once. This
+ * is equivalent to calling viewmat_get() for viewport 0 and 1.
+ *
+ * @param viewmatrix To be filled in with the view matrix of the left
+ * (viewport 0) and right (viewport 1) eye.
+ *
+ * @param projmatrix To be filled in with the projection matrices.
+ */
+void viewmat_get_stereo(float viewmatrix[2][16], float projmatrix[2][16])
+{
+	for(int i=0; i<2; i++)
+		viewmat_get(viewmatrix[i], projmatrix[i], i);
+}
+
+/** Prepares OpenGL to render both eyes with a single set of draw
+ * calls. This should be used instead of calling viewmat_begin_eye()
+ * for each viewport when viewmat_single_pass() returns 1.
+ *
+ * The viewport is set to cover both eyes and every kuhl_geometry is
+ * drawn with two instances (see kuhl_geometry_view_count()). The
+ * vertex program should use gl_InstanceID % 2 as the eye index to
+ * choose the view/projection matrices for that eye (see
+ * viewmat_get_stereo()). It should then squeeze the clip space
+ * position into that eye's half of the viewport and clip away the
+ * other half:
+ *
+ * <pre>
+ * gl_Position.x = 0.5*gl_Position.x + (eye==0 ? -0.5 : 0.5)*gl_Position.w;
+ * gl_ClipDistance[0] = (eye==0 ? -gl_Position.x : gl_Position.x);
+ * </pre>
+ *
+ * Call viewmat_end_stereo() when both eyes have been drawn.
+ */
+void viewmat_begin_stereo(void)
+{
+	int left[4], right[4];
+	viewmat_get_viewport(left, 0);
+	viewmat_get_viewport(right, 1);
+	glViewport(left[0], left[1], left[2] + right[2], left[3]);
+	glEnable(GL_CLIP_DISTANCE0);
+	kuhl_geometry_view_count(2);
+}
+
+/** Finishes single-pass stereo rendering started with
+ * viewmat_begin_stereo(). */
+void viewmat_end_stereo(void)
+{
+	glDisable(GL_CLIP_DISTANCE0);
+	kuhl_geometry_view_count(1);
+}
+
 /** Checks if VIEWMAT_VRPN_OBJECT environment variable is set. If it
     is, use VRPN to control the camera position and orientation.
     
@@ -474,6 +1235,7 @@ static void viewmat_init_hmd_dsight()
 	/* TODO: Currently this mode only supports the orientation sensor
 	 * in the dSight HMD */
 	viewmat_hmd = initHmdControl(hmdDeviceFile);
+	kalman_pose_initialize(&viewmat_dsight_filter, 0.001, 10);
 }
 
 /** Initialize the Oculus HMD.
@@ -528,15 +1290,45 @@ static void viewmat_init_hmd_oculus(float pos[3])
 	/* Number of multisample antialiasing while rendering the scene
 	 * for each eye. */
 	GLint msaa_samples = 2;
+	const char *samplesString = getenv("VIEWMAT_MSAA_SAMPLES");
+	if(samplesString != NULL)
+		msaa_samples = atoi(samplesString);
+
+	/* Which buffers need to be copied out of the multisampled
+	 * framebuffers? libovr only uses the color buffer. */
+	const char *resolveString = getenv("VIEWMAT_RESOLVE");
+	if(resolveString != NULL)
+	{
+		viewmat_resolve_mask = 0;
+		if(strstr(resolveString, "color") != NULL)
+			viewmat_resolve_mask |= GL_COLOR_BUFFER_BIT;
+		if(strstr(resolveString, "depth") != NULL)
+			viewmat_resolve_mask |= GL_DEPTH_BUFFER_BIT;
+		if(strstr(resolveString, "stencil") != NULL)
+			viewmat_resolve_mask |= GL_STENCIL_BUFFER_BIT;
+	}
+
 	recommendTexSizeL = ovrHmd_GetFovTextureSize(hmd, ovrEye_Left,  hmd->DefaultEyeFov[ovrEye_Left],  pixelDensity);
 	recommendTexSizeR = ovrHmd_GetFovTextureSize(hmd, ovrEye_Right, hmd->DefaultEyeFov[ovrEye_Right], pixelDensity);
 	
-	GLuint leftTextureAA,rightTextureAA;
-	leftFramebufferAA  = kuhl_gen_framebuffer_msaa(recommendTexSizeL.w, recommendTexSizeL.h, &leftTextureAA, NULL, msaa_samples);
-	rightFramebufferAA = kuhl_gen_framebuffer_msaa(recommendTexSizeR.w, recommendTexSizeR.h, &rightTextureAA, NULL, msaa_samples);
 	GLuint leftTexture,rightTexture;
 	leftFramebuffer  = kuhl_gen_framebuffer(recommendTexSizeL.w, recommendTexSizeL.h, &leftTexture,  NULL);
 	rightFramebuffer = kuhl_gen_framebuffer(recommendTexSizeR.w, recommendTexSizeR.h, &rightTexture, NULL);
+	if(msaa_samples > 1)
+	{
+		GLuint leftTextureAA,rightTextureAA;
+		leftFramebufferAA  = kuhl_gen_framebuffer_msaa(recommendTexSizeL.w, recommendTexSizeL.h, &leftTextureAA, NULL, msaa_samples);
+		rightFramebufferAA = kuhl_gen_framebuffer_msaa(recommendTexSizeR.w, recommendTexSizeR.h, &rightTextureAA, NULL, msaa_samples);
+		if(GLEW_VERSION_3_3 || GLEW_ARB_timer_query)
+			glGenQueries(2, viewmat_resolve_queries);
+	}
+	else
+	{
+		/* Without antialiasing, render directly into the textures
+		 * that we give to libovr. */
+		leftFramebufferAA  = leftFramebuffer;
+		rightFramebufferAA = rightFramebuffer;
+	}
 	//printf("Left recommended texture size: %d %d\n", recommendTexSizeL.w, recommendTexSizeL.h);
 	//printf("Right recommended texture size: %d %d\n", recommendTexSizeR.w, recommendTexSizeR.h);
 
@@ -699,6 +1491,54 @@ void viewmat_init(float pos[3], float look[3], float up[3])
 
 	viewmat_refresh_viewports();
 
+	const char *profileString = getenv("VIEWMAT_PROFILE");
+	if(profileString != NULL && strcmp(profileString, "1") == 0)
+		viewmat_profile_enable(1);
+
+	const char *predictString = getenv("VIEWMAT_PREDICT");
+	if(predictString != NULL && strcasecmp(predictString, "auto") == 0)
+	{
+		viewmat_predict_usec = VIEWMAT_PREDICT_AUTO;
+		msg(INFO, "Predicting tracked poses one frame ahead.\n");
+	}
+	else if(predictString != NULL && atof(predictString) > 0)
+	{
+		viewmat_predict_usec = (long) (atof(predictString) * 1000);
+		msg(INFO, "Predicting tracked poses %.1f ms ahead.\n", viewmat_predict_usec/1000.0);
+	}
+
+	const char *dynresString = getenv("VIEWMAT_DYNAMIC_RESOLUTION");
+	if(dynresString != NULL && atof(dynresString) > 0)
+	{
+		viewmat_dynres_budget = (float) atof(dynresString);
+		const char *minString = getenv("VIEWMAT_RESOLUTION_MIN");
+		const char *maxString = getenv("VIEWMAT_RESOLUTION_MAX");
+		if(minString != NULL && atof(minString) > 0 && atof(minString) <= 1)
+			viewmat_dynres_min = (float) atof(minString);
+		if(maxString != NULL && atof(maxString) > 0 && atof(maxString) <= 1)
+			viewmat_dynres_max = (float) atof(maxString);
+		if(viewmat_dynres_min > viewmat_dynres_max)
+			viewmat_dynres_min = viewmat_dynres_max;
+		viewmat_dynres_scale = viewmat_dynres_max;
+		if(!(GLEW_VERSION_3_3 || GLEW_ARB_timer_query))
+			msg(WARNING, "Dynamic resolution needs timer queries, which are not supported. The resolution will not change.\n");
+		msg(INFO, "Dynamic resolution: %.1f ms GPU budget, scale %.2f to %.2f\n",
+		    viewmat_dynres_budget, viewmat_dynres_min, viewmat_dynres_max);
+	}
+	const char *lockString = getenv("VIEWMAT_RESOLUTION_LOCK");
+	if(lockString != NULL && atof(lockString) > 0)
+		viewmat_resolution_lock((float) atof(lockString));
+
+	const char *singlePassString = getenv("VIEWMAT_SINGLE_PASS");
+	if(singlePassString != NULL && strcmp(singlePassString, "1") == 0)
+	{
+		viewmat_single_pass_enabled = 1;
+		if(viewmat_single_pass())
+			msg(INFO, "Using single-pass stereo rendering.\n");
+		else
+			msg(WARNING, "Single-pass stereo rendering is not supported in this viewmat mode. Each viewport will be rendered separately.\n");
+	}
+
 	// If there are two "viewports" then it is likely that we are
 	// doing stereoscopic rendering. Displaying the mouse cursor can
 	// interfere with stereo images, so we disable the cursor here.
@@ -787,7 +1627,7 @@ static viewmat_eye viewmat_get_mouse(float viewmatrix[16], int viewportNum)
 	else // if VRPN object is specified, use that instead
 	{
 		float pos[3], orient[16];
-		vrpn_get(viewmat_vrpn_obj, NULL, pos, orient);
+		vrpn_get_predicted(viewmat_vrpn_obj, NULL, viewmat_photon_time(), pos, orient);
 
 		float pos4[4] = {pos[0],pos[1],pos[2],1};
 		viewmat_fix_rotation(orient);
@@ -830,6 +1670,21 @@ static viewmat_eye viewmat_get_hmd_dsight(float viewmatrix[16], int viewportNum)
 	float quaternion[4];
 	updateHmdControl(&viewmat_hmd, quaternion);
 
+	long photonTime = viewmat_photon_time();
+	if(photonTime != 0)
+	{
+		/* The dSight doesn't timestamp its data, so use the time that
+		 * we read it. It only provides an orientation. */
+		double pos[3] = { 0, 0, 0 };
+		double quat[4];
+		for(int i=0; i<4; i++)
+			quat[i] = quaternion[i];
+		kalman_pose_update(&viewmat_dsight_filter, pos, quat, kuhl_microseconds());
+		kalman_pose_predict(&viewmat_dsight_filter, photonTime, pos, quat);
+		for(int i=0; i<4; i++)
+			quaternion[i] = (float) quat[i];
+	}
+
 	float rotationMatrix[16];
 	mat4f_rotateQuatVec_new(rotationMatrix, quaternion);
 
@@ -884,7 +1739,7 @@ static viewmat_eye viewmat_get_hmd_oculus(float viewmatrix[16], int viewportID)
 		                    eye_rdesc[eye].HmdToEyeViewOffset.z); // forward/back offset
 
 		float pos[3] = { 0,0,0 };
-		vrpn_get(viewmat_vrpn_obj, NULL, pos, rotMat);
+		vrpn_get_predicted(viewmat_vrpn_obj, NULL, viewmat_photon_time(), pos, rotMat);
 		mat4f_translate_new(posMat, -pos[0], -pos[1], -pos[2]); // position
 		viewmat_fix_rotation(rotMat);
 	}
@@ -959,7 +1814,7 @@ static viewmat_eye viewmat_get_ivs(float viewmatrix[16], float frustum[6])
 		{
 			/* get information from vrpn */
 			float orient[16];
-			vrpn_get(viewmat_vrpn_obj, NULL, pos, orient);
+			vrpn_get_predicted(viewmat_vrpn_obj, NULL, viewmat_photon_time(), pos, orient);
 		}
 		else
 		{
@@ -1208,7 +2063,7 @@ void viewmat_get_viewport(int viewportValue[4], int viewportNum)
 
 	/* Copy the viewport into the location the caller provided. */
 	for(int i=0; i<4; i++)
-		viewportValue[i] = viewports[viewportNum][i];
+		viewportValue[i] = viewmat_dynres_apply(viewports[viewportNum][i]);
 
 }
 
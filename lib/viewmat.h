@@ -22,6 +22,41 @@
     will be placed on the user's head. Currently only used in "ivs"
     mode.
 
+    VIEWMAT_MSAA_SAMPLES="2" - Number of multisample antialiasing
+    samples used when rendering each eye for the Oculus. Use 0 to
+    render directly into the textures given to libovr.
+
+    VIEWMAT_RESOLVE="color" - Buffers that are copied out of the
+    multisampled Oculus framebuffers at the end of each frame. May
+    contain "color", "depth" and "stencil" (e.g., "color,depth").
+
+    VIEWMAT_PROFILE="1" - Measure how long the CPU and GPU spend on
+    each part of a frame (see viewmat_profile_percentile()).
+
+    VIEWMAT_SINGLE_PASS="1" - Render both eyes with one set of draw
+    calls in the side-by-side stereo modes (see
+    viewmat_single_pass()).
+
+    VIEWMAT_PREDICT="auto" - Predict the pose of tracked objects for
+    the time that the frame will be displayed. "auto" predicts one
+    frame interval past viewmat_begin_frame(), a number predicts that
+    many milliseconds ahead.
+
+    VIEWMAT_DYNAMIC_RESOLUTION="10" - Render a smaller part of each
+    viewport when the GPU needs more than this many milliseconds per
+    frame and stretch it over the viewport at the end of the frame
+    (see viewmat_resolution_scale()). Viewports are then rendered into
+    a framebuffer, so programs that bind their own framebuffers should
+    switch back with viewmat_get_framebuffer() instead of binding
+    framebuffer 0.
+
+    VIEWMAT_RESOLUTION_MIN="0.5" and VIEWMAT_RESOLUTION_MAX="1" - The
+    smallest and largest fraction of the width and height of each
+    viewport that dynamic resolution renders.
+
+    VIEWMAT_RESOLUTION_LOCK="1" - Always render this fraction of each
+    viewport (see viewmat_resolution_lock()).
+
     @author Scott Kuhl
  */
 
@@ -36,12 +71,37 @@ typedef enum { VIEWMAT_EYE_LEFT,    /*< Right eye viewport */
                VIEWMAT_EYE_MIDDLE,  /*< Single viewport */
                VIEWMAT_EYE_UNKNOWN } viewmat_eye;
 
+/** Parts of a frame that are timed by the viewmat profiler (see
+ * viewmat_profile_percentile()). */
+typedef enum { VIEWMAT_PROFILE_FRAME, /*< viewmat_begin_frame() until the buffers are swapped */
+               VIEWMAT_PROFILE_PREP,  /*< viewmat_begin_frame() until the first viewmat_begin_eye() */
+               VIEWMAT_PROFILE_EYE0,  /*< Drawing viewport 0 */
+               VIEWMAT_PROFILE_EYE1,  /*< Drawing viewport 1 */
+               VIEWMAT_PROFILE_EYE2,  /*< Drawing viewport 2 */
+               VIEWMAT_PROFILE_EYE3,  /*< Drawing viewport 3 */
+               VIEWMAT_PROFILE_END,   /*< viewmat_end_frame(): resolving, compositing and swapping */
+               VIEWMAT_PROFILE_STAGES } viewmat_profile_stage;
+
 void viewmat_window_size(int *width, int *height);
 
 void viewmat_begin_frame(void);
 void viewmat_begin_eye(int viewportID);
 int viewmat_get_blitted_framebuffer(int viewportID);
+int viewmat_get_framebuffer(int viewportID);
 void viewmat_end_frame(void);
+float viewmat_resolve_time(void);
+float viewmat_resolution_scale(void);
+void viewmat_resolution_lock(float scale);
+
+void viewmat_profile_enable(int enable);
+const char* viewmat_profile_stage_name(viewmat_profile_stage stage);
+float viewmat_profile_percentile(viewmat_profile_stage stage, int gpu, float percentile);
+void viewmat_profile_string(char *str, int size);
+
+int viewmat_single_pass(void);
+void viewmat_get_stereo(float viewmatrix[2][16], float projmatrix[2][16]);
+void viewmat_begin_stereo(void);
+void viewmat_end_stereo(void);
 	
 void viewmat_init(float pos[3], float look[3], float up[3]);
 viewmat_eye viewmat_get(float viewmatrix[16], float projmatrix[16], int viewportNum);
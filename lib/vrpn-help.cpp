@@ -9,7 +9,6 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
-#include <map>
 #include <string>
 
 #ifndef MISSING_VRPN
@@ -26,17 +25,51 @@
 #include "kuhl-util.h"
 #include "vecmat.h"
 #include "kalman.h"
+#include "vrpn-help.h"
+#include "trace.h"
 
 #ifndef MISSING_VRPN
 
+#include <pthread.h>
+#include <atomic>
 
-/** A mapping of object\@tracker strings to vrpn_Tracker_Remote objects
- * so we can quickly find the appropriate object given an
- * object\@tracker string. */
-std::map<std::string, vrpn_Tracker_Remote*> nameToTracker;
-/** A mapping of object\@tracker strings to the data that the callback
- * functions store the data into. */
-std::map<std::string, vrpn_TRACKERCB> nameToCallbackData;
+#define VRPN_MAX_OBJECTS 64 /**< Maximum number of object\@tracker strings that can be tracked */
+#define VRPN_POLL_USEC 1000 /**< Microseconds that the tracker thread sleeps between polling all trackers */
+#define VRPN_CLOCK_DRIFT 0.001 /**< How quickly the estimated clock offset may grow (fraction of the difference per record) */
+#define VRPN_CLOCK_SYNCED 1000000 /**< Assume our clock matches the tracker's clock if they differ by less than this many microseconds */
+
+/** An object\@tracker that the tracker thread receives data for. */
+typedef struct
+{
+	std::string fullname;  /**< object\@hostname */
+	std::string hostname;
+	const char *object;    /**< The object name that was passed to vrpn_register() */
+	const char *requestedHost; /**< The hostname that was passed to vrpn_register() (NULL if the ~/.vrpn-server file was used) */
+	vrpn_Tracker_Remote *tkr; /**< Only used by the tracker thread */
+	int failed;            /**< Tracker thread couldn't connect to the server */
+
+	/** Difference between our clock and the tracker's timestamps
+	 * (microseconds). Only used by the tracker thread. */
+	long clockOffset;
+	int hasClockOffset;
+
+	/** Seqlock that protects hasData, data and filter. The tracker
+	 * thread makes it odd while it writes and even when the data is
+	 * consistent. */
+	std::atomic<unsigned int> seq;
+	int hasData;
+	vrpn_TRACKERCB data;
+	kalman_pose_state filter; /**< Used to predict the pose (times are on our clock) */
+} vrpn_object;
+
+/** Objects that have been requested. Objects are only added (by
+ * vrpn_register()) and never removed so that vrpn_get_handle() can
+ * read them without locking. */
+static vrpn_object *vrpn_objects[VRPN_MAX_OBJECTS];
+static std::atomic<int> vrpn_object_count(0);
+static pthread_mutex_t vrpn_register_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t vrpn_thread;
+static int vrpn_thread_started = 0;
 
 static kuhl_fps_state fps_state;
 static kalman_state kalman;
@@ -55,9 +88,11 @@ static void smooth(vrpn_TRACKERCB &t)
 /** A callback function that will get called whenever the tracker
  * provides us with new data. This may be called repeatedly for each
  * record that we have missed if many records have been delivered
- * since the last call to the VRPN mainloop() function. */
-static void VRPN_CALLBACK handle_tracker(void *name, vrpn_TRACKERCB t)
+ * since the last call to the VRPN mainloop() function. It is called
+ * on the tracker thread. */
+static void VRPN_CALLBACK handle_tracker(void *userdata, vrpn_TRACKERCB t)
 {
+	vrpn_object *obj = (vrpn_object*) userdata;
 	float fps = kuhl_getfps(&fps_state);
 	if(fps_state.frame == 0)
 		msg(INFO, "VRPN records per second: %.1f\n", fps);
@@ -79,11 +114,104 @@ static void VRPN_CALLBACK handle_tracker(void *name, vrpn_TRACKERCB t)
 	
 	if(vec3f_norm(pos) > 100)
 		return;
-	
-	// Store the data in our map so that someone can use it later.
-	std::string s = (char*)name;
-	nameToCallbackData[s] = t;
-	smooth(nameToCallbackData[s]);
+
+	smooth(t);
+
+	/* If the tracker's clock is close to ours, assume that they are
+	 * synchronized (e.g., with NTP) so that the time the record
+	 * spent in the network is compensated for. Otherwise, the
+	 * smallest difference between when a record arrives and its
+	 * timestamp is our best guess of the offset between the clocks
+	 * (plus the minimum network delay). Let the offset grow slowly in
+	 * case the clocks drift apart. */
+	long offset = kuhl_microseconds() - microseconds;
+	if(labs(offset) < VRPN_CLOCK_SYNCED)
+		obj->clockOffset = 0;
+	else if(!obj->hasClockOffset || offset < obj->clockOffset)
+	{
+		obj->clockOffset = offset;
+		obj->hasClockOffset = 1;
+	}
+	else
+		obj->clockOffset += (long) ((offset - obj->clockOffset) * VRPN_CLOCK_DRIFT);
+
+	/* Publish the data so that someone can use it later. */
+	unsigned int seq = obj->seq.load(std::memory_order_relaxed);
+	obj->seq.store(seq+1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	obj->data = t;
+	obj->hasData = 1;
+	kalman_pose_update(&(obj->filter), t.pos, t.quat, microseconds + obj->clockOffset);
+	obj->seq.store(seq+2, std::memory_order_release);
+}
+
+/** Connects to the tracker for an object. Called on the tracker
+ * thread because VRPN connections are shared between trackers and
+ * are not thread safe. */
+static void vrpn_connect(vrpn_object *obj)
+{
+	msg(INFO, "Connecting to VRPN server: %s\n", obj->hostname.c_str());
+	// If we are making a TCP connection and the server isn't up, the following function call may hang for a long time
+	vrpn_Connection *connection = vrpn_get_connection_by_name(obj->hostname.c_str());
+
+	/* Wait for a bit to see if we can connect. Sometimes we don't immediately connect! */
+	for(int i=0; i<1000 && !connection->connected(); i++)
+	{
+		usleep(1000); // 1000 microseconds * 1000 = up to 1 second of waiting.
+		connection->mainloop();
+	}
+	/* If connection failed, give up on this object. */
+	if(!connection->connected())
+	{
+		delete connection;
+		msg(ERROR, "Failed to connect to tracker: %s\n", obj->fullname.c_str());
+		obj->failed = 1;
+		return;
+	}
+	obj->tkr = new vrpn_Tracker_Remote(obj->fullname.c_str(), connection);
+	obj->tkr->register_change_handler(obj, handle_tracker);
+}
+
+/** The tracker thread continuously runs the VRPN main loop for all
+ * of the trackers so that tracker I/O never happens on the render
+ * thread. */
+static void* vrpn_thread_main(void *arg)
+{
+	kuhl_getfps_init(&fps_state);
+	kalman_initialize(&kalman, 0.1, 0.1);
+	while(1)
+	{
+		int count = vrpn_object_count.load(std::memory_order_acquire);
+		for(int i=0; i<count; i++)
+		{
+			vrpn_object *obj = vrpn_objects[i];
+			if(obj->tkr == NULL && !obj->failed)
+				vrpn_connect(obj);
+			if(obj->tkr != NULL)
+				obj->tkr->mainloop();
+		}
+		usleep(VRPN_POLL_USEC);
+	}
+	return NULL;
+}
+
+/** Finds an object that was already registered.
+ * @return The handle of the object or -1 if it isn't registered. */
+static int vrpn_find(const char *object, const char *hostname)
+{
+	if(object == NULL)
+		return -1;
+	int count = vrpn_object_count.load(std::memory_order_acquire);
+	for(int i=0; i<count; i++)
+	{
+		const vrpn_object *obj = vrpn_objects[i];
+		if(strcmp(obj->object, object) != 0)
+			continue;
+		if(hostname == NULL ? obj->requestedHost == NULL :
+		   obj->requestedHost != NULL && strcmp(obj->requestedHost, hostname) == 0)
+			return i;
+	}
+	return -1;
 }
 
 #endif
@@ -134,8 +262,10 @@ char* vrpn_default_host()
 
 
 
-/** Uses the VRPN library to get the position and orientation of a
- * tracked object.
+/** Starts tracking an object. The first time this is called, a
+ * thread is started which receives data from the trackers in the
+ * background. Calling this function again with the same object and
+ * hostname returns the same handle.
  *
  * @param object The name of the object being tracked.
  *
@@ -143,155 +273,280 @@ char* vrpn_default_host()
  * tracking system computer. If hostname is set to NULL, the
  * ~/.vrpn-server file is consulted.
  *
- * @param pos An array to be filled in with the position information
- * for the tracked object. If we are unable to track the object, a
- * message may be printed and pos will be set to a fixed value.
- *
- * @param orient An array to be filled in with the orientation matrix
- * for the tracked object. The orientation matrix is in row-major
- * order can be used with OpenGL. If the tracking system is moving an
- * object around on the screen, this matrix can be used directly. If
- * the tracking system is moving the OpenGL camera, this matrix may
- * need to be inverted. If we are unable to track the object, a
- * message may be printed and orient will be set to the identity
- * matrix.
- *
- * @return 1 if we returned data from the tracker. 0 if there was
- * problems connecting to the tracker.
+ * @return A handle that can be passed to vrpn_get_handle() or -1 if
+ * the object can't be tracked.
  */
-int vrpn_get(const char *object, const char *hostname, float pos[3], float orient[16])
+int vrpn_register(const char *object, const char *hostname)
 {
-	/* Set to default values */
-	vec3f_set(pos, 10000,10000,10000);
-	mat4f_identity(orient);
 #ifdef MISSING_VRPN
 	printf("You are missing VRPN support.\n");
-	return 0;
+	return -1;
 #else
 	if(object == NULL || strlen(object) == 0)
 	{
 		msg(WARNING, "Empty or NULL object name was passed into this function.\n");
-		return 0;
+		return -1;
 	}
 	if(hostname != NULL && strlen(hostname) == 0)
 	{
 		msg(WARNING, "Hostname is an empty string.\n");
-		return 0;
+		return -1;
 	}
-	
+
+	pthread_mutex_lock(&vrpn_register_mutex);
+	int handle = vrpn_find(object, hostname);
+	if(handle >= 0)
+	{
+		pthread_mutex_unlock(&vrpn_register_mutex);
+		return handle;
+	}
+	int count = vrpn_object_count.load(std::memory_order_relaxed);
+	if(count == VRPN_MAX_OBJECTS)
+	{
+		pthread_mutex_unlock(&vrpn_register_mutex);
+		msg(ERROR, "Can't track more than %d objects with VRPN.\n", VRPN_MAX_OBJECTS);
+		return -1;
+	}
+
 	/* Construct an object@hostname string. */
 	std::string hostnamecpp;
-	std::string objectcpp;
 	if(hostname == NULL)
 	{
 		char *hostnameInFile = vrpn_default_host();
 		if(hostnameInFile)
+		{
 			hostnamecpp = hostnameInFile;
+			free(hostnameInFile);
+		}
 		else
 		{
 			msg(ERROR, "Failed to find hostname of VRPN server.\n");
 			exit(EXIT_FAILURE);
 		}
-		
 	}
 	else
 		hostnamecpp = hostname;
 
-	objectcpp = object;
-	std::string fullname = objectcpp + "@" + hostnamecpp;
+	vrpn_object *obj = new vrpn_object();
+	obj->hostname = hostnamecpp;
+	obj->fullname = std::string(object) + "@" + hostnamecpp;
+	obj->object = strdup(object);
+	obj->requestedHost = hostname ? strdup(hostname) : NULL;
+	obj->tkr = NULL;
+	obj->failed = 0;
+	obj->clockOffset = 0;
+	obj->hasClockOffset = 0;
+	obj->seq.store(0, std::memory_order_relaxed);
+	obj->hasData = 0;
+	kalman_pose_initialize(&(obj->filter), 0.001, 10);
+	vrpn_objects[count] = obj;
+	vrpn_object_count.store(count+1, std::memory_order_release);
 
-	/* Check if we have a tracker object for that string in our map. */
-	if(nameToTracker.count(fullname))
+	if(!vrpn_thread_started)
 	{
-		/* If we already have a tracker object, ask it to run the main
-		 * loop (and therefore call our handle_tracker() function if
-		 * there is new data). */
-		nameToTracker[fullname]->mainloop();
-
-		/* If our callback has been called, get the callback object
-		 * and get the data out of it. */
-		if(nameToCallbackData.count(fullname))
+		if(pthread_create(&vrpn_thread, NULL, vrpn_thread_main, NULL) != 0)
 		{
-			vrpn_TRACKERCB t = nameToCallbackData[fullname];
-			float pos4[4];
-			for(int i=0; i<3; i++)
-				pos4[i] = t.pos[i];
-			pos4[3]=1;
-
-			double orientd[16];
-			// Convert quaternion into orientation matrix.
-			q_to_ogl_matrix(orientd, t.quat);
-			for(int i=0; i<16; i++)
-				orient[i] = (float) orientd[i];
-
-			/* VICON in the MTU IVS lab is typically calibrated so that:
-			 * X = points to the right (while facing screen)
-			 * Y = points into the screen
-			 * Z = up
-			 * (left-handed coordinate system)
-			 *
-			 * PPT is typically calibrated so that:
-			 * X = the points to the wall that has two closets at both corners
-			 * Y = up
-			 * Z = points to the door
-			 * (right-handed coordinate system)
-			 *
-			 * By default, OpenGL assumes that:
-			 * X = points to the right (while facing screen in the IVS lab)
-			 * Y = up
-			 * Z = points OUT of the screen (i.e., -Z points into the screen in te IVS lab)
-			 * (right-handed coordinate system)
-			 *
-			 * Below, we convert the position and orientation
-			 * information into the OpenGL convention.
-			 */
-			if(strlen(hostnamecpp.c_str()) > 14 && strncmp(hostnamecpp.c_str(), "tcp://141.219.", 14) == 0) // MTU vicon tracker
-			{
-				float viconTransform[16] = { 1,0,0,0,  // column major order!
-				                             0,0,-1,0,
-				                             0,1,0,0,
-				                             0,0,0,1 };
-				mat4f_mult_mat4f_new(orient, viconTransform, orient);
-				mat4f_mult_vec4f_new(pos4, viconTransform, pos4);
-				vec3f_copy(pos,pos4);
-				return 1; // we successfully collected some data
-			}
-			else // Non-Vicon tracker
-			{
-				/* Don't transform other tracking systems */
-				// orient is already filled in
-				vec3f_copy(pos, pos4);
-				return 1; // we successfully collected some data
-			}
+			msg(FATAL, "Failed to create VRPN tracker thread.\n");
+			exit(EXIT_FAILURE);
 		}
+		pthread_detach(vrpn_thread);
+		vrpn_thread_started = 1;
 	}
-	else
-	{
-		/* If this is our first time, create a tracker for the object@hostname string, register the callback handler. */
-		msg(INFO, "Connecting to VRPN server: %s\n", hostnamecpp.c_str());
-		// If we are making a TCP connection and the server isn't up, the following function call may hang for a long time
-		vrpn_Connection *connection = vrpn_get_connection_by_name(hostnamecpp.c_str());
+	pthread_mutex_unlock(&vrpn_register_mutex);
+	return count;
+#endif
+}
 
-		/* Wait for a bit to see if we can connect. Sometimes we don't immediately connect! */
-		for(int i=0; i<1000 && !connection->connected(); i++)
-		{
-		    usleep(1000); // 1000 microseconds * 1000 = up to 1 second of waiting.
-		    connection->mainloop();
-		}
-		/* If connection failed, exit. */
-		if(!connection->connected())
-		{
-		    delete connection;
-		    msg(ERROR, "Failed to connect to tracker: %s\n", fullname.c_str());
-		    return 0;
-		}
-		vrpn_Tracker_Remote *tkr = new vrpn_Tracker_Remote(fullname.c_str(), connection);
-		nameToTracker[fullname] = tkr;
-		tkr->register_change_handler((void*) fullname.c_str(), handle_tracker);
-		kuhl_getfps_init(&fps_state);
-		kalman_initialize(&kalman, 0.1, 0.1);
+/** Gets the latest position and orientation of an object that was
+ * registered with vrpn_register(). This function never waits for the
+ * tracker thread or for the network.
+ *
+ * @param handle The value returned by vrpn_register().
+ *
+ * @param pos An array to be filled in with the position information
+ * for the tracked object. If we are unable to track the object, a
+ * message may be printed and pos will be set to a fixed value.
+ *
+ * @param orient An array to be filled in with the orientation matrix
+ * for the tracked object (see vrpn_get()).
+ *
+ * @return 1 if we returned data from the tracker. 0 if no data has
+ * been received yet or if there was problems connecting to the tracker.
+ */
+int vrpn_get_handle(int handle, float pos[3], float orient[16])
+{
+	return vrpn_get_handle_predicted(handle, 0, pos, orient);
+}
+
+/** Same as vrpn_get_handle() except that the position and
+ * orientation are predicted for a time in the near future (or
+ * past). The prediction uses the timestamps of the tracker records,
+ * so it accounts for the time that the data spent in the network
+ * and waiting for us. Typically, the time should be when the frame
+ * that is being rendered will be displayed.
+ *
+ * @param handle The value returned by vrpn_register().
+ *
+ * @param microseconds The time (see kuhl_microseconds()) to predict
+ * the pose for. 0 returns the latest data without prediction.
+ *
+ * @param pos Set to the predicted position.
+ *
+ * @param orient Set to the predicted orientation matrix.
+ *
+ * @return 1 if we returned data from the tracker, 0 otherwise.
+ */
+int vrpn_get_handle_predicted(int handle, long microseconds, float pos[3], float orient[16])
+{
+	/* Set to default values */
+	vec3f_set(pos, 10000,10000,10000);
+	mat4f_identity(orient);
+#ifdef MISSING_VRPN
+	return 0;
+#else
+	if(handle < 0 || handle >= vrpn_object_count.load(std::memory_order_acquire))
+		return 0;
+	const vrpn_object *obj = vrpn_objects[handle];
+
+	/* Copy the data out of the seqlock, retrying if the tracker
+	 * thread changed it while we were copying. */
+	vrpn_TRACKERCB t;
+	kalman_pose_state filter;
+	unsigned int seq1, seq2;
+	int hasData;
+	do {
+		seq1 = obj->seq.load(std::memory_order_acquire);
+		hasData = obj->hasData;
+		t = obj->data;
+		if(microseconds != 0)
+			filter = obj->filter;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		seq2 = obj->seq.load(std::memory_order_relaxed);
+	} while(seq1 != seq2 || (seq1 & 1));
+	if(!hasData)
+		return 0;
+
+	if(microseconds != 0)
+		kalman_pose_predict(&filter, microseconds, t.pos, t.quat);
+
+	float pos4[4];
+	for(int i=0; i<3; i++)
+		pos4[i] = t.pos[i];
+	pos4[3]=1;
+
+	double orientd[16];
+	// Convert quaternion into orientation matrix.
+	q_to_ogl_matrix(orientd, t.quat);
+	for(int i=0; i<16; i++)
+		orient[i] = (float) orientd[i];
+
+	/* VICON in the MTU IVS lab is typically calibrated so that:
+	 * X = points to the right (while facing screen)
+	 * Y = points into the screen
+	 * Z = up
+	 * (left-handed coordinate system)
+	 *
+	 * PPT is typically calibrated so that:
+	 * X = the points to the wall that has two closets at both corners
+	 * Y = up
+	 * Z = points to the door
+	 * (right-handed coordinate system)
+	 *
+	 * By default, OpenGL assumes that:
+	 * X = points to the right (while facing screen in the IVS lab)
+	 * Y = up
+	 * Z = points OUT of the screen (i.e., -Z points into the screen in te IVS lab)
+	 * (right-handed coordinate system)
+	 *
+	 * Below, we convert the position and orientation
+	 * information into the OpenGL convention.
+	 */
+	const char *hostname = obj->hostname.c_str();
+	if(strlen(hostname) > 14 && strncmp(hostname, "tcp://141.219.", 14) == 0) // MTU vicon tracker
+	{
+		float viconTransform[16] = { 1,0,0,0,  // column major order!
+		                             0,0,-1,0,
+		                             0,1,0,0,
+		                             0,0,0,1 };
+		mat4f_mult_mat4f_new(orient, viconTransform, orient);
+		mat4f_mult_vec4f_new(pos4, viconTransform, pos4);
+		vec3f_copy(pos,pos4);
+		return 1; // we successfully collected some data
+	}
+	else // Non-Vicon tracker
+	{
+		/* Don't transform other tracking systems */
+		// orient is already filled in
+		vec3f_copy(pos, pos4);
+		return 1; // we successfully collected some data
 	}
+#endif
+}
+
+/** Uses the VRPN library to get the position and orientation of a
+ * tracked object. The data is received by a background thread (see
+ * vrpn_register()), so this function returns the most recent data
+ * without waiting. It will return 0 for the first few calls while
+ * the thread connects to the tracker.
+ *
+ * @param object The name of the object being tracked.
+ *
+ * @param hostname The IP address or hostname of the VRPN server or
+ * tracking system computer. If hostname is set to NULL, the
+ * ~/.vrpn-server file is consulted.
+ *
+ * @param pos An array to be filled in with the position information
+ * for the tracked object. If we are unable to track the object, a
+ * message may be printed and pos will be set to a fixed value.
+ *
+ * @param orient An array to be filled in with the orientation matrix
+ * for the tracked object. The orientation matrix is in row-major
+ * order can be used with OpenGL. If the tracking system is moving an
+ * object around on the screen, this matrix can be used directly. If
+ * the tracking system is moving the OpenGL camera, this matrix may
+ * need to be inverted. If we are unable to track the object, a
+ * message may be printed and orient will be set to the identity
+ * matrix.
+ *
+ * @return 1 if we returned data from the tracker. 0 if there was
+ * problems connecting to the tracker.
+ */
+int vrpn_get(const char *object, const char *hostname, float pos[3], float orient[16])
+{
+	TRACE_SCOPE("vrpn_get");
+#ifdef MISSING_VRPN
+	/* Set to default values */
+	vec3f_set(pos, 10000,10000,10000);
+	mat4f_identity(orient);
+	printf("You are missing VRPN support.\n");
 	return 0;
+#else
+	int handle = vrpn_find(object, hostname);
+	if(handle < 0)
+		handle = vrpn_register(object, hostname);
+	return vrpn_get_handle(handle, pos, orient);
+#endif
+}
+
+/** Same as vrpn_get() except the pose is predicted for a specific
+ * time. See vrpn_get_handle_predicted().
+ *
+ * @param object The name of the object being tracked.
+ * @param hostname The VRPN server (NULL to use ~/.vrpn-server).
+ * @param microseconds The time to predict the pose for (0 for no prediction).
+ * @param pos Set to the predicted position.
+ * @param orient Set to the predicted orientation matrix.
+ * @return 1 if we returned data from the tracker, 0 otherwise.
+ */
+int vrpn_get_predicted(const char *object, const char *hostname, long microseconds, float pos[3], float orient[16])
+{
+#ifdef MISSING_VRPN
+	return vrpn_get(object, hostname, pos, orient);
+#else
+	int handle = vrpn_find(object, hostname);
+	if(handle < 0)
+		handle = vrpn_register(object, hostname);
+	return vrpn_get_handle_predicted(handle, microseconds, pos, orient);
 #endif
 }
 
@@ -10,6 +10,10 @@
  * the position and orientation of a tracked point from a VRPN
  * server. The VRPN library itself uses C++.
  *
+ * A background thread receives data from the VRPN servers and
+ * publishes the latest position and orientation of each object, so
+ * vrpn_get() never waits for the network.
+ *
  * For more information about VRPN, see:
  * http://www.cs.unc.edu/Research/vrpn/
  *
@@ -24,6 +28,10 @@ extern "C" {
 #endif
 
 int vrpn_get(const char *object, const char *hostname, float pos[3], float orient[16]);
+int vrpn_register(const char *object, const char *hostname);
+int vrpn_get_handle(int handle, float pos[3], float orient[16]);
+int vrpn_get_predicted(const char *object, const char *hostname, long microseconds, float pos[3], float orient[16]);
+int vrpn_get_handle_predicted(int handle, long microseconds, float pos[3], float orient[16]);
 char* vrpn_default_host();
 	
 #ifdef __cplusplus
@@ -0,0 +1,1020 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ *
+ * Builds tile pyramids and streams the visible tiles into an atlas
+ * texture. See vtex.h for details.
+ *
+ * A .vtex file contains a vtex_header followed by every tile of
+ * every level (level 0 first, each level in row-major order starting
+ * at the bottom). Each tile is VTEX_TILE pixels square and has a
+ * VTEX_BORDER pixel border copied from its neighbors so that
+ * filtering doesn't show seams between tiles in the atlas. Tiles are
+ * stored as compressed blocks so that they can be copied into the
+ * atlas with glCompressedTexSubImage2D().
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h> // strcasecmp()
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <GL/glew.h>
+
+#include "vtex.h"
+#include "texcache.h"
+#include "kuhl-util.h"
+#include "kuhl-nodep.h"
+#include "msg.h"
+#include "trace.h"
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+#include "imageio.h"
+#else
+#include "stb_image.h"
+#endif
+
+#define VTEX_MAGIC "KUHLVTX"
+#define VTEX_VERSION 1
+#define VTEX_TILE 256 /**< Size of a tile (including its border) in pixels */
+#define VTEX_BORDER 1 /**< Pixels on each side of a tile that are copied from its neighbors */
+#define VTEX_CONTENT (VTEX_TILE-2*VTEX_BORDER) /**< Pixels of the image in each tile */
+#define VTEX_MAX_LEVELS 24
+#define VTEX_MAX_PENDING 64 /**< Most tiles that can be waiting to be read or uploaded */
+#define VTEX_BUCKETS 1024 /**< Size of the hash table that tiles are found with */
+#define VTEX_UPLOAD_BUDGET 2000 /**< Microseconds that vtex_visible() spends copying tiles into the atlas */
+
+/** The start of a .vtex file. */
+typedef struct
+{
+	char magic[8]; /**< VTEX_MAGIC */
+	uint32_t version; /**< VTEX_VERSION */
+	uint32_t width, height; /**< Size of the image */
+	uint32_t tileSize; /**< VTEX_TILE */
+	uint32_t border; /**< VTEX_BORDER */
+	uint32_t levels; /**< Number of levels in the pyramid */
+	uint32_t format; /**< Compressed format of the tiles */
+	char source[256]; /**< texcache_source_id() of the image the file was built from */
+} vtex_header;
+
+/** The states of a tile. */
+enum
+{
+	VTEX_QUEUED,   /**< Waiting to be read */
+	VTEX_READING,  /**< Being read by the background thread */
+	VTEX_LOADED,   /**< Read, waiting to be copied into the atlas */
+	VTEX_RESIDENT, /**< In the atlas */
+	VTEX_MISSING   /**< The tile couldn't be read */
+};
+
+/** A tile that is loading or is in the atlas. */
+typedef struct
+{
+	int level, tx, ty;
+	int state;
+	int slot; /**< Slot in the atlas (resident tiles only) */
+	unsigned char *data; /**< Compressed tile (loaded tiles only) */
+	long lastUsed; /**< Last frame the tile was needed */
+	int next; /**< Next record in the hash bucket (or in the free list) */
+} vtex_record;
+
+struct vtex
+{
+	char *filename; /**< The .vtex file */
+	char *imageFilename; /**< The image the .vtex file is built from (NULL if a .vtex file was opened) */
+	int fd;
+	int ready; /**< 1 once the pyramid is open, -1 if it couldn't be built or opened */
+	int width, height, levels;
+	GLenum format;
+	size_t tileBytes;
+	int levelWidth[VTEX_MAX_LEVELS], levelHeight[VTEX_MAX_LEVELS];
+	int levelColumns[VTEX_MAX_LEVELS], levelRows[VTEX_MAX_LEVELS];
+	long levelFirst[VTEX_MAX_LEVELS]; /**< Index of the first tile of each level in the file */
+	float levelScale[VTEX_MAX_LEVELS]; /**< Image pixels per pixel of each level */
+
+	GLuint atlas;
+	int atlasSize, slotsPerRow, slotCount;
+	int *slotRecord; /**< Record in each slot, -1 if the slot is empty */
+
+	vtex_record *records;
+	int recordCount;
+	int freeRecord; /**< First unused record */
+	int buckets[VTEX_BUCKETS];
+	int pending; /**< Tiles that are queued, being read or loaded */
+	long frame; /**< Number of times vtex_visible() has been called */
+
+	pthread_t thread;
+	pthread_mutex_t mutex; /**< Protects the records and ready */
+	pthread_cond_t cond; /**< Signaled when a tile is queued or the vtex is closed */
+	int quit;
+};
+
+
+/* ====== Building ====== */
+
+/** Most pixels that an image other than a binary PPM file can have.
+ * stb_image refuses to decode images with more than 2^30 bytes of
+ * RGBA pixels. */
+#define VTEX_MAX_DECODE_PIXELS (1L<<28)
+
+/** The image a pyramid is built from. Binary PPM files are read a
+ * row at a time so that they can be any size; other images are
+ * decoded all at once. */
+typedef struct
+{
+	int width, height;
+	int alpha; /**< 1 if any pixel isn't opaque */
+	unsigned char *image; /**< The decoded image, bottom row first (NULL for PPM files) */
+	FILE *ppm; /**< The PPM file that rows are read from */
+	off_t ppmStart; /**< Offset of the first pixel in the PPM file */
+	unsigned char *ppmRow; /**< One row of the PPM file */
+} vtex_source;
+
+/** Reads a number from the header of a PPM file, skipping any
+ * whitespace and comments in front of it.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+static int vtex_ppm_number(FILE *f, int *value)
+{
+	int c = fgetc(f);
+	while(c == '#' || c == ' ' || c == '\t' || c == '\n' || c == '\r')
+	{
+		if(c == '#')
+			while(c != '\n' && c != EOF)
+				c = fgetc(f);
+		c = fgetc(f);
+	}
+	if(c < '0' || c > '9')
+		return 0;
+	long n = 0;
+	while(c >= '0' && c <= '9' && n < 1000000000L)
+	{
+		n = n*10 + (c-'0');
+		c = fgetc(f);
+	}
+	/* A single whitespace character separates the header from the
+	 * pixels. */
+	if(c != ' ' && c != '\t' && c != '\n' && c != '\r')
+		return 0;
+	*value = (int) n;
+	return 1;
+}
+
+/** Opens an 8 bit binary (P6) PPM file so that its rows can be read
+ * one at a time.
+ *
+ * @return 1 on success, 0 if the file isn't an 8 bit binary PPM
+ * file.
+ */
+static int vtex_source_ppm(const char *filename, vtex_source *src)
+{
+	FILE *f = fopen(filename, "rb");
+	if(f == NULL)
+		return 0;
+	int maxval = 0;
+	if(fgetc(f) != 'P' || fgetc(f) != '6' ||
+	   !vtex_ppm_number(f, &src->width) || !vtex_ppm_number(f, &src->height) ||
+	   !vtex_ppm_number(f, &maxval) || maxval != 255 ||
+	   src->width <= 0 || src->height <= 0)
+	{
+		fclose(f);
+		return 0;
+	}
+	src->ppm = f;
+	src->ppmStart = ftello(f);
+	src->ppmRow = kuhl_malloc((size_t)src->width*3);
+	src->alpha = 0;
+	return 1;
+}
+
+/** Opens the image that a pyramid is built from.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+static int vtex_source_open(const char *filename, vtex_source *src)
+{
+	memset(src, 0, sizeof(vtex_source));
+	if(vtex_source_ppm(filename, src))
+		return 1;
+
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	imageio_info iioinfo;
+	iioinfo.filename   = (char*) filename;
+	iioinfo.type       = CharPixel;
+	iioinfo.map        = (char*) "RGBA";
+	iioinfo.colorspace = sRGBColorspace;
+	src->image = (unsigned char*) imagein(&iioinfo);
+	if(iioinfo.comment)
+		free(iioinfo.comment);
+	src->width  = (int)iioinfo.width;
+	src->height = (int)iioinfo.height;
+#else
+	/* stb_image checks the size of PNG and JPEG images while it
+	 * reads the header, so stbi_info() also fails if they are too
+	 * large. */
+	int comp = -1;
+	if(!stbi_info(filename, &src->width, &src->height, &comp) ||
+	   (long)src->width*src->height > VTEX_MAX_DECODE_PIXELS)
+	{
+		msg(ERROR, "Unable to read '%s' (%s). Images with more than %ld megapixels can't be decoded at once and must be converted to a binary PPM (P6) file, which is read a row at a time.\n",
+		    filename, src->width > 0 ? "too large" : stbi_failure_reason(), VTEX_MAX_DECODE_PIXELS/(1024*1024));
+		return 0;
+	}
+	stbi_set_flip_vertically_on_load(1);
+	src->image = (unsigned char*) stbi_load(filename, &src->width, &src->height, &comp, STBI_rgb_alpha);
+#endif
+	if(src->image == NULL)
+	{
+		msg(ERROR, "Unable to read '%s'.\n", filename);
+		return 0;
+	}
+	for(size_t i=0; i<(size_t)src->width*src->height && !src->alpha; i++)
+		if(src->image[i*4+3] != 255)
+			src->alpha = 1;
+	return 1;
+}
+
+/** Copies row y (0 is the bottom row) of the image into rgba as RGBA
+ * pixels.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+static int vtex_source_row(vtex_source *src, int y, unsigned char *rgba)
+{
+	size_t w = src->width;
+	if(src->image)
+	{
+		memcpy(rgba, src->image + (size_t)y*w*4, w*4);
+		return 1;
+	}
+	/* PPM files store the top row first. */
+	off_t offset = src->ppmStart + (off_t)(src->height-1-y) * (off_t)(w*3);
+	if(fseeko(src->ppm, offset, SEEK_SET) != 0 ||
+	   fread(src->ppmRow, 1, w*3, src->ppm) != w*3)
+		return 0;
+	for(size_t x=0; x<w; x++)
+	{
+		memcpy(rgba + x*4, src->ppmRow + x*3, 3);
+		rgba[x*4+3] = 255;
+	}
+	return 1;
+}
+
+static void vtex_source_close(vtex_source *src)
+{
+	free(src->image);
+	free(src->ppmRow);
+	if(src->ppm)
+		fclose(src->ppm);
+}
+
+/** Computes the size of each level of a pyramid. Each level is half
+ * the size of the previous one and the last level fits in one
+ * tile.
+ *
+ * @return The number of levels.
+ */
+static int vtex_levels(int width, int height, int *levelWidth, int *levelHeight)
+{
+	int levels = 0;
+	int w = width, h = height;
+	for(;;)
+	{
+		levelWidth[levels] = w;
+		levelHeight[levels] = h;
+		levels++;
+		if((w <= VTEX_CONTENT && h <= VTEX_CONTENT) || levels == VTEX_MAX_LEVELS)
+			break;
+		w = w > 1 ? w/2 : 1;
+		h = h > 1 ? h/2 : 1;
+	}
+	return levels;
+}
+
+/** The rows of one level of a pyramid that is being built. Each
+ * level only keeps the rows that the next row of tiles needs. */
+typedef struct
+{
+	int width, height, columns, rows;
+	long first; /**< Index of the first tile of the level in the file */
+	int bufferRows; /**< Number of rows in buffer */
+	unsigned char *buffer; /**< Row y of the level is row y%bufferRows of the buffer */
+	int nextRow; /**< Next row of tiles to write */
+} vtex_strip;
+
+static unsigned char* vtex_strip_row(const vtex_strip *s, int y)
+{
+	y = y < 0 ? 0 : (y >= s->height ? s->height-1 : y);
+	return s->buffer + (size_t)(y % s->bufferRows) * s->width * 4;
+}
+
+/** Compresses and writes the tiles of the next row of tiles of a
+ * level. All of the rows that the tiles cover (including their
+ * border) must be in the strip.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+static int vtex_write_tiles(vtex_strip *s, int alpha, unsigned char *tile, unsigned char *blocks, size_t tileBytes, FILE *f)
+{
+	int ty = s->nextRow++;
+	for(int tx=0; tx<s->columns; tx++)
+	{
+		/* Copy the tile and its border, repeating the edge of the
+		 * image where the tile extends past it. */
+		for(int y=0; y<VTEX_TILE; y++)
+		{
+			const unsigned char *row = vtex_strip_row(s, ty*VTEX_CONTENT + y - VTEX_BORDER);
+			for(int x=0; x<VTEX_TILE; x++)
+			{
+				int sx = tx*VTEX_CONTENT + x - VTEX_BORDER;
+				sx = sx < 0 ? 0 : (sx >= s->width ? s->width-1 : sx);
+				memcpy(tile + (y*VTEX_TILE + x)*4, row + (size_t)sx*4, 4);
+			}
+		}
+		texcache_compress_blocks(tile, VTEX_TILE, VTEX_TILE, alpha, blocks);
+		long index = s->first + (long) ty * s->columns + tx;
+		off_t offset = (off_t) sizeof(vtex_header) + (off_t) index * tileBytes;
+		if(fseeko(f, offset, SEEK_SET) != 0 || fwrite(blocks, 1, tileBytes, f) != tileBytes)
+			return 0;
+	}
+	return 1;
+}
+
+/** Builds a pyramid file. See vtex_build(). Stops early if quit
+ * becomes nonzero.
+ *
+ * The image is read a row at a time. Each row is added to level 0
+ * and every second row is averaged with the previous one into a row
+ * of the next level (in the same way as texcache_downsample()), so
+ * all of the levels are built at the same time. A row of tiles is
+ * written as soon as a level has all of the rows it covers.
+ */
+static int vtex_build_internal(const char *imageFilename, const char *vtexFilename, const volatile int *quit)
+{
+	TRACE_SCOPE("vtex_build");
+	msg(INFO, "Building virtual texture %s from %s (this only happens once)\n", vtexFilename, imageFilename);
+	vtex_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VTEX_MAGIC, strlen(VTEX_MAGIC)+1);
+	header.version = VTEX_VERSION;
+	header.tileSize = VTEX_TILE;
+	header.border = VTEX_BORDER;
+	if(!texcache_source_id(header.source, sizeof(header.source), imageFilename))
+		return 0;
+
+	vtex_source src;
+	if(!vtex_source_open(imageFilename, &src))
+		return 0;
+	header.width = src.width;
+	header.height = src.height;
+	header.format = src.alpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	int levelWidth[VTEX_MAX_LEVELS], levelHeight[VTEX_MAX_LEVELS];
+	header.levels = vtex_levels(src.width, src.height, levelWidth, levelHeight);
+
+	char tmpFile[2100];
+	snprintf(tmpFile, 2100, "%s.%d.tmp", vtexFilename, (int) getpid());
+	FILE *f = fopen(tmpFile, "wb");
+	if(f == NULL)
+	{
+		msg(ERROR, "Unable to write virtual texture %s\n", tmpFile);
+		vtex_source_close(&src);
+		return 0;
+	}
+	int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+	int levels = header.levels;
+	vtex_strip strips[VTEX_MAX_LEVELS];
+	long first = 0;
+	for(int l=0; l<levels; l++)
+	{
+		vtex_strip *s = &strips[l];
+		s->width = levelWidth[l];
+		s->height = levelHeight[l];
+		s->columns = (s->width + VTEX_CONTENT-1) / VTEX_CONTENT;
+		s->rows    = (s->height + VTEX_CONTENT-1) / VTEX_CONTENT;
+		s->first = first;
+		s->bufferRows = s->height < VTEX_TILE ? s->height : VTEX_TILE;
+		s->buffer = kuhl_malloc((size_t)s->bufferRows * s->width * 4);
+		s->nextRow = 0;
+		first += (long) s->columns * s->rows;
+	}
+
+	size_t tileBytes = texcache_level_size(header.format, VTEX_TILE, VTEX_TILE);
+	unsigned char *tile = kuhl_malloc(VTEX_TILE*VTEX_TILE*4);
+	unsigned char *blocks = kuhl_malloc(tileBytes);
+	for(int row=0; ok && row<src.height; row++)
+	{
+		if(quit && *quit)
+			ok = 0;
+		if(ok && !vtex_source_row(&src, row, vtex_strip_row(&strips[0], row)))
+		{
+			msg(ERROR, "Unable to read '%s'.\n", imageFilename);
+			ok = 0;
+		}
+		int y = row;
+		for(int l=0; ok && l<levels; l++)
+		{
+			vtex_strip *s = &strips[l];
+			/* The tiles in a row of tiles cover the rows from
+			 * nextRow*VTEX_CONTENT-VTEX_BORDER to
+			 * nextRow*VTEX_CONTENT+VTEX_TILE-VTEX_BORDER-1. The
+			 * last two rows of tiles can both end at the top of the
+			 * level. */
+			while(ok && s->nextRow < s->rows)
+			{
+				int last = s->nextRow*VTEX_CONTENT + VTEX_TILE-VTEX_BORDER-1;
+				if(y != (last < s->height ? last : s->height-1))
+					break;
+				ok = vtex_write_tiles(s, src.alpha, tile, blocks, tileBytes, f);
+			}
+			if(!ok)
+				break;
+
+			/* Add a row to the next level after every second row
+			 * (or after the only row of a level that is one pixel
+			 * tall). */
+			if(l+1 == levels || (y%2 == 0 && s->height > 1))
+				break;
+			vtex_strip *n = &strips[l+1];
+			const unsigned char *r0 = vtex_strip_row(s, s->height > 1 ? y-1 : y);
+			const unsigned char *r1 = vtex_strip_row(s, y);
+			y /= 2;
+			unsigned char *out = vtex_strip_row(n, y);
+			for(int x=0; x<n->width; x++)
+			{
+				int x0 = x*2 < s->width ? x*2 : s->width-1;
+				int x1 = x*2+1 < s->width ? x*2+1 : s->width-1;
+				for(int c=0; c<4; c++)
+				{
+					int sum = r0[x0*4+c] + r0[x1*4+c] + r1[x0*4+c] + r1[x1*4+c];
+					out[x*4+c] = (unsigned char)((sum+2)/4);
+				}
+			}
+		}
+	}
+	for(int l=0; l<levels; l++)
+		free(strips[l].buffer);
+	free(tile);
+	free(blocks);
+	vtex_source_close(&src);
+
+	if(fclose(f) != 0)
+		ok = 0;
+	if(!ok || rename(tmpFile, vtexFilename) != 0)
+	{
+		if(!(quit && *quit))
+			msg(ERROR, "Failed to write virtual texture %s\n", vtexFilename);
+		unlink(tmpFile);
+		return 0;
+	}
+	return 1;
+}
+
+/** Cuts an image into a pyramid of compressed tiles and writes them
+ * to a file. vtex_open() calls this automatically when needed, but
+ * it can also be called ahead of time (for example, to prepare
+ * images for a slideshow).
+ *
+ * @param imageFilename The image.
+ *
+ * @param vtexFilename The file to write.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+int vtex_build(const char *imageFilename, const char *vtexFilename)
+{
+	return vtex_build_internal(imageFilename, vtexFilename, NULL);
+}
+
+/** Opens a pyramid file and reads its header.
+ *
+ * @param source If not NULL, the file is only used if it was built
+ * from an image with this texcache_source_id().
+ *
+ * @return 1 on success, 0 if the file is missing, out of date or
+ * invalid.
+ */
+static int vtex_open_file(vtex *vt, const char *source)
+{
+	int fd = open(vt->filename, O_RDONLY);
+	if(fd < 0)
+		return 0;
+	vtex_header header;
+	if(pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	   strncmp(header.magic, VTEX_MAGIC, 8) != 0 || header.version != VTEX_VERSION ||
+	   header.tileSize != VTEX_TILE || header.border != VTEX_BORDER ||
+	   texcache_level_size(header.format, VTEX_TILE, VTEX_TILE) == 0 ||
+	   header.width == 0 || header.height == 0)
+	{
+		close(fd);
+		return 0;
+	}
+	header.source[sizeof(header.source)-1] = '\0';
+	if(source && strcmp(source, header.source) != 0)
+	{
+		msg(DEBUG, "Virtual texture %s is out of date.\n", vt->filename);
+		close(fd);
+		return 0;
+	}
+
+	vt->fd = fd;
+	vt->width = header.width;
+	vt->height = header.height;
+	vt->format = header.format;
+	vt->tileBytes = texcache_level_size(header.format, VTEX_TILE, VTEX_TILE);
+	vt->levels = vtex_levels(vt->width, vt->height, vt->levelWidth, vt->levelHeight);
+	long first = 0;
+	for(int l=0; l<vt->levels; l++)
+	{
+		vt->levelColumns[l] = (vt->levelWidth[l] + VTEX_CONTENT-1) / VTEX_CONTENT;
+		vt->levelRows[l]    = (vt->levelHeight[l] + VTEX_CONTENT-1) / VTEX_CONTENT;
+		vt->levelFirst[l] = first;
+		vt->levelScale[l] = (float) vt->width / vt->levelWidth[l];
+		first += (long) vt->levelColumns[l] * vt->levelRows[l];
+	}
+	return 1;
+}
+
+
+/* ====== Tile records ====== */
+
+static int vtex_hash(int level, int tx, int ty)
+{
+	unsigned int h = (unsigned int) level * 73856093u ^ (unsigned int) tx * 19349663u ^ (unsigned int) ty * 83492791u;
+	return h % VTEX_BUCKETS;
+}
+
+/** Finds a tile. Must be called with the mutex locked.
+ *
+ * @return The record index or -1.
+ */
+static int vtex_find(const vtex *vt, int level, int tx, int ty)
+{
+	for(int i = vt->buckets[vtex_hash(level, tx, ty)]; i >= 0; i = vt->records[i].next)
+	{
+		const vtex_record *r = &vt->records[i];
+		if(r->level == level && r->tx == tx && r->ty == ty)
+			return i;
+	}
+	return -1;
+}
+
+/** Queues a tile to be read. Must be called with the mutex locked.
+ *
+ * @return The record index, or -1 if too many tiles are pending.
+ */
+static int vtex_request(vtex *vt, int level, int tx, int ty)
+{
+	if(vt->pending >= VTEX_MAX_PENDING || vt->freeRecord < 0)
+		return -1;
+	int i = vt->freeRecord;
+	vtex_record *r = &vt->records[i];
+	vt->freeRecord = r->next;
+	r->level = level;
+	r->tx = tx;
+	r->ty = ty;
+	r->state = VTEX_QUEUED;
+	r->slot = -1;
+	r->data = NULL;
+	r->lastUsed = vt->frame;
+	int b = vtex_hash(level, tx, ty);
+	r->next = vt->buckets[b];
+	vt->buckets[b] = i;
+	vt->pending++;
+	pthread_cond_signal(&vt->cond);
+	return i;
+}
+
+/** Forgets a tile (and frees its slot). Must be called with the
+ * mutex locked and not on a tile that is being read. */
+static void vtex_remove(vtex *vt, int index)
+{
+	vtex_record *r = &vt->records[index];
+	int *link = &vt->buckets[vtex_hash(r->level, r->tx, r->ty)];
+	while(*link != index)
+		link = &vt->records[*link].next;
+	*link = r->next;
+
+	if(r->state == VTEX_QUEUED || r->state == VTEX_LOADED)
+		vt->pending--;
+	if(r->slot >= 0)
+		vt->slotRecord[r->slot] = -1;
+	free(r->data);
+	r->data = NULL;
+	r->slot = -1;
+	r->level = -1;
+	r->next = vt->freeRecord;
+	vt->freeRecord = index;
+}
+
+/** Reads queued tiles and (if needed) builds the pyramid first. */
+static void* vtex_thread(void *arg)
+{
+	vtex *vt = (vtex*) arg;
+	int ready = 1;
+	if(vt->imageFilename != NULL)
+	{
+		char source[256];
+		if(!texcache_source_id(source, 256, vt->imageFilename))
+			ready = -1;
+		else if(!vtex_open_file(vt, source))
+		{
+			if(!vtex_build_internal(vt->imageFilename, vt->filename, &vt->quit) ||
+			   !vtex_open_file(vt, source))
+				ready = -1;
+		}
+	}
+	else if(!vtex_open_file(vt, NULL))
+	{
+		msg(ERROR, "Unable to open virtual texture %s\n", vt->filename);
+		ready = -1;
+	}
+
+	pthread_mutex_lock(&vt->mutex);
+	vt->ready = ready;
+	while(!vt->quit && ready == 1)
+	{
+		int index = -1;
+		for(int i=0; i<vt->recordCount && index < 0; i++)
+			if(vt->records[i].level >= 0 && vt->records[i].state == VTEX_QUEUED)
+				index = i;
+		if(index < 0)
+		{
+			pthread_cond_wait(&vt->cond, &vt->mutex);
+			continue;
+		}
+		vtex_record *r = &vt->records[index];
+		r->state = VTEX_READING;
+		long tile = vt->levelFirst[r->level] + (long) r->ty * vt->levelColumns[r->level] + r->tx;
+		pthread_mutex_unlock(&vt->mutex);
+
+		unsigned char *data = kuhl_malloc(vt->tileBytes);
+		off_t offset = (off_t) sizeof(vtex_header) + (off_t) tile * vt->tileBytes;
+		if(pread(vt->fd, data, vt->tileBytes, offset) != (ssize_t) vt->tileBytes)
+		{
+			free(data);
+			data = NULL;
+		}
+
+		pthread_mutex_lock(&vt->mutex);
+		r->data = data;
+		r->state = data ? VTEX_LOADED : VTEX_MISSING;
+		if(data == NULL)
+			vt->pending--;
+	}
+	pthread_mutex_unlock(&vt->mutex);
+	return NULL;
+}
+
+
+/* ====== Public functions ====== */
+
+/** Opens an image as a virtual texture. If the image hasn't been
+ * cut into tiles yet (or has changed), the tiles are built in the
+ * background; vtex_ready() reports when they are available.
+ *
+ * @param filename An image file, or a .vtex file created by vtex_build().
+ *
+ * @param atlasSize Width and height of the atlas texture in pixels
+ * (rounded down to a multiple of 256). This determines how much
+ * texture memory is used.
+ *
+ * @return The virtual texture, or NULL if the file can't be found.
+ */
+vtex* vtex_open(const char *filename, int atlasSize)
+{
+	char *fullpath = kuhl_find_file(filename);
+	if(!kuhl_can_read_file(fullpath))
+	{
+		msg(ERROR, "Unable to find '%s'.\n", filename);
+		free(fullpath);
+		return NULL;
+	}
+
+	vtex *vt = kuhl_malloc(sizeof(vtex));
+	memset(vt, 0, sizeof(vtex));
+	size_t len = strlen(fullpath);
+	if(len > 5 && strcasecmp(fullpath + len - 5, ".vtex") == 0)
+		vt->filename = fullpath;
+	else
+	{
+		char cacheFile[2048];
+		texcache_filename(cacheFile, 2048, fullpath, ".vtex");
+		vt->filename = strdup(cacheFile);
+		vt->imageFilename = fullpath;
+	}
+	vt->fd = -1;
+
+	vt->atlasSize = atlasSize / VTEX_TILE * VTEX_TILE;
+	if(vt->atlasSize < VTEX_TILE)
+		vt->atlasSize = VTEX_TILE;
+	vt->slotsPerRow = vt->atlasSize / VTEX_TILE;
+	vt->slotCount = vt->slotsPerRow * vt->slotsPerRow;
+	vt->slotRecord = kuhl_malloc(sizeof(int)*vt->slotCount);
+	for(int i=0; i<vt->slotCount; i++)
+		vt->slotRecord[i] = -1;
+
+	vt->recordCount = vt->slotCount + VTEX_MAX_PENDING;
+	vt->records = kuhl_malloc(sizeof(vtex_record)*vt->recordCount);
+	for(int i=0; i<vt->recordCount; i++)
+	{
+		memset(&vt->records[i], 0, sizeof(vtex_record));
+		vt->records[i].level = -1;
+		vt->records[i].slot = -1;
+		vt->records[i].next = i+1 < vt->recordCount ? i+1 : -1;
+	}
+	vt->freeRecord = 0;
+	for(int i=0; i<VTEX_BUCKETS; i++)
+		vt->buckets[i] = -1;
+
+	pthread_mutex_init(&vt->mutex, NULL);
+	pthread_cond_init(&vt->cond, NULL);
+	if(pthread_create(&vt->thread, NULL, vtex_thread, vt) != 0)
+	{
+		msg(FATAL, "Unable to create virtual texture thread.\n");
+		exit(EXIT_FAILURE);
+	}
+	return vt;
+}
+
+/** Stops loading tiles, deletes the atlas texture and frees a
+ * virtual texture. If the tiles are still being built, they are
+ * abandoned and built again the next time the image is opened. */
+void vtex_close(vtex *vt)
+{
+	if(vt == NULL)
+		return;
+	pthread_mutex_lock(&vt->mutex);
+	vt->quit = 1;
+	pthread_cond_broadcast(&vt->cond);
+	pthread_mutex_unlock(&vt->mutex);
+	pthread_join(vt->thread, NULL);
+
+	if(vt->atlas)
+		glDeleteTextures(1, &vt->atlas);
+	for(int i=0; i<vt->recordCount; i++)
+		free(vt->records[i].data);
+	if(vt->fd >= 0)
+		close(vt->fd);
+	pthread_mutex_destroy(&vt->mutex);
+	pthread_cond_destroy(&vt->cond);
+	free(vt->records);
+	free(vt->slotRecord);
+	free(vt->filename);
+	free(vt->imageFilename);
+	free(vt);
+}
+
+/** Checks if a virtual texture can be displayed.
+ *
+ * @param vt The virtual texture.
+ *
+ * @param width Set to the width of the image once it is ready (can be NULL).
+ *
+ * @param height Set to the height of the image once it is ready (can be NULL).
+ *
+ * @return 1 if the tiles are available, 0 if they are still being
+ * built, -1 if they couldn't be built or read.
+ */
+int vtex_ready(vtex *vt, int *width, int *height)
+{
+	pthread_mutex_lock(&vt->mutex);
+	int ready = vt->ready;
+	pthread_mutex_unlock(&vt->mutex);
+	if(ready == 1)
+	{
+		if(width)
+			*width = vt->width;
+		if(height)
+			*height = vt->height;
+	}
+	return ready;
+}
+
+/** Returns the atlas texture that the quads from vtex_visible()
+ * should be drawn with (0 before vtex_visible() creates it). */
+GLuint vtex_texture(const vtex *vt)
+{
+	return vt->atlas;
+}
+
+/** Returns the number of bytes of texture memory that the atlas
+ * uses. */
+long vtex_memory(const vtex *vt)
+{
+	GLenum format = vt->format ? vt->format : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	return (long) texcache_level_size(format, vt->atlasSize, vt->atlasSize);
+}
+
+/** Finds a slot in the atlas for a tile. Empty slots are used first,
+ * then the slot of the resident tile that was used least recently
+ * (as long as it wasn't needed by the previous frame). Must be called
+ * with the mutex locked.
+ *
+ * @return The slot or -1 if every slot is in use.
+ */
+static int vtex_slot(vtex *vt)
+{
+	int victim = -1;
+	for(int s=0; s<vt->slotCount; s++)
+	{
+		int i = vt->slotRecord[s];
+		if(i < 0)
+			return s;
+		if(vt->records[i].lastUsed < vt->frame-1 &&
+		   (victim < 0 || vt->records[i].lastUsed < vt->records[vt->slotRecord[victim]].lastUsed))
+			victim = s;
+	}
+	if(victim >= 0)
+		vtex_remove(vt, vt->slotRecord[victim]);
+	return victim;
+}
+
+/** Copies tiles that have been read into the atlas and forgets
+ * queued tiles that are no longer needed. Must be called with the
+ * mutex locked. */
+static void vtex_upload(vtex *vt)
+{
+	if(vt->atlas == 0)
+	{
+		GLint boundTexture = 0;
+		glGetIntegerv(GL_TEXTURE_BINDING_2D, &boundTexture);
+		glGenTextures(1, &vt->atlas);
+		glBindTexture(GL_TEXTURE_2D, vt->atlas);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glCompressedTexImage2D(GL_TEXTURE_2D, 0, vt->format, vt->atlasSize, vt->atlasSize, 0,
+		                       (GLsizei) vtex_memory(vt), NULL);
+		glBindTexture(GL_TEXTURE_2D, boundTexture);
+		kuhl_errorcheck();
+	}
+
+	TRACE_SCOPE("vtex_upload");
+	GLint boundTexture = 0;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &boundTexture);
+	glBindTexture(GL_TEXTURE_2D, vt->atlas);
+	long start = kuhl_microseconds();
+	for(int i=0; i<vt->recordCount; i++)
+	{
+		vtex_record *r = &vt->records[i];
+		if(r->level < 0 || r->state == VTEX_READING || r->state == VTEX_RESIDENT)
+			continue;
+		/* Tiles that aren't resident yet are forgotten once they are
+		 * no longer on the screen. */
+		if(r->lastUsed < vt->frame-2 && r->level != vt->levels-1)
+		{
+			vtex_remove(vt, i);
+			continue;
+		}
+		if(r->state != VTEX_LOADED)
+			continue;
+		if(kuhl_microseconds() - start > VTEX_UPLOAD_BUDGET)
+			continue;
+		int slot = vtex_slot(vt);
+		if(slot < 0)
+			continue;
+		glCompressedTexSubImage2D(GL_TEXTURE_2D, 0,
+		                          (slot % vt->slotsPerRow) * VTEX_TILE, (slot / vt->slotsPerRow) * VTEX_TILE,
+		                          VTEX_TILE, VTEX_TILE, vt->format, (GLsizei) vt->tileBytes, r->data);
+		free(r->data);
+		r->data = NULL;
+		r->state = VTEX_RESIDENT;
+		r->slot = slot;
+		vt->slotRecord[slot] = i;
+		vt->pending--;
+	}
+	glBindTexture(GL_TEXTURE_2D, boundTexture);
+	kuhl_errorcheck();
+}
+
+/** Fills in a quad that draws part of the image with a resident
+ * tile.
+ *
+ * @param rect The part of the image (xmin, xmax, ymin, ymax in image pixels).
+ *
+ * @param r A resident tile that covers rect.
+ */
+static void vtex_make_quad(const vtex *vt, const float rect[4], const vtex_record *r, vtex_quad *q)
+{
+	float scale = vt->levelScale[r->level];
+	float originX = (r->slot % vt->slotsPerRow) * VTEX_TILE + VTEX_BORDER - r->tx * VTEX_CONTENT;
+	float originY = (r->slot / vt->slotsPerRow) * VTEX_TILE + VTEX_BORDER - r->ty * VTEX_CONTENT;
+	q->x0 = rect[0];
+	q->x1 = rect[1];
+	q->y0 = rect[2];
+	q->y1 = rect[3];
+	q->s0 = (originX + rect[0]/scale) / vt->atlasSize;
+	q->s1 = (originX + rect[1]/scale) / vt->atlasSize;
+	q->t0 = (originY + rect[2]/scale) / vt->atlasSize;
+	q->t1 = (originY + rect[3]/scale) / vt->atlasSize;
+}
+
+/** Determines which tiles are needed to draw part of a virtual
+ * texture, requests the ones that are missing and copies tiles that
+ * have been read into the atlas. Call once per frame from the thread
+ * that owns the OpenGL context.
+ *
+ * @param vt The virtual texture.
+ *
+ * @param region The part of the image that is visible (xmin, xmax,
+ * ymin, ymax in image pixels).
+ *
+ * @param screenPixels The number of screen pixels that the width of
+ * the region covers.
+ *
+ * @param quads Filled in with the quads to draw (with the texture
+ * from vtex_texture()).
+ *
+ * @param maxQuads The length of the quads array.
+ *
+ * @return The number of quads.
+ */
+int vtex_visible(vtex *vt, const float region[4], float screenPixels, vtex_quad *quads, int maxQuads)
+{
+	TRACE_SCOPE("vtex_visible");
+	pthread_mutex_lock(&vt->mutex);
+	vt->frame++;
+	if(vt->ready != 1)
+	{
+		pthread_mutex_unlock(&vt->mutex);
+		return 0;
+	}
+	vtex_upload(vt);
+
+	/* The coarsest tile is always kept so that something can be
+	 * drawn everywhere. */
+	int top = vt->levels-1;
+	int topIndex = vtex_find(vt, top, 0, 0);
+	if(topIndex < 0)
+		topIndex = vtex_request(vt, top, 0, 0);
+	if(topIndex >= 0)
+		vt->records[topIndex].lastUsed = vt->frame;
+
+	/* Use the coarsest level whose pixels are no larger than a screen
+	 * pixel. */
+	float imagePerScreen = screenPixels > 0 ? (region[1]-region[0]) / screenPixels : 1;
+	int level = 0;
+	while(level+1 < vt->levels && vt->levelScale[level+1] <= imagePerScreen)
+		level++;
+
+	float scale = vt->levelScale[level];
+	int tx0 = (int)(region[0] / scale / VTEX_CONTENT);
+	int tx1 = (int)(region[1] / scale / VTEX_CONTENT);
+	int ty0 = (int)(region[2] / scale / VTEX_CONTENT);
+	int ty1 = (int)(region[3] / scale / VTEX_CONTENT);
+	tx0 = tx0 < 0 ? 0 : tx0;
+	ty0 = ty0 < 0 ? 0 : ty0;
+	tx1 = tx1 >= vt->levelColumns[level] ? vt->levelColumns[level]-1 : tx1;
+	ty1 = ty1 >= vt->levelRows[level] ? vt->levelRows[level]-1 : ty1;
+
+	int count = 0;
+	for(int ty=ty0; ty<=ty1 && count<maxQuads; ty++)
+	{
+		for(int tx=tx0; tx<=tx1 && count<maxQuads; tx++)
+		{
+			float rect[4];
+			rect[0] = tx * VTEX_CONTENT * scale;
+			rect[1] = (tx+1) * VTEX_CONTENT * scale;
+			rect[2] = ty * VTEX_CONTENT * scale;
+			rect[3] = (ty+1) * VTEX_CONTENT * scale;
+			if(rect[1] > vt->width)  rect[1] = vt->width;
+			if(rect[3] > vt->height) rect[3] = vt->height;
+
+			int index = vtex_find(vt, level, tx, ty);
+			if(index < 0)
+				index = vtex_request(vt, level, tx, ty);
+			if(index >= 0)
+				vt->records[index].lastUsed = vt->frame;
+
+			/* Draw with the tile if it is resident or with the
+			 * closest coarser tile that is. */
+			float cx = (rect[0]+rect[1])/2, cy = (rect[2]+rect[3])/2;
+			for(int l=level; l<vt->levels; l++)
+			{
+				if(l > level)
+					index = vtex_find(vt, l, (int)(cx / vt->levelScale[l] / VTEX_CONTENT),
+					                  (int)(cy / vt->levelScale[l] / VTEX_CONTENT));
+				if(index >= 0 && vt->records[index].state == VTEX_RESIDENT)
+				{
+					vt->records[index].lastUsed = vt->frame;
+					vtex_make_quad(vt, rect, &vt->records[index], &quads[count]);
+					count++;
+					break;
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&vt->mutex);
+	return count;
+}
@@ -0,0 +1,86 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    vtex displays images that are too large to keep in texture memory
+    (for example, multi-gigapixel panoramas) by only loading the parts
+    of the image that are visible at the resolution they are
+    displayed at.
+
+    The first time an image is opened with vtex_open(), a background
+    thread cuts it into a mipmap pyramid of 256x256 tiles that are
+    compressed (see texcache.h) and written next to the image (i.e.,
+    "image.jpg.vtex", or in KUHL_TEXTURE_CACHE_DIR). The pyramid is
+    rebuilt if the image changes. Later runs only read the tiles
+    that are needed.
+
+    Binary (P6) PPM files with 8 bits per channel are read a row at a
+    time while the pyramid is built, so they can have any size up to
+    2^31-1 pixels on a side; building needs about 2 KB of memory per
+    pixel of width. Other formats are decoded all at once, which
+    needs 4 bytes of memory per pixel, and images with more than 2^28
+    pixels (256 megapixels, e.g., 16384x16384) are rejected because
+    stb_image can't decode them. Convert larger images to PPM first
+    (for example, with "vips copy huge.tif huge.ppm").
+
+    Each frame, the program calls vtex_visible() with the part of the
+    image that is on the screen and the number of screen pixels that
+    it covers. vtex_visible() picks the pyramid level that matches the
+    screen resolution, asks the background thread to read any missing
+    tiles, copies tiles that have been read into a single atlas
+    texture and returns a list of quads to draw. Until a tile is
+    loaded, the part of a coarser tile that covers the same area is
+    drawn instead. The atlas has a fixed size; the tiles that were
+    used least recently are replaced when it is full.
+
+    For example:
+
+    <pre>
+    vtex *vt = vtex_open("huge.jpg", 4096);
+    ...
+    vtex_quad quads[1024];
+    int count = vtex_visible(vt, region, windowWidth, quads, 1024);
+    glBindTexture(GL_TEXTURE_2D, vtex_texture(vt));
+    for(int i=0; i<count; i++)
+        draw a rectangle from (quads[i].x0, quads[i].y0) to (quads[i].x1, quads[i].y1)
+        with texture coordinates (quads[i].s0, quads[i].t0) to (quads[i].s1, quads[i].t1)
+    </pre>
+
+    @author Scott Kuhl
+ */
+
+#ifndef __VTEX_H__
+#define __VTEX_H__
+
+#include <GL/glew.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A rectangle of the image and the part of the atlas texture to
+ * draw it with. */
+typedef struct
+{
+	float x0, y0, x1, y1; /**< Rectangle in image pixels (0,0 is the lower left corner of the image) */
+	float s0, t0, s1, t1; /**< Texture coordinates in the atlas */
+} vtex_quad;
+
+/** A virtual texture. Create with vtex_open(). */
+typedef struct vtex vtex;
+
+vtex* vtex_open(const char *filename, int atlasSize);
+void vtex_close(vtex *vt);
+int vtex_ready(vtex *vt, int *width, int *height);
+GLuint vtex_texture(const vtex *vt);
+long vtex_memory(const vtex *vt);
+int vtex_visible(vtex *vt, const float region[4], float screenPixels, vtex_quad *quads, int maxQuads);
+int vtex_build(const char *imageFilename, const char *vtexFilename);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+#endif // __VTEX_H__
@@ -7,7 +7,13 @@ in vec3 in_Color;
 
 in vec4 in_BoneIndex;
 in vec4 in_BoneWeight;
-uniform mat4 BoneMat[128];
+// Bone matrices are read from a buffer that kuhl_geometry_draw()
+// binds to KUHL_BONE_BINDING. With GLSL 4.30, a shader storage block
+// ("buffer BoneBuffer { mat4 BoneMat[]; };") removes the 128 bone limit.
+layout(std140) uniform BoneBlock
+{
+	mat4 BoneMat[128];
+};
 uniform int NumBones;
 
 uniform float farPlane;
@@ -15,6 +21,14 @@ uniform mat4 ModelView;
 uniform mat4 Projection;
 uniform mat4 GeomTransform;
 
+// Single-pass stereo (see viewmat_begin_stereo()): When StereoViews
+// is 2, every vertex is drawn once per eye and the even/odd instances
+// use the matrices for the left/right eye.
+uniform int StereoViews;
+uniform mat4 StereoModelView[2];
+uniform mat4 StereoProjection[2];
+out float gl_ClipDistance[1];
+
 out vec2 out_TexCoord;
 out vec3 out_Color;
 out float out_Depth;
@@ -27,6 +41,15 @@ void main()
 	out_TexCoord = in_TexCoord;
 	out_Color = in_Color;
 
+	int eye = gl_InstanceID % 2;
+	mat4 eyeModelView = ModelView;
+	mat4 eyeProjection = Projection;
+	if(StereoViews == 2)
+	{
+		eyeModelView = StereoModelView[eye];
+		eyeProjection = StereoProjection[eye];
+	}
+
 	mat4 actualModelView;
 	if(NumBones > 0)
 	{
@@ -34,10 +57,10 @@ void main()
 			in_BoneWeight.y * BoneMat[int(in_BoneIndex.y)] +
 			in_BoneWeight.z * BoneMat[int(in_BoneIndex.z)] +
 			in_BoneWeight.w * BoneMat[int(in_BoneIndex.w)];
-		actualModelView = ModelView * m;
+		actualModelView = eyeModelView * m;
 	}
 	else
-		actualModelView = ModelView * GeomTransform;
+		actualModelView = eyeModelView * GeomTransform;
 
 	// Transform normal from object coordinates to camera coordinates
 	//out_Normal = normalize(NormalMat * in_Normal);
@@ -45,7 +68,17 @@ void main()
 
 	// Transform vertex from object to unhomogenized Normalized Device
 	// Coordinates (NDC).
-	gl_Position = Projection * actualModelView * vec4(in_Position.xyz, 1);
+	gl_Position = eyeProjection * actualModelView * vec4(in_Position.xyz, 1);
+
+	if(StereoViews == 2)
+	{
+		// Squeeze the vertex into the eye's half of the viewport and
+		// clip anything that would spill into the other eye.
+		gl_Position.x = 0.5*gl_Position.x + (eye == 0 ? -0.5 : 0.5)*gl_Position.w;
+		gl_ClipDistance[0] = (eye == 0 ? -gl_Position.x : gl_Position.x);
+	}
+	else
+		gl_ClipDistance[0] = 1.0;
 
 	// For rendering depth onto screen:
 	// To avoid dealing with issues from non-linear z in perspective
@@ -0,0 +1,11 @@
+#version 150 // GLSL 150 = OpenGL 3.2
+
+out vec4 fragColor;
+in vec3 out_Direction;
+
+uniform samplerCube cubemap;
+
+void main() 
+{
+	fragColor = texture(cubemap, out_Direction);
+}
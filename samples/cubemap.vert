@@ -0,0 +1,18 @@
+#version 150 // GLSL 150 = OpenGL 3.2
+
+in vec2 in_Position; // normalized device coordinates
+
+uniform mat4 InverseViewProjection;
+
+out vec3 out_Direction;
+
+void main() 
+{
+	/* Find the direction that this corner of the screen looks in by
+	 * converting a point on the far plane back to world
+	 * coordinates. The view matrix has no translation, so the point
+	 * is also the direction. */
+	vec4 world = InverseViewProjection * vec4(in_Position, 1.0, 1.0);
+	out_Direction = world.xyz / world.w;
+	gl_Position = vec4(in_Position, 1.0, 1.0);
+}
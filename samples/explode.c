@@ -3,8 +3,10 @@
  * the file named "LICENSE" for a full copy of the license.
  */
 
-/** @file This program demonstrates how to access individual vertices
- * inside of a model.
+/** @file This program demonstrates how to move individual vertices
+ * inside of a model. Press 'x' to make the model explode into
+ * particles and 'r' to put it back together. The particles are
+ * updated on the GPU (see particles.h).
  *
  * @author Scott Kuhl
  */
@@ -23,6 +25,7 @@
 #include "dgr.h"
 #include "projmat.h"
 #include "viewmat.h"
+#include "particles.h"
 
 #include <assimp/cimport.h>
 #include <assimp/scene.h>
@@ -55,11 +58,8 @@ float placeToPutModel[3] = { 0, 0, 0 };
 struct aiScene *scene;
 kuhl_geometry geom;
 
-typedef struct {
-	GLfloat velocity[3];
-} particle;
-
-particle **particles;
+/** Moves each vertex of the model on the GPU. */
+particle_system particles;
 
 #define GLSL_VERT_FILE "assimp.vert"
 #define GLSL_FRAG_FILE "assimp.frag"
@@ -67,85 +67,22 @@ particle **particles;
 /** Give each vertex a velocity when the explosion occurs. */
 void explode()
 {
-	kuhl_geometry *g = modelgeom;
-	for(unsigned int i=0; i<kuhl_geometry_count(modelgeom); i++)
-	{
-		/* Get the normal information from each of the vertices. */
-		GLint numFloats = 0;
-		GLfloat *norm = kuhl_geometry_attrib_get(g, "in_Normal",
-		                                         &numFloats);
-		
-		/* Calculate the velocity of each vertex when the explosion occurs */
-		for(unsigned int j=0; j<g->vertex_count; j++)
-		{
-			// Start by setting the velocity equal to the normal to
-			// make the particles move out.
-			vec3f_copy(particles[i][j].velocity, &norm[j*3]);
-
-			// Scale the initial velocity
-			vec3f_scalarMult(particles[i][j].velocity, 10);
-
-			// Instead of moving the particles only in the direction
-			// of the normal, make them move 'up' (in object
-			// coordinates) too.
-			particles[i][j].velocity[1] += .5;
-
-			// Add a bit of randomness
-			for(int k=0; k<3; k++)
-				particles[i][j].velocity[k] += (drand48()-.5);
-		}
-		g = g->next;
-	}
+	/* Start by making the particles move in the direction of the
+	 * normal at a speed of 10. Instead of moving the particles only
+	 * in the direction of the normal, make them move 'up' (in object
+	 * coordinates) too and add a bit of randomness. */
+	particles_explode(&particles, 10, .5, 1);
 }
 
-/** Update the vertex positions and the velocity stored in the
- * particles array. */
+/** Update the vertex positions and velocities. Gravity is pushing
+ * particles down -Y, but we are operating in object coordinates. If
+ * GeomTransform (i.e., g->matrix) is used to rotate the model, then
+ * gravity might not push the particles down in world coordinates.
+ * The particles bounce off of the xz-plane and keep
+ * particles.bounce of their velocity when they do. */
 void update()
 {
-	kuhl_geometry *g = modelgeom;
-	for(unsigned int i=0; i<kuhl_geometry_count(modelgeom); i++)
-	{
-		int numFloats = 0;
-		GLfloat *pos = kuhl_geometry_attrib_get(g, "in_Position",
-		                                        &numFloats);
-
-		for(unsigned int j=0; j<g->vertex_count; j++)
-		{
-			/* If the first point isn't moving, don't update anything */
-			if(vec3f_norm(particles[i][j].velocity) == 0)
-				return;
-
-			/* Gravity is pushing particles down -Y, but we are
-			 * operating in object coordinates. If GeomTransform
-			 * (i.e., g->matrix) is used to rotate the model, then
-			 * gravity might not push the particles down in world
-			 * coordinates. */
-			float accel[3] = { 0, -1, 0};
-			float timestep = 0.1f; // change this to change speed of explosion
-			for(int k=0; k<3; k++)
-			{
-				pos[j*3+k] += timestep * (particles[i][j].velocity[k] + timestep * accel[k]/2);
-				particles[i][j].velocity[k] += timestep * accel[k];
-			}
-#if 1   /* Bounce the particles off the xz-plane. */
-			if(pos[j*3+1] < 0)
-			{
-				/* How much velocity is lost when a bounce occurs? */
-				float velocityLossFactor = .4;
-				/* If particle fell through floor, negate its position */
-				pos[j*3+1] *= -velocityLossFactor;
-				/* Negative the Y velocity */
-				particles[i][j].velocity[1] *= -1;
-				/* Scale velocity in all directions */
-				vec3f_scalarMult(particles[i][j].velocity, velocityLossFactor); // lose energy on bounce
-			}
-#endif
-		}
-		g = g->next;
-	}
-
-
-	
+	particles_update(&particles);
 }
 
 
@@ -217,6 +154,9 @@ void keyboard(unsigned char key, int x, int y)
 		case 'z':
 			update();
 			break;
+		case 'r':
+			particles_reset(&particles);
+			break;
 		case ' ': // Toggle different sections of the GLSL fragment shader
 			renderStyle++;
 			if(renderStyle > 9)
@@ -297,6 +237,9 @@ void display()
 	 * viewport will fill the entire screen. However, this loop will
 	 * run twice for HMDs (once for the left eye and once for the
 	 * right. */
+	kuhl_limitfps(60);
+	update();
+
 	viewmat_begin_frame();
 	for(int viewportID=0; viewportID<viewmat_num_viewports(); viewportID++)
 	{
@@ -358,8 +301,6 @@ void display()
 
 		kuhl_errorcheck();
 
-		kuhl_limitfps(60);
-		update();
 		kuhl_geometry_draw(modelgeom); /* Draw the model */
 		kuhl_errorcheck();
 
@@ -466,23 +407,16 @@ int main(int argc, char** argv)
 	// Load the model from the file
 	modelgeom = kuhl_load_model(modelFilename, modelTexturePath, program, bbox);
 
-	/* Count the number of kuhl_geometry objects for this model */
-	unsigned int geomCount = kuhl_geometry_count(modelgeom);
-	
-	/* Allocate an array of particle arrays */
-	particles = malloc(sizeof(particle*)*geomCount);
-	int i = 0;
+	/* Change the geometry to be drawn as points */
 	for(kuhl_geometry *g = modelgeom; g != NULL; g=g->next)
-	{
-		/* allocate space to store velocity information for all of the
-		 * vertices in this kuhl_geometry */
-		particles[i] = malloc(sizeof(particle)*g->vertex_count);
-		for(unsigned int j=0; j<g->vertex_count; j++)
-			vec3f_set(particles[i][j].velocity, 0,0,0);
-
-		/* Change the geometry to be drawn as points */
 		g->primitive_type = GL_POINTS; // Comment out this line to default to triangle rendering.
-		i++;
+
+	/* Turn every vertex into a particle. The positions and
+	 * velocities stay in OpenGL buffers and are updated on the GPU. */
+	if(particles_init(&particles, modelgeom) == 0)
+	{
+		msg(FATAL, "Unable to create particles for the model.\n");
+		exit(EXIT_FAILURE);
 	}
 
 	/* Tell GLUT to start running the main loop and to call display(),
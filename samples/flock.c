@@ -3,8 +3,11 @@
  * the file named "LICENSE" for a full copy of the license.
  */
 
-/** @file Draws a single model repeatedly. Useful for doing very
- * simple performance measurements.
+/** @file Draws a flock of copies of a single model. Useful for doing
+ * very simple performance measurements. The flock is simulated by
+ * boids.c and all of the copies of the model are drawn with
+ * instanced rendering: each copy gets its own model matrix from a
+ * per-instance attribute.
  *
  * @author Scott Kuhl
  */
@@ -24,20 +27,26 @@
 #include "dgr.h"
 #include "projmat.h"
 #include "viewmat.h"
+#include "boids.h"
 
 GLuint fpsLabel = 0;
 float fpsLabelAspectRatio = 0;
 kuhl_geometry labelQuad;
 
 GLuint program = 0; // id value for the GLSL program
+GLuint instanceProgram = 0; // GLSL program used to draw the instanced models
 kuhl_geometry *modelgeom = NULL;
 float bbox[6], fitMatrix[16];
 
-#define NUM_MODELS 5000
-float positions[NUM_MODELS][3];
+#define NUM_MODELS 10000
+#define FLOCK_STEP_MS 10 /**< Milliseconds that the flock moves forward in each update */
+#define FLOCK_MAX_STEPS 10 /**< The flock moves forward at most this many steps per frame */
+#define FLOCK_CATCHUP_STEPS 500 /**< Steps per frame that a DGR slave takes to catch up to the master */
+boids flock;
 
 #define GLSL_VERT_FILE "assimp.vert"
 #define GLSL_FRAG_FILE "assimp.frag"
+#define GLSL_INSTANCE_VERT_FILE "flock.vert"
 
 /* Called by GLUT whenever a key is pressed. */
 void keyboard(unsigned char key, int x, int y)
@@ -64,17 +73,18 @@ void keyboard(unsigned char key, int x, int y)
 }
 
 
-void get_model_matrix(float result[16], float placeToPutModel[3])
+/* Creates the flock in the same way in every DGR process. Each copy
+ * of the model is scaled to fit in a 1 meter box before it is placed
+ * at a boid. */
+void flock_reset()
 {
-	/* Get a matrix that moves the model to the correct location. */
-	float moveToLookPoint[16];
-	mat4f_translateVec_new(moveToLookPoint, placeToPutModel);
-
-	/* Create a single model matrix. */
-	mat4f_mult_mat4f_new(result, moveToLookPoint, fitMatrix);
+	boids_free(&flock);
+	srand48(0);
+	boids_init(&flock, NUM_MODELS);
+	mat4f_copy(flock.base, fitMatrix);
+	boids_update(&flock, 0);
 }
 
-
 /* Called by GLUT whenever the window needs to be redrawn. This
  * function should not be called directly by the programmer. Instead,
  * we can call glutPostRedisplay() to request that GLUT call display()
@@ -162,7 +172,7 @@ void display()
 		float viewMat[16], perspective[16];
 		viewmat_get(viewMat, perspective, viewportID);
 
-		glUseProgram(program);
+		glUseProgram(instanceProgram);
 		kuhl_errorcheck();
 		/* Send the perspective projection matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
@@ -176,27 +186,21 @@ void display()
 		projmat_get_frustum(f, viewport[2], viewport[3]);
 		glUniform1f(kuhl_get_uniform("farPlane"), f[5]);
 
-		float modelview[16];
-		for(int i=0; i<NUM_MODELS; i++)
-		{
-			float modelMat[16];
-			get_model_matrix(modelMat, positions[i]);
-
-			mat4f_mult_mat4f_new(modelview, viewMat, modelMat); // modelview = view * model
-
-			/* Send the modelview matrix to the vertex program. */
-			glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
-			                   1, // number of 4x4 float matrices
-			                   0, // transpose
-			                   modelview); // value
-
-			kuhl_errorcheck();
-			kuhl_geometry_draw(modelgeom); /* Draw the model */
-			kuhl_errorcheck();
-		}
+		/* The model matrix for each copy of the model is stored in
+		 * a per-instance attribute, so we only send the view matrix
+		 * and draw all of the copies at once. */
+		glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
+		                   1, // number of 4x4 float matrices
+		                   0, // transpose
+		                   viewMat); // value
+		kuhl_errorcheck();
+		kuhl_geometry_draw(modelgeom); /* Draw all copies of the model */
+		kuhl_errorcheck();
 
 		if(dgr_is_enabled() == 0 || dgr_is_master())
 		{
+			glUseProgram(program);
+			float modelview[16];
 
 			/* The shape of the frames per second quad depends on the
 			 * aspect ratio of the label texture and the aspect ratio of
@@ -238,6 +242,45 @@ void display()
 	dgr_setget("time", &time, sizeof(int));
 	kuhl_update_model(modelgeom, 0, ((time%10000)/1000.0));
 
+	/* Move the flock forward in steps of a fixed length. The master
+	 * decides how many steps have happened and shares the count, and
+	 * every process takes the steps that it hasn't taken yet. The
+	 * simulation doesn't depend on the number of threads or on how
+	 * often the frames of a process are drawn, so every DGR process
+	 * computes the same flock. A slave that starts late runs the
+	 * simulation from the beginning (a few hundred steps per frame)
+	 * until it catches up. */
+	static int lastTime = -1;
+	static int step = 0, flockStep = 0;
+	if(lastTime >= 0)
+	{
+		int steps = (time - lastTime) / FLOCK_STEP_MS;
+		if(steps > FLOCK_MAX_STEPS)
+			steps = FLOCK_MAX_STEPS; // don't jump after a long pause
+		step += steps;
+		lastTime += steps * FLOCK_STEP_MS;
+		if(time - lastTime > FLOCK_STEP_MS)
+			lastTime = time - FLOCK_STEP_MS;
+	}
+	else
+		lastTime = time;
+	dgr_setget("flockStep", &step, sizeof(int));
+	if(flockStep > step)
+	{
+		/* The master restarted. */
+		flock_reset();
+		flockStep = 0;
+	}
+	if(flockStep == 0 && step > FLOCK_CATCHUP_STEPS)
+		msg(INFO, "Catching up to the master's flock (%d steps)\n", step);
+	for(int i=0; flockStep < step && i < FLOCK_CATCHUP_STEPS; i++)
+	{
+		boids_update(&flock, FLOCK_STEP_MS/1000.0f);
+		flockStep++;
+	}
+	kuhl_geometry_instance_attrib(modelgeom, flock.matrices, 16, flock.count,
+	                              "in_InstanceMat", KG_FULL_LIST);
+
 	/* Check for errors. If there are errors, consider adding more
 	 * calls to kuhl_errorcheck() in your code. */
 	kuhl_errorcheck();
@@ -331,6 +374,7 @@ int main(int argc, char** argv)
 	/* Compile and link a GLSL program composed of a vertex shader and
 	 * a fragment shader. */
 	program = kuhl_create_program(GLSL_VERT_FILE, GLSL_FRAG_FILE);
+	instanceProgram = kuhl_create_program(GLSL_INSTANCE_VERT_FILE, GLSL_FRAG_FILE);
 
 	dgr_init();     /* Initialize DGR based on environment variables. */
 	projmat_init(); /* Figure out which projection matrix we should use based on environment variables */
@@ -345,18 +389,18 @@ int main(int argc, char** argv)
 	glClear(GL_COLOR_BUFFER_BIT);
 
 	// Load the model from the file
-	modelgeom = kuhl_load_model(modelFilename, NULL, program, bbox);
+	modelgeom = kuhl_load_model(modelFilename, NULL, instanceProgram, bbox);
 	kuhl_bbox_fit(fitMatrix, bbox, 1);
 	init_geometryQuad(&labelQuad, program);
 
 	kuhl_getfps_init(&fps_state);
 
-	for(int i=0; i<NUM_MODELS; i++)
-	{
-		positions[i][0] = drand48()*50-25;
-		positions[i][1] = drand48()*50-25;
-		positions[i][2] = drand48()*50-25;
-	}
+	flock_reset();
+
+	/* Store a model matrix for each copy of the model in a
+	 * per-instance attribute. */
+	kuhl_geometry_instance_attrib(modelgeom, flock.matrices, 16, flock.count,
+	                              "in_InstanceMat", KG_WARN | KG_FULL_LIST);
 	
 	/* Tell GLUT to start running the main loop and to call display(),
 	 * keyboard(), etc callback methods as needed. */
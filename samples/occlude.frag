@@ -0,0 +1,9 @@
+#version 150 // GLSL 150 = OpenGL 3.2
+
+/* Used by kuhl_render_queue_draw_occluded() to draw bounding boxes
+ * during occlusion queries. Only the depth test matters since color
+ * writes are disabled. */
+
+void main()
+{
+}
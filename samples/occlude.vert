@@ -0,0 +1,14 @@
+#version 150 // GLSL 150 = OpenGL 3.2
+
+/* Used by kuhl_render_queue_draw_occluded() to draw bounding boxes
+ * during occlusion queries. */
+
+in vec3 in_Position;
+
+uniform mat4 ModelView;
+uniform mat4 Projection;
+
+void main()
+{
+	gl_Position = Projection * ModelView * vec4(in_Position, 1.0);
+}
@@ -4,6 +4,18 @@
  */
 
 /** @file A slideshow program written in OpenGL 2.0
+ *
+ * Images are decoded and uploaded in the background with
+ * texstream. The images before and after the current one are
+ * prefetched, and images stay cached until they use more than the
+ * texture memory budget. The following environment variables change
+ * the cache:
+ *
+ * SLIDESHOW_PREFETCH="2" - Number of images to prefetch in each direction.<br>
+ * SLIDESHOW_CACHE_MB="512" - Texture memory (in megabytes) that cached images may use.<br>
+ * SLIDESHOW_VIRTUAL_MPIXELS="64" - Images with more megapixels than this
+ * (and ".vtex" files) are displayed with vtex so that only the visible
+ * tiles are loaded.
  *
  * @author Scott Kuhl
  */
@@ -12,6 +24,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <strings.h> // strcasecmp()
 
 #ifdef __linux__
 #include <unistd.h>
@@ -30,193 +43,256 @@
 #include "kuhl-util.h"
 #include "dgr.h"
 #include "projmat.h"
-#ifdef KUHL_UTIL_USE_IMAGEMAGICK
-#include "imageio.h"
-#else
+#include "texstream.h"
+#include "vtex.h"
+#ifndef KUHL_UTIL_USE_IMAGEMAGICK
 #include "stb_image.h"
 #endif
 
 #define SCROLL_SPEED 30  // number of seconds to scroll past one screen-width of image.
-#define MAX_TILES 100
 #define SLIDESHOW_WAIT 10 // time in seconds to wait when autoadvance is turned on.
-#define MAX_TILES 100
+#define MAX_TILE_SIZE 4096 // largest width or height of a texture
+#define MAX_CACHED 64 // most images that can be cached at once
+#define VIRTUAL_ATLAS_SIZE 4096 // width and height of the tile atlas for virtual textures
+#define MAX_VIRTUAL_QUADS 4096 // most tiles drawn for a virtual texture
 
 int autoAdvance = 0; // Automatically advance from image to image after a time out.
 int lastAdvance = 0; // Time (in ms from when our program started) that we advanced picture.
 float scrollAmount = 0; // How far has the image scrolled?
 
+/* An image that is loading or loaded. */
+typedef struct
+{
+	int image; // index into globalargv, -1 if the entry is unused
+	texstream_tiles tiles;
+	vtex *virt; // virtual texture for huge images (NULL for other images)
+	int status; // TEXSTREAM_LOADING, TEXSTREAM_READY or TEXSTREAM_FAILED
+	float aspectRatio;
+	long bytes; // texture memory used by the tiles (including mipmaps)
+	long lastUsed; // time (microseconds) that the image was last displayed or requested
+} cachedImage;
+
+cachedImage cache[MAX_CACHED];
+long cacheBytes = 0; // texture memory used by all of the images that are ready
+long cacheBudget = 512L*1024*1024;
+int prefetchCount = 2; // number of images to prefetch in each direction
+long virtualPixels = 64L*1000*1000; // images larger than this are displayed with vtex
+
 /* The current image that we are displaying. */
-GLuint numTiles=0;
-GLuint texNames[MAX_TILES];
-float aspectRatio;
+cachedImage *displayed = NULL;
 
 int alreadyDisplayedTexture = 0; // Used to determine if we need to reload currentTexture.
 int currentTexture = 0; // The texture to be displayed.
 int totalTextures = 0;
 char **globalargv = NULL;
 
-/* Readfile uses imageio to read in an image, and binds it to an OpenGL
- * texture name.  Requires OpenGL 2.0 or better.
- *
- * filename: name of file to load
- *
- * texName: A pointer to where the OpenGL texture name should be stored.
- * (Remember that the "texture name" is really just some unsigned int).
- *
- * returns: aspect ratio of the image in the file.
- */
-float readfile(char *filename, GLuint *texName, GLuint *numTiles)
+int getNextTexture()
 {
-	static int verbose=1;  // change this to 0 to print out less info
-
-	/* Try to load the image. */
-#if KUHL_UTIL_USE_IMAGEMAGICK
-	imageio_info iioinfo;
-	iioinfo.filename = filename;
-	iioinfo.type = CharPixel;
-	iioinfo.map = "RGBA";
-	iioinfo.colorspace = sRGBColorspace;
-	unsigned char *image = (unsigned char*) imagein(&iioinfo);
-	int width  = (int)iioinfo.width;
-	int height = (int)iioinfo.height;
-#else
-	int width  = -1;
-	int height = -1;
-	int comp = -1;
-	int requestedComponents = STBI_rgb_alpha;
-	stbi_set_flip_vertically_on_load(1);
-	unsigned char *image = (unsigned char*) stbi_load(filename, &width, &height, &comp, requestedComponents);
-#endif
+	int next = currentTexture+1;
+	if(next >= totalTextures)
+		return 0;
+	return next;
+}
 
-	if(image == NULL)
-	{
-		msg(FATAL, "Unable to read image: %s\n", filename);
-		return -1;
-	}
+int getPrevTexture()
+{
+	int next = currentTexture-1;
+	if(next < 0)
+		return totalTextures-1;
+	return next;
+}
 
-	/* "image" is a 1D array of characters (unsigned bytes) with four
-	 * bytes for each pixel (red, green, blue, alpha). The data in "image"
-	 * is in row major order. The first 4 bytes are the color information
-	 * for the lowest left pixel in the texture. */
-	float original_aspectRatio = (float)width/height;
-	if(verbose)
-		msg(INFO, "Finished reading %s (%dx%d)\n", filename, width, height);
-
-	/* OpenGL only supports textures if they are small enough. If
-	 * the texture is too large, we need to split it into smaller
-	 * textures and render each texture on its own
-	 * quad. Typically, the limit is 4096 pixels in each
-	 * dimension. This code will always split the image vertically
-	 * in half...and then decide how many tiles are necessary
-	 * horizontally. This allows for long horizontal panoramas but
-	 * not long vertical panoramas. */
-	
-	/* Since we display image as being two tiles tall, make sure
-	 * image isn't too tall. */
-	if(height > 4096*2)
-	{
-		msg(FATAL, "Source image must <= 8192 pixels tall.");
-		exit(EXIT_FAILURE);
-	}
+/* Returns how many images away from the current image an image is
+ * (wrapping around at the ends of the list). */
+int distanceFromCurrent(int image)
+{
+	int d = abs(image - currentTexture);
+	if(totalTextures - d < d)
+		d = totalTextures - d;
+	return d;
+}
 
-	int subimgH = height/2; // height of a the tiles
-	int workingWidth = width;
-	*numTiles = 1; // number of tiles in horizontal direction
-	/* Calculate number of tiles horizontally we need. */
-	while(workingWidth > 4096)
-	{
-		/* If image is too wide, split the width of the tile
-		 * in half---doubling the number of tiles in the
-		 * horizontal direction */
-		*numTiles = *numTiles * 2;
-		workingWidth = workingWidth / 2;
-	}
-	int subimgW = workingWidth;
+/* Deletes the textures for an image and removes it from the cache. */
+void evictImage(cachedImage *c)
+{
+	if(c->status == TEXSTREAM_READY)
+		cacheBytes -= c->bytes;
+	texstream_tiles_delete(&(c->tiles));
+	vtex_close(c->virt);
+	c->virt = NULL;
+	if(displayed == c)
+		displayed = NULL;
+	c->image = -1;
+}
 
-	if(*numTiles > MAX_TILES/2.0)
+/* Removes images until the ones that are ready fit in the texture
+ * memory budget. Images outside of the prefetch window are removed
+ * first (least recently used first). Then, prefetched images that
+ * are farthest from the current image are removed. The current image
+ * and the image on the screen are never removed. */
+void enforceBudget(void)
+{
+	while(cacheBytes > cacheBudget)
 	{
-		msg(FATAL, "Too many tiles");
-		exit(EXIT_FAILURE);
+		cachedImage *victim = NULL;
+		for(int i=0; i<MAX_CACHED; i++)
+		{
+			cachedImage *c = &cache[i];
+			if(c->image < 0 || c->status != TEXSTREAM_READY ||
+			   c->image == currentTexture || c == displayed)
+				continue;
+			if(victim == NULL)
+			{
+				victim = c;
+				continue;
+			}
+			int d = distanceFromCurrent(c->image);
+			int vd = distanceFromCurrent(victim->image);
+			int outside = d > prefetchCount;
+			int victimOutside = vd > prefetchCount;
+			if(outside != victimOutside)
+			{
+				if(outside)
+					victim = c;
+			}
+			else if(outside ? c->lastUsed < victim->lastUsed : d > vd)
+				victim = c;
+		}
+		if(victim == NULL)
+			return;
+		msg(DEBUG, "Evicting %s from the cache (%ld MB in use)\n", globalargv[victim->image], cacheBytes/(1024*1024));
+		evictImage(victim);
 	}
+}
 
-	glTexImage2D(GL_PROXY_TEXTURE_2D, 0, GL_RGBA8, subimgW, subimgH,
-	             0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-	int tmp;
-	glGetTexLevelParameteriv(GL_PROXY_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &tmp);
-
-	if(tmp == 0)
+/* Called by texstream when an image is ready or failed to load. */
+void imageLoaded(GLuint texture, float aspectRatio, void *data)
+{
+	cachedImage *c = (cachedImage*) data;
+	if(aspectRatio < 0)
 	{
-		msg(FATAL, "%s: File is too large (%d x %d). I can't load it!\n", filename, subimgW, subimgH);
-		free(image);
-		exit(EXIT_FAILURE);
+		msg(ERROR, "Unable to load image: %s\n", globalargv[c->image]);
+		c->status = TEXSTREAM_FAILED;
+		return;
 	}
+	c->status = TEXSTREAM_READY;
+	c->aspectRatio = aspectRatio;
+	c->bytes = (long) c->tiles.width * c->tiles.height * 4 * 4/3;
+	cacheBytes += c->bytes;
+	msg(DEBUG, "Loaded %s (%dx%d, %d tiles, %ld MB cached)\n", globalargv[c->image], c->tiles.width, c->tiles.height, c->tiles.columns*c->tiles.rows, cacheBytes/(1024*1024));
+	enforceBudget();
+}
 
+/* Returns 1 if an image should be displayed with vtex because it
+ * is too large to keep in texture memory. */
+int isVirtual(const char *filename)
+{
+	size_t len = strlen(filename);
+	if(len > 5 && strcasecmp(filename + len - 5, ".vtex") == 0)
+		return 1;
+#ifndef KUHL_UTIL_USE_IMAGEMAGICK
+	int width, height, comp;
+	char *fullpath = kuhl_find_file(filename);
+	int ok = stbi_info(fullpath, &width, &height, &comp);
+	free(fullpath);
+	if(ok && (long) width * height > virtualPixels)
+		return 1;
+#endif
+	return 0;
+}
 
-	/* Generate all of the textures that we need. */
-	glGenTextures(*numTiles*2, texName);
-
-	for(GLuint curTile=0; curTile < *numTiles*2; curTile = curTile+2)
+/* Checks if the virtual textures that are being built or opened are
+ * ready. */
+void updateVirtualImages(void)
+{
+	for(int i=0; i<MAX_CACHED; i++)
 	{
-		/* Prepare to copy the data from the array into the
-		 * texture, tell OpenGL to skip pixels appropriately
-		 * so that each tile gets the right part of the
-		 * image. */
-		glPixelStorei(GL_UNPACK_ROW_LENGTH,  width);
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS, curTile/2.0*subimgW);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS,   0);
-
-		glBindTexture(GL_TEXTURE_2D, texName[curTile]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, subimgW, subimgH,
-		             0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-
-		glPixelStorei( GL_UNPACK_SKIP_PIXELS, curTile/2.0*subimgW );
-		glPixelStorei( GL_UNPACK_SKIP_ROWS, subimgH);
-
-		glBindTexture(GL_TEXTURE_2D, texName[curTile+1]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, subimgW, subimgH,
-		             0, GL_RGBA, GL_UNSIGNED_BYTE, image);
+		cachedImage *c = &cache[i];
+		if(c->image < 0 || c->virt == NULL || c->status != TEXSTREAM_LOADING)
+			continue;
+		int width, height;
+		int ready = vtex_ready(c->virt, &width, &height);
+		if(ready < 0)
+		{
+			msg(ERROR, "Unable to load image: %s\n", globalargv[c->image]);
+			c->status = TEXSTREAM_FAILED;
+		}
+		else if(ready > 0)
+		{
+			c->status = TEXSTREAM_READY;
+			c->aspectRatio = width / (float) height;
+			c->bytes = vtex_memory(c->virt);
+			cacheBytes += c->bytes;
+			msg(DEBUG, "Opened %s as a virtual texture (%dx%d, %ld MB cached)\n", globalargv[c->image], width, height, cacheBytes/(1024*1024));
+			enforceBudget();
+		}
 	}
-
-	free(image);
-	return original_aspectRatio;
 }
 
-int getNextTexture()
+/* Finds an image in the cache or starts loading it. */
+cachedImage* requestImage(int image)
 {
-	int next = currentTexture+1;
-	if(next >= totalTextures)
-		return 0;
-	return next;
-}
+	cachedImage *c = NULL;
+	for(int i=0; i<MAX_CACHED; i++)
+	{
+		if(cache[i].image == image)
+		{
+			cache[i].lastUsed = kuhl_microseconds();
+			return &cache[i];
+		}
+		if(c == NULL && cache[i].image < 0)
+			c = &cache[i];
+	}
+	if(c == NULL)
+	{
+		/* No free entries: reuse the least recently used entry that
+		 * isn't on the screen. */
+		for(int i=0; i<MAX_CACHED; i++)
+			if(&cache[i] != displayed && cache[i].image != currentTexture &&
+			   (c == NULL || cache[i].lastUsed < c->lastUsed))
+				c = &cache[i];
+		evictImage(c);
+	}
 
-int getPrevTexture()
-{
-	int next = currentTexture-1;
-	if(next < 0)
-		return totalTextures-1;
-	return next;
+	c->image = image;
+	c->status = TEXSTREAM_LOADING;
+	c->aspectRatio = 1;
+	c->bytes = 0;
+	c->lastUsed = kuhl_microseconds();
+	if(isVirtual(globalargv[image]))
+	{
+		memset(&(c->tiles), 0, sizeof(texstream_tiles));
+		c->virt = vtex_open(globalargv[image], VIRTUAL_ATLAS_SIZE);
+		if(c->virt == NULL)
+			c->status = TEXSTREAM_FAILED;
+	}
+	else if(texstream_load_tiles(globalargv[image], MAX_TILE_SIZE, &(c->tiles), imageLoaded, c) == 0)
+		c->status = TEXSTREAM_FAILED;
+	return c;
 }
 
-/* Deletes any tiles that are already loaded and then loads up the
- * current texture image. */
-void loadTexture(int textureIndex)
+/* Requests the current image and prefetches the images around
+ * it. Images that are still loading but are no longer near the
+ * current image are canceled so that they don't delay the ones that
+ * are needed. */
+void prefetchImages(void)
 {
-	if(numTiles > 0)
-		glDeleteTextures(numTiles*2, texNames);
+	for(int i=0; i<MAX_CACHED; i++)
+	{
+		if(cache[i].image >= 0 && cache[i].status == TEXSTREAM_LOADING &&
+		   distanceFromCurrent(cache[i].image) > prefetchCount)
+			evictImage(&cache[i]);
+	}
 
-	scrollAmount = 0;
-	aspectRatio = readfile(globalargv[textureIndex], texNames, &numTiles);
-	lastAdvance = glutGet(GLUT_ELAPSED_TIME);
+	/* The current image is requested first so that it is decoded
+	 * first. */
+	requestImage(currentTexture);
+	for(int i=1; i<=prefetchCount && 2*i-1 < totalTextures; i++)
+	{
+		requestImage((currentTexture+i) % totalTextures);
+		if(2*i < totalTextures)
+			requestImage((currentTexture-i+totalTextures) % totalTextures);
+	}
 }
 
 void display(void)
@@ -229,14 +305,38 @@ void display(void)
 	/* If the texture has changed since we were previously in display() */
 	if(alreadyDisplayedTexture != currentTexture)
 	{
-		// Load the new texture
-		loadTexture(currentTexture);
+		// Start loading the new texture and the ones near it
+		prefetchImages();
 		// Keep a record of which texture we are currently displaying
 		// so we can detect when DGR changes currentTexture on a
 		// slave.
 		alreadyDisplayedTexture = currentTexture;
 	}
 
+	/* Upload a few rows of the images that are loading. */
+	texstream_update_frame();
+	updateVirtualImages();
+
+	/* Keep showing the previous image until the new one is ready so
+	 * that the screen doesn't go blank. The scrolling and
+	 * auto-advance timers start when the new image appears. */
+	cachedImage *current = requestImage(currentTexture);
+	if(current != displayed && current->status != TEXSTREAM_LOADING)
+	{
+		displayed = current;
+		scrollAmount = 0;
+		lastAdvance = glutGet(GLUT_ELAPSED_TIME);
+		enforceBudget();
+	}
+	int numTiles = 0;
+	float aspectRatio = 1;
+	if(displayed && displayed->status == TEXSTREAM_READY)
+	{
+		if(displayed->virt == NULL)
+			numTiles = displayed->tiles.columns * displayed->tiles.rows;
+		aspectRatio = displayed->aspectRatio;
+	}
+
 	/* The view frustum is an orthographic frustum for this
 	 * application. The size of the frustum doesn't matter much, but
 	 * the aspect ratio of the frustum should match the aspect ratio
@@ -257,9 +357,6 @@ void display(void)
 	        -1, 1);
 	glMatrixMode(GL_MODELVIEW);
 
-	// Middle of master frustum in the vertical direction. It divides the top
-	// tiles from the bottom tiles.
-	float masterFrustumMid = (masterFrustum[2]+masterFrustum[3])/2;
 	// Dimensions of the master view frustum
 	float masterFrustumWidth  = masterFrustum[1]-masterFrustum[0];
 	float masterFrustumHeight = masterFrustum[3]-masterFrustum[2];
@@ -270,7 +367,6 @@ void display(void)
 	// frustum times the aspect ratio divided by the number of tiles
 	// in the horizontal direction.
 	float quadWidth = aspectRatio * masterFrustumHeight;
-	float tileWidth = quadWidth/numTiles;
 
 // TODO: Maybe just scale the image vertically if the image almost fits in the screen horizontally?
 
@@ -320,6 +416,8 @@ void display(void)
 		{
 			msg(INFO, "Automatically advancing to next image, please wait.\n");
 			currentTexture = getNextTexture();
+			// Wait for the next image before advancing again.
+			lastAdvance = glutGet(GLUT_ELAPSED_TIME);
 			dgr_setget("currentTexture", &currentTexture, sizeof(int));
 			dgr_update();
 		}
@@ -329,28 +427,68 @@ void display(void)
 	glEnable(GL_TEXTURE_2D);
 	glColor3f(1,1,1); // color of quad
 
-	// Draw the top and bottom quad for each of the tiles going across the screen horizontally. */
-	for(GLuint i=0; i<numTiles*2; i=i+2)
+	// Draw a quad for each tile. The tiles in the last column and row may be smaller than the others.
+	for(int i=0; i<numTiles; i++)
 	{
-		float tileLeft  = (i/2  )*tileWidth + masterFrustum[0];
-		float tileRight = (i/2+1)*tileWidth + masterFrustum[0];
-		
-		// Draw bottom tile
-		glBindTexture(GL_TEXTURE_2D, texNames[i]);
+		texstream_tiles *tiles = &(displayed->tiles);
+		int column = i % tiles->columns;
+		int row    = i / tiles->columns;
+		float left   = column*tiles->tile_width / (float) tiles->width;
+		float right  = (column+1)*tiles->tile_width / (float) tiles->width;
+		float bottom = row*tiles->tile_height / (float) tiles->height;
+		float top    = (row+1)*tiles->tile_height / (float) tiles->height;
+		if(right > 1)
+			right = 1;
+		if(top > 1)
+			top = 1;
+		float tileLeft   = left  *quadWidth + masterFrustum[0] - scrollAmount;
+		float tileRight  = right *quadWidth + masterFrustum[0] - scrollAmount;
+		float tileBottom = bottom*masterFrustumHeight + masterFrustum[2];
+		float tileTop    = top   *masterFrustumHeight + masterFrustum[2];
+
+		glBindTexture(GL_TEXTURE_2D, tiles->textures[i]);
+		glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
 		glBegin(GL_QUADS);
-		glTexCoord2f(0.0, 0.0); glVertex2d(tileLeft -scrollAmount, masterFrustum[2]); // lower left
-		glTexCoord2f(1.0, 0.0); glVertex2d(tileRight-scrollAmount, masterFrustum[2]); // lower right
-		glTexCoord2f(1.0, 1.0); glVertex2d(tileRight-scrollAmount, masterFrustumMid); // upper right
-		glTexCoord2f(0.0, 1.0); glVertex2d(tileLeft -scrollAmount, masterFrustumMid); // upper left
+		glTexCoord2f(0.0, 0.0); glVertex2d(tileLeft,  tileBottom); // lower left
+		glTexCoord2f(1.0, 0.0); glVertex2d(tileRight, tileBottom); // lower right
+		glTexCoord2f(1.0, 1.0); glVertex2d(tileRight, tileTop); // upper right
+		glTexCoord2f(0.0, 1.0); glVertex2d(tileLeft,  tileTop); // upper left
 		glEnd();
+	}
 
-		// Draw top tile
-		glBindTexture(GL_TEXTURE_2D, texNames[i+1]);
+	/* Draw the visible tiles of a virtual texture. The part of the
+	 * image that this process draws (in image pixels) is computed
+	 * from its frustum. */
+	if(displayed && displayed->status == TEXSTREAM_READY && displayed->virt)
+	{
+		int width, height;
+		vtex_ready(displayed->virt, &width, &height);
+		float imageLeft = masterFrustum[0] - scrollAmount;
+		float pixelsPerUnitX = width / quadWidth;
+		float pixelsPerUnitY = height / masterFrustumHeight;
+		float region[4];
+		region[0] = (frustum[0] - imageLeft) * pixelsPerUnitX;
+		region[1] = (frustum[1] - imageLeft) * pixelsPerUnitX;
+		region[2] = (frustum[2] - masterFrustum[2]) * pixelsPerUnitY;
+		region[3] = (frustum[3] - masterFrustum[2]) * pixelsPerUnitY;
+
+		static vtex_quad quads[MAX_VIRTUAL_QUADS];
+		int count = vtex_visible(displayed->virt, region, glutGet(GLUT_WINDOW_WIDTH), quads, MAX_VIRTUAL_QUADS);
+		glBindTexture(GL_TEXTURE_2D, vtex_texture(displayed->virt));
+		glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
 		glBegin(GL_QUADS);
-		glTexCoord2f(0.0, 0.0); glVertex2d(tileLeft -scrollAmount, masterFrustumMid); // lower left
-		glTexCoord2f(1.0, 0.0); glVertex2d(tileRight-scrollAmount, masterFrustumMid); // lower right
-		glTexCoord2f(1.0, 1.0); glVertex2d(tileRight-scrollAmount, masterFrustum[3]); // upper right
-		glTexCoord2f(0.0, 1.0); glVertex2d(tileLeft -scrollAmount, masterFrustum[3]); // upper left
+		for(int i=0; i<count; i++)
+		{
+			vtex_quad *q = &quads[i];
+			float left   = q->x0 / pixelsPerUnitX + imageLeft;
+			float right  = q->x1 / pixelsPerUnitX + imageLeft;
+			float bottom = q->y0 / pixelsPerUnitY + masterFrustum[2];
+			float top    = q->y1 / pixelsPerUnitY + masterFrustum[2];
+			glTexCoord2f(q->s0, q->t0); glVertex2d(left,  bottom); // lower left
+			glTexCoord2f(q->s1, q->t0); glVertex2d(right, bottom); // lower right
+			glTexCoord2f(q->s1, q->t1); glVertex2d(right, top); // upper right
+			glTexCoord2f(q->s0, q->t1); glVertex2d(left,  top); // upper left
+		}
 		glEnd();
 	}
 
@@ -368,7 +506,7 @@ void display(void)
 	glColor4f(1,1,1,.9);
 	glRasterPos2f(-.98,-.98);
 	void *font = GLUT_BITMAP_TIMES_ROMAN_24;
-	char *str = globalargv[currentTexture];
+	char *str = globalargv[displayed ? displayed->image : currentTexture];
 	for(GLuint i=0; i<strlen(str); i++)
 		glutBitmapCharacter(font, str[i]);
 
@@ -554,7 +692,25 @@ int main(int argc, char** argv)
 	dgr_init();
 	projmat_init();
 
-	loadTexture(currentTexture);
+	for(int i=0; i<MAX_CACHED; i++)
+	{
+		cache[i].image = -1;
+		cache[i].virt = NULL;
+	}
+	const char *str = getenv("SLIDESHOW_PREFETCH");
+	if(str != NULL && strlen(str) > 0)
+		prefetchCount = atoi(str);
+	str = getenv("SLIDESHOW_CACHE_MB");
+	if(str != NULL && strlen(str) > 0)
+		cacheBudget = atol(str)*1024*1024;
+	str = getenv("SLIDESHOW_VIRTUAL_MPIXELS");
+	if(str != NULL && strlen(str) > 0)
+		virtualPixels = atol(str)*1000*1000;
+	if(prefetchCount < 0)
+		prefetchCount = 0;
+	if(2*prefetchCount+1 > MAX_CACHED)
+		prefetchCount = (MAX_CACHED-1)/2;
+	prefetchImages();
 
 	/* Tell GLUT to start running the main loop and to call display(),
 	 * keyboard(), etc callback methods as needed. */
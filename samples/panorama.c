@@ -3,8 +3,10 @@
  * the file named "LICENSE" for a full copy of the license.
  */
 
-/** @file This program demonstrates how to load cylindrical and
- * cubemap panorama photos (either in mono or stereo modes).
+/** @file This program demonstrates how to load cylindrical,
+ * cubemap and equirectangular panorama photos (either in mono or
+ * stereo modes). Cubemap and equirectangular panoramas are loaded
+ * into a single cubemap texture and drawn with one full-screen quad.
  *
  * @author Scott Kuhl
  */
@@ -12,6 +14,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 #include <GL/glew.h>
 #ifdef __APPLE__
 #include <GLUT/glut.h>
@@ -25,17 +28,18 @@
 #include "projmat.h"
 #include "viewmat.h"
 GLuint program = 0; // id value for the GLSL program
+GLuint cubemapProgram = 0; // GLSL program that draws a cubemap behind everything
 
-kuhl_geometry quad;
+kuhl_geometry skybox;
 kuhl_geometry cylinder;
 
 /* cylindrical panorama textures */
 GLuint texIdLeft  = 0;
 GLuint texIdRight = 0;
 
-/* cubemap textures */
-GLuint cubemapLeftTex[6];
-GLuint cubemapRightTex[6];
+/* cubemap textures (GL_TEXTURE_CUBE_MAP) */
+GLuint cubemapLeftTex  = 0;
+GLuint cubemapRightTex = 0;
 
 
 
@@ -56,6 +60,9 @@ void keyboard(unsigned char key, int x, int y)
 			tmp = texIdLeft;
 			texIdLeft = texIdRight;
 			texIdRight = tmp;
+			tmp = cubemapLeftTex;
+			cubemapLeftTex = cubemapRightTex;
+			cubemapRightTex = tmp;
 			break;
 		}
 	}
@@ -65,43 +72,27 @@ void keyboard(unsigned char key, int x, int y)
 	glutPostRedisplay();
 }
 
-void setupCubemap(GLuint texId[6], kuhl_geometry q, const float origModelView[16])
+/* Draws a cubemap with a single full-screen quad. The vertex program
+ * uses the inverse of the projection and view rotation to calculate
+ * the direction that each pixel looks in and the fragment program
+ * looks up that direction in the cubemap. */
+void drawCubemap(GLuint texId, const float viewMat[16], const float perspective[16])
 {
-	glUniformMatrix4fv(kuhl_get_uniform("ModelView"),1,0,origModelView);
-	kuhl_geometry_texture(&q, texId[0], "tex", KG_WARN);
-	kuhl_geometry_draw(&q); // negative Z (front)
-	
-	float rotation[16];
-	float modelview[16];
-	mat4f_rotateEuler_new(rotation, 0,180,0, "XYZ");
-	mat4f_mult_mat4f_new(modelview, origModelView, rotation);
-	glUniformMatrix4fv(kuhl_get_uniform("ModelView"),1,0,modelview);
-	kuhl_geometry_texture(&q, texId[1], "tex", KG_WARN);
-	kuhl_geometry_draw(&q); // positive Z (back)
-
-	mat4f_rotateEuler_new(rotation, 0,90,0, "XYZ");
-	mat4f_mult_mat4f_new(modelview, origModelView, rotation);
-	glUniformMatrix4fv(kuhl_get_uniform("ModelView"),1,0,modelview);
-	kuhl_geometry_texture(&q, texId[2], "tex", KG_WARN);
-	kuhl_geometry_draw(&q); // negative X (left)
-
-	mat4f_rotateEuler_new(rotation, 0,-90,0, "XYZ");
-	mat4f_mult_mat4f_new(modelview, origModelView, rotation);
-	glUniformMatrix4fv(kuhl_get_uniform("ModelView"),1,0,modelview);
-	kuhl_geometry_texture(&q, texId[3], "tex", KG_WARN);
-	kuhl_geometry_draw(&q); // positive X (right)
-
-	mat4f_rotateEuler_new(rotation, -90,0,0, "XYZ");
-	mat4f_mult_mat4f_new(modelview, origModelView, rotation);
-	glUniformMatrix4fv(kuhl_get_uniform("ModelView"),1,0,modelview);
-	kuhl_geometry_texture(&q, texId[4], "tex", KG_WARN);
-	kuhl_geometry_draw(&q); // negative Y (down)
-	
-	mat4f_rotateEuler_new(rotation, 90,0,0, "XYZ");
-	mat4f_mult_mat4f_new(modelview, origModelView, rotation);
-	glUniformMatrix4fv(kuhl_get_uniform("ModelView"),1,0,modelview);
-	kuhl_geometry_texture(&q, texId[5], "tex", KG_WARN);
-	kuhl_geometry_draw(&q); // positive Y (up)
+	float viewProjection[16], inverse[16];
+	mat4f_mult_mat4f_new(viewProjection, perspective, viewMat);
+	mat4f_invert_new(inverse, viewProjection);
+
+	glUseProgram(cubemapProgram);
+	glUniformMatrix4fv(kuhl_get_uniform("InverseViewProjection"), 1, 0, inverse);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, texId);
+	glUniform1i(kuhl_get_uniform("cubemap"), 0);
+	/* The quad is behind everything else. */
+	glDisable(GL_DEPTH_TEST);
+	kuhl_geometry_draw(&skybox);
+	glEnable(GL_DEPTH_TEST);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	kuhl_errorcheck();
 }
 
 
@@ -194,9 +185,9 @@ void display()
 		else // cubemap
 		{
 			if(eye == VIEWMAT_EYE_RIGHT)
-				setupCubemap(cubemapRightTex, quad, modelview);
+				drawCubemap(cubemapRightTex, viewMat, perspective);
 			else
-				setupCubemap(cubemapLeftTex, quad, modelview);
+				drawCubemap(cubemapLeftTex, viewMat, perspective);
 		}
 	} // finish viewport loop
 	viewmat_end_frame();
@@ -224,35 +215,23 @@ void display()
 }
 
 
-/* This illustrates how to draw a quad by drawing two triangles and reusing vertices. */
-void init_geometryQuad(kuhl_geometry *geom, GLuint prog)
+/* Creates a quad that covers the whole viewport. The vertices are in
+ * normalized device coordinates and placed on the far plane. */
+void init_geometrySkybox(kuhl_geometry *geom, GLuint prog)
 {
 	kuhl_geometry_new(geom, prog,
 	                  4, // number of vertices
 	                  GL_TRIANGLES); // type of thing to draw
 
-	/* The data that we want to draw */
-	GLfloat vertexPositions[] = {-.5, -.5, -.5,
-	                              .5, -.5, -.5,
-	                              .5,  .5, -.5,
-	                             -.5,  .5, -.5 };
+	GLfloat vertexPositions[] = {-1, -1,
+	                              1, -1,
+	                              1,  1,
+	                             -1,  1 };
 	kuhl_geometry_attrib(geom, vertexPositions,
-	                     3, // number of components x,y,z
+	                     2, // number of components x,y
 	                     "in_Position", // GLSL variable
 	                     KG_WARN); // warn if attribute is missing in GLSL program?
 
-	GLfloat texcoord[] = {0, 0,
-	                      1, 0,
-	                      1, 1,
-	                      0, 1};
-	kuhl_geometry_attrib(geom, texcoord,
-	                     2, // number of components x,y,z
-	                     "in_TexCoord", // GLSL variable
-	                     KG_WARN); // warn if attribute is missing in GLSL program?
-
-
-	
-
 	GLuint indexData[] = { 0, 1, 2,  // first triangle is index 0, 1, and 2 in the list of vertices
 	                       0, 2, 3 }; // indices of second triangle.
 	kuhl_geometry_indices(geom, indexData, 6);
@@ -423,7 +402,16 @@ void init_geometryCylinder(kuhl_geometry *cyl, GLuint prog)
 
 int main(int argc, char** argv)
 {
-	if(argc != 2 && argc != 3 && argc != 7 && argc != 13)
+	int equirect = 0;
+	if(argc > 1 && strcmp(argv[1], "--equirect") == 0)
+	{
+		/* Remove the option from the arguments. */
+		equirect = 1;
+		argv[1] = argv[0];
+		argv++;
+		argc--;
+	}
+	if(argc != 2 && argc != 3 && (equirect || (argc != 7 && argc != 13)))
 	{
 		printf("Usage for cylindrical panoramas:\n");
 		printf("   %s panoImage.jpg\n", argv[0]);
@@ -433,6 +421,10 @@ int main(int argc, char** argv)
 		printf("   %s front.jpg back.jpg left.jpg right.jpg down.jpg up.jpg\n", argv[0]);
 		printf("   %s Lfront.jpg Lback.jpg Lleft.jpg Lright.jpg Ldown.jpg Lup.jpg Rfront.jpg Rback.jpg Rleft.jpg Rright.jpg Rdown.jpg Rup.jpg\n", argv[0]);
 		printf("\n");
+		printf("Usage for equirectangular (360x180 degree) panoramas:\n");
+		printf("   %s --equirect panoImage.jpg\n", argv[0]);
+		printf("   %s --equirect left.jpg right.jpg\n", argv[0]);
+		printf("\n");
 		printf("Tip: Works best if horizon is at center of the panorama.\n");
 		exit(EXIT_FAILURE);
 	}
@@ -477,16 +469,29 @@ int main(int argc, char** argv)
 	glUseProgram(program);
 	kuhl_errorcheck();
 
-	init_geometryQuad(&quad, program);
+	cubemapProgram = kuhl_create_program("cubemap.vert", "cubemap.frag");
+	init_geometrySkybox(&skybox, cubemapProgram);
+	glUseProgram(program);
 	init_geometryCylinder(&cylinder, program);
 
-	if(argc == 2)
+	if(equirect)
+	{
+		msg(INFO, "Equirectangular left  image: %s\n", argv[1]);
+		kuhl_read_cubemap_equirect(argv[1], &cubemapLeftTex, 0);
+		cubemapRightTex = cubemapLeftTex;
+		if(argc == 3)
+		{
+			msg(INFO, "Equirectangular right image: %s\n", argv[2]);
+			kuhl_read_cubemap_equirect(argv[2], &cubemapRightTex, 0);
+		}
+	}
+	else if(argc == 2)
 	{
 		msg(INFO, "Cylinder mono image: %s\n", argv[1]);
 		kuhl_read_texture_file(argv[1], &texIdLeft);
 		texIdRight = texIdLeft;
 	}
-	if(argc == 3)
+	else if(argc == 3)
 	{
 		msg(INFO, "Cylinder left  image: %s\n", argv[1]);
 		kuhl_read_texture_file(argv[1], &texIdLeft);
@@ -494,29 +499,24 @@ int main(int argc, char** argv)
 		kuhl_read_texture_file(argv[2], &texIdRight);
 	}
 
-	char *cubemapNames[] = { "front", "back", "left", "right", "down", "up" };	
-	if(argc == 7)
+	const char *cubemapNames[] = { "front", "back", "left", "right", "down", "up" };
+	if(argc == 7 || argc == 13)
 	{
 		for(int i=0; i<6; i++)
-		{
-			msg(INFO, "Cubemap image (%-5s): %s\n", cubemapNames[i], argv[i+1]);
-			kuhl_read_texture_file(argv[i+1], &(cubemapLeftTex[i]));
-			cubemapRightTex[i]= cubemapLeftTex[i];
-			texIdLeft =0;
-			texIdRight=0;
-		}
+			msg(INFO, "Cubemap image (left,  %-5s): %s\n", cubemapNames[i], argv[i+1]);
+		kuhl_read_cubemap_files((const char**) &argv[1], &cubemapLeftTex);
+		cubemapRightTex = cubemapLeftTex;
 	}
 	if(argc == 13)
 	{
 		for(int i=0; i<6; i++)
-		{
-			msg(INFO, "Cubemap image (left,  %-5s): %s\n", cubemapNames[i], argv[i+6+1]);
-			kuhl_read_texture_file(argv[i+6+1], &(cubemapLeftTex[i]));
-			msg(INFO, "Cubemap image (right, %-5s)\n", cubemapNames[i], argv[i+6+1]);
-			cubemapRightTex[i]= cubemapLeftTex[i];
-			texIdLeft =0;
-			texIdRight=0;
-		}
+			msg(INFO, "Cubemap image (right, %-5s): %s\n", cubemapNames[i], argv[i+6+1]);
+		kuhl_read_cubemap_files((const char**) &argv[7], &cubemapRightTex);
+	}
+	if((argc == 7 || argc == 13 || equirect) && (cubemapLeftTex == 0 || cubemapRightTex == 0))
+	{
+		msg(FATAL, "Unable to load the cubemap.\n");
+		exit(EXIT_FAILURE);
 	}
 	
 	
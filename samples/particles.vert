@@ -0,0 +1,60 @@
+#version 150 // GLSL 150 = OpenGL 3.2
+
+/* Updates the particles created by particles.c. Each vertex is one
+ * particle; the results are written into a buffer with transform
+ * feedback and nothing is drawn. */
+
+in vec3 in_Position;     // position of the particle
+in vec3 in_Velocity;     // velocity of the particle
+in vec3 in_RestPosition; // position of the vertex in the original geometry
+in vec3 in_Normal;       // normal of the vertex in the original geometry
+
+uniform int mode;        // 0=reset, 1=explode, 2=move
+uniform float timestep;
+uniform vec3 accel;
+uniform float bounce;    // fraction of velocity kept when bouncing off of the XZ plane
+uniform vec3 explode;    // speed along the normal, speed up (+Y), amount of randomness
+uniform uint seed;
+
+out vec3 out_Position;
+out vec3 out_Velocity;
+
+/* Returns a pseudo-random number between 0 and 1. */
+float random(uint n)
+{
+	n = (n << 13u) ^ n;
+	n = n * (n * n * 15731u + 789221u) + 1376312589u;
+	return float(n & 0x7fffffffu) / float(0x7fffffff);
+}
+
+void main()
+{
+	out_Position = in_Position;
+	out_Velocity = in_Velocity;
+
+	if(mode == 0)
+	{
+		out_Position = in_RestPosition;
+		out_Velocity = vec3(0,0,0);
+	}
+	else if(mode == 1)
+	{
+		/* Move out along the normal, up, and in a random direction. */
+		uint id = uint(gl_VertexID) * 3u + seed;
+		vec3 r = vec3(random(id), random(id+1u), random(id+2u)) - .5;
+		out_Velocity = in_Normal * explode.x + vec3(0, explode.y, 0) + r * explode.z;
+	}
+	else
+	{
+		out_Position = in_Position + timestep * (in_Velocity + timestep * accel / 2);
+		out_Velocity = in_Velocity + timestep * accel;
+
+		/* Bounce off of the XZ plane. */
+		if(bounce > 0 && out_Position.y < 0)
+		{
+			out_Position.y *= -bounce;
+			out_Velocity.y *= -1;
+			out_Velocity *= bounce;
+		}
+	}
+}
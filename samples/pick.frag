@@ -0,0 +1,12 @@
+#version 150 // GLSL 150 = OpenGL 3.2
+
+/* Used by pick.c to draw the IDs of objects. */
+
+uniform uint DrawId; // index of the geometry in the list of draws (plus 1)
+
+out uvec2 out_Id;
+
+void main()
+{
+	out_Id = uvec2(DrawId, uint(gl_PrimitiveID));
+}
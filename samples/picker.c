@@ -4,9 +4,11 @@
  */
 
 /** @file This example demonstrates how to draw a HUD cursor and how
- * to use the stencil buffer to determine what piece of geometry the
- * cursor is on. For more information and details, see:
- * http://en.wikibooks.org/wiki/OpenGL_Programming/Object_selection
+ * to determine what piece of geometry the cursor is on. By default,
+ * the objects are drawn with IDs into a small framebuffer around the
+ * cursor and the result is read back a frame later (see pick.h).
+ * Press 'p' to switch to intersecting a ray through the cursor with
+ * a bounding volume hierarchy on the CPU instead (see bvh.h).
  *
  * @author Scott Kuhl
  */
@@ -26,12 +28,54 @@
 #include "dgr.h"
 #include "projmat.h"
 #include "viewmat.h"
+#include "bvh.h"
+#include "pick.h"
 GLuint program = 0; // id value for the GLSL program
 
 kuhl_geometry cursor;
 kuhl_geometry triangle;
 kuhl_geometry quad;
 
+/** IDs that the objects are picked with (0 means nothing). */
+enum { PICK_NOTHING, PICK_TRIANGLE, PICK_QUAD };
+
+pick_buffer picker;
+bvh_tree triangleTree, quadTree;
+int useRay = 0; /**< Pick with rays on the CPU instead of with the GPU? */
+int lastPicked = -1;
+
+/** Prints the object that the cursor is on when it changes. */
+void print_picked(int picked, int primitive)
+{
+	if(picked == lastPicked)
+		return;
+	lastPicked = picked;
+	if(picked == PICK_TRIANGLE)
+		printf("Cursor is on triangle.\n");
+	else if(picked == PICK_QUAD)
+		printf("Cursor is on quad (triangle %d).\n", primitive);
+	else
+		printf("Cursor isn't on anything.\n");
+}
+
+/** Finds the object under the cursor by intersecting a ray with the
+ * bounding volume hierarchy of each object. */
+void pick_with_ray(const int viewport[4], int x, int y, const float viewMat[16], const float perspective[16], const float modelMat[16])
+{
+	bvh_refit(&triangleTree, modelMat);
+	bvh_refit(&quadTree, modelMat);
+
+	bvh_hit triangleHit, quadHit;
+	int hitTriangle = pick_ray(&triangleTree, viewport, x, y, viewMat, perspective, &triangleHit);
+	int hitQuad = pick_ray(&quadTree, viewport, x, y, viewMat, perspective, &quadHit);
+	if(hitTriangle && (!hitQuad || triangleHit.distance <= quadHit.distance))
+		print_picked(PICK_TRIANGLE, triangleHit.triangle);
+	else if(hitQuad)
+		print_picked(PICK_QUAD, quadHit.triangle);
+	else
+		print_picked(PICK_NOTHING, 0);
+}
+
 
 /* Called by GLUT whenever a key is pressed. */
 void keyboard(unsigned char key, int x, int y)
@@ -44,6 +88,11 @@ void keyboard(unsigned char key, int x, int y)
 			dgr_exit();
 			exit(EXIT_SUCCESS);
 			break;
+		case 'p':
+			useRay = !useRay;
+			lastPicked = -1;
+			printf("Picking with %s\n", useRay ? "rays through the bounding volume hierarchy" : "the GPU");
+			break;
 	}
 
 	/* Whenever any key is pressed, request that display() get
@@ -83,7 +132,7 @@ void display()
 		glScissor(viewport[0], viewport[1], viewport[2], viewport[3]);
 		glEnable(GL_SCISSOR_TEST);
 		glClearColor(.2,.2,.2,0); // set clear color to grey
-		glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT|GL_STENCIL_BUFFER_BIT);
+		glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
 		glDisable(GL_SCISSOR_TEST);
 		glEnable(GL_DEPTH_TEST); // turn on depth testing
 		kuhl_errorcheck();
@@ -107,10 +156,10 @@ void display()
 		float scaleMatrix[16];
 		mat4f_scale_new(scaleMatrix, 3, 3, 3);
 
-		// Modelview = (viewMatrix * scaleMatrix) * rotationMatrix
-		float modelview[16];
-		mat4f_mult_mat4f_new(modelview, viewMat, scaleMatrix);
-		mat4f_mult_mat4f_new(modelview, modelview, rotateMat);
+		// Modelview = viewMatrix * (scaleMatrix * rotationMatrix)
+		float modelMat[16], modelview[16];
+		mat4f_mult_mat4f_new(modelMat, scaleMatrix, rotateMat);
+		mat4f_mult_mat4f_new(modelview, viewMat, modelMat);
 
 		kuhl_errorcheck();
 		glUseProgram(program);
@@ -127,18 +176,10 @@ void display()
 		                   modelview); // value
 		kuhl_errorcheck();
 
-			/* Draw the geometry using the matrices that we sent to the
-			 * vertex programs immediately above. Use the stencil buffer
-			 * to keep track of which object appears on top. */
-		if(viewportID == 0)
-			glEnable(GL_STENCIL_TEST);
-		glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
-		glStencilFunc(GL_ALWAYS, 1, -1);
+		/* Draw the geometry using the matrices that we sent to the
+		 * vertex programs immediately above. */
 		kuhl_geometry_draw(&triangle);
-		
-		glStencilFunc(GL_ALWAYS, 2, -1);
 		kuhl_geometry_draw(&quad);
-		glDisable(GL_STENCIL_TEST);
 		
 		/* If we have multiple viewports, only draw cursor in the
 		 * first viewport. */
@@ -159,28 +200,25 @@ void display()
 			kuhl_geometry_draw(&cursor);
 			glEnable(GL_DEPTH_TEST);
 
-			/* When we render images on the Oculus, we are rendering
-			 * into a multisampled framebuffer object, and we can't
-			 * read from the multisample FBO until we have blitted it
-			 * into a normal FBO. Here, we get the blitted FBO for the
-			 * *previous* frame. */
-			GLint fb =viewmat_get_blitted_framebuffer(viewportID);
-			glBindFramebuffer(GL_FRAMEBUFFER, fb);
-			
-			GLuint stencilVal = 0;
-			kuhl_errorcheck();
-			glReadPixels(viewport[0]+viewport[2]/2, viewport[1]+viewport[3]/2,
-			             1,1, // get data for 1x1 area (i.e., a pixel)
-			             GL_STENCIL_INDEX, // query the stencil buffer
-			             GL_UNSIGNED_INT,
-			             &stencilVal);
-			kuhl_errorcheck();
-			if(stencilVal == 1)
-				printf("Cursor is on triangle.\n");
-			else if(stencilVal == 2)
-				printf("Cursor is on quad.\n");
+			/* Find the object in the center of the viewport. The
+			 * GPU result that we get is usually from the previous
+			 * frame, so we never wait for the GPU to finish drawing
+			 * this one. */
+			int x = viewport[0]+viewport[2]/2;
+			int y = viewport[1]+viewport[3]/2;
+			if(useRay)
+				pick_with_ray(viewport, x, y, viewMat, perspective, modelMat);
 			else
-				printf("Cursor isn't on anything.\n");
+			{
+				pick_begin(&picker, viewport, x, y, viewMat, perspective);
+				pick_draw(&picker, &triangle, modelMat, PICK_TRIANGLE);
+				pick_draw(&picker, &quad, modelMat, PICK_QUAD);
+				pick_end(&picker);
+
+				pick_result result;
+				if(pick_get(&picker, &result))
+					print_picked(result.id, result.primitive);
+			}
 		}
 
 		glUseProgram(0); // stop using a GLSL program.
@@ -275,9 +313,9 @@ int main(int argc, char** argv)
 	/* Ask GLUT to for a double buffered, full color window that
 	 * includes a depth buffer */
 #ifdef __APPLE__
-	glutInitDisplayMode(GLUT_3_2_CORE_PROFILE | GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH | GLUT_MULTISAMPLE | GLUT_STENCIL);
+	glutInitDisplayMode(GLUT_3_2_CORE_PROFILE | GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH | GLUT_MULTISAMPLE);
 #else
-	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH | GLUT_MULTISAMPLE | GLUT_STENCIL);
+	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH | GLUT_MULTISAMPLE);
 	glutInitContextVersion(3,2);
 	glutInitContextProfile(GLUT_CORE_PROFILE);
 #endif
@@ -321,6 +359,15 @@ int main(int argc, char** argv)
 	init_geometryTriangle(&triangle, program);
 	init_geometryQuad(&quad, program);
 
+	/* Prepare both ways of picking. Only the pixels in a 5x5 area
+	 * around the cursor are drawn into the pick buffer. */
+	if(pick_init(&picker, 5) == 0)
+		useRay = 1;
+	float identity[16];
+	mat4f_identity(identity);
+	bvh_build(&triangleTree, &triangle, identity, BVH_TRIANGLES);
+	bvh_build(&quadTree, &quad, identity, BVH_TRIANGLES);
+
 	dgr_init();     /* Initialize DGR based on environment variables. */
 	projmat_init(); /* Figure out which projection matrix we should use based on environment variables */
 
@@ -167,8 +167,9 @@ void display()
 		kuhl_geometry_draw(&triangle);
 		kuhl_geometry_draw(&quad);
 
-		/* Stop rendering to texture */
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		/* Stop rendering to texture. Viewmat might not render
+		 * this viewport straight to the window. */
+		glBindFramebuffer(GL_FRAMEBUFFER, viewmat_get_framebuffer(viewportID));
 		glUseProgram(0);
 		kuhl_errorcheck();
 		
@@ -179,8 +180,7 @@ void display()
 		glBlitFramebuffer(0,0,viewport[2],viewport[3],
 		                  0,0,viewport[2],viewport[3],
 		                  GL_COLOR_BUFFER_BIT, GL_NEAREST);
-		glBindFramebuffer(GL_READ_FRAMEBUFFER,0);
-		glBindFramebuffer(GL_DRAW_FRAMEBUFFER,0);
+		glBindFramebuffer(GL_FRAMEBUFFER, viewmat_get_framebuffer(viewportID));
 		kuhl_errorcheck();
 #endif
 
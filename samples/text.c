@@ -158,9 +158,10 @@ void display()
 		glDisable(GL_DEPTH_TEST); // turn off depth testing
 		kuhl_errorcheck();
 		
+		/* Both strings are drawn with a single draw call by
+		 * font_flush(). */
 		float x = 10, y = 10;
-		font_draw(&text, buffer, x, y);
-		kuhl_errorcheck();
+		font_append(&text, buffer, x, y);
 		
 		// Draw fps
 		if(dgr_is_enabled() == 0 || dgr_is_master())
@@ -169,9 +170,10 @@ void display()
 			char label[1024] = "FPS: -0.0";
 			// Check if FPS value was just updated by kuhl_getfps()
 			snprintf(label, 1024, "FPS: %0.1f", fps);
-			font_draw(&text, label, x, y);
-			kuhl_errorcheck();
+			font_append(&text, label, x, y);
 		}
+		font_flush(&text);
+		kuhl_errorcheck();
 		
 		glEnable(GL_DEPTH_TEST); // turn on depth testing
 		kuhl_errorcheck();
@@ -23,6 +23,7 @@
 #include "dgr.h"
 #include "projmat.h"
 #include "viewmat.h"
+#include "trace.h"
 
 GLuint fpsLabel = 0;
 float fpsLabelAspectRatio = 0;
@@ -33,6 +34,13 @@ GLuint program = 0; // id value for the GLSL program
 kuhl_geometry *modelgeom = NULL;
 kuhl_geometry *origingeom = NULL;
 float bbox[6];
+unsigned int drawnCount = 0, culledCount = 0; // meshes drawn/culled in the last frame
+kuhl_render_queue visibleQueue; // meshes that are visible in at least one viewport
+#define MAX_OCCLUSION_VIEWPORTS 4
+kuhl_occlusion occlusion[MAX_OCCLUSION_VIEWPORTS]; // occlusion query results for each viewport
+int useOcclusion = 1; // skip meshes that are hidden behind other meshes?
+unsigned int occludedCount = 0; // meshes skipped (or left to the GPU) because they were hidden in the last frame
+int showProfile = 0; // show frame timing instead of FPS in the label?
 
 int fitToView=0;  // was --fit option used?
 
@@ -109,6 +117,23 @@ void keyboard(unsigned char key, int x, int y)
 				glPolygonMode(GL_FRONT_AND_BACK, GL_POINT);
 			break;
 		}
+		case 'o':
+			// Toggle occlusion culling
+			useOcclusion = !useOcclusion;
+			printf("Occlusion culling is %s\n", useOcclusion ? "on" : "off");
+			break;
+		case 't':
+			// Toggle the frame timing display
+			showProfile = !showProfile;
+			viewmat_profile_enable(showProfile);
+			break;
+		case 'T':
+			// Write the zones recorded so far to a trace file
+			if(trace_enabled)
+				trace_write(NULL);
+			else
+				printf("Tracing is disabled. Set the KUHL_TRACE environment variable to enable it.\n");
+			break;
 		case 'c':
 		{
 			// Toggle front, back, and no culling
@@ -273,7 +298,11 @@ void display()
 		if(fps_state.frame == 0)
 		{
 			char label[1024];
-			snprintf(label, 1024, "FPS: %0.1f", fps);
+			if(showProfile)
+				viewmat_profile_string(label, 1024);
+			else
+				snprintf(label, 1024, "FPS: %0.1f Drawn: %u Culled: %u Occluded: %u",
+				         fps, drawnCount, culledCount, occludedCount);
 
 			/* Delete old label if it exists */
 			if(fpsLabel != 0) 
@@ -303,14 +332,61 @@ void display()
 	 * run twice for HMDs (once for the left eye and once for the
 	 * right. */
 	viewmat_begin_frame();
-	for(int viewportID=0; viewportID<viewmat_num_viewports(); viewportID++)
+
+	/* Get the view and projection matrices for all of the viewports
+	 * so that we can cull the model once against a frustum that
+	 * covers all of them (i.e., both eyes) and reuse the list of
+	 * visible meshes in each viewport. */
+	int numViewports = viewmat_num_viewports();
+	float viewMats[numViewports][16], perspectives[numViewports][16];
+	float modelMat[16];
+	get_model_matrix(modelMat);
+	kuhl_frustum frustum;
+	for(int viewportID=0; viewportID<numViewports; viewportID++)
+	{
+		viewmat_get(viewMats[viewportID], perspectives[viewportID], viewportID);
+		float modelview[16];
+		mat4f_mult_mat4f_new(modelview, viewMats[viewportID], modelMat);
+		kuhl_frustum eyeFrustum;
+		kuhl_frustum_extract(&eyeFrustum, perspectives[viewportID], modelview);
+		if(viewportID == 0)
+			frustum = eyeFrustum;
+		else
+			kuhl_frustum_union(&frustum, &frustum, &eyeFrustum);
+	}
+	/* Choose the level of detail of large meshes from their size
+	 * in the first viewport so that every viewport draws the same
+	 * version. */
+	int lodViewport[4];
+	viewmat_get_viewport(lodViewport, 0);
+	float lodModelview[16];
+	mat4f_mult_mat4f_new(lodModelview, viewMats[0], modelMat);
+	kuhl_geometry_lod_select(modelgeom, lodModelview, perspectives[0], lodViewport[3]);
+
+	kuhl_render_queue_clear(&visibleQueue);
+	kuhl_render_queue_add_visible(&visibleQueue, modelgeom, &frustum);
+
+	/* In single-pass stereo mode, both eyes are drawn in one pass
+	 * through this loop: Each kuhl_geometry is drawn twice (once
+	 * per eye) and the vertex program uses the StereoModelView and
+	 * StereoProjection uniforms. */
+	int singlePass = viewmat_single_pass();
+	int numPasses = singlePass ? 1 : numViewports;
+	for(int viewportID=0; viewportID<numPasses; viewportID++)
 	{
 		viewmat_begin_eye(viewportID);
 
 		/* Where is the viewport that we are drawing onto and what is its size? */
 		int viewport[4]; // x,y of lower left corner, width, height
 		viewmat_get_viewport(viewport, viewportID);
-		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+		if(singlePass)
+		{
+			/* Both eyes are side-by-side with the same size. */
+			viewport[2] *= 2;
+			viewmat_begin_stereo();
+		}
+		else
+			glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
 
 		/* Clear the current viewport. Without glScissor(), glClear()
 		 * clears the entire screen. We could call glClear() before
@@ -332,9 +408,9 @@ void display()
 		glBlendEquationSeparate(GL_FUNC_ADD, GL_FUNC_ADD);
 		glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ZERO);
 
-		/* Get the view or camera matrix; update the frustum values if needed. */
-		float viewMat[16], perspective[16];
-		viewmat_get(viewMat, perspective, viewportID);
+		/* The view and projection matrices for this viewport. */
+		float *viewMat = viewMats[viewportID];
+		float *perspective = perspectives[viewportID];
 
 		glUseProgram(program);
 		kuhl_errorcheck();
@@ -344,8 +420,6 @@ void display()
 		                   0, // transpose
 		                   perspective); // value
 
-		float modelMat[16];
-		get_model_matrix(modelMat);
 		float modelview[16];
 		mat4f_mult_mat4f_new(modelview, viewMat, modelMat); // modelview = view * model
 
@@ -355,14 +429,31 @@ void display()
 		                   0, // transpose
 		                   modelview); // value
 
+		/* Send the matrices for both eyes in single-pass stereo mode. */
+		float stereoModelView[2][16];
+		if(singlePass)
+		{
+			for(int eye=0; eye<2; eye++)
+				mat4f_mult_mat4f_new(stereoModelView[eye], viewMats[eye], modelMat);
+			glUniformMatrix4fv(kuhl_get_uniform("StereoModelView"), 2, 0, stereoModelView[0]);
+			glUniformMatrix4fv(kuhl_get_uniform("StereoProjection"), 2, 0, perspectives[0]);
+		}
+		glUniform1i(kuhl_get_uniform("StereoViews"), singlePass ? 2 : 0);
+
 		glUniform1i(kuhl_get_uniform("renderStyle"), renderStyle);
 		// Copy far plane value into vertex program so we can render depth buffer.
 		float f[6]; // left, right, bottom, top, near>0, far>0
-		projmat_get_frustum(f, viewport[2], viewport[3]);
+		projmat_get_frustum(f, singlePass ? viewport[2]/2 : viewport[2], viewport[3]);
 		glUniform1f(kuhl_get_uniform("farPlane"), f[5]);
 
 		kuhl_errorcheck();
-		kuhl_geometry_draw(modelgeom); /* Draw the model */
+		/* Draw the parts of the model that are inside of the
+		 * combined view frustum. */
+		if(useOcclusion && !singlePass && viewportID < MAX_OCCLUSION_VIEWPORTS)
+			kuhl_render_queue_draw_occluded(&visibleQueue, &occlusion[viewportID], modelview, perspective);
+		else
+			kuhl_render_queue_draw(&visibleQueue);
+		glUseProgram(program); // kuhl_render_queue_draw() unbinds the program
 		kuhl_errorcheck();
 		if(showOrigin)
 		{
@@ -380,6 +471,8 @@ void display()
 			                   1, // number of 4x4 float matrices
 			                   0, // transpose
 			                   modelview); // value
+			if(singlePass)
+				glUniformMatrix4fv(kuhl_get_uniform("StereoModelView"), 2, 0, viewMats[0]);
 			kuhl_geometry_draw(origingeom); /* Draw the origin marker */
 
 			/* Restore line width */
@@ -411,6 +504,18 @@ void display()
 			float identity[16];
 			mat4f_identity(identity);
 			glUniformMatrix4fv(kuhl_get_uniform("Projection"), 1, 0, identity);
+			if(singlePass)
+			{
+				/* Place the label in the same spot in both eyes. */
+				float stereoLabel[2][16], stereoIdentity[2][16];
+				for(int eye=0; eye<2; eye++)
+				{
+					mat4f_copy(stereoLabel[eye], modelview);
+					mat4f_copy(stereoIdentity[eye], identity);
+				}
+				glUniformMatrix4fv(kuhl_get_uniform("StereoModelView"), 2, 0, stereoLabel[0]);
+				glUniformMatrix4fv(kuhl_get_uniform("StereoProjection"), 2, 0, stereoIdentity[0]);
+			}
 
 			/* Don't use depth testing and make sure we use the texture
 			 * rendering style */
@@ -422,9 +527,19 @@ void display()
 		}
 
 		glUseProgram(0); // stop using a GLSL program.
+		if(singlePass)
+			viewmat_end_stereo();
 
 	} // finish viewport loop
 	viewmat_end_frame();
+	kuhl_cull_stats(&drawnCount, &culledCount);
+	occludedCount = 0;
+	for(int i=0; i<MAX_OCCLUSION_VIEWPORTS; i++)
+	{
+		unsigned int conditional, skipped;
+		kuhl_occlusion_stats(&occlusion[i], NULL, &conditional, &skipped);
+		occludedCount += conditional + skipped;
+	}
 	
 	/* Update the model for the next frame based on the time. We
 	 * convert the time to seconds and then use mod to cause the
@@ -575,10 +690,21 @@ int main(int argc, char** argv)
 	glClearColor(.2,.2,.2,1);
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	// Load the model from the file
-	modelgeom = kuhl_load_model(modelFilename, modelTexturePath, program, bbox);
+	// Load the model (and the origin marker) from the files. The
+	// models are imported on several threads.
+	const char *modelFilenames[2] = { modelFilename, "../models/origin/origin.obj" };
+	const char *textureDirnames[2] = { modelTexturePath, NULL };
+	kuhl_geometry *models[2];
+	float bboxes[2][6];
+	kuhl_load_models(modelFilenames, textureDirnames, showOrigin ? 2 : 1, program, models, bboxes);
+	modelgeom = models[0];
+	if(modelgeom != NULL)
+		memcpy(bbox, bboxes[0], sizeof(bbox));
 	if(showOrigin)
-		origingeom = kuhl_load_model("../models/origin/origin.obj", NULL, program, NULL);
+		origingeom = models[1];
+	kuhl_render_queue_init(&visibleQueue);
+	for(int i=0; i<MAX_OCCLUSION_VIEWPORTS; i++)
+		kuhl_occlusion_init(&occlusion[i]);
 	
 	init_geometryQuad(&labelQuad, program);
 
@@ -23,6 +23,8 @@
 #include <string>
 #include <cerrno>
 #include <time.h>
+#include <signal.h>
+#include <vector>
 
 #include "vrpn_Text.h"
 #include "vrpn_Tracker.h"
@@ -38,9 +40,10 @@ using namespace std;
 class myTracker : public vrpn_Tracker
 {
   public:
-	myTracker( const char* name, bool* flags, vrpn_Connection *c = 0, int fd = -1 );
+	myTracker( const char* name, bool* flags, vrpn_Connection *c = 0, tdl_reader* file = NULL, int object = 0, double speed = 1 );
 	virtual ~myTracker() {};
 	virtual void mainloop();
+	void setTime(double seconds);
 
   protected:
 	struct timeval _timestamp;
@@ -52,12 +55,15 @@ class myTracker : public vrpn_Tracker
   	bool noise;
   	bool type;
   	char* trackerName;
-  	int fd;
+  	tdl_reader* file;
+  	int object;
+  	double speed;
+  	double playTime;
   	int modifier;
   	long lastrecord;
 };
 
-myTracker::myTracker( const char* name, bool* flags, vrpn_Connection *c, int fd ) :
+myTracker::myTracker( const char* name, bool* flags, vrpn_Connection *c, tdl_reader* file, int object, double speed ) :
 	vrpn_Tracker( name, c )
 {
 	printf("Using tracker name: %s\n", name);
@@ -66,32 +72,39 @@ myTracker::myTracker( const char* name, bool* flags, vrpn_Connection *c, int fd
 	this->quiet = flags[1];
 	this->noise = flags[2];
 	this->type = flags[3];
-	this->fd = fd;
+	this->file = file;
+	this->object = object;
+	this->speed = speed;
+	this->playTime = 0;
 	this->modifier = ((double) rand() / (RAND_MAX)) * (360);
 	kuhl_getfps_init(&fps_state);
 }
 
+/* Sets the time (in seconds since the server started) that the next
+ * mainloop() sends the tracker's position for. */
+void myTracker::setTime(double seconds)
+{
+	playTime = seconds * speed;
+	if(type == FILE_TRACKER)
+	{
+		//Loop at the end of the file.
+		double duration = tdl_reader_duration(file);
+		playTime = duration > 0 ? fmod(playTime, duration) : 0;
+	}
+}
+
 void myTracker::mainloop()
 {
 	vrpn_gettimeofday(&_timestamp, NULL);
 	vrpn_Tracker::timestamp = _timestamp;
 
-	float filePos[3];
-	float fileOrient[9];
-	int readVal = -1;
+	float filePos[3] = { 0, 0, 0 };
+	float fileOrient[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
 	if(type == FILE_TRACKER)
 	{
-		readVal = tdl_read(fd, filePos, fileOrient);
-	
-		//Handle the end of the file or an error.
-		if(readVal == 1)
-		{
-			tdl_prepare(fd, NULL);
-		}
-		else if(readVal == -1)
-		{
-			exit(0);
-		}
+		//Interpolate between the records around the time so that playback
+		//is smooth even if we send faster than the file was recorded.
+		tdl_reader_interpolate(file, object, playTime, filePos, fileOrient);
 	}
 	
 	if(!quiet)
@@ -100,7 +113,7 @@ void myTracker::mainloop()
 		printf(LINE_CLEAR "Records sent per second: %.1f\n", kuhl_getfps(&fps_state));	
 	}
 	
-	double angle = kuhl_milliseconds_start() / 1000.0;
+	double angle = playTime;
 
 	// Position
 	if(type == DATA_TRACKER)
@@ -116,15 +129,12 @@ void myTracker::mainloop()
 		pos[2] = filePos[2];
 	}
 	
-	double r[10];
+	double r[6];
 	if(noise)
 	{
 		// generate some random numbers to simulate imperfect tracking system
-		for(int i=0; i<10; i++)
-		{
-			r[i] = 0;
-			r[i] = kuhl_gauss(); // generate some random numbers
-		}
+		for(int i=0; i<6; i++)
+			r[i] = kuhl_gauss();
 	
 		// Add random noise to position
 		pos[0] += r[0] * .10;
@@ -183,11 +193,47 @@ void myTracker::mainloop()
 	server_mainloop();
 }
 
+static volatile sig_atomic_t done = 0;
+
+/* Stop the server on Ctrl+C so that the jitter summary is printed. */
+static void stop(int sig)
+{
+	done = 1;
+}
+
+/* How late records were sent compared to when they were scheduled. */
+typedef struct
+{
+	long count;
+	long missed; /* Times we fell more than a period behind and skipped a send */
+	double sum, sumSq, max;
+} jitter_stats;
+
+static void jitter_add(jitter_stats* j, double late)
+{
+	j->count++;
+	j->sum += late;
+	j->sumSq += late*late;
+	if(late > j->max)
+		j->max = late;
+}
+
+static void jitter_print(const char* prefix, const jitter_stats* j, double period)
+{
+	double mean = j->count ? j->sum / j->count : 0;
+	double var = j->count ? j->sumSq / j->count - mean*mean : 0;
+	printf(LINE_CLEAR "%sSent at %.1f Hz: late by %.3f ms on average, jitter %.3f ms, max %.3f ms, %ld missed\n",
+	       prefix, 1.0/period, mean*1000, sqrt(var > 0 ? var : 0)*1000, j->max*1000, j->missed);
+}
+
 /**
+ * -c (count)- Takes one parameter. Generates data for the specified number of trackers named Tracker0, Tracker1, ...
  * -f (files)- Takes one or more parameters, this will read from a log file instead of generating data.
  * -h (help)- Prints a helpful message
  * -n (noise)- Adds noise to each data point.
  * -q (quiet)- Turns off almost all debugging.
+ * -r (rate)- Takes one parameter. The number of records sent per second for each tracker.
+ * -s (speed)- Takes one or more parameters. Playback speed for each file (or for generated data), the last one is used for the rest.
  * -t (tracker)- Takes one or more parameters. Uses the specified names for the tracked objects, multiple names will create multiple objects.
  * -v (verbose)- Turns on some extra debugging.
  */
@@ -200,6 +246,9 @@ int main(int argc, char* argv[])
 	bool noise = false;
 	char** objNamesv = NULL;
 	int objNamesc = 0;
+	int generatec = 0;
+	double rate = 100;
+	std::vector<double> speeds;
 	
 	//Start out with no file names, we will malloc later if we need it.
 	char** filesv = NULL;
@@ -208,11 +257,14 @@ int main(int argc, char* argv[])
 	//Check the arguments for any options supplied
 	//See Linux man(3) getopt for more info
 	int option = 0;
-	const char* options = "f:hnqt:v";
+	const char* options = "c:f:hnqr:s:t:v";
 	while((option = getopt(argc, argv, options)) != -1){
 
     	switch(option)
 		{
+        	case 'c':
+				generatec = atoi(optarg);
+        		break;
         	case 'f':
 				//decriment the option index since it get's auto-incremented twice by getopt to
 				//pass over the expected single parameter. We need to support multiple params.
@@ -232,10 +284,13 @@ int main(int argc, char* argv[])
 				printf("Usage: fake [OPTION]...\n");
 				printf("Runs a fake vrpn server that simulates a real tracking system.\n");
 				printf("If no data files are specified, data will be generated.\n");
+				printf("\t-c COUNT\tCount: generate data for COUNT trackers named Tracker0, Tracker1, ...\n");
 				printf("\t-f [FILE]...\tFiles: use the specified data files (one or more).\n");
 				printf("\t-h\t\tHelp: print this message.\n");
 				printf("\t-n\t\tNoise: adds noise to each data point.\n");
 				printf("\t-q\t\tQuiet: turn off most of the debugging.\n");
+				printf("\t-r RATE\t\tRate: records sent per second for each tracker (default 100).\n");
+				printf("\t-s [SPEED]...\tSpeed: playback speed of each file (default 1), the last speed is\n\t\t\t\t used for the remaining files.\n");
 				printf("\t-t [NAME]...\tTracker: use the specified names for tracked objects.\n\t\t\t\t NOTE: does nothing if any files are specified.\n");
 				printf("\t-v\t\tVerbose: turn on extra debugging.\n");
 				exit(0);
@@ -247,6 +302,19 @@ int main(int argc, char* argv[])
 				quiet = true;
 				verbose = false;
         		break;
+        	case 'r':
+				rate = atof(optarg);
+				if(rate <= 0)
+				{
+					fprintf(stderr, "The rate must be greater than 0.\n");
+					exit(1);
+				}
+        		break;
+        	case 's':
+				//Same as -f, there may be several speeds.
+       			for(optind--; optind < argc && argv[optind][0] != '-' && strlen(argv[optind]); optind++)
+					speeds.push_back(atof(argv[optind]));
+        		break;
         	case 't':
         		//decriment the option index since it get's auto-incremented twice by getopt to
 				//pass over the expected single parameter. We need to support multiple params.
@@ -276,6 +344,16 @@ int main(int argc, char* argv[])
     	}
 	}
 	
+	//Add the generated tracker names.
+	for(int i = 0; i < generatec; i++)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "Tracker%d", i);
+		objNamesc++;
+		objNamesv = (char**)realloc(objNamesv, objNamesc * sizeof(char**));
+		objNamesv[objNamesc-1] = strdup(name);
+	}
+	
 	//if the user didn't specify a tracker or a file, use the default traker name.
 	if(filesc == 0 && objNamesc == 0)
 	{
@@ -283,6 +361,8 @@ int main(int argc, char* argv[])
 		objNamesv[0] = (char*)("Tracker0");
 		objNamesc = 1;
 	}
+	if(speeds.empty())
+		speeds.push_back(1);
 	
 	if(verbose)
 	{
@@ -290,6 +370,7 @@ int main(int argc, char* argv[])
 		printf("  Verbose: %s\n", verbose ? "true" : "false");
 		printf("  Quiet: %s\n", quiet ? "true" : "false");
 		printf("  Noise: %s\n", noise ? "true" : "false");
+		printf("  Rate: %.1f\n", rate);
 		printf("  Number of trackers: %d\n", objNamesc);
 		if(objNamesc > 0)printf("  Trackers:\n");
 		for(int i = 0; i < objNamesc; i++)
@@ -300,7 +381,7 @@ int main(int argc, char* argv[])
 		if(filesc > 0)printf("  Files:\n");
 		for(int i = 0; i < filesc; i++)
 		{
-			printf("    %s\n", filesv[i]);
+			printf("    %s (speed %.2f)\n", filesv[i], speeds[i < (int)speeds.size() ? i : speeds.size()-1]);
 		}
 		printf("-------------------\n");
 	}
@@ -312,48 +393,64 @@ int main(int argc, char* argv[])
 	//Set the tracker type to file if files were specified, otherwise set it to data type.
 	bool trackerst = filesc > 0 ? FILE_TRACKER : DATA_TRACKER;
 	
-	//Set the tracker count to the number of either files or data trackers depending on the type.
-	int trackersc = trackerst ? filesc : objNamesc;
-	
-	//Make an array of tracker objects that is the size of the number of trackers we need.
-	myTracker* trackersv[128];
-	if(trackersc > 128)
+	//Data trackers get one tracker per name, each file gets one tracker per object in it.
+	std::vector<myTracker*> trackersv;
+	bool flags[4] = {verbose, quiet, noise, trackerst};
+	if(trackerst == DATA_TRACKER)
 	{
-		fprintf(stderr, "Too many tracker objects specified.\n");
-		exit(EXIT_FAILURE);
+		for(int i = 0; i < objNamesc; i++)
+			trackersv.push_back(new myTracker(objNamesv[i], flags, m_Connection, NULL, 0, speeds.back()));
 	}
-	
-	bool flags[4] = {verbose, quiet, noise, trackerst};
-	for(int i = 0; i < trackersc; i++)
+	else
 	{
-		if(trackerst == DATA_TRACKER)
-		{
-			trackersv[i] = new myTracker(objNamesv[i], flags, m_Connection);
-		}
-		else
+		for(int i = 0; i < filesc; i++)
 		{
-			int fd = open(filesv[i], O_RDONLY);
-			if(fd == -1)
+			tdl_reader* file = tdl_reader_open(filesv[i]);
+			if(file == NULL)
+			{
+				fprintf(stderr, "Failed to open file \"%s\"\n", filesv[i]);
+				exit(1);
+			}
+			double speed = speeds[i < (int)speeds.size() ? i : speeds.size()-1];
+			for(int j = 0; j < file->objectCount; j++)
 			{
-				fprintf(stderr, "Failed to open file \"%s\": %s\n", filesv[i], strerror(errno));
-    			exit(1);
-    		}
-    		
-    		char* name;
-			tdl_prepare(fd, &name);	
-			
-			if(verbose)printf("Creating tracker for %s from file %s\n", name, filesv[i]);
-			trackersv[i] = new myTracker(name, flags, m_Connection, fd);
-			
+				if(verbose)printf("Creating tracker for %s from file %s\n", file->names[j], filesv[i]);
+				trackersv.push_back(new myTracker(file->names[j], flags, m_Connection, file, j, speed));
+			}
 		}
 	}
+	int trackersc = trackersv.size();
 
 	printf("Starting VRPN server.\n");
+	signal(SIGINT, stop);
 	
-	while(true)
+	//Records are sent on a fixed schedule. Sending starts at the
+	//scheduled time instead of a fixed delay after the previous send,
+	//so time spent sending doesn't make the rate drift.
+	kuhl_pacer pacer;
+	kuhl_pacer_init(&pacer, rate);
+	double period = pacer.period;
+	const jitter_stats empty = { 0, 0, 0, 0, 0 };
+	jitter_stats total = empty;
+	jitter_stats recent = empty;
+	double start = kuhl_monotonic();
+	double nextReport = start + (quiet ? 10 : 1);
+	while(!done)
 	{
+		//If we fell more than a period behind, the pacer skips the sends
+		//we missed instead of sending them all at once.
+		int missed = kuhl_pacer_wait(&pacer);
+		double now = kuhl_monotonic();
+		double late = pacer.frames > 1 ? now - (pacer.next - period) : 0;
+		jitter_add(&total, late);
+		jitter_add(&recent, late);
+		total.missed += missed;
+		recent.missed += missed;
+
+		if(!quiet)jitter_print("", &recent, period);
 		for(int i = 0; i < trackersc; i++)
 		{
+			trackersv[i]->setTime(now - start);
 			trackersv[i]->mainloop();
 		}
 		for(int i = 0; i < trackersc; i++)
@@ -361,10 +458,22 @@ int main(int argc, char* argv[])
 			//Clear out the last couple of lines so that the log isn't spammed
 			if(!quiet)printf(LINE_UP LINE_UP LINE_UP LINE_UP LINE_UP LINE_UP LINE_UP LINE_UP);
 		}
+		if(!quiet)printf(LINE_UP);
 
 		m_Connection->mainloop();
-		kuhl_limitfps(100);
+
+		if(now >= nextReport)
+		{
+			if(quiet)jitter_print("", &recent, period);
+			recent = empty;
+			nextReport = now + (quiet ? 10 : 1);
+		}
 	}
+
+	//Move below the status lines before printing the summary.
+	for(int i = 0; !quiet && i < trackersc*8+1; i++)
+		printf("\n");
+	jitter_print("Total: ", &total, period);
 	if(filesv != NULL)free(filesv);
 	if(objNamesv != NULL)free(objNamesv);
 }
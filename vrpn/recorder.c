@@ -8,50 +8,70 @@
  */
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
 
 #include "vrpn-help.h"
 #include "kuhl-util.h"
 #include "vecmat.h"
 #include "tdl-util.h"
 
+static volatile sig_atomic_t done = 0;
+
+/* Stop recording on Ctrl+C so that the index gets written. */
+static void stop(int sig)
+{
+	done = 1;
+}
+
 int main(int argc, char* argv[])
 {
 	//Check if we got the proper arguments.
 	if(argc < 3)
 	{
-		printf("Usage\n\trecorder <file name> <object name>\n");
+		printf("Usage\n\trecorder <file name> <object name>...\n");
 		printf("\n");
 		printf("This program reads data from a VRPN server and saves it to a file that can be played back later.\n");
+		printf("Press Ctrl+C to stop recording.\n");
 		exit(1);
 	}
 
-	//Create a new TDL file.
-	int fd = tdl_create(argv[1], argv[2]);
-	if(fd == -1)
+	//Create a new TDL file with every object in it.
+	const char** names = (const char**) (argv + 2);
+	int count = argc - 2;
+	tdl_writer* writer = tdl_writer_open(argv[1], names, count);
+	if(writer == NULL)
 	{
 		printf("Failed to create file: %s\n", argv[1]);
 		exit(EXIT_FAILURE);
 	}
+	signal(SIGINT, stop);
 	
 	//Buffers for the data.
 	float pos[3];
+	float orient[16];
 	float rotMat[9];
 	
 	//Loop until Ctrl+C.
-	while(1)
+	kuhl_pacer pacer;
+	kuhl_pacer_init(&pacer, 100);
+	while(!done)
 	{
-		//Get the next vrpn entry
-		vrpn_get(argv[2], NULL, pos, rotMat);
-		
-		//Write that entry to the file
-		tdl_write(fd, pos, rotMat);
-		
-		//IMPORTANT! Since there are no time stamps, this MUST be the same value as the fake
-		//server that is going to be reading the file, otherwise artificial speed ups or delays
-		//may occur in the final reading and output of the file.
-		kuhl_limitfps(100);
+		for(int i=0; i<count; i++)
+		{
+			//Get the next vrpn entry
+			vrpn_get(names[i], NULL, pos, orient);
+			mat3f_from_mat4f(rotMat, orient);
+
+			//Write that entry to the file. Each record is time stamped,
+			//so the rate here only changes how smooth playback is.
+			tdl_writer_add(writer, i, -1, pos, rotMat);
+		}
+		kuhl_pacer_wait(&pacer);
 	}
-	
-	//Close up the fd (Useless code until code to stop loop is added)
-	close(fd);
+	if(pacer.missed > 0)
+		printf("Missed %ld of %ld samples.\n", pacer.missed, pacer.missed + pacer.frames);
+
+	if(!tdl_writer_close(writer))
+		exit(EXIT_FAILURE);
+	return 0;
 }